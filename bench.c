@@ -0,0 +1,798 @@
+/*******************************************************************************
+ * BENCHMARKS DO SISTEMA DE TRANSFERÊNCIA DE ARQUIVOS
+ *
+ * Descrição: Mede isoladamente os caminhos críticos do servidor para comparar
+ *            alternativas de implementação na mesma máquina.
+ *
+ * Subcomandos:
+ * - download: vazão (GB/s) e CPU por GB dos modos de envio de downloads
+ *             (sendfile, mmap e buffer) por um socket TCP de loopback
+ * - compress: razão e velocidade de cada codec dos quadros DATA e a vazão
+ *             efetiva resultante em links de 100 Mbit/s, 1 Gbit/s e 10 Gbit/s
+ * - checksum: vazão (GB/s) do CRC32C (instrução da CPU e tabela), do XXH64
+ *             e do SHA-256, e a fração de um núcleo que cada um ocupa a
+ *             10 Gbit/s
+ * - buffers:  custo de obter e devolver um buffer de transferência com
+ *             malloc(), com alocação alinhada e com o pool de buffers
+ * - metrics:  custo de registrar um evento nas métricas (contador e
+ *             histograma) com várias threads ao mesmo tempo
+ *
+ * Compilação: gcc -O2 bench.c -o bench -pthread
+ *             (com zstd: -DBIGFS_WITH_ZSTD ... -lzstd)
+ ******************************************************************************/
+
+/*--------------------------------------------------------------
+ * INCLUSÕES DE BIBLIOTECAS
+ *------------------------------------------------------------*/
+#include <stdio.h>      // Para funções de entrada/saída padrão
+#include <stdlib.h>     // Para alocação de memória e outras utilidades
+#include <string.h>     // Para manipulação de strings
+#include "platform.h"   // Sockets, threads e relógios portáveis
+#include "transfer.h"   // Modos de envio de arquivos
+#include "compress.h"   // Codecs dos quadros DATA
+#include "digest.h"     // CRC32C, XXH64 e SHA-256
+#include "bufpool.h"    // Pool de buffers de transferência
+#include "metrics.h"    // Contadores e histogramas por thread
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define BENCH_FILE "bench_download.tmp" // Arquivo de teste padrão
+#define BENCH_SIZE_MB 1024              // Tamanho padrão do arquivo de teste
+#define BENCH_ROUNDS 3                  // Repetições por modo (usa a melhor)
+#define RECV_BUFFER_SIZE (1024 * 1024)  // Buffer do leitor
+#define COMPRESS_SIZE_MB 64             // Tamanho padrão da amostra do benchmark de compressão
+#define CHECKSUM_SIZE_MB 256            // Dados percorridos por repetição no benchmark de resumos
+#define CHECKSUM_BUFFER (1024 * 1024)   // Buffer percorrido várias vezes (cabe no cache L2/L3)
+#define BUFFERS_OPS 20000               // Pedidos por thread no benchmark de buffers
+#define METRICS_OPS 10000000            // Eventos por thread no benchmark de métricas
+
+/**
+ * Parâmetros da thread que consome os bytes do outro lado do socket
+ */
+typedef struct {
+    SOCKET sock;
+    uint64_t expected;
+    uint64_t received;
+} reader_t;
+
+/*--------------------------------------------------------------
+ * DECLARAÇÕES DE FUNÇÕES
+ *------------------------------------------------------------*/
+
+/**
+ * Cria um par de sockets TCP conectados pelo loopback
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - sendfile() para sockets TCP é o caso real do servidor; um socketpair
+ *   local não exercitaria a mesma pilha de rede
+ */
+int loopback_pair(SOCKET *sender, SOCKET *receiver) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;  // Porta escolhida pelo sistema
+
+    if (listener == INVALID_SOCKET ||
+        bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(listener, 1) == SOCKET_ERROR ||
+        getsockname(listener, (struct sockaddr *)&addr, &len) == SOCKET_ERROR) {
+        return -1;
+    }
+
+    *sender = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(*sender, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR) return -1;
+    *receiver = accept(listener, NULL, NULL);
+    closesocket(listener);
+    return *receiver == INVALID_SOCKET ? -1 : 0;
+}
+
+/**
+ * Thread leitora: consome e descarta os bytes enviados
+ */
+void *reader_main(void *arg) {
+    reader_t *r = (reader_t *)arg;
+    char *buffer = (char *)malloc(RECV_BUFFER_SIZE);
+
+    while (buffer && r->received < r->expected) {
+        int got = recv(r->sock, buffer, RECV_BUFFER_SIZE, 0);
+        if (got <= 0) break;
+        r->received += (uint64_t)got;
+    }
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Cria o arquivo de teste com conteúdo pseudoaleatório
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+int create_test_file(const char *path, uint64_t size) {
+    FILE *file = fopen(path, "wb");
+    uint64_t *block = (uint64_t *)malloc(RECV_BUFFER_SIZE);
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+
+    if (file == NULL || block == NULL) {
+        if (file) fclose(file);
+        free(block);
+        return -1;
+    }
+
+    for (uint64_t written = 0; written < size; written += RECV_BUFFER_SIZE) {
+        for (size_t i = 0; i < RECV_BUFFER_SIZE / sizeof(uint64_t); i++) {
+            // xorshift64: barato e sem padrões triviais
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            block[i] = state;
+        }
+        size_t chunk = size - written < RECV_BUFFER_SIZE ? (size_t)(size - written) : RECV_BUFFER_SIZE;
+        fwrite(block, 1, chunk, file);
+    }
+
+    free(block);
+    fclose(file);
+    return 0;
+}
+
+/**
+ * Lê o arquivo inteiro uma vez para colocá-lo no page cache
+ *
+ * Por que foi feito:
+ * - Todos os modos são medidos a partir da memória; caso contrário o
+ *   primeiro modo pagaria sozinho a leitura do disco
+ */
+void warm_cache(const char *path) {
+    int fd = file_open_read(path);
+    char *buffer = (char *)malloc(RECV_BUFFER_SIZE);
+    uint64_t offset = 0;
+    int64_t got;
+
+    while (fd >= 0 && buffer && (got = file_pread(fd, buffer, RECV_BUFFER_SIZE, offset)) > 0) {
+        offset += (uint64_t)got;
+    }
+    free(buffer);
+    if (fd >= 0) file_close(fd);
+}
+
+/**
+ * Envia o arquivo inteiro em um modo e mede vazão e CPU do remetente
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+int measure_download(const char *path, uint64_t size, send_mode_t mode,
+                     double *gb_per_s, double *cpu_s_per_gb) {
+    SOCKET sender, receiver;
+    reader_t reader;
+    thread_t thread;
+    file_sender_t fs;
+    uint64_t sent_total = 0;
+
+    int fd = file_open_read(path);
+    if (fd < 0 || loopback_pair(&sender, &receiver) != 0) return -1;
+
+    reader.sock = receiver;
+    reader.expected = size;
+    reader.received = 0;
+    thread_create(&thread, reader_main, &reader);
+
+    uint64_t wall_start = monotonic_ns();
+    uint64_t cpu_start = thread_cpu_ns();
+
+    sender_open(&fs, fd, mode, 0);
+    while (sent_total < size) {
+        int64_t sent = sender_send(&fs, sender, size - sent_total);
+        if (sent < 0) break;
+        sent_total += (uint64_t)sent;
+    }
+
+    uint64_t cpu_end = thread_cpu_ns();
+    thread_join(thread);
+    uint64_t wall_end = monotonic_ns();
+
+    sender_close(&fs);
+    closesocket(sender);
+    closesocket(receiver);
+    if (reader.received != size) return -1;
+
+    double gb = (double)size / 1e9;
+    *gb_per_s = gb / ((double)(wall_end - wall_start) / 1e9);
+    *cpu_s_per_gb = ((double)(cpu_end - cpu_start) / 1e9) / gb;
+    return 0;
+}
+
+/**
+ * Subcomando "download": compara os modos de envio de arquivos
+ */
+int bench_download(int argc, char *argv[]) {
+    const char *path = BENCH_FILE;
+    uint64_t size_mb = BENCH_SIZE_MB;
+    int rounds = BENCH_ROUNDS;
+    int keep = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) size_mb = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) rounds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) { path = argv[++i]; keep = 1; }
+        else {
+            printf("Uso: bench download [-s MB] [-r repetições] [-f arquivo]\n");
+            return 1;
+        }
+    }
+
+    uint64_t size = size_mb * 1024 * 1024;
+    if (!keep && create_test_file(path, size) != 0) {
+        printf("Erro ao criar arquivo de teste: %s\n", path);
+        return 1;
+    }
+    if (keep) size = (uint64_t)file_size(path);
+    warm_cache(path);
+
+    printf("Arquivo: %s (%llu MB), %d repetições por modo\n\n", path,
+           (unsigned long long)(size / (1024 * 1024)), rounds);
+    printf("%-10s %12s %14s\n", "modo", "GB/s", "CPU s/GB");
+
+    send_mode_t modes[] = { SEND_MODE_SENDFILE, SEND_MODE_MMAP, SEND_MODE_BUFFERED };
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        double best_rate = 0, best_cpu = 0;
+        for (int r = 0; r < rounds; r++) {
+            double rate, cpu;
+            if (measure_download(path, size, modes[m], &rate, &cpu) != 0) {
+                best_rate = -1;
+                break;
+            }
+            if (rate > best_rate) {
+                best_rate = rate;
+                best_cpu = cpu;
+            }
+        }
+        if (best_rate < 0) printf("%-10s %12s %14s\n", send_mode_name(modes[m]), "erro", "-");
+        else printf("%-10s %12.2f %14.3f\n", send_mode_name(modes[m]), best_rate, best_cpu);
+    }
+
+    if (!keep) remove(path);
+    return 0;
+}
+
+/**
+ * Gera texto no formato de um log de aplicação
+ *
+ * Por que foi feito:
+ * - Logs, CSVs e dumps de texto são o caso em que a compressão compensa;
+ *   campos repetidos com números variáveis comprimem como os reais
+ */
+void fill_log_text(uint8_t *data, size_t size) {
+    static const char *levels[] = { "INFO", "INFO", "INFO", "WARN", "DEBUG", "ERROR" };
+    static const char *paths[] = { "/api/v1/items", "/api/v1/users", "/static/app.js", "/health", "/api/v1/orders" };
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    size_t pos = 0;
+    char line[256];
+
+    for (uint64_t n = 0; pos < size; n++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        int len = snprintf(line, sizeof(line),
+                           "2026-01-%02u %02u:%02u:%02u.%03u %-5s worker-%u GET %s/%u status=%u bytes=%u ms=%u\n",
+                           (unsigned)(1 + n / 86400000 % 28), (unsigned)(n / 3600000 % 24), (unsigned)(n / 60000 % 60),
+                           (unsigned)(n / 1000 % 60), (unsigned)(n % 1000), levels[state % 6],
+                           (unsigned)(state >> 8 & 15), paths[(state >> 12) % 5], (unsigned)(state >> 16 & 0xffff),
+                           (state >> 32) % 20 ? 200u : 404u, (unsigned)(state >> 40 & 0xfffff),
+                           (unsigned)(state >> 24 & 1023));
+        size_t take = size - pos < (size_t)len ? size - pos : (size_t)len;
+        memcpy(data + pos, line, take);
+        pos += take;
+    }
+}
+
+/**
+ * Comprime e descomprime a amostra inteira em quadros, como nas transferências
+ *
+ * @param wire Recebe os bytes que iriam pela rede (quadros que não
+ *             diminuem vão crus)
+ * @return 0 em caso de sucesso, -1 se algum quadro não voltou igual
+ */
+int measure_codec(int codec, const uint8_t *data, size_t size, uint8_t *packed, uint8_t *plain,
+                  uint64_t *wire, double *compress_s, double *decompress_s) {
+    size_t *lengths = (size_t *)malloc((size / FRAME_DATA_CHUNK + 1) * sizeof(size_t));
+    size_t frames = 0, out = 0;
+
+    if (lengths == NULL) return -1;
+
+    // Cada quadro comprimido vai para a sua posição em packed
+    uint64_t start = monotonic_ns();
+    for (size_t pos = 0; pos < size; pos += FRAME_DATA_CHUNK, frames++) {
+        size_t len = size - pos < FRAME_DATA_CHUNK ? size - pos : FRAME_DATA_CHUNK;
+        lengths[frames] = len > 4 ? codec_compress(codec, data + pos, len, packed + out, len - 4) : 0;
+        out += lengths[frames] ? lengths[frames] : len;
+    }
+    *compress_s = (double)(monotonic_ns() - start) / 1e9;
+    *wire = out;
+
+    int failed = 0;
+    out = 0;
+    start = monotonic_ns();
+    for (size_t f = 0, pos = 0; f < frames; f++, pos += FRAME_DATA_CHUNK) {
+        size_t len = size - pos < FRAME_DATA_CHUNK ? size - pos : FRAME_DATA_CHUNK;
+        if (lengths[f] == 0) {
+            out += len;
+            continue;
+        }
+        if (codec_decompress(codec, packed + out, lengths[f], plain + pos, len) != 0) failed = 1;
+        out += lengths[f];
+    }
+    *decompress_s = (double)(monotonic_ns() - start) / 1e9;
+
+    // Quadros crus não passaram pelo codec: o conteúdo é o original
+    for (size_t f = 0, pos = 0; f < frames && !failed; f++, pos += FRAME_DATA_CHUNK) {
+        size_t len = size - pos < FRAME_DATA_CHUNK ? size - pos : FRAME_DATA_CHUNK;
+        if (lengths[f] != 0 && memcmp(plain + pos, data + pos, len) != 0) failed = 1;
+    }
+    free(lengths);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Subcomando "compress": compara os codecs e estima a vazão efetiva
+ *
+ * Por que foi feito:
+ * - Compressão só compensa quando o link é mais lento que o codec; a
+ *   vazão efetiva é limitada pelo mais lento entre comprimir,
+ *   descomprimir e enviar os bytes comprimidos (os três trabalham em
+ *   paralelo, um quadro por vez)
+ */
+int bench_compress(int argc, char *argv[]) {
+    static const double links_mbit[] = { 100, 1000, 10000 };
+    const char *path = NULL;
+    uint64_t size_mb = COMPRESS_SIZE_MB;
+    int rounds = BENCH_ROUNDS;
+    int random_data = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) size_mb = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) rounds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) path = argv[++i];
+        else if (strcmp(argv[i], "-a") == 0) random_data = 1;
+        else {
+            printf("Uso: bench compress [-s MB] [-r repetições] [-f arquivo | -a (dados aleatórios)]\n");
+            return 1;
+        }
+    }
+
+    size_t size = (size_t)(size_mb * 1024 * 1024);
+    if (path != NULL) {
+        int64_t file_bytes = file_size(path);
+        if (file_bytes < 0) {
+            printf("Arquivo não encontrado: %s\n", path);
+            return 1;
+        }
+        if ((uint64_t)file_bytes < size) size = (size_t)file_bytes;
+    }
+
+    uint8_t *data = (uint8_t *)malloc(size ? size : 1);
+    uint8_t *packed = (uint8_t *)malloc(size ? size : 1);
+    uint8_t *plain = (uint8_t *)malloc(size ? size : 1);
+    if (data == NULL || packed == NULL || plain == NULL) {
+        free(data);
+        free(packed);
+        free(plain);
+        printf("Memória insuficiente.\n");
+        return 1;
+    }
+
+    if (path != NULL) {
+        int fd = file_open_read(path);
+        if (fd < 0 || file_pread(fd, data, size, 0) != (int64_t)size) size = 0;
+        if (fd >= 0) file_close(fd);
+    } else if (random_data) {
+        uint64_t state = 0x9e3779b97f4a7c15ull;
+        for (size_t i = 0; i < size; i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            data[i] = (uint8_t)(state >> 24);
+        }
+    } else {
+        fill_log_text(data, size);
+    }
+
+    size_t sample = size < COMPRESS_SAMPLE ? size : COMPRESS_SAMPLE;
+    printf("Amostra: %s (%.1f MB), quadros de %d KB, %d repetições por codec\n",
+           path ? path : random_data ? "dados aleatórios" : "log de texto gerado",
+           (double)size / (1024 * 1024), FRAME_DATA_CHUNK / 1024, rounds);
+    printf("Detecção de conteúdo já comprimido: %s\n\n",
+           compress_looks_compressed(data, sample, packed) ? "sim (transferências vão sem compressão)" : "não");
+    printf("%-6s %7s %12s %12s", "codec", "razão", "comp MB/s", "desc MB/s");
+    for (size_t l = 0; l < sizeof(links_mbit) / sizeof(links_mbit[0]); l++) {
+        char label[32];
+        snprintf(label, sizeof(label), "%g Mbit/s", links_mbit[l]);
+        printf(" %13s", label);
+    }
+    printf("\n");
+
+    for (int codec = CODEC_NONE; codec <= CODEC_ZSTD; codec++) {
+        if (!(codec_supported_mask() & (1 << codec))) continue;
+
+        double best_comp = 0, best_decomp = 0;
+        uint64_t wire = size;
+        int failed = 0;
+        for (int r = 0; r < rounds && codec != CODEC_NONE; r++) {
+            double comp_s, decomp_s;
+            if (measure_codec(codec, data, size, packed, plain, &wire, &comp_s, &decomp_s) != 0) {
+                failed = 1;
+                break;
+            }
+            if (best_comp == 0 || comp_s < best_comp) best_comp = comp_s;
+            if (best_decomp == 0 || decomp_s < best_decomp) best_decomp = decomp_s;
+        }
+        if (failed) {
+            printf("%-6s %7s\n", codec_name(codec), "erro");
+            continue;
+        }
+
+        double mb = (double)size / 1e6;
+        double fraction = size > 0 ? (double)wire / (double)size : 1;
+        double comp_rate = best_comp > 0 ? mb / best_comp : 0;
+        double decomp_rate = best_decomp > 0 && wire < size ? mb / best_decomp : 0;
+        if (codec == CODEC_NONE) printf("%-6s %7.3f %12s %12s", codec_name(codec), 1.0, "-", "-");
+        else if (decomp_rate == 0) printf("%-6s %7.3f %12.0f %12s", codec_name(codec), fraction, comp_rate, "-");
+        else printf("%-6s %7.3f %12.0f %12.0f", codec_name(codec), fraction, comp_rate, decomp_rate);
+
+        // Vazão efetiva em MB/s de dados originais
+        for (size_t l = 0; l < sizeof(links_mbit) / sizeof(links_mbit[0]); l++) {
+            double effective = links_mbit[l] / 8 / (fraction > 0 ? fraction : 1);
+            if (comp_rate > 0 && comp_rate < effective) effective = comp_rate;
+            if (decomp_rate > 0 && decomp_rate < effective) effective = decomp_rate;
+            printf(" %8.0f MB/s", effective);
+        }
+        printf("\n");
+    }
+
+    free(data);
+    free(packed);
+    free(plain);
+    return 0;
+}
+
+/**
+ * Calcula um resumo sobre o buffer, em pedaços do tamanho de um quadro
+ *
+ * @param kind 0 = CRC32C, 1 = CRC32C por tabela, 2 = XXH64, 3 = SHA-256,
+ *             4 = CRC32C + XXH64 (o que as transferências calculam)
+ * @return Valor do resumo (impede que o compilador descarte o cálculo)
+ */
+uint64_t checksum_pass(int kind, const uint8_t *data, size_t size, uint64_t total) {
+    uint64_t result = 0;
+    uint32_t crc = 0;
+    xxh64_t xxh;
+    sha256_t sha;
+    checksum_t sum;
+    uint8_t digest[SHA256_SIZE];
+
+    xxh64_init(&xxh);
+    sha256_init(&sha);
+    checksum_init(&sum);
+    for (uint64_t done = 0; done < total; done += size) {
+        for (size_t pos = 0; pos < size; pos += FRAME_DATA_CHUNK) {
+            size_t len = size - pos < FRAME_DATA_CHUNK ? size - pos : FRAME_DATA_CHUNK;
+            if (kind == 0) crc = crc32c(crc, data + pos, len);
+            else if (kind == 1) crc = ~crc32c_soft(~crc, data + pos, len);
+            else if (kind == 2) xxh64_update(&xxh, data + pos, len);
+            else if (kind == 3) sha256_update(&sha, data + pos, len);
+            else checksum_update(&sum, data + pos, len);
+        }
+    }
+    if (kind <= 1) result = crc;
+    else if (kind == 2) result = xxh64_final(&xxh);
+    else if (kind == 3) {
+        sha256_final(&sha, digest);
+        memcpy(&result, digest, sizeof(result));
+    } else {
+        result = xxh64_final(&sum.xxh) ^ sum.crc;
+    }
+    return result;
+}
+
+/**
+ * Subcomando "checksum": vazão de cada resumo
+ *
+ * Por que foi feito:
+ * - Uploads e downloads calculam CRC32C e XXH64 sobre todos os bytes; a
+ *   10 Gbit/s (1,25 GB/s) o cálculo precisa ocupar uma fração pequena de
+ *   um núcleo para não limitar a transferência
+ */
+int bench_checksum(int argc, char *argv[]) {
+    static const char *names[] = { "crc32c", "crc32c-tabela", "xxh64", "sha256", "crc32c+xxh64" };
+    uint64_t total_mb = CHECKSUM_SIZE_MB;
+    int rounds = BENCH_ROUNDS;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) total_mb = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) rounds = atoi(argv[++i]);
+        else {
+            printf("Uso: bench checksum [-s MB por repetição] [-r repetições]\n");
+            return 1;
+        }
+    }
+
+    uint8_t *data = (uint8_t *)malloc(CHECKSUM_BUFFER);
+    if (data == NULL) {
+        printf("Memória insuficiente.\n");
+        return 1;
+    }
+    fill_log_text(data, CHECKSUM_BUFFER);
+
+    uint64_t total = total_mb * 1024 * 1024;
+    printf("CRC32C pela CPU (SSE4.2): %s\n", crc32c_hardware() ? "sim" : "não (usa a tabela)");
+    printf("%llu MB por repetição em quadros de %d KB, %d repetições\n\n",
+           (unsigned long long)total_mb, FRAME_DATA_CHUNK / 1024, rounds);
+    printf("%-14s %10s %18s\n", "resumo", "GB/s", "núcleo a 10 Gbit/s");
+
+    for (int kind = 0; kind < (int)(sizeof(names) / sizeof(names[0])); kind++) {
+        double best = 0;
+        volatile uint64_t sink = 0;
+        // SHA-256 é dezenas de vezes mais lento: uma fração dos dados basta
+        uint64_t amount = kind == 3 || (kind == 1 && !crc32c_hardware()) ? total / 8 : total;
+        if (amount < CHECKSUM_BUFFER) amount = CHECKSUM_BUFFER;
+        for (int r = 0; r < rounds; r++) {
+            uint64_t start = monotonic_ns();
+            sink ^= checksum_pass(kind, data, CHECKSUM_BUFFER, amount);
+            double seconds = (double)(monotonic_ns() - start) / 1e9;
+            if (best == 0 || seconds < best) best = seconds;
+        }
+        (void)sink;
+        double rate = best > 0 ? (double)amount / best / 1e9 : 0;
+        printf("%-14s %10.2f %17.0f%%\n", names[kind], rate, rate > 0 ? 1.25 / rate * 100 : 0);
+    }
+
+    free(data);
+    return 0;
+}
+
+/**
+ * Parâmetros de uma thread do benchmark de buffers
+ */
+typedef struct {
+    int method;                 // 0 = malloc, 1 = alinhado, 2 = pool
+    size_t size;
+    long ops;
+    uint64_t elapsed_ns;
+} buffers_job_t;
+
+/**
+ * Pede, usa e devolve buffers em laço
+ *
+ * Por que foi feito:
+ * - Cada buffer tem uma página escrita por vez, como acontece ao receber
+ *   um quadro; buffers novos do sistema pagam as faltas de página, os do
+ *   pool já estão mapeados
+ */
+void *buffers_main(void *arg) {
+    buffers_job_t *job = (buffers_job_t *)arg;
+    uint64_t start = monotonic_ns();
+
+    for (long i = 0; i < job->ops; i++) {
+        uint8_t *p = job->method == 0 ? (uint8_t *)malloc(job->size) :
+                     job->method == 1 ? (uint8_t *)mem_aligned_alloc(job->size, BUFPOOL_ALIGNMENT) :
+                     (uint8_t *)bufpool_alloc(job->size, NULL);
+        if (p == NULL) break;
+        for (size_t off = 0; off < job->size; off += 4096) p[off] = (uint8_t)i;
+        if (job->method == 0) free(p);
+        else if (job->method == 1) mem_aligned_free(p);
+        else bufpool_free(p, job->size, NULL);
+    }
+    job->elapsed_ns = monotonic_ns() - start;
+    if (job->method == 2) bufpool_thread_release();
+    return NULL;
+}
+
+/**
+ * Subcomando "buffers": custo de obter um buffer de transferência
+ *
+ * Por que foi feito:
+ * - Cada transferência pede buffers de 64 KB a 4 MB; o malloc() atende
+ *   tamanhos assim com mmap()/munmap() a cada pedido, e o pool deve ficar
+ *   na casa das dezenas de nanossegundos com várias threads
+ */
+int bench_buffers(int argc, char *argv[]) {
+    static const char *names[] = { "malloc", "alinhado", "pool" };
+    static const size_t sizes[] = { 64 * 1024, FRAME_DATA_CHUNK, 1024 * 1024, 4 * 1024 * 1024 };
+    int threads = cpu_count();
+    long ops = BUFFERS_OPS;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) ops = atol(argv[++i]);
+        else {
+            printf("Uso: bench buffers [-t threads] [-n pedidos por thread]\n");
+            return 1;
+        }
+    }
+    if (threads <= 0 || ops <= 0) return 1;
+
+    buffers_job_t *jobs = (buffers_job_t *)calloc((size_t)threads, sizeof(buffers_job_t));
+    thread_t *handles = (thread_t *)calloc((size_t)threads, sizeof(thread_t));
+    if (jobs == NULL || handles == NULL) {
+        free(jobs);
+        free(handles);
+        printf("Memória insuficiente.\n");
+        return 1;
+    }
+
+    printf("%d threads, %ld pedidos por thread (uma escrita por página)\n\n", threads, ops);
+    printf("%-10s", "tamanho");
+    for (int m = 0; m < 3; m++) printf(" %12s", names[m]);
+    printf("   (ns por pedido)\n");
+
+    for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+        printf("%7zu KB", sizes[z] / 1024);
+        for (int m = 0; m < 3; m++) {
+            uint64_t total = 0;
+            for (int t = 0; t < threads; t++) {
+                jobs[t].method = m;
+                jobs[t].size = sizes[z];
+                jobs[t].ops = ops;
+                if (thread_create(&handles[t], buffers_main, &jobs[t]) != 0) {
+                    printf("\nErro ao criar thread.\n");
+                    return 1;
+                }
+            }
+            for (int t = 0; t < threads; t++) {
+                thread_join(handles[t]);
+                total += jobs[t].elapsed_ns;
+            }
+            printf(" %12.0f", (double)total / ((double)threads * (double)ops));
+        }
+        printf("\n");
+    }
+
+    bufpool_stats_t stats;
+    bufpool_stats(&stats);
+    printf("\nPool: %ld pedidos, %ld ao sistema, pico em uso %ld KB, obtido do sistema %ld KB, %ld recusados\n",
+           stats.allocations, stats.system_allocations, stats.high_water / 1024, stats.held / 1024, stats.failures);
+
+    free(jobs);
+    free(handles);
+    return 0;
+}
+
+/**
+ * Parâmetros de uma thread do benchmark de métricas
+ */
+typedef struct {
+    long ops;
+    uint64_t counter_ns, record_ns, clock_ns;
+    uint64_t sink;              // Impede o compilador de descartar as leituras do relógio
+} metrics_job_t;
+
+/**
+ * Registra eventos em laço na área da própria thread
+ */
+void *metrics_main(void *arg) {
+    metrics_job_t *job = (metrics_job_t *)arg;
+
+    metrics_add(0, 1);  // Cria a área fora da medição
+    uint64_t start = monotonic_ns();
+    for (long i = 0; i < job->ops; i++) metrics_add((int)(i & 7), (uint64_t)i);
+    job->counter_ns = monotonic_ns() - start;
+
+    start = monotonic_ns();
+    for (long i = 0; i < job->ops; i++) metrics_record((int)(i & 7), (uint64_t)(i * 2654435761u) >> 40);
+    job->record_ns = monotonic_ns() - start;
+
+    start = monotonic_ns();
+    for (long i = 0; i < job->ops; i++) job->sink += monotonic_ns();
+    job->clock_ns = monotonic_ns() - start;
+    return NULL;
+}
+
+/**
+ * Subcomando "metrics": custo de registrar um evento
+ *
+ * Por que foi feito:
+ * - As métricas ficam ligadas em produção; somar a um contador ou
+ *   registrar em um histograma deve custar poucos nanossegundos mesmo com
+ *   todas as threads registrando ao mesmo tempo (áreas por thread, sem
+ *   trava nem instrução atômica)
+ * - A leitura do relógio aparece à parte: é o que uma medição de duração
+ *   acrescenta ao registro
+ */
+int bench_metrics(int argc, char *argv[]) {
+    int threads = cpu_count();
+    long ops = METRICS_OPS;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) ops = atol(argv[++i]);
+        else {
+            printf("Uso: bench metrics [-t threads] [-n eventos por thread]\n");
+            return 1;
+        }
+    }
+    if (threads <= 0 || ops <= 0) return 1;
+
+    metrics_job_t *jobs = (metrics_job_t *)calloc((size_t)threads, sizeof(metrics_job_t));
+    thread_t *handles = (thread_t *)calloc((size_t)threads, sizeof(thread_t));
+    if (jobs == NULL || handles == NULL) {
+        free(jobs);
+        free(handles);
+        printf("Memória insuficiente.\n");
+        return 1;
+    }
+
+    metrics_init();
+    for (int t = 0; t < threads; t++) {
+        jobs[t].ops = ops;
+        if (thread_create(&handles[t], metrics_main, &jobs[t]) != 0) {
+            printf("Erro ao criar thread.\n");
+            return 1;
+        }
+    }
+    uint64_t counter = 0, record = 0, clock = 0;
+    for (int t = 0; t < threads; t++) {
+        thread_join(handles[t]);
+        counter += jobs[t].counter_ns;
+        record += jobs[t].record_ns;
+        clock += jobs[t].clock_ns;
+    }
+
+    metrics_shard_t *snap = (metrics_shard_t *)malloc(sizeof(metrics_shard_t));
+    uint64_t start = monotonic_ns();
+    if (snap != NULL) metrics_snapshot(snap);
+    uint64_t snapshot_ns = monotonic_ns() - start;
+
+    double per = (double)threads * (double)ops;
+    printf("%d threads, %ld eventos por thread\n\n", threads, ops);
+    printf("%-24s %10s\n", "operação", "ns/evento");
+    printf("%-24s %10.2f\n", "contador", (double)counter / per);
+    printf("%-24s %10.2f\n", "histograma", (double)record / per);
+    printf("%-24s %10.2f\n", "leitura do relógio", (double)clock / per);
+    printf("\nSoma das %d áreas para uma consulta: %.1f µs\n", threads, (double)snapshot_ns / 1e3);
+
+    free(snap);
+    free(jobs);
+    free(handles);
+    return 0;
+}
+
+/*******************************************************************************
+ * FUNÇÃO PRINCIPAL
+ ******************************************************************************/
+int main(int argc, char *argv[]) {
+    if (net_init() != 0) {
+        printf("Falha ao inicializar a rede.\n");
+        return 1;
+    }
+    bufpool_init(0);
+
+    int result;
+    if (argc >= 2 && strcmp(argv[1], "download") == 0) {
+        result = bench_download(argc - 2, argv + 2);
+    } else if (argc >= 2 && strcmp(argv[1], "compress") == 0) {
+        result = bench_compress(argc - 2, argv + 2);
+    } else if (argc >= 2 && strcmp(argv[1], "checksum") == 0) {
+        result = bench_checksum(argc - 2, argv + 2);
+    } else if (argc >= 2 && strcmp(argv[1], "buffers") == 0) {
+        result = bench_buffers(argc - 2, argv + 2);
+    } else if (argc >= 2 && strcmp(argv[1], "metrics") == 0) {
+        result = bench_metrics(argc - 2, argv + 2);
+    } else {
+        printf("Uso: %s <subcomando> [opções]\n", argv[0]);
+        printf("  download   Compara sendfile, mmap e buffer no envio de arquivos\n");
+        printf("  compress   Compara os codecs e a vazão efetiva em links de várias velocidades\n");
+        printf("  checksum   Mede a vazão dos resumos de integridade (CRC32C, XXH64, SHA-256)\n");
+        printf("  buffers    Compara malloc(), alocação alinhada e o pool de buffers\n");
+        printf("  metrics    Mede o custo de registrar eventos nas métricas\n");
+        result = 1;
+    }
+
+    net_cleanup();
+    return result;
+}
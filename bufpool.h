@@ -0,0 +1,333 @@
+/*******************************************************************************
+ * POOL DE BUFFERS DE TRANSFERÊNCIA
+ *
+ * Descrição: Entrega os buffers grandes por onde passam os bytes dos
+ *            arquivos (anéis de disco, quadros DATA, compressão, blocos)
+ *            a partir de listas de buffers já alocados, em vez de ir ao
+ *            malloc() a cada transferência.
+ *
+ * Organização:
+ * - Classes de tamanho em potências de 2, de 64 KB a 4 MB; um pedido recebe
+ *   o buffer da menor classe que o comporta
+ * - Todo buffer é alinhado à página (4 KB), o que também atende setores de
+ *   512 B e 4 KB: serve para O_DIRECT e para registro de buffers no kernel
+ * - Cache por thread: pedir e devolver na mesma thread não toca em lock
+ * - Listas globais por classe recebem o que não cabe no cache da thread;
+ *   acima de BUFPOOL_KEEP_BYTES o buffer volta ao sistema
+ *
+ * Limites e estatísticas:
+ * - Limite total opcional para a memória obtida do sistema (em uso + livre
+ *   nas listas); ao passar dele o pool devolve as listas globais ao
+ *   sistema antes de recusar o pedido
+ * - buf_account_t limita o que um dono (ex.: uma conexão) tem em uso
+ * - Em uso, pico, memória obtida do sistema e pedidos recusados ficam
+ *   disponíveis em bufpool_stats()
+ ******************************************************************************/
+#ifndef BIGFS_BUFPOOL_H
+#define BIGFS_BUFPOOL_H
+
+#include "platform.h"
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define BUFPOOL_MIN_SHIFT 16                        // Menor classe: 64 KB
+#define BUFPOOL_CLASSES 7                           // 64 KB, 128 KB, ..., 4 MB
+#define BUFPOOL_MAX_SIZE ((size_t)1 << (BUFPOOL_MIN_SHIFT + BUFPOOL_CLASSES - 1))
+#define BUFPOOL_ALIGNMENT 4096                      // Página (e setores de 512 B / 4 KB)
+#define BUFPOOL_THREAD_BYTES (8L * 1024 * 1024)     // Cache máximo de cada thread
+#define BUFPOOL_KEEP_BYTES (64L * 1024 * 1024)      // Livres guardados nas listas globais
+
+/*--------------------------------------------------------------
+ * ESTRUTURAS
+ *------------------------------------------------------------*/
+
+/**
+ * Buffer livre em uma lista (o encadeamento ocupa o início do próprio buffer)
+ */
+typedef struct bufpool_free {
+    struct bufpool_free *next;
+} bufpool_free_t;
+
+/**
+ * Memória em uso por um dono, com limite opcional
+ */
+typedef struct {
+    volatile long used;         // Bytes entregues a este dono
+    long limit;                 // 0: sem limite
+} buf_account_t;
+
+/**
+ * Números do pool para acompanhamento
+ */
+typedef struct {
+    long in_use;                // Bytes entregues e ainda não devolvidos
+    long high_water;            // Maior valor de in_use já visto
+    long held;                  // Bytes obtidos do sistema (em uso + livres)
+    long limit;                 // Limite de held (0: sem limite)
+    long allocations;           // Pedidos atendidos
+    long system_allocations;    // Pedidos que precisaram ir ao sistema
+    long failures;              // Pedidos recusados (limite ou falta de memória)
+} bufpool_stats_t;
+
+/**
+ * Estado global do pool
+ */
+typedef struct {
+    mutex_t lock;
+    bufpool_free_t *lists[BUFPOOL_CLASSES];
+    long list_bytes;            // Bytes livres nas listas globais
+
+    volatile long in_use;
+    volatile long high_water;
+    volatile long held;
+    volatile long allocations;
+    volatile long system_allocations;
+    volatile long failures;
+    long limit;
+} bufpool_t;
+
+/**
+ * Cache de buffers livres de uma thread
+ */
+typedef struct {
+    bufpool_free_t *lists[BUFPOOL_CLASSES];
+    long bytes;
+} bufpool_cache_t;
+
+static bufpool_t bufpool;
+static THREAD_LOCAL bufpool_cache_t bufpool_cache;
+
+/*--------------------------------------------------------------
+ * DECLARAÇÕES DE FUNÇÕES
+ *------------------------------------------------------------*/
+
+/**
+ * Prepara o pool (uma vez, antes de criar as threads)
+ *
+ * @param limit Máximo de bytes obtidos do sistema (0: sem limite)
+ */
+static inline void bufpool_init(long limit) {
+    memset(&bufpool, 0, sizeof(bufpool));
+    mutex_init(&bufpool.lock);
+    bufpool.limit = limit;
+}
+
+/**
+ * Classe de tamanho que comporta size bytes
+ *
+ * @return Índice da classe, ou -1 se size passa de BUFPOOL_MAX_SIZE
+ */
+static inline int bufpool_class(size_t size) {
+    int c = 0;
+    while (c < BUFPOOL_CLASSES && ((size_t)1 << (BUFPOOL_MIN_SHIFT + c)) < size) c++;
+    return c < BUFPOOL_CLASSES ? c : -1;
+}
+
+/**
+ * Tamanho real dos buffers de uma classe
+ */
+static inline size_t bufpool_class_size(int c) {
+    return (size_t)1 << (BUFPOOL_MIN_SHIFT + c);
+}
+
+/**
+ * Devolve ao sistema os buffers livres das listas globais
+ *
+ * @return Bytes devolvidos
+ *
+ * Por que foi feito:
+ * - Depois de um pico de transferências as listas guardam memória que
+ *   talvez não seja usada de novo; um servidor no limite troca o cache
+ *   pela chance de atender o pedido
+ */
+static inline long bufpool_trim(void) {
+    bufpool_free_t *lists[BUFPOOL_CLASSES];
+    long freed = 0;
+
+    mutex_lock(&bufpool.lock);
+    memcpy(lists, bufpool.lists, sizeof(lists));
+    memset(bufpool.lists, 0, sizeof(bufpool.lists));
+    bufpool.list_bytes = 0;
+    mutex_unlock(&bufpool.lock);
+
+    for (int c = 0; c < BUFPOOL_CLASSES; c++) {
+        while (lists[c] != NULL) {
+            bufpool_free_t *next = lists[c]->next;
+            mem_aligned_free(lists[c]);
+            freed += (long)bufpool_class_size(c);
+            lists[c] = next;
+        }
+    }
+    atomic_add_long(&bufpool.held, -freed);
+    return freed;
+}
+
+/**
+ * Obtém um buffer novo do sistema respeitando o limite total
+ */
+static inline void *bufpool_system_alloc(int c) {
+    long size = (long)bufpool_class_size(c);
+
+    if (bufpool.limit > 0 && atomic_add_long(&bufpool.held, size) + size > bufpool.limit) {
+        // Acima do limite: devolve as listas globais e tenta de novo
+        atomic_add_long(&bufpool.held, -size);
+        bufpool_trim();
+        if (atomic_add_long(&bufpool.held, size) + size > bufpool.limit) {
+            atomic_add_long(&bufpool.held, -size);
+            return NULL;
+        }
+    } else if (bufpool.limit <= 0) {
+        atomic_add_long(&bufpool.held, size);
+    }
+
+    void *p = mem_aligned_alloc((size_t)size, BUFPOOL_ALIGNMENT);
+    if (p == NULL) {
+        atomic_add_long(&bufpool.held, -size);
+        return NULL;
+    }
+    atomic_add_long(&bufpool.system_allocations, 1);
+    return p;
+}
+
+/**
+ * Pede um buffer alinhado com pelo menos size bytes
+ *
+ * @param size Bytes necessários (até BUFPOOL_MAX_SIZE)
+ * @param account Dono a cobrar (NULL: nenhum)
+ * @return Buffer alinhado a BUFPOOL_ALIGNMENT, ou NULL se o pedido passa
+ *         de um limite ou falta memória; devolver com bufpool_free()
+ */
+static inline void *bufpool_alloc(size_t size, buf_account_t *account) {
+    int c = bufpool_class(size);
+    void *p = NULL;
+
+    if (c < 0) {
+        atomic_add_long(&bufpool.failures, 1);
+        return NULL;
+    }
+    long bytes = (long)bufpool_class_size(c);
+    if (account != NULL && account->limit > 0 && atomic_add_long(&account->used, bytes) + bytes > account->limit) {
+        atomic_add_long(&account->used, -bytes);
+        atomic_add_long(&bufpool.failures, 1);
+        return NULL;
+    } else if (account != NULL && account->limit <= 0) {
+        atomic_add_long(&account->used, bytes);
+    }
+
+    if (bufpool_cache.lists[c] != NULL) {
+        // Cache da thread: sem lock
+        p = bufpool_cache.lists[c];
+        bufpool_cache.lists[c] = bufpool_cache.lists[c]->next;
+        bufpool_cache.bytes -= bytes;
+    } else {
+        mutex_lock(&bufpool.lock);
+        if (bufpool.lists[c] != NULL) {
+            p = bufpool.lists[c];
+            bufpool.lists[c] = bufpool.lists[c]->next;
+            bufpool.list_bytes -= bytes;
+        }
+        mutex_unlock(&bufpool.lock);
+        if (p == NULL) p = bufpool_system_alloc(c);
+    }
+
+    if (p == NULL) {
+        if (account != NULL) atomic_add_long(&account->used, -bytes);
+        atomic_add_long(&bufpool.failures, 1);
+        return NULL;
+    }
+    atomic_add_long(&bufpool.allocations, 1);
+    atomic_max_long(&bufpool.high_water, atomic_add_long(&bufpool.in_use, bytes) + bytes);
+    return p;
+}
+
+/**
+ * Devolve um buffer obtido com bufpool_alloc()
+ *
+ * @param p Buffer (NULL é ignorado)
+ * @param size O mesmo tamanho usado no pedido
+ * @param account O mesmo dono usado no pedido
+ *
+ * Por que foi feito:
+ * - Buffers de outra thread (ex.: alocados pela trabalhadora e devolvidos
+ *   pela thread de disco) entram no cache de quem devolve; o excesso vai
+ *   para as listas globais e, acima de BUFPOOL_KEEP_BYTES, para o sistema
+ */
+static inline void bufpool_free(void *p, size_t size, buf_account_t *account) {
+    if (p == NULL) return;
+
+    int c = bufpool_class(size);
+    long bytes = (long)bufpool_class_size(c);
+    bufpool_free_t *node = (bufpool_free_t *)p;
+
+    atomic_add_long(&bufpool.in_use, -bytes);
+    if (account != NULL) atomic_add_long(&account->used, -bytes);
+
+    if (bufpool_cache.bytes + bytes <= BUFPOOL_THREAD_BYTES) {
+        node->next = bufpool_cache.lists[c];
+        bufpool_cache.lists[c] = node;
+        bufpool_cache.bytes += bytes;
+        return;
+    }
+
+    mutex_lock(&bufpool.lock);
+    int keep = bufpool.list_bytes + bytes <= BUFPOOL_KEEP_BYTES;
+    if (keep) {
+        node->next = bufpool.lists[c];
+        bufpool.lists[c] = node;
+        bufpool.list_bytes += bytes;
+    }
+    mutex_unlock(&bufpool.lock);
+
+    if (!keep) {
+        mem_aligned_free(p);
+        atomic_add_long(&bufpool.held, -bytes);
+    }
+}
+
+/**
+ * Entrega o cache da thread atual às listas globais
+ *
+ * Por que foi feito:
+ * - Threads que terminam (ex.: conexões paralelas do cliente) levariam
+ *   seus buffers livres junto; chamada no fim de cada thread
+ */
+static inline void bufpool_thread_release(void) {
+    for (int c = 0; c < BUFPOOL_CLASSES; c++) {
+        long bytes = (long)bufpool_class_size(c);
+        while (bufpool_cache.lists[c] != NULL) {
+            bufpool_free_t *node = bufpool_cache.lists[c];
+            bufpool_cache.lists[c] = node->next;
+
+            mutex_lock(&bufpool.lock);
+            int keep = bufpool.list_bytes + bytes <= BUFPOOL_KEEP_BYTES;
+            if (keep) {
+                node->next = bufpool.lists[c];
+                bufpool.lists[c] = node;
+                bufpool.list_bytes += bytes;
+            }
+            mutex_unlock(&bufpool.lock);
+
+            if (!keep) {
+                mem_aligned_free(node);
+                atomic_add_long(&bufpool.held, -bytes);
+            }
+        }
+    }
+    bufpool_cache.bytes = 0;
+}
+
+/**
+ * Copia os números atuais do pool
+ */
+static inline void bufpool_stats(bufpool_stats_t *out) {
+    out->in_use = atomic_add_long(&bufpool.in_use, 0);
+    out->high_water = atomic_add_long(&bufpool.high_water, 0);
+    out->held = atomic_add_long(&bufpool.held, 0);
+    out->limit = bufpool.limit;
+    out->allocations = atomic_add_long(&bufpool.allocations, 0);
+    out->system_allocations = atomic_add_long(&bufpool.system_allocations, 0);
+    out->failures = atomic_add_long(&bufpool.failures, 0);
+}
+
+#endif /* BIGFS_BUFPOOL_H */
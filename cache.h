@@ -0,0 +1,607 @@
+/*******************************************************************************
+ * CACHE DE LEITURA DOS DOWNLOADS
+ *
+ * Descrição: Guarda em memória os arquivos pequenos mais pedidos e os
+ *            trechos quentes dos arquivos grandes, de modo que downloads
+ *            repetidos saem da RAM sem abrir o arquivo nem ocupar as
+ *            threads de disco.
+ *
+ * Organização:
+ * - O conteúdo é guardado em blocos de CACHE_BLOCK bytes alinhados à
+ *   posição no arquivo (o último bloco pode ser menor); um arquivo pequeno
+ *   ocupa poucos blocos e fica inteiro, um arquivo grande só tem os blocos
+ *   que foram lidos
+ * - Cada arquivo guarda a versão lida (inode, tamanho e data); um pedido
+ *   com outra versão descarta os blocos antigos
+ * - Tabelas hash encadeadas (arquivos por nome, blocos por arquivo e
+ *   posição) crescem conforme o número de itens
+ *
+ * Política de substituição (2Q):
+ * - Um bloco lido pela primeira vez entra na fila IN, limitada a
+ *   CACHE_IN_PERCENT do orçamento; uma varredura de um arquivo enorme
+ *   passa por ela sem tirar da memória os blocos quentes
+ * - Ao sair de IN o bloco vira um fantasma (só a chave, sem os bytes);
+ *   lido de novo enquanto fantasma, volta para a fila MAIN (LRU)
+ * - Blocos em uso por um envio (fixados) não são removidos; se nada pode
+ *   sair, o bloco novo simplesmente não entra
+ *
+ * Invalidação:
+ * - O servidor chama cache_invalidate() quando o índice registra um
+ *   upload, uma exclusão ou uma mudança feita por fora (inotify); a versão
+ *   conferida a cada pedido cobre o que escapar disso
+ ******************************************************************************/
+#ifndef BIGFS_CACHE_H
+#define BIGFS_CACHE_H
+
+#include "platform.h"
+#include "protocol.h"
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define CACHE_BLOCK FRAME_DATA_CHUNK            // Bytes por bloco (um quadro DATA)
+#define CACHE_SMALL_FILE (1024 * 1024)          // Arquivos até este tamanho entram no primeiro pedido
+#define CACHE_IN_PERCENT 25                     // Parte do orçamento para a fila IN
+#define CACHE_GHOST_PERCENT 50                  // Fantasmas guardados (em blocos do orçamento)
+#define CACHE_INITIAL_SLOTS 256                 // Listas de cada tabela vazia (potência de 2)
+#define CACHE_EVICT_TRIES 64                    // Blocos fixados pulados antes de desistir
+
+/**
+ * Filas de um bloco
+ */
+enum {
+    CACHE_IN,                   // Lido uma vez (FIFO)
+    CACHE_MAIN,                 // Lido de novo depois de sair de IN (LRU)
+    CACHE_GHOST,                // Saiu de IN; só a chave
+    CACHE_QUEUES,
+    CACHE_DETACHED = -1         // Invalidado enquanto fixado; liberado no último cache_unpin()
+};
+
+/*--------------------------------------------------------------
+ * ESTRUTURAS
+ *------------------------------------------------------------*/
+
+/**
+ * Versão de um arquivo (muda quando o arquivo é substituído ou alterado)
+ */
+typedef struct {
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime;
+} cache_version_t;
+
+struct cache_file;
+
+/**
+ * Bloco de um arquivo
+ */
+typedef struct cache_block {
+    struct cache_file *file;    // NULL depois de desligado do arquivo
+    struct cache_block *prev, *next;    // Posição na fila
+    struct cache_block *sibling_prev, *sibling_next; // Demais blocos do mesmo arquivo
+    struct cache_block *chain;  // Lista da tabela de blocos
+    uint8_t *data;              // NULL para um fantasma
+    size_t len;
+    uint32_t index;             // Posição no arquivo / CACHE_BLOCK
+    int queue;
+    int refs;                   // Envios usando os bytes
+} cache_block_t;
+
+/**
+ * Arquivo com blocos (ou fantasmas) no cache
+ */
+typedef struct cache_file {
+    char *name;
+    uint32_t hash;
+    cache_version_t version;
+    cache_block_t *blocks;      // Lista dos blocos do arquivo
+    struct cache_file *chain;   // Lista da tabela de arquivos
+} cache_file_t;
+
+/**
+ * Fila de blocos (cabeça: mais recente)
+ */
+typedef struct {
+    cache_block_t *head, *tail;
+    long count;
+    uint64_t bytes;
+} cache_queue_t;
+
+/**
+ * Números do cache para acompanhamento
+ */
+typedef struct {
+    uint64_t bytes;             // Bytes guardados (IN + MAIN)
+    uint64_t budget;
+    long blocks;                // Blocos com bytes
+    long ghosts;                // Chaves sem bytes
+    uint64_t hits;              // Blocos pedidos que estavam na memória
+    uint64_t misses;            // Blocos pedidos que vieram do disco
+    uint64_t inserts;           // Blocos guardados
+    uint64_t evictions;         // Blocos tirados para abrir espaço
+    uint64_t invalidations;     // Arquivos descartados por mudança
+} cache_stats_t;
+
+/**
+ * Estado do cache
+ */
+typedef struct {
+    mutex_t lock;
+    uint64_t budget;            // Bytes guardados no máximo
+    uint64_t in_budget;         // Bytes da fila IN no máximo
+    long ghost_max;
+    cache_queue_t queues[CACHE_QUEUES];
+    cache_file_t **files;
+    size_t file_mask, file_count;
+    cache_block_t **blocks;
+    size_t block_mask, block_count;
+    uint64_t hits, misses, inserts, evictions, invalidations;
+} read_cache_t;
+
+/*--------------------------------------------------------------
+ * TABELAS E FILAS
+ *------------------------------------------------------------*/
+
+/**
+ * Hash de 32 bits de um nome (FNV-1a)
+ */
+static inline uint32_t cache_name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+static inline size_t cache_block_slot(const cache_file_t *f, uint32_t index, size_t mask) {
+    return (f->hash ^ (index * 0x9E3779B1u)) & mask;
+}
+
+/**
+ * Dobra uma tabela quando o número de itens passa do número de listas
+ *
+ * Por que foi feito:
+ * - Falta de memória só deixa as listas mais longas; o cache continua
+ */
+static inline void cache_grow_files(read_cache_t *c) {
+    size_t slots = (c->file_mask + 1) * 2;
+    cache_file_t **grown = (cache_file_t **)calloc(slots, sizeof(cache_file_t *));
+
+    if (grown == NULL) return;
+    for (size_t i = 0; i <= c->file_mask; i++) {
+        while (c->files[i] != NULL) {
+            cache_file_t *f = c->files[i];
+            c->files[i] = f->chain;
+            f->chain = grown[f->hash & (slots - 1)];
+            grown[f->hash & (slots - 1)] = f;
+        }
+    }
+    free(c->files);
+    c->files = grown;
+    c->file_mask = slots - 1;
+}
+
+static inline void cache_grow_blocks(read_cache_t *c) {
+    size_t slots = (c->block_mask + 1) * 2;
+    cache_block_t **grown = (cache_block_t **)calloc(slots, sizeof(cache_block_t *));
+
+    if (grown == NULL) return;
+    for (size_t i = 0; i <= c->block_mask; i++) {
+        while (c->blocks[i] != NULL) {
+            cache_block_t *b = c->blocks[i];
+            size_t slot = cache_block_slot(b->file, b->index, slots - 1);
+            c->blocks[i] = b->chain;
+            b->chain = grown[slot];
+            grown[slot] = b;
+        }
+    }
+    free(c->blocks);
+    c->blocks = grown;
+    c->block_mask = slots - 1;
+}
+
+static inline cache_file_t *cache_find_file(read_cache_t *c, const char *name, uint32_t hash) {
+    for (cache_file_t *f = c->files[hash & c->file_mask]; f != NULL; f = f->chain) {
+        if (f->hash == hash && strcmp(f->name, name) == 0) return f;
+    }
+    return NULL;
+}
+
+static inline cache_block_t *cache_find_block(read_cache_t *c, cache_file_t *f, uint32_t index) {
+    for (cache_block_t *b = c->blocks[cache_block_slot(f, index, c->block_mask)]; b != NULL; b = b->chain) {
+        if (b->file == f && b->index == index) return b;
+    }
+    return NULL;
+}
+
+static inline void cache_queue_push(read_cache_t *c, cache_block_t *b, int queue) {
+    cache_queue_t *q = &c->queues[queue];
+
+    b->queue = queue;
+    b->prev = NULL;
+    b->next = q->head;
+    if (q->head != NULL) q->head->prev = b;
+    else q->tail = b;
+    q->head = b;
+    q->count++;
+    q->bytes += b->data != NULL ? b->len : 0;
+}
+
+static inline void cache_queue_unlink(read_cache_t *c, cache_block_t *b) {
+    cache_queue_t *q = &c->queues[b->queue];
+
+    if (b->prev != NULL) b->prev->next = b->next;
+    else q->head = b->next;
+    if (b->next != NULL) b->next->prev = b->prev;
+    else q->tail = b->prev;
+    q->count--;
+    q->bytes -= b->data != NULL ? b->len : 0;
+    b->prev = b->next = NULL;
+}
+
+/**
+ * Registra um novo acesso a um bloco com bytes
+ */
+static inline void cache_touch(read_cache_t *c, cache_block_t *b) {
+    // IN é FIFO: um segundo acesso logo após o primeiro não indica reuso
+    if (b->queue != CACHE_MAIN || c->queues[CACHE_MAIN].head == b) return;
+    cache_queue_unlink(c, b);
+    cache_queue_push(c, b, CACHE_MAIN);
+}
+
+/**
+ * Tira da tabela e libera um arquivo sem blocos
+ */
+static inline void cache_free_file(read_cache_t *c, cache_file_t *f) {
+    cache_file_t **link = &c->files[f->hash & c->file_mask];
+
+    while (*link != f) link = &(*link)->chain;
+    *link = f->chain;
+    c->file_count--;
+    free(f->name);
+    free(f);
+}
+
+/**
+ * Tira um bloco da fila, da tabela e do arquivo
+ *
+ * Por que foi feito:
+ * - Um bloco fixado continua válido para o envio que o usa; os bytes só
+ *   são liberados no último cache_unpin()
+ * - O arquivo sai da tabela junto com o seu último bloco
+ */
+static inline void cache_drop_block(read_cache_t *c, cache_block_t *b) {
+    cache_file_t *f = b->file;
+    cache_block_t **link = &c->blocks[cache_block_slot(f, b->index, c->block_mask)];
+
+    cache_queue_unlink(c, b);
+    while (*link != b) link = &(*link)->chain;
+    *link = b->chain;
+    c->block_count--;
+
+    if (b->sibling_prev != NULL) b->sibling_prev->sibling_next = b->sibling_next;
+    else f->blocks = b->sibling_next;
+    if (b->sibling_next != NULL) b->sibling_next->sibling_prev = b->sibling_prev;
+
+    if (b->refs > 0) {
+        b->file = NULL;
+        b->queue = CACHE_DETACHED;
+    } else {
+        free(b->data);
+        free(b);
+    }
+
+    if (f->blocks == NULL) cache_free_file(c, f);
+}
+
+/**
+ * Descarta um arquivo e todos os seus blocos
+ */
+static inline void cache_drop_file(read_cache_t *c, cache_file_t *f) {
+    c->invalidations++;
+    // O último bloco leva junto o próprio arquivo
+    while (f->blocks->sibling_next != NULL) cache_drop_block(c, f->blocks->sibling_next);
+    cache_drop_block(c, f->blocks);
+}
+
+/**
+ * Obtém o arquivo com a versão pedida, descartando uma versão antiga
+ *
+ * @param create 1 para criar o arquivo se ausente
+ * @return Arquivo, ou NULL se ausente (ou sem memória para criá-lo)
+ */
+static inline cache_file_t *cache_file_get(read_cache_t *c, const char *name, const cache_version_t *version,
+                                           int create) {
+    uint32_t hash = cache_name_hash(name);
+    cache_file_t *f = cache_find_file(c, name, hash);
+
+    if (f != NULL && memcmp(&f->version, version, sizeof(*version)) != 0) {
+        cache_drop_file(c, f);
+        f = NULL;
+    }
+    if (f != NULL || !create) return f;
+
+    if ((f = (cache_file_t *)calloc(1, sizeof(cache_file_t))) == NULL) return NULL;
+    if ((f->name = strdup(name)) == NULL) {
+        free(f);
+        return NULL;
+    }
+    f->hash = hash;
+    f->version = *version;
+    if (c->file_count >= c->file_mask + 1) cache_grow_files(c);
+    f->chain = c->files[hash & c->file_mask];
+    c->files[hash & c->file_mask] = f;
+    c->file_count++;
+    return f;
+}
+
+/**
+ * Acrescenta um bloco (com bytes ou fantasma) a um arquivo
+ *
+ * @return Bloco criado, ou NULL sem memória
+ */
+static inline cache_block_t *cache_add_block(read_cache_t *c, cache_file_t *f, uint32_t index,
+                                             uint8_t *data, size_t len, int queue) {
+    cache_block_t *b = (cache_block_t *)calloc(1, sizeof(cache_block_t));
+
+    if (b == NULL) return NULL;
+    b->file = f;
+    b->index = index;
+    b->data = data;
+    b->len = len;
+    if (c->block_count >= c->block_mask + 1) cache_grow_blocks(c);
+    size_t slot = cache_block_slot(f, index, c->block_mask);
+    b->chain = c->blocks[slot];
+    c->blocks[slot] = b;
+    c->block_count++;
+    b->sibling_next = f->blocks;
+    if (f->blocks != NULL) f->blocks->sibling_prev = b;
+    f->blocks = b;
+    cache_queue_push(c, b, queue);
+    return b;
+}
+
+/*--------------------------------------------------------------
+ * SUBSTITUIÇÃO
+ *------------------------------------------------------------*/
+
+/**
+ * Mantém a quantidade de fantasmas no limite (os mais antigos saem)
+ */
+static inline void cache_trim_ghosts(read_cache_t *c) {
+    while (c->queues[CACHE_GHOST].count > c->ghost_max) cache_drop_block(c, c->queues[CACHE_GHOST].tail);
+}
+
+/**
+ * Tira um bloco da memória
+ *
+ * @return 0 se um bloco saiu, -1 se todos os candidatos estão fixados
+ *
+ * Por que foi feito:
+ * - IN cede primeiro enquanto passa da sua parte do orçamento; o bloco
+ *   vira fantasma para que um segundo acesso o leve a MAIN
+ * - De MAIN sai o bloco usado há mais tempo, sem deixar fantasma
+ */
+static inline int cache_evict(read_cache_t *c) {
+    int first = (c->queues[CACHE_IN].bytes > c->in_budget || c->queues[CACHE_MAIN].count == 0)
+                    ? CACHE_IN : CACHE_MAIN;
+
+    for (int pass = 0; pass < 2; pass++) {
+        int queue = pass == 0 ? first : CACHE_IN + CACHE_MAIN - first;
+        cache_block_t *b = c->queues[queue].tail;
+        for (int tries = 0; b != NULL && tries < CACHE_EVICT_TRIES; tries++, b = b->prev) {
+            if (b->refs > 0) continue;
+            c->evictions++;
+            if (queue == CACHE_MAIN) {
+                cache_drop_block(c, b);
+                return 0;
+            }
+            cache_queue_unlink(c, b);
+            free(b->data);
+            b->data = NULL;
+            cache_queue_push(c, b, CACHE_GHOST);
+            cache_trim_ghosts(c);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*--------------------------------------------------------------
+ * INTERFACE
+ *------------------------------------------------------------*/
+
+/**
+ * Prepara um cache vazio
+ *
+ * @param budget Bytes de arquivos guardados no máximo
+ * @return 0 em caso de sucesso, -1 sem memória
+ */
+static inline int cache_init(read_cache_t *c, uint64_t budget) {
+    memset(c, 0, sizeof(*c));
+    c->files = (cache_file_t **)calloc(CACHE_INITIAL_SLOTS, sizeof(cache_file_t *));
+    c->blocks = (cache_block_t **)calloc(CACHE_INITIAL_SLOTS, sizeof(cache_block_t *));
+    if (c->files == NULL || c->blocks == NULL) {
+        free(c->files);
+        free(c->blocks);
+        return -1;
+    }
+    mutex_init(&c->lock);
+    c->file_mask = c->block_mask = CACHE_INITIAL_SLOTS - 1;
+    c->budget = budget;
+    c->in_budget = budget / 100 * CACHE_IN_PERCENT;
+    c->ghost_max = (long)(budget / CACHE_BLOCK * CACHE_GHOST_PERCENT / 100);
+    if (c->ghost_max < 1) c->ghost_max = 1;
+    return 0;
+}
+
+/**
+ * Fixa os blocos de um trecho se todos estão na memória
+ *
+ * @param first Primeiro bloco do trecho
+ * @param last Último bloco do trecho
+ * @param out Recebe os blocos fixados (last - first + 1 posições)
+ * @param known Recebe 1 se algum bloco do trecho está no cache (com bytes
+ *              ou fantasma), isto é, o trecho já foi lido antes
+ * @return 0 se o trecho inteiro foi fixado (liberar com cache_unpin),
+ *         -1 se falta algum bloco (nada fica fixado)
+ *
+ * Por que foi feito:
+ * - Um trecho incompleto vai inteiro ao disco; os blocos presentes contam
+ *   como acertos e os ausentes como falhas
+ */
+static inline int cache_pin_range(read_cache_t *c, const char *name, const cache_version_t *version,
+                                  uint32_t first, uint32_t last, cache_block_t **out, int *known) {
+    long present = 0;
+    long count = (long)(last - first) + 1;
+
+    mutex_lock(&c->lock);
+    cache_file_t *f = cache_file_get(c, name, version, 0);
+    *known = 0;
+    for (uint32_t i = first; f != NULL && i <= last; i++) {
+        cache_block_t *b = cache_find_block(c, f, i);
+        if (b != NULL) *known = 1;
+        if (b != NULL && b->data != NULL) out[present++] = b;
+    }
+    c->hits += (uint64_t)present;
+    c->misses += (uint64_t)(count - present);
+    if (present == count) {
+        for (long i = 0; i < count; i++) {
+            out[i]->refs++;
+            cache_touch(c, out[i]);
+        }
+    }
+    mutex_unlock(&c->lock);
+    return present == count ? 0 : -1;
+}
+
+/**
+ * Libera blocos fixados por cache_pin_range()
+ */
+static inline void cache_unpin(read_cache_t *c, cache_block_t **blocks, long count) {
+    mutex_lock(&c->lock);
+    for (long i = 0; i < count; i++) {
+        cache_block_t *b = blocks[i];
+        if (--b->refs == 0 && b->queue == CACHE_DETACHED) {
+            free(b->data);
+            free(b);
+        }
+    }
+    mutex_unlock(&c->lock);
+}
+
+/**
+ * Registra a primeira leitura de um trecho que não entra no cache
+ *
+ * Por que foi feito:
+ * - Um arquivo grande só passa pela memória a partir do segundo pedido;
+ *   os fantasmas deixados aqui marcam o trecho como já lido (no máximo
+ *   o limite de fantasmas a partir do início do trecho)
+ */
+static inline void cache_note(read_cache_t *c, const char *name, const cache_version_t *version,
+                              uint32_t first, uint32_t last) {
+    mutex_lock(&c->lock);
+    cache_file_t *f = cache_file_get(c, name, version, 1);
+    if (f != NULL && (uint64_t)last - first >= (uint64_t)c->ghost_max) last = first + (uint32_t)c->ghost_max - 1;
+    for (uint32_t i = first; f != NULL && i <= last; i++) {
+        if (cache_find_block(c, f, i) == NULL && cache_add_block(c, f, i, NULL, 0, CACHE_GHOST) == NULL) break;
+    }
+    // Arquivo criado sem nenhum bloco (sem memória para eles)
+    if (f != NULL && f->blocks == NULL) cache_free_file(c, f);
+    cache_trim_ghosts(c);
+    mutex_unlock(&c->lock);
+}
+
+/**
+ * Copia um bloco guardado
+ *
+ * @param len Tamanho esperado do bloco
+ * @return 0 se o bloco foi copiado, -1 se não está no cache
+ */
+static inline int cache_copy(read_cache_t *c, const char *name, const cache_version_t *version,
+                             uint32_t index, uint8_t *buf, size_t len) {
+    int result = -1;
+
+    mutex_lock(&c->lock);
+    cache_file_t *f = cache_file_get(c, name, version, 0);
+    cache_block_t *b = f != NULL ? cache_find_block(c, f, index) : NULL;
+    if (b != NULL && b->data != NULL && b->len == len) {
+        memcpy(buf, b->data, len);
+        cache_touch(c, b);
+        result = 0;
+    }
+    mutex_unlock(&c->lock);
+    return result;
+}
+
+/**
+ * Guarda um bloco lido do disco
+ *
+ * @param index Posição do bloco no arquivo / CACHE_BLOCK
+ * @param data Bytes do bloco (copiados)
+ *
+ * Por que foi feito:
+ * - A cópia é feita fora do lock; com o lock só se abre espaço e liga o
+ *   bloco ao arquivo
+ * - Um fantasma lido de novo vai direto para MAIN; os demais entram em IN
+ */
+static inline void cache_insert(read_cache_t *c, const char *name, const cache_version_t *version,
+                                uint32_t index, const uint8_t *data, size_t len) {
+    uint8_t *copy;
+
+    if (len == 0 || len > c->budget || (copy = (uint8_t *)malloc(len)) == NULL) return;
+    memcpy(copy, data, len);
+
+    mutex_lock(&c->lock);
+    int room = 0;
+    while (room == 0 && c->queues[CACHE_IN].bytes + c->queues[CACHE_MAIN].bytes + len > c->budget) {
+        room = cache_evict(c);
+    }
+    cache_file_t *f = room == 0 ? cache_file_get(c, name, version, 1) : NULL;
+    cache_block_t *b = f != NULL ? cache_find_block(c, f, index) : NULL;
+    if (f == NULL || (b != NULL && b->data != NULL)) {
+        // Sem espaço, sem memória ou já guardado por outro envio
+        if (f != NULL && f->blocks == NULL) cache_free_file(c, f);
+        free(copy);
+    } else if (b != NULL) {
+        cache_queue_unlink(c, b);
+        b->data = copy;
+        b->len = len;
+        cache_queue_push(c, b, CACHE_MAIN);
+        c->inserts++;
+    } else if (cache_add_block(c, f, index, copy, len, CACHE_IN) != NULL) {
+        c->inserts++;
+    } else {
+        free(copy);
+    }
+    mutex_unlock(&c->lock);
+}
+
+/**
+ * Descarta os blocos de um arquivo alterado ou removido
+ */
+static inline void cache_invalidate(read_cache_t *c, const char *name) {
+    mutex_lock(&c->lock);
+    cache_file_t *f = cache_find_file(c, name, cache_name_hash(name));
+    if (f != NULL) cache_drop_file(c, f);
+    mutex_unlock(&c->lock);
+}
+
+/**
+ * Copia os números do cache
+ */
+static inline void cache_stats(read_cache_t *c, cache_stats_t *out) {
+    mutex_lock(&c->lock);
+    out->bytes = c->queues[CACHE_IN].bytes + c->queues[CACHE_MAIN].bytes;
+    out->budget = c->budget;
+    out->blocks = c->queues[CACHE_IN].count + c->queues[CACHE_MAIN].count;
+    out->ghosts = c->queues[CACHE_GHOST].count;
+    out->hits = c->hits;
+    out->misses = c->misses;
+    out->inserts = c->inserts;
+    out->evictions = c->evictions;
+    out->invalidations = c->invalidations;
+    mutex_unlock(&c->lock);
+}
+
+#endif /* BIGFS_CACHE_H */
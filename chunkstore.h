@@ -0,0 +1,525 @@
+/*******************************************************************************
+ * ARMAZENAMENTO POR CONTEÚDO (DEDUPLICAÇÃO EM BLOCOS)
+ *
+ * Descrição: Divide arquivos em blocos definidos pelo conteúdo e descreve
+ *            cada arquivo como um manifesto (lista de blocos). Blocos são
+ *            identificados pelo SHA-256 e gravados uma única vez, mesmo que
+ *            apareçam em vários arquivos ou várias vezes no mesmo arquivo.
+ *
+ * Componentes:
+ * - cdc_t:      divisor de blocos por hash rolante (gear); as fronteiras
+ *               dependem só dos bytes próximos, então inserir ou remover
+ *               bytes no início do arquivo muda só os blocos vizinhos
+ * - manifest_t: tamanho do arquivo e sequência de blocos (SHA-256 e
+ *               tamanho de cada um)
+ * - chunk_gc_t: coleta dos blocos que nenhum manifesto usa mais (marcação
+ *               pelos manifestos e varredura dos blocos, em segundo plano)
+ *
+ * Layout no servidor (dentro do diretório de armazenamento):
+ *
+ *   .bigfs-chunks/ab/abcdef...    bloco cujo SHA-256 começa com "ab"
+ *   .bigfs-manifests/<nome>       manifesto do arquivo <nome>
+ *
+ * Formato do manifesto (inteiros em big-endian):
+ *   "BIGFSMF1" + u64 tamanho do arquivo + u32 blocos +
+ *   blocos x (32 bytes de SHA-256 + u32 tamanho)
+ ******************************************************************************/
+#ifndef BIGFS_CHUNKSTORE_H
+#define BIGFS_CHUNKSTORE_H
+
+#include "platform.h"
+#include "protocol.h"
+#include "digest.h"
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define CDC_MIN_SIZE (256 * 1024)           // Menor bloco (exceto o último)
+#define CDC_MAX_SIZE (4 * 1024 * 1024)      // Maior bloco
+#define CDC_MASK ((1ull << 20) - 1)         // Fronteira a cada ~1 MB após o mínimo
+#define CHUNKS_DIR ".bigfs-chunks"          // Blocos por SHA-256
+#define MANIFESTS_DIR ".bigfs-manifests"    // Manifestos por nome de arquivo
+#define MANIFEST_MAGIC "BIGFSMF1"
+#define MANIFEST_HEADER_SIZE 20             // Magic + tamanho + quantidade de blocos
+#define MANIFEST_REF_SIZE (SHA256_SIZE + 4) // SHA-256 + tamanho de um bloco
+#define CHUNK_QUERY_MAX ((FRAME_MAX_CONTROL - 4) / SHA256_SIZE) // Hashes por consulta
+#define CHUNK_GC_INTERVAL_MS (60 * 1000)    // Espera entre a exclusão de um manifesto e a coleta
+#define CHUNK_GC_GRACE (60 * 60)            // Idade mínima (s) de um bloco coletado
+
+/*--------------------------------------------------------------
+ * DIVISÃO EM BLOCOS DEFINIDOS PELO CONTEÚDO
+ *------------------------------------------------------------*/
+
+/**
+ * Tabela do hash rolante (igual no cliente e no servidor)
+ */
+typedef struct {
+    uint64_t gear[256];
+} cdc_t;
+
+/**
+ * Preenche a tabela com valores pseudoaleatórios fixos (splitmix64)
+ */
+static inline void cdc_init(cdc_t *c) {
+    uint64_t seed = 0x42494746535f4344ull;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        c->gear[i] = z ^ (z >> 31);
+    }
+}
+
+/**
+ * Encontra o fim do próximo bloco
+ *
+ * @param data Bytes a partir do início do bloco
+ * @param len Bytes disponíveis; menos que CDC_MAX_SIZE só no fim do arquivo
+ * @return Tamanho do bloco (entre 1 e CDC_MAX_SIZE)
+ *
+ * Por que foi feito:
+ * - O hash rolante só olha os últimos 64 bytes (deslocamento de 1 bit
+ *   por byte), então a fronteira reaparece no mesmo conteúdo mesmo que
+ *   ele tenha mudado de posição no arquivo
+ * - Os primeiros CDC_MIN_SIZE bytes nem são examinados: blocos pequenos
+ *   demais custariam mais em manifesto e arquivos do que economizam
+ */
+static inline size_t cdc_cut(const cdc_t *c, const uint8_t *data, size_t len) {
+    size_t end = len < CDC_MAX_SIZE ? len : CDC_MAX_SIZE;
+    uint64_t hash = 0;
+
+    if (end <= CDC_MIN_SIZE) return end;
+    for (size_t i = CDC_MIN_SIZE; i < end; i++) {
+        hash = (hash << 1) + c->gear[data[i]];
+        if ((hash & CDC_MASK) == 0) return i + 1;
+    }
+    return end;
+}
+
+/*--------------------------------------------------------------
+ * MANIFESTOS
+ *------------------------------------------------------------*/
+
+/**
+ * Referência a um bloco dentro de um manifesto
+ */
+typedef struct {
+    uint8_t hash[SHA256_SIZE];
+    uint32_t length;
+    uint64_t offset;            // Posição do bloco no arquivo (calculada)
+} chunk_ref_t;
+
+/**
+ * Arquivo descrito como sequência de blocos
+ */
+typedef struct {
+    uint64_t size;
+    uint32_t count;
+    chunk_ref_t *refs;
+} manifest_t;
+
+/**
+ * Libera os blocos de um manifesto
+ */
+static inline void manifest_free(manifest_t *m) {
+    free(m->refs);
+    memset(m, 0, sizeof(*m));
+}
+
+/**
+ * Serializa o cabeçalho de um manifesto
+ *
+ * @param out Buffer com MANIFEST_HEADER_SIZE bytes
+ */
+static inline void manifest_encode_header(uint8_t *out, uint64_t size, uint32_t count) {
+    memcpy(out, MANIFEST_MAGIC, 8);
+    put_u64(out + 8, size);
+    put_u32(out + 16, count);
+}
+
+/**
+ * Serializa a referência a um bloco
+ *
+ * @param out Buffer com MANIFEST_REF_SIZE bytes
+ */
+static inline void manifest_encode_ref(uint8_t *out, const chunk_ref_t *ref) {
+    memcpy(out, ref->hash, SHA256_SIZE);
+    put_u32(out + SHA256_SIZE, ref->length);
+}
+
+/**
+ * Decodifica e valida um manifesto inteiro
+ *
+ * @return 0 se o manifesto é válido, -1 caso contrário
+ *
+ * Por que foi feito:
+ * - O manifesto chega do cliente; a soma dos blocos precisa bater com o
+ *   tamanho declarado antes de ele virar um arquivo do servidor
+ */
+static inline int manifest_parse(const uint8_t *data, size_t len, manifest_t *m) {
+    memset(m, 0, sizeof(*m));
+    if (len < MANIFEST_HEADER_SIZE || memcmp(data, MANIFEST_MAGIC, 8) != 0) return -1;
+    m->size = get_u64(data + 8);
+    m->count = get_u32(data + 16);
+    if ((len - MANIFEST_HEADER_SIZE) / MANIFEST_REF_SIZE != m->count ||
+        (len - MANIFEST_HEADER_SIZE) % MANIFEST_REF_SIZE != 0) return -1;
+
+    m->refs = (chunk_ref_t *)malloc((m->count ? m->count : 1) * sizeof(chunk_ref_t));
+    if (m->refs == NULL) return -1;
+
+    uint64_t offset = 0;
+    int invalid = 0;
+    for (uint32_t i = 0; i < m->count && !invalid; i++) {
+        const uint8_t *p = data + MANIFEST_HEADER_SIZE + (size_t)i * MANIFEST_REF_SIZE;
+        memcpy(m->refs[i].hash, p, SHA256_SIZE);
+        m->refs[i].length = get_u32(p + SHA256_SIZE);
+        m->refs[i].offset = offset;
+        invalid = m->refs[i].length == 0 || m->refs[i].length > CDC_MAX_SIZE;
+        offset += m->refs[i].length;
+    }
+    if (invalid || offset != m->size) {
+        manifest_free(m);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Lê e valida um manifesto do disco
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+static inline int manifest_load(const char *path, manifest_t *m) {
+    int64_t len = file_size(path);
+    int fd = file_open_read(path);
+    uint8_t *data = NULL;
+    int result = -1;
+
+    if (fd >= 0 && len >= MANIFEST_HEADER_SIZE && (data = (uint8_t *)malloc((size_t)len)) != NULL &&
+        file_pread(fd, data, (size_t)len, 0) == len) {
+        result = manifest_parse(data, (size_t)len, m);
+    }
+    free(data);
+    if (fd >= 0) file_close(fd);
+    return result;
+}
+
+/**
+ * Lê só o tamanho do arquivo descrito por um manifesto
+ *
+ * @return 0 em caso de sucesso, -1 se não é um manifesto
+ */
+static inline int manifest_read_size(const char *path, uint64_t *size) {
+    uint8_t header[MANIFEST_HEADER_SIZE];
+    int fd = file_open_read(path);
+    int ok = fd >= 0 && file_pread(fd, header, sizeof(header), 0) == (int64_t)sizeof(header) &&
+             memcmp(header, MANIFEST_MAGIC, 8) == 0;
+
+    if (fd >= 0) file_close(fd);
+    if (!ok) return -1;
+    *size = get_u64(header + 8);
+    return 0;
+}
+
+/**
+ * Encontra o bloco que contém uma posição do arquivo
+ *
+ * @return Índice do bloco (count se a posição é o fim do arquivo)
+ */
+static inline uint32_t manifest_find(const manifest_t *m, uint64_t offset) {
+    uint32_t low = 0, high = m->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (m->refs[mid].offset + m->refs[mid].length <= offset) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+/*--------------------------------------------------------------
+ * BLOCOS NO DISCO
+ *------------------------------------------------------------*/
+
+/**
+ * Monta o caminho de um bloco
+ *
+ * @param root Diretório de armazenamento
+ * @return 0 em caso de sucesso, -1 se o caminho não cabe no buffer
+ */
+static inline int chunk_path(char *out, size_t cap, const char *root, const uint8_t *hash) {
+    char hex[SHA256_SIZE * 2 + 1];
+    digest_hex(hash, SHA256_SIZE, hex);
+    int len = snprintf(out, cap, "%s" PATH_SEP CHUNKS_DIR PATH_SEP "%.2s" PATH_SEP "%s", root, hex, hex);
+    return (len < 0 || (size_t)len >= cap) ? -1 : 0;
+}
+
+/**
+ * Cria os diretórios do armazenamento por conteúdo
+ *
+ * Por que foi feito:
+ * - Os blocos ficam em 256 subdiretórios (primeiro byte do hash) para que
+ *   nenhum diretório acumule milhões de entradas
+ */
+static inline void chunk_store_prepare(const char *root) {
+    char path[MAX_PATH + 32];
+
+    snprintf(path, sizeof(path), "%s" PATH_SEP CHUNKS_DIR, root);
+    make_dir(path);
+    for (int i = 0; i < 256; i++) {
+        snprintf(path, sizeof(path), "%s" PATH_SEP CHUNKS_DIR PATH_SEP "%02x", root, i);
+        make_dir(path);
+    }
+    snprintf(path, sizeof(path), "%s" PATH_SEP MANIFESTS_DIR, root);
+    make_dir(path);
+}
+
+/*--------------------------------------------------------------
+ * COLETA DE BLOCOS SEM USO
+ *------------------------------------------------------------*/
+
+/**
+ * Coletor dos blocos que nenhum manifesto referencia
+ *
+ * Por que foi feito:
+ * - Excluir ou substituir um arquivo remove só o manifesto: os blocos
+ *   podem pertencer a outros arquivos. Sem a coleta, o espaço de um
+ *   arquivo excluído nunca voltava ao disco
+ * - A coleta relê os manifestos em vez de manter contadores de
+ *   referência: nada a reconstruir depois de uma queda, e blocos de
+ *   uploads abandonados (enviados sem o manifesto) também são coletados
+ */
+typedef struct {
+    char root[MAX_PATH];
+    mutex_t lock;                       // Remoção de um bloco x quem passa a contar com ele
+    volatile long requests;             // Manifestos excluídos ou substituídos (só cresce)
+    uint64_t runs, removed, reclaimed;  // Coletas, blocos e bytes devolvidos ao disco
+} chunk_gc_t;
+
+/**
+ * Hashes dos blocos referenciados, ordenados para busca binária
+ */
+typedef struct {
+    uint8_t *hashes;
+    size_t count, cap;
+} chunk_marks_t;
+
+/**
+ * Avisa o coletor que um manifesto foi excluído ou substituído
+ *
+ * Pode ser chamada antes de chunk_gc_start() (recuperação do diário).
+ */
+static inline void chunk_gc_request(chunk_gc_t *gc) {
+    atomic_add_long(&gc->requests, 1);
+}
+
+/**
+ * Confirma que um bloco existe e o protege da coleta em andamento
+ *
+ * @param length Tamanho esperado do bloco (0 = qualquer)
+ * @return 1 se o bloco existe com esse tamanho, 0 caso contrário
+ *
+ * Por que foi feito:
+ * - Quem consulta um bloco (para não enviá-lo) ou o referencia em um
+ *   manifesto novo passa a contar com ele; a data de modificação
+ *   renovada faz a varredura poupá-lo, e o lock impede que a remoção
+ *   aconteça entre a verificação e a renovação
+ */
+static inline int chunk_claim(chunk_gc_t *gc, const uint8_t *hash, uint64_t length) {
+    char path[MAX_PATH];
+
+    if (chunk_path(path, sizeof(path), gc->root, hash) != 0) return 0;
+    mutex_lock(&gc->lock);
+    int64_t size = file_size(path);
+    int present = size > 0 && (length == 0 || size == (int64_t)length) &&
+                  file_set_meta(path, 0644, (int64_t)time(NULL)) == 0;
+    mutex_unlock(&gc->lock);
+    return present;
+}
+
+/**
+ * Compara hashes de blocos (para qsort e bsearch)
+ */
+static inline int chunk_hash_compare(const void *a, const void *b) {
+    return memcmp(a, b, SHA256_SIZE);
+}
+
+/**
+ * Converte o nome de um arquivo de bloco de volta para o hash
+ *
+ * @return 0 se o nome é um hash em hexadecimal, -1 caso contrário
+ */
+static inline int chunk_parse_name(const char *name, uint8_t *hash) {
+    for (int i = 0; i < SHA256_SIZE * 2; i++) {
+        char c = name[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (v < 0) return -1;
+        if (i % 2 == 0) hash[i / 2] = (uint8_t)(v << 4);
+        else hash[i / 2] |= (uint8_t)v;
+    }
+    return name[SHA256_SIZE * 2] == '\0' ? 0 : -1;
+}
+
+/**
+ * Marca os blocos referenciados pelos manifestos de um diretório e dos
+ * seus subdiretórios (arquivos de árvores)
+ *
+ * @param path Diretório; o buffer é reaproveitado para montar os caminhos
+ * @return 0 em caso de sucesso, -1 se um manifesto não pôde ser lido
+ *
+ * Por que foi feito:
+ * - Um manifesto ilegível suspende a coleta inteira: sem saber quais
+ *   blocos ele usa, nenhum bloco pode ser dado como livre
+ */
+static inline int chunk_gc_mark(chunk_marks_t *marks, char *path, size_t len) {
+    dir_iter_t it;
+    const char *name;
+    int result = 0;
+
+    if (dir_open(&it, path) != 0) return path_exists(path) ? -1 : 0;
+    while (result == 0 && (name = dir_next(&it)) != NULL) {
+        int n = snprintf(path + len, MAX_PATH - len, PATH_SEP "%s", name);
+        if (n < 0 || (size_t)n >= MAX_PATH - len) {
+            result = -1;
+            break;
+        }
+        if (path_is_dir(path)) {
+            result = chunk_gc_mark(marks, path, len + (size_t)n);
+            continue;
+        }
+
+        manifest_t m;
+        if (manifest_load(path, &m) != 0) {
+            // Excluído depois da leitura do diretório: não referencia mais nada
+            if (path_exists(path)) {
+                printf("Coleta de blocos suspensa: manifesto ilegível %s\n", path);
+                result = -1;
+            }
+            continue;
+        }
+        if (marks->count + m.count > marks->cap) {
+            size_t cap = marks->cap ? marks->cap : 4096;
+            while (cap < marks->count + m.count) cap *= 2;
+            uint8_t *grown = (uint8_t *)realloc(marks->hashes, cap * SHA256_SIZE);
+            if (grown == NULL) {
+                manifest_free(&m);
+                result = -1;
+                break;
+            }
+            marks->hashes = grown;
+            marks->cap = cap;
+        }
+        for (uint32_t i = 0; i < m.count; i++) {
+            memcpy(marks->hashes + (marks->count++) * SHA256_SIZE, m.refs[i].hash, SHA256_SIZE);
+        }
+        manifest_free(&m);
+    }
+    dir_close(&it);
+    path[len] = '\0';
+    return result;
+}
+
+/**
+ * Remove os blocos que nenhum manifesto referencia
+ *
+ * Por que foi feito:
+ * - Blocos recentes ficam (CHUNK_GC_GRACE): podem ser de um upload cujo
+ *   manifesto ainda não chegou, ou ter sido consultados por um cliente
+ *   que vai referenciá-los sem enviá-los (chunk_claim())
+ * - Um manifesto gravado durante a marcação só referencia blocos que
+ *   passaram por chunk_claim(), então nenhum deles é velho o bastante
+ */
+static inline void chunk_gc_run(chunk_gc_t *gc) {
+    char path[MAX_PATH], dir[MAX_PATH + 32];
+    chunk_marks_t marks = { NULL, 0, 0 };
+    uint8_t hash[SHA256_SIZE];
+    uint64_t removed = 0, reclaimed = 0, start = monotonic_ns();
+    int64_t cutoff = (int64_t)time(NULL) - CHUNK_GC_GRACE;
+
+    int len = snprintf(path, sizeof(path), "%s" PATH_SEP MANIFESTS_DIR, gc->root);
+    if (len < 0 || len >= (int)sizeof(path) || chunk_gc_mark(&marks, path, (size_t)len) != 0) {
+        free(marks.hashes);
+        return;
+    }
+    if (marks.count > 0) qsort(marks.hashes, marks.count, SHA256_SIZE, chunk_hash_compare);
+
+    for (int i = 0; i < 256; i++) {
+        dir_iter_t it;
+        const char *name;
+        snprintf(dir, sizeof(dir), "%s" PATH_SEP CHUNKS_DIR PATH_SEP "%02x", gc->root, i);
+        if (dir_open(&it, dir) != 0) continue;
+        while ((name = dir_next(&it)) != NULL) {
+            uint64_t size, inode;
+            int64_t mtime;
+            if (chunk_parse_name(name, hash) != 0) continue;
+            if (marks.count > 0 && bsearch(hash, marks.hashes, marks.count, SHA256_SIZE, chunk_hash_compare) != NULL) continue;
+            if (chunk_path(path, sizeof(path), gc->root, hash) != 0) continue;
+            mutex_lock(&gc->lock);
+            if (file_stat(path, &size, &mtime, &inode) == 0 && mtime < cutoff && remove(path) == 0) {
+                removed++;
+                reclaimed += size;
+            }
+            mutex_unlock(&gc->lock);
+        }
+        dir_close(&it);
+    }
+    free(marks.hashes);
+
+    mutex_lock(&gc->lock);
+    gc->runs++;
+    gc->removed += removed;
+    gc->reclaimed += reclaimed;
+    mutex_unlock(&gc->lock);
+    if (removed > 0) {
+        printf("Coleta de blocos: %llu bloco(s) sem uso removido(s), %.1f MB devolvidos em %.1f ms.\n",
+               (unsigned long long)removed, (double)reclaimed / (1024 * 1024),
+               (double)(monotonic_ns() - start) / 1e6);
+    }
+}
+
+/**
+ * Thread do coletor: uma coleta por intervalo, se algum manifesto saiu
+ *
+ * Por que foi feito:
+ * - Uma exclusão em massa vira uma única coleta; a primeira, logo após
+ *   a partida, recolhe o que ficou de uploads interrompidos
+ */
+static inline void *chunk_gc_main(void *arg) {
+    chunk_gc_t *gc = (chunk_gc_t *)arg;
+    long collected = -1;
+
+    for (;;) {
+        sleep_ms(CHUNK_GC_INTERVAL_MS);
+        long requests = atomic_add_long(&gc->requests, 0);
+        if (requests == collected) continue;
+        collected = requests;
+        chunk_gc_run(gc);
+    }
+    return NULL;
+}
+
+/**
+ * Inicia o coletor de blocos
+ *
+ * @param root Diretório de armazenamento
+ * @return 0 em caso de sucesso, -1 se a thread não pôde ser criada
+ */
+static inline int chunk_gc_start(chunk_gc_t *gc, const char *root) {
+    thread_t thread;
+
+    snprintf(gc->root, sizeof(gc->root), "%s", root);
+    mutex_init(&gc->lock);
+    return thread_create(&thread, chunk_gc_main, gc);
+}
+
+/**
+ * Lê os contadores do coletor (métricas)
+ */
+static inline void chunk_gc_stats(chunk_gc_t *gc, uint64_t *runs, uint64_t *removed, uint64_t *reclaimed) {
+    mutex_lock(&gc->lock);
+    *runs = gc->runs;
+    *removed = gc->removed;
+    *reclaimed = gc->reclaimed;
+    mutex_unlock(&gc->lock);
+}
+
+#endif /* BIGFS_CHUNKSTORE_H */
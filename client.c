@@ -8,12 +8,33 @@
  * - Conexão com servidor remoto
  * - Listagem de arquivos no servidor e local
  * - Upload/download de arquivos com barra de progresso
+ * - Reconexão e retomada automáticas de transferências interrompidas
+ * - Arquivos grandes transferidos em blocos por várias conexões paralelas
+ * - Upload deduplicado: só os blocos que o servidor ainda não tem
+ * - Atualização por diferenças de arquivos que já estão no servidor
+ * - Compressão dos dados negociada com o servidor (LZ4/zstd)
+ * - Conferência de integridade (CRC32C e XXH64) em uploads e downloads
+ * - Protocolo binário enquadrado (conexão reutilizada entre comandos)
+ * - Listagens, exclusões e transferências (inteiras, retomadas, em blocos
+ *   paralelos, por diferenças e lotes de diretórios) pela biblioteca de
+ *   pedidos assíncronos (clientlib.h): várias conexões persistentes,
+ *   vários pedidos em andamento em cada uma e reconexão automática;
+ *   uploads deduplicados e downloads de diretórios (TREE_GET) seguem pela
+ *   conexão principal
+ * - Cluster de vários servidores: cada nome vai para o nó dono no anel de
+ *   hash consistente; listagens consultam todos os nós e a redistribuição
+ *   move só os arquivos que mudaram de dono
+ * - Downloads em lote repartidos entre o servidor e as réplicas dele,
+ *   aceitos só de cópias com o mesmo resumo do servidor
  * - Exclusão de arquivos remotos
+ * - Modo em lote (linha de comando ou roteiro) com pedidos encadeados
+ * - Envio e download de diretórios inteiros, com arquivos pequenos em lotes
+ *   e permissões e datas preservadas
  * - Suporte a caracteres acentuados e Unicode
  * 
  * Autor: [Seu Nome]
  * Data: [Data]
- * Versão: 1.0
+ * Versão: 2.0
  ******************************************************************************/
 
 /*--------------------------------------------------------------
@@ -22,293 +43,3325 @@
 #include <stdio.h>      // Para funções de entrada/saída padrão
 #include <stdlib.h>     // Para alocação de memória e outras utilidades
 #include <string.h>     // Para manipulação de strings
-#include <winsock2.h>   // Para sockets no Windows
-#include <windows.h>    // Para funções específicas do Windows
-#include <direct.h>     // Para manipulação de diretórios
-#include <conio.h>      // Para funções de console (getch, etc.)
 #include <locale.h>     // Para configuração de localização (acentos)
-
-// Linkar com a biblioteca de sockets do Windows
-#pragma comment(lib, "ws2_32.lib")
+#include <time.h>       // Para exibir datas de modificação
+#include "platform.h"   // Sockets e diretórios portáveis (Winsock/POSIX)
+#include "protocol.h"   // Formato binário dos quadros
+#include "bufpool.h"    // Buffers alinhados das transferências
+#include "chunkstore.h" // Blocos definidos pelo conteúdo (upload deduplicado)
+#include "delta.h"      // Atualização de arquivos por diferenças
+#include "compress.h"   // Compressão dos quadros DATA
+#include "clientlib.h"  // Pedidos assíncronos por conexões persistentes
 
 /*--------------------------------------------------------------
  * DEFINIÇÕES DE CONSTANTES
  *------------------------------------------------------------*/
 #define PORT 8888               // Porta padrão para conexão
 #define BUFFER_SIZE 1024        // Tamanho do buffer para transferência
+#define CLIENT_RETRIES 5        // Tentativas de reconexão durante uma transferência
+#define RETRY_DELAY_MS 1000     // Espera antes da primeira reconexão (dobra a cada tentativa)
+#define SERVER_ADDRESS "127.0.0.1" // Endereço padrão do servidor
+#define PARALLEL_STREAMS 4      // Conexões paralelas padrão para arquivos grandes
+#define MAX_STREAMS 64          // Limite de conexões paralelas
+#define CHUNK_SIZE_MB 8         // Tamanho padrão dos blocos paralelos
+#define BATCH_WINDOW 32         // Pedidos em andamento por conexão no modo em lote
+#define BATCH_MAX_WINDOW 1024   // Limite da janela do modo em lote
+#define BATCH_MAX_WORDS 4096    // Palavras de um comando do modo em lote
+#define BATCH_LINE_SIZE 8192    // Linha de um roteiro do modo em lote
+#define TREE_BATCH_BYTES (4 * 1024 * 1024) // Tamanho de cada lote de arquivos pequenos
+#define TREE_MAX_DEPTH 64       // Níveis de subdiretórios percorridos
+#define REBALANCE_PARALLEL 16   // Arquivos movidos ao mesmo tempo na redistribuição
+#ifndef MAX_PATH
 #define MAX_PATH 260            // Tamanho máximo de caminhos no Windows
+#endif
+
+/*--------------------------------------------------------------
+ * ESTADO DA CONEXÃO
+ *------------------------------------------------------------*/
+static volatile long last_request_id;  // Último identificador de pedido usado
+static struct sockaddr_in server_addr;  // Endereço do servidor (para reconectar)
+static int transfer_codec = CODEC_NONE; // Compressão negociada com o servidor
+static int quiet_progress;              // Sem barra de progresso (modo em lote)
+static bfs_cluster_t *cluster;          // Nós do servidor: listagens, exclusões e arquivos pequenos
+static bfs_cluster_t *transfers;        // Nós do servidor: transferências do menu e arquivos grandes
+static int main_node;                   // Nó da conexão principal
+static bfs_client_t *replicas[RING_MAX_NODES]; // Réplicas de leitura do servidor (-R)
+static int replica_count;
+static int replica_next;                // Próxima cópia de um download (0: o próprio servidor)
+
+/**
+ * Configuração do cliente (ajustável por linha de comando)
+ */
+typedef struct {
+    char address[64];           // IP do servidor
+    int port;                   // Porta do servidor
+    int streams;                // Conexões paralelas por transferência
+    uint64_t chunk_size;        // Tamanho dos blocos paralelos (bytes)
+    int dedup;                  // Envia só os blocos que o servidor não tem
+    int codec;                  // Compressão pedida (-1: melhor codec em comum)
+    int window;                 // Pedidos em andamento por conexão (modo em lote)
+    const char *script;         // Roteiro de comandos ("-": entrada padrão)
+    const char *output;         // Diretório de destino dos downloads em lote
+    int command;                // Posição do primeiro comando em argv (0: nenhum)
+    const char *nodes;          // Nós do cluster ("ip:porta,ip:porta,..."; NULL: só -a e -p)
+    const char *replicas;       // Réplicas de leitura ("ip:porta,..."; NULL: nenhuma)
+} client_config_t;
+
+static client_config_t config = { SERVER_ADDRESS, PORT, PARALLEL_STREAMS, (uint64_t)CHUNK_SIZE_MB * 1024 * 1024, 0, -1,
+                                  BATCH_WINDOW, NULL, ".", 0, NULL, NULL };
 
 /*--------------------------------------------------------------
  * DECLARAÇÕES DE FUNÇÕES
  *------------------------------------------------------------*/
 
 /**
- * Configura a codificação do console para suportar UTF-8 e acentos
- * 
- * Por que foi feito:
- * - Garantir que caracteres acentuados sejam exibidos corretamente
- * - Configurar o locale para português do Brasil
+ * Configura a codificação do console para suportar UTF-8 e acentos
+ * 
+ * Por que foi feito:
+ * - Garantir que caracteres acentuados sejam exibidos corretamente
+ * - Configurar o locale para português do Brasil
+ */
+void set_console_encoding() {
+#ifdef _WIN32
+    system("chcp 65001 > nul");     // Muda a página de código para UTF-8
+    SetConsoleOutputCP(CP_UTF8);    // Configura saída do console para UTF-8
+    SetConsoleCP(CP_UTF8);          // Configura entrada do console para UTF-8
+    setlocale(LC_ALL, "Portuguese_Brazil.1252"); // Configura localização
+#else
+    setlocale(LC_ALL, "");          // Terminais POSIX já usam UTF-8
+#endif
+}
+
+/**
+ * Exibe uma barra de progresso gráfica no console
+ * 
+ * @param percentage Porcentagem completada (0-100)
+ * 
+ * Por que foi feito:
+ * - Feedback visual durante transferências longas
+ * - Melhor experiência do usuário
+ */
+void show_progress(int percentage) {
+    if (quiet_progress) return;
+    printf("\r[");  // \r volta ao início da linha
+    
+    // Calcula posição do cursor na barra
+    int pos = percentage / 5;
+    
+    // Desenha a barra
+    for (int i = 0; i < 20; ++i) {
+        if (i < pos) printf("=");       // Parte completada
+        else if (i == pos) printf(">"); // Posição atual
+        else printf(" ");               // Parte não completada
+    }
+    
+    printf("] %d%%", percentage);  // Mostra porcentagem
+    fflush(stdout);                // Força exibição imediata
+}
+
+/**
+ * Exibe mensagem de conclusão de operação
+ * 
+ * @param operation Nome da operação realizada
+ * @param filename Nome do arquivo envolvido
+ * 
+ * Por que foi feito:
+ * - Feedback claro ao usuário sobre conclusão de operações
+ */
+void show_complete_message(const char* operation, const char* filename) {
+    printf("\n%s %s concluído com sucesso!\n", operation, filename);
+}
+
+/**
+ * Lista de nomes que cresce conforme necessário
+ */
+typedef struct {
+    char **names;
+    int count, cap;
+} name_list_t;
+
+/**
+ * Acrescenta uma cópia de um nome à lista
+ *
+ * @return 0 em caso de sucesso, -1 se faltou memória
+ */
+int name_list_add(name_list_t *l, const char *name) {
+    if (l->count == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 64;
+        char **names = (char **)realloc(l->names, (size_t)cap * sizeof(char *));
+        if (names == NULL) return -1;
+        l->names = names;
+        l->cap = cap;
+    }
+    size_t len = strlen(name) + 1;
+    if ((l->names[l->count] = (char *)malloc(len)) == NULL) return -1;
+    memcpy(l->names[l->count++], name, len);
+    return 0;
+}
+
+/**
+ * Libera a lista e os nomes
+ */
+void name_list_free(name_list_t *l) {
+    for (int i = 0; i < l->count; i++) free(l->names[i]);
+    free(l->names);
+    memset(l, 0, sizeof(*l));
+}
+
+/**
+ * Lista arquivos no diretório local
+ * 
+ * @param path Caminho do diretório a ser listado
+ * 
+ * Por que foi feito:
+ * - Permitir ao usuário visualizar arquivos disponíveis para upload
+ * - Interface amigável para navegação local
+ */
+void list_local_files(const char* path) {
+    dir_iter_t it;                 // Iterador do diretório
+    const char *name;              // Nome do arquivo atual
+    
+    // Inicia a busca
+    if (dir_open(&it, path) != 0) {
+        printf("Nenhum arquivo encontrado no diretório.\n");
+        return;
+    }
+    
+    printf("\nArquivos no diretório local:\n");
+    int count = 1;
+    
+    // Lista todos os arquivos ("." e ".." já são ignorados)
+    while ((name = dir_next(&it)) != NULL) {
+        printf("%d. %s\n", count++, name);
+    }
+    
+    dir_close(&it);  // Libera o iterador
+}
+
+/**
+ * Limpa o buffer de entrada
+ * 
+ * Por que foi feito:
+ * - Evitar problemas com entradas pendentes no buffer
+ * - Garantir leitura correta da próxima entrada
+ */
+void clear_input_buffer() {
+    int c;
+    while ((c = getchar()) != '\n' && c != EOF);
+}
+
+/**
+ * Permite ao usuário selecionar um arquivo da lista local
+ * 
+ * @param path Diretório onde procurar arquivos
+ * @param selectedFile Buffer para armazenar o nome do arquivo selecionado
+ * @return 1 se seleção bem sucedida, 0 caso contrário
+ * 
+ * Por que foi feito:
+ * - Interface interativa para seleção de arquivos
+ * - Validação da entrada do usuário
+ */
+int select_file_from_list(const char* path, char* selectedFile) {
+    dir_iter_t it;
+    const char *name;
+    name_list_t files = { NULL, 0, 0 };
+    int selectedIndex = 0;
+    
+    // Uma única leitura do diretório: os nomes exibidos são os selecionáveis
+    if (dir_open(&it, path) == 0) {
+        while ((name = dir_next(&it)) != NULL && name_list_add(&files, name) == 0) {
+        }
+        dir_close(&it);
+    }
+    
+    if (files.count == 0) {
+        printf("Nenhum arquivo encontrado no diretório.\n");
+        name_list_free(&files);
+        return 0;
+    }
+    
+    // Lista os arquivos com números para seleção
+    printf("\nSelecione um arquivo:\n");
+    for (int i = 0; i < files.count; i++) {
+        printf("%d. %s\n", i + 1, files.names[i]);
+    }
+    
+    // Obtém a seleção do usuário
+    printf("\nDigite o número do arquivo: ");
+    if (scanf("%d", &selectedIndex) != 1) selectedIndex = 0;
+    clear_input_buffer();
+    
+    // Valida a entrada
+    int selected = selectedIndex >= 1 && selectedIndex <= files.count;
+    if (selected) {
+        snprintf(selectedFile, MAX_PATH, "%s", files.names[selectedIndex - 1]);
+    } else {
+        printf("Seleção inválida.\n");
+    }
+    name_list_free(&files);
+    return selected;
+}
+
+/**
+ * Obtém o caminho de destino para download
+ * 
+ * @param path Buffer para armazenar o caminho
+ * 
+ * Por que foi feito:
+ * - Flexibilidade para o usuário escolher onde salvar arquivos
+ * - Validação de existência do diretório
+ */
+void get_download_path(char* path) {
+    printf("\nDigite o diretório de destino para o download (ou pressione Enter para usar o diretório atual): ");
+    fgets(path, MAX_PATH, stdin);
+    path[strcspn(path, "\n")] = '\0';  // Remove o \n do final
+    
+    // Se vazio, usa o diretório atual
+    if (strlen(path) == 0) {
+        current_dir(path, MAX_PATH);
+    }
+    
+    // Verifica se o diretório existe
+    if (!path_exists(path)) {
+        printf("Diretório não existe. Usando diretório atual.\n");
+        current_dir(path, MAX_PATH);
+    }
+}
+
+/*--------------------------------------------------------------
+ * PROTOCOLO
+ *------------------------------------------------------------*/
+
+/**
+ * Gera o identificador do próximo pedido
+ *
+ * Por que foi feito:
+ * - Cada pedido e todos os quadros da sua resposta carregam o mesmo id,
+ *   o que permite conferir que a resposta lida é a do pedido enviado
+ * - Atômico porque as conexões de uma transferência paralela pedem ids
+ *   ao mesmo tempo
+ */
+uint32_t next_request_id() {
+    return (uint32_t)atomic_add_long(&last_request_id, 1) + 1;
+}
+
+/**
+ * Aguarda a resposta OK/ERROR de um pedido
+ *
+ * @param message Buffer para a mensagem do servidor
+ * @param size Tamanho do buffer
+ * @param code Recebe o código de erro (pode ser NULL)
+ * @return 1 para OK, 0 para ERROR, -1 se a conexão falhou
+ */
+int receive_reply(SOCKET s, uint32_t request_id, char *message, size_t size, uint16_t *code) {
+    frame_header_t h;
+    char payload[FRAME_MAX_CONTROL + 1];
+
+    if (proto_recv_frame(s, &h, payload, sizeof(payload)) != 0 || h.request_id != request_id) {
+        printf("Resposta inválida do servidor.\n");
+        return -1;
+    }
+
+    if (h.opcode == OP_ERROR) {
+        // Código de erro (2 bytes) seguido da mensagem
+        if (code != NULL) *code = h.length >= 2 ? get_u16((uint8_t *)payload) : 0;
+        snprintf(message, size, "%s", h.length >= 2 ? payload + 2 : "");
+        return 0;
+    }
+    if (h.opcode != OP_OK) {
+        printf("Resposta inesperada do servidor.\n");
+        return -1;
+    }
+    if (message != NULL) {
+        size_t len = h.length < size - 1 ? (size_t)h.length : size - 1;
+        memcpy(message, payload, len);
+        message[len] = '\0';
+    }
+    return 1;
+}
+
+/**
+ * Exibe uma entrada da listagem do servidor (nome, tamanho, data e CRC32C)
+ */
+void print_list_entry(const list_entry_t *e) {
+    char date[32] = "-";
+    char crc[16] = "";
+    time_t mtime = (time_t)e->mtime;
+    struct tm *local = localtime(&mtime);
+
+    if (local != NULL) strftime(date, sizeof(date), "%Y-%m-%d %H:%M", local);
+    if (e->hash_len >= CHECKSUM_CRC_SIZE) snprintf(crc, sizeof(crc), "  %08x", checksum_crc(e->hash));
+    printf("%-40s %15llu  %s%s\n", e->name, (unsigned long long)e->size, date, crc);
+}
+
+/**
+ * Listagem em andamento pela biblioteca de pedidos assíncronos
+ */
+typedef struct {
+    bfs_future_t future;        // Primeiro campo: é o contexto de bfs_future_done()
+    void (*visit)(const list_entry_t *e, void *ctx);
+    void *ctx;
+} list_call_t;
+
+/**
+ * Repassa uma entrada da listagem (thread da conexão)
+ */
+void list_call_entry(void *ctx, const list_entry_t *e) {
+    list_call_t *call = (list_call_t *)ctx;
+    call->visit(e, call->ctx);
+}
+
+/**
+ * Percorre a lista de arquivos do servidor
+ *
+ * @param node Nó do cluster a listar (NULL: todos, em ordem de nome)
+ * @param prefix Só lista nomes que começam com este prefixo ("" = todos)
+ * @param visit Chamada para cada entrada
+ * @return Número de entradas, ou -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - A lista chega em páginas; a biblioteca pede a próxima a partir do
+ *   nome da última entrada recebida, e depois de uma queda de conexão
+ *   continua dali, sem repetir entradas
+ * - O menu exibe as entradas; o modo em lote as usa para expandir padrões
+ */
+long long list_remote(bfs_client_t *node, const char *prefix, void (*visit)(const list_entry_t *e, void *ctx),
+                      void *ctx) {
+    list_call_t call;
+
+    call.visit = visit;
+    call.ctx = ctx;
+    bfs_future_init(&call.future);
+    if (node != NULL) bfs_list(node, prefix, list_call_entry, bfs_future_done, &call);
+    else bfs_cluster_list(cluster, prefix, list_call_entry, bfs_future_done, &call);
+    const bfs_result_t *r = bfs_future_wait(&call.future);
+    if (r->status != BFS_OK) {
+        printf("Erro ao receber lista de arquivos: %s\n", r->message);
+        return -1;
+    }
+    return (long long)r->size;
+}
+
+/**
+ * Exibe uma entrada recebida por list_remote()
+ */
+void print_list_visit(const list_entry_t *e, void *ctx) {
+    (void)ctx;
+    print_list_entry(e);
+}
+
+/**
+ * Solicita e exibe a lista de arquivos do servidor
+ *
+ * @param title Título exibido antes da lista
+ * @param prefix Só lista nomes que começam com este prefixo ("" = todos)
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+int request_list(const char *title, const char *prefix) {
+    printf("\n%s\n", title);
+    long long listed = list_remote(NULL, prefix, print_list_visit, NULL);
+    if (listed < 0) return -1;
+    printf("%lld arquivo(s)\n", listed);
+    return 0;
+}
+
+/*--------------------------------------------------------------
+ * CONEXÃO E RETOMADA DE TRANSFERÊNCIAS
+ *------------------------------------------------------------*/
+
+/**
+ * Abre uma nova conexão com o servidor
+ *
+ * @return Socket conectado, ou INVALID_SOCKET em caso de erro
+ */
+SOCKET connect_server() {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET) return INVALID_SOCKET;
+    if (connect(s, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    net_set_nodelay(s);
+    return s;
+}
+
+/**
+ * Substitui uma conexão perdida por uma nova
+ *
+ * @return 0 se reconectou, -1 se todas as tentativas falharam
+ *
+ * Por que foi feito:
+ * - Em links instáveis a queda da conexão é esperada; a transferência
+ *   continua de onde parou em vez de voltar ao menu com erro
+ * - A espera dobra a cada tentativa para não martelar um servidor que
+ *   está reiniciando
+ */
+int reconnect(SOCKET *s) {
+    int delay = RETRY_DELAY_MS;
+
+    closesocket(*s);
+    *s = INVALID_SOCKET;
+    for (int attempt = 1; attempt <= CLIENT_RETRIES; attempt++) {
+        printf("\nConexão perdida. Reconectando (tentativa %d de %d)...\n", attempt, CLIENT_RETRIES);
+        sleep_ms(delay);
+        delay *= 2;
+        *s = connect_server();
+        if (*s != INVALID_SOCKET) return 0;
+    }
+    return -1;
+}
+
+/**
+ * Combina com o servidor a compressão dos quadros DATA
+ *
+ * Por que foi feito:
+ * - Cada lado só usa codecs que o outro sabe descomprimir; servidores
+ *   sem compressão respondem UNSUPPORTED e as transferências seguem cruas
+ */
+void negotiate_codecs(SOCKET s) {
+    frame_header_t h;
+    char payload[FRAME_MAX_CONTROL + 1];
+    uint8_t mask = codec_supported_mask(), common = 0;
+    uint32_t id = next_request_id();
+    int previous = transfer_codec;
+
+    transfer_codec = CODEC_NONE;
+    if (config.codec == CODEC_NONE) return;
+    if (proto_send_frame(s, OP_CODECS, 0, id, &mask, 1) != 0 ||
+        proto_recv_frame(s, &h, payload, sizeof(payload)) != 0 || h.request_id != id) return;
+    if (h.opcode == OP_OK && h.length == 1) common = (uint8_t)payload[0];
+
+    if (config.codec < 0) {
+        transfer_codec = codec_choose(common);
+    } else if (common & (1 << config.codec)) {
+        transfer_codec = config.codec;
+    } else {
+        printf("O servidor não suporta a compressão %s; transferências sem compressão.\n", codec_name(config.codec));
+    }
+    if (transfer_codec != CODEC_NONE && transfer_codec != previous) {
+        printf("Compressão: %s\n", codec_name(transfer_codec));
+    }
+}
+
+/**
+ * Leva a conexão principal a outro nó do cluster
+ *
+ * @return 0 em caso de sucesso, -1 se não foi possível conectar ao nó
+ *
+ * Por que foi feito:
+ * - Uploads deduplicados e downloads de diretórios usam a conexão
+ *   principal; apontá-la para o dono do nome antes de começar leva os
+ *   pedidos ao nó certo
+ */
+int route_node(SOCKET *s, int node) {
+    if (node == main_node) return 0;
+
+    struct sockaddr_in previous = server_addr;
+    SOCKET moved;
+    server_addr = cluster->nodes[node]->addr;
+    if ((moved = connect_server()) == INVALID_SOCKET && reconnect(&moved) != 0) {
+        server_addr = previous;
+        return -1;
+    }
+    proto_send_frame(*s, OP_BYE, 0, next_request_id(), NULL, 0);
+    closesocket(*s);
+    *s = moved;
+    main_node = node;
+    negotiate_codecs(*s);
+    return 0;
+}
+
+/**
+ * Encerra os clientes da biblioteca (nós do cluster e réplicas de leitura)
+ */
+void close_clients() {
+    bfs_cluster_close(cluster);
+    bfs_cluster_close(transfers);
+    for (int i = 0; i < replica_count; i++) bfs_close(replicas[i]);
+}
+
+/**
+ * Leva a conexão principal ao nó dono de um nome
+ *
+ * @return 0 em caso de sucesso, -1 se não foi possível conectar ao nó
+ */
+int route_name(SOCKET *s, const char *name) {
+    return route_node(s, bfs_cluster_owner(cluster, name));
+}
+
+/**
+ * Escolhe a compressão dos quadros DATA de um upload
+ *
+ * @param buffer Área livre com pelo menos 2 * COMPRESS_SAMPLE bytes
+ * @return Codec negociado, ou CODEC_NONE se o conteúdo já é comprimido
+ */
+int upload_codec(int fd, uint64_t offset, uint64_t size, uint8_t *buffer) {
+    if (transfer_codec == CODEC_NONE || offset >= size) return CODEC_NONE;
+
+    size_t want = size - offset < COMPRESS_SAMPLE ? (size_t)(size - offset) : COMPRESS_SAMPLE;
+    int64_t got = file_pread(fd, buffer, want, offset);
+    if (got <= 0 || compress_looks_compressed(buffer, (size_t)got, buffer + COMPRESS_SAMPLE)) return CODEC_NONE;
+    return transfer_codec;
+}
+
+/**
+ * Recebe o payload de um quadro DATA, descomprimindo se necessário
+ *
+ * @param buffer Recebe os dados (FRAME_DATA_CHUNK bytes)
+ * @param packed Área para o payload comprimido (FRAME_DATA_CHUNK bytes);
+ *               NULL se nenhuma compressão foi pedida
+ * @param len Recebe os bytes entregues em buffer
+ * @param left Bytes do quadro ainda não recebidos (atualizado)
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - Quadros crus maiores que o buffer chegam em partes; quadros
+ *   comprimidos chegam inteiros, pois o codec precisa de todo o payload
+ */
+int receive_data(SOCKET s, const frame_header_t *h, uint8_t *buffer, uint8_t *packed, size_t *len, uint64_t *left) {
+    if (h->flags & FLAG_COMPRESSED) {
+        if (packed == NULL || proto_recv_packed(s, h, packed, buffer, len) != 0) return -1;
+        *left = 0;
+        return 0;
+    }
+    *len = *left < FRAME_DATA_CHUNK ? (size_t)*left : FRAME_DATA_CHUNK;
+    if (net_recv_all(s, buffer, *len) != 0) return -1;
+    *left -= *len;
+    return 0;
+}
+
+/**
+ * Encerra os quadros DATA de um pedido com o resumo dos bytes enviados
+ *
+ * @return 0 em caso de sucesso, -1 se a conexão falhou
+ *
+ * Por que foi feito:
+ * - O servidor confere o resumo antes de aceitar os dados; o resumo é
+ *   calculado sobre os bytes originais enquanto eles são enviados, sem
+ *   uma segunda leitura do arquivo
+ */
+int send_digest(SOCKET s, uint32_t request_id, const checksum_t *sum) {
+    uint8_t digest[CHECKSUM_SIZE];
+    checksum_final(sum, digest);
+    return proto_send_frame(s, OP_DATA, FLAG_END | FLAG_DIGEST, request_id, digest, sizeof(digest));
+}
+
+/**
+ * Calcula o id de upload retomável de um arquivo local
+ *
+ * Por que foi feito:
+ * - O id depende só do nome, do tamanho e da data de modificação, então
+ *   o mesmo upload é reconhecido mesmo depois de reiniciar o cliente, e
+ *   um arquivo alterado gera um upload novo
+ */
+uint64_t upload_id_for(const char *filename, uint64_t size, int64_t mtime) {
+    uint64_t hash = 0xcbf29ce484222325ull;  // FNV-1a de 64 bits
+    uint8_t numbers[16];
+
+    put_u64(numbers, size);
+    put_u64(numbers + 8, (uint64_t)mtime);
+    for (const char *p = filename; *p; p++) hash = (hash ^ (uint8_t)*p) * 0x100000001b3ull;
+    for (size_t i = 0; i < sizeof(numbers); i++) hash = (hash ^ numbers[i]) * 0x100000001b3ull;
+    return hash ? hash : 1;
+}
+
+/**
+ * Transferência pela biblioteca de pedidos: progresso, resultado e, nas
+ * transferências paralelas, os blocos
+ */
+typedef struct {
+    mutex_t lock;               // Protege os campos abaixo
+    cond_t finished;            // Um pedido terminou
+    int running;                // Pedidos em andamento
+    uint64_t size;              // Tamanho do arquivo (para o progresso)
+    uint64_t transferred;       // Bytes concluídos
+    int status;                 // BFS_* da primeira falha (BFS_OK: nenhuma)
+    uint16_t code;              // Código ERR_* da primeira falha
+    char message[BUFFER_SIZE];  // Motivo da falha ou resposta do servidor
+    FILE *file;                 // Download sequencial: arquivo parcial
+
+    bfs_client_t *node;         // Nó dono do nome (transferência paralela)
+    int upload;                 // 1 para upload, 0 para download
+    const char *path;           // Arquivo local (origem do upload)
+    const char *filename;       // Nome do arquivo no servidor
+    int fd;                     // Destino do download
+    uint64_t upload_id;         // Id do upload (só no upload)
+    const char *done_path;      // Registro dos blocos baixados (só no download)
+    uint8_t *done;              // 1 para cada bloco já concluído
+    uint32_t *crcs;             // CRC32C de cada bloco baixado (só no download)
+    uint64_t chunk_count;
+    uint64_t next_chunk;        // Próximo bloco a pedir
+} transfer_t;
+
+/**
+ * Prepara o estado de uma transferência
+ */
+void transfer_init(transfer_t *t, uint64_t size) {
+    memset(t, 0, sizeof(*t));
+    mutex_init(&t->lock);
+    cond_init(&t->finished);
+    t->size = size;
+    t->status = BFS_OK;
+    t->fd = -1;
+}
+
+/**
+ * Libera o estado de uma transferência
+ */
+void transfer_destroy(transfer_t *t) {
+    mutex_destroy(&t->lock);
+    cond_destroy(&t->finished);
+    free(t->done);
+    free(t->crcs);
+}
+
+/**
+ * Guarda o resultado de um pedido; só a primeira falha fica registrada
+ */
+void transfer_record(transfer_t *t, const bfs_result_t *r) {
+    mutex_lock(&t->lock);
+    if (t->status == BFS_OK) {
+        t->status = r->status;
+        t->code = r->code;
+        snprintf(t->message, sizeof(t->message), "%s", r->message);
+    }
+    mutex_unlock(&t->lock);
+}
+
+/**
+ * Conta um pedido concluído e acorda quem espera a transferência
+ */
+void transfer_leave(transfer_t *t) {
+    mutex_lock(&t->lock);
+    t->running--;
+    cond_signal(&t->finished);
+    mutex_unlock(&t->lock);
+}
+
+/**
+ * Conclui o pedido de uma transferência sequencial (thread da conexão)
+ */
+void transfer_done(void *ctx, const bfs_result_t *r) {
+    transfer_record((transfer_t *)ctx, r);
+    transfer_leave((transfer_t *)ctx);
+}
+
+/**
+ * Soma ao progresso os bytes enviados ou recebidos (thread da conexão)
+ */
+int transfer_progress(void *ctx, const uint8_t *data, size_t len) {
+    transfer_t *t = (transfer_t *)ctx;
+    (void)data;
+    mutex_lock(&t->lock);
+    t->transferred += len;
+    mutex_unlock(&t->lock);
+    return 0;
+}
+
+/**
+ * Anexa um trecho de um download sequencial ao arquivo parcial
+ */
+int transfer_append(void *ctx, const uint8_t *data, size_t len) {
+    transfer_t *t = (transfer_t *)ctx;
+    if (fwrite(data, 1, len, t->file) != len) return -1;
+    return transfer_progress(ctx, data, len);
+}
+
+/**
+ * Aguarda os pedidos de uma transferência exibindo o progresso
+ *
+ * @return 1 se todos concluíram, 0 se algum foi recusado (motivo em
+ *         t->message), -1 se a conexão com o servidor foi perdida
+ *
+ * Por que foi feito:
+ * - Os pedidos andam nas threads da biblioteca; a thread do menu só
+ *   acompanha o progresso, uma vez a cada 100 ms
+ */
+int transfer_wait(transfer_t *t) {
+    mutex_lock(&t->lock);
+    while (1) {
+        int running = t->running;
+        uint64_t transferred = t->transferred;
+        mutex_unlock(&t->lock);
+
+        int progress = t->size > 0 ? (int)((transferred * 100) / t->size) : 100;
+        show_progress(progress > 100 ? 100 : progress);
+
+        mutex_lock(&t->lock);
+        if (running == 0) break;
+        if (t->running > 0) cond_wait_ms(&t->finished, &t->lock, 100);
+    }
+    int status = t->status;
+    mutex_unlock(&t->lock);
+    return status == BFS_OK ? 1 : status == BFS_REFUSED ? 0 : -1;
+}
+
+/**
+ * Consulta quantos bytes de um upload o servidor já tem
+ *
+ * @param held Recebe a posição de onde continuar (0 se o upload não existe)
+ * @return 0 em caso de sucesso, -1 se a conexão foi perdida
+ */
+int upload_status(bfs_client_t *node, uint64_t upload_id, uint64_t size, const char *filename, uint64_t *held) {
+    bfs_future_t f;
+
+    bfs_future_init(&f);
+    bfs_upload_status(node, upload_id, size, filename, bfs_future_done, &f);
+    const bfs_result_t *r = bfs_future_wait(&f);
+    *held = r->status == BFS_OK ? r->size : 0;
+    return r->status == BFS_FAILED ? -1 : 0;
+}
+
+/**
+ * Envia um arquivo ao servidor, retomando após quedas de conexão
+ *
+ * @param path Caminho do arquivo local
+ * @param filename Nome do arquivo no servidor
+ * @return 1 para OK, 0 se o servidor recusou, -1 se não foi possível
+ *         reconectar
+ *
+ * Por que foi feito:
+ * - Antes de enviar, pergunta ao servidor quantos bytes ele já tem deste
+ *   upload; após uma queda, a biblioteca reconecta e o envio continua do
+ *   ponto que o servidor informar
+ */
+int upload_file(const char *path, const char *filename, char *message, size_t message_size) {
+    int64_t size = file_size(path);
+    bfs_client_t *node = bfs_cluster_route(transfers, filename);
+    int result = -1;
+
+    if (size < 0) {
+        snprintf(message, message_size, "Arquivo não encontrado: %s", path);
+        return 0;
+    }
+    uint64_t upload_id = upload_id_for(filename, (uint64_t)size, file_mtime(path));
+
+    printf("\nEnviando %s (Tamanho: %lld bytes)\n", filename, (long long)size);
+    for (int attempt = 0; attempt <= CLIENT_RETRIES; attempt++) {
+        transfer_t t;
+        uint64_t offset = 0;
+
+        if (upload_status(node, upload_id, (uint64_t)size, filename, &offset) != 0) {
+            result = -1;
+            break;
+        }
+        if (offset > 0) printf("Retomando a partir do byte %llu.\n", (unsigned long long)offset);
+        transfer_init(&t, (uint64_t)size);
+        t.transferred = offset;
+        t.running = 1;
+        bfs_put_resume(node, path, filename, upload_id, offset, transfer_progress, transfer_done, &t);
+        result = transfer_wait(&t);
+        uint16_t code = t.code;
+        snprintf(message, message_size, "%s", t.message);
+        transfer_destroy(&t);
+
+        if (result == 0 && code == ERR_BUSY) {
+            // A conexão antiga ainda não foi encerrada no servidor
+            sleep_ms(RETRY_DELAY_MS);
+            continue;
+        }
+        if (result == 0 && code == ERR_CHECKSUM) {
+            // Bytes corrompidos no caminho: o servidor descartou o upload
+            printf("\n%s Enviando de novo.\n", message);
+            continue;
+        }
+        if (result >= 0) break;
+        printf("\nConexão perdida. Retomando (tentativa %d de %d)...\n", attempt + 1, CLIENT_RETRIES);
+    }
+    return result;
+}
+
+/**
+ * Calcula o CRC32C do início de um arquivo local
+ *
+ * @param length Bytes a ler a partir do início
+ * @return 0 em caso de sucesso, -1 em caso de erro de leitura
+ */
+int file_crc_prefix(const char *path, uint64_t length, uint32_t *crc) {
+    uint8_t *buf = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, NULL);
+    int fd = buf != NULL ? file_open_read(path) : -1;
+    uint64_t done = 0;
+
+    *crc = 0;
+    while (fd >= 0 && done < length) {
+        size_t want = length - done < FRAME_DATA_CHUNK ? (size_t)(length - done) : FRAME_DATA_CHUNK;
+        if (file_pread(fd, buf, want, done) != (int64_t)want) break;
+        *crc = crc32c(*crc, buf, want);
+        done += want;
+    }
+    if (fd >= 0) file_close(fd);
+    bufpool_free(buf, FRAME_DATA_CHUNK, NULL);
+    return done == length ? 0 : -1;
+}
+
+/**
+ * Baixa um arquivo do servidor, retomando após quedas de conexão
+ *
+ * @param full_path Caminho local de destino
+ * @param size Tamanho do arquivo no servidor (para o progresso)
+ * @return 1 para OK, 0 se o servidor recusou, -1 se não foi possível
+ *         reconectar
+ *
+ * Por que foi feito:
+ * - Os bytes recebidos ficam em "<destino>.part"; depois de uma queda (ou
+ *   de reiniciar o cliente) o download pede ao servidor só o intervalo
+ *   que falta e o arquivo final aparece apenas quando está completo
+ * - O CRC32C do trecho que já estava no disco (lido uma vez, só ao
+ *   retomar) é combinado com o dos bytes novos e conferido com o resumo
+ *   do servidor
+ */
+int download_file(const char *filename, const char *full_path, uint64_t size) {
+    char part_path[MAX_PATH * 2 + 8];
+    bfs_client_t *node = bfs_cluster_route(transfers, filename);
+    int result = -1;
+
+    snprintf(part_path, sizeof(part_path), "%s.part", full_path);
+    for (int attempt = 0; attempt <= CLIENT_RETRIES; attempt++) {
+        transfer_t t;
+        int64_t held = file_size(part_path);
+        uint64_t offset = held > 0 ? (uint64_t)held : 0;
+        uint32_t crc = 0;
+
+        if (offset > 0 && file_crc_prefix(part_path, offset, &crc) != 0) offset = 0;
+        if (offset > 0) printf("Retomando a partir do byte %llu.\n", (unsigned long long)offset);
+        transfer_init(&t, size);
+        if ((t.file = fopen(part_path, offset > 0 ? "ab" : "wb")) == NULL) {
+            printf("Erro ao criar arquivo.\n");
+            transfer_destroy(&t);
+            return 0;
+        }
+        t.transferred = offset;
+        t.running = 1;
+        bfs_get_range(node, filename, offset, 0, crc, transfer_append, transfer_done, &t);
+        result = transfer_wait(&t);
+        if (fclose(t.file) != 0 && result == 1) {
+            snprintf(t.message, sizeof(t.message), "Erro ao gravar arquivo.");
+            result = 0;
+        }
+        uint16_t code = t.code;
+        if (result == 0 && code != ERR_RANGE && code != ERR_CHECKSUM) printf("\n%s\n", t.message);
+        transfer_destroy(&t);
+
+        if (result == 0 && (code == ERR_RANGE || code == ERR_CHECKSUM)) {
+            // O arquivo parcial não corresponde ao do servidor: recomeça
+            printf("\nResumo do arquivo não confere; baixando de novo.\n");
+            remove(part_path);
+            result = 2;
+            continue;
+        }
+        if (result >= 0) break;
+        printf("\nConexão perdida. Retomando (tentativa %d de %d)...\n", attempt + 1, CLIENT_RETRIES);
+    }
+
+    if (result == 2) {
+        // Todas as tentativas chegaram diferentes do arquivo do servidor
+        printf("Não foi possível obter uma cópia íntegra do arquivo.\n");
+        remove(part_path);
+        result = 0;
+    }
+    int64_t received = result == 1 ? file_size(part_path) : -1;
+    if (result == 1 && file_replace(part_path, full_path) != 0) {
+        printf("Erro ao criar arquivo.\n");
+        result = 0;
+    }
+    if (result == 1) printf("\nTotal recebido: %lld bytes\n", (long long)received);
+    return result;
+}
+
+/*--------------------------------------------------------------
+ * TRANSFERÊNCIAS PARALELAS EM BLOCOS
+ *------------------------------------------------------------*/
+
+/**
+ * Um bloco de um download paralelo em andamento
+ */
+typedef struct {
+    transfer_t *transfer;
+    uint64_t index;
+    uint64_t offset;            // Posição do próximo byte no arquivo parcial
+} chunk_get_t;
+
+void parallel_issue(transfer_t *t);
+
+/**
+ * Anota um bloco baixado no registro do download paralelo
+ *
+ * Por que foi feito:
+ * - Com escrita posicional o tamanho do arquivo parcial não diz quais
+ *   blocos já chegaram; o registro permite retomar depois de reiniciar
+ *   o cliente sem baixar de novo o que já está no disco
+ * - O CRC32C de cada bloco fica no registro, então o resumo do arquivo
+ *   inteiro é conferido no fim sem reler os blocos de antes da queda
+ */
+void parallel_record(transfer_t *t, uint64_t index, uint32_t crc) {
+    uint8_t record[12];
+    put_u64(record, index);
+    put_u32(record + 8, crc);
+
+    mutex_lock(&t->lock);
+    t->crcs[index] = crc;
+    FILE *file = fopen(t->done_path, "ab");
+    if (file != NULL) {
+        fwrite(record, 1, sizeof(record), file);
+        fclose(file);
+    }
+    mutex_unlock(&t->lock);
+}
+
+/**
+ * Conclui o envio de um bloco e pede o próximo (thread da conexão)
+ */
+void chunk_sent(void *ctx, const bfs_result_t *r) {
+    transfer_t *t = (transfer_t *)ctx;
+    transfer_record(t, r);
+    parallel_issue(t);
+    transfer_leave(t);
+}
+
+/**
+ * Grava um trecho de um bloco baixado na sua posição do arquivo parcial
+ */
+int chunk_write(void *ctx, const uint8_t *data, size_t len) {
+    chunk_get_t *c = (chunk_get_t *)ctx;
+    io_vec_t iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    if (file_pwritev(c->transfer->fd, &iov, 1, c->offset) != 0) return -1;
+    c->offset += len;
+    return transfer_progress(c->transfer, data, len);
+}
+
+/**
+ * Conclui o download de um bloco e pede o próximo (thread da conexão)
+ *
+ * Por que foi feito:
+ * - O bloco só entra no registro se o arquivo do servidor ainda tem o
+ *   tamanho usado para dividi-lo
+ */
+void chunk_received(void *ctx, const bfs_result_t *r) {
+    chunk_get_t *c = (chunk_get_t *)ctx;
+    transfer_t *t = c->transfer;
+    bfs_result_t changed;
+
+    if (r->status == BFS_OK && r->size != t->size) {
+        changed = *r;
+        changed.status = BFS_REFUSED;
+        snprintf(changed.message, sizeof(changed.message), "O arquivo mudou no servidor durante o download.");
+        r = &changed;
+    }
+    if (r->status == BFS_OK) parallel_record(t, c->index, r->crc);
+    transfer_record(t, r);
+    free(c);
+    parallel_issue(t);
+    transfer_leave(t);
+}
+
+/**
+ * Pede o próximo bloco pendente, se ainda há algum
+ *
+ * Por que foi feito:
+ * - Cada pedido concluído puxa o seguinte, então há sempre config.streams
+ *   blocos em andamento; o cliente das transferências tem uma conexão por
+ *   bloco (janela 1), e cada uma usa a sua própria janela TCP
+ * - Depois de uma falha nenhum bloco novo é pedido
+ */
+void parallel_issue(transfer_t *t) {
+    uint64_t index = 0;
+    int found = 0;
+
+    mutex_lock(&t->lock);
+    while (t->next_chunk < t->chunk_count && t->done[t->next_chunk]) t->next_chunk++;
+    if (t->status == BFS_OK && t->next_chunk < t->chunk_count) {
+        index = t->next_chunk++;
+        t->running++;
+        found = 1;
+    }
+    mutex_unlock(&t->lock);
+    if (!found) return;
+
+    uint64_t offset = index * config.chunk_size;
+    uint64_t length = t->size - offset < config.chunk_size ? t->size - offset : config.chunk_size;
+    if (t->upload) {
+        bfs_put_chunk(t->node, t->path, t->filename, t->upload_id, offset, length, transfer_progress, chunk_sent, t);
+        return;
+    }
+    chunk_get_t *c = (chunk_get_t *)malloc(sizeof(chunk_get_t));
+    if (c == NULL) {
+        bfs_result_t r;
+        memset(&r, 0, sizeof(r));
+        r.status = BFS_REFUSED;
+        snprintf(r.message, sizeof(r.message), "Memória insuficiente.");
+        transfer_record(t, &r);
+        transfer_leave(t);
+        return;
+    }
+    c->transfer = t;
+    c->index = index;
+    c->offset = offset;
+    bfs_get_range(t->node, t->filename, offset, length, 0, chunk_write, chunk_received, c);
+}
+
+/**
+ * Executa a transferência com config.streams blocos em andamento e exibe
+ * o progresso total
+ *
+ * @return 1 se todos os blocos foram concluídos, 0 se algum falhou (motivo
+ *         em t->message), -1 se a conexão com o servidor foi perdida
+ */
+int parallel_run(transfer_t *t) {
+    for (int i = 0; i < config.streams; i++) parallel_issue(t);
+    int result = transfer_wait(t);
+    printf("\n");
+    return result;
+}
+
+/**
+ * Prepara o estado de uma transferência paralela
+ *
+ * @return 0 em caso de sucesso, -1 se faltou memória
+ */
+int parallel_init(transfer_t *t, int upload, const char *filename, uint64_t size) {
+    transfer_init(t, size);
+    t->node = bfs_cluster_route(transfers, filename);
+    t->upload = upload;
+    t->filename = filename;
+    t->chunk_count = (size + config.chunk_size - 1) / config.chunk_size;
+    t->done = (uint8_t *)calloc((size_t)t->chunk_count, 1);
+    t->crcs = upload ? NULL : (uint32_t *)calloc((size_t)t->chunk_count, sizeof(uint32_t));
+    if (t->done == NULL || (!upload && t->crcs == NULL)) {
+        transfer_destroy(t);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Envia um arquivo por várias conexões, em blocos
+ *
+ * @param path Caminho do arquivo local
+ * @param filename Nome do arquivo no servidor
+ * @return 1 para OK, 0 se a transferência falhou, -1 se a conexão com o
+ *         servidor foi perdida
+ *
+ * Por que foi feito:
+ * - Arquivos pequenos (menos de dois blocos) ou com uma só conexão
+ *   configurada seguem pelo upload sequencial
+ * - Os blocos que o servidor já tem sem lacunas desde o início do arquivo
+ *   são pulados, então um upload paralelo interrompido é retomado
+ * - O arquivo só ganha o nome final com UPLOAD_COMMIT, depois do OK de
+ *   todos os blocos
+ */
+int parallel_upload(const char *path, const char *filename, char *message, size_t message_size) {
+    int64_t size = file_size(path);
+    transfer_t t;
+    uint64_t held = 0;
+
+    if (config.streams <= 1 || size < 0 || (uint64_t)size < 2 * config.chunk_size) {
+        return upload_file(path, filename, message, message_size);
+    }
+    if (parallel_init(&t, 1, filename, (uint64_t)size) != 0) {
+        snprintf(message, message_size, "Memória insuficiente.");
+        return 0;
+    }
+    t.path = path;
+    t.upload_id = upload_id_for(filename, (uint64_t)size, file_mtime(path));
+
+    // Blocos que o servidor já tem desde o início do arquivo
+    if (upload_status(t.node, t.upload_id, (uint64_t)size, filename, &held) != 0) {
+        transfer_destroy(&t);
+        return -1;
+    }
+    for (uint64_t i = 0; i < t.chunk_count && (i + 1) * config.chunk_size <= held; i++) {
+        t.done[i] = 1;
+        t.transferred += config.chunk_size;
+    }
+
+    printf("\nEnviando %s (Tamanho: %lld bytes, %d conexões, blocos de %llu MB)\n", filename,
+           (long long)size, config.streams, (unsigned long long)(config.chunk_size / (1024 * 1024)));
+    if (t.transferred > 0) printf("Retomando a partir do byte %llu.\n", (unsigned long long)t.transferred);
+    int result = parallel_run(&t);
+
+    if (result == 1) {
+        // Todos os blocos confirmados: pede o nome final
+        bfs_future_t f;
+        bfs_future_init(&f);
+        bfs_commit_upload(t.node, t.upload_id, bfs_future_done, &f);
+        const bfs_result_t *r = bfs_future_wait(&f);
+        snprintf(message, message_size, "%s", r->message);
+        result = r->status == BFS_OK ? 1 : r->status == BFS_REFUSED ? 0 : -1;
+    } else {
+        snprintf(message, message_size, "%s", t.message);
+    }
+    transfer_destroy(&t);
+    return result;
+}
+
+/**
+ * Lê o registro de blocos de um download paralelo interrompido
+ *
+ * @return 0 se o registro vale para este arquivo, -1 caso contrário
+ */
+int load_download_record(transfer_t *t) {
+    uint8_t record[16];
+    FILE *file = fopen(t->done_path, "rb");
+    int valid = 0;
+
+    // Cabeçalho: tamanho do arquivo e tamanho dos blocos; depois, índice e
+    // CRC32C de cada bloco concluído
+    if (file != NULL && fread(record, 1, 16, file) == 16 &&
+        get_u64(record) == t->size && get_u64(record + 8) == config.chunk_size) {
+        valid = 1;
+        while (fread(record, 1, 12, file) == 12) {
+            uint64_t index = get_u64(record);
+            if (index < t->chunk_count && !t->done[index]) {
+                t->done[index] = 1;
+                t->crcs[index] = get_u32(record + 8);
+                t->transferred += index + 1 == t->chunk_count ? t->size - index * config.chunk_size
+                                                                : config.chunk_size;
+            }
+        }
+    }
+    if (file != NULL) fclose(file);
+    return valid ? 0 : -1;
+}
+
+/**
+ * Baixa um arquivo por várias conexões, em blocos
+ *
+ * @param full_path Caminho local de destino
+ * @return 1 para OK, 0 se a transferência falhou, -1 se a conexão com o
+ *         servidor foi perdida
+ *
+ * Por que foi feito:
+ * - STAT informa o tamanho antes de dividir o arquivo; arquivos pequenos
+ *   (menos de dois blocos) ou com uma só conexão configurada seguem pelo
+ *   download sequencial
+ * - Cada bloco é um intervalo pedido ao servidor, gravado na sua posição
+ *   em "<destino>.part", pré-alocado com o tamanho final
+ * - "<destino>.part.done" registra os blocos concluídos para retomar
+ *   depois de reiniciar o cliente
+ */
+int parallel_download(const char *filename, const char *full_path) {
+    char part_path[MAX_PATH * 2 + 8];
+    char done_path[MAX_PATH * 2 + 16];
+    transfer_t t;
+    list_entry_t entry;
+    bfs_future_t f;
+
+    bfs_future_init(&f);
+    bfs_stat(bfs_cluster_route(transfers, filename), filename, bfs_future_done, &f);
+    const bfs_result_t *r = bfs_future_wait(&f);
+    if (r->status != BFS_OK) {
+        if (r->status == BFS_REFUSED) printf("%s\n", r->message);
+        return r->status == BFS_REFUSED ? 0 : -1;
+    }
+    entry = *r->entry;
+    uint64_t size = entry.size;
+    if (config.streams <= 1 || size < 2 * config.chunk_size) return download_file(filename, full_path, size);
+
+    snprintf(part_path, sizeof(part_path), "%s.part", full_path);
+    snprintf(done_path, sizeof(done_path), "%s.part.done", full_path);
+    if (parallel_init(&t, 0, filename, size) != 0) {
+        printf("Memória insuficiente.\n");
+        return 0;
+    }
+    t.done_path = done_path;
+
+    // Sem registro válido, recomeça do zero
+    if (load_download_record(&t) != 0) {
+        uint8_t header[16];
+        FILE *file;
+        put_u64(header, size);
+        put_u64(header + 8, config.chunk_size);
+        remove(part_path);
+        if ((file = fopen(done_path, "wb")) != NULL) {
+            fwrite(header, 1, sizeof(header), file);
+            fclose(file);
+        }
+    }
+    t.fd = file_open_write(part_path, 0);
+    if (t.fd < 0 || file_preallocate(t.fd, size) != 0) {
+        printf("Erro ao criar arquivo.\n");
+        if (t.fd >= 0) file_close(t.fd);
+        transfer_destroy(&t);
+        return 0;
+    }
+
+    printf("%d conexões, blocos de %llu MB\n", config.streams,
+           (unsigned long long)(config.chunk_size / (1024 * 1024)));
+    if (t.transferred > 0) printf("Retomando: %llu bytes já recebidos.\n", (unsigned long long)t.transferred);
+    int result = parallel_run(&t);
+    file_close(t.fd);
+
+    if (result == 1 && entry.hash_len >= CHECKSUM_CRC_SIZE) {
+        // CRC do arquivo inteiro combinado a partir dos CRCs dos blocos
+        uint32_t crc = 0;
+        for (uint64_t i = 0; i < t.chunk_count; i++) {
+            uint64_t length = i + 1 == t.chunk_count ? size - i * config.chunk_size : config.chunk_size;
+            crc = crc32c_combine(crc, t.crcs[i], length);
+        }
+        if (crc != checksum_crc(entry.hash)) {
+            snprintf(t.message, sizeof(t.message), "Resumo do arquivo não confere; download descartado.");
+            remove(part_path);
+            remove(done_path);
+            result = 0;
+        }
+    }
+    if (result == 1 && file_replace(part_path, full_path) != 0) {
+        printf("Erro ao criar arquivo.\n");
+        result = 0;
+    } else if (result == 1) {
+        remove(done_path);
+        printf("Total recebido: %llu bytes\n", (unsigned long long)size);
+    } else if (result == 0) {
+        printf("%s\n", t.message);
+    }
+    transfer_destroy(&t);
+    return result;
+}
+
+/*--------------------------------------------------------------
+ * UPLOAD DEDUPLICADO (ARMAZENAMENTO POR CONTEÚDO)
+ *------------------------------------------------------------*/
+
+/**
+ * Divide um arquivo local em blocos definidos pelo conteúdo
+ *
+ * @param m Recebe o tamanho e os blocos (hash, tamanho e posição)
+ * @return 0 em caso de sucesso, -1 em caso de erro de leitura ou memória
+ *
+ * Por que foi feito:
+ * - As fronteiras dependem só do conteúdo, então um arquivo com poucas
+ *   alterações produz quase os mesmos blocos de uma versão anterior
+ */
+int chunk_local_file(int fd, uint64_t size, manifest_t *m) {
+    cdc_t cdc;
+    uint32_t cap = 0;
+    size_t filled = 0;
+    uint64_t read_pos = 0, offset = 0;
+    uint8_t *buffer = (uint8_t *)bufpool_alloc(CDC_MAX_SIZE, NULL);
+
+    memset(m, 0, sizeof(*m));
+    if (buffer == NULL) return -1;
+    cdc_init(&cdc);
+
+    while (offset < size) {
+        // Mantém o buffer cheio: cdc_cut só aceita menos que o máximo no fim do arquivo
+        size_t want = CDC_MAX_SIZE - filled;
+        if (want > size - read_pos) want = (size_t)(size - read_pos);
+        int64_t got = want > 0 ? file_pread(fd, buffer + filled, want, read_pos) : 0;
+        if (got < 0 || (size_t)got != want) break;
+        filled += want;
+        read_pos += want;
+
+        if (m->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            chunk_ref_t *grown = (chunk_ref_t *)realloc(m->refs, cap * sizeof(chunk_ref_t));
+            if (grown == NULL) break;
+            m->refs = grown;
+        }
+        size_t cut = cdc_cut(&cdc, buffer, filled);
+        chunk_ref_t *ref = &m->refs[m->count++];
+        sha256(buffer, cut, ref->hash);
+        ref->length = (uint32_t)cut;
+        ref->offset = offset;
+        offset += cut;
+        memmove(buffer, buffer + cut, filled - cut);
+        filled -= cut;
+    }
+    bufpool_free(buffer, CDC_MAX_SIZE, NULL);
+    if (offset != size) {
+        manifest_free(m);
+        return -1;
+    }
+    m->size = size;
+    return 0;
+}
+
+/**
+ * Pergunta ao servidor quais blocos ele ainda não tem
+ *
+ * @param missing Recebe 1 para cada bloco ausente no servidor
+ * @param code Recebe o código de erro quando o servidor recusa
+ * @return 1 em caso de sucesso, 0 se o servidor recusou, -1 se a conexão falhou
+ */
+int query_missing_chunks(SOCKET s, const manifest_t *m, uint8_t *missing,
+                         char *message, size_t message_size, uint16_t *code) {
+    uint8_t *request = (uint8_t *)malloc(4 + (size_t)CHUNK_QUERY_MAX * SHA256_SIZE);
+    uint8_t bitmap[(CHUNK_QUERY_MAX + 7) / 8 + 1];
+    int result = 1;
+
+    if (request == NULL) return -1;
+    for (uint32_t first = 0; first < m->count && result == 1; first += CHUNK_QUERY_MAX) {
+        uint32_t count = m->count - first < CHUNK_QUERY_MAX ? m->count - first : CHUNK_QUERY_MAX;
+        uint32_t id = next_request_id();
+
+        put_u32(request, count);
+        for (uint32_t i = 0; i < count; i++) {
+            memcpy(request + 4 + (size_t)i * SHA256_SIZE, m->refs[first + i].hash, SHA256_SIZE);
+        }
+        if (proto_send_frame(s, OP_CHUNK_QUERY, 0, id, request, 4 + (size_t)count * SHA256_SIZE) != 0) {
+            result = -1;
+            break;
+        }
+        result = receive_reply(s, id, (char *)bitmap, sizeof(bitmap), code);
+        if (result == 0) snprintf(message, message_size, "%s", (char *)bitmap);
+        for (uint32_t i = 0; i < count && result == 1; i++) {
+            missing[first + i] = (bitmap[i / 8] >> (i % 8)) & 1;
+        }
+    }
+    free(request);
+    return result;
+}
+
+/**
+ * Ordena índices de blocos pelo hash (para achar repetições no arquivo)
+ */
+static const manifest_t *sort_manifest;
+
+int compare_chunk_hashes(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    int c = memcmp(sort_manifest->refs[x].hash, sort_manifest->refs[y].hash, SHA256_SIZE);
+    return c != 0 ? c : (x > y) - (x < y);
+}
+
+/**
+ * Desmarca blocos ausentes que se repetem dentro do próprio arquivo
+ *
+ * Por que foi feito:
+ * - Um bloco que aparece várias vezes só precisa ser enviado uma vez;
+ *   ordenar os índices pelo hash acha as repetições em O(n log n)
+ */
+void skip_repeated_chunks(const manifest_t *m, uint8_t *missing) {
+    uint32_t *order = (uint32_t *)malloc((m->count ? m->count : 1) * sizeof(uint32_t));
+    if (order == NULL) return;
+    for (uint32_t i = 0; i < m->count; i++) order[i] = i;
+    sort_manifest = m;
+    qsort(order, m->count, sizeof(uint32_t), compare_chunk_hashes);
+    for (uint32_t i = 1; i < m->count; i++) {
+        if (memcmp(m->refs[order[i]].hash, m->refs[order[i - 1]].hash, SHA256_SIZE) == 0) missing[order[i]] = 0;
+    }
+    free(order);
+}
+
+/**
+ * Envia um bloco ao armazenamento por conteúdo
+ *
+ * @param buffer Buffer com CDC_MAX_SIZE bytes
+ * @param packed Área para quadros comprimidos (FRAME_DATA_CHUNK bytes)
+ * @return 1 para OK, 0 para ERROR, -1 se a conexão falhou
+ */
+int send_content_chunk(SOCKET s, int fd, const chunk_ref_t *ref, uint8_t *buffer, uint8_t *packed, int codec,
+                       char *message, size_t message_size) {
+    uint8_t request[SHA256_SIZE + 8];
+    uint32_t id = next_request_id();
+
+    if (file_pread(fd, buffer, ref->length, ref->offset) != (int64_t)ref->length) {
+        snprintf(message, message_size, "Erro ao ler o arquivo local.");
+        return 0;
+    }
+    memcpy(request, ref->hash, SHA256_SIZE);
+    put_u64(request + SHA256_SIZE, ref->length);
+    if (proto_send_frame(s, OP_CHUNK_PUT, 0, id, request, sizeof(request)) != 0) return -1;
+    checksum_t sum;
+    checksum_init(&sum);
+    for (uint32_t sent = 0; sent < ref->length;) {
+        uint32_t len = ref->length - sent < FRAME_DATA_CHUNK ? ref->length - sent : FRAME_DATA_CHUNK;
+        checksum_update(&sum, buffer + sent, len);
+        if (proto_send_data(s, 0, id, buffer + sent, len, codec, packed) != 0) return -1;
+        sent += len;
+    }
+    if (send_digest(s, id, &sum) != 0) return -1;
+    return receive_reply(s, id, message, message_size, NULL);
+}
+
+/**
+ * Envia o manifesto que dá nome ao arquivo
+ *
+ * @return 1 para OK, 0 para ERROR, -1 se a conexão falhou
+ */
+int send_manifest(SOCKET s, const char *filename, const manifest_t *m, char *message, size_t message_size) {
+    uint8_t request[12 + PROTO_MAX_NAME];
+    size_t name_len = strlen(filename);
+    uint32_t id = next_request_id();
+    size_t per_frame = FRAME_DATA_CHUNK / MANIFEST_REF_SIZE;
+    uint8_t *refs = (uint8_t *)malloc(per_frame * MANIFEST_REF_SIZE);
+
+    if (refs == NULL) return -1;
+    put_u64(request, m->size);
+    put_u32(request + 8, m->count);
+    memcpy(request + 12, filename, name_len);
+    int failed = proto_send_frame(s, OP_MANIFEST_PUT, 0, id, request, 12 + name_len) != 0;
+
+    // Lista de blocos em quadros DATA; um manifesto vazio leva um quadro vazio
+    uint32_t next = 0;
+    while (!failed) {
+        size_t count = m->count - next < per_frame ? m->count - next : per_frame;
+        for (size_t i = 0; i < count; i++) manifest_encode_ref(refs + i * MANIFEST_REF_SIZE, &m->refs[next + i]);
+        next += (uint32_t)count;
+        uint16_t flags = next == m->count ? FLAG_END : 0;
+        failed = proto_send_frame(s, OP_DATA, flags, id, refs, count * MANIFEST_REF_SIZE) != 0;
+        if (flags & FLAG_END) break;
+    }
+    free(refs);
+    if (failed) return -1;
+    return receive_reply(s, id, message, message_size, NULL);
+}
+
+/**
+ * Envia só os blocos que o servidor não tem e depois o manifesto
+ *
+ * @param code Recebe o código de erro quando o servidor recusa
+ * @return 1 para OK, 0 se o servidor recusou, -1 se a conexão falhou
+ */
+int send_deduplicated(SOCKET s, int fd, const char *filename, const manifest_t *m,
+                      char *message, size_t message_size, uint16_t *code) {
+    uint8_t *missing = (uint8_t *)malloc(m->count ? m->count : 1);
+    uint8_t *buffer = (uint8_t *)bufpool_alloc(CDC_MAX_SIZE, NULL);
+    uint8_t *packed = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, NULL);
+    uint64_t sent_bytes = 0, sent_chunks = 0;
+    int result = -1;
+
+    if (missing != NULL && buffer != NULL && packed != NULL) {
+        result = query_missing_chunks(s, m, missing, message, message_size, code);
+    }
+    if (result == 1) {
+        int codec = upload_codec(fd, 0, m->size, buffer);
+        skip_repeated_chunks(m, missing);
+        for (uint32_t i = 0; i < m->count && result == 1; i++) {
+            if (!missing[i]) continue;
+            result = send_content_chunk(s, fd, &m->refs[i], buffer, packed, codec, message, message_size);
+            sent_bytes += m->refs[i].length;
+            sent_chunks++;
+            show_progress(m->size > 0 ? (int)((m->refs[i].offset + m->refs[i].length) * 100 / m->size) : 100);
+        }
+    }
+    if (result == 1) {
+        printf("\nBlocos: %u no total, %llu enviados (%llu bytes), %llu bytes já estavam no servidor\n",
+               m->count, (unsigned long long)sent_chunks, (unsigned long long)sent_bytes,
+               (unsigned long long)(m->size - sent_bytes));
+        result = send_manifest(s, filename, m, message, message_size);
+    }
+    free(missing);
+    bufpool_free(buffer, CDC_MAX_SIZE, NULL);
+    bufpool_free(packed, FRAME_DATA_CHUNK, NULL);
+    return result;
+}
+
+/**
+ * Envia um arquivo ao armazenamento por conteúdo do servidor
+ *
+ * @param path Caminho do arquivo local
+ * @param filename Nome do arquivo no servidor
+ * @return 1 para OK, 0 se o servidor recusou, -1 se não foi possível
+ *         reconectar
+ *
+ * Por que foi feito:
+ * - Arquivos repetidos ou com poucas alterações transferem só os blocos
+ *   novos; depois de uma queda, os blocos já guardados são pulados
+ * - Servidores sem armazenamento por conteúdo recebem o upload normal
+ */
+int dedup_upload(SOCKET *s, const char *path, const char *filename, char *message, size_t message_size) {
+    int64_t size = file_size(path);
+    int fd = file_open_read(path);
+    manifest_t m;
+    uint16_t code = 0;
+    int result = 0;
+
+    if (fd < 0 || size < 0 || chunk_local_file(fd, (uint64_t)size, &m) != 0) {
+        if (fd >= 0) file_close(fd);
+        snprintf(message, message_size, "Arquivo não encontrado: %s", path);
+        return 0;
+    }
+
+    printf("\nEnviando %s (Tamanho: %lld bytes, %u blocos)\n", filename, (long long)size, m.count);
+    for (int attempt = 0; attempt <= CLIENT_RETRIES; attempt++) {
+        result = send_deduplicated(*s, fd, filename, &m, message, message_size, &code);
+        if (result >= 0) break;
+        if (reconnect(s) != 0) break;
+    }
+    manifest_free(&m);
+    file_close(fd);
+
+    if (result == 0 && code == ERR_UNSUPPORTED) {
+        printf("Servidor sem armazenamento por conteúdo; enviando o arquivo inteiro.\n");
+        return parallel_upload(path, filename, message, message_size);
+    }
+    return result;
+}
+
+/**
+ * Envia um arquivo pelo modo de upload configurado (-s)
+ *
+ * @return 1 para OK, 0 se o servidor recusou, -1 se a conexão foi perdida
+ *
+ * Por que foi feito:
+ * - O upload deduplicado usa a conexão principal, levada antes ao nó dono
+ *   do nome; os demais seguem pela biblioteca de pedidos
+ */
+int send_file(SOCKET *s, const char *path, const char *filename, char *message, size_t message_size) {
+    if (!config.dedup) return parallel_upload(path, filename, message, message_size);
+    if (route_name(s, filename) != 0) return -1;
+    return dedup_upload(s, path, filename, message, message_size);
+}
+
+/*--------------------------------------------------------------
+ * ATUALIZAÇÃO POR DIFERENÇAS
+ *------------------------------------------------------------*/
+
+/**
+ * Assinaturas em recepção pela biblioteca de pedidos
+ */
+typedef struct {
+    bfs_future_t future;        // Primeiro campo: é o contexto de bfs_future_done()
+    delta_signature_t *sig;
+    int64_t mtime;              // Data da cópia assinada
+    uint32_t received;          // Assinaturas já decodificadas
+    int invalid;                // Resposta fora do formato
+} signature_call_t;
+
+/**
+ * Lê o cabeçalho das assinaturas (thread da conexão)
+ *
+ * @return 1: os quadros DATA com as assinaturas seguem a resposta
+ */
+int signature_reply(void *ctx, const uint8_t *payload, size_t len) {
+    signature_call_t *call = (signature_call_t *)ctx;
+    delta_signature_t *sig = call->sig;
+
+    if (len != 24) {
+        call->invalid = 1;
+        return 0;
+    }
+    sig->size = get_u64(payload);
+    call->mtime = (int64_t)get_u64(payload + 8);
+    sig->block = get_u32(payload + 16);
+    sig->count = get_u32(payload + 20);
+    sig->sigs = (delta_sig_t *)malloc((sig->count ? sig->count : 1) * sizeof(delta_sig_t));
+    if (sig->sigs == NULL || sig->block == 0 || sig->block > DELTA_BLOCK_MAX) call->invalid = 1;
+    return 1;
+}
+
+/**
+ * Decodifica um quadro DATA de assinaturas (thread da conexão)
+ */
+int signature_data(void *ctx, const uint8_t *data, size_t len) {
+    signature_call_t *call = (signature_call_t *)ctx;
+
+    if (call->invalid || len % DELTA_SIG_SIZE != 0 || len / DELTA_SIG_SIZE > call->sig->count - call->received) {
+        call->invalid = 1;
+        return -1;
+    }
+    for (size_t off = 0; off < len; off += DELTA_SIG_SIZE) {
+        delta_sig_decode(data + off, &call->sig->sigs[call->received++]);
+    }
+    return 0;
+}
+
+/**
+ * Recebe as assinaturas da cópia de um arquivo no servidor
+ *
+ * @param mtime Recebe a data da cópia assinada (devolvida no pedido DELTA)
+ * @param code Recebe o código de erro quando o servidor recusa
+ * @return 1 em caso de sucesso, 0 se o servidor recusou, -1 se a conexão
+ *         falhou ou a resposta está fora do formato
+ */
+int request_signatures(bfs_client_t *node, const char *filename, delta_signature_t *sig, int64_t *mtime,
+                       char *message, size_t message_size, uint16_t *code) {
+    uint8_t request[4 + PROTO_MAX_NAME];
+    size_t name_len = strlen(filename);
+    signature_call_t call;
+
+    memset(sig, 0, sizeof(*sig));
+    memset(&call, 0, sizeof(call));
+    call.sig = sig;
+    put_u32(request, 0);
+    memcpy(request + 4, filename, name_len);
+    bfs_future_init(&call.future);
+    bfs_call(node, OP_SIGNATURES, request, 4 + name_len, signature_reply, signature_data, bfs_future_done, &call);
+    const bfs_result_t *r = bfs_future_wait(&call.future);
+
+    int result = r->status == BFS_OK ? 1 : r->status == BFS_REFUSED && !call.invalid ? 0 : -1;
+    if (result == 0) {
+        *code = r->code;
+        snprintf(message, message_size, "%s", r->message);
+    }
+    if (result == 1 && (call.invalid || call.received != sig->count || delta_signature_index(sig) != 0)) result = -1;
+    if (result != 1) delta_signature_free(sig);
+    *mtime = call.mtime;
+    return result;
+}
+
+/**
+ * Calcula e envia as diferenças entre o arquivo local e a cópia do servidor
+ *
+ * @param code Recebe o código de erro quando o servidor recusa
+ * @return 1 para OK, 0 se o servidor recusou, -1 se a conexão falhou
+ */
+int send_delta(bfs_client_t *node, int fd, const char *filename, uint64_t size,
+               char *message, size_t message_size, uint16_t *code) {
+    delta_signature_t sig;
+    delta_writer_t w;
+    transfer_t t;
+    uint8_t request[68 + PROTO_MAX_NAME];
+    uint8_t hash[SHA256_SIZE];
+    size_t name_len = strlen(filename);
+    int64_t mtime = 0;
+
+    int result = request_signatures(node, filename, &sig, &mtime, message, message_size, code);
+    if (result != 1) return result;
+
+    // Instruções em um arquivo temporário: o tamanho vai no pedido
+    memset(&w, 0, sizeof(w));
+    w.out = tmpfile();
+    if (w.out == NULL || delta_encode_file(fd, size, &sig, &w, hash) != 0 || fflush(w.out) != 0) {
+        if (w.out != NULL) fclose(w.out);
+        delta_signature_free(&sig);
+        snprintf(message, message_size, "Erro ao calcular as diferenças.");
+        return 0;
+    }
+    printf("Diferenças: %llu bytes de instruções (%llu literais) para %llu bytes; %u blocos de %u bytes no servidor\n",
+           (unsigned long long)w.length, (unsigned long long)w.literal, (unsigned long long)size,
+           sig.count, sig.block);
+
+    put_u64(request, w.length);
+    put_u64(request + 8, size);
+    memcpy(request + 16, hash, SHA256_SIZE);
+    put_u32(request + 48, sig.block);
+    put_u64(request + 52, sig.size);
+    put_u64(request + 60, (uint64_t)mtime);
+    memcpy(request + 68, filename, name_len);
+    delta_signature_free(&sig);
+
+    // Instruções em quadros DATA, lidas do arquivo temporário, seguidas do resumo
+    transfer_init(&t, w.length);
+    t.running = 1;
+    bfs_call_send(node, OP_DELTA, request, 68 + name_len, NULL, file_stream_fd(w.out), w.length, transfer_progress,
+                  transfer_done, &t);
+    result = transfer_wait(&t);
+    fclose(w.out);
+    *code = t.code;
+    snprintf(message, message_size, "%s", t.message);
+    transfer_destroy(&t);
+    return result;
+}
+
+/**
+ * Atualiza um arquivo do servidor enviando só as diferenças
+ *
+ * @param path Caminho do arquivo local
+ * @param filename Nome do arquivo no servidor
+ * @return 1 para OK, 0 se o servidor recusou, -1 se não foi possível
+ *         reconectar
+ *
+ * Por que foi feito:
+ * - Um arquivo grande com poucas alterações (logs que crescem, dumps de
+ *   banco) transfere só os trechos novos e referências ao resto
+ * - Se o arquivo ainda não existe no servidor (ou está guardado por
+ *   conteúdo), segue pelo upload configurado
+ * - Se a cópia do servidor mudar entre as assinaturas e as diferenças, as
+ *   assinaturas são pedidas de novo
+ */
+int delta_sync(SOCKET *s, const char *path, const char *filename, char *message, size_t message_size) {
+    int64_t size = file_size(path);
+    int fd = file_open_read(path);
+    bfs_client_t *node = bfs_cluster_route(transfers, filename);
+    uint16_t code = 0;
+    int result = 0;
+
+    if (fd < 0 || size < 0) {
+        if (fd >= 0) file_close(fd);
+        snprintf(message, message_size, "Arquivo não encontrado: %s", path);
+        return 0;
+    }
+
+    printf("\nSincronizando %s (Tamanho: %lld bytes)\n", filename, (long long)size);
+    for (int attempt = 0; attempt <= CLIENT_RETRIES; attempt++) {
+        code = 0;
+        result = send_delta(node, fd, filename, (uint64_t)size, message, message_size, &code);
+        if (result == 0 && (code == ERR_RANGE || code == ERR_CHECKSUM)) continue;  // Cópia mudou ou dados corrompidos: recalcula
+        if (result >= 0) break;
+        printf("\nConexão perdida. Retomando (tentativa %d de %d)...\n", attempt + 1, CLIENT_RETRIES);
+    }
+    file_close(fd);
+
+    if (result == 0 && (code == ERR_NOT_FOUND || code == ERR_UNSUPPORTED)) {
+        printf("Sem cópia para comparar no servidor; enviando o arquivo.\n");
+        return send_file(s, path, filename, message, message_size);
+    }
+    return result;
+}
+
+/*--------------------------------------------------------------
+ * ÁRVORES DE DIRETÓRIOS
+ *------------------------------------------------------------*/
+
+/**
+ * Um arquivo ou diretório de uma árvore transferida
+ */
+typedef struct {
+    char *path;                 // Caminho local
+    char *name;                 // Nome no servidor
+    int type;                   // TREE_FILE ou TREE_DIR
+    uint64_t size;
+    uint32_t mode;              // Permissões (ex.: 0644)
+    int64_t mtime;
+    int done;                   // 1 se transferido
+    int node;                   // Nó do cluster dono do nome
+} tree_item_t;
+
+/**
+ * Arquivos e diretórios de uma árvore
+ */
+typedef struct {
+    tree_item_t *items;
+    int count, cap;
+} tree_list_t;
+
+/**
+ * Lote em montagem (entradas no formato de TREE_PUT)
+ */
+typedef struct {
+    uint8_t *data;              // TREE_BATCH_BYTES bytes
+    size_t len;
+    uint32_t entries;
+    int *members;               // Itens da árvore no lote (TREE_MAX_ENTRIES)
+} tree_batch_t;
+
+/**
+ * Acrescenta um item à árvore
+ *
+ * @return 0 em caso de sucesso, -1 se faltou memória
+ */
+int tree_list_add(tree_list_t *l, const char *path, const char *name, int type, uint64_t size,
+                  uint32_t mode, int64_t mtime) {
+    if (l->count == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 64;
+        tree_item_t *items = (tree_item_t *)realloc(l->items, (size_t)cap * sizeof(tree_item_t));
+        if (items == NULL) return -1;
+        l->items = items;
+        l->cap = cap;
+    }
+    tree_item_t *item = &l->items[l->count];
+    size_t path_len = strlen(path) + 1, name_len = strlen(name) + 1;
+    if ((item->path = (char *)malloc(path_len + name_len)) == NULL) return -1;
+    item->name = item->path + path_len;
+    memcpy(item->path, path, path_len);
+    memcpy(item->name, name, name_len);
+    item->type = type;
+    item->size = size;
+    item->mode = mode;
+    item->mtime = mtime;
+    item->done = 0;
+    item->node = bfs_cluster_owner(cluster, name);
+    l->count++;
+    return 0;
+}
+
+/**
+ * Libera a árvore
+ */
+void tree_list_free(tree_list_t *l) {
+    for (int i = 0; i < l->count; i++) free(l->items[i].path);
+    free(l->items);
+    memset(l, 0, sizeof(*l));
+}
+
+/**
+ * Acrescenta à árvore o conteúdo de um diretório local, recursivamente
+ *
+ * @param prefix Nome do diretório no servidor
+ * @return Número de itens recusados, ou -1 se faltou memória
+ *
+ * Por que foi feito:
+ * - Nomes ocultos ficam de fora, como no índice do servidor, que não os
+ *   listaria; nomes que o servidor recusaria são avisados aqui, antes de
+ *   qualquer envio
+ */
+int tree_walk(tree_list_t *l, const char *dir, const char *prefix, int depth) {
+    char path[MAX_PATH * 2];
+    char remote[PROTO_MAX_NAME + 256];
+    dir_iter_t it;
+    const char *name;
+    uint64_t size, inode;
+    uint32_t mode;
+    int64_t mtime;
+    int failed = 0;
+
+    if (dir_open(&it, dir) != 0) {
+        printf("Não foi possível ler o diretório %s\n", dir);
+        return 1;
+    }
+    while (failed >= 0 && (name = dir_next(&it)) != NULL) {
+        if (name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s" PATH_SEP "%s", dir, name);
+        snprintf(remote, sizeof(remote), "%s/%s", prefix, name);
+        if (strlen(remote) >= PROTO_MAX_NAME || !proto_valid_name(remote, strlen(remote))) {
+            printf("Nome não aceito pelo servidor: %s\n", path);
+            failed++;
+            continue;
+        }
+        if (file_get_mode(path, &mode) != 0) mode = 0644;
+        if (path_is_dir(path)) {
+            if (depth >= TREE_MAX_DEPTH) {
+                printf("Diretório profundo demais: %s\n", path);
+                failed++;
+                continue;
+            }
+            if (tree_list_add(l, path, remote, TREE_DIR, 0, mode, file_mtime(path)) != 0) failed = -1;
+            int result = failed >= 0 ? tree_walk(l, path, remote, depth + 1) : -1;
+            failed = result < 0 ? -1 : failed + result;
+        } else if (file_stat(path, &size, &mtime, &inode) == 0) {
+            if (tree_list_add(l, path, remote, TREE_FILE, size, mode, mtime) != 0) failed = -1;
+        }
+    }
+    dir_close(&it);
+    return failed;
+}
+
+/**
+ * Nome padrão de um diretório no servidor: a última parte do caminho local
+ */
+void tree_default_name(const char *path, char *name, size_t size) {
+    size_t len = strlen(path);
+    while (len > 1 && (path[len - 1] == '/' || path[len - 1] == '\\')) len--;
+    size_t start = len;
+    while (start > 0 && path[start - 1] != '/' && path[start - 1] != '\\') start--;
+    snprintf(name, size, "%.*s", (int)(len - start), path + start);
+}
+
+/**
+ * Remove as barras finais de um nome de diretório do servidor e o valida
+ *
+ * @return 0 se o nome é válido, -1 caso contrário
+ */
+int tree_remote_name(const char *text, char *name, size_t size) {
+    size_t len = strlen(text);
+    while (len > 0 && text[len - 1] == '/') len--;
+    if (len == 0 || len + 1 >= size || len + 1 >= PROTO_MAX_NAME || !proto_valid_name(text, len)) return -1;
+    memcpy(name, text, len);
+    name[len] = '\0';
+    return 0;
+}
+
+/**
+ * Indica se uma entrada ainda cabe no lote
+ */
+int tree_batch_fits(const tree_batch_t *b, const char *name, uint64_t size) {
+    return b->entries < TREE_MAX_ENTRIES &&
+           b->len + TREE_ENTRY_HEADER + strlen(name) + size <= TREE_BATCH_BYTES;
+}
+
+/**
+ * Acrescenta ao lote um item sem conteúdo (TREE_DIR ou TREE_ATTR)
+ */
+void tree_batch_add_meta(tree_batch_t *b, const tree_item_t *item, int index) {
+    tree_entry_t e;
+
+    memset(&e, 0, sizeof(e));
+    e.type = (uint8_t)(item->type == TREE_DIR ? TREE_DIR : TREE_ATTR);
+    e.mode = item->mode;
+    e.mtime = item->mtime;
+    e.size = item->size;
+    snprintf(e.name, sizeof(e.name), "%s", item->name);
+    b->len += tree_entry_encode(b->data + b->len, &e);
+    b->members[b->entries++] = index;
+}
+
+/**
+ * Acrescenta ao lote um arquivo e o seu conteúdo
+ *
+ * @return 0 em caso de sucesso, -1 se o arquivo não pôde ser lido inteiro
+ */
+int tree_batch_add_file(tree_batch_t *b, const tree_item_t *item, int index) {
+    tree_entry_t e;
+    int fd = file_open_read(item->path);
+
+    memset(&e, 0, sizeof(e));
+    e.type = TREE_FILE;
+    e.mode = item->mode;
+    e.mtime = item->mtime;
+    e.size = item->size;
+    snprintf(e.name, sizeof(e.name), "%s", item->name);
+    size_t head = tree_entry_encode(b->data + b->len, &e);
+    int64_t got = fd >= 0 ? file_pread(fd, b->data + b->len + head, (size_t)item->size, 0) : -1;
+    if (fd >= 0) file_close(fd);
+    if (item->size > 0 && got != (int64_t)item->size) return -1;  // Encolheu desde a varredura
+
+    b->len += head + (size_t)item->size;
+    b->members[b->entries++] = index;
+    return 0;
+}
+
+/**
+ * Envia um lote por TREE_PUT e espera a confirmação
+ *
+ * @param node Nó dono dos nomes do lote
+ * @return 1 para OK, 0 se o servidor recusou, -1 se a conexão foi perdida
+ *
+ * Por que foi feito:
+ * - O lote só vale quando o servidor confirma; depois de uma queda (ou de
+ *   dados corrompidos no caminho) a biblioteca o envia de novo inteiro
+ * - Com o servidor no limite de memória (BUSY), espera antes de tentar
+ *   outra vez
+ */
+int tree_batch_send(bfs_client_t *node, const tree_batch_t *b, char *message, size_t message_size) {
+    uint8_t request[12];
+    int result = -1;
+
+    put_u64(request, b->len);
+    put_u32(request + 8, b->entries);
+    for (int attempt = 0; attempt <= CLIENT_RETRIES; attempt++) {
+        bfs_future_t f;
+        bfs_future_init(&f);
+        bfs_call_send(node, OP_TREE_PUT, request, sizeof(request), b->data, -1, b->len, NULL, bfs_future_done, &f);
+        const bfs_result_t *r = bfs_future_wait(&f);
+        snprintf(message, message_size, "%s", r->message);
+        result = r->status == BFS_OK ? 1 : r->status == BFS_REFUSED ? 0 : -1;
+        if (result != 0 || (r->code != ERR_BUSY && r->code != ERR_CHECKSUM)) break;
+        sleep_ms(r->code == ERR_BUSY ? RETRY_DELAY_MS : 0);
+    }
+    return result;
+}
+
+/**
+ * Envia o lote em montagem e registra o resultado dos seus itens
+ *
+ * @return 0 em caso de sucesso ou recusa, -1 se a conexão foi perdida
+ */
+int tree_batch_flush(bfs_client_t *node, tree_batch_t *b, tree_list_t *l) {
+    char message[BUFFER_SIZE];
+    int files = 0;
+
+    if (b->entries == 0) return 0;
+    int result = tree_batch_send(node, b, message, sizeof(message));
+    for (uint32_t i = 0; i < b->entries; i++) {
+        tree_item_t *item = &l->items[b->members[i]];
+        files += item->type == TREE_FILE && item->size <= TREE_FILE_MAX;
+        if (result == 1) item->done = 1;
+    }
+    if (result == 1 && files > 0) printf("enviado: lote de %d arquivo(s)\n", files);
+    else if (result == 1) printf("enviado: permissões e datas de %u item(ns)\n", b->entries);
+    else if (result == 0) printf("falhou: lote de %u entrada(s) - %s\n", b->entries, message);
+    b->len = 0;
+    b->entries = 0;
+    return result < 0 ? -1 : 0;
+}
+
+/**
+ * Envia um diretório local com os seus subdiretórios
+ *
+ * @param local Diretório local
+ * @param remote Nome do diretório no servidor ("" = última parte de local)
+ * @return Número de falhas, ou -1 se a conexão principal foi perdida
+ *
+ * Por que foi feito:
+ * - Árvores de código e de fotos têm milhares de arquivos pequenos; um
+ *   pedido por arquivo gasta o tempo em idas e voltas e o servidor gasta
+ *   um fsync() em cada um. Os pequenos seguem em lotes (TREE_PUT), que o
+ *   servidor grava com um único syncfs()
+ * - Arquivos grandes seguem pelas transferências em blocos; permissões e
+ *   datas deles e dos diretórios vão num último lote (TREE_ATTR e
+ *   TREE_DIR), depois que nada mais muda dentro dos diretórios
+ * - Num cluster, cada nó recebe só os nomes de que é dono (inclusive os
+ *   dos diretórios, que nos demais nós só existem como caminho)
+ */
+int tree_put_dir(SOCKET *s, const char *local, const char *remote) {
+    char root[PROTO_MAX_NAME];
+    char message[BUFFER_SIZE];
+    tree_list_t l;
+    tree_batch_t b;
+    uint32_t mode;
+    int failed = 0, lost = 0;
+
+    tree_default_name(local, message, sizeof(message));
+    if (tree_remote_name(remote[0] ? remote : message, root, sizeof(root)) != 0) {
+        printf("Nome de diretório inválido: %s\n", remote[0] ? remote : message);
+        return 1;
+    }
+    if (!path_is_dir(local)) {
+        printf("Diretório não encontrado: %s\n", local);
+        return 1;
+    }
+
+    uint64_t start = monotonic_ns();
+    memset(&l, 0, sizeof(l));
+    memset(&b, 0, sizeof(b));
+    if (file_get_mode(local, &mode) != 0) mode = 0755;
+    if (tree_list_add(&l, local, root, TREE_DIR, 0, mode, file_mtime(local)) == 0) {
+        failed = tree_walk(&l, local, root, 1);
+    } else {
+        failed = -1;
+    }
+    b.data = (uint8_t *)malloc(TREE_BATCH_BYTES);
+    b.members = (int *)malloc(TREE_MAX_ENTRIES * sizeof(int));
+    if (failed < 0 || b.data == NULL || b.members == NULL) {
+        printf("Memória insuficiente.\n");
+        failed = 1;
+        goto done;
+    }
+
+    // Cada nó do cluster recebe os itens de que é dono
+    for (int node = 0; node < cluster->ring.count && !lost; node++) {
+        bfs_client_t *to = transfers->nodes[node];
+        int owned = 0;
+        for (int i = 0; i < l.count && !owned; i++) owned = l.items[i].node == node;
+        if (!owned) continue;
+
+        // Arquivos pequenos, em lotes
+        for (int i = 0; i < l.count && !lost; i++) {
+            tree_item_t *item = &l.items[i];
+            if (item->type != TREE_FILE || item->size > TREE_FILE_MAX || item->node != node) continue;
+            if (!tree_batch_fits(&b, item->name, item->size)) lost = tree_batch_flush(to, &b, &l) < 0;
+            if (!lost && tree_batch_add_file(&b, item, i) != 0) printf("falhou: %s - Erro ao ler o arquivo.\n", item->name);
+        }
+        if (!lost) lost = tree_batch_flush(to, &b, &l) < 0;
+
+        // Arquivos grandes, um a um, pelas transferências em blocos
+        for (int i = 0; i < l.count && !lost; i++) {
+            tree_item_t *item = &l.items[i];
+            if (item->type != TREE_FILE || item->size <= TREE_FILE_MAX || item->node != node) continue;
+            int result = send_file(s, item->path, item->name, message, sizeof(message));
+            lost = result < 0;
+            if (result == 0) printf("\nfalhou: %s - %s\n", item->name, message);
+            item->done = result == 1;
+        }
+
+        // Permissões e datas dos arquivos grandes e dos diretórios
+        for (int i = 0; i < l.count && !lost; i++) {
+            tree_item_t *item = &l.items[i];
+            if (item->node != node || (item->type == TREE_FILE && (item->size <= TREE_FILE_MAX || !item->done))) continue;
+            item->done = 0;
+            if (!tree_batch_fits(&b, item->name, 0)) lost = tree_batch_flush(to, &b, &l) < 0;
+            if (!lost) tree_batch_add_meta(&b, item, i);
+        }
+        if (!lost) lost = tree_batch_flush(to, &b, &l) < 0;
+    }
+
+    if (!lost) {
+        int files = 0;
+        for (int i = 0; i < l.count; i++) {
+            files += l.items[i].type == TREE_FILE;
+            failed += !l.items[i].done;
+        }
+        printf("putdir: %d arquivo(s), %d diretório(s), %d falha(s), %.2f s\n", files, l.count - files, failed,
+               (double)(monotonic_ns() - start) / 1e9);
+    }
+
+done:
+    free(b.data);
+    free(b.members);
+    tree_list_free(&l);
+    return lost ? -1 : failed;
+}
+
+/**
+ * Arquivos de um diretório do servidor a baixar
+ */
+typedef struct {
+    tree_list_t list;
+    const char *local;          // Diretório local de destino
+    size_t prefix_len;          // Tamanho de "<diretório>/" nos nomes
+    int failed;                 // 1 se faltou memória
+} tree_get_t;
+
+/**
+ * Acrescenta à árvore uma entrada da lista do servidor
+ */
+void tree_list_visit(const list_entry_t *e, void *ctx) {
+    tree_get_t *g = (tree_get_t *)ctx;
+    char path[MAX_PATH * 2];
+
+    snprintf(path, sizeof(path), "%s" PATH_SEP "%s", g->local, e->name + g->prefix_len);
+    if (tree_list_add(&g->list, path, e->name, TREE_FILE, e->size, 0644, e->mtime) != 0) g->failed = 1;
+}
+
+/**
+ * Recebe o lote de um pedido TREE_GET
+ *
+ * @param archive Recebe o lote (liberar com free())
+ * @return 1 se recebido, 0 se o servidor recusou (motivo em message), 2
+ *         se o resumo não confere, -1 se a conexão falhou
+ */
+int tree_receive(SOCKET s, uint32_t id, uint32_t count, uint8_t **archive, size_t *len,
+                 char *message, size_t message_size) {
+    frame_header_t h;
+    char payload[FRAME_MAX_CONTROL + 1];
+    uint8_t digest[CHECKSUM_SIZE];
+    checksum_t sum;
+
+    *archive = NULL;
+    if (proto_recv_frame(s, &h, payload, sizeof(payload)) != 0 || h.request_id != id) return -1;
+    if (h.opcode == OP_ERROR) {
+        snprintf(message, message_size, "%s", h.length >= 2 ? payload + 2 : "Erro no servidor.");
+        return 0;
+    }
+    uint64_t size = h.length == 8 + CHECKSUM_SIZE ? get_u64((uint8_t *)payload) : UINT64_MAX;
+    if (h.opcode != OP_OK || size > TREE_MAX_BYTES + (uint64_t)count * (TREE_ENTRY_HEADER + PROTO_MAX_NAME)) {
+        return -1;
+    }
+
+    uint8_t *data = (uint8_t *)malloc((size_t)size + 1);
+    uint8_t *buffer = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, NULL);
+    uint8_t *packed = FLAG_CODEC_OF(h.flags) != CODEC_NONE ? (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, NULL) : NULL;
+    int result = data != NULL && buffer != NULL ? 1 : -1;
+    size_t received = 0;
+
+    // Quadros DATA até o marcado com FLAG_END
+    memcpy(digest, payload + 8, CHECKSUM_SIZE);
+    checksum_init(&sum);
+    while (result == 1) {
+        if (proto_recv_header(s, &h) != 0 || h.opcode != OP_DATA || h.request_id != id) {
+            result = -1;
+            break;
+        }
+        uint64_t left = h.length;
+        while (left > 0 && result == 1) {
+            size_t got;
+            if (receive_data(s, &h, buffer, packed, &got, &left) != 0 || got > size - received) {
+                result = -1;
+                break;
+            }
+            memcpy(data + received, buffer, got);
+            checksum_update(&sum, buffer, got);
+            received += got;
+        }
+        if (h.flags & FLAG_END) break;
+    }
+    bufpool_free(buffer, FRAME_DATA_CHUNK, NULL);
+    bufpool_free(packed, FRAME_DATA_CHUNK, NULL);
+
+    if (result == 1 && received != size) result = -1;
+    if (result == 1) {
+        uint8_t check[CHECKSUM_SIZE];
+        checksum_final(&sum, check);
+        if (memcmp(check, digest, CHECKSUM_SIZE) != 0) result = 2;
+    }
+    if (result != 1) {
+        free(data);
+        return result;
+    }
+    *archive = data;
+    *len = received;
+    return 1;
+}
+
+/**
+ * Grava um arquivo recebido em um lote, com permissões e data
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+int tree_write_file(const char *path, const uint8_t *data, const tree_entry_t *e) {
+    char part_path[MAX_PATH * 2 + 8];
+
+    snprintf(part_path, sizeof(part_path), "%s.part", path);
+    if (make_parent_dirs(path) != 0) return -1;
+    FILE *file = fopen(part_path, "wb");
+    if (file == NULL) return -1;
+    size_t written = fwrite(data, 1, (size_t)e->size, file);
+    if (fclose(file) != 0 || written != e->size || file_replace(part_path, path) != 0) {
+        remove(part_path);
+        return -1;
+    }
+    file_set_meta(path, e->mode & 0777, e->mtime);
+    return 0;
+}
+
+/**
+ * Baixa um grupo de arquivos por TREE_GET
+ *
+ * @param first Primeiro item do grupo
+ * @param request Payload do pedido (u32 nomes + nomes)
+ * @return Número de falhas, ou -1 se a conexão principal foi perdida
+ *
+ * Por que foi feito:
+ * - Um pedido traz centenas de arquivos pequenos; os que o servidor deixa
+ *   fora do lote (TREE_ATTR: grandes ou armazenados em blocos) seguem
+ *   pela transferência em blocos e recebem permissões e data em seguida
+ */
+int tree_fetch(SOCKET *s, tree_list_t *l, int first, uint32_t count, const uint8_t *request, size_t request_len) {
+    char message[BUFFER_SIZE];
+    uint8_t *archive = NULL;
+    size_t len = 0;
+    int result = -1, failed = 0;
+
+    for (int attempt = 0; attempt <= CLIENT_RETRIES; attempt++) {
+        uint32_t id = next_request_id();
+        result = proto_send_frame(*s, OP_TREE_GET, FLAG_CODEC(transfer_codec), id, request, request_len) != 0 ? -1
+                 : tree_receive(*s, id, count, &archive, &len, message, sizeof(message));
+        if (result == 2) {
+            printf("Resumo do lote não confere; baixando de novo.\n");
+            continue;
+        }
+        if (result >= 0) break;
+        if (reconnect(s) != 0) return -1;
+    }
+    if (result != 1) {
+        printf("falhou: lote de %u arquivo(s) - %s\n", count,
+               result == 0 ? message : "Não foi possível obter uma cópia íntegra do lote.");
+        return (int)count;
+    }
+
+    // Entradas na ordem dos nomes pedidos
+    size_t pos = 0;
+    int files = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        tree_item_t *item = &l->items[first + (int)i];
+        tree_entry_t e;
+        size_t used = tree_entry_decode(archive + pos, len - pos, &e);
+        if (used == 0 || strcmp(e.name, item->name) != 0 || (e.type == TREE_FILE && e.size > len - pos - used)) {
+            printf("Lote inválido recebido do servidor.\n");
+            failed += (int)(count - i);
+            break;
+        }
+        pos += used;
+        if (e.type == TREE_FILE) {
+            item->done = tree_write_file(item->path, archive + pos, &e) == 0;
+            if (!item->done) printf("falhou: %s - Erro ao criar arquivo.\n", item->name);
+            files += item->done;
+            pos += (size_t)e.size;
+        } else if (e.type == TREE_ATTR) {
+            make_parent_dirs(item->path);
+            int single = parallel_download(item->name, item->path);
+            if (single < 0) {
+                free(archive);
+                return -1;
+            }
+            if (single == 1) file_set_meta(item->path, e.mode & 0777, e.mtime);
+            item->done = single == 1;
+            if (!item->done) printf("falhou: %s\n", item->name);
+        } else {
+            printf("falhou: %s - Arquivo não encontrado.\n", item->name);
+        }
+        failed += !item->done;
+    }
+    if (files > 0) printf("baixado: lote de %d arquivo(s)\n", files);
+    free(archive);
+    return failed;
+}
+
+/**
+ * Compara itens pelo nó dono e depois pelo nome, para qsort()
+ */
+int tree_compare_node(const void *a, const void *b) {
+    const tree_item_t *x = (const tree_item_t *)a, *y = (const tree_item_t *)b;
+    if (x->node != y->node) return x->node - y->node;
+    return strcmp(x->name, y->name);
+}
+
+/**
+ * Baixa um diretório do servidor com os seus subdiretórios
+ *
+ * @param remote Nome do diretório no servidor
+ * @param local Diretório local de destino ("" = a última parte do nome,
+ *              dentro do destino dos downloads)
+ * @return Número de falhas, ou -1 se a conexão principal foi perdida
+ *
+ * Por que foi feito:
+ * - Os nomes vêm do LIST com o prefixo "<diretório>/" e seguem em grupos
+ *   por TREE_GET, um lote por ida e volta em vez de um pedido por arquivo
+ * - Diretórios vazios não aparecem na lista do servidor e não são criados
+ */
+int tree_get_dir(SOCKET *s, const char *remote, const char *local) {
+    char root[PROTO_MAX_NAME];
+    char prefix[PROTO_MAX_NAME + 1];
+    char target[MAX_PATH * 2];
+    tree_get_t g;
+    long long listed = -1;
+    int failed = 0;
+
+    if (tree_remote_name(remote, root, sizeof(root)) != 0) {
+        printf("Nome de diretório inválido: %s\n", remote);
+        return 1;
+    }
+    if (local[0] != '\0') {
+        snprintf(target, sizeof(target), "%s", local);
+    } else {
+        tree_default_name(root, prefix, sizeof(prefix));
+        snprintf(target, sizeof(target), "%s" PATH_SEP "%s", config.output, prefix);
+    }
+    snprintf(prefix, sizeof(prefix), "%s/", root);
+
+    uint64_t start = monotonic_ns();
+    memset(&g, 0, sizeof(g));
+    g.local = target;
+    g.prefix_len = strlen(prefix);
+    listed = list_remote(NULL, prefix, tree_list_visit, &g);
+    if (listed < 0) {
+        tree_list_free(&g.list);
+        return -1;
+    }
+    if (g.failed || listed <= 0) {
+        if (g.failed) printf("Memória insuficiente.\n");
+        else printf("Nenhum arquivo do servidor em %s\n", prefix);
+        tree_list_free(&g.list);
+        return 1;
+    }
+
+    // Grupos do mesmo nó, limitados pelo payload do pedido e pelo tamanho do lote
+    qsort(g.list.items, (size_t)g.list.count, sizeof(tree_item_t), tree_compare_node);
+    uint8_t *request = (uint8_t *)malloc(FRAME_MAX_CONTROL);
+    int first = 0;
+    while (request != NULL && first < g.list.count && failed >= 0) {
+        size_t request_len = 4;
+        uint64_t bytes = 0;
+        uint32_t count = 0;
+        int node = g.list.items[first].node;
+        while (first + (int)count < g.list.count && count < TREE_MAX_ENTRIES) {
+            const tree_item_t *item = &g.list.items[first + (int)count];
+            size_t name_len = strlen(item->name);
+            int small = item->size <= TREE_FILE_MAX;
+            if (item->node != node || request_len + 2 + name_len > FRAME_MAX_CONTROL ||
+                (small && bytes + item->size > TREE_BATCH_BYTES)) break;
+            put_u16(request + request_len, (uint16_t)name_len);
+            memcpy(request + request_len + 2, item->name, name_len);
+            request_len += 2 + name_len;
+            if (small) bytes += item->size;
+            count++;
+        }
+        put_u32(request, count);
+        int result = route_node(s, node) < 0 ? -1 : tree_fetch(s, &g.list, first, count, request, request_len);
+        failed = result < 0 ? -1 : failed + result;
+        first += (int)count;
+    }
+    if (request == NULL) {
+        printf("Memória insuficiente.\n");
+        failed = 1;
+    } else if (failed >= 0) {
+        printf("getdir: %d arquivo(s), %d falha(s), %.2f s\n", g.list.count, failed,
+               (double)(monotonic_ns() - start) / 1e9);
+    }
+    free(request);
+    tree_list_free(&g.list);
+    return failed;
+}
+
+/*--------------------------------------------------------------
+ * MODO EM LOTE (COMANDOS SEM MENU)
+ *------------------------------------------------------------*/
+
+/**
+ * Operações do modo em lote que atuam sobre vários arquivos
+ */
+typedef enum {
+    BATCH_PUT,
+    BATCH_GET,
+    BATCH_RM
+} batch_op_t;
+
+/**
+ * Situação de um arquivo de um comando em lote
+ */
+enum {
+    ITEM_PENDING,               // Ainda não distribuído a uma conexão
+    ITEM_DONE,                  // Concluído
+    ITEM_FAILED,                // Recusado pelo servidor ou erro local
+    ITEM_RETRY,                 // Conexão caiu: refeito depois, com retomada
+    ITEM_LARGE                  // Grande: segue pela transferência em blocos
+};
+
+typedef struct batch batch_t;
+
+/**
+ * Um arquivo de um comando em lote
+ */
+typedef struct {
+    char *path;                 // Caminho local (origem do put, destino do get)
+    char *name;                 // Nome no servidor
+    uint64_t size;              // Tamanho conhecido (0 se desconhecido)
+    uint8_t hash[LIST_HASH_MAX]; // Resumo informado pela listagem (get)
+    uint8_t hash_len;           // 0 se desconhecido
+    int status;                 // ITEM_*
+    batch_t *batch;             // Comando do arquivo (para a função de retorno)
+} batch_item_t;
+
+/**
+ * Arquivos de um comando
+ */
+struct batch {
+    batch_op_t op;
+    batch_item_t *items;
+    int count, cap;
+};
+
+/**
+ * Parte final de um caminho (depois do último separador)
+ */
+const char *base_name(const char *path) {
+    const char *base = path;
+    for (const char *p = path; *p; p++) {
+        if (*p == '/' || *p == '\\') base = p + 1;
+    }
+    return base;
+}
+
+/**
+ * Indica se o texto tem caracteres de padrão (*, ? ou [)
+ */
+int has_wildcard(const char *text) {
+    return strpbrk(text, "*?[") != NULL;
+}
+
+/**
+ * Confere um caractere com uma classe "[abc]", "[a-z]" ou "[!abc]"
+ *
+ * @param p Posição do "[" no padrão
+ * @return Posição depois do "]", ou NULL se o caractere não pertence à classe
+ */
+const char *wildcard_class(const char *p, unsigned char c) {
+    int negate = 0, found = 0;
+
+    p++;
+    if (*p == '!' || *p == '^') {
+        negate = 1;
+        p++;
+    }
+    do {
+        if (*p == '\0') return NULL;  // Classe sem "]"
+        unsigned char low = (unsigned char)*p, high = low;
+        if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+            high = (unsigned char)p[2];
+            p += 2;
+        }
+        if (c >= low && c <= high) found = 1;
+        p++;
+    } while (*p != ']');
+    return found != negate ? p + 1 : NULL;
+}
+
+/**
+ * Confere um nome com um padrão com *, ? e classes [...]
+ *
+ * @return 1 se o nome corresponde ao padrão, 0 caso contrário
+ *
+ * Por que foi feito:
+ * - Roteiros e o Windows não expandem padrões como o shell; o cliente
+ *   expande os locais (put) e os do servidor (get, rm) do mesmo jeito
+ * - Sem recursão: ao falhar, volta só até o último "*", que engole mais
+ *   um caractere
+ * - Como no shell, "*", "?" e classes não passam de um "/": o padrão
+ *   "dir/" seguido de "*" fica só nos arquivos do próprio diretório
+ */
+int wildcard_match(const char *pattern, const char *name) {
+    const char *star = NULL, *retry = NULL;
+
+    while (*name) {
+        const char *next = NULL;
+        if (*pattern == '*') {
+            star = ++pattern;
+            retry = name;
+            continue;
+        }
+        if (*name == '/') {
+            if (*pattern == '/') next = pattern + 1;
+        }
+        else if (*pattern == '?') next = pattern + 1;
+        else if (*pattern == '[') next = wildcard_class(pattern, (unsigned char)*name);
+        else if (*pattern == *name) next = pattern + 1;
+
+        if (next != NULL) {
+            pattern = next;
+            name++;
+        } else if (star != NULL && *retry != '/') {
+            pattern = star;
+            name = ++retry;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+/**
+ * Compara nomes para qsort()
+ */
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Acrescenta um arquivo ao comando
+ *
+ * @return 0 em caso de sucesso, -1 se faltou memória
+ */
+int batch_add(batch_t *b, const char *path, const char *name, uint64_t size) {
+    if (b->count == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 64;
+        batch_item_t *items = (batch_item_t *)realloc(b->items, (size_t)cap * sizeof(batch_item_t));
+        if (items == NULL) return -1;
+        b->items = items;
+        b->cap = cap;
+    }
+    batch_item_t *item = &b->items[b->count];
+    size_t path_len = strlen(path) + 1, name_len = strlen(name) + 1;
+    item->path = (char *)malloc(path_len + name_len);
+    if (item->path == NULL) return -1;
+    item->name = item->path + path_len;
+    memcpy(item->path, path, path_len);
+    memcpy(item->name, name, name_len);
+    item->size = size;
+    item->hash_len = 0;
+    item->status = ITEM_PENDING;
+    b->count++;
+    return 0;
+}
+
+/**
+ * Libera os arquivos de um comando
+ */
+void batch_free(batch_t *b) {
+    for (int i = 0; i < b->count; i++) free(b->items[i].path);
+    free(b->items);
+    memset(b, 0, sizeof(*b));
+}
+
+/**
+ * Acrescenta um arquivo local, ou os que correspondem a um padrão no nome
+ *
+ * @return 0 em caso de sucesso, 1 se nada foi acrescentado (erro exibido)
+ *
+ * Por que foi feito:
+ * - Uma só leitura do diretório; os nomes são ordenados para que a ordem
+ *   dos envios não dependa do sistema de arquivos
+ */
+int batch_expand_local(batch_t *b, const char *pattern) {
+    const char *base = base_name(pattern);
+    size_t dir_len = (size_t)(base - pattern);
+    char dir[MAX_PATH], path[MAX_PATH * 2];
+    name_list_t found = { NULL, 0, 0 };
+    dir_iter_t it;
+    const char *name;
+    uint64_t size, inode;
+    int64_t mtime;
+
+    if (!has_wildcard(base)) {
+        if (*base == '\0' || file_stat(pattern, &size, &mtime, &inode) != 0) {
+            printf("Arquivo não encontrado: %s\n", pattern);
+            return 1;
+        }
+        return batch_add(b, pattern, base, size) == 0 ? 0 : 1;
+    }
+    if (dir_len >= sizeof(dir) || memchr(pattern, '*', dir_len) || memchr(pattern, '?', dir_len) ||
+        memchr(pattern, '[', dir_len)) {
+        printf("Padrões só são aceitos no nome do arquivo: %s\n", pattern);
+        return 1;
+    }
+    snprintf(dir, sizeof(dir), "%.*s", (int)dir_len, pattern);
+    if (dir_open(&it, dir_len > 0 ? dir : ".") == 0) {
+        while ((name = dir_next(&it)) != NULL) {
+            if (name[0] == '.' && base[0] != '.') continue;  // Ocultos só com padrão explícito
+            if (wildcard_match(base, name) && name_list_add(&found, name) != 0) break;
+        }
+        dir_close(&it);
+    }
+
+    int added = 0;
+    qsort(found.names, (size_t)found.count, sizeof(char *), compare_names);
+    for (int i = 0; i < found.count; i++) {
+        snprintf(path, sizeof(path), "%s%s", dir, found.names[i]);
+        if (file_stat(path, &size, &mtime, &inode) != 0) continue;  // Diretórios e especiais
+        if (batch_add(b, path, found.names[i], size) != 0) break;
+        added++;
+    }
+    name_list_free(&found);
+    if (added == 0) printf("Nenhum arquivo corresponde a %s\n", pattern);
+    return added > 0 ? 0 : 1;
+}
+
+/**
+ * Padrão e destino de uma expansão pela lista do servidor
+ */
+typedef struct {
+    batch_t *batch;
+    const char *pattern;
+    int added;
+} remote_match_t;
+
+/**
+ * Acrescenta ao comando uma entrada da lista do servidor que corresponde ao padrão
+ */
+void remote_match_visit(const list_entry_t *e, void *ctx) {
+    remote_match_t *m = (remote_match_t *)ctx;
+    char path[MAX_PATH * 2];
+
+    if (!wildcard_match(m->pattern, e->name)) return;
+    snprintf(path, sizeof(path), "%s" PATH_SEP "%s", config.output, e->name);
+    if (batch_add(m->batch, path, e->name, e->size) != 0) return;
+    batch_item_t *item = &m->batch->items[m->batch->count - 1];
+    item->hash_len = e->hash_len;
+    memcpy(item->hash, e->hash, e->hash_len);
+    m->added++;
+}
+
+/**
+ * Acrescenta um arquivo do servidor, ou os que correspondem a um padrão
+ *
+ * @return 0 em caso de sucesso, 1 se nada foi acrescentado, -1 se a
+ *         conexão principal foi perdida
+ *
+ * Por que foi feito:
+ * - O padrão é conferido nas entradas do LIST com o prefixo que vem antes
+ *   do primeiro caractere de padrão, sem percorrer a lista toda
+ * - Nomes sem padrão vão direto para o lote, sem consultar o servidor
+ */
+int batch_expand_remote(batch_t *b, const char *pattern) {
+    char prefix[PROTO_MAX_NAME];
+    char path[MAX_PATH * 2];
+    remote_match_t match = { b, pattern, 0 };
+
+    if (!has_wildcard(pattern)) {
+        snprintf(path, sizeof(path), "%s" PATH_SEP "%s", config.output, pattern);
+        return batch_add(b, path, pattern, 0) == 0 ? 0 : 1;
+    }
+    snprintf(prefix, sizeof(prefix), "%.*s", (int)strcspn(pattern, "*?["), pattern);
+    if (list_remote(NULL, prefix, remote_match_visit, &match) < 0) return -1;
+    if (match.added == 0) printf("Nenhum arquivo do servidor corresponde a %s\n", pattern);
+    return match.added > 0 ? 0 : 1;
+}
+
+/**
+ * Registra o resultado de um arquivo e o exibe
+ *
+ * @param result 1 concluído, 0 falhou, 2 refazer com retomada
+ */
+void batch_finish(batch_t *b, batch_item_t *item, int result, const char *message) {
+    static const char *done[] = { "enviado", "baixado", "excluído" };
+
+    if (result == 2) {
+        item->status = ITEM_RETRY;
+    } else if (result == 1) {
+        item->status = ITEM_DONE;
+        printf("%s: %s\n", done[b->op], item->name);
+    } else {
+        item->status = ITEM_FAILED;
+        printf("falhou: %s%s%s\n", item->name, message[0] ? " - " : "", message);
+    }
+}
+
+/**
+ * Recebe o resultado de um arquivo pedido pela biblioteca (thread da conexão)
+ *
+ * Por que foi feito:
+ * - Conexão perdida de vez, resumo que não confere ou arquivo que mudou
+ *   no meio: o arquivo é refeito depois, um a um, pelo caminho com
+ *   retomada
+ */
+void batch_done(void *ctx, const bfs_result_t *r) {
+    batch_item_t *item = (batch_item_t *)ctx;
+    int result = r->status == BFS_OK;
+
+    if (r->status == BFS_FAILED ||
+        (r->status == BFS_REFUSED && (r->code == ERR_BUSY || r->code == ERR_CHECKSUM || r->code == ERR_RANGE))) {
+        result = 2;
+    }
+    batch_finish(item->batch, item, result, r->message);
+}
+
+/**
+ * Exclui um arquivo do servidor e aguarda a resposta
+ *
+ * @return 1 para OK, 0 se o servidor recusou, -1 se a conexão foi perdida
+ */
+int remote_delete(const char *name, char *message, size_t message_size) {
+    bfs_future_t f;
+
+    bfs_future_init(&f);
+    bfs_delete(bfs_cluster_route(cluster, name), name, bfs_future_done, &f);
+    const bfs_result_t *r = bfs_future_wait(&f);
+    snprintf(message, message_size, "%s", r->message);
+    return r->status == BFS_OK ? 1 : r->status == BFS_REFUSED ? 0 : -1;
+}
+
+/**
+ * Pede o download de um arquivo pequeno à biblioteca
+ *
+ * Por que foi feito:
+ * - Com réplicas (-R), os downloads se revezam entre o servidor e cada
+ *   réplica, repartindo a carga de leitura; só vão para uma réplica os
+ *   arquivos cujo resumo veio na listagem do servidor, e uma cópia
+ *   diferente dele é refeita pelo servidor (batch_done)
+ */
+void batch_get(batch_item_t *item) {
+    int copy = replica_count > 0 && item->hash_len >= CHECKSUM_CRC_SIZE ? replica_next++ % (replica_count + 1) : 0;
+
+    if (copy == 0) bfs_get_file(bfs_cluster_route(cluster, item->name), item->name, item->path, batch_done, item);
+    else bfs_get_file_expect(replicas[copy - 1], item->name, item->path, item->hash, item->hash_len, batch_done, item);
+}
+
+/**
+ * Transfere um arquivo sozinho, com retomada
+ *
+ * @return 1 concluído, 0 falhou, -1 se não foi possível reconectar
+ */
+int batch_single(SOCKET *s, batch_t *b, batch_item_t *item, char *message, size_t message_size) {
+    message[0] = '\0';
+    if (b->op == BATCH_PUT) return send_file(s, item->path, item->name, message, message_size);
+    if (b->op == BATCH_GET) return parallel_download(item->name, item->path);
+    return remote_delete(item->name, message, message_size);
+}
+
+/**
+ * Executa os arquivos de um comando
+ *
+ * @return Número de arquivos que falharam, ou -1 se a conexão principal
+ *         foi perdida
+ *
+ * Por que foi feito:
+ * - Arquivos pequenos vão todos para a biblioteca de pedidos assíncronos,
+ *   que os distribui pelas config.streams conexões com até config.window
+ *   pedidos em andamento em cada uma
+ * - Grandes (ou no modo dedup) seguem um de cada vez pelas transferências
+ *   com retomada (em blocos com várias conexões, ou sequenciais com uma),
+ *   assim como downloads que já têm um "<destino>.part": rodar o mesmo
+ *   comando depois de interromper o cliente continua de onde parou
+ */
+int batch_run(SOCKET *s, batch_t *b) {
+    char message[BUFFER_SIZE];
+    char part[MAX_PATH * 2 + 8];
+    int failed = 0;
+
+    for (int i = 0; i < b->count; i++) {
+        batch_item_t *item = &b->items[i];
+        item->batch = b;
+        int resume = 0;
+        if (b->op == BATCH_GET) {
+            // Nomes com subdiretórios ("árvore/a.txt") gravam dentro de -o
+            if (make_parent_dirs(item->path) != 0) {
+                batch_finish(b, item, 0, "Erro ao criar o diretório de destino.");
+                continue;
+            }
+            snprintf(part, sizeof(part), "%s.part", item->path);
+            resume = path_exists(part);
+        }
+        if (b->op != BATCH_RM && ((b->op == BATCH_PUT && config.dedup) || item->size >= config.chunk_size || resume)) {
+            item->status = ITEM_LARGE;
+        } else if (b->op == BATCH_PUT) {
+            bfs_put(bfs_cluster_route(cluster, item->name), item->path, item->name, batch_done, item);
+        } else if (b->op == BATCH_GET) {
+            batch_get(item);
+        } else {
+            bfs_delete(bfs_cluster_route(cluster, item->name), item->name, batch_done, item);
+        }
+    }
+    bfs_cluster_wait(cluster);
+    for (int i = 0; i < replica_count; i++) bfs_wait(replicas[i]);
+
+    // Grandes e refeitos: um a um, com retomada
+    for (int i = 0; i < b->count; i++) {
+        batch_item_t *item = &b->items[i];
+        if (item->status == ITEM_DONE || item->status == ITEM_FAILED) continue;
+        int result = batch_single(s, b, item, message, sizeof(message));
+        if (result < 0) return -1;
+        batch_finish(b, item, result == 1, message);
+    }
+
+    for (int i = 0; i < b->count; i++) failed += b->items[i].status != ITEM_DONE;
+    return failed;
+}
+
+/*--------------------------------------------------------------
+ * REDISTRIBUIÇÃO ENTRE OS NÓS DO CLUSTER
+ *------------------------------------------------------------*/
+
+/**
+ * Andamento de uma redistribuição
  */
-void set_console_encoding() {
-    system("chcp 65001 > nul");     // Muda a página de código para UTF-8
-    SetConsoleOutputCP(CP_UTF8);    // Configura saída do console para UTF-8
-    SetConsoleCP(CP_UTF8);          // Configura entrada do console para UTF-8
-    setlocale(LC_ALL, "Portuguese_Brazil.1252"); // Configura localização
+typedef struct {
+    mutex_t lock;
+    cond_t cond;
+    int active;                 // Arquivos sendo movidos
+    int moved, failed;
+} rebalance_t;
+
+/**
+ * Listagem de um nó de origem
+ */
+typedef struct {
+    batch_t *batch;             // Arquivos a mover (path: cópia temporária local)
+    int node;                   // Nó listado (-1: nó que sai do cluster)
+} rebalance_list_t;
+
+/**
+ * Um arquivo em movimento: baixado da origem, enviado ao dono e excluído
+ * da origem
+ */
+typedef struct {
+    rebalance_t *rebalance;
+    batch_item_t *item;
+    bfs_client_t *from, *to;
+    int stage;                  // 0 baixando, 1 enviando, 2 excluindo da origem
+} move_t;
+
+/**
+ * Guarda os nomes de um nó que pertencem a outro
+ */
+void rebalance_visit(const list_entry_t *e, void *ctx) {
+    rebalance_list_t *l = (rebalance_list_t *)ctx;
+    char path[MAX_PATH * 2];
+
+    if (bfs_cluster_owner(cluster, e->name) == l->node) return;
+    snprintf(path, sizeof(path), "%s" PATH_SEP ".bigfs-move-%d", config.output, l->batch->count);
+    batch_add(l->batch, path, e->name, e->size);
 }
 
 /**
- * Exibe uma barra de progresso gráfica no console
- * 
- * @param percentage Porcentagem completada (0-100)
- * 
+ * Avança um arquivo em movimento para a próxima etapa (thread da conexão)
+ *
  * Por que foi feito:
- * - Feedback visual durante transferências longas
- * - Melhor experiência do usuário
+ * - A cópia só sai da origem depois que o dono confirmou o envio; se algo
+ *   falha no meio, o arquivo continua legível em pelo menos um nó
  */
-void show_progress(int percentage) {
-    printf("\r[");  // \r volta ao início da linha
-    
-    // Calcula posição do cursor na barra
-    int pos = percentage / 5;
-    
-    // Desenha a barra
-    for (int i = 0; i < 20; ++i) {
-        if (i < pos) printf("=");       // Parte completada
-        else if (i == pos) printf(">"); // Posição atual
-        else printf(" ");               // Parte não completada
+void move_done(void *ctx, const bfs_result_t *r) {
+    move_t *m = (move_t *)ctx;
+    rebalance_t *rb = m->rebalance;
+
+    if (r->status == BFS_OK && m->stage == 0) {
+        m->stage = 1;
+        bfs_put(m->to, m->item->path, m->item->name, move_done, m);
+        return;
     }
-    
-    printf("] %d%%", percentage);  // Mostra porcentagem
-    fflush(stdout);                // Força exibição imediata
+    if (m->stage == 0) {
+        char part[MAX_PATH * 2 + 8];
+        snprintf(part, sizeof(part), "%s.part", m->item->path);
+        remove(part);
+    }
+    if (m->stage == 1) remove(m->item->path);
+    if (r->status == BFS_OK && m->stage == 1) {
+        m->stage = 2;
+        bfs_delete(m->from, m->item->name, move_done, m);
+        return;
+    }
+
+    if (r->status == BFS_OK) printf("movido: %s\n", m->item->name);
+    else printf("falhou: %s%s%s\n", m->item->name, r->message[0] ? " - " : "", r->message);
+    mutex_lock(&rb->lock);
+    rb->active--;
+    if (r->status == BFS_OK) rb->moved++;
+    else rb->failed++;
+    cond_signal(&rb->cond);
+    mutex_unlock(&rb->lock);
 }
 
 /**
- * Exibe mensagem de conclusão de operação
- * 
- * @param operation Nome da operação realizada
- * @param filename Nome do arquivo envolvido
- * 
- * Por que foi feito:
- * - Feedback claro ao usuário sobre conclusão de operações
+ * Move para os donos os arquivos de um nó que não lhe pertencem
+ *
+ * @param node Posição do nó no cluster, ou -1 para um nó que sai
+ * @return 0 em caso de sucesso, -1 se não foi possível listar o nó
  */
-void show_complete_message(const char* operation, const char* filename) {
-    printf("\n%s %s concluído com sucesso!\n", operation, filename);
+int rebalance_source(rebalance_t *rb, bfs_client_t *from, int node) {
+    batch_t b;
+    rebalance_list_t l = { &b, node };
+
+    memset(&b, 0, sizeof(b));
+    if (list_remote(from, "", rebalance_visit, &l) < 0) {
+        batch_free(&b);
+        return -1;
+    }
+    move_t *moves = (move_t *)calloc((size_t)b.count + 1, sizeof(move_t));
+    for (int i = 0; i < b.count && moves != NULL; i++) {
+        mutex_lock(&rb->lock);
+        while (rb->active >= REBALANCE_PARALLEL) cond_wait(&rb->cond, &rb->lock);
+        rb->active++;
+        mutex_unlock(&rb->lock);
+
+        move_t *m = &moves[i];
+        m->rebalance = rb;
+        m->item = &b.items[i];
+        m->from = from;
+        m->to = bfs_cluster_route(cluster, m->item->name);
+        bfs_get_file(from, m->item->name, m->item->path, move_done, m);
+    }
+
+    mutex_lock(&rb->lock);
+    while (rb->active > 0) cond_wait(&rb->cond, &rb->lock);
+    mutex_unlock(&rb->lock);
+    free(moves);
+    batch_free(&b);
+    return moves != NULL ? 0 : -1;
 }
 
 /**
- * Lista arquivos no diretório local
- * 
- * @param path Caminho do diretório a ser listado
- * 
+ * Leva cada arquivo do cluster ao nó que é dono do nome
+ *
+ * @param leaving Nós que saem do cluster ("ip:porta"), esvaziados por inteiro
+ * @return Número de falhas
+ *
  * Por que foi feito:
- * - Permitir ao usuário visualizar arquivos disponíveis para upload
- * - Interface amigável para navegação local
+ * - Depois que um nó entra no cluster (-C com um nó a mais), só os nomes
+ *   que o anel passou para ele mudam de lugar; os demais ficam onde estão
+ * - Os nós não conhecem o anel: a cópia passa pelo cliente, com até
+ *   REBALANCE_PARALLEL arquivos em andamento
  */
-void list_local_files(const char* path) {
-    WIN32_FIND_DATA findFileData;  // Estrutura para dados do arquivo
-    HANDLE hFind;                  // Handle para busca
-    char searchPath[MAX_PATH];     // Caminho para busca
-    
-    // Prepara o caminho de busca (todos os arquivos)
-    sprintf(searchPath, "%s\\*", path);
-    
-    // Inicia a busca
-    hFind = FindFirstFile(searchPath, &findFileData);
-    
-    if (hFind == INVALID_HANDLE_VALUE) {
-        printf("Nenhum arquivo encontrado no diretório.\n");
-        return;
+int rebalance(int count, char **leaving) {
+    rebalance_t rb;
+    int failed = 0;
+
+    memset(&rb, 0, sizeof(rb));
+    mutex_init(&rb.lock);
+    cond_init(&rb.cond);
+    uint64_t start = monotonic_ns();
+    for (int node = 0; node < cluster->ring.count; node++) {
+        failed += rebalance_source(&rb, cluster->nodes[node], node) != 0;
     }
-    
-    printf("\nArquivos no diretório local:\n");
-    int count = 1;
-    
-    // Lista todos os arquivos, ignorando "." e ".."
-    do {
-        if (strcmp(findFileData.cFileName, ".") != 0 && 
-            strcmp(findFileData.cFileName, "..") != 0) {
-            printf("%d. %s\n", count++, findFileData.cFileName);
+
+    for (int i = 0; i < count; i++) {
+        char address[RING_NAME_SIZE];
+        int port = bfs_node_split(leaving[i], address);
+        int member = 0;
+        for (int node = 0; node < cluster->ring.count; node++) member |= strcmp(cluster->ring.names[node], leaving[i]) == 0;
+        bfs_client_t *from = port < 0 || member ? NULL
+                             : bfs_open(address, port, config.streams, config.window, config.codec);
+        if (from == NULL) {
+            printf("Nó inválido ou ainda no cluster (-C): %s\n", leaving[i]);
+            failed++;
+            continue;
         }
-    } while (FindNextFile(hFind, &findFileData) != 0);
-    
-    FindClose(hFind);  // Libera o handle de busca
+        failed += rebalance_source(&rb, from, -1) != 0;
+        bfs_close(from);
+    }
+
+    printf("rebalance: %d arquivo(s) movido(s), %d falha(s), %.2f s\n", rb.moved, rb.failed,
+           (double)(monotonic_ns() - start) / 1e9);
+    mutex_destroy(&rb.lock);
+    cond_destroy(&rb.cond);
+    return failed + rb.failed;
 }
 
 /**
- * Permite ao usuário selecionar um arquivo da lista local
- * 
- * @param path Diretório onde procurar arquivos
- * @param selectedFile Buffer para armazenar o nome do arquivo selecionado
- * @return 1 se seleção bem sucedida, 0 caso contrário
- * 
- * Por que foi feito:
- * - Interface interativa para seleção de arquivos
- * - Validação da entrada do usuário
+ * Executa um comando do modo em lote
+ *
+ * @return Número de falhas, ou -1 se a conexão principal foi perdida
  */
-int select_file_from_list(const char* path, char* selectedFile) {
-    WIN32_FIND_DATA findFileData;
-    HANDLE hFind;
-    char searchPath[MAX_PATH];
-    int fileCount = 0;
-    int selectedIndex = 0;
-    
-    sprintf(searchPath, "%s\\*", path);
-    hFind = FindFirstFile(searchPath, &findFileData);
-    
-    if (hFind == INVALID_HANDLE_VALUE) {
-        printf("Nenhum arquivo encontrado no diretório.\n");
-        return 0;
+int batch_command(SOCKET *s, int argc, char **argv) {
+    char message[BUFFER_SIZE];
+    batch_t b;
+    int failed = 0;
+
+    if (argc == 0) return 0;
+    if (strcmp(argv[0], "ls") == 0 && argc <= 2) {
+        return request_list("Arquivos no servidor:", argc > 1 ? argv[1] : "") == 0 ? 0 : -1;
     }
-    
-    // Conta quantos arquivos existem
-    do {
-        if (strcmp(findFileData.cFileName, ".") != 0 && 
-            strcmp(findFileData.cFileName, "..") != 0) {
-            fileCount++;
-        }
-    } while (FindNextFile(hFind, &findFileData) != 0);
-    
-    FindClose(hFind);
-    
-    if (fileCount == 0) {
-        printf("Nenhum arquivo encontrado no diretório.\n");
-        return 0;
+    if ((strcmp(argv[0], "putdir") == 0 || strcmp(argv[0], "getdir") == 0) && (argc == 2 || argc == 3)) {
+        const char *second = argc == 3 ? argv[2] : "";
+        return argv[0][0] == 'p' ? tree_put_dir(s, argv[1], second) : tree_get_dir(s, argv[1], second);
     }
-    
-    // Lista os arquivos com números para seleção
-    hFind = FindFirstFile(searchPath, &findFileData);
-    printf("\nSelecione um arquivo:\n");
-    int count = 1;
-    
-    do {
-        if (strcmp(findFileData.cFileName, ".") != 0 && 
-            strcmp(findFileData.cFileName, "..") != 0) {
-            printf("%d. %s\n", count++, findFileData.cFileName);
+    if (strcmp(argv[0], "sync") == 0 && argc == 2) {
+        int result = delta_sync(s, argv[1], base_name(argv[1]), message, sizeof(message));
+        if (result < 0) return -1;
+        printf("%s: %s - %s\n", result == 1 ? "sincronizado" : "falhou", argv[1], message);
+        return result == 1 ? 0 : 1;
+    }
+    if (strcmp(argv[0], "rebalance") == 0) return rebalance(argc - 1, argv + 1);
+
+    memset(&b, 0, sizeof(b));
+    if (strcmp(argv[0], "put") == 0) b.op = BATCH_PUT;
+    else if (strcmp(argv[0], "get") == 0) b.op = BATCH_GET;
+    else if (strcmp(argv[0], "rm") == 0) b.op = BATCH_RM;
+    else {
+        printf("Comando inválido: %s\n", argv[0]);
+        return 1;
+    }
+    if (b.op == BATCH_GET && !path_exists(config.output)) {
+        printf("Diretório de destino não existe: %s\n", config.output);
+        return 1;
+    }
+
+    uint64_t start = monotonic_ns();
+    for (int i = 1; i < argc; i++) {
+        int result = b.op == BATCH_PUT ? batch_expand_local(&b, argv[i]) : batch_expand_remote(&b, argv[i]);
+        if (result < 0) {
+            batch_free(&b);
+            return -1;
         }
-    } while (FindNextFile(hFind, &findFileData) != 0);
-    
-    FindClose(hFind);
-    
-    // Obtém a seleção do usuário
-    printf("\nDigite o número do arquivo: ");
-    scanf("%d", &selectedIndex);
-    getchar(); // Limpa o buffer do teclado
-    
-    // Valida a entrada
-    if (selectedIndex < 1 || selectedIndex > fileCount) {
-        printf("Seleção inválida.\n");
-        return 0;
+        failed += result;
     }
-    
-    // Encontra o arquivo correspondente ao número selecionado
-    hFind = FindFirstFile(searchPath, &findFileData);
-    count = 1;
-    
-    do {
-        if (strcmp(findFileData.cFileName, ".") != 0 && 
-            strcmp(findFileData.cFileName, "..") != 0) {
-            if (count++ == selectedIndex) {
-                strcpy(selectedFile, findFileData.cFileName);
-                FindClose(hFind);
-                return 1;
-            }
+
+    int result = batch_run(s, &b);
+    if (result >= 0) {
+        printf("%s: %d arquivo(s), %d falha(s), %.2f s\n", argv[0], b.count, result,
+               (double)(monotonic_ns() - start) / 1e9);
+    }
+    batch_free(&b);
+    return result < 0 ? -1 : failed + result;
+}
+
+/**
+ * Separa uma linha de roteiro em palavras
+ *
+ * @return Número de palavras
+ *
+ * Por que foi feito:
+ * - Aspas duplas agrupam nomes com espaços; "#" no início de uma palavra
+ *   começa um comentário até o fim da linha
+ */
+int split_words(char *line, char **words, int max) {
+    int count = 0;
+    char *p = line;
+
+    while (count < max) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0' || *p == '#') break;
+
+        char *out = p;
+        words[count++] = out;
+        int quoted = 0;
+        while (*p != '\0' && (quoted || (*p != ' ' && *p != '\t'))) {
+            if (*p == '"') quoted = !quoted;
+            else *out++ = *p;
+            p++;
         }
-    } while (FindNextFile(hFind, &findFileData) != 0);
-    
-    FindClose(hFind);
-    return 0;
+        if (*p != '\0') p++;
+        *out = '\0';
+    }
+    return count;
 }
 
 /**
- * Obtém o caminho de destino para download
- * 
- * @param path Buffer para armazenar o caminho
- * 
+ * Executa os comandos da linha de comando e do roteiro, em ordem
+ *
+ * @return Número de falhas, ou -1 se a conexão principal foi perdida
+ *
  * Por que foi feito:
- * - Flexibilidade para o usuário escolher onde salvar arquivos
- * - Validação de existência do diretório
+ * - Tarefas agendadas não têm quem responda ao menu; os comandos chegam
+ *   pela linha de comando (separados por ";") ou por um roteiro, uma
+ *   linha por comando
  */
-void get_download_path(char* path) {
-    printf("\nDigite o diretório de destino para o download (ou pressione Enter para usar o diretório atual): ");
-    fgets(path, MAX_PATH, stdin);
-    path[strcspn(path, "\n")] = '\0';  // Remove o \n do final
-    
-    // Se vazio, usa o diretório atual
-    if (strlen(path) == 0) {
-        GetCurrentDirectory(MAX_PATH, path);
+int run_batch(SOCKET *s, int argc, char *argv[]) {
+    int failed = 0;
+
+    quiet_progress = 1;
+    if (config.command > 0) {
+        int first = config.command;
+        for (int i = first; i <= argc; i++) {
+            if (i < argc && strcmp(argv[i], ";") != 0) continue;
+            int result = batch_command(s, i - first, argv + first);
+            if (result < 0) return -1;
+            failed += result;
+            first = i + 1;
+        }
     }
-    
-    // Verifica se o diretório existe
-    if (_access(path, 0) == -1) {
-        printf("Diretório não existe. Usando diretório atual.\n");
-        GetCurrentDirectory(MAX_PATH, path);
+    if (config.script == NULL) return failed;
+
+    FILE *script = strcmp(config.script, "-") == 0 ? stdin : fopen(config.script, "r");
+    char *line = (char *)malloc(BATCH_LINE_SIZE);
+    char **words = (char **)malloc(BATCH_MAX_WORDS * sizeof(char *));
+    if (script == NULL || line == NULL || words == NULL) {
+        printf("Não foi possível ler o roteiro %s.\n", config.script);
+        failed++;
+    }
+    while (script != NULL && line != NULL && words != NULL && fgets(line, BATCH_LINE_SIZE, script) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        int result = batch_command(s, split_words(line, words, BATCH_MAX_WORDS), words);
+        if (result < 0) {
+            failed = -1;
+            break;
+        }
+        failed += result;
     }
+    if (script != NULL && script != stdin) fclose(script);
+    free(line);
+    free(words);
+    return failed;
 }
 
 /**
- * Limpa o buffer de entrada
- * 
+ * Exibe as opções de linha de comando do cliente
+ */
+void print_usage(const char *program) {
+    printf("Uso: %s [opções] [comando [argumentos] [\\; comando ...]]\n", program);
+    printf("  -a <endereço>  IP do servidor (padrão %s)\n", SERVER_ADDRESS);
+    printf("  -p <porta>     Porta do servidor (padrão %d)\n", PORT);
+    printf("  -n <conexões>  Conexões paralelas por transferência (padrão %d)\n", PARALLEL_STREAMS);
+    printf("  -k <MB>        Tamanho dos blocos paralelos (padrão %d)\n", CHUNK_SIZE_MB);
+    printf("  -s <modo>      Uploads: full ou dedup (só blocos novos; padrão full)\n");
+    printf("  -c <codec>     Compressão: auto, lz4, zstd ou none (padrão auto)\n");
+    printf("  -b <arquivo>   Executa os comandos do roteiro (\"-\": entrada padrão)\n");
+    printf("  -w <pedidos>   Pedidos em andamento por conexão (listas e arquivos pequenos; padrão %d)\n", BATCH_WINDOW);
+    printf("  -o <diretório> Destino dos downloads no modo em lote (padrão: atual)\n");
+    printf("  -C <nós>       Cluster: ip:porta de cada nó, separados por vírgula (substitui -a e -p)\n");
+    printf("  -R <réplicas>  Réplicas do servidor (ip:porta,...) que também atendem o get\n");
+    printf("Comandos (modo em lote, sem menu):\n");
+    printf("  ls [prefixo]           Lista arquivos do servidor\n");
+    printf("  put <arquivos...>      Envia arquivos locais (aceita *, ? e [...])\n");
+    printf("  get <nomes...>         Baixa arquivos do servidor (aceita *, ? e [...])\n");
+    printf("  rm <nomes...>          Exclui arquivos do servidor (aceita *, ? e [...])\n");
+    printf("  sync <arquivo>         Atualiza um arquivo do servidor por diferenças\n");
+    printf("  putdir <dir> [nome]    Envia um diretório com os subdiretórios\n");
+    printf("  getdir <nome> [dir]    Baixa um diretório do servidor com os subdiretórios\n");
+    printf("  rebalance [nós...]     Leva cada arquivo ao dono no cluster, esvaziando os nós que saem\n");
+}
+
+/**
+ * Separa a lista de nós de -C
+ *
+ * @param names Recebe "ip:porta" de cada nó (RING_MAX_NODES posições)
+ * @return Número de nós, ou -1 se algum nó é inválido ou são muitos
+ */
+int parse_nodes(const char *text, char names[][RING_NAME_SIZE]) {
+    char address[RING_NAME_SIZE];
+    int count = 0;
+
+    while (*text != '\0') {
+        size_t len = strcspn(text, ",");
+        if (count == RING_MAX_NODES || len == 0 || len >= RING_NAME_SIZE) return -1;
+        snprintf(names[count], RING_NAME_SIZE, "%.*s", (int)len, text);
+        if (bfs_node_split(names[count], address) < 0) return -1;
+        count++;
+        text += len;
+        if (*text == ',') text++;
+    }
+    return count > 0 ? count : -1;
+}
+
+/**
+ * Lê as opções da linha de comando para a configuração global
+ *
+ * @return 0 se as opções são válidas, -1 caso contrário
+ *
  * Por que foi feito:
- * - Evitar problemas com entradas pendentes no buffer
- * - Garantir leitura correta da próxima entrada
+ * - O número de conexões e o tamanho dos blocos que aproveitam melhor o
+ *   link dependem da latência e da banda, então são ajustáveis por execução
  */
-void clear_input_buffer() {
-    while (getchar() != '\n');
+int parse_arguments(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (argv[i][0] != '-') {
+            // Primeiro comando do modo em lote: o restante é dele
+            config.command = i;
+            break;
+        }
+        if (strcmp(argv[i], "-h") == 0) return -1;
+        if (value == NULL) return -1;
+
+        if (strcmp(argv[i], "-a") == 0) snprintf(config.address, sizeof(config.address), "%s", value);
+        else if (strcmp(argv[i], "-p") == 0) config.port = atoi(value);
+        else if (strcmp(argv[i], "-n") == 0) config.streams = atoi(value);
+        else if (strcmp(argv[i], "-k") == 0) config.chunk_size = strtoull(value, NULL, 10) * 1024 * 1024;
+        else if (strcmp(argv[i], "-s") == 0) {
+            if (strcmp(value, "dedup") == 0) config.dedup = 1;
+            else if (strcmp(value, "full") == 0) config.dedup = 0;
+            else return -1;
+        }
+        else if (strcmp(argv[i], "-c") == 0) {
+            if (strcmp(value, "auto") == 0) config.codec = -1;
+            else if ((config.codec = codec_parse(value)) < 0) return -1;
+        }
+        else if (strcmp(argv[i], "-b") == 0) config.script = value;
+        else if (strcmp(argv[i], "-w") == 0) config.window = atoi(value);
+        else if (strcmp(argv[i], "-o") == 0) config.output = value;
+        else if (strcmp(argv[i], "-C") == 0) config.nodes = value;
+        else if (strcmp(argv[i], "-R") == 0) config.replicas = value;
+        else return -1;
+        i++;
+    }
+
+    if (config.port <= 0 || config.port > 65535 || config.streams <= 0 ||
+        config.streams > MAX_STREAMS || config.chunk_size == 0 ||
+        config.window <= 0 || config.window > BATCH_MAX_WINDOW) return -1;
+    char names[RING_MAX_NODES][RING_NAME_SIZE];
+    if (config.nodes != NULL && parse_nodes(config.nodes, names) < 0) return -1;
+    // Réplicas são de um servidor só: com cluster, não há a quem pertençam
+    if (config.replicas != NULL && (config.nodes != NULL || parse_nodes(config.replicas, names) < 0)) return -1;
+    return 0;
 }
 
 /*******************************************************************************
  * FUNÇÃO PRINCIPAL
  ******************************************************************************/
-int main() {
+int main(int argc, char *argv[]) {
     // Configura o console para suportar acentos e caracteres especiais
     set_console_encoding();
+
+    if (parse_arguments(argc, argv) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    bufpool_init(0);
     
     // Variáveis para conexão
-    WSADATA wsa;                    // Estrutura para inicialização do Winsock
     SOCKET s;                       // Socket para comunicação
-    struct sockaddr_in server;      // Estrutura com dados do servidor
     
     // Buffers e variáveis de controle
-    char buffer[BUFFER_SIZE];       // Buffer para transferência de dados
-    char command[BUFFER_SIZE];      // Buffer para comandos
+    char message[BUFFER_SIZE];      // Mensagem de resposta do servidor
     char filename[MAX_PATH];        // Nome do arquivo
     char currentDir[MAX_PATH];      // Diretório atual
     char downloadPath[MAX_PATH];    // Caminho para download
     
     /*--------------------------------------------------------------
-     * INICIALIZAÇÃO DO WINSOCK
+     * INICIALIZAÇÃO DA REDE
      *------------------------------------------------------------*/
-    printf("Inicializando Winsock...\n");
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-        printf("Falha. Código de erro: %d\n", WSAGetLastError());
+    printf("Inicializando rede...\n");
+    if (net_init() != 0) {
+        printf("Falha. Código de erro: %d\n", net_error());
         return 1;
     }
     printf("Inicializado.\n");
     
     /*--------------------------------------------------------------
-     * CRIAÇÃO DO SOCKET
+     * CONFIGURAÇÃO E CONEXÃO COM SERVIDOR
      *------------------------------------------------------------*/
-    if ((s = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET) {
-        printf("Não foi possível criar o socket: %d\n", WSAGetLastError());
+    // Nós do cluster (-C), ou um nó só com o servidor de -a e -p
+    char node_names[RING_MAX_NODES][RING_NAME_SIZE];
+    const char *nodes[RING_MAX_NODES];
+    int node_count = 1;
+    if (config.nodes != NULL) node_count = parse_nodes(config.nodes, node_names);
+    else snprintf(node_names[0], RING_NAME_SIZE, "%.48s:%d", config.address, config.port);
+    for (int i = 0; i < node_count; i++) nodes[i] = node_names[i];
+
+    // Conexões da biblioteca: abertas no primeiro pedido que as usar
+    cluster = bfs_cluster_open(nodes, node_count, config.streams, config.window, config.codec);
+
+    // Transferências do menu e arquivos grandes: um pedido por conexão, para
+    // que os blocos de uma transferência paralela sigam por conexões diferentes
+    transfers = bfs_cluster_open(nodes, node_count, config.streams, 1, config.codec);
+    if (cluster == NULL || transfers == NULL) {
+        printf("Lista de nós inválida ou memória insuficiente.\n");
+        close_clients();
+        net_cleanup();
         return 1;
     }
-    printf("Socket criado.\n");
-    
-    /*--------------------------------------------------------------
-     * CONFIGURAÇÃO E CONEXÃO COM SERVIDOR
-     *------------------------------------------------------------*/
-    server.sin_addr.s_addr = inet_addr("127.0.0.1");  // IP do servidor
-    server.sin_family = AF_INET;                      // Família IPv4
-    server.sin_port = htons(PORT);                    // Porta
-    
-    if (connect(s, (struct sockaddr *)&server, sizeof(server)) < 0) {
-        printf("Falha na conexão. Código de erro: %d\n", WSAGetLastError());
+
+    // Réplicas de leitura: conexões abertas no primeiro download
+    int replica_total = config.replicas != NULL ? parse_nodes(config.replicas, node_names) : 0;
+    for (; replica_count < replica_total; replica_count++) {
+        char address[RING_NAME_SIZE];
+        int port = bfs_node_split(node_names[replica_count], address);
+        if ((replicas[replica_count] = bfs_open(address, port, config.streams, config.window, config.codec)) == NULL) {
+            printf("Memória insuficiente.\n");
+            close_clients();
+            net_cleanup();
+            return 1;
+        }
+    }
+
+    // Conexão principal: começa no primeiro nó e segue o dono de cada nome
+    server_addr = cluster->nodes[0]->addr;
+    main_node = 0;
+    if ((s = connect_server()) == INVALID_SOCKET) {
+        printf("Falha na conexão. Código de erro: %d\n", net_error());
+        close_clients();
+        net_cleanup();
         return 1;
     }
-    printf("Conectado ao servidor.\n");
+    if (node_count > 1) printf("Conectado ao cluster (%d nós).\n", node_count);
+    else printf("Conectado ao servidor.\n");
+    negotiate_codecs(s);
+    
+    // Comandos na linha de comando ou em roteiro: executa sem o menu
+    if (config.command > 0 || config.script != NULL) {
+        int failed = run_batch(&s, argc, argv);
+        if (failed >= 0) proto_send_frame(s, OP_BYE, 0, next_request_id(), NULL, 0);
+        closesocket(s);
+        close_clients();
+        net_cleanup();
+        return failed == 0 ? 0 : 1;
+    }
     
     // Obtém o diretório atual para operações locais
-    GetCurrentDirectory(MAX_PATH, currentDir);
+    current_dir(currentDir, MAX_PATH);
     
     /*--------------------------------------------------------------
      * LOOP PRINCIPAL - INTERFACE DO USUÁRIO
@@ -322,100 +3375,52 @@ int main() {
         printf("4. DELETE - Excluir arquivo no servidor\n");
         printf("5. LOCAL - Listar arquivos no diretório local\n");
         printf("6. EXIT - Desconectar do servidor\n");
+        printf("7. SYNC - Atualizar arquivo do servidor (envia só as diferenças)\n");
+        printf("8. PUTDIR - Enviar diretório (com subdiretórios) para o servidor\n");
+        printf("9. GETDIR - Baixar diretório do servidor\n");
         printf("Digite o número do comando: ");
         
         int choice;
-        if (scanf("%d", &choice) != 1) {
+        int scanned = scanf("%d", &choice);
+        if (scanned == EOF) {
+            choice = 6;  // Entrada encerrada: desconecta
+        } else if (scanned != 1) {
             clear_input_buffer();
             printf("Entrada inválida. Tente novamente.\n");
             continue;
+        } else {
+            clear_input_buffer();
         }
-        clear_input_buffer();
         
         // Processa a escolha do usuário
         switch (choice) {
             case 1: { // LIST - Listar arquivos no servidor
-                strcpy(command, "LIST");
-                send(s, command, strlen(command), 0);
-                
-                // Limpa o buffer e recebe a lista de arquivos
-                memset(buffer, 0, BUFFER_SIZE);
-                int bytes_received = recv(s, buffer, BUFFER_SIZE - 1, 0);
-                
-                if (bytes_received > 0) {
-                    buffer[bytes_received] = '\0';
-                    printf("\nArquivos no servidor:\n%s\n", buffer);
-                }
+                printf("Filtrar por prefixo (ou pressione Enter para listar todos): ");
+                if (fgets(filename, MAX_PATH, stdin) == NULL) filename[0] = '\0';
+                filename[strcspn(filename, "\n")] = '\0';
+                if (request_list("Arquivos no servidor:", filename) != 0) goto connection_lost;
                 break;
             }
                 
             case 2: { // UPLOAD - Enviar arquivo para o servidor
-                int bytes_received;
                 printf("\nDiretório atual: %s\n", currentDir);
-                list_local_files(currentDir);
                 
                 if (select_file_from_list(currentDir, filename)) {
-                    // Prepara o comando UPLOAD
-                    sprintf(command, "UPLOAD %s", filename);
-                    
-                    // Abre o arquivo para leitura binária
-                    FILE *file = fopen(filename, "rb");
-                    if (file == NULL) {
-                        printf("Arquivo não encontrado: %s\n", filename);
-                        break;
-                    }
-                    
-                    // Obtém o tamanho do arquivo
-                    fseek(file, 0, SEEK_END);
-                    long file_size = ftell(file);
-                    fseek(file, 0, SEEK_SET);
-                    
-                    printf("\nEnviando %s (Tamanho: %ld bytes)\n", filename, file_size);
-                    send(s, command, strlen(command), 0);
-                    
-                    long total_sent = 0;
-                    size_t bytes_read;
-                    
-                    // Lê e envia o arquivo em chunks
-                    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-                        send(s, buffer, bytes_read, 0);
-                        total_sent += bytes_read;
-                        int progress = (int)((total_sent * 100) / file_size);
-                        show_progress(progress);
-                    }
-                    
-                    fclose(file);
-                    shutdown(s, SD_SEND);  // Indica fim do envio
-                    
-                    // Aguarda confirmação do servidor
-                    memset(buffer, 0, BUFFER_SIZE);
-                    bytes_received = recv(s, buffer, BUFFER_SIZE - 1, 0);
-                    if (bytes_received > 0) {
-                        buffer[bytes_received] = '\0';
-                        show_complete_message("Upload de", filename);
-                        printf("Resposta do servidor: %s\n", buffer);
-                    }
+                    int result = send_file(&s, filename, filename, message, sizeof(message));
+                    if (result < 0) goto connection_lost;
+                    if (result == 1) show_complete_message("Upload de", filename);
+                    printf("\nResposta do servidor: %s\n", message);
                 }
                 break;
             }
                 
             case 3: { // DOWNLOAD - Baixar arquivo do servidor
-                strcpy(command, "LIST");
-                send(s, command, strlen(command), 0);
-                
                 // Recebe lista de arquivos disponíveis
-                memset(buffer, 0, BUFFER_SIZE);
-                int bytes_received = recv(s, buffer, BUFFER_SIZE - 1, 0);
-                if (bytes_received <= 0) {
-                    printf("Erro ao receber lista de arquivos\n");
-                    break;
-                }
-                buffer[bytes_received] = '\0';
-                printf("\nArquivos disponíveis para download:\n%s\n", buffer);
+                if (request_list("Arquivos disponíveis para download:", "") != 0) goto connection_lost;
                 
                 // Obtém nome do arquivo para download
                 printf("Digite o nome do arquivo para download: ");
-                fgets(filename, MAX_PATH, stdin);
+                if (fgets(filename, MAX_PATH, stdin) == NULL) filename[0] = '\0';
                 filename[strcspn(filename, "\n")] = '\0';
                 
                 if (strlen(filename) == 0) {
@@ -425,74 +3430,24 @@ int main() {
                 
                 // Obtém diretório de destino
                 get_download_path(downloadPath);
-                char fullPath[MAX_PATH];
-                sprintf(fullPath, "%s\\%s", downloadPath, filename);
-                
-                // Envia comando DOWNLOAD
-                sprintf(command, "DOWNLOAD %s", filename);
-                send(s, command, strlen(command), 0);
+                char fullPath[MAX_PATH * 2];
+                snprintf(fullPath, sizeof(fullPath), "%s" PATH_SEP "%s", downloadPath, filename);
                 
+                // Baixa para "<destino>.part", retomando se já existir
                 printf("\nBaixando %s para %s\n", filename, downloadPath);
-                
-                // Abre arquivo para escrita binária
-                FILE *file = fopen(fullPath, "wb");
-                if (file == NULL) {
-                    printf("Erro ao criar arquivo.\n");
-                    break;
-                }
-                
-                long total_received = 0;
-                int file_size = 0;
-                
-                // Recebe dados do servidor
-                memset(buffer, 0, BUFFER_SIZE);
-                bytes_received = recv(s, buffer, BUFFER_SIZE, 0);
-                if (bytes_received > 0) {
-                    // Verifica se é mensagem de erro
-                    if (strstr(buffer, "não encontrado") != NULL) {
-                        printf("%s", buffer);
-                        fclose(file);
-                        remove(fullPath);
-                        break;
-                    }
-                    
-                    // Escreve dados no arquivo
-                    fwrite(buffer, 1, bytes_received, file);
-                    total_received += bytes_received;
-                    file_size = total_received * 3; // Estimativa inicial
-                    
-                    // Continua recebendo dados
-                    while ((bytes_received = recv(s, buffer, BUFFER_SIZE, 0)) > 0) {
-                        fwrite(buffer, 1, bytes_received, file);
-                        total_received += bytes_received;
-                        int progress = (int)((total_received * 100) / (total_received + 1024));
-                        show_progress(progress > 100 ? 100 : progress);
-                    }
-                    
-                    fclose(file);
-                    show_complete_message("Download de", filename);
-                    printf("Total recebido: %ld bytes\n", total_received);
-                }
+                int result = parallel_download(filename, fullPath);
+                if (result < 0) goto connection_lost;
+                if (result == 1) show_complete_message("Download de", filename);
                 break;
             }
                 
             case 4: { // DELETE - Excluir arquivo no servidor
-                strcpy(command, "LIST");
-                send(s, command, strlen(command), 0);
-                
                 // Recebe lista de arquivos
-                memset(buffer, 0, BUFFER_SIZE);
-                int bytes_received = recv(s, buffer, BUFFER_SIZE - 1, 0);
-                if (bytes_received <= 0) {
-                    printf("Erro ao receber lista de arquivos\n");
-                    break;
-                }
-                buffer[bytes_received] = '\0';
-                printf("\nArquivos no servidor:\n%s\n", buffer);
+                if (request_list("Arquivos no servidor:", "") != 0) goto connection_lost;
                 
                 // Obtém nome do arquivo para exclusão
                 printf("Digite o nome do arquivo para excluir: ");
-                fgets(filename, MAX_PATH, stdin);
+                if (fgets(filename, MAX_PATH, stdin) == NULL) filename[0] = '\0';
                 filename[strcspn(filename, "\n")] = '\0';
                 
                 if (strlen(filename) == 0) {
@@ -500,26 +3455,12 @@ int main() {
                     break;
                 }
                 
-                // Envia comando DELETE
-                sprintf(command, "DELETE %s", filename);
+                // Pedido DELETE e confirmação
                 printf("\nExcluindo %s...\n", filename);
-                
-                // Barra de progresso simulada
-                for (int i = 0; i <= 100; i += 20) {
-                    show_progress(i);
-                    Sleep(100);
-                }
-                
-                send(s, command, strlen(command), 0);
-                
-                // Recebe confirmação
-                memset(buffer, 0, BUFFER_SIZE);
-                bytes_received = recv(s, buffer, BUFFER_SIZE - 1, 0);
-                if (bytes_received > 0) {
-                    buffer[bytes_received] = '\0';
-                    show_complete_message("Delete de", filename);
-                    printf("Resposta do servidor: %s\n", buffer);
-                }
+                int result = remote_delete(filename, message, sizeof(message));
+                if (result < 0) goto connection_lost;
+                if (result == 1) show_complete_message("Delete de", filename);
+                printf("Resposta do servidor: %s\n", message);
                 break;
             }
                 
@@ -528,11 +3469,59 @@ int main() {
                 list_local_files(currentDir);
                 break;
                 
+            case 7: { // SYNC - Atualizar arquivo do servidor por diferenças
+                printf("\nDiretório atual: %s\n", currentDir);
+
+                if (select_file_from_list(currentDir, filename)) {
+                    int result = delta_sync(&s, filename, filename, message, sizeof(message));
+                    if (result < 0) goto connection_lost;
+                    if (result == 1) show_complete_message("Sincronização de", filename);
+                    printf("\nResposta do servidor: %s\n", message);
+                }
+                break;
+            }
+
+            case 8: { // PUTDIR - Enviar diretório com subdiretórios
+                char remoteName[MAX_PATH];
+                printf("\nDiretório atual: %s\n", currentDir);
+                printf("Digite o diretório local a enviar: ");
+                if (fgets(filename, MAX_PATH, stdin) == NULL) filename[0] = '\0';
+                filename[strcspn(filename, "\n")] = '\0';
+                printf("Nome no servidor (ou pressione Enter para usar o mesmo): ");
+                if (fgets(remoteName, MAX_PATH, stdin) == NULL) remoteName[0] = '\0';
+                remoteName[strcspn(remoteName, "\n")] = '\0';
+
+                if (strlen(filename) == 0) {
+                    printf("Nome de diretório inválido.\n");
+                    break;
+                }
+                if (tree_put_dir(&s, filename, remoteName) < 0) goto connection_lost;
+                break;
+            }
+
+            case 9: { // GETDIR - Baixar diretório do servidor
+                printf("Digite o diretório do servidor a baixar: ");
+                if (fgets(filename, MAX_PATH, stdin) == NULL) filename[0] = '\0';
+                filename[strcspn(filename, "\n")] = '\0';
+
+                if (strlen(filename) == 0) {
+                    printf("Nome de diretório inválido.\n");
+                    break;
+                }
+                get_download_path(downloadPath);
+                char fullPath[MAX_PATH * 2];
+                char baseName[MAX_PATH];
+                tree_default_name(filename, baseName, sizeof(baseName));
+                snprintf(fullPath, sizeof(fullPath), "%s" PATH_SEP "%s", downloadPath, baseName);
+                if (tree_get_dir(&s, filename, fullPath) < 0) goto connection_lost;
+                break;
+            }
+
             case 6: // EXIT - Desconectar do servidor
-                strcpy(command, "EXIT");
-                send(s, command, strlen(command), 0);
+                proto_send_frame(s, OP_BYE, 0, next_request_id(), NULL, 0);
                 closesocket(s);
-                WSACleanup();
+                close_clients();
+                net_cleanup();
                 printf("Desconectado.\n");
                 return 0;
                 
@@ -541,8 +3530,11 @@ int main() {
         }
     }
     
-    // Limpeza final (não deve ser alcançado normalmente)
+connection_lost:
+    // Conexão perdida ou resposta fora do protocolo
+    printf("\nConexão com o servidor perdida.\n");
     closesocket(s);
-    WSACleanup();
-    return 0;
-}
\ No newline at end of file
+    close_clients();
+    net_cleanup();
+    return 1;
+}
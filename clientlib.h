@@ -0,0 +1,1876 @@
+/*******************************************************************************
+ * BIBLIOTECA DE ACESSO AO SERVIDOR (PEDIDOS ASSÍNCRONOS)
+ *
+ * Descrição: Fala o protocolo do servidor por um pequeno conjunto de
+ *            conexões persistentes, com vários pedidos em andamento ao
+ *            mesmo tempo em cada uma. Quem pede informa uma função de
+ *            retorno, chamada quando a resposta chega; o menu e o modo em
+ *            lote do cliente são camadas finas por cima dela.
+ *
+ * Organização:
+ * - Uma fila única de pedidos; cada conexão tem uma thread que envia (até
+ *   "window" pedidos sem resposta) e outra que lê as respostas
+ * - As respostas são casadas com os pedidos pelo id dos quadros, não pela
+ *   ordem de chegada
+ * - As conexões abrem na primeira vez que há trabalho e reabrem sozinhas
+ *   depois de uma queda; os pedidos sem resposta voltam para o início da
+ *   fila (downloads continuam do byte em que pararam, listagens a partir
+ *   da última entrada recebida)
+ * - As funções de retorno rodam na thread que lê a conexão, sem lock:
+ *   podem fazer novos pedidos, mas não devem esperar por eles
+ * - bfs_future_t transforma um pedido em chamada síncrona
+ * - bfs_stream_t leva a um PUT bytes que ainda estão chegando: o pedido
+ *   parte com o tamanho declarado e os quadros DATA saem à medida que os
+ *   blocos são escritos
+ * - Transferências retomáveis (intervalos de um download, uploads que
+ *   continuam de uma posição e blocos de um upload paralelo) e pedidos
+ *   genéricos (bfs_call) para as demais operações do protocolo
+ * - bfs_cluster_t reúne um cliente por servidor de um cluster: cada nome
+ *   vai para o nó dono no anel de hash consistente (ring.h) e as
+ *   listagens consultam todos os nós ao mesmo tempo
+ *
+ * Uso:
+ *   bfs_client_t *c = bfs_open("127.0.0.1", 8888, 4, 32, -1);
+ *   bfs_get_file(c, "a.txt", "dados/a.txt", pronto, ctx);
+ *   bfs_put(c, "b.txt", "b.txt", pronto, ctx);
+ *   bfs_wait(c);
+ *   bfs_close(c);
+ ******************************************************************************/
+#ifndef BIGFS_CLIENTLIB_H
+#define BIGFS_CLIENTLIB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "protocol.h"
+#include "digest.h"
+#include "bufpool.h"
+#include "compress.h"
+#include "ring.h"
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define BFS_MAX_CONNECTIONS 64          // Conexões de um cliente
+#define BFS_MAX_WINDOW 1024             // Pedidos sem resposta por conexão
+#define BFS_CONNECT_RETRIES 5           // Falhas seguidas ao conectar antes de recusar a fila
+#define BFS_RETRY_DELAY_MS 250          // Espera depois da primeira falha (dobra a cada uma)
+#define BFS_REQUEST_RETRIES 3           // Vezes que um pedido volta à fila (queda ou BUSY)
+#define BFS_MESSAGE_SIZE 256            // Mensagem de um resultado
+
+/**
+ * Situação final de um pedido
+ */
+enum {
+    BFS_OK,                     // Concluído
+    BFS_REFUSED,                // Recusado pelo servidor (code) ou erro local (code 0)
+    BFS_FAILED                  // Conexão perdida e tentativas esgotadas
+};
+
+/**
+ * Situação de um envio contínuo
+ */
+enum {
+    BFS_STREAM_OPEN,            // Ainda recebendo blocos
+    BFS_STREAM_END,             // Completo: o servidor pode aceitar o arquivo
+    BFS_STREAM_CANCEL           // Abandonado: o servidor descarta o que recebeu
+};
+
+/**
+ * Operações da biblioteca
+ */
+typedef enum {
+    BFS_LIST,
+    BFS_STAT,
+    BFS_DELETE,
+    BFS_GET,
+    BFS_PUT,
+    BFS_COMMIT,
+    BFS_STATUS,
+    BFS_CALL
+} bfs_op_t;
+
+/**
+ * Resultado entregue à função de retorno
+ */
+typedef struct {
+    int status;                 // BFS_*
+    uint16_t code;              // Código ERR_* quando o servidor recusou
+    char message[BFS_MESSAGE_SIZE]; // Mensagem do servidor ou motivo local
+    uint64_t size;              // GET/PUT: tamanho do arquivo; LIST: entradas;
+                                // STATUS: bytes já gravados; CALL: bytes recebidos
+    uint32_t crc;               // GET: CRC32C dos bytes entregues
+    const list_entry_t *entry;  // STAT: metadados do arquivo (NULL nas demais)
+} bfs_result_t;
+
+typedef void (*bfs_done_fn)(void *ctx, const bfs_result_t *r);
+typedef void (*bfs_entry_fn)(void *ctx, const list_entry_t *e);
+typedef int (*bfs_data_fn)(void *ctx, const uint8_t *data, size_t len);
+typedef int (*bfs_reply_fn)(void *ctx, const uint8_t *payload, size_t len);
+
+/**
+ * Bloco de um envio contínuo
+ */
+typedef struct bfs_block {
+    struct bfs_block *next;
+    size_t len;
+    uint8_t data[FRAME_DATA_CHUNK];
+} bfs_block_t;
+
+/**
+ * Bytes de um PUT que ainda estão chegando, entre quem escreve e a thread
+ * de envio
+ */
+typedef struct {
+    mutex_t lock;
+    cond_t ready;               // Bloco novo ou fim
+    bfs_block_t *head, *tail;
+    uint64_t queued;            // Bytes à espera da thread de envio
+    uint64_t limit;             // Acima disso o envio é abandonado
+    int state;                  // BFS_STREAM_*
+    int refs;
+} bfs_stream_t;
+
+/**
+ * Um pedido, da fila até a conclusão
+ */
+typedef struct bfs_request {
+    struct bfs_request *next;   // Fila ou lista dos enviados da conexão
+    bfs_op_t op;
+    uint32_t id;                // Id dos quadros na tentativa atual
+    int attempts;               // Vezes que voltou à fila
+    char *name;                 // Nome no servidor (LIST: prefixo)
+    char *path;                 // PUT: arquivo local (NULL: conteúdo em memória)
+    int fd;                     // PUT/CALL: arquivo já aberto (-1: nenhum); fechado na conclusão
+    int keep_fd;                // fd continua de quem pediu (não é fechado)
+    bfs_stream_t *stream;       // PUT: bytes ainda chegando (nunca volta à fila)
+    uint64_t upload_id;         // PUT em bloco ou retomável, COMMIT e STATUS: id do upload
+    uint64_t offset, length;    // PUT em bloco e GET: posição e tamanho (0: até o fim)
+    int resume;                 // PUT: upload retomável a partir de offset (nunca volta à fila)
+    uint32_t prefix_crc;        // GET: CRC32C dos bytes antes de offset
+    uint8_t opcode;             // CALL: operação do pedido
+    uint8_t *request;           // CALL: payload do pedido
+    size_t request_len;
+    char *cursor;               // LIST: última entrada recebida
+    const uint8_t *data;        // PUT: conteúdo em memória
+    uint64_t total;             // PUT/GET: tamanho do arquivo
+    int known;                  // GET: o servidor já informou tamanho e resumo; CALL: quadros DATA seguem
+    uint64_t received;          // GET/CALL: bytes entregues (todas as tentativas); LIST: entradas;
+                                // STATUS: bytes já gravados
+    checksum_t sum;             // GET: resumo dos bytes entregues
+    uint8_t digest[CHECKSUM_SIZE]; // GET: resumo informado pelo servidor
+    size_t digest_len;
+    uint8_t expect[CHECKSUM_CRC_SIZE]; // GET: CRC32C que a cópia precisa ter (expect_len 0: qualquer)
+    size_t expect_len;
+    uint16_t code;              // GET: recusa descoberta no meio dos dados
+    const char *reason;
+    bfs_entry_fn on_entry;
+    bfs_data_fn on_data;        // GET/CALL: bytes recebidos; PUT/CALL: progresso do envio
+    bfs_reply_fn on_reply;      // CALL: payload da resposta OK
+    bfs_done_fn done;
+    void *ctx;
+} bfs_request_t;
+
+struct bfs_client;
+
+/**
+ * Uma conexão persistente e seus pedidos enviados sem resposta completa
+ */
+typedef struct {
+    struct bfs_client *client;
+    SOCKET sock;                // INVALID_SOCKET enquanto desconectada
+    int ready;                  // Conectada e com a compressão negociada
+    int codec;                  // Compressão negociada nesta conexão
+    bfs_request_t *inflight;    // Enviados, na ordem de envio
+    bfs_request_t *inflight_tail;
+    int inflight_count;
+    bfs_request_t *sending;     // Pedido que a thread de envio está escrevendo
+    uint8_t *chunk, *out;       // Envio: dados lidos e comprimidos
+    uint8_t *buffer, *packed;   // Recepção: dados e payload comprimido
+    char *control;              // Recepção: payload de quadros de controle
+    thread_t sender, receiver;
+} bfs_conn_t;
+
+/**
+ * Cliente: fila de pedidos e conexões com um servidor
+ */
+typedef struct bfs_client {
+    mutex_t lock;
+    cond_t work;                // Fila, janela, conexão pronta ou encerramento
+    cond_t idle;                // Todos os pedidos concluídos
+    cond_t sent;                // Uma thread de envio terminou de escrever
+    struct sockaddr_in addr;
+    int codec;                  // Compressão pedida (-1: melhor codec em comum)
+    int window;                 // Pedidos sem resposta por conexão
+    int count;
+    bfs_conn_t *conns;
+    bfs_request_t *head, *tail; // Pedidos ainda não enviados
+    long pending;               // Pedidos feitos e não concluídos
+    int closing;
+    volatile long last_id;
+} bfs_client_t;
+
+/**
+ * Resposta de um pedido aguardada de forma síncrona
+ */
+typedef struct {
+    mutex_t lock;
+    cond_t cond;
+    int done;
+    bfs_result_t result;
+    list_entry_t entry;         // Cópia da entrada de um STAT
+} bfs_future_t;
+
+/*--------------------------------------------------------------
+ * ENVIO CONTÍNUO
+ *------------------------------------------------------------*/
+
+/**
+ * Cria um envio contínuo, com uma referência para quem escreve
+ *
+ * @param limit Bytes que podem esperar pela thread de envio
+ * @return Envio, ou NULL se faltou memória
+ */
+static inline bfs_stream_t *bfs_stream_new(uint64_t limit) {
+    bfs_stream_t *st = (bfs_stream_t *)calloc(1, sizeof(bfs_stream_t));
+    if (st == NULL) return NULL;
+    mutex_init(&st->lock);
+    cond_init(&st->ready);
+    st->limit = limit;
+    st->refs = 1;
+    return st;
+}
+
+/**
+ * Encerra o envio (BFS_STREAM_END ou BFS_STREAM_CANCEL); só o primeiro
+ * encerramento vale
+ */
+static inline void bfs_stream_close(bfs_stream_t *st, int state) {
+    mutex_lock(&st->lock);
+    if (st->state == BFS_STREAM_OPEN) st->state = state;
+    cond_broadcast(&st->ready);
+    mutex_unlock(&st->lock);
+}
+
+/**
+ * Acrescenta bytes ao envio
+ *
+ * @return 0 em caso de sucesso, -1 se o envio foi abandonado
+ *
+ * Por que foi feito:
+ * - Quem escreve nunca espera pela rede: se o servidor não acompanha e
+ *   os bytes à espera passam do limite, ou se falta memória, o envio é
+ *   abandonado e quem escreve decide o que fazer no lugar
+ */
+static inline int bfs_stream_write(bfs_stream_t *st, const uint8_t *data, size_t len) {
+    mutex_lock(&st->lock);
+    if (st->state == BFS_STREAM_OPEN && st->queued + len > st->limit) st->state = BFS_STREAM_CANCEL;
+    while (st->state == BFS_STREAM_OPEN && len > 0) {
+        bfs_block_t *b = st->tail;
+        if (b == NULL || b->len == FRAME_DATA_CHUNK) {
+            if ((b = (bfs_block_t *)malloc(sizeof(bfs_block_t))) == NULL) {
+                st->state = BFS_STREAM_CANCEL;
+                break;
+            }
+            b->next = NULL;
+            b->len = 0;
+            if (st->tail != NULL) st->tail->next = b;
+            else st->head = b;
+            st->tail = b;
+        }
+        size_t n = FRAME_DATA_CHUNK - b->len < len ? FRAME_DATA_CHUNK - b->len : len;
+        memcpy(b->data + b->len, data, n);
+        b->len += n;
+        st->queued += n;
+        data += n;
+        len -= n;
+    }
+    int state = st->state;
+    cond_broadcast(&st->ready);
+    mutex_unlock(&st->lock);
+    return state == BFS_STREAM_OPEN ? 0 : -1;
+}
+
+/**
+ * Retira o próximo bloco completo (ou o último), esperando se preciso
+ *
+ * @param state Recebe a situação do envio
+ * @return Bloco (liberado por quem retira), ou NULL se o envio terminou
+ */
+static inline bfs_block_t *bfs_stream_take(bfs_stream_t *st, int *state) {
+    mutex_lock(&st->lock);
+    while (st->state == BFS_STREAM_OPEN && (st->head == NULL || st->head->len < FRAME_DATA_CHUNK)) {
+        cond_wait(&st->ready, &st->lock);
+    }
+    bfs_block_t *b = st->state == BFS_STREAM_CANCEL ? NULL : st->head;
+    if (b != NULL) {
+        st->head = b->next;
+        if (st->head == NULL) st->tail = NULL;
+        st->queued -= b->len;
+    }
+    *state = st->state;
+    mutex_unlock(&st->lock);
+    return b;
+}
+
+/**
+ * Libera uma referência do envio
+ */
+static inline void bfs_stream_release(bfs_stream_t *st) {
+    if (st == NULL) return;
+    mutex_lock(&st->lock);
+    int last = --st->refs == 0;
+    mutex_unlock(&st->lock);
+    if (!last) return;
+    while (st->head != NULL) {
+        bfs_block_t *next = st->head->next;
+        free(st->head);
+        st->head = next;
+    }
+    mutex_destroy(&st->lock);
+    cond_destroy(&st->ready);
+    free(st);
+}
+
+/*--------------------------------------------------------------
+ * PEDIDOS
+ *------------------------------------------------------------*/
+
+/**
+ * Cria um pedido com cópias do nome e do caminho na mesma alocação
+ *
+ * @return Pedido, ou NULL se o nome é grande demais ou faltou memória
+ */
+static inline bfs_request_t *bfs_request_new(bfs_op_t op, const char *name, const char *path,
+                                             bfs_done_fn done, void *ctx) {
+    size_t name_len = strlen(name) + 1;
+    size_t path_len = path != NULL ? strlen(path) + 1 : 0;
+    size_t cursor_len = op == BFS_LIST ? PROTO_MAX_NAME : 0;
+
+    if (name_len > PROTO_MAX_NAME) return NULL;
+    bfs_request_t *req = (bfs_request_t *)calloc(1, sizeof(bfs_request_t) + name_len + path_len + cursor_len);
+    if (req == NULL) return NULL;
+    req->op = op;
+    req->name = (char *)(req + 1);
+    memcpy(req->name, name, name_len);
+    if (path != NULL) {
+        req->path = req->name + name_len;
+        memcpy(req->path, path, path_len);
+    }
+    if (cursor_len > 0) req->cursor = req->name + name_len + path_len;
+    req->fd = -1;
+    checksum_init(&req->sum);
+    req->done = done;
+    req->ctx = ctx;
+    return req;
+}
+
+/**
+ * Conclui um pedido: chama a função de retorno e libera o pedido
+ *
+ * @param message Motivo ou mensagem do servidor (pode ser NULL)
+ * @param entry Metadados de um STAT (NULL nas demais operações)
+ *
+ * Por que foi feito:
+ * - Chamada sem o lock, para que a função de retorno possa fazer novos
+ *   pedidos; o contador de pendentes só cai depois dela, então bfs_wait()
+ *   também espera o que ela pedir
+ */
+static inline void bfs_finish(bfs_client_t *c, bfs_request_t *req, int status, uint16_t code,
+                              const char *message, const list_entry_t *entry) {
+    bfs_result_t r;
+
+    r.status = status;
+    r.code = code;
+    snprintf(r.message, sizeof(r.message), "%s", message != NULL ? message : "");
+    r.size = req->op == BFS_LIST || req->op == BFS_STATUS || req->op == BFS_CALL ? req->received : req->total;
+    r.crc = req->sum.crc;
+    r.entry = entry;
+    if (req->done != NULL) req->done(req->ctx, &r);
+    if (req->fd >= 0 && !req->keep_fd) file_close(req->fd);
+    bfs_stream_release(req->stream);
+    free(req->request);
+    free(req);
+
+    mutex_lock(&c->lock);
+    if (--c->pending == 0) cond_broadcast(&c->idle);
+    mutex_unlock(&c->lock);
+}
+
+/**
+ * Conclui uma lista de pedidos com a mesma falha
+ */
+static inline void bfs_finish_all(bfs_client_t *c, bfs_request_t *list, const char *message) {
+    while (list != NULL) {
+        bfs_request_t *next = list->next;
+        bfs_finish(c, list, BFS_FAILED, 0, message, NULL);
+        list = next;
+    }
+}
+
+/**
+ * Põe um pedido na fila (no fim, ou no início se é a volta de um já enviado)
+ *
+ * Deve ser chamada com o lock do cliente.
+ */
+static inline void bfs_enqueue(bfs_client_t *c, bfs_request_t *req, int front) {
+    if (front) {
+        req->next = c->head;
+        c->head = req;
+        if (c->tail == NULL) c->tail = req;
+    } else {
+        req->next = NULL;
+        if (c->tail != NULL) c->tail->next = req;
+        else c->head = req;
+        c->tail = req;
+    }
+    cond_broadcast(&c->work);
+}
+
+/**
+ * Entrega um pedido novo à fila
+ *
+ * @param req Pedido criado (NULL se bfs_request_new() falhou)
+ * @return 0 em caso de sucesso, -1 se o pedido não foi criado (a função
+ *         de retorno já foi chamada com BFS_REFUSED)
+ */
+static inline int bfs_submit(bfs_client_t *c, bfs_request_t *req, bfs_done_fn done, void *ctx) {
+    if (req == NULL) {
+        bfs_result_t r;
+        memset(&r, 0, sizeof(r));
+        r.status = BFS_REFUSED;
+        snprintf(r.message, sizeof(r.message), "Nome grande demais ou memória insuficiente.");
+        if (done != NULL) done(ctx, &r);
+        return -1;
+    }
+    mutex_lock(&c->lock);
+    c->pending++;
+    bfs_enqueue(c, req, 0);
+    mutex_unlock(&c->lock);
+    return 0;
+}
+
+/**
+ * Tira um pedido da lista dos enviados de uma conexão
+ *
+ * Por que foi feito:
+ * - Uma recusa pode chegar enquanto os quadros DATA do upload ainda estão
+ *   sendo escritos; o pedido só é liberado depois que a thread de envio
+ *   termina de usá-lo
+ */
+static inline void bfs_detach(bfs_client_t *c, bfs_conn_t *conn, bfs_request_t *req) {
+    mutex_lock(&c->lock);
+    while (conn->sending == req) cond_wait(&c->sent, &c->lock);
+
+    bfs_request_t *prev = NULL;
+    for (bfs_request_t *p = conn->inflight; p != NULL; prev = p, p = p->next) {
+        if (p != req) continue;
+        if (prev != NULL) prev->next = p->next;
+        else conn->inflight = p->next;
+        if (conn->inflight_tail == p) conn->inflight_tail = prev;
+        conn->inflight_count--;
+        break;
+    }
+    req->next = NULL;
+    cond_broadcast(&c->work);
+    mutex_unlock(&c->lock);
+}
+
+/**
+ * Diz se um pedido recusado com BUSY ou CHECKSUM pode ser enviado de novo
+ *
+ * Por que foi feito:
+ * - Arquivos, blocos e conteúdos em memória podem ser lidos outra vez;
+ *   envios contínuos já consumiram os bytes, e um upload retomável
+ *   precisa antes perguntar ao servidor de onde continuar
+ */
+static inline int bfs_resendable(const bfs_request_t *req) {
+    if (req->op == BFS_PUT) return req->stream == NULL && !req->resume;
+    return req->op == BFS_CALL && (req->data != NULL || req->fd >= 0);
+}
+
+/*--------------------------------------------------------------
+ * ENVIO
+ *------------------------------------------------------------*/
+
+/**
+ * Escolhe a compressão dos quadros DATA de um upload
+ *
+ * @param sample Início do conteúdo
+ * @param scratch Área livre com pelo menos COMPRESS_SAMPLE bytes
+ */
+static inline int bfs_upload_codec(int codec, const uint8_t *sample, size_t len, uint8_t *scratch) {
+    if (codec == CODEC_NONE || len == 0 || compress_looks_compressed(sample, len, scratch)) return CODEC_NONE;
+    return codec;
+}
+
+/**
+ * Envia o intervalo [start, end) do conteúdo de um pedido em quadros DATA
+ * (ao menos um, mesmo vazio), seguidos do resumo dos bytes
+ *
+ * @param fd Arquivo lido (-1: conteúdo em memória, req->data)
+ * @return 0 se enviado, -1 se a conexão falhou
+ */
+static inline int bfs_send_body(bfs_conn_t *conn, SOCKET s, int codec, bfs_request_t *req, int fd,
+                                uint64_t start, uint64_t end) {
+    checksum_t sum;
+    uint64_t done = start;
+    int failed = 0;
+
+    checksum_init(&sum);
+    while (!failed) {
+        size_t want = end - done < FRAME_DATA_CHUNK ? (size_t)(end - done) : FRAME_DATA_CHUNK;
+        const uint8_t *data = fd < 0 ? req->data + done : conn->chunk;
+        int64_t got = (int64_t)want;
+        if (fd >= 0 && want > 0) got = file_pread(fd, conn->chunk, want, done);
+        if (got < 0) got = 0;  // Arquivo encolheu: o servidor recusa o tamanho
+        done += (uint64_t)got;
+        checksum_update(&sum, data, (size_t)got);
+        failed = proto_send_data(s, 0, req->id, data, (size_t)got, codec, conn->out) != 0;
+        if (!failed && got > 0 && req->on_data != NULL) req->on_data(req->ctx, data, (size_t)got);
+        if ((size_t)got < want || done >= end) break;
+    }
+    if (!failed) {
+        uint8_t digest[CHECKSUM_SIZE];
+        checksum_final(&sum, digest);
+        failed = proto_send_frame(s, OP_DATA, FLAG_END | FLAG_DIGEST, req->id, digest, sizeof(digest)) != 0;
+    }
+    return failed ? -1 : 0;
+}
+
+/**
+ * Escolhe a compressão pelo início do trecho enviado
+ *
+ * @param fd Arquivo lido (-1: conteúdo em memória, req->data)
+ */
+static inline int bfs_body_codec(bfs_conn_t *conn, int codec, bfs_request_t *req, int fd, uint64_t start,
+                                 uint64_t end) {
+    size_t sample = end - start < COMPRESS_SAMPLE ? (size_t)(end - start) : COMPRESS_SAMPLE;
+    const uint8_t *head = fd < 0 ? req->data + start : conn->chunk;
+    if (fd >= 0) {
+        int64_t got = sample > 0 ? file_pread(fd, conn->chunk, sample, start) : 0;
+        sample = got > 0 ? (size_t)got : 0;
+    }
+    return bfs_upload_codec(codec, head, sample, conn->out);
+}
+
+/**
+ * Envia um UPLOAD de arquivo ou de memória: pedido, quadros DATA e o resumo
+ *
+ * @param reason Recebe o motivo quando o arquivo local não pode ser lido
+ * @return 0 se enviado, 1 se nada foi enviado (erro local), -1 se a
+ *         conexão falhou
+ *
+ * Por que foi feito:
+ * - Com upload_id o pedido é um bloco [offset, offset + length) de um
+ *   upload paralelo ou, com resume, o restante de um upload retomável a
+ *   partir de offset; sem ele, o arquivo inteiro
+ */
+static inline int bfs_send_put(bfs_conn_t *conn, SOCKET s, int codec, bfs_request_t *req, const char **reason) {
+    uint8_t request[32 + PROTO_MAX_NAME];
+    size_t name_len = strlen(req->name);
+    int fd = req->fd;
+
+    if (fd >= 0) {
+        // Aberto por quem pediu: o conteúdo é o do momento da abertura
+        int64_t size = file_size_fd(fd);
+        if (size < 0) {
+            *reason = "Erro ao ler o arquivo.";
+            return 1;
+        }
+        req->total = (uint64_t)size;
+    } else if (req->path != NULL) {
+        int64_t size = file_size(req->path);
+        fd = size >= 0 ? file_open_read(req->path) : -1;
+        if (fd < 0) {
+            *reason = "Arquivo não encontrado.";
+            return 1;
+        }
+        req->total = (uint64_t)size;
+    }
+
+    // Tamanho do arquivo; retomável e bloco levam também id e posição
+    int chunk = req->upload_id != 0 && !req->resume;
+    uint64_t start = req->upload_id != 0 ? req->offset : 0;
+    uint64_t end = chunk ? req->offset + req->length : req->total;
+    size_t fixed = chunk ? 32 : req->resume ? 24 : 8;
+    if (start > end || end > req->total) {
+        if (fd != req->fd) file_close(fd);
+        *reason = "Intervalo fora do arquivo.";
+        return 1;
+    }
+    codec = bfs_body_codec(conn, codec, req, fd, start, end);
+    put_u64(request, req->total);
+    put_u64(request + 8, req->upload_id);
+    put_u64(request + 16, req->offset);
+    put_u64(request + 24, req->length);
+    memcpy(request + fixed, req->name, name_len);
+    uint16_t flags = chunk ? FLAG_CHUNK : req->resume ? FLAG_RESUME : 0;
+    int failed = proto_send_frame(s, OP_UPLOAD, flags, req->id, request, fixed + name_len) != 0;
+
+    if (!failed) failed = bfs_send_body(conn, s, codec, req, fd, start, end) != 0;
+    if (fd >= 0 && fd != req->fd) file_close(fd);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Envia um UPLOAD cujos bytes ainda estão chegando
+ *
+ * @return 0 se enviado, 1 se nada foi enviado (envio abandonado antes do
+ *         primeiro bloco), -1 se a conexão falhou
+ *
+ * Por que foi feito:
+ * - O pedido só parte com o primeiro bloco, e cada bloco sai assim que
+ *   fica completo; o envio abandonado ou mais curto que o declarado
+ *   termina com o resumo invertido, e o servidor descarta o arquivo
+ */
+static inline int bfs_send_stream(bfs_conn_t *conn, SOCKET s, int codec, bfs_request_t *req, const char **reason) {
+    uint8_t request[32 + PROTO_MAX_NAME];
+    uint8_t digest[CHECKSUM_SIZE];
+    size_t name_len = strlen(req->name);
+    size_t fixed = req->upload_id != 0 ? 32 : 8;
+    uint64_t expected = req->upload_id != 0 ? req->length : req->total;
+    int state;
+    bfs_block_t *block = bfs_stream_take(req->stream, &state);
+
+    if (block == NULL) {
+        *reason = "Envio abandonado.";
+        return 1;
+    }
+    codec = bfs_upload_codec(codec, block->data, block->len < COMPRESS_SAMPLE ? block->len : COMPRESS_SAMPLE,
+                             conn->out);
+    // Tamanho do arquivo; um bloco leva também id, posição e tamanho do bloco
+    put_u64(request, req->total);
+    put_u64(request + 8, req->upload_id);
+    put_u64(request + 16, req->offset);
+    put_u64(request + 24, req->length);
+    memcpy(request + fixed, req->name, name_len);
+    int failed = proto_send_frame(s, OP_UPLOAD, req->upload_id != 0 ? FLAG_CHUNK : 0, req->id, request,
+                                  fixed + name_len) != 0;
+
+    checksum_t sum;
+    uint64_t done = 0;
+    checksum_init(&sum);
+    while (block != NULL) {
+        if (!failed) {
+            checksum_update(&sum, block->data, block->len);
+            done += block->len;
+            failed = proto_send_data(s, 0, req->id, block->data, block->len, codec, conn->out) != 0;
+        }
+        free(block);
+        block = failed ? NULL : bfs_stream_take(req->stream, &state);
+    }
+    if (!failed) {
+        checksum_final(&sum, digest);
+        if (state != BFS_STREAM_END || done != expected) digest[0] ^= 0xFF;
+        failed = proto_send_frame(s, OP_DATA, FLAG_END | FLAG_DIGEST, req->id, digest, sizeof(digest)) != 0;
+    }
+    return failed ? -1 : 0;
+}
+
+/**
+ * Envia um pedido genérico e, se ele leva conteúdo, os quadros DATA
+ *
+ * @return 0 se enviado, -1 se a conexão falhou
+ */
+static inline int bfs_send_call(bfs_conn_t *conn, SOCKET s, int codec, bfs_request_t *req) {
+    int fd = req->data != NULL ? -1 : req->fd;
+
+    if (proto_send_frame(s, req->opcode, 0, req->id, req->request, req->request_len) != 0) return -1;
+    if (req->data == NULL && req->fd < 0) return 0;
+    codec = bfs_body_codec(conn, codec, req, fd, 0, req->total);
+    return bfs_send_body(conn, s, codec, req, fd, 0, req->total);
+}
+
+/**
+ * Escreve os quadros de um pedido
+ *
+ * @return 0 se enviado, 1 se nada foi enviado (motivo em reason), -1 se
+ *         a conexão falhou
+ */
+static inline int bfs_send_request(bfs_conn_t *conn, SOCKET s, int codec, bfs_request_t *req, const char **reason) {
+    uint8_t request[16 + 2 * PROTO_MAX_NAME];
+    size_t name_len = strlen(req->name);
+
+    switch (req->op) {
+        case BFS_LIST: {
+            // Tamanho da página, prefixo e cursor
+            size_t cursor_len = strlen(req->cursor);
+            put_u32(request, LIST_PAGE_DEFAULT);
+            put_u16(request + 4, (uint16_t)name_len);
+            memcpy(request + 6, req->name, name_len);
+            memcpy(request + 6 + name_len, req->cursor, cursor_len);
+            return proto_send_frame(s, OP_LIST, 0, req->id, request, 6 + name_len + cursor_len) != 0 ? -1 : 0;
+        }
+        case BFS_GET:
+            // Intervalo pedido, a partir dos bytes já entregues
+            put_u64(request, req->offset + req->received);
+            put_u64(request + 8, req->length > 0 ? req->length - req->received : 0);
+            memcpy(request + 16, req->name, name_len);
+            return proto_send_frame(s, OP_DOWNLOAD, FLAG_RANGE | FLAG_CODEC(codec), req->id, request,
+                                    16 + name_len) != 0 ? -1 : 0;
+        case BFS_PUT:
+            if (req->stream != NULL) return bfs_send_stream(conn, s, codec, req, reason);
+            return bfs_send_put(conn, s, codec, req, reason);
+        case BFS_COMMIT:
+        case BFS_STATUS:
+            put_u64(request, req->upload_id);
+            return proto_send_frame(s, req->op == BFS_COMMIT ? OP_UPLOAD_COMMIT : OP_UPLOAD_STATUS, 0, req->id,
+                                    request, 8) != 0 ? -1 : 0;
+        case BFS_CALL:
+            return bfs_send_call(conn, s, codec, req);
+        default:
+            return proto_send_frame(s, req->op == BFS_STAT ? OP_STAT : OP_DELETE, 0, req->id, req->name,
+                                    name_len) != 0 ? -1 : 0;
+    }
+}
+
+/**
+ * Thread de envio de uma conexão
+ *
+ * Por que foi feito:
+ * - Com arquivos pequenos o tempo é quase todo de ida e volta; a conexão
+ *   mantém até "window" pedidos sem resposta, e os próximos partem
+ *   enquanto a outra thread lê as respostas
+ * - Só escreve em conexão pronta; se a escrita falha, fecha o socket para
+ *   que a thread de recepção perceba a queda e reconecte
+ */
+static inline void *bfs_sender(void *arg) {
+    bfs_conn_t *conn = (bfs_conn_t *)arg;
+    bfs_client_t *c = conn->client;
+
+    mutex_lock(&c->lock);
+    while (1) {
+        while (!c->closing && !(conn->ready && conn->inflight_count < c->window && c->head != NULL)) {
+            cond_wait(&c->work, &c->lock);
+        }
+        if (c->closing) break;
+
+        // Próximo da fila vai para a lista dos enviados antes de ser escrito
+        bfs_request_t *req = c->head;
+        c->head = req->next;
+        if (c->head == NULL) c->tail = NULL;
+        req->next = NULL;
+        req->id = (uint32_t)atomic_add_long(&c->last_id, 1) + 1;
+        if (conn->inflight_tail != NULL) conn->inflight_tail->next = req;
+        else conn->inflight = req;
+        conn->inflight_tail = req;
+        conn->inflight_count++;
+        conn->sending = req;
+        SOCKET s = conn->sock;
+        int codec = conn->codec;
+        mutex_unlock(&c->lock);
+
+        const char *reason = NULL;
+        int sent = bfs_send_request(conn, s, codec, req, &reason);
+
+        mutex_lock(&c->lock);
+        conn->sending = NULL;
+        cond_broadcast(&c->sent);
+        if (sent < 0 && conn->ready && conn->sock == s) {
+            conn->ready = 0;
+            shutdown(s, SD_BOTH);
+        }
+        if (sent > 0) {
+            mutex_unlock(&c->lock);
+            bfs_detach(c, conn, req);
+            bfs_finish(c, req, BFS_REFUSED, 0, reason, NULL);
+            mutex_lock(&c->lock);
+        }
+    }
+    mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/*--------------------------------------------------------------
+ * RECEPÇÃO
+ *------------------------------------------------------------*/
+
+/**
+ * Abre uma conexão e combina a compressão dos quadros DATA
+ *
+ * @param codec Recebe o codec negociado (CODEC_NONE se nenhum em comum)
+ * @return Socket conectado, ou INVALID_SOCKET em caso de erro
+ */
+static inline SOCKET bfs_connect(bfs_client_t *c, int *codec) {
+    frame_header_t h;
+    char payload[16];
+    uint8_t mask = codec_supported_mask(), common = 0;
+    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+
+    *codec = CODEC_NONE;
+    if (s == INVALID_SOCKET) return INVALID_SOCKET;
+    if (connect(s, (struct sockaddr *)&c->addr, sizeof(c->addr)) < 0) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    net_set_nodelay(s);
+    if (c->codec == CODEC_NONE) return s;
+
+    // Servidores sem compressão respondem UNSUPPORTED: segue sem compressão
+    uint32_t id = (uint32_t)atomic_add_long(&c->last_id, 1) + 1;
+    if (proto_send_frame(s, OP_CODECS, 0, id, &mask, 1) != 0 ||
+        proto_recv_frame(s, &h, payload, sizeof(payload)) != 0 || h.request_id != id) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    if (h.opcode == OP_OK && h.length == 1) common = (uint8_t)payload[0];
+    if (c->codec < 0) *codec = codec_choose(common);
+    else if (common & (1 << c->codec)) *codec = c->codec;
+    return s;
+}
+
+/**
+ * Recebe um quadro DATA de um download (ou da resposta de um pedido
+ * genérico) e entrega os bytes
+ *
+ * @return 0 em caso de sucesso, -1 se a conexão falhou
+ *
+ * Por que foi feito:
+ * - O resumo acumula os bytes de todas as tentativas, então um download
+ *   retomado ainda é conferido com CRC32C e XXH64 do arquivo inteiro; um
+ *   download que começa depois do início só confere o CRC32C, combinado
+ *   com o dos bytes que quem pediu já tinha
+ * - Depois de uma recusa local (erro de escrita, arquivo mudou) os dados
+ *   restantes ainda são lidos, para manter a conexão alinhada nos quadros
+ */
+static inline int bfs_receive_get(bfs_client_t *c, bfs_conn_t *conn, bfs_request_t *req, const frame_header_t *h) {
+    uint64_t left = h->length;
+
+    if (!req->known) return -1;
+    while (left > 0) {
+        size_t got;
+        if (h->flags & FLAG_COMPRESSED) {
+            if (proto_recv_packed(conn->sock, h, conn->packed, conn->buffer, &got) != 0) return -1;
+            left = 0;
+        } else {
+            got = left < FRAME_DATA_CHUNK ? (size_t)left : FRAME_DATA_CHUNK;
+            if (net_recv_all(conn->sock, conn->buffer, got) != 0) return -1;
+            left -= got;
+        }
+        if (req->reason != NULL) continue;
+        checksum_update(&req->sum, conn->buffer, got);
+        req->received += got;
+        if (req->on_data != NULL && req->on_data(req->ctx, conn->buffer, got) != 0) {
+            req->reason = req->op == BFS_GET ? "Erro ao gravar os dados recebidos." : "Resposta recusada.";
+        }
+    }
+    if (!(h->flags & FLAG_END)) return 0;
+
+    bfs_detach(c, conn, req);
+    if (req->op == BFS_CALL) {
+        bfs_finish(c, req, req->reason != NULL ? BFS_REFUSED : BFS_OK, 0, req->reason, NULL);
+        return 0;
+    }
+    uint64_t expected = req->length > 0 ? req->length : req->total - req->offset;
+    if (req->reason == NULL && (req->offset > req->total || req->received != expected)) {
+        req->code = ERR_RANGE;
+        req->reason = "O tamanho recebido não confere com o do servidor.";
+    }
+    uint32_t crc = req->offset > 0 ? crc32c_combine(req->prefix_crc, req->sum.crc, req->received) : req->sum.crc;
+    if (req->reason == NULL && req->length == 0 && req->digest_len >= CHECKSUM_CRC_SIZE &&
+        (crc != checksum_crc(req->digest) || (req->offset == 0 && req->digest_len >= CHECKSUM_SIZE &&
+                                              xxh64_final(&req->sum.xxh) != checksum_xxh(req->digest)))) {
+        req->code = ERR_CHECKSUM;
+        req->reason = "Resumo do arquivo não confere.";
+    }
+    if (req->reason == NULL && req->expect_len > 0 && req->sum.crc != checksum_crc(req->expect)) {
+        req->code = ERR_CHECKSUM;
+        req->reason = "A cópia deste servidor está desatualizada.";
+    }
+    bfs_finish(c, req, req->reason != NULL ? BFS_REFUSED : BFS_OK, req->code, req->reason, NULL);
+    return 0;
+}
+
+/**
+ * Recebe um quadro DATA de uma página de LIST
+ *
+ * @return 0 em caso de sucesso, -1 se a conexão falhou
+ *
+ * Por que foi feito:
+ * - Cada entrada é entregue assim que chega; a próxima página volta para
+ *   o início da fila a partir do nome da última entrada recebida
+ */
+static inline int bfs_receive_list(bfs_client_t *c, bfs_conn_t *conn, bfs_request_t *req, const frame_header_t *h) {
+    list_entry_t entry;
+    size_t pos = 0, used;
+
+    if (h->length > FRAME_MAX_CONTROL || net_recv_all(conn->sock, conn->control, (size_t)h->length) != 0) return -1;
+    while (pos < h->length &&
+           (used = list_entry_decode((uint8_t *)conn->control + pos, (size_t)h->length - pos, &entry)) > 0) {
+        if (req->on_entry != NULL) req->on_entry(req->ctx, &entry);
+        memcpy(req->cursor, entry.name, strlen(entry.name) + 1);
+        req->received++;
+        pos += used;
+    }
+    if (!(h->flags & FLAG_END)) return 0;
+
+    bfs_detach(c, conn, req);
+    if (h->flags & FLAG_MORE) {
+        mutex_lock(&c->lock);
+        bfs_enqueue(c, req, 1);
+        mutex_unlock(&c->lock);
+        return 0;
+    }
+    bfs_finish(c, req, BFS_OK, 0, NULL, NULL);
+    return 0;
+}
+
+/**
+ * Lê um quadro da conexão e o entrega ao pedido de mesmo id
+ *
+ * @return 0 em caso de sucesso, -1 se a conexão falhou ou a resposta
+ *         está fora do protocolo
+ */
+static inline int bfs_receive(bfs_client_t *c, bfs_conn_t *conn) {
+    frame_header_t h;
+    char *payload = conn->control;
+
+    if (proto_recv_header(conn->sock, &h) != 0) return -1;
+    mutex_lock(&c->lock);
+    bfs_request_t *req = conn->inflight;
+    while (req != NULL && req->id != h.request_id) req = req->next;
+    mutex_unlock(&c->lock);
+    if (req == NULL) return -1;
+
+    if (h.opcode == OP_DATA && (req->op == BFS_GET || req->op == BFS_CALL)) return bfs_receive_get(c, conn, req, &h);
+    if (h.opcode == OP_DATA && req->op == BFS_LIST) return bfs_receive_list(c, conn, req, &h);
+    if ((h.opcode != OP_OK && h.opcode != OP_ERROR) || h.length > FRAME_MAX_CONTROL ||
+        net_recv_all(conn->sock, payload, (size_t)h.length) != 0) return -1;
+    payload[h.length] = '\0';
+
+    if (h.opcode == OP_ERROR) {
+        // Código de erro (2 bytes) seguido da mensagem
+        uint16_t code = h.length >= 2 ? get_u16((uint8_t *)payload) : 0;
+        bfs_detach(c, conn, req);
+        if (bfs_resendable(req) && (code == ERR_BUSY || code == ERR_CHECKSUM) && req->attempts < BFS_REQUEST_RETRIES) {
+            mutex_lock(&c->lock);
+            req->attempts++;
+            bfs_enqueue(c, req, 0);
+            mutex_unlock(&c->lock);
+            return 0;
+        }
+        bfs_finish(c, req, BFS_REFUSED, code, h.length >= 2 ? payload + 2 : "", NULL);
+        return 0;
+    }
+
+    switch (req->op) {
+        case BFS_GET: {
+            // Tamanho do intervalo e do arquivo, seguidos do resumo (se houver)
+            if (req->known || h.length < 16 || h.length > 16 + CHECKSUM_SIZE) return -1;
+            uint64_t total = get_u64((uint8_t *)payload + 8);
+            if (req->received > 0 && total != req->total) {
+                req->code = ERR_RANGE;
+                req->reason = "O arquivo mudou no servidor durante o download.";
+            }
+            req->total = total;
+            req->known = 1;
+            req->digest_len = (size_t)h.length - 16;
+            memcpy(req->digest, payload + 16, req->digest_len);
+            return 0;
+        }
+        case BFS_STAT: {
+            list_entry_t entry;
+            if (list_entry_decode((uint8_t *)payload, (size_t)h.length, &entry) == 0) return -1;
+            bfs_detach(c, conn, req);
+            req->total = entry.size;
+            bfs_finish(c, req, BFS_OK, 0, NULL, &entry);
+            return 0;
+        }
+        case BFS_STATUS:
+            // Bytes já gravados, tamanho e nome: só valem para o mesmo arquivo
+            bfs_detach(c, conn, req);
+            if (h.length >= 16 && get_u64((uint8_t *)payload + 8) == req->total && strcmp(payload + 16, req->name) == 0) {
+                uint64_t held = get_u64((uint8_t *)payload);
+                req->received = held <= req->total ? held : 0;
+            }
+            bfs_finish(c, req, BFS_OK, 0, NULL, NULL);
+            return 0;
+        case BFS_CALL:
+            if (req->known) return -1;
+            if (req->on_reply != NULL && req->on_reply(req->ctx, (uint8_t *)payload, (size_t)h.length) > 0) {
+                req->known = 1;
+                return 0;
+            }
+            bfs_detach(c, conn, req);
+            bfs_finish(c, req, BFS_OK, 0, payload, NULL);
+            return 0;
+        case BFS_LIST:
+            return -1;
+        default:
+            bfs_detach(c, conn, req);
+            bfs_finish(c, req, BFS_OK, 0, payload, NULL);
+            return 0;
+    }
+}
+
+/**
+ * Trata a queda de uma conexão
+ *
+ * Por que foi feito:
+ * - Os pedidos sem resposta voltam para o início da fila, na ordem em que
+ *   foram enviados, e seguem por esta ou por outra conexão; os que já
+ *   voltaram BFS_REQUEST_RETRIES vezes falham, assim como os envios
+ *   contínuos, cujos bytes já foram consumidos, os uploads retomáveis
+ *   (quem pediu consulta o servidor e continua de onde ele parou) e os
+ *   pedidos genéricos cuja resposta já começou a ser entregue
+ */
+static inline void bfs_conn_lost(bfs_client_t *c, bfs_conn_t *conn) {
+    bfs_request_t *failed = NULL, *retry = NULL, *retry_tail = NULL;
+
+    mutex_lock(&c->lock);
+    conn->ready = 0;
+    shutdown(conn->sock, SD_BOTH);
+    while (conn->sending != NULL) cond_wait(&c->sent, &c->lock);
+
+    for (bfs_request_t *req = conn->inflight, *next; req != NULL; req = next) {
+        next = req->next;
+        int started = req->op == BFS_CALL && req->known;
+        req->known = 0;
+        if (req->stream != NULL || req->resume || started || ++req->attempts > BFS_REQUEST_RETRIES) {
+            req->next = failed;
+            failed = req;
+            continue;
+        }
+        req->next = NULL;
+        if (retry_tail != NULL) retry_tail->next = req;
+        else retry = req;
+        retry_tail = req;
+    }
+    if (retry != NULL) {
+        retry_tail->next = c->head;
+        c->head = retry;
+        if (c->tail == NULL) c->tail = retry_tail;
+    }
+    conn->inflight = conn->inflight_tail = NULL;
+    conn->inflight_count = 0;
+    closesocket(conn->sock);
+    conn->sock = INVALID_SOCKET;
+    cond_broadcast(&c->work);
+    mutex_unlock(&c->lock);
+
+    bfs_finish_all(c, failed, "Conexão com o servidor perdida.");
+}
+
+/**
+ * Thread de recepção de uma conexão: conecta, lê as respostas e reconecta
+ *
+ * Por que foi feito:
+ * - A conexão só abre quando há pedidos na fila, e fica aberta entre eles
+ * - A espera entre tentativas dobra para não martelar um servidor que
+ *   está reiniciando; depois de BFS_CONNECT_RETRIES falhas seguidas, se
+ *   nenhuma outra conexão está de pé, os pedidos da fila falham em vez
+ *   de esperar para sempre
+ */
+static inline void *bfs_receiver(void *arg) {
+    bfs_conn_t *conn = (bfs_conn_t *)arg;
+    bfs_client_t *c = conn->client;
+    int failures = 0;
+
+    mutex_lock(&c->lock);
+    while (!c->closing) {
+        if (c->head == NULL) {
+            cond_wait(&c->work, &c->lock);
+            continue;
+        }
+        mutex_unlock(&c->lock);
+        int codec;
+        SOCKET s = bfs_connect(c, &codec);
+        mutex_lock(&c->lock);
+
+        if (s == INVALID_SOCKET) {
+            bfs_request_t *failed = NULL;
+            int alive = 0;
+            for (int i = 0; i < c->count; i++) alive |= c->conns[i].ready;
+            if (++failures >= BFS_CONNECT_RETRIES && !alive) {
+                failed = c->head;
+                c->head = c->tail = NULL;
+                failures = 0;
+            }
+            mutex_unlock(&c->lock);
+            bfs_finish_all(c, failed, "Não foi possível conectar ao servidor.");
+            if (failed == NULL) sleep_ms(BFS_RETRY_DELAY_MS << (failures < 5 ? failures - 1 : 4));
+            mutex_lock(&c->lock);
+            continue;
+        }
+        failures = 0;
+        if (c->closing) {
+            closesocket(s);
+            break;
+        }
+        conn->sock = s;
+        conn->codec = codec;
+        conn->ready = 1;
+        cond_broadcast(&c->work);
+        mutex_unlock(&c->lock);
+
+        while (bfs_receive(c, conn) == 0) {}
+        bfs_conn_lost(c, conn);
+        mutex_lock(&c->lock);
+    }
+    mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/*--------------------------------------------------------------
+ * CLIENTE
+ *------------------------------------------------------------*/
+
+/**
+ * Libera as conexões e o cliente (threads já encerradas)
+ */
+static inline void bfs_free(bfs_client_t *c) {
+    for (int i = 0; i < c->count; i++) {
+        bfs_conn_t *conn = &c->conns[i];
+        bufpool_free(conn->chunk, FRAME_DATA_CHUNK, NULL);
+        bufpool_free(conn->out, FRAME_DATA_CHUNK, NULL);
+        bufpool_free(conn->buffer, FRAME_DATA_CHUNK, NULL);
+        bufpool_free(conn->packed, FRAME_DATA_CHUNK, NULL);
+        free(conn->control);
+    }
+    mutex_destroy(&c->lock);
+    cond_destroy(&c->work);
+    cond_destroy(&c->idle);
+    cond_destroy(&c->sent);
+    free(c->conns);
+    free(c);
+}
+
+/**
+ * Cria um cliente para um servidor
+ *
+ * @param connections Conexões persistentes (abertas quando há trabalho)
+ * @param window Pedidos sem resposta por conexão
+ * @param codec Compressão pedida (-1: melhor codec em comum)
+ * @return Cliente, ou NULL em caso de erro
+ */
+static inline bfs_client_t *bfs_open(const char *address, int port, int connections, int window, int codec) {
+    if (connections <= 0 || connections > BFS_MAX_CONNECTIONS || window <= 0 || window > BFS_MAX_WINDOW) return NULL;
+    bfs_client_t *c = (bfs_client_t *)calloc(1, sizeof(bfs_client_t));
+    bfs_conn_t *conns = (bfs_conn_t *)calloc((size_t)connections, sizeof(bfs_conn_t));
+    if (c == NULL || conns == NULL) {
+        free(c);
+        free(conns);
+        return NULL;
+    }
+    mutex_init(&c->lock);
+    cond_init(&c->work);
+    cond_init(&c->idle);
+    cond_init(&c->sent);
+    c->addr.sin_family = AF_INET;
+    c->addr.sin_addr.s_addr = inet_addr(address);
+    c->addr.sin_port = htons((uint16_t)port);
+    c->codec = codec;
+    c->window = window;
+    c->conns = conns;
+    c->count = connections;
+
+    // Buffers de todas as conexões antes de qualquer thread
+    int failed = 0;
+    for (int i = 0; i < connections; i++) {
+        bfs_conn_t *conn = &conns[i];
+        conn->client = c;
+        conn->sock = INVALID_SOCKET;
+        conn->chunk = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, NULL);
+        conn->out = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, NULL);
+        conn->buffer = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, NULL);
+        conn->packed = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, NULL);
+        conn->control = (char *)malloc(FRAME_MAX_CONTROL + 1);
+        failed |= conn->chunk == NULL || conn->out == NULL || conn->buffer == NULL || conn->packed == NULL ||
+                  conn->control == NULL;
+    }
+
+    // Threads de envio e recepção; se alguma falha, as criadas são encerradas
+    thread_t *created[2 * BFS_MAX_CONNECTIONS];
+    int started = 0;
+    for (int i = 0; i < connections && !failed; i++) {
+        if (thread_create(&conns[i].sender, bfs_sender, &conns[i]) != 0) break;
+        created[started++] = &conns[i].sender;
+        if (thread_create(&conns[i].receiver, bfs_receiver, &conns[i]) != 0) break;
+        created[started++] = &conns[i].receiver;
+    }
+    if (started < 2 * connections) {
+        mutex_lock(&c->lock);
+        c->closing = 1;
+        cond_broadcast(&c->work);
+        mutex_unlock(&c->lock);
+        for (int i = 0; i < started; i++) thread_join(*created[i]);
+        bfs_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+/**
+ * Aguarda a conclusão de todos os pedidos feitos até agora
+ *
+ * Não deve ser chamada de uma função de retorno.
+ */
+static inline void bfs_wait(bfs_client_t *c) {
+    mutex_lock(&c->lock);
+    while (c->pending > 0) cond_wait(&c->idle, &c->lock);
+    mutex_unlock(&c->lock);
+}
+
+/**
+ * Aguarda os pedidos, encerra as conexões e libera o cliente
+ */
+static inline void bfs_close(bfs_client_t *c) {
+    if (c == NULL) return;
+    bfs_wait(c);
+
+    // BYE nas conexões abertas; a thread de recepção vê a queda e sai
+    mutex_lock(&c->lock);
+    c->closing = 1;
+    for (int i = 0; i < c->count; i++) {
+        bfs_conn_t *conn = &c->conns[i];
+        if (conn->sock == INVALID_SOCKET) continue;
+        if (conn->ready) proto_send_frame(conn->sock, OP_BYE, 0, (uint32_t)atomic_add_long(&c->last_id, 1) + 1, NULL, 0);
+        shutdown(conn->sock, SD_BOTH);
+    }
+    cond_broadcast(&c->work);
+    mutex_unlock(&c->lock);
+
+    for (int i = 0; i < c->count; i++) {
+        thread_join(c->conns[i].sender);
+        thread_join(c->conns[i].receiver);
+    }
+    bfs_free(c);
+}
+
+/*--------------------------------------------------------------
+ * OPERAÇÕES
+ *
+ * A função de retorno é chamada exatamente uma vez. Todas retornam 0 se
+ * o pedido entrou na fila, ou -1 se não foi possível criá-lo (nesse caso
+ * a função de retorno já foi chamada, com BFS_REFUSED).
+ *------------------------------------------------------------*/
+
+/**
+ * Lista os arquivos do servidor cujo nome começa com prefix
+ *
+ * @param visit Chamada para cada entrada, assim que ela chega
+ */
+static inline int bfs_list(bfs_client_t *c, const char *prefix, bfs_entry_fn visit, bfs_done_fn done, void *ctx) {
+    bfs_request_t *req = bfs_request_new(BFS_LIST, prefix, NULL, done, ctx);
+    if (req != NULL) req->on_entry = visit;
+    return bfs_submit(c, req, done, ctx);
+}
+
+/**
+ * Consulta os metadados de um arquivo (result->entry)
+ */
+static inline int bfs_stat(bfs_client_t *c, const char *name, bfs_done_fn done, void *ctx) {
+    return bfs_submit(c, bfs_request_new(BFS_STAT, name, NULL, done, ctx), done, ctx);
+}
+
+/**
+ * Exclui um arquivo do servidor
+ */
+static inline int bfs_delete(bfs_client_t *c, const char *name, bfs_done_fn done, void *ctx) {
+    return bfs_submit(c, bfs_request_new(BFS_DELETE, name, NULL, done, ctx), done, ctx);
+}
+
+/**
+ * Baixa um arquivo entregando os bytes a uma função, em ordem
+ *
+ * @param on_data Recebe cada trecho; retorna diferente de 0 para recusar
+ *                o download (os dados restantes são descartados)
+ */
+static inline int bfs_get(bfs_client_t *c, const char *name, bfs_data_fn on_data, bfs_done_fn done, void *ctx) {
+    bfs_request_t *req = bfs_request_new(BFS_GET, name, NULL, done, ctx);
+    if (req != NULL) req->on_data = on_data;
+    return bfs_submit(c, req, done, ctx);
+}
+
+/**
+ * Envia um arquivo local (lido quando o pedido parte)
+ */
+static inline int bfs_put(bfs_client_t *c, const char *path, const char *name, bfs_done_fn done, void *ctx) {
+    return bfs_submit(c, bfs_request_new(BFS_PUT, name, path, done, ctx), done, ctx);
+}
+
+/**
+ * Envia um arquivo já aberto
+ *
+ * @param fd Descritor que passa a ser do pedido: é fechado na conclusão,
+ *           mesmo se o pedido não puder ser criado
+ *
+ * Por que foi feito:
+ * - Um nome pode ser trocado ou excluído antes de o pedido partir; o
+ *   descritor aberto guarda a versão que existia quando o pedido foi
+ *   feito, inclusive para as novas tentativas
+ */
+static inline int bfs_put_fd(bfs_client_t *c, int fd, const char *name, bfs_done_fn done, void *ctx) {
+    bfs_request_t *req = bfs_request_new(BFS_PUT, name, NULL, done, ctx);
+    if (req != NULL) req->fd = fd;
+    else file_close(fd);
+    return bfs_submit(c, req, done, ctx);
+}
+
+/**
+ * Envia bytes que ainda estão chegando (ver bfs_stream_t)
+ *
+ * @param size Tamanho declarado do arquivo
+ * @param upload_id Id de um upload em blocos (0: o envio é o arquivo
+ *                  inteiro e o servidor o grava ao fim)
+ * @param offset Posição do bloco no arquivo (só com upload_id)
+ * @param length Tamanho do bloco (só com upload_id)
+ * @return 0 em caso de sucesso, -1 se o pedido não foi criado (o envio
+ *         continua só de quem o criou)
+ *
+ * Por que foi feito:
+ * - Com menos bytes que o declarado, o servidor recusa o envio; um bloco
+ *   fica no arquivo parcial até bfs_commit_upload()
+ */
+static inline int bfs_put_stream(bfs_client_t *c, bfs_stream_t *st, uint64_t size, uint64_t upload_id,
+                                 uint64_t offset, uint64_t length, const char *name, bfs_done_fn done, void *ctx) {
+    bfs_request_t *req = bfs_request_new(BFS_PUT, name, NULL, done, ctx);
+    if (req != NULL) {
+        mutex_lock(&st->lock);
+        st->refs++;
+        mutex_unlock(&st->lock);
+        req->stream = st;
+        req->total = size;
+        req->upload_id = upload_id;
+        req->offset = offset;
+        req->length = length;
+    }
+    return bfs_submit(c, req, done, ctx);
+}
+
+/**
+ * Dá o nome final a um upload enviado em blocos
+ *
+ * Por que foi feito:
+ * - O servidor confere que os blocos cobrem o arquivo inteiro; se falta
+ *   algum, recusa com ERR_RANGE e quem pediu envia o arquivo de outro modo
+ */
+static inline int bfs_commit_upload(bfs_client_t *c, uint64_t upload_id, bfs_done_fn done, void *ctx) {
+    bfs_request_t *req = bfs_request_new(BFS_COMMIT, "", NULL, done, ctx);
+    if (req != NULL) req->upload_id = upload_id;
+    return bfs_submit(c, req, done, ctx);
+}
+
+/**
+ * Consulta quantos bytes de um upload retomável o servidor já tem
+ * (result->size; 0 se o upload não existe ou é de outro arquivo)
+ *
+ * @param size Tamanho do arquivo local
+ */
+static inline int bfs_upload_status(bfs_client_t *c, uint64_t upload_id, uint64_t size, const char *name,
+                                    bfs_done_fn done, void *ctx) {
+    bfs_request_t *req = bfs_request_new(BFS_STATUS, name, NULL, done, ctx);
+    if (req != NULL) {
+        req->upload_id = upload_id;
+        req->total = size;
+    }
+    return bfs_submit(c, req, done, ctx);
+}
+
+/**
+ * Continua um upload retomável a partir de uma posição
+ *
+ * @param offset Bytes que o servidor já tem (bfs_upload_status())
+ * @param progress Recebe cada trecho enviado (pode ser NULL)
+ *
+ * Por que foi feito:
+ * - Depois de uma queda o pedido não volta à fila: o servidor pode ter
+ *   gravado parte dos bytes, e quem pediu consulta de onde continuar
+ */
+static inline int bfs_put_resume(bfs_client_t *c, const char *path, const char *name, uint64_t upload_id,
+                                 uint64_t offset, bfs_data_fn progress, bfs_done_fn done, void *ctx) {
+    bfs_request_t *req = bfs_request_new(BFS_PUT, name, path, done, ctx);
+    if (req != NULL) {
+        req->upload_id = upload_id;
+        req->offset = offset;
+        req->resume = 1;
+        req->on_data = progress;
+    }
+    return bfs_submit(c, req, done, ctx);
+}
+
+/**
+ * Envia um bloco [offset, offset + length) de um arquivo local como parte
+ * de um upload paralelo (nome final com bfs_commit_upload())
+ *
+ * @param progress Recebe cada trecho enviado (pode ser NULL; um bloco
+ *                 enviado de novo é contado outra vez)
+ */
+static inline int bfs_put_chunk(bfs_client_t *c, const char *path, const char *name, uint64_t upload_id,
+                                uint64_t offset, uint64_t length, bfs_data_fn progress, bfs_done_fn done,
+                                void *ctx) {
+    bfs_request_t *req = bfs_request_new(BFS_PUT, name, path, done, ctx);
+    if (req != NULL) {
+        req->upload_id = upload_id;
+        req->offset = offset;
+        req->length = length;
+        req->on_data = progress;
+    }
+    return bfs_submit(c, req, done, ctx);
+}
+
+/**
+ * Baixa o intervalo [offset, offset + length) de um arquivo
+ *
+ * @param length Tamanho do intervalo (0: até o fim do arquivo)
+ * @param prefix_crc CRC32C dos bytes antes de offset, que quem pede já
+ *                   tem; só conferido quando o intervalo vai até o fim
+ *
+ * Por que foi feito:
+ * - Downloads retomados pedem só o que falta de "<destino>.part", e os
+ *   paralelos um intervalo por bloco; result->crc traz o CRC32C dos bytes
+ *   entregues para o resumo do arquivo inteiro
+ */
+static inline int bfs_get_range(bfs_client_t *c, const char *name, uint64_t offset, uint64_t length,
+                                uint32_t prefix_crc, bfs_data_fn on_data, bfs_done_fn done, void *ctx) {
+    bfs_request_t *req = bfs_request_new(BFS_GET, name, NULL, done, ctx);
+    if (req != NULL) {
+        req->offset = offset;
+        req->length = length;
+        req->prefix_crc = prefix_crc;
+        req->on_data = on_data;
+    }
+    return bfs_submit(c, req, done, ctx);
+}
+
+/**
+ * Cria um pedido genérico com uma cópia do payload
+ */
+static inline bfs_request_t *bfs_call_new(uint8_t opcode, const void *request, size_t request_len,
+                                          bfs_done_fn done, void *ctx) {
+    bfs_request_t *req = bfs_request_new(BFS_CALL, "", NULL, done, ctx);
+    if (req == NULL) return NULL;
+    req->request = (uint8_t *)malloc(request_len > 0 ? request_len : 1);
+    if (req->request == NULL) {
+        free(req);
+        return NULL;
+    }
+    memcpy(req->request, request, request_len);
+    req->request_len = request_len;
+    req->opcode = opcode;
+    return req;
+}
+
+/**
+ * Faz um pedido de qualquer operação do protocolo
+ *
+ * @param on_reply Recebe o payload da resposta OK (pode ser NULL);
+ *                 retorna 1 se quadros DATA seguem a resposta, 0 se ela
+ *                 conclui o pedido
+ * @param on_data Recebe os quadros DATA da resposta até FLAG_END; retorna
+ *                diferente de 0 para recusá-los
+ *
+ * Por que foi feito:
+ * - Operações sem função própria (assinaturas, diferenças, lotes de
+ *   diretórios) seguem pelas mesmas conexões e reconexões; depois que a
+ *   resposta começou a ser entregue, uma queda conclui o pedido com
+ *   BFS_FAILED em vez de entregá-la de novo
+ */
+static inline int bfs_call(bfs_client_t *c, uint8_t opcode, const void *request, size_t request_len,
+                           bfs_reply_fn on_reply, bfs_data_fn on_data, bfs_done_fn done, void *ctx) {
+    bfs_request_t *req = bfs_call_new(opcode, request, request_len, done, ctx);
+    if (req != NULL) {
+        req->on_reply = on_reply;
+        req->on_data = on_data;
+    }
+    return bfs_submit(c, req, done, ctx);
+}
+
+/**
+ * Faz um pedido genérico seguido de conteúdo em quadros DATA e do resumo
+ *
+ * @param data Conteúdo em memória (NULL: lido de fd)
+ * @param fd Arquivo aberto, que continua de quem pediu (lido desde o início)
+ * @param size Bytes do conteúdo
+ * @param progress Recebe cada trecho enviado (pode ser NULL)
+ *
+ * Por que foi feito:
+ * - O conteúdo pode ser lido de novo, então o pedido volta à fila depois
+ *   de uma queda ou de uma recusa BUSY/CHECKSUM; o conteúdo (e o
+ *   arquivo) deve existir até a conclusão
+ */
+static inline int bfs_call_send(bfs_client_t *c, uint8_t opcode, const void *request, size_t request_len,
+                                const void *data, int fd, uint64_t size, bfs_data_fn progress, bfs_done_fn done,
+                                void *ctx) {
+    bfs_request_t *req = bfs_call_new(opcode, request, request_len, done, ctx);
+    if (req != NULL) {
+        req->data = (const uint8_t *)data;
+        req->fd = data != NULL ? -1 : fd;
+        req->keep_fd = 1;
+        req->total = size;
+        req->on_data = progress;
+    }
+    return bfs_submit(c, req, done, ctx);
+}
+
+/**
+ * Envia um conteúdo em memória, que deve existir até a conclusão
+ */
+static inline int bfs_put_buffer(bfs_client_t *c, const void *data, uint64_t size, const char *name,
+                                 bfs_done_fn done, void *ctx) {
+    bfs_request_t *req = bfs_request_new(BFS_PUT, name, NULL, done, ctx);
+    if (req != NULL) {
+        req->data = (const uint8_t *)data;
+        req->total = size;
+    }
+    return bfs_submit(c, req, done, ctx);
+}
+
+/**
+ * Destino de um bfs_get_file()
+ */
+typedef struct {
+    FILE *file;                 // Arquivo parcial (aberto no primeiro trecho)
+    char *path;                 // Destino final
+    char *part;                 // "<destino>.part"
+    bfs_done_fn done;
+    void *ctx;
+} bfs_file_sink_t;
+
+/**
+ * Grava um trecho de um download no arquivo parcial
+ */
+static inline int bfs_file_data(void *ctx, const uint8_t *data, size_t len) {
+    bfs_file_sink_t *sink = (bfs_file_sink_t *)ctx;
+    if (sink->file == NULL && (sink->file = fopen(sink->part, "wb")) == NULL) return -1;
+    return fwrite(data, 1, len, sink->file) == len ? 0 : -1;
+}
+
+/**
+ * Conclui um download para arquivo e repassa o resultado
+ *
+ * Por que foi feito:
+ * - O arquivo final só aparece completo e conferido: o parcial troca de
+ *   nome no fim, ou é removido se o download falhou
+ */
+static inline void bfs_file_done(void *ctx, const bfs_result_t *r) {
+    bfs_file_sink_t *sink = (bfs_file_sink_t *)ctx;
+    bfs_result_t out = *r;
+
+    if (out.status == BFS_OK && sink->file == NULL) sink->file = fopen(sink->part, "wb");  // Arquivo vazio
+    if (sink->file != NULL && fclose(sink->file) != 0 && out.status == BFS_OK) out.status = BFS_REFUSED;
+    if (out.status == BFS_OK && sink->file == NULL) out.status = BFS_REFUSED;
+    if (out.status == BFS_OK && file_replace(sink->part, sink->path) != 0) out.status = BFS_REFUSED;
+    if (out.status != BFS_OK) {
+        if (r->status == BFS_OK) {
+            out.code = 0;
+            snprintf(out.message, sizeof(out.message), "Erro ao criar arquivo.");
+        }
+        remove(sink->part);
+    }
+    if (sink->done != NULL) sink->done(sink->ctx, &out);
+    free(sink);
+}
+
+/**
+ * Baixa um arquivo para um caminho local, de uma cópia que precisa estar em dia
+ *
+ * @param expect Resumo do arquivo no servidor principal (CRC32C no
+ *               início), ou NULL para aceitar qualquer versão
+ *
+ * Por que foi feito:
+ * - Os bytes vão para "<destino>.part", sem ocupar memória, e o resumo do
+ *   servidor é conferido antes da troca de nome
+ * - Uma réplica atrasada entrega a versão antiga, íntegra pelo próprio
+ *   resumo; comparada com o resumo do principal, a cópia é recusada com
+ *   ERR_CHECKSUM e quem pediu a busca no principal
+ */
+static inline int bfs_get_file_expect(bfs_client_t *c, const char *name, const char *path, const uint8_t *expect,
+                                      size_t expect_len, bfs_done_fn done, void *ctx) {
+    size_t path_len = strlen(path) + 1;
+    bfs_file_sink_t *sink = (bfs_file_sink_t *)malloc(sizeof(bfs_file_sink_t) + 2 * path_len + 5);
+    if (sink == NULL) return bfs_submit(c, NULL, done, ctx);
+    sink->file = NULL;
+    sink->path = (char *)(sink + 1);
+    sink->part = sink->path + path_len;
+    memcpy(sink->path, path, path_len);
+    snprintf(sink->part, path_len + 5, "%s.part", path);
+    sink->done = done;
+    sink->ctx = ctx;
+
+    bfs_request_t *req = bfs_request_new(BFS_GET, name, NULL, bfs_file_done, sink);
+    if (req != NULL) {
+        req->on_data = bfs_file_data;
+        if (expect != NULL && expect_len >= CHECKSUM_CRC_SIZE) {
+            memcpy(req->expect, expect, CHECKSUM_CRC_SIZE);
+            req->expect_len = CHECKSUM_CRC_SIZE;
+        }
+    }
+    return bfs_submit(c, req, bfs_file_done, sink);
+}
+
+/**
+ * Baixa um arquivo para um caminho local
+ */
+static inline int bfs_get_file(bfs_client_t *c, const char *name, const char *path, bfs_done_fn done, void *ctx) {
+    return bfs_get_file_expect(c, name, path, NULL, 0, done, ctx);
+}
+
+/*--------------------------------------------------------------
+ * CLUSTER (VÁRIOS SERVIDORES)
+ *------------------------------------------------------------*/
+
+/**
+ * Clientes dos nós de um cluster e o anel que divide os nomes entre eles
+ */
+typedef struct {
+    ring_t ring;
+    bfs_client_t *nodes[RING_MAX_NODES];
+} bfs_cluster_t;
+
+/**
+ * Entrada de listagem guardada até a junção das respostas dos nós
+ */
+typedef struct {
+    uint64_t size;
+    int64_t mtime;
+    uint8_t hash_len;
+    uint8_t hash[LIST_HASH_MAX];
+    char name[];
+} bfs_merge_entry_t;
+
+/**
+ * Listagem em andamento em todos os nós
+ */
+typedef struct {
+    mutex_t lock;
+    bfs_merge_entry_t **entries;
+    size_t count, cap;
+    int waiting;                // Nós que ainda não concluíram
+    int oom;                    // Faltou memória para guardar alguma entrada
+    bfs_result_t failure;       // Primeiro nó que falhou (status BFS_OK: nenhum)
+    bfs_entry_fn visit;
+    bfs_done_fn done;
+    void *ctx;
+} bfs_merge_t;
+
+/**
+ * Separa "ip:porta"
+ *
+ * @param address Recebe o ip (RING_NAME_SIZE bytes)
+ * @return Porta, ou -1 se o texto não está no formato
+ */
+static inline int bfs_node_split(const char *node, char *address) {
+    const char *colon = strrchr(node, ':');
+    if (colon == NULL || colon == node || (size_t)(colon - node) >= RING_NAME_SIZE) return -1;
+    int port = atoi(colon + 1);
+    if (port <= 0 || port > 65535) return -1;
+    snprintf(address, RING_NAME_SIZE, "%.*s", (int)(colon - node), node);
+    return port;
+}
+
+/**
+ * Aguarda os pedidos e encerra os clientes de todos os nós
+ */
+static inline void bfs_cluster_close(bfs_cluster_t *cl) {
+    if (cl == NULL) return;
+    for (int i = 0; i < cl->ring.count; i++) bfs_close(cl->nodes[i]);
+    ring_free(&cl->ring);
+    free(cl);
+}
+
+/**
+ * Cria os clientes dos nós de um cluster
+ *
+ * @param nodes Nós no formato "ip:porta"; um nó só equivale a bfs_open()
+ * @return Cluster, ou NULL se algum nó é inválido ou faltou memória
+ */
+static inline bfs_cluster_t *bfs_cluster_open(const char *const *nodes, int count, int connections, int window,
+                                              int codec) {
+    bfs_cluster_t *cl = (bfs_cluster_t *)calloc(1, sizeof(bfs_cluster_t));
+    if (cl == NULL) return NULL;
+    if (ring_init(&cl->ring, nodes, count) != 0) {
+        free(cl);
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        char address[RING_NAME_SIZE];
+        int port = bfs_node_split(nodes[i], address);
+        if (port < 0 || (cl->nodes[i] = bfs_open(address, port, connections, window, codec)) == NULL) {
+            bfs_cluster_close(cl);
+            return NULL;
+        }
+    }
+    return cl;
+}
+
+/**
+ * Nó dono de um nome (posição na lista passada a bfs_cluster_open())
+ */
+static inline int bfs_cluster_owner(const bfs_cluster_t *cl, const char *name) {
+    return ring_owner(&cl->ring, name);
+}
+
+/**
+ * Cliente do nó dono de um nome
+ */
+static inline bfs_client_t *bfs_cluster_route(bfs_cluster_t *cl, const char *name) {
+    return cl->nodes[ring_owner(&cl->ring, name)];
+}
+
+/**
+ * Aguarda a conclusão dos pedidos em todos os nós
+ */
+static inline void bfs_cluster_wait(bfs_cluster_t *cl) {
+    for (int i = 0; i < cl->ring.count; i++) bfs_wait(cl->nodes[i]);
+}
+
+/**
+ * Guarda uma entrada da listagem de um nó (thread da conexão)
+ */
+static inline void bfs_merge_entry(void *ctx, const list_entry_t *e) {
+    bfs_merge_t *m = (bfs_merge_t *)ctx;
+    size_t name_len = strlen(e->name) + 1;
+    bfs_merge_entry_t *copy = (bfs_merge_entry_t *)malloc(sizeof(bfs_merge_entry_t) + name_len);
+
+    if (copy != NULL) {
+        copy->size = e->size;
+        copy->mtime = e->mtime;
+        copy->hash_len = e->hash_len;
+        memcpy(copy->hash, e->hash, sizeof(copy->hash));
+        memcpy(copy->name, e->name, name_len);
+    }
+    mutex_lock(&m->lock);
+    if (copy != NULL && m->count == m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 256;
+        bfs_merge_entry_t **entries = (bfs_merge_entry_t **)realloc(m->entries, cap * sizeof(bfs_merge_entry_t *));
+        if (entries != NULL) {
+            m->entries = entries;
+            m->cap = cap;
+        } else {
+            free(copy);
+            copy = NULL;
+        }
+    }
+    if (copy != NULL) m->entries[m->count++] = copy;
+    else m->oom = 1;
+    mutex_unlock(&m->lock);
+}
+
+/**
+ * Compara entradas guardadas pelo nome, para qsort()
+ */
+static inline int bfs_merge_compare(const void *a, const void *b) {
+    return strcmp((*(bfs_merge_entry_t *const *)a)->name, (*(bfs_merge_entry_t *const *)b)->name);
+}
+
+/**
+ * Registra o fim da listagem de um nó; no último, entrega tudo em ordem
+ *
+ * Por que foi feito:
+ * - Cada nó devolve só os seus nomes, em ordem; a junção é ordenada de
+ *   novo para que a listagem do cluster se pareça com a de um servidor só
+ * - Entradas dos nós que responderam são entregues mesmo se outro falhou;
+ *   o resultado informa a falha
+ */
+static inline void bfs_merge_done(void *ctx, const bfs_result_t *r) {
+    bfs_merge_t *m = (bfs_merge_t *)ctx;
+
+    mutex_lock(&m->lock);
+    if (r->status != BFS_OK && m->failure.status == BFS_OK) m->failure = *r;
+    int last = --m->waiting == 0;
+    mutex_unlock(&m->lock);
+    if (!last) return;
+
+    list_entry_t *e = (list_entry_t *)malloc(sizeof(list_entry_t));
+    qsort(m->entries, m->count, sizeof(bfs_merge_entry_t *), bfs_merge_compare);
+    for (size_t i = 0; i < m->count; i++) {
+        bfs_merge_entry_t *copy = m->entries[i];
+        if (e != NULL && m->visit != NULL) {
+            e->size = copy->size;
+            e->mtime = copy->mtime;
+            e->hash_len = copy->hash_len;
+            memcpy(e->hash, copy->hash, sizeof(e->hash));
+            snprintf(e->name, sizeof(e->name), "%s", copy->name);
+            m->visit(m->ctx, e);
+        }
+        free(copy);
+    }
+
+    bfs_result_t out = m->failure;
+    if (out.status == BFS_OK && (m->oom || e == NULL)) {
+        out.status = BFS_REFUSED;
+        snprintf(out.message, sizeof(out.message), "Memória insuficiente.");
+    }
+    out.size = m->count;
+    out.entry = NULL;
+    if (m->done != NULL) m->done(m->ctx, &out);
+    free(e);
+    free(m->entries);
+    mutex_destroy(&m->lock);
+    free(m);
+}
+
+/**
+ * Lista os arquivos de todos os nós cujo nome começa com prefix
+ *
+ * @param visit Chamada para cada entrada, em ordem de nome, depois que
+ *              todos os nós responderam (com um nó só, assim que chega)
+ *
+ * Por que foi feito:
+ * - Os pedidos partem para todos os nós de uma vez, então a listagem leva
+ *   o tempo do nó mais lento, e não a soma de todos
+ */
+static inline int bfs_cluster_list(bfs_cluster_t *cl, const char *prefix, bfs_entry_fn visit, bfs_done_fn done,
+                                   void *ctx) {
+    if (cl->ring.count == 1) return bfs_list(cl->nodes[0], prefix, visit, done, ctx);
+
+    bfs_merge_t *m = (bfs_merge_t *)calloc(1, sizeof(bfs_merge_t));
+    if (m == NULL) return bfs_submit(cl->nodes[0], NULL, done, ctx);
+    mutex_init(&m->lock);
+    m->waiting = cl->ring.count;
+    m->failure.status = BFS_OK;
+    m->visit = visit;
+    m->done = done;
+    m->ctx = ctx;
+    for (int i = 0; i < cl->ring.count; i++) bfs_list(cl->nodes[i], prefix, bfs_merge_entry, bfs_merge_done, m);
+    return 0;
+}
+
+/*--------------------------------------------------------------
+ * CHAMADAS SÍNCRONAS
+ *------------------------------------------------------------*/
+
+/**
+ * Prepara a espera pela resposta de um pedido
+ */
+static inline void bfs_future_init(bfs_future_t *f) {
+    mutex_init(&f->lock);
+    cond_init(&f->cond);
+    f->done = 0;
+}
+
+/**
+ * Função de retorno que guarda o resultado em um bfs_future_t
+ */
+static inline void bfs_future_done(void *ctx, const bfs_result_t *r) {
+    bfs_future_t *f = (bfs_future_t *)ctx;
+
+    mutex_lock(&f->lock);
+    f->result = *r;
+    if (r->entry != NULL) {
+        f->entry = *r->entry;
+        f->result.entry = &f->entry;
+    }
+    f->done = 1;
+    cond_signal(&f->cond);
+    mutex_unlock(&f->lock);
+}
+
+/**
+ * Aguarda a resposta e libera o que bfs_future_init() preparou
+ *
+ * @return Resultado do pedido (válido enquanto f existir)
+ */
+static inline const bfs_result_t *bfs_future_wait(bfs_future_t *f) {
+    mutex_lock(&f->lock);
+    while (!f->done) cond_wait(&f->cond, &f->lock);
+    mutex_unlock(&f->lock);
+    mutex_destroy(&f->lock);
+    cond_destroy(&f->cond);
+    return &f->result;
+}
+
+#endif
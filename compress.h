@@ -0,0 +1,382 @@
+/*******************************************************************************
+ * COMPRESSÃO DOS QUADROS DE DADOS
+ *
+ * Descrição: Codecs usados para comprimir o conteúdo dos quadros DATA. Cada
+ *            quadro é comprimido de forma independente, então compressão,
+ *            rede e disco trabalham em paralelo, um quadro por vez.
+ *
+ * Codecs:
+ * - CODEC_NONE: bytes crus
+ * - CODEC_LZ4:  formato de bloco do LZ4 (implementação própria, sem
+ *               dependências): compressão rápida, para links rápidos
+ * - CODEC_ZSTD: zstd nível 3, melhor razão para links lentos; só existe
+ *               quando o programa é compilado com -DBIGFS_WITH_ZSTD -lzstd
+ *
+ * Formato de um quadro DATA com FLAG_COMPRESSED (codec em FLAG_CODEC):
+ *   u32 tamanho original + bytes comprimidos
+ * Quadros que não diminuem com a compressão vão crus (sem a flag), então
+ * conteúdo já comprimido custa só a tentativa.
+ ******************************************************************************/
+#ifndef BIGFS_COMPRESS_H
+#define BIGFS_COMPRESS_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "protocol.h"
+#ifdef BIGFS_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define COMPRESS_SAMPLE (64 * 1024)     // Amostra usada para detectar conteúdo já comprimido
+#define COMPRESS_MIN_GAIN 0.90          // Razão máxima da amostra para valer a pena comprimir
+#define LZ4_HASH_BITS 13                // Entradas da tabela de busca do LZ4 (2^13)
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5             // Bytes finais sempre literais (formato LZ4)
+#define LZ4_MATCH_LIMIT 12              // Último início de repetição antes do fim
+#define ZSTD_LEVEL 3
+
+/**
+ * Codecs dos quadros DATA (valor transportado nas flags do cabeçalho)
+ */
+enum {
+    CODEC_NONE = 0,
+    CODEC_LZ4  = 1,
+    CODEC_ZSTD = 2
+};
+
+/*--------------------------------------------------------------
+ * LZ4 (FORMATO DE BLOCO)
+ *------------------------------------------------------------*/
+
+static inline uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/**
+ * Escreve a extensão de um tamanho (bytes 255 e o resto)
+ */
+static inline uint8_t *lz4_write_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/**
+ * Comprime um bloco no formato do LZ4
+ *
+ * @return Tamanho comprimido, ou 0 se não coube em cap bytes
+ *
+ * Por que foi feito:
+ * - Busca gulosa com uma tabela de hash de 4 bytes, como o LZ4 rápido;
+ *   em trechos sem repetição o passo aumenta, então conteúdo
+ *   incompressível custa pouca CPU
+ */
+static inline size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    uint32_t table[1 << LZ4_HASH_BITS];
+    const uint8_t *ip = src, *anchor = src, *end = src + len;
+    uint8_t *op = dst, *op_end = dst + cap;
+    unsigned misses = 0;
+
+    if (len > LZ4_MATCH_LIMIT) {
+        const uint8_t *match_start_limit = end - LZ4_MATCH_LIMIT;
+        const uint8_t *match_end_limit = end - LZ4_LAST_LITERALS;
+        memset(table, 0, sizeof(table));
+
+        while (ip < match_start_limit) {
+            uint32_t seq = lz4_read32(ip);
+            uint32_t h = lz4_hash(seq);
+            const uint8_t *ref = table[h] ? src + table[h] - 1 : NULL;
+            table[h] = (uint32_t)(ip - src) + 1;
+
+            if (ref == NULL || ip - ref > 65535 || lz4_read32(ref) != seq) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            // Estende a repetição para trás e para frente
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            size_t match_len = LZ4_MIN_MATCH;
+            while (ip + match_len < match_end_limit && ip[match_len] == ref[match_len]) match_len++;
+
+            size_t lit_len = (size_t)(ip - anchor);
+            if ((size_t)(op_end - op) < 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1) return 0;
+
+            uint8_t *token = op++;
+            *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+            if (lit_len >= 15) op = lz4_write_length(op, lit_len - 15);
+            memcpy(op, anchor, lit_len);
+            op += lit_len;
+
+            uint16_t offset = (uint16_t)(ip - ref);
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+
+            size_t extra = match_len - LZ4_MIN_MATCH;
+            *token |= (uint8_t)(extra >= 15 ? 15 : extra);
+            if (extra >= 15) op = lz4_write_length(op, extra - 15);
+
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    // Literais finais
+    size_t lit_len = (size_t)(end - anchor);
+    if ((size_t)(op_end - op) < 1 + lit_len / 255 + 1 + lit_len) return 0;
+    *op++ = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15) op = lz4_write_length(op, lit_len - 15);
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+    return (size_t)(op - dst);
+}
+
+/**
+ * Lê a extensão de um tamanho
+ *
+ * @return 0 em caso de sucesso, -1 se a entrada acabou
+ */
+static inline int lz4_read_length(const uint8_t **ip, const uint8_t *end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= end) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/**
+ * Descomprime um bloco no formato do LZ4
+ *
+ * @param raw Tamanho original exato
+ * @return 0 em caso de sucesso, -1 se o bloco é inválido
+ *
+ * Por que foi feito:
+ * - O bloco vem da rede: todo tamanho e distância é conferido contra os
+ *   limites da entrada e da saída antes de copiar
+ */
+static inline int lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t raw) {
+    const uint8_t *ip = src, *end = src + len;
+    uint8_t *op = dst, *op_end = dst + raw;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && lz4_read_length(&ip, end, &lit_len) != 0) return -1;
+        if (lit_len > (size_t)(end - ip) || lit_len > (size_t)(op_end - op)) return -1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == end) break;   // Última sequência: só literais
+
+        if (end - ip < 2) return -1;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+        size_t match_len = token & 15;
+        if (match_len == 15 && lz4_read_length(&ip, end, &match_len) != 0) return -1;
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > (size_t)(op_end - op)) return -1;
+
+        const uint8_t *ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            // Repetição que se sobrepõe à saída (ex.: sequências de um byte)
+            while (match_len-- > 0) *op++ = *ref++;
+        }
+    }
+    return op == op_end ? 0 : -1;
+}
+
+/*--------------------------------------------------------------
+ * INTERFACE DOS CODECS
+ *------------------------------------------------------------*/
+
+/**
+ * Codecs disponíveis neste programa (bit 1 << codec)
+ */
+static inline uint8_t codec_supported_mask(void) {
+    uint8_t mask = (1 << CODEC_NONE) | (1 << CODEC_LZ4);
+#ifdef BIGFS_WITH_ZSTD
+    mask |= 1 << CODEC_ZSTD;
+#endif
+    return mask;
+}
+
+/**
+ * Nome legível de um codec
+ */
+static inline const char *codec_name(int codec) {
+    switch (codec) {
+        case CODEC_LZ4: return "lz4";
+        case CODEC_ZSTD: return "zstd";
+        default: return "none";
+    }
+}
+
+/**
+ * Converte o nome de um codec
+ *
+ * @return Codec, ou -1 se o nome é desconhecido
+ */
+static inline int codec_parse(const char *name) {
+    if (strcmp(name, "none") == 0) return CODEC_NONE;
+    if (strcmp(name, "lz4") == 0) return CODEC_LZ4;
+    if (strcmp(name, "zstd") == 0) return CODEC_ZSTD;
+    return -1;
+}
+
+/**
+ * Escolhe o codec preferido entre os que os dois lados suportam
+ *
+ * Por que foi feito:
+ * - zstd comprime mais e compensa quando o link é o gargalo; sem ele, o
+ *   LZ4 ainda reduz texto várias vezes a um custo baixo de CPU
+ */
+static inline int codec_choose(uint8_t mask) {
+    if (mask & (1 << CODEC_ZSTD)) return CODEC_ZSTD;
+    if (mask & (1 << CODEC_LZ4)) return CODEC_LZ4;
+    return CODEC_NONE;
+}
+
+/**
+ * Comprime um bloco
+ *
+ * @return Tamanho comprimido, ou 0 se não coube em cap bytes
+ */
+static inline size_t codec_compress(int codec, const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    switch (codec) {
+        case CODEC_LZ4:
+            return lz4_compress(src, len, dst, cap);
+#ifdef BIGFS_WITH_ZSTD
+        case CODEC_ZSTD: {
+            size_t n = ZSTD_compress(dst, cap, src, len, ZSTD_LEVEL);
+            return ZSTD_isError(n) ? 0 : n;
+        }
+#endif
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Descomprime um bloco
+ *
+ * @param raw Tamanho original exato
+ * @return 0 em caso de sucesso, -1 se o bloco é inválido
+ */
+static inline int codec_decompress(int codec, const uint8_t *src, size_t len, uint8_t *dst, size_t raw) {
+    switch (codec) {
+        case CODEC_LZ4:
+            return lz4_decompress(src, len, dst, raw);
+#ifdef BIGFS_WITH_ZSTD
+        case CODEC_ZSTD: {
+            size_t n = ZSTD_decompress(dst, raw, src, len);
+            return (ZSTD_isError(n) || n != raw) ? -1 : 0;
+        }
+#endif
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Indica se o conteúdo já parece comprimido
+ *
+ * @param sample Início do arquivo (até COMPRESS_SAMPLE bytes)
+ * @param scratch Buffer com pelo menos len bytes
+ * @return 1 se não vale a pena comprimir, 0 caso contrário
+ *
+ * Por que foi feito:
+ * - Formatos comprimidos conhecidos são reconhecidos pela assinatura; os
+ *   demais passam por uma tentativa rápida com LZ4 na amostra
+ * - PDFs guardam a maior parte do conteúdo em fluxos já comprimidos
+ */
+static inline int compress_looks_compressed(const uint8_t *sample, size_t len, uint8_t *scratch) {
+    static const struct { const char *magic; size_t len; } known[] = {
+        { "\x1f\x8b", 2 },              // gzip
+        { "PK\x03\x04", 4 },            // zip, docx, xlsx, jar
+        { "\x28\xb5\x2f\xfd", 4 },      // zstd
+        { "\x04\x22\x4d\x18", 4 },      // lz4
+        { "\xfd" "7zXZ", 5 },           // xz
+        { "BZh", 3 },                   // bzip2
+        { "7z\xbc\xaf\x27\x1c", 6 },    // 7z
+        { "Rar!", 4 },                  // rar
+        { "\x89PNG", 4 },               // png
+        { "\xff\xd8\xff", 3 },          // jpeg
+        { "%PDF", 4 },                  // pdf
+        { "OggS", 4 },                  // ogg
+        { "ID3", 3 }                    // mp3
+    };
+
+    for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+        if (len >= known[i].len && memcmp(sample, known[i].magic, known[i].len) == 0) return 1;
+    }
+    if (len >= 12 && memcmp(sample + 4, "ftyp", 4) == 0) return 1;  // mp4, mov
+    if (len < 1024) return 0;
+
+    size_t packed = lz4_compress(sample, len, scratch, len);
+    return packed == 0 || (double)packed > (double)len * COMPRESS_MIN_GAIN;
+}
+
+/*--------------------------------------------------------------
+ * QUADROS DATA COMPRIMIDOS (CONEXÕES BLOQUEANTES)
+ *------------------------------------------------------------*/
+
+/**
+ * Envia um quadro DATA, comprimido quando o codec reduz o bloco
+ *
+ * @param scratch Buffer com pelo menos len bytes
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+static inline int proto_send_data(SOCKET s, uint16_t flags, uint32_t request_id, const void *data,
+                                  size_t len, int codec, uint8_t *scratch) {
+    if (codec != CODEC_NONE && len > 4) {
+        size_t packed = codec_compress(codec, (const uint8_t *)data, len, scratch + 4, len - 4);
+        if (packed > 0) {
+            put_u32(scratch, (uint32_t)len);
+            return proto_send_frame(s, OP_DATA, flags | FLAG_COMPRESSED | FLAG_CODEC(codec), request_id,
+                                    scratch, 4 + packed);
+        }
+    }
+    return proto_send_frame(s, OP_DATA, flags, request_id, data, len);
+}
+
+/**
+ * Recebe e descomprime o payload de um quadro DATA com FLAG_COMPRESSED
+ *
+ * @param h Cabeçalho já recebido (o codec vem das flags)
+ * @param packed Buffer com FRAME_DATA_CHUNK bytes para o payload
+ * @param out Buffer com FRAME_DATA_CHUNK bytes para os dados originais
+ * @param out_len Recebe o tamanho original
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+static inline int proto_recv_packed(SOCKET s, const frame_header_t *h, uint8_t *packed, uint8_t *out,
+                                    size_t *out_len) {
+    int codec = FLAG_CODEC_OF(h->flags);
+
+    if (h->length < 4 || h->length > FRAME_DATA_CHUNK || net_recv_all(s, packed, (size_t)h->length) != 0) return -1;
+    uint32_t raw = get_u32(packed);
+    if (raw > FRAME_DATA_CHUNK || !(codec_supported_mask() & (1 << codec)) ||
+        codec_decompress(codec, packed + 4, (size_t)h->length - 4, out, raw) != 0) return -1;
+    *out_len = raw;
+    return 0;
+}
+
+#endif /* BIGFS_COMPRESS_H */
@@ -0,0 +1,471 @@
+/*******************************************************************************
+ * SINCRONIZAÇÃO POR DIFERENÇAS (ESTILO RSYNC)
+ *
+ * Descrição: Atualiza um arquivo que já existe no servidor enviando só o que
+ *            mudou. O servidor descreve sua cópia em assinaturas de blocos
+ *            de tamanho fixo; o cliente procura esses blocos em qualquer
+ *            posição do arquivo novo e envia referências para os que achou
+ *            e os bytes literais do resto.
+ *
+ * Componentes:
+ * - Soma fraca rolante (duas somas de 16 bits, como no rsync): desliza um
+ *   byte por vez em O(1), então o cliente testa todas as posições
+ * - Hash forte (SHA-256 truncado): confirma um candidato da soma fraca
+ * - Instruções: COPY (blocos consecutivos da cópia antiga) e LITERAL
+ *
+ * Formato das assinaturas (inteiros em big-endian): por bloco, u32 soma
+ * fraca + DELTA_STRONG_SIZE bytes do hash forte; o último bloco pode ser
+ * menor que os demais.
+ *
+ * Formato das instruções:
+ *   u8 DELTA_OP_COPY + u32 primeiro bloco + u32 quantidade de blocos
+ *   u8 DELTA_OP_LITERAL + u32 tamanho + bytes
+ ******************************************************************************/
+#ifndef BIGFS_DELTA_H
+#define BIGFS_DELTA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "platform.h"
+#include "protocol.h"
+#include "digest.h"
+#include "bufpool.h"
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define DELTA_BLOCK_MIN (2 * 1024)          // Menor bloco escolhido pelo servidor
+#define DELTA_BLOCK_MAX (256 * 1024)        // Maior bloco aceito
+#define DELTA_STRONG_SIZE 16                // Bytes do SHA-256 mantidos por bloco
+#define DELTA_SIG_SIZE (4 + DELTA_STRONG_SIZE) // Assinatura codificada de um bloco
+#define DELTA_LITERAL_MAX (256 * 1024)      // Maior trecho literal de uma instrução
+#define DELTA_IO_SIZE (1024 * 1024)         // Leituras e escritas em disco
+
+enum {
+    DELTA_OP_COPY = 1,      // Blocos da cópia antiga
+    DELTA_OP_LITERAL = 2    // Bytes novos
+};
+
+/*--------------------------------------------------------------
+ * SOMAS E ASSINATURAS
+ *------------------------------------------------------------*/
+
+/**
+ * Assinatura de um bloco da cópia do servidor
+ */
+typedef struct {
+    uint32_t weak;
+    uint8_t strong[DELTA_STRONG_SIZE];
+} delta_sig_t;
+
+/**
+ * Assinaturas de um arquivo, com tabela de busca pela soma fraca
+ */
+typedef struct {
+    uint64_t size;              // Tamanho do arquivo assinado
+    uint32_t block;             // Tamanho dos blocos
+    uint32_t count;
+    delta_sig_t *sigs;
+    uint32_t *table;            // Índice do bloco + 1 (0 = vazio), por soma fraca
+    uint32_t mask;
+} delta_signature_t;
+
+/**
+ * Escolhe o tamanho dos blocos para um arquivo
+ *
+ * Por que foi feito:
+ * - Perto da raiz quadrada do tamanho, como no rsync: blocos menores
+ *   acham mais trechos iguais, mas a lista de assinaturas cresce
+ */
+static inline uint32_t delta_block_size(uint64_t size) {
+    uint32_t block = DELTA_BLOCK_MIN;
+    while (block < DELTA_BLOCK_MAX && (uint64_t)block * block < size) block *= 2;
+    return block;
+}
+
+/**
+ * Calcula a soma fraca de um bloco inteiro
+ */
+static inline uint32_t delta_weak(const uint8_t *data, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += a;
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+/**
+ * Desliza a soma fraca um byte para frente
+ *
+ * @param out Byte que sai do início da janela
+ * @param in Byte que entra no fim da janela
+ * @param len Tamanho da janela
+ */
+static inline uint32_t delta_roll(uint32_t weak, uint8_t out, uint8_t in, size_t len) {
+    uint32_t a = weak & 0xffff, b = weak >> 16;
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t)(len * out) + a) & 0xffff;
+    return a | (b << 16);
+}
+
+/**
+ * Calcula o hash forte de um bloco
+ */
+static inline void delta_strong(const uint8_t *data, size_t len, uint8_t *out) {
+    uint8_t full[SHA256_SIZE];
+    sha256(data, len, full);
+    memcpy(out, full, DELTA_STRONG_SIZE);
+}
+
+/**
+ * Libera as assinaturas
+ */
+static inline void delta_signature_free(delta_signature_t *sig) {
+    free(sig->sigs);
+    free(sig->table);
+    memset(sig, 0, sizeof(*sig));
+}
+
+/**
+ * Monta a tabela de busca pela soma fraca
+ *
+ * @return 0 em caso de sucesso, -1 sem memória
+ */
+static inline int delta_signature_index(delta_signature_t *sig) {
+    uint32_t cap = 16;
+    while (cap < sig->count * 2) cap *= 2;
+    sig->table = (uint32_t *)calloc(cap, sizeof(uint32_t));
+    if (sig->table == NULL) return -1;
+    sig->mask = cap - 1;
+    for (uint32_t i = 0; i < sig->count; i++) {
+        uint32_t slot = (sig->sigs[i].weak * 0x9e3779b1u) & sig->mask;
+        while (sig->table[slot] != 0) slot = (slot + 1) & sig->mask;
+        sig->table[slot] = i + 1;
+    }
+    return 0;
+}
+
+/**
+ * Procura um bloco igual à janela atual
+ *
+ * @param data Janela com len bytes
+ * @return Índice do bloco, ou -1 se nenhum bloco é igual
+ *
+ * Por que foi feito:
+ * - O hash forte só é calculado quando a soma fraca coincide, o que é
+ *   raro fora dos trechos realmente iguais
+ */
+static inline int64_t delta_signature_find(const delta_signature_t *sig, uint32_t weak,
+                                           const uint8_t *data, size_t len) {
+    uint8_t strong[DELTA_STRONG_SIZE];
+    int computed = 0;
+    uint32_t slot = (weak * 0x9e3779b1u) & sig->mask;
+
+    for (; sig->table[slot] != 0; slot = (slot + 1) & sig->mask) {
+        uint32_t i = sig->table[slot] - 1;
+        if (sig->sigs[i].weak != weak) continue;
+        // Só o último bloco pode ter outro tamanho
+        uint64_t block_len = i + 1 < sig->count ? sig->block : sig->size - (uint64_t)i * sig->block;
+        if (block_len != len) continue;
+        if (!computed) {
+            delta_strong(data, len, strong);
+            computed = 1;
+        }
+        if (memcmp(strong, sig->sigs[i].strong, DELTA_STRONG_SIZE) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * Calcula as assinaturas de um arquivo
+ *
+ * @param block Tamanho dos blocos
+ * @return 0 em caso de sucesso, -1 em caso de erro de leitura ou memória
+ */
+static inline int delta_sign_file(int fd, uint64_t size, uint32_t block, delta_signature_t *sig) {
+    uint64_t count = (size + block - 1) / block;
+    uint8_t *buffer;
+
+    memset(sig, 0, sizeof(*sig));
+    if (block == 0 || block > DELTA_BLOCK_MAX || count > UINT32_MAX) return -1;
+    sig->size = size;
+    sig->block = block;
+    sig->count = (uint32_t)count;
+    sig->sigs = (delta_sig_t *)malloc((count ? count : 1) * sizeof(delta_sig_t));
+    buffer = (uint8_t *)bufpool_alloc(DELTA_IO_SIZE, NULL);
+    if (sig->sigs == NULL || buffer == NULL) {
+        bufpool_free(buffer, DELTA_IO_SIZE, NULL);
+        delta_signature_free(sig);
+        return -1;
+    }
+
+    // Lê vários blocos por vez (DELTA_IO_SIZE é múltiplo de qualquer bloco)
+    for (uint64_t pos = 0; pos < size;) {
+        size_t want = size - pos < DELTA_IO_SIZE ? (size_t)(size - pos) : DELTA_IO_SIZE;
+        if (file_pread(fd, buffer, want, pos) != (int64_t)want) {
+            bufpool_free(buffer, DELTA_IO_SIZE, NULL);
+            delta_signature_free(sig);
+            return -1;
+        }
+        for (size_t off = 0; off < want; off += block) {
+            size_t len = want - off < block ? want - off : block;
+            delta_sig_t *s = &sig->sigs[(pos + off) / block];
+            s->weak = delta_weak(buffer + off, len);
+            delta_strong(buffer + off, len, s->strong);
+        }
+        pos += want;
+    }
+    bufpool_free(buffer, DELTA_IO_SIZE, NULL);
+    return 0;
+}
+
+/**
+ * Serializa a assinatura de um bloco
+ *
+ * @param out Buffer com DELTA_SIG_SIZE bytes
+ */
+static inline void delta_sig_encode(uint8_t *out, const delta_sig_t *s) {
+    put_u32(out, s->weak);
+    memcpy(out + 4, s->strong, DELTA_STRONG_SIZE);
+}
+
+/**
+ * Decodifica a assinatura de um bloco
+ */
+static inline void delta_sig_decode(const uint8_t *in, delta_sig_t *s) {
+    s->weak = get_u32(in);
+    memcpy(s->strong, in + 4, DELTA_STRONG_SIZE);
+}
+
+/*--------------------------------------------------------------
+ * GERAÇÃO DAS INSTRUÇÕES (CLIENTE)
+ *------------------------------------------------------------*/
+
+/**
+ * Saída das instruções, com a cópia pendente ainda não escrita
+ */
+typedef struct {
+    FILE *out;
+    uint64_t length;            // Bytes de instruções escritos
+    uint64_t literal;           // Bytes literais escritos
+    uint32_t copy_first;        // Cópia pendente (blocos consecutivos)
+    uint32_t copy_count;
+    int failed;
+} delta_writer_t;
+
+/**
+ * Escreve a cópia pendente
+ */
+static inline void delta_flush_copy(delta_writer_t *w) {
+    uint8_t op[9];
+    if (w->copy_count == 0) return;
+    op[0] = DELTA_OP_COPY;
+    put_u32(op + 1, w->copy_first);
+    put_u32(op + 5, w->copy_count);
+    if (fwrite(op, 1, sizeof(op), w->out) != sizeof(op)) w->failed = 1;
+    w->length += sizeof(op);
+    w->copy_count = 0;
+}
+
+/**
+ * Acrescenta uma referência a um bloco, juntando blocos consecutivos
+ */
+static inline void delta_emit_copy(delta_writer_t *w, uint32_t index) {
+    if (w->copy_count > 0 && w->copy_first + w->copy_count == index && w->copy_count < UINT32_MAX) {
+        w->copy_count++;
+        return;
+    }
+    delta_flush_copy(w);
+    w->copy_first = index;
+    w->copy_count = 1;
+}
+
+/**
+ * Acrescenta bytes literais
+ */
+static inline void delta_emit_literal(delta_writer_t *w, const uint8_t *data, size_t len) {
+    uint8_t op[5];
+    if (len == 0) return;
+    delta_flush_copy(w);
+    op[0] = DELTA_OP_LITERAL;
+    put_u32(op + 1, (uint32_t)len);
+    if (fwrite(op, 1, sizeof(op), w->out) != sizeof(op) || fwrite(data, 1, len, w->out) != len) w->failed = 1;
+    w->length += sizeof(op) + len;
+    w->literal += len;
+}
+
+/**
+ * Gera as instruções que transformam a cópia do servidor no arquivo local
+ *
+ * @param fd Arquivo local (versão nova)
+ * @param size Tamanho do arquivo local
+ * @param sig Assinaturas da cópia do servidor (com tabela de busca)
+ * @param w Saída das instruções
+ * @param hash Recebe o SHA-256 do arquivo local (conferido pelo servidor)
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - O arquivo é percorrido por uma janela em memória; ao achar um bloco a
+ *   janela pula o bloco inteiro, e fora dos trechos iguais desliza um
+ *   byte por vez com a soma rolante
+ * - Os bytes sem correspondência saem em trechos de até DELTA_LITERAL_MAX,
+ *   então a janela nunca precisa guardar mais que isso do passado
+ */
+static inline int delta_encode_file(int fd, uint64_t size, const delta_signature_t *sig,
+                                    delta_writer_t *w, uint8_t *hash) {
+    size_t block = sig->block;
+    size_t cap = DELTA_LITERAL_MAX + block + DELTA_IO_SIZE;
+    uint8_t *buf = (uint8_t *)bufpool_alloc(cap, NULL);
+    uint64_t base = 0;          // Posição no arquivo do primeiro byte do buffer
+    size_t filled = 0, lit = 0, p = 0;
+    uint32_t weak = 0;
+    int rolling = 0;
+    sha256_t digest;
+
+    if (buf == NULL) return -1;
+    sha256_init(&digest);
+
+    for (;;) {
+        // Garante a janela inteira (ou o fim do arquivo) à frente de p
+        if (p + block > filled && base + filled < size) {
+            memmove(buf, buf + lit, filled - lit);
+            filled -= lit;
+            p -= lit;
+            base += lit;
+            lit = 0;
+            size_t want = cap - filled;
+            if (want > size - (base + filled)) want = (size_t)(size - (base + filled));
+            if (file_pread(fd, buf + filled, want, base + filled) != (int64_t)want) break;
+            sha256_update(&digest, buf + filled, want);
+            filled += want;
+        }
+        if (p + block > filled) break;  // Sobra menos que um bloco
+
+        if (!rolling) {
+            weak = delta_weak(buf + p, block);
+            rolling = 1;
+        }
+        int64_t match = sig->count > 0 ? delta_signature_find(sig, weak, buf + p, block) : -1;
+        if (match >= 0) {
+            delta_emit_literal(w, buf + lit, p - lit);
+            delta_emit_copy(w, (uint32_t)match);
+            p += block;
+            lit = p;
+            rolling = 0;
+            continue;
+        }
+        if (p + block < filled) weak = delta_roll(weak, buf[p], buf[p + block], block);
+        else rolling = 0;
+        p++;
+        if (p - lit >= DELTA_LITERAL_MAX) {
+            delta_emit_literal(w, buf + lit, p - lit);
+            lit = p;
+        }
+    }
+
+    // O fim do arquivo pode coincidir com o último bloco (mais curto) do servidor
+    if (base + filled == size && filled > p && sig->count > 0) {
+        size_t tail = filled - p;
+        int64_t match = delta_signature_find(sig, delta_weak(buf + p, tail), buf + p, tail);
+        if (match >= 0) {
+            delta_emit_literal(w, buf + lit, p - lit);
+            delta_emit_copy(w, (uint32_t)match);
+            p = lit = filled;
+        }
+    }
+    int complete = base + filled == size;
+    // Literais em pedaços de no máximo DELTA_LITERAL_MAX
+    while (complete && lit < filled) {
+        size_t len = filled - lit < DELTA_LITERAL_MAX ? filled - lit : DELTA_LITERAL_MAX;
+        delta_emit_literal(w, buf + lit, len);
+        lit += len;
+    }
+    delta_flush_copy(w);
+    bufpool_free(buf, cap, NULL);
+    sha256_final(&digest, hash);
+    return (complete && !w->failed) ? 0 : -1;
+}
+
+/*--------------------------------------------------------------
+ * APLICAÇÃO DAS INSTRUÇÕES (SERVIDOR)
+ *------------------------------------------------------------*/
+
+/**
+ * Reconstrói o arquivo novo a partir da cópia antiga e das instruções
+ *
+ * @param base_fd Cópia antiga do servidor
+ * @param base_size Tamanho da cópia antiga
+ * @param block Tamanho dos blocos das assinaturas
+ * @param ops_fd Instruções recebidas do cliente
+ * @param ops_len Tamanho das instruções
+ * @param out_fd Arquivo novo (vazio)
+ * @param size Tamanho esperado do arquivo novo
+ * @param hash Recebe o SHA-256 do arquivo novo
+ * @param sum Recebe o CRC32C e o XXH64 do arquivo novo (pode ser NULL)
+ * @return 0 em caso de sucesso, -1 se as instruções são inválidas ou
+ *         houve erro de disco
+ *
+ * Por que foi feito:
+ * - As instruções vêm da rede: cada referência e cada tamanho é conferido
+ *   antes de ser usado, e o arquivo novo nunca passa do tamanho declarado
+ * - O SHA-256 do resultado é comparado pelo chamador com o do cliente,
+ *   o que cobre uma colisão improvável das somas
+ * - O resumo de integridade sai da mesma passada, então o servidor guarda
+ *   o resumo do arquivo novo sem lê-lo de novo
+ */
+static inline int delta_apply(int base_fd, uint64_t base_size, uint32_t block, int ops_fd, uint64_t ops_len,
+                              int out_fd, uint64_t size, uint8_t *hash, checksum_t *sum) {
+    uint8_t *buf = (uint8_t *)bufpool_alloc(DELTA_IO_SIZE, NULL);
+    uint64_t in = 0, out = 0;
+    uint32_t blocks = block ? (uint32_t)((base_size + block - 1) / block) : 0;
+    int failed = buf == NULL || block == 0 || block > DELTA_BLOCK_MAX;
+    sha256_t digest;
+    io_vec_t iov;
+
+    sha256_init(&digest);
+    if (sum != NULL) checksum_init(sum);
+    while (!failed && in < ops_len) {
+        uint8_t op[9];
+        uint64_t src, len;
+
+        if (file_pread(ops_fd, op, 1, in) != 1) break;
+        if (op[0] == DELTA_OP_COPY) {
+            if (in + 9 > ops_len || file_pread(ops_fd, op, 9, in) != 9) break;
+            uint32_t first = get_u32(op + 1), count = get_u32(op + 5);
+            if (count == 0 || first >= blocks || count > blocks - first) break;
+            src = (uint64_t)first * block;
+            len = (uint64_t)count * block;
+            if (len > base_size - src) len = base_size - src;  // Inclui o último bloco, mais curto
+            in += 9;
+        } else if (op[0] == DELTA_OP_LITERAL) {
+            if (in + 5 > ops_len || file_pread(ops_fd, op, 5, in) != 5) break;
+            len = get_u32(op + 1);
+            src = in + 5;
+            if (len == 0 || len > ops_len - src) break;
+            in = src + len;
+        } else {
+            break;
+        }
+        if (len > size - out) break;
+
+        // Copia o trecho da cópia antiga ou das instruções para o arquivo novo
+        int from = op[0] == DELTA_OP_COPY ? base_fd : ops_fd;
+        while (len > 0 && !failed) {
+            size_t n = len < DELTA_IO_SIZE ? (size_t)len : DELTA_IO_SIZE;
+            iov.iov_base = buf;
+            iov.iov_len = n;
+            failed = file_pread(from, buf, n, src) != (int64_t)n || file_pwritev(out_fd, &iov, 1, out) != 0;
+            sha256_update(&digest, buf, n);
+            if (sum != NULL) checksum_update(sum, buf, n);
+            src += n;
+            out += n;
+            len -= n;
+        }
+    }
+    bufpool_free(buf, DELTA_IO_SIZE, NULL);
+    sha256_final(&digest, hash);
+    return (!failed && in == ops_len && out == size) ? 0 : -1;
+}
+
+#endif /* BIGFS_DELTA_H */
@@ -0,0 +1,609 @@
+/*******************************************************************************
+ * RESUMOS (HASHES) DE CONTEÚDO
+ *
+ * Descrição: Funções de hash usadas para identificar e conferir conteúdo de
+ *            arquivos e blocos, sem depender de bibliotecas externas.
+ *
+ * Algoritmos:
+ * - SHA-256: hash criptográfico (FIPS 180-4); identifica blocos no
+ *            armazenamento por conteúdo, onde uma colisão faria dois
+ *            conteúdos diferentes compartilharem o mesmo bloco
+ * - CRC32C:  soma de verificação (Castagnoli) calculada pela instrução
+ *            crc32 do SSE4.2 quando a CPU tem; CRCs de trechos
+ *            consecutivos podem ser combinados sem reler os dados
+ * - XXH64:   hash não criptográfico de 64 bits, várias vezes mais rápido
+ *            que o SHA-256; detecta corrupção, não adulteração
+ *
+ * Todas as funções aceitam os dados em pedaços (init/update/final), então o
+ * hash é calculado enquanto os bytes chegam pela rede ou saem do disco.
+ ******************************************************************************/
+#ifndef BIGFS_DIGEST_H
+#define BIGFS_DIGEST_H
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HW_X86 1         // Instrução crc32 do SSE4.2 (detectada em tempo de execução)
+#endif
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define SHA256_SIZE 32          // Tamanho do resumo SHA-256 em bytes
+#define CRC32C_POLY 0x82f63b78u // Polinômio de Castagnoli (representação refletida)
+#define CHECKSUM_SIZE 12        // CRC32C (u32) + XXH64 (u64), em big-endian
+#define CHECKSUM_CRC_SIZE 4     // Resumo só com o CRC32C (XXH64 desconhecido)
+
+/*--------------------------------------------------------------
+ * SHA-256
+ *------------------------------------------------------------*/
+
+/**
+ * Estado de um cálculo SHA-256 em andamento
+ */
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;            // Bytes processados
+    uint8_t block[64];          // Bloco parcial ainda não processado
+    size_t used;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * Processa um bloco de 64 bytes
+ */
+static inline void sha256_compress(uint32_t *state, const uint8_t *block) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/**
+ * Inicia um cálculo SHA-256
+ */
+static inline void sha256_init(sha256_t *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+/**
+ * Acrescenta bytes ao cálculo
+ */
+static inline void sha256_update(sha256_t *ctx, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+
+    ctx->length += len;
+    if (ctx->used > 0) {
+        size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        len -= take;
+        if (ctx->used < 64) return;
+        sha256_compress(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    // Blocos inteiros direto da entrada, sem copiar
+    for (; len >= 64; p += 64, len -= 64) sha256_compress(ctx->state, p);
+    memcpy(ctx->block, p, len);
+    ctx->used = len;
+}
+
+/**
+ * Conclui o cálculo
+ *
+ * @param out Recebe SHA256_SIZE bytes
+ */
+static inline void sha256_final(sha256_t *ctx, uint8_t *out) {
+    uint64_t bits = ctx->length * 8;
+
+    // Preenchimento: 0x80, zeros e o tamanho em bits (big-endian)
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        sha256_compress(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (int i = 0; i < 8; i++) ctx->block[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha256_compress(ctx->state, ctx->block);
+
+    for (int i = 0; i < 8; i++) {
+        out[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)ctx->state[i];
+    }
+}
+
+/**
+ * Calcula o SHA-256 de um buffer inteiro
+ */
+static inline void sha256(const void *data, size_t len, uint8_t *out) {
+    sha256_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, out);
+}
+
+/*--------------------------------------------------------------
+ * CRC32C
+ *------------------------------------------------------------*/
+
+static const uint32_t crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+    0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+    0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+    0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+    0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+    0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+    0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+    0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+    0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+    0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+    0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+    0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+    0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+    0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+    0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+    0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+    0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+    0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+    0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+    0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+    0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+    0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+/**
+ * CRC32C por tabela, um byte por vez (CPUs sem SSE4.2)
+ */
+static inline uint32_t crc32c_soft(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len-- > 0) crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CRC32C_HW_X86
+/**
+ * CRC32C com a instrução crc32 (8 bytes por instrução)
+ */
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    for (; len > 0 && ((uintptr_t)p & 7) != 0; len--) c = _mm_crc32_u8((uint32_t)c, *p++);
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; len > 0; len--) c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+#endif
+
+/**
+ * Indica se o CRC32C é calculado pela CPU
+ */
+static inline int crc32c_hardware(void) {
+#ifdef CRC32C_HW_X86
+    static int supported = -1;
+    if (supported < 0) supported = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    return supported;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Acrescenta bytes a um CRC32C
+ *
+ * @param crc CRC dos bytes anteriores (0 no início)
+ * @return CRC de todos os bytes até aqui
+ */
+static inline uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+#ifdef CRC32C_HW_X86
+    if (crc32c_hardware()) return ~crc32c_hw(crc, p, len);
+#endif
+    return ~crc32c_soft(crc, p, len);
+}
+
+/**
+ * Multiplica um vetor por uma matriz sobre GF(2)
+ */
+static inline uint32_t crc32c_gf2_times(const uint32_t *matrix, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec != 0; vec >>= 1, matrix++) {
+        if (vec & 1) sum ^= *matrix;
+    }
+    return sum;
+}
+
+/**
+ * Eleva uma matriz ao quadrado sobre GF(2)
+ */
+static inline void crc32c_gf2_square(uint32_t *square, const uint32_t *matrix) {
+    for (int n = 0; n < 32; n++) square[n] = crc32c_gf2_times(matrix, matrix[n]);
+}
+
+/**
+ * Combina os CRCs de dois trechos consecutivos
+ *
+ * @param crc1 CRC do primeiro trecho
+ * @param crc2 CRC do segundo trecho
+ * @param len2 Tamanho do segundo trecho
+ * @return CRC dos dois trechos concatenados
+ *
+ * Por que foi feito:
+ * - Blocos de uma transferência paralela chegam fora de ordem e por
+ *   conexões diferentes; o CRC do arquivo inteiro sai dos CRCs dos
+ *   blocos, sem uma segunda leitura do arquivo
+ * - Mesmo método do zlib: o efeito de len2 bytes zero sobre o CRC é um
+ *   operador linear, aplicado por quadrados sucessivos (log2(len2) passos)
+ */
+static inline uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    uint32_t even[32], odd[32];
+    uint32_t row = 1;
+
+    if (len2 == 0) return crc1;
+
+    // Operador de um bit zero
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++, row <<= 1) odd[n] = row;
+    crc32c_gf2_square(even, odd);   // Dois bits zero
+    crc32c_gf2_square(odd, even);   // Quatro bits zero
+
+    // Aplica len2 bytes zero ao primeiro CRC
+    do {
+        crc32c_gf2_square(even, odd);
+        if (len2 & 1) crc1 = crc32c_gf2_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0) break;
+        crc32c_gf2_square(odd, even);
+        if (len2 & 1) crc1 = crc32c_gf2_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2 != 0);
+    return crc1 ^ crc2;
+}
+
+/*--------------------------------------------------------------
+ * XXH64
+ *------------------------------------------------------------*/
+#define XXH_PRIME64_1 0x9e3779b185ebca87ull
+#define XXH_PRIME64_2 0xc2b2ae3d27d4eb4full
+#define XXH_PRIME64_3 0x165667b19e3779f9ull
+#define XXH_PRIME64_4 0x85ebca77c2b2ae63ull
+#define XXH_PRIME64_5 0x27d4eb2f165667c5ull
+
+/**
+ * Estado de um cálculo XXH64 em andamento
+ */
+typedef struct {
+    uint64_t v[4];              // Acumuladores das quatro faixas
+    uint64_t length;            // Bytes processados
+    uint8_t block[32];          // Bloco parcial ainda não processado
+    size_t used;
+} xxh64_t;
+
+static inline uint64_t xxh64_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh64_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t xxh64_read32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return xxh64_rotl(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/**
+ * Inicia um cálculo XXH64 (semente 0)
+ */
+static inline void xxh64_init(xxh64_t *ctx) {
+    ctx->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    ctx->v[1] = XXH_PRIME64_2;
+    ctx->v[2] = 0;
+    ctx->v[3] = 0 - XXH_PRIME64_1;
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+/**
+ * Processa blocos inteiros de 32 bytes
+ *
+ * Por que foi feito:
+ * - As quatro faixas são independentes, então a CPU executa as quatro
+ *   multiplicações de cada bloco em paralelo
+ */
+static inline void xxh64_blocks(xxh64_t *ctx, const uint8_t *p, size_t blocks) {
+    uint64_t v0 = ctx->v[0], v1 = ctx->v[1], v2 = ctx->v[2], v3 = ctx->v[3];
+    for (; blocks > 0; blocks--, p += 32) {
+        v0 = xxh64_round(v0, xxh64_read64(p));
+        v1 = xxh64_round(v1, xxh64_read64(p + 8));
+        v2 = xxh64_round(v2, xxh64_read64(p + 16));
+        v3 = xxh64_round(v3, xxh64_read64(p + 24));
+    }
+    ctx->v[0] = v0;
+    ctx->v[1] = v1;
+    ctx->v[2] = v2;
+    ctx->v[3] = v3;
+}
+
+/**
+ * Acrescenta bytes ao cálculo
+ */
+static inline void xxh64_update(xxh64_t *ctx, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+
+    ctx->length += len;
+    if (ctx->used > 0) {
+        size_t take = 32 - ctx->used < len ? 32 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        len -= take;
+        if (ctx->used < 32) return;
+        xxh64_blocks(ctx, ctx->block, 1);
+        ctx->used = 0;
+    }
+    xxh64_blocks(ctx, p, len / 32);
+    p += len / 32 * 32;
+    len -= len / 32 * 32;
+    memcpy(ctx->block, p, len);
+    ctx->used = len;
+}
+
+/**
+ * Conclui o cálculo (o estado não é alterado)
+ */
+static inline uint64_t xxh64_final(const xxh64_t *ctx) {
+    const uint8_t *p = ctx->block, *end = ctx->block + ctx->used;
+    uint64_t h;
+
+    if (ctx->length >= 32) {
+        h = xxh64_rotl(ctx->v[0], 1) + xxh64_rotl(ctx->v[1], 7) +
+            xxh64_rotl(ctx->v[2], 12) + xxh64_rotl(ctx->v[3], 18);
+        for (int i = 0; i < 4; i++) h = xxh64_merge(h, ctx->v[i]);
+    } else {
+        h = XXH_PRIME64_5;      // Semente 0
+    }
+    h += ctx->length;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, xxh64_read64(p));
+        h = xxh64_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxh64_read32(p) * XXH_PRIME64_1;
+        h = xxh64_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME64_5;
+        h = xxh64_rotl(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*--------------------------------------------------------------
+ * RESUMO DE TRANSFERÊNCIA (CRC32C + XXH64)
+ *------------------------------------------------------------*/
+
+/**
+ * Resumo calculado enquanto os bytes de uma transferência passam
+ */
+typedef struct {
+    uint32_t crc;
+    xxh64_t xxh;
+} checksum_t;
+
+/**
+ * Inicia um resumo vazio
+ */
+static inline void checksum_init(checksum_t *c) {
+    c->crc = 0;
+    xxh64_init(&c->xxh);
+}
+
+#ifdef CRC32C_HW_X86
+/**
+ * CRC32C e XXH64 de blocos inteiros de 32 bytes numa só passada
+ *
+ * @param crc CRC em andamento (sem a inversão final)
+ * @return CRC atualizado (sem a inversão final)
+ *
+ * Por que foi feito:
+ * - Cada palavra é lida da memória uma vez só, e as duas cadeias de
+ *   dependência (crc32 e multiplicações do XXH64) ocupam unidades
+ *   diferentes da CPU; juntas custam pouco mais que a mais lenta delas
+ */
+__attribute__((target("sse4.2")))
+static inline uint32_t checksum_fused_hw(uint32_t crc, xxh64_t *x, const uint8_t *p, size_t blocks) {
+    uint64_t c = crc;
+    uint64_t v0 = x->v[0], v1 = x->v[1], v2 = x->v[2], v3 = x->v[3];
+
+    for (; blocks > 0; blocks--, p += 32) {
+        uint64_t w0 = xxh64_read64(p), w1 = xxh64_read64(p + 8);
+        uint64_t w2 = xxh64_read64(p + 16), w3 = xxh64_read64(p + 24);
+        c = _mm_crc32_u64(c, w0);
+        v0 = xxh64_round(v0, w0);
+        c = _mm_crc32_u64(c, w1);
+        v1 = xxh64_round(v1, w1);
+        c = _mm_crc32_u64(c, w2);
+        v2 = xxh64_round(v2, w2);
+        c = _mm_crc32_u64(c, w3);
+        v3 = xxh64_round(v3, w3);
+    }
+    x->v[0] = v0;
+    x->v[1] = v1;
+    x->v[2] = v2;
+    x->v[3] = v3;
+    return (uint32_t)c;
+}
+#endif
+
+/**
+ * Acrescenta bytes ao resumo
+ */
+static inline void checksum_update(checksum_t *c, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+
+#if defined(CRC32C_HW_X86) && (!defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    if (len >= 256 && crc32c_hardware()) {
+        // Completa o bloco parcial do XXH64 e segue em blocos inteiros
+        size_t head = c->xxh.used > 0 ? 32 - c->xxh.used : 0;
+        c->crc = crc32c(c->crc, p, head);
+        xxh64_update(&c->xxh, p, head);
+        p += head;
+        len -= head;
+
+        size_t blocks = len / 32;
+        c->crc = ~checksum_fused_hw(~c->crc, &c->xxh, p, blocks);
+        c->xxh.length += blocks * 32;
+        p += blocks * 32;
+        len -= blocks * 32;
+    }
+#endif
+    c->crc = crc32c(c->crc, p, len);
+    xxh64_update(&c->xxh, p, len);
+}
+
+/**
+ * Serializa CRC32C e XXH64 em big-endian
+ *
+ * @param out Buffer com CHECKSUM_SIZE bytes
+ */
+static inline void checksum_encode(uint8_t *out, uint32_t crc, uint64_t xxh) {
+    for (int i = 0; i < 4; i++) out[i] = (uint8_t)(crc >> (24 - 8 * i));
+    for (int i = 0; i < 8; i++) out[4 + i] = (uint8_t)(xxh >> (56 - 8 * i));
+}
+
+/**
+ * Conclui o resumo (o estado não é alterado)
+ *
+ * @param out Recebe CHECKSUM_SIZE bytes
+ */
+static inline void checksum_final(const checksum_t *c, uint8_t *out) {
+    checksum_encode(out, c->crc, xxh64_final(&c->xxh));
+}
+
+/**
+ * Lê o CRC32C de um resumo serializado
+ */
+static inline uint32_t checksum_crc(const uint8_t *digest) {
+    return ((uint32_t)digest[0] << 24) | ((uint32_t)digest[1] << 16) | ((uint32_t)digest[2] << 8) | digest[3];
+}
+
+/**
+ * Lê o XXH64 de um resumo serializado com CHECKSUM_SIZE bytes
+ */
+static inline uint64_t checksum_xxh(const uint8_t *digest) {
+    uint64_t v = 0;
+    for (int i = 4; i < CHECKSUM_SIZE; i++) v = (v << 8) | digest[i];
+    return v;
+}
+
+/*--------------------------------------------------------------
+ * FORMATAÇÃO
+ *------------------------------------------------------------*/
+
+/**
+ * Converte um resumo em texto hexadecimal
+ *
+ * @param out Buffer com pelo menos 2 * len + 1 bytes
+ */
+static inline void digest_hex(const uint8_t *digest, size_t len, char *out) {
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        out[i * 2] = hex[digest[i] >> 4];
+        out[i * 2 + 1] = hex[digest[i] & 15];
+    }
+    out[len * 2] = '\0';
+}
+
+#endif /* BIGFS_DIGEST_H */
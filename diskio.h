@@ -0,0 +1,842 @@
+/*******************************************************************************
+ * ESTÁGIO DE E/S EM DISCO
+ *
+ * Descrição: Separa o acesso ao disco do atendimento da rede. Threads de
+ *            disco executam leituras, escritas e operações de conclusão
+ *            enquanto as threads trabalhadoras continuam atendendo sockets.
+ *
+ * Componentes:
+ * - disk_pool_t:   fila de tarefas atendida por threads dedicadas ao disco,
+ *                  com orçamento de memória aguardando escrita
+ * - file_writer_t: anel de buffers grandes e alinhados de um arquivo em
+ *                  gravação; buffers cheios vão para o disco com pwritev()
+ *                  enquanto o próximo buffer é preenchido
+ * - file_reader_t: anel de leitura antecipada de um arquivo em envio; as
+ *                  threads de disco enchem os buffers à frente da rede
+ * - disk_call_t:   uma função executada na thread de disco, com o resultado
+ *                  devolvido ao dono (renomear, sincronizar, reconstruir)
+ *
+ * Fluxo de um arquivo recebido:
+ *
+ *   rede -> writer_write() -> [buffer cheio] -> disk_pool -> pwritev()
+ *                ^                                              |
+ *                +------------- buffer livre de novo <----------+
+ *
+ * Fluxo de um arquivo enviado pela memória (comprimido ou modo buffer):
+ *
+ *   disk_pool -> fill() -> [buffer pronto] -> reader_next() -> rede
+ *       ^                                           |
+ *       +------------ reader_consume() <------------+
+ *
+ * Cada objeto (writer, reader, call) tem no máximo uma tarefa na fila, então
+ * a fila cresce no máximo com o número de sessões. Um disco lento recebe
+ * escritas maiores em vez de uma fila crescente. Quando todos os buffers de
+ * um arquivo estão cheios, ou a soma dos buffers cheios de todos os arquivos
+ * passa do orçamento do pool, o dono para de ler da rede e é acordado
+ * (callback wake) quando a sua escrita termina.
+ ******************************************************************************/
+#ifndef BIGFS_DISKIO_H
+#define BIGFS_DISKIO_H
+
+#include "platform.h"
+#include "bufpool.h"
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define WRITER_BUFFERS 4                    // Buffers no anel de cada arquivo
+#define WRITER_BUFFER_SIZE (1024 * 1024)    // Tamanho de cada buffer
+#define READER_BUFFERS 4                    // Buffers lidos à frente em cada envio
+#define DISK_BUDGET_DEFAULT (64L * 1024 * 1024) // Bytes cheios aguardando o disco (todos os arquivos)
+
+/*--------------------------------------------------------------
+ * FILA DE TAREFAS DE DISCO
+ *------------------------------------------------------------*/
+
+/**
+ * Tarefa executada por uma thread de disco
+ */
+typedef struct disk_job {
+    void (*run)(struct disk_job *job);      // Executa a tarefa (na thread de disco)
+    struct disk_job *next;
+} disk_job_t;
+
+/**
+ * Conjunto de threads que executam as tarefas de disco
+ */
+typedef struct {
+    mutex_t lock;
+    cond_t ready;
+    disk_job_t *head, *tail;
+    long depth;                     // Tarefas na fila
+    long peak;                      // Maior profundidade já vista
+    long completed;                 // Tarefas executadas
+    uint64_t busy_ns;               // Tempo das threads de disco executando tarefas
+
+    volatile long pending;          // Bytes em buffers cheios esperando escrita
+    long budget;                    // Limite de "pending" antes de segurar a rede
+    volatile long throttled;        // Vezes que um upload parou pelo orçamento
+} disk_pool_t;
+
+/**
+ * Laço das threads de disco
+ */
+static inline void *disk_pool_main(void *arg) {
+    disk_pool_t *pool = (disk_pool_t *)arg;
+    uint64_t busy = 0;
+
+    while (1) {
+        mutex_lock(&pool->lock);
+        pool->busy_ns += busy;
+        while (pool->head == NULL) {
+            cond_wait(&pool->ready, &pool->lock);
+        }
+        disk_job_t *job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL) pool->tail = NULL;
+        pool->depth--;
+        pool->completed++;
+        mutex_unlock(&pool->lock);
+
+        uint64_t start = monotonic_ns();
+        job->run(job);
+        busy = monotonic_ns() - start;
+    }
+    return NULL;
+}
+
+/**
+ * Inicia as threads de disco
+ *
+ * @param budget Bytes em buffers cheios aceitos antes de segurar a rede
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+static inline int disk_pool_start(disk_pool_t *pool, int threads, long budget) {
+    mutex_init(&pool->lock);
+    cond_init(&pool->ready);
+    pool->head = pool->tail = NULL;
+    pool->depth = pool->peak = pool->completed = 0;
+    pool->busy_ns = 0;
+    pool->pending = pool->throttled = 0;
+    pool->budget = budget;
+
+    for (int i = 0; i < threads; i++) {
+        thread_t thread;
+        if (thread_create(&thread, disk_pool_main, pool) != 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Entrega uma tarefa às threads de disco
+ */
+static inline void disk_pool_submit(disk_pool_t *pool, disk_job_t *job) {
+    mutex_lock(&pool->lock);
+    job->next = NULL;
+    if (pool->tail) pool->tail->next = job;
+    else pool->head = job;
+    pool->tail = job;
+    if (++pool->depth > pool->peak) pool->peak = pool->depth;
+    cond_signal(&pool->ready);
+    mutex_unlock(&pool->lock);
+}
+
+/**
+ * Indica se os buffers cheios de todos os arquivos passaram do orçamento
+ *
+ * Por que foi feito:
+ * - O anel limita a memória de um upload, mas não a de mil uploads
+ *   rápidos para o mesmo disco lento; acima do orçamento, quem já tem um
+ *   buffer na fila espera a própria escrita antes de encher outro
+ */
+static inline int disk_pool_over_budget(disk_pool_t *pool) {
+    return atomic_add_long(&pool->pending, 0) >= pool->budget;
+}
+
+/*--------------------------------------------------------------
+ * GRAVAÇÃO DE ARQUIVOS COM ANEL DE BUFFERS
+ *------------------------------------------------------------*/
+
+/**
+ * Estado da gravação de um arquivo
+ *
+ * Os buffers [head, head + count) estão cheios, na ordem do arquivo; os
+ * primeiros "inflight" deles pertencem à escrita em andamento. O buffer
+ * (head + count) % WRITER_BUFFERS é o que está sendo preenchido.
+ */
+typedef struct {
+    disk_job_t job;                 // Escrita em andamento (deve ser o primeiro campo)
+    disk_pool_t *pool;
+    mutex_t lock;
+    cond_t idle;                    // Sinalizado quando a escrita em andamento termina
+    int fd;
+
+    char *buffers[WRITER_BUFFERS];  // Do pool de buffers enquanto há um arquivo aberto
+    buf_account_t *account;         // Dono cobrado pelos buffers
+    size_t lengths[WRITER_BUFFERS];
+    int head, count, inflight;
+    int busy;                       // Há uma tarefa na fila ou em execução
+    uint64_t offset;                // Posição no arquivo do buffer "head"
+    io_vec_t iov[WRITER_BUFFERS];   // Trechos da escrita em andamento
+    int iov_count;
+
+    int finishing;                  // O dono não vai mais escrever
+    int sync_pending;               // A escrita em andamento termina com file_sync()
+    int defer_sync;                 // O dono sincroniza depois (confirmação em grupo)
+    int synced;                     // Todos os dados chegaram ao disco
+    int failed;                     // Uma escrita falhou; o restante é descartado
+
+    int waiting;                    // O dono parou esperando uma escrita terminar
+    void (*wake)(void *owner);      // Chamado (fora do lock) ao liberar o dono
+    void *owner;
+} file_writer_t;
+
+/**
+ * Inicializa o estado de gravação (uma vez por dono)
+ */
+static inline void writer_init(file_writer_t *w, disk_pool_t *pool, buf_account_t *account,
+                               void (*wake)(void *), void *owner) {
+    memset(w, 0, sizeof(*w));
+    mutex_init(&w->lock);
+    cond_init(&w->idle);
+    w->pool = pool;
+    w->account = account;
+    w->wake = wake;
+    w->owner = owner;
+    w->fd = -1;
+}
+
+/**
+ * Devolve os buffers do anel ao pool (nenhuma escrita em andamento)
+ *
+ * Por que foi feito:
+ * - Uma conexão parada entre uploads não segura os 4 MB do anel
+ */
+static inline void writer_release(file_writer_t *w) {
+    for (int i = 0; i < WRITER_BUFFERS; i++) {
+        bufpool_free(w->buffers[i], WRITER_BUFFER_SIZE, w->account);
+        w->buffers[i] = NULL;
+        w->lengths[i] = 0;
+    }
+}
+
+/**
+ * Libera os buffers do anel (o arquivo já deve ter sido fechado)
+ */
+static inline void writer_destroy(file_writer_t *w) {
+    writer_release(w);
+    mutex_destroy(&w->lock);
+    cond_destroy(&w->idle);
+}
+
+/**
+ * Submete a próxima escrita se nenhuma estiver em andamento
+ *
+ * Deve ser chamada com w->lock adquirido.
+ *
+ * Por que foi feito:
+ * - Todos os buffers cheios seguem juntos em um único pwritev(); o
+ *   sync final vai na mesma tarefa quando ela esvazia o anel
+ */
+static inline void writer_submit_locked(file_writer_t *w) {
+    if (w->busy || w->failed) return;
+    if (w->count == 0 && !(w->finishing && !w->synced)) return;
+
+    w->iov_count = 0;
+    for (int i = 0; i < w->count; i++) {
+        int index = (w->head + i) % WRITER_BUFFERS;
+        w->iov[i].iov_base = w->buffers[index];
+        w->iov[i].iov_len = w->lengths[index];
+        w->iov_count++;
+    }
+    w->inflight = w->count;
+    w->sync_pending = w->finishing;
+    w->busy = 1;
+    disk_pool_submit(w->pool, &w->job);
+}
+
+/**
+ * Executa a escrita em andamento (na thread de disco)
+ */
+static inline void writer_run(disk_job_t *job) {
+    file_writer_t *w = (file_writer_t *)job;
+    uint64_t written = 0;
+    int failed = 0;
+
+    // Os buffers em gravação não são tocados pelo dono: dispensa o lock
+    for (int i = 0; i < w->iov_count; i++) written += w->iov[i].iov_len;
+    if (w->iov_count > 0 && file_pwritev(w->fd, w->iov, w->iov_count, w->offset) != 0) failed = 1;
+    if (!failed && w->sync_pending && !w->defer_sync && file_sync(w->fd) != 0) failed = 1;
+
+    atomic_add_long(&w->pool->pending, -(long)written);
+    mutex_lock(&w->lock);
+    for (int i = 0; i < w->inflight; i++) {
+        w->lengths[(w->head + i) % WRITER_BUFFERS] = 0;  // Buffer livre de novo
+    }
+    w->head = (w->head + w->inflight) % WRITER_BUFFERS;
+    w->count -= w->inflight;
+    w->inflight = 0;
+    w->offset += written;
+    w->busy = 0;
+    if (failed) w->failed = 1;
+    else if (w->sync_pending && w->count == 0) w->synced = 1;
+    w->sync_pending = 0;
+
+    writer_submit_locked(w);
+
+    int wake = w->waiting;
+    w->waiting = 0;
+    cond_broadcast(&w->idle);
+    mutex_unlock(&w->lock);
+
+    if (wake) w->wake(w->owner);
+}
+
+/**
+ * Começa a gravar um novo arquivo
+ *
+ * @param fd Descritor aberto para escrita (continua pertencendo ao dono)
+ * @param offset Posição do arquivo onde o primeiro byte será gravado
+ * @return 0 em caso de sucesso, -1 se os buffers não puderam ser obtidos
+ *         (limite de memória da conexão ou do servidor)
+ */
+static inline int writer_open(file_writer_t *w, int fd, uint64_t offset) {
+    for (int i = 0; i < WRITER_BUFFERS; i++) {
+        if (w->buffers[i] == NULL) {
+            w->buffers[i] = (char *)bufpool_alloc(WRITER_BUFFER_SIZE, w->account);
+            if (w->buffers[i] == NULL) {
+                writer_release(w);
+                return -1;
+            }
+        }
+        w->lengths[i] = 0;
+    }
+    w->job.run = writer_run;
+    w->fd = fd;
+    w->head = w->count = w->inflight = 0;
+    w->busy = w->finishing = w->sync_pending = w->defer_sync = w->synced = w->failed = w->waiting = 0;
+    w->offset = offset;
+    return 0;
+}
+
+/**
+ * Dispensa o file_sync() do fim da gravação aberta (depois de writer_open)
+ *
+ * Por que foi feito:
+ * - Objetos pequenos gravados num segmento compartilhado são
+ *   sincronizados juntos pelo armazenamento (segstore.h), um
+ *   fdatasync() para vários uploads em vez de um para cada
+ */
+static inline void writer_defer_sync(file_writer_t *w) {
+    w->defer_sync = 1;
+}
+
+/**
+ * Indica se o dono deve parar de encher buffers
+ *
+ * Deve ser chamada com w->lock adquirido.
+ *
+ * Por que foi feito:
+ * - Acima do orçamento do pool só para quem já tem escrita na fila; o
+ *   dono é acordado quando ela termina, então nenhum upload fica parado
+ *   esperando a escrita de outro
+ */
+static inline int writer_full_locked(file_writer_t *w) {
+    if (w->count == WRITER_BUFFERS) return 1;
+    if (w->count > 0 && disk_pool_over_budget(w->pool)) {
+        atomic_add_long(&w->pool->throttled, 1);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Marca o buffer em preenchimento como cheio e o entrega ao disco
+ *
+ * Deve ser chamada com w->lock adquirido.
+ */
+static inline void writer_seal_locked(file_writer_t *w, int index) {
+    atomic_add_long(&w->pool->pending, (long)w->lengths[index]);
+    w->count++;
+    writer_submit_locked(w);
+}
+
+/**
+ * Copia bytes recebidos para o anel de buffers
+ *
+ * @return Bytes aceitos; menos que len quando todos os buffers estão
+ *         cheios ou o pool passou do orçamento (o dono deve parar de ler
+ *         e chamar writer_park())
+ *
+ * Por que foi feito:
+ * - A rede entrega blocos pequenos; o disco recebe escritas de vários MB
+ * - O buffer em preenchimento não está na escrita em andamento, então a
+ *   cópia acontece sem o lock
+ */
+static inline size_t writer_write(file_writer_t *w, const void *data, size_t len) {
+    size_t accepted = 0;
+
+    while (accepted < len) {
+        mutex_lock(&w->lock);
+        int full = writer_full_locked(w);
+        int failed = w->failed;
+        int index = (w->head + w->count) % WRITER_BUFFERS;
+        mutex_unlock(&w->lock);
+
+        if (failed) return len;  // Gravação já falhou: descarta o restante
+        if (full) break;
+
+        size_t room = WRITER_BUFFER_SIZE - w->lengths[index];
+        size_t n = len - accepted < room ? len - accepted : room;
+        memcpy(w->buffers[index] + w->lengths[index], (const char *)data + accepted, n);
+        w->lengths[index] += n;
+        accepted += n;
+
+        if (w->lengths[index] == WRITER_BUFFER_SIZE) {
+            mutex_lock(&w->lock);
+            writer_seal_locked(w, index);
+            mutex_unlock(&w->lock);
+        }
+    }
+    return accepted;
+}
+
+/**
+ * Obtém o espaço livre do buffer em preenchimento para receber direto nele
+ *
+ * @param room Recebe quantos bytes cabem no buffer
+ * @return Início do espaço livre, ou NULL se o dono deve esperar o disco
+ *         (como em writer_write()) ou a gravação falhou
+ */
+static inline char *writer_reserve(file_writer_t *w, size_t *room) {
+    mutex_lock(&w->lock);
+    int unavailable = writer_full_locked(w) || w->failed;
+    int index = (w->head + w->count) % WRITER_BUFFERS;
+    mutex_unlock(&w->lock);
+
+    if (unavailable) return NULL;
+    *room = WRITER_BUFFER_SIZE - w->lengths[index];
+    return w->buffers[index] + w->lengths[index];
+}
+
+/**
+ * Confirma bytes gravados no espaço obtido com writer_reserve()
+ */
+static inline void writer_commit(file_writer_t *w, size_t len) {
+    mutex_lock(&w->lock);
+    int index = (w->head + w->count) % WRITER_BUFFERS;
+    w->lengths[index] += len;
+    if (w->lengths[index] == WRITER_BUFFER_SIZE) writer_seal_locked(w, index);
+    mutex_unlock(&w->lock);
+}
+
+/**
+ * Encerra a escrita: grava o buffer parcial e sincroniza o arquivo
+ *
+ * Por que foi feito:
+ * - O arquivo só pode ser renomeado para o nome final depois que todos os
+ *   bytes estão no disco; do contrário uma queda de energia logo após a
+ *   troca deixaria um arquivo completo no nome, mas vazio no conteúdo
+ */
+static inline void writer_finish(file_writer_t *w) {
+    mutex_lock(&w->lock);
+    int index = (w->head + w->count) % WRITER_BUFFERS;
+    w->finishing = 1;
+    if (w->lengths[index] > 0 && w->count < WRITER_BUFFERS) writer_seal_locked(w, index);
+    else writer_submit_locked(w);
+    mutex_unlock(&w->lock);
+}
+
+/**
+ * Indica se a gravação terminou
+ *
+ * @return 1 se todos os dados foram gravados e sincronizados, 0 se ainda
+ *         há escrita pendente, -1 se alguma escrita falhou
+ */
+static inline int writer_done(file_writer_t *w) {
+    mutex_lock(&w->lock);
+    int result = w->failed ? -1 : (w->synced && w->count == 0 && !w->busy) ? 1 : 0;
+    mutex_unlock(&w->lock);
+    return result;
+}
+
+/**
+ * Registra que o dono vai esperar a escrita em andamento
+ *
+ * @return 1 se há escrita em andamento (o dono será acordado por wake()),
+ *         0 se não há nada a esperar e o dono deve tentar de novo
+ *
+ * Por que foi feito:
+ * - A verificação e o registro acontecem sob o mesmo lock que a conclusão
+ *   da escrita usa, então o dono nunca perde o aviso de término
+ */
+static inline int writer_park(file_writer_t *w) {
+    mutex_lock(&w->lock);
+    int parked = w->busy;
+    if (parked) w->waiting = 1;
+    mutex_unlock(&w->lock);
+    return parked;
+}
+
+/**
+ * Espera a escrita em andamento terminar e descarta o restante
+ *
+ * Por que foi feito:
+ * - Antes de fechar o arquivo de uma transferência interrompida, nenhuma
+ *   thread de disco pode estar usando o descritor ou os buffers
+ */
+static inline void writer_abort(file_writer_t *w) {
+    mutex_lock(&w->lock);
+    w->failed = 1;
+    w->waiting = 0;
+    while (w->busy) {
+        cond_wait(&w->idle, &w->lock);
+    }
+    for (int i = 0; i < w->count; i++) {
+        atomic_add_long(&w->pool->pending, -(long)w->lengths[(w->head + i) % WRITER_BUFFERS]);
+    }
+    w->count = 0;
+    mutex_unlock(&w->lock);
+    writer_release(w);
+}
+
+/**
+ * Prepara o anel para o próximo arquivo depois de uma gravação concluída
+ */
+static inline void writer_reset(file_writer_t *w) {
+    writer_release(w);
+    w->fd = -1;
+}
+
+/*--------------------------------------------------------------
+ * LEITURA ANTECIPADA DE ARQUIVOS EM ENVIO
+ *------------------------------------------------------------*/
+
+/**
+ * Estado da leitura antecipada de um arquivo
+ *
+ * Os buffers [head, head + count) já foram lidos, na ordem do arquivo; o
+ * buffer (head + count) % READER_BUFFERS é o próximo a ser lido.
+ */
+typedef struct {
+    disk_job_t job;                 // Leitura em andamento (deve ser o primeiro campo)
+    disk_pool_t *pool;
+    mutex_t lock;
+    cond_t idle;                    // Sinalizado quando a leitura em andamento termina
+
+    // Lê os próximos len bytes do arquivo (na thread de disco); 0 ou -1
+    int (*fill)(void *owner, uint8_t *buf, size_t len);
+
+    uint8_t *buffers[READER_BUFFERS]; // Do pool de buffers enquanto há um envio aberto
+    buf_account_t *account;         // Dono cobrado pelos buffers
+    size_t lengths[READER_BUFFERS];
+    size_t block;                   // Bytes lidos por buffer
+    int head, count;
+    int busy;                       // Há uma tarefa na fila ou em execução
+    uint64_t remaining;             // Bytes do envio ainda não lidos
+    int failed;                     // Uma leitura falhou; o envio não termina
+
+    int waiting;                    // O dono parou esperando uma leitura terminar
+    void (*wake)(void *owner);      // Chamado (fora do lock) ao liberar o dono
+    void *owner;
+} file_reader_t;
+
+/**
+ * Inicializa o estado de leitura (uma vez por dono)
+ */
+static inline void reader_init(file_reader_t *r, disk_pool_t *pool, buf_account_t *account,
+                               int (*fill)(void *, uint8_t *, size_t), void (*wake)(void *), void *owner) {
+    memset(r, 0, sizeof(*r));
+    mutex_init(&r->lock);
+    cond_init(&r->idle);
+    r->pool = pool;
+    r->account = account;
+    r->fill = fill;
+    r->wake = wake;
+    r->owner = owner;
+}
+
+/**
+ * Devolve os buffers do anel ao pool (nenhuma leitura em andamento)
+ */
+static inline void reader_release(file_reader_t *r) {
+    for (int i = 0; i < READER_BUFFERS; i++) {
+        bufpool_free(r->buffers[i], r->block, r->account);
+        r->buffers[i] = NULL;
+    }
+}
+
+/**
+ * Libera os buffers do anel (nenhuma leitura pode estar em andamento)
+ */
+static inline void reader_destroy(file_reader_t *r) {
+    reader_release(r);
+    mutex_destroy(&r->lock);
+    cond_destroy(&r->idle);
+}
+
+/**
+ * Submete a próxima leitura se há buffer livre e nenhuma em andamento
+ *
+ * Deve ser chamada com r->lock adquirido.
+ *
+ * Por que foi feito:
+ * - Uma leitura por tarefa: vários envios compartilham as threads de
+ *   disco em vez de um arquivo grande ocupar uma delas até o fim
+ */
+static inline void reader_submit_locked(file_reader_t *r) {
+    if (r->busy || r->failed || r->remaining == 0 || r->count == READER_BUFFERS) return;
+    r->busy = 1;
+    disk_pool_submit(r->pool, &r->job);
+}
+
+/**
+ * Executa a leitura em andamento (na thread de disco)
+ */
+static inline void reader_run(disk_job_t *job) {
+    file_reader_t *r = (file_reader_t *)job;
+
+    mutex_lock(&r->lock);
+    int index = (r->head + r->count) % READER_BUFFERS;
+    size_t len = r->remaining < r->block ? (size_t)r->remaining : r->block;
+    mutex_unlock(&r->lock);
+
+    // O buffer em leitura não é tocado pelo dono: a leitura dispensa o lock
+    int failed = r->fill(r->owner, r->buffers[index], len) != 0;
+
+    mutex_lock(&r->lock);
+    if (failed) {
+        r->failed = 1;
+    } else {
+        r->lengths[index] = len;
+        r->count++;
+        r->remaining -= len;
+    }
+    r->busy = 0;
+    reader_submit_locked(r);
+
+    int wake = r->waiting;
+    r->waiting = 0;
+    cond_broadcast(&r->idle);
+    mutex_unlock(&r->lock);
+
+    if (wake) r->wake(r->owner);
+}
+
+/**
+ * Começa a ler um envio à frente da rede
+ *
+ * @param total Bytes a enviar a partir da posição atual de fill()
+ * @param block Bytes por buffer (o dono consome um buffer por quadro)
+ * @return 0 em caso de sucesso, -1 se os buffers não puderam ser obtidos
+ *         (limite de memória da conexão ou do servidor)
+ */
+static inline int reader_open(file_reader_t *r, uint64_t total, size_t block) {
+    reader_release(r);
+    r->block = block;
+    for (int i = 0; i < READER_BUFFERS; i++) {
+        if ((r->buffers[i] = (uint8_t *)bufpool_alloc(block, r->account)) == NULL) {
+            reader_release(r);
+            return -1;
+        }
+        r->lengths[i] = 0;
+    }
+    r->job.run = reader_run;
+    r->head = r->count = 0;
+    r->busy = r->failed = r->waiting = 0;
+    r->remaining = total;
+
+    mutex_lock(&r->lock);
+    reader_submit_locked(r);
+    mutex_unlock(&r->lock);
+    return 0;
+}
+
+/**
+ * Obtém o próximo buffer lido
+ *
+ * @param data Recebe o início dos bytes
+ * @param len Recebe quantos bytes o buffer tem
+ * @return 1 se há um buffer pronto, 0 se a leitura ainda não terminou
+ *         (o dono deve chamar reader_park()), -1 se uma leitura falhou
+ */
+static inline int reader_next(file_reader_t *r, const uint8_t **data, size_t *len) {
+    mutex_lock(&r->lock);
+    int result = r->count > 0 ? 1 : r->failed ? -1 : 0;
+    int index = r->head;
+    mutex_unlock(&r->lock);
+
+    if (result > 0) {
+        *data = r->buffers[index];
+        *len = r->lengths[index];
+    }
+    return result;
+}
+
+/**
+ * Devolve o buffer obtido com reader_next() para a próxima leitura
+ */
+static inline void reader_consume(file_reader_t *r) {
+    mutex_lock(&r->lock);
+    r->head = (r->head + 1) % READER_BUFFERS;
+    r->count--;
+    reader_submit_locked(r);
+    mutex_unlock(&r->lock);
+}
+
+/**
+ * Registra que o dono vai esperar a leitura em andamento
+ *
+ * @return 1 se há leitura em andamento (o dono será acordado por wake()),
+ *         0 se não há nada a esperar e o dono deve tentar de novo
+ */
+static inline int reader_park(file_reader_t *r) {
+    mutex_lock(&r->lock);
+    int parked = r->busy;
+    if (parked) r->waiting = 1;
+    mutex_unlock(&r->lock);
+    return parked;
+}
+
+/**
+ * Interrompe a leitura antecipada e espera a leitura em andamento
+ *
+ * Por que foi feito:
+ * - Antes de fechar o arquivo de um envio, nenhuma thread de disco pode
+ *   estar lendo dele nem usando o estado do dono em fill()
+ */
+static inline void reader_abort(file_reader_t *r) {
+    mutex_lock(&r->lock);
+    r->remaining = 0;
+    r->waiting = 0;
+    while (r->busy) {
+        cond_wait(&r->idle, &r->lock);
+    }
+    r->count = 0;
+    mutex_unlock(&r->lock);
+    reader_release(r);
+}
+
+/*--------------------------------------------------------------
+ * OPERAÇÕES AVULSAS NA THREAD DE DISCO
+ *------------------------------------------------------------*/
+
+/**
+ * Uma função do dono executada por uma thread de disco
+ */
+typedef struct {
+    disk_job_t job;                 // Tarefa (deve ser o primeiro campo)
+    disk_pool_t *pool;
+    mutex_t lock;
+    cond_t idle;                    // Sinalizado quando a função termina
+    int (*fn)(void *arg);
+    void *arg;
+    int pending;                    // Na fila ou em execução
+    int done;                       // Terminou; o resultado ainda não foi lido
+    int result;
+
+    int waiting;                    // O dono parou esperando a função terminar
+    void (*wake)(void *owner);      // Chamado (fora do lock) ao liberar o dono
+    void *owner;
+} disk_call_t;
+
+/**
+ * Executa a função (na thread de disco)
+ */
+static inline void disk_call_run(disk_job_t *job) {
+    disk_call_t *c = (disk_call_t *)job;
+    int result = c->fn(c->arg);
+
+    mutex_lock(&c->lock);
+    c->result = result;
+    c->pending = 0;
+    c->done = 1;
+    int wake = c->waiting;
+    c->waiting = 0;
+    cond_broadcast(&c->idle);
+    mutex_unlock(&c->lock);
+
+    if (wake) c->wake(c->owner);
+}
+
+/**
+ * Inicializa o estado da operação (uma vez por dono)
+ */
+static inline void disk_call_init(disk_call_t *c, disk_pool_t *pool, void (*wake)(void *), void *owner) {
+    memset(c, 0, sizeof(*c));
+    mutex_init(&c->lock);
+    cond_init(&c->idle);
+    c->job.run = disk_call_run;
+    c->pool = pool;
+    c->wake = wake;
+    c->owner = owner;
+}
+
+/**
+ * Libera o estado (nenhuma operação pode estar em andamento)
+ */
+static inline void disk_call_destroy(disk_call_t *c) {
+    mutex_destroy(&c->lock);
+    cond_destroy(&c->idle);
+}
+
+/**
+ * Entrega a função às threads de disco
+ *
+ * Por que foi feito:
+ * - Trocas de nome, fsync e reconstruções inteiras de arquivos levam de
+ *   milissegundos a segundos em um disco ocupado; na thread trabalhadora
+ *   elas parariam todas as sessões atendidas por ela
+ */
+static inline void disk_call_submit(disk_call_t *c, int (*fn)(void *), void *arg) {
+    c->fn = fn;
+    c->arg = arg;
+    c->pending = 1;
+    c->done = 0;
+    disk_pool_submit(c->pool, &c->job);
+}
+
+/**
+ * Lê o resultado da função
+ *
+ * @param result Recebe o valor devolvido pela função
+ * @return 1 se a função terminou, 0 se ainda está na fila ou em execução
+ */
+static inline int disk_call_done(disk_call_t *c, int *result) {
+    mutex_lock(&c->lock);
+    int done = c->done;
+    if (done) {
+        *result = c->result;
+        c->done = 0;
+    }
+    mutex_unlock(&c->lock);
+    return done;
+}
+
+/**
+ * Registra que o dono vai esperar a função terminar
+ *
+ * @return 1 se a função está pendente (o dono será acordado por wake()),
+ *         0 se não há nada a esperar
+ */
+static inline int disk_call_park(disk_call_t *c) {
+    mutex_lock(&c->lock);
+    int parked = c->pending;
+    if (parked) c->waiting = 1;
+    mutex_unlock(&c->lock);
+    return parked;
+}
+
+/**
+ * Espera a função pendente terminar (sem acordar o dono)
+ */
+static inline void disk_call_wait(disk_call_t *c) {
+    mutex_lock(&c->lock);
+    c->waiting = 0;
+    while (c->pending) {
+        cond_wait(&c->idle, &c->lock);
+    }
+    mutex_unlock(&c->lock);
+}
+
+#endif /* BIGFS_DISKIO_H */
@@ -0,0 +1,871 @@
+/*******************************************************************************
+ * ÍNDICE EM MEMÓRIA DO ARMAZENAMENTO
+ *
+ * Descrição: Mantém em RAM os metadados de todos os arquivos do diretório de
+ *            armazenamento (tamanho, data de modificação, inode e hash do
+ *            conteúdo), de modo que listagens e consultas não percorrem nem
+ *            consultam o disco.
+ *
+ * Estrutura:
+ * - index_entry_t: metadados de um arquivo, em um vetor contíguo (a remoção
+ *                  move a última entrada para a posição liberada)
+ * - index_slot_t:  tabela hash de endereçamento aberto com sondagem linear;
+ *                  cada slot tem 8 bytes (hash de 32 bits do nome + posição
+ *                  da entrada), então a sondagem percorre memória contígua e
+ *                  só compara o nome quando o hash coincide
+ * - order:         posições das entradas em ordem de nome, para listagens
+ *                  paginadas; montada na primeira listagem e mantida depois
+ *                  a cada inserção e remoção (busca binária e deslocamento
+ *                  de um vetor de 4 bytes por entrada)
+ *
+ * Origens:
+ * - Um índice pode reunir mais de um diretório (ex.: arquivos comuns e
+ *   manifestos do armazenamento por conteúdo); cada entrada registra de
+ *   qual origem veio, e o tamanho pode ser lido por uma função da origem
+ * - Uma origem também pode não ter diretório (objetos guardados em
+ *   segmentos, segstore.h): ela informa os metadados de um nome e
+ *   percorre os seus nomes, e fica fora do inotify
+ *
+ * Subdiretórios:
+ * - Arquivos em subdiretórios são indexados pelo caminho relativo à
+ *   origem, com '/' entre as partes (o mesmo nome usado no protocolo)
+ *
+ * Atualização:
+ * - O servidor atualiza o índice depois de cada upload e exclusão
+ * - Cada nome atualizado ou removido é repassado a um observador opcional
+ *   (o cache de leitura descarta a cópia do arquivo)
+ * - No Linux, inotify informa mudanças feitas por fora do servidor (um
+ *   watch por diretório); nas demais plataformas o diretório é relido
+ *   periodicamente
+ * - A tabela pode vir pronta de um ponto de controle (journal.h); a
+ *   leitura do diretório então só confere o disco, em segundo plano
+ ******************************************************************************/
+#ifndef BIGFS_INDEX_H
+#define BIGFS_INDEX_H
+
+#include "platform.h"
+#include "protocol.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define INDEX_INITIAL_SLOTS 1024        // Slots da tabela vazia (potência de 2)
+#define INDEX_PATH_MAX 4096             // Caminho completo de um arquivo indexado
+#define INDEX_RESCAN_MS (30 * 1000)     // Releitura do diretório sem inotify
+#define INDEX_NONE ((size_t)-1)         // Nome ausente da tabela
+#define INDEX_MAX_SOURCES 2             // Diretórios reunidos em um índice
+#define INDEX_MAX_DEPTH 64              // Subdiretórios percorridos (evita ciclos de links)
+#ifdef __linux__
+#define INDEX_WATCH_EVENTS (IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE)
+#endif
+
+/**
+ * Metadados de um arquivo indexado
+ */
+typedef struct {
+    char *name;
+    uint32_t hash;                      // Hash do nome (usado ao crescer a tabela)
+    uint8_t source;                     // Diretório de origem (ordem de index_add_source)
+    uint8_t digest_len;                 // 0 se o hash do conteúdo não é conhecido
+    uint8_t digest[LIST_HASH_MAX];
+    uint64_t size;
+    int64_t mtime;
+    uint64_t inode;
+} index_entry_t;
+
+/**
+ * Slot da tabela hash
+ */
+typedef struct {
+    uint32_t hash;
+    uint32_t entry;                     // Posição da entrada + 1 (0 = slot vazio)
+} index_slot_t;
+
+/**
+ * Tabela de entradas (trocada inteira ao reler o diretório)
+ */
+typedef struct {
+    index_slot_t *slots;
+    size_t slot_mask;                   // Quantidade de slots - 1
+    index_entry_t *entries;
+    size_t count, cap;
+    size_t name_bytes;                  // Memória dos nomes (com '\0')
+    uint32_t *order;                    // Posições em ordem de nome (NULL: ainda não montada)
+    size_t order_cap;
+} index_table_t;
+
+/**
+ * Recebe cada nome de uma origem sem diretório
+ */
+typedef void (*index_visit_fn)(void *arg, const char *name, uint64_t size, int64_t mtime, uint64_t inode);
+
+/**
+ * Diretório reunido no índice
+ */
+typedef struct {
+    char dir[INDEX_PATH_MAX];
+    int (*read_size)(const char *path, uint64_t *size); // NULL = tamanho do arquivo
+
+    // Origem sem diretório (dir vazio)
+    int (*lookup)(void *ctx, const char *name, uint64_t *size, int64_t *mtime, uint64_t *inode);
+    void (*each)(void *ctx, index_visit_fn visit, void *arg);
+    void *ctx;
+} index_source_t;
+
+/**
+ * Índice do diretório de armazenamento
+ */
+typedef struct {
+    mutex_t lock;                       // Protege a tabela e a lista abaixo
+    index_table_t table;
+    index_source_t sources[INDEX_MAX_SOURCES];
+    int source_count;
+    const char *hidden;                 // Prefixo dos nomes que não são indexados
+    int preloaded;                      // Tabela lida de um ponto de controle
+    void (*changed)(void *ctx, const char *name); // Observador das mudanças (ou NULL)
+    void *changed_ctx;
+
+    // Nomes alterados durante uma releitura, reaplicados ao final
+    int rebuilding;
+    char **touched;
+    size_t touched_count, touched_cap;
+
+    int watch_fd;                       // Descritor do inotify (-1 sem)
+    char **watch_dirs;                  // Subdiretório de cada watch (posição = descritor; NULL = raiz)
+    int watch_cap;
+} storage_index_t;
+
+/*--------------------------------------------------------------
+ * TABELA HASH
+ *------------------------------------------------------------*/
+
+/**
+ * Hash de 32 bits de um nome (FNV-1a)
+ */
+static inline uint32_t index_name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = name; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+    return hash;
+}
+
+/**
+ * Prepara uma tabela vazia
+ *
+ * @return 0 em caso de sucesso, -1 se faltou memória
+ */
+static inline int index_table_init(index_table_t *t) {
+    memset(t, 0, sizeof(*t));
+    t->slots = (index_slot_t *)calloc(INDEX_INITIAL_SLOTS, sizeof(index_slot_t));
+    t->slot_mask = INDEX_INITIAL_SLOTS - 1;
+    return t->slots != NULL ? 0 : -1;
+}
+
+/**
+ * Libera a tabela e os nomes
+ */
+static inline void index_table_free(index_table_t *t) {
+    for (size_t i = 0; i < t->count; i++) free(t->entries[i].name);
+    free(t->entries);
+    free(t->slots);
+    free(t->order);
+    memset(t, 0, sizeof(*t));
+}
+
+/**
+ * Procura um nome na ordem das entradas
+ *
+ * @param after 0: primeira posição com nome >= name; 1: com nome > name
+ * @return Posição em t->order (t->count se nenhuma)
+ */
+static inline size_t index_order_seek(const index_table_t *t, const char *name, int after) {
+    size_t low = 0, high = t->count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(t->entries[t->order[mid]].name, name);
+        if (cmp < 0 || (after && cmp == 0)) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+/**
+ * Compara entradas pelo nome (para qsort)
+ */
+static inline int index_entry_compare(const void *a, const void *b) {
+    return strcmp((*(const index_entry_t *const *)a)->name, (*(const index_entry_t *const *)b)->name);
+}
+
+/**
+ * Monta a ordem por nome, se ainda não existe
+ *
+ * @return 0 em caso de sucesso, -1 se faltou memória
+ *
+ * Por que foi feito:
+ * - Tabelas montadas de uma vez (releitura do diretório, ponto de
+ *   controle) são ordenadas uma vez só, na primeira listagem, em vez de
+ *   pagarem um deslocamento do vetor a cada nome inserido
+ */
+static inline int index_table_order(index_table_t *t) {
+    if (t->order != NULL) return 0;
+    size_t cap = t->count > 256 ? t->count : 256;
+    index_entry_t **sorted = (index_entry_t **)malloc((t->count > 0 ? t->count : 1) * sizeof(index_entry_t *));
+    uint32_t *order = (uint32_t *)malloc(cap * sizeof(uint32_t));
+    if (sorted == NULL || order == NULL) {
+        free(sorted);
+        free(order);
+        return -1;
+    }
+    for (size_t i = 0; i < t->count; i++) sorted[i] = &t->entries[i];
+    qsort(sorted, t->count, sizeof(index_entry_t *), index_entry_compare);
+    for (size_t i = 0; i < t->count; i++) order[i] = (uint32_t)(sorted[i] - t->entries);
+    free(sorted);
+    t->order = order;
+    t->order_cap = cap;
+    return 0;
+}
+
+/**
+ * Acrescenta à ordem por nome a última entrada inserida
+ *
+ * Sem memória, a ordem é descartada e montada de novo na próxima listagem.
+ */
+static inline void index_order_insert(index_table_t *t) {
+    size_t pos = t->count - 1;
+
+    if (t->order == NULL) return;
+    if (t->count > t->order_cap) {
+        uint32_t *grown = (uint32_t *)realloc(t->order, t->order_cap * 2 * sizeof(uint32_t));
+        if (grown == NULL) {
+            free(t->order);
+            t->order = NULL;
+            return;
+        }
+        t->order = grown;
+        t->order_cap *= 2;
+    }
+    // Busca entre as pos entradas que já estão na ordem
+    size_t count = t->count;
+    t->count = pos;
+    size_t at = index_order_seek(t, t->entries[pos].name, 0);
+    t->count = count;
+    memmove(t->order + at + 1, t->order + at, (pos - at) * sizeof(uint32_t));
+    t->order[at] = (uint32_t)pos;
+}
+
+/**
+ * Procura o slot de um nome
+ *
+ * @return Posição do slot, ou INDEX_NONE se o nome não está na tabela
+ */
+static inline size_t index_table_find(const index_table_t *t, const char *name, uint32_t hash) {
+    size_t i = hash & t->slot_mask;
+
+    while (t->slots[i].entry != 0) {
+        if (t->slots[i].hash == hash && strcmp(t->entries[t->slots[i].entry - 1].name, name) == 0) return i;
+        i = (i + 1) & t->slot_mask;
+    }
+    return INDEX_NONE;
+}
+
+/**
+ * Dobra a quantidade de slots e redistribui as entradas
+ *
+ * @return 0 em caso de sucesso, -1 se faltou memória
+ */
+static inline int index_table_grow(index_table_t *t) {
+    size_t slots = (t->slot_mask + 1) * 2;
+    index_slot_t *grown = (index_slot_t *)calloc(slots, sizeof(index_slot_t));
+    if (grown == NULL) return -1;
+
+    for (size_t e = 0; e < t->count; e++) {
+        size_t i = t->entries[e].hash & (slots - 1);
+        while (grown[i].entry != 0) i = (i + 1) & (slots - 1);
+        grown[i].hash = t->entries[e].hash;
+        grown[i].entry = (uint32_t)(e + 1);
+    }
+    free(t->slots);
+    t->slots = grown;
+    t->slot_mask = slots - 1;
+    return 0;
+}
+
+/**
+ * Insere ou atualiza os metadados de um arquivo
+ *
+ * @return 0 em caso de sucesso, -1 se faltou memória
+ */
+static inline int index_table_put(index_table_t *t, const char *name, int source,
+                                  uint64_t size, int64_t mtime, uint64_t inode) {
+    uint32_t hash = index_name_hash(name);
+    size_t slot = index_table_find(t, name, hash);
+
+    if (slot != INDEX_NONE) {
+        index_entry_t *e = &t->entries[t->slots[slot].entry - 1];
+        // Conteúdo alterado: o hash conhecido deixa de valer
+        if (e->size != size || e->mtime != mtime || e->inode != inode) e->digest_len = 0;
+        e->source = (uint8_t)source;
+        e->size = size;
+        e->mtime = mtime;
+        e->inode = inode;
+        return 0;
+    }
+
+    // Mantém a ocupação abaixo de 70% para sondagens curtas
+    if ((t->count + 1) * 10 > (t->slot_mask + 1) * 7 && index_table_grow(t) != 0) return -1;
+    if (t->count == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 256;
+        index_entry_t *grown = (index_entry_t *)realloc(t->entries, cap * sizeof(index_entry_t));
+        if (grown == NULL) return -1;
+        t->entries = grown;
+        t->cap = cap;
+    }
+
+    index_entry_t *e = &t->entries[t->count];
+    memset(e, 0, sizeof(*e));
+    e->name = strdup(name);
+    if (e->name == NULL) return -1;
+    e->hash = hash;
+    e->source = (uint8_t)source;
+    e->size = size;
+    e->mtime = mtime;
+    e->inode = inode;
+    t->name_bytes += strlen(name) + 1;
+
+    slot = hash & t->slot_mask;
+    while (t->slots[slot].entry != 0) slot = (slot + 1) & t->slot_mask;
+    t->slots[slot].hash = hash;
+    t->slots[slot].entry = (uint32_t)(++t->count);
+    index_order_insert(t);
+    return 0;
+}
+
+/**
+ * Remove um arquivo da tabela
+ *
+ * Por que foi feito:
+ * - Na sondagem linear, as entradas seguintes do mesmo agrupamento são
+ *   puxadas para trás em vez de deixar marcas de remoção, então buscas
+ *   continuam curtas depois de muitas exclusões
+ */
+static inline void index_table_remove(index_table_t *t, const char *name) {
+    size_t i = index_table_find(t, name, index_name_hash(name));
+    if (i == INDEX_NONE) return;
+
+    size_t e = t->slots[i].entry - 1;
+    t->slots[i].entry = 0;
+    for (size_t j = (i + 1) & t->slot_mask; t->slots[j].entry != 0; j = (j + 1) & t->slot_mask) {
+        size_t home = t->slots[j].hash & t->slot_mask;
+        // Só move o slot se a posição vaga fica entre a ideal e a atual
+        int stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (stays) continue;
+        t->slots[i] = t->slots[j];
+        t->slots[j].entry = 0;
+        i = j;
+    }
+
+    // Tira o nome da ordem antes de liberá-lo
+    size_t last = t->count - 1;
+    if (t->order != NULL) {
+        size_t at = index_order_seek(t, t->entries[e].name, 0);
+        memmove(t->order + at, t->order + at + 1, (last - at) * sizeof(uint32_t));
+    }
+
+    // Move a última entrada para a posição liberada
+    t->name_bytes -= strlen(t->entries[e].name) + 1;
+    free(t->entries[e].name);
+    t->count--;
+    if (e != last) {
+        t->entries[e] = t->entries[last];
+        size_t slot = t->entries[e].hash & t->slot_mask;
+        while (t->slots[slot].entry != last + 1) slot = (slot + 1) & t->slot_mask;
+        t->slots[slot].entry = (uint32_t)(e + 1);
+        if (t->order != NULL) t->order[index_order_seek(t, t->entries[e].name, 0)] = (uint32_t)e;
+    }
+}
+
+/*--------------------------------------------------------------
+ * ÍNDICE DO DIRETÓRIO
+ *------------------------------------------------------------*/
+
+/**
+ * Indica se um nome deve ficar fora do índice
+ */
+static inline int index_is_hidden(const storage_index_t *idx, const char *name) {
+    return idx->hidden != NULL && strncmp(name, idx->hidden, strlen(idx->hidden)) == 0;
+}
+
+/**
+ * Lê os metadados de um arquivo em uma origem
+ *
+ * @return 0 em caso de sucesso, -1 se o arquivo não existe nessa origem
+ */
+static inline int index_stat(const index_source_t *src, const char *name,
+                             uint64_t *size, int64_t *mtime, uint64_t *inode) {
+    char path[INDEX_PATH_MAX];
+
+    if (src->lookup != NULL) return src->lookup(src->ctx, name, size, mtime, inode);
+    if (snprintf(path, sizeof(path), "%s" PATH_SEP "%s", src->dir, name) >= (int)sizeof(path)) return -1;
+    if (file_stat(path, size, mtime, inode) != 0) return -1;
+    return src->read_size != NULL ? src->read_size(path, size) : 0;
+}
+
+/**
+ * Relê os metadados de um arquivo do disco para o índice
+ *
+ * Por que foi feito:
+ * - Serve para criação, alteração e remoção: se o arquivo não existe mais
+ *   em nenhuma origem (ou não é regular) a entrada é removida
+ * - O stat() é feito fora do lock; só a atualização da tabela é protegida
+ */
+static inline void index_update(storage_index_t *idx, const char *name) {
+    uint64_t size = 0, inode = 0;
+    int64_t mtime = 0;
+    int source = -1;
+
+    if (index_is_hidden(idx, name)) return;
+    for (int i = 0; i < idx->source_count && source < 0; i++) {
+        if (index_stat(&idx->sources[i], name, &size, &mtime, &inode) == 0) source = i;
+    }
+
+    mutex_lock(&idx->lock);
+    if (source >= 0) index_table_put(&idx->table, name, source, size, mtime, inode);
+    else index_table_remove(&idx->table, name);
+
+    // Releitura em andamento: a tabela nova pode ter lido o estado antigo
+    if (idx->rebuilding) {
+        if (idx->touched_count == idx->touched_cap) {
+            size_t cap = idx->touched_cap ? idx->touched_cap * 2 : 64;
+            char **grown = (char **)realloc(idx->touched, cap * sizeof(char *));
+            if (grown != NULL) {
+                idx->touched = grown;
+                idx->touched_cap = cap;
+            }
+        }
+        if (idx->touched_count < idx->touched_cap && (idx->touched[idx->touched_count] = strdup(name)) != NULL) {
+            idx->touched_count++;
+        }
+    }
+    mutex_unlock(&idx->lock);
+    if (idx->changed != NULL) idx->changed(idx->changed_ctx, name);
+}
+
+/**
+ * Consulta os metadados de um arquivo
+ *
+ * @param out Recebe uma cópia da entrada (sem o nome); pode ser NULL
+ * @return 0 se o arquivo está no índice, -1 caso contrário
+ */
+static inline int index_lookup(storage_index_t *idx, const char *name, index_entry_t *out) {
+    mutex_lock(&idx->lock);
+    size_t slot = index_table_find(&idx->table, name, index_name_hash(name));
+    if (slot != INDEX_NONE && out != NULL) {
+        *out = idx->table.entries[idx->table.slots[slot].entry - 1];
+        out->name = NULL;
+    }
+    mutex_unlock(&idx->lock);
+    return slot != INDEX_NONE ? 0 : -1;
+}
+
+/**
+ * Guarda o hash do conteúdo de um arquivo indexado
+ *
+ * @param size Tamanho do arquivo ao qual o hash se refere
+ * @param mtime Data de modificação do arquivo ao qual o hash se refere
+ *
+ * Por que foi feito:
+ * - O hash só é aceito se a entrada ainda descreve o mesmo arquivo; uma
+ *   alteração que chegou no meio não fica com o hash da versão anterior
+ */
+static inline void index_set_digest(storage_index_t *idx, const char *name, uint64_t size, int64_t mtime,
+                                    const uint8_t *digest, size_t len) {
+    if (len > LIST_HASH_MAX) return;
+    mutex_lock(&idx->lock);
+    size_t slot = index_table_find(&idx->table, name, index_name_hash(name));
+    if (slot != INDEX_NONE) {
+        index_entry_t *e = &idx->table.entries[idx->table.slots[slot].entry - 1];
+        if (e->size == size && e->mtime == mtime) {
+            memcpy(e->digest, digest, len);
+            e->digest_len = (uint8_t)len;
+        }
+    }
+    mutex_unlock(&idx->lock);
+}
+
+/**
+ * Passa a acompanhar um subdiretório pelo inotify
+ *
+ * @param path Caminho do diretório
+ * @param rel Caminho relativo à origem, prefixo dos nomes dos eventos
+ */
+static inline void index_watch(storage_index_t *idx, const char *path, const char *rel) {
+#ifdef __linux__
+    int wd = idx->watch_fd >= 0 ? inotify_add_watch(idx->watch_fd, path, INDEX_WATCH_EVENTS) : -1;
+    if (wd < 0) return;
+
+    mutex_lock(&idx->lock);
+    if (wd >= idx->watch_cap) {
+        int cap = wd * 2 + 16;
+        char **grown = (char **)realloc(idx->watch_dirs, (size_t)cap * sizeof(char *));
+        if (grown != NULL) {
+            memset(grown + idx->watch_cap, 0, (size_t)(cap - idx->watch_cap) * sizeof(char *));
+            idx->watch_dirs = grown;
+            idx->watch_cap = cap;
+        }
+    }
+    if (wd < idx->watch_cap) {
+        free(idx->watch_dirs[wd]);
+        idx->watch_dirs[wd] = strdup(rel);
+    }
+    mutex_unlock(&idx->lock);
+#else
+    (void)idx;
+    (void)path;
+    (void)rel;
+#endif
+}
+
+/**
+ * Percorre os arquivos de um diretório de uma origem e dos seus subdiretórios
+ *
+ * @param rel Caminho do diretório relativo à origem ("" para a raiz)
+ * @param visit Chamada para cada nome; devolve 0 se era um arquivo
+ *              regular, -1 para o nome ser examinado como diretório
+ *
+ * Por que foi feito:
+ * - Árvores enviadas pelo cliente ficam em subdiretórios; cada um passa a
+ *   ser acompanhado pelo inotify enquanto é lido, então um arquivo criado
+ *   durante a leitura gera um evento em vez de ser perdido
+ */
+static inline void index_walk(storage_index_t *idx, int source, const char *rel, int depth,
+                              int (*visit)(storage_index_t *idx, int source, const char *name, void *ctx),
+                              void *ctx) {
+    const index_source_t *src = &idx->sources[source];
+    char dir[INDEX_PATH_MAX];
+    char name[PROTO_MAX_NAME];
+    dir_iter_t it;
+    const char *entry;
+
+    if (depth > INDEX_MAX_DEPTH || src->each != NULL) return;
+    if (snprintf(dir, sizeof(dir), "%s%s%s", src->dir, rel[0] ? PATH_SEP : "", rel) >= (int)sizeof(dir)) return;
+    if (rel[0] != '\0') index_watch(idx, dir, rel);
+    if (dir_open(&it, dir) != 0) return;
+
+    while ((entry = dir_next(&it)) != NULL) {
+        if (snprintf(name, sizeof(name), "%s%s%s", rel, rel[0] ? "/" : "", entry) >= (int)sizeof(name)) continue;
+        if (index_is_hidden(idx, name) || visit(idx, source, name, ctx) == 0) continue;
+
+        char path[INDEX_PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s" PATH_SEP "%s", src->dir, name) < (int)sizeof(path) && path_is_dir(path)) {
+            index_walk(idx, source, name, depth + 1, visit, ctx);
+        }
+    }
+    dir_close(&it);
+}
+
+/**
+ * Acrescenta um arquivo a uma tabela em montagem (index_walk)
+ */
+static inline int index_visit_fresh(storage_index_t *idx, int source, const char *name, void *ctx) {
+    index_table_t *fresh = (index_table_t *)ctx;
+    uint64_t size, inode;
+    int64_t mtime;
+
+    // Nome presente em duas origens: vale a primeira
+    if (index_table_find(fresh, name, index_name_hash(name)) != INDEX_NONE) return 0;
+    if (index_stat(&idx->sources[source], name, &size, &mtime, &inode) != 0) return -1;
+    index_table_put(fresh, name, source, size, mtime, inode);
+    return 0;
+}
+
+/**
+ * Tabela em montagem e origem dos nomes visitados (index_visit_store)
+ */
+typedef struct {
+    index_table_t *table;
+    int source;
+} index_fresh_t;
+
+/**
+ * Acrescenta um nome de uma origem sem diretório a uma tabela em montagem
+ */
+static inline void index_visit_store(void *arg, const char *name, uint64_t size, int64_t mtime, uint64_t inode) {
+    index_fresh_t *fresh = (index_fresh_t *)arg;
+    if (index_table_find(fresh->table, name, index_name_hash(name)) != INDEX_NONE) return;
+    index_table_put(fresh->table, name, fresh->source, size, mtime, inode);
+}
+
+/**
+ * Relê um arquivo de um diretório que acabou de aparecer (index_walk)
+ */
+static inline int index_visit_update(storage_index_t *idx, int source, const char *name, void *ctx) {
+    uint64_t size, inode;
+    int64_t mtime;
+
+    (void)ctx;
+    if (index_stat(&idx->sources[source], name, &size, &mtime, &inode) != 0) return -1;
+    index_update(idx, name);
+    return 0;
+}
+
+/**
+ * Remove do índice os arquivos de um subdiretório que deixou de existir
+ */
+static inline void index_drop_tree(storage_index_t *idx, const char *dir) {
+    size_t len = strlen(dir);
+
+    mutex_lock(&idx->lock);
+    for (size_t i = idx->table.count; i-- > 0;) {
+        // A última entrada, já examinada, passa a ocupar a posição removida
+        const char *name = idx->table.entries[i].name;
+        if (strncmp(name, dir, len) != 0 || name[len] != '/') continue;
+        if (idx->changed != NULL) idx->changed(idx->changed_ctx, name);
+        index_table_remove(&idx->table, name);
+    }
+    mutex_unlock(&idx->lock);
+}
+
+/**
+ * Relê o diretório inteiro e substitui a tabela
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - Usado na partida, quando o inotify perde eventos (fila cheia) e
+ *   periodicamente nas plataformas sem inotify
+ * - A tabela nova é montada fora do lock; consultas continuam usando a
+ *   antiga até a troca, e alterações feitas no meio são reaplicadas
+ */
+static inline int index_rebuild(storage_index_t *idx) {
+    index_table_t fresh, old;
+
+    if (index_table_init(&fresh) != 0) return -1;
+    mutex_lock(&idx->lock);
+    idx->rebuilding = 1;
+    mutex_unlock(&idx->lock);
+
+    for (int source = 0; source < idx->source_count; source++) {
+        const index_source_t *src = &idx->sources[source];
+        index_fresh_t store = { &fresh, source };
+        if (src->each != NULL) src->each(src->ctx, index_visit_store, &store);
+        else index_walk(idx, source, "", 0, index_visit_fresh, &fresh);
+    }
+
+    // Já houve listagem: ordena a tabela nova antes da troca, fora do lock
+    mutex_lock(&idx->lock);
+    int ordered = idx->table.order != NULL;
+    mutex_unlock(&idx->lock);
+    if (ordered) index_table_order(&fresh);
+
+    mutex_lock(&idx->lock);
+    old = idx->table;
+    idx->table = fresh;
+    idx->rebuilding = 0;
+    char **touched = idx->touched;
+    size_t touched_count = idx->touched_count;
+    idx->touched = NULL;
+    idx->touched_count = idx->touched_cap = 0;
+    mutex_unlock(&idx->lock);
+
+    index_table_free(&old);
+    for (size_t i = 0; i < touched_count; i++) {
+        index_update(idx, touched[i]);
+        free(touched[i]);
+    }
+    free(touched);
+    return 0;
+}
+
+/**
+ * Calcula a memória ocupada pelo índice
+ *
+ * @param bytes Recebe o total em bytes (slots, entradas, ordem e nomes)
+ * @return Quantidade de arquivos indexados
+ */
+static inline size_t index_memory(storage_index_t *idx, size_t *bytes) {
+    mutex_lock(&idx->lock);
+    size_t count = idx->table.count;
+    *bytes = (idx->table.slot_mask + 1) * sizeof(index_slot_t) +
+             idx->table.cap * sizeof(index_entry_t) + idx->table.order_cap * sizeof(uint32_t) +
+             idx->table.name_bytes;
+    mutex_unlock(&idx->lock);
+    return count;
+}
+
+/**
+ * Exibe o tamanho do índice e o custo de memória por arquivo
+ */
+static inline void index_report(storage_index_t *idx) {
+    size_t bytes;
+    size_t count = index_memory(idx, &bytes);
+
+    printf("Índice do armazenamento: %zu arquivos, %.1f MB em memória", count, (double)bytes / (1024 * 1024));
+    if (count > 0) printf(" (%zu bytes por arquivo)", bytes / count);
+    printf("\n");
+}
+
+#ifdef __linux__
+/**
+ * Aplica ao índice um evento do inotify
+ *
+ * Por que foi feito:
+ * - O evento traz só o nome dentro do diretório observado; o caminho
+ *   relativo do diretório vem da tabela de watches
+ * - Um diretório novo é lido por inteiro (arquivos podem ter sido criados
+ *   antes do watch); um diretório removido leva junto suas entradas
+ */
+static inline void index_event(storage_index_t *idx, const struct inotify_event *ev) {
+    char name[PROTO_MAX_NAME];
+    const char *dir = ev->wd >= 0 && ev->wd < idx->watch_cap ? idx->watch_dirs[ev->wd] : NULL;
+
+    if (snprintf(name, sizeof(name), "%s%s%s", dir ? dir : "", dir ? "/" : "", ev->name) >= (int)sizeof(name)) return;
+    if (!(ev->mask & IN_ISDIR)) {
+        index_update(idx, name);
+    } else if (index_is_hidden(idx, name)) {
+        return;
+    } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        for (int source = 0; source < idx->source_count; source++) {
+            index_walk(idx, source, name, 1, index_visit_update, NULL);
+        }
+    } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        index_drop_tree(idx, name);
+    }
+}
+#endif
+
+/**
+ * Thread que acompanha mudanças feitas por fora do servidor
+ */
+static inline void *index_watch_main(void *arg) {
+    storage_index_t *idx = (storage_index_t *)arg;
+
+    // Tabela lida de um ponto de controle: confere com o disco o que mudou
+    // por fora enquanto o servidor estava parado
+    if (idx->preloaded) index_rebuild(idx);
+
+#ifdef __linux__
+    if (idx->watch_fd >= 0) {
+        char events[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+        for (;;) {
+            ssize_t got = read(idx->watch_fd, events, sizeof(events));
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) break;
+
+            for (char *p = events; p < events + got;) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                if (ev->mask & IN_Q_OVERFLOW) index_rebuild(idx);  // Eventos perdidos
+                else if (ev->len > 0) index_event(idx, ev);
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+    }
+#endif
+
+    // Sem inotify: relê o diretório de tempos em tempos
+    for (;;) {
+        sleep_ms(INDEX_RESCAN_MS);
+        index_rebuild(idx);
+    }
+    return NULL;
+}
+
+/**
+ * Prepara um índice vazio
+ *
+ * @param hidden Prefixo dos nomes que ficam fora do índice (ou NULL)
+ */
+static inline void index_init(storage_index_t *idx, const char *hidden) {
+    memset(idx, 0, sizeof(*idx));
+    mutex_init(&idx->lock);
+    idx->hidden = hidden;
+    idx->watch_fd = -1;
+}
+
+/**
+ * Registra quem é avisado de cada arquivo alterado ou removido (antes de
+ * index_start)
+ *
+ * @param changed Chamada com o nome relativo; não deve consultar o índice,
+ *                pois pode ser chamada com o lock do índice
+ */
+static inline void index_on_change(storage_index_t *idx, void (*changed)(void *ctx, const char *name), void *ctx) {
+    idx->changed = changed;
+    idx->changed_ctx = ctx;
+}
+
+/**
+ * Acrescenta um diretório ao índice (antes de index_start)
+ *
+ * @param read_size Lê o tamanho lógico de um arquivo da origem (ou NULL
+ *                  para usar o tamanho do próprio arquivo)
+ * @return Número da origem, ou -1 se não cabem mais origens
+ */
+static inline int index_add_source(storage_index_t *idx, const char *dir,
+                                   int (*read_size)(const char *path, uint64_t *size)) {
+    if (idx->source_count == INDEX_MAX_SOURCES) return -1;
+    index_source_t *src = &idx->sources[idx->source_count];
+    snprintf(src->dir, sizeof(src->dir), "%s", dir);
+    src->read_size = read_size;
+    return idx->source_count++;
+}
+
+/**
+ * Acrescenta ao índice uma origem sem diretório (antes de index_start)
+ *
+ * @param lookup Metadados de um nome; 0 se ele existe, -1 caso contrário
+ * @param each Chama visit para cada nome da origem
+ * @return Número da origem, ou -1 se não cabem mais origens
+ *
+ * Por que foi feito:
+ * - Objetos guardados em segmentos não são arquivos; o índice os trata
+ *   como qualquer outra origem, sem stat() nem leitura de diretório
+ */
+static inline int index_add_store(storage_index_t *idx, int (*lookup)(void *ctx, const char *name, uint64_t *size,
+                                                                      int64_t *mtime, uint64_t *inode),
+                                  void (*each)(void *ctx, index_visit_fn visit, void *arg), void *ctx) {
+    if (idx->source_count == INDEX_MAX_SOURCES) return -1;
+    index_source_t *src = &idx->sources[idx->source_count];
+    memset(src, 0, sizeof(*src));
+    src->lookup = lookup;
+    src->each = each;
+    src->ctx = ctx;
+    return idx->source_count++;
+}
+
+/**
+ * Monta o índice das origens e passa a acompanhar suas mudanças
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - O inotify é registrado antes da leitura inicial, então um arquivo
+ *   criado durante a leitura gera um evento em vez de ser perdido
+ * - Com a tabela já carregada (idx->preloaded) a partida não espera a
+ *   leitura do diretório, que passa para a thread de acompanhamento
+ */
+static inline int index_start(storage_index_t *idx) {
+    thread_t thread;
+
+    if (!idx->preloaded && index_table_init(&idx->table) != 0) return -1;
+
+#ifdef __linux__
+    idx->watch_fd = inotify_init1(IN_CLOEXEC);
+    for (int i = 0; i < idx->source_count && idx->watch_fd >= 0; i++) {
+        // Diretório ausente (ex.: sem armazenamento por conteúdo) não é erro
+        if (idx->sources[i].each != NULL || !path_exists(idx->sources[i].dir)) continue;
+        if (inotify_add_watch(idx->watch_fd, idx->sources[i].dir, INDEX_WATCH_EVENTS) < 0) {
+            close(idx->watch_fd);
+            idx->watch_fd = -1;
+        }
+    }
+#endif
+
+    if (!idx->preloaded && index_rebuild(idx) != 0) return -1;
+    return thread_create(&thread, index_watch_main, idx);
+}
+
+#endif /* BIGFS_INDEX_H */
@@ -0,0 +1,798 @@
+/*******************************************************************************
+ * DIÁRIO DE OPERAÇÕES (WRITE-AHEAD) E PONTO DE CONTROLE DO ÍNDICE
+ *
+ * Descrição: Registra num arquivo só de acréscimos cada operação que muda o
+ *            armazenamento, antes de ela acontecer, e o estado do arquivo
+ *            depois dela. Na partida o servidor lê o último ponto de
+ *            controle do índice e reaplica o diário, sem percorrer o
+ *            diretório de armazenamento.
+ *
+ * Registros:
+ * - UPLOAD: um temporário completo vai receber o nome final
+ * - MANIFEST: o mesmo, para um manifesto (modo dedup)
+ * - DELETE: um arquivo vai ser excluído
+ * - DONE:   a operação terminou; leva os metadados do nome no índice
+ *           (tamanho, data, inode e resumo) ou a ausência dele
+ * - Cada registro tem tamanho e CRC32C; um registro cortado por uma queda
+ *   encerra a leitura do diário
+ *
+ * Confirmação em grupo:
+ * - Quem precisa do registro no disco espera a vez; a primeira thread
+ *   grava e sincroniza tudo o que as outras acumularam até ali, e todas
+ *   são liberadas com um único fdatasync()
+ * - DONE não é esperado: se for perdido, a intenção já estava no disco e
+ *   a recuperação relê o nome
+ *
+ * Ponto de controle:
+ * - Quando o diário passa de JOURNAL_CHECKPOINT_BYTES, uma thread abre o
+ *   diário da geração seguinte, copia para ele as operações ainda em
+ *   andamento e grava o índice inteiro; os diários anteriores são apagados
+ * - A recuperação lê o ponto de controle e os diários da geração dele em
+ *   diante, então o tempo de partida depende do tamanho do diário e não
+ *   da quantidade de arquivos no disco
+ *
+ * Recuperação:
+ * - Uma intenção sem DONE é entregue ao servidor, que termina o upload (o
+ *   temporário, completo e sincronizado, ainda existe: a troca de nome não
+ *   chegou ao disco) ou a exclusão; o nome é relido do disco e o DONE vai
+ *   para o diário novo
+ ******************************************************************************/
+#ifndef BIGFS_JOURNAL_H
+#define BIGFS_JOURNAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "protocol.h"
+#include "digest.h"
+#include "index.h"
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define JOURNAL_FILE ".bigfs-journal"   // Diários: ".bigfs-journal-<geração>"
+#define JOURNAL_SNAPSHOT ".bigfs-index" // Ponto de controle do índice
+#define JOURNAL_SNAPSHOT_MAGIC "BIGFSIX1"
+#define JOURNAL_CHECKPOINT_BYTES (16 * 1024 * 1024) // Diário que dispara um ponto de controle
+#define JOURNAL_FLUSH_MS 1000           // Intervalo máximo até gravar DONEs acumulados
+#define JOURNAL_HEADER_SIZE 8           // Tamanho (u32) e CRC32C (u32) do registro
+#define JOURNAL_BODY_MAX (12 + 2 * (2 + PROTO_MAX_NAME) + 27 + LIST_HASH_MAX)
+#define JOURNAL_RECORD_MAX (JOURNAL_HEADER_SIZE + JOURNAL_BODY_MAX)
+
+/**
+ * Tipos de registro
+ */
+enum {
+    JOURNAL_UPLOAD = 1,
+    JOURNAL_DELETE = 2,
+    JOURNAL_DONE = 3,
+    JOURNAL_MANIFEST = 4
+};
+
+/**
+ * Registro decodificado
+ */
+typedef struct {
+    uint8_t type;
+    uint64_t id;                        // Operação (0: DONE avulso, só metadados)
+    char name[PROTO_MAX_NAME + 1];
+    char from[PROTO_MAX_NAME + 1];      // UPLOAD: temporário, relativo ao armazenamento
+    uint8_t present;                    // DONE: o nome existe no índice
+    index_entry_t meta;                 // DONE: entrada do índice (sem o nome)
+} journal_record_t;
+
+/**
+ * Operação em andamento (intenção sem DONE)
+ */
+typedef struct {
+    uint64_t id;
+    size_t len;
+    uint8_t *bytes;                     // Registro codificado, copiado ao trocar de geração
+} journal_active_t;
+
+/**
+ * Diário do diretório de armazenamento
+ */
+typedef struct {
+    mutex_t lock;                       // Protege todos os campos abaixo
+    cond_t flushed;                     // Fim de uma gravação (confirmação em grupo)
+    cond_t wake;                        // Acorda a thread do diário
+    char dir[INDEX_PATH_MAX];
+    storage_index_t *idx;
+
+    int fd;                             // Diário da geração atual
+    uint32_t generation, first;         // Geração atual e a mais antiga ainda no disco
+    uint64_t file_size;                 // Bytes gravados no diário atual
+    uint8_t *buf, *spare;               // Registros ainda não gravados / buffer livre
+    size_t len, cap, spare_cap;
+    uint64_t appended, durable;         // Bytes acumulados e bytes já sincronizados
+    int flushing;                       // Uma thread está gravando (ou trocando de geração)
+    int checkpointing;                  // Ponto de controle pedido à thread
+    int failed;                         // Erro de gravação: novas operações são recusadas
+    uint64_t next_id;
+
+    journal_active_t *active;
+    size_t active_count, active_cap;
+
+    // Recuperação: intenções sem DONE, resolvidas pelo servidor
+    journal_record_t *pending;
+    size_t pending_count;
+
+    uint64_t records, syncs, checkpoints;
+} journal_t;
+
+/**
+ * Resultado da recuperação (para o relatório da partida)
+ */
+typedef struct {
+    int snapshot;                       // Ponto de controle lido
+    size_t files;                       // Arquivos no ponto de controle
+    uint64_t records;                   // Registros reaplicados
+    uint32_t journals;                  // Diários lidos
+    size_t resolved;                    // Operações interrompidas resolvidas
+    double ms;
+} journal_recovery_t;
+
+/*--------------------------------------------------------------
+ * REGISTROS
+ *------------------------------------------------------------*/
+
+/**
+ * Monta o caminho de um arquivo do diário
+ *
+ * @param generation Geração do diário, ou 0 para o ponto de controle
+ * @param suffix Acrescentado ao nome (ex.: ".tmp")
+ * @return 0 em caso de sucesso, -1 se o caminho não couber
+ */
+static inline int journal_path(const journal_t *j, char *path, uint32_t generation, const char *suffix) {
+    int len = generation > 0 ?
+        snprintf(path, INDEX_PATH_MAX, "%s" PATH_SEP JOURNAL_FILE "-%u%s", j->dir, generation, suffix) :
+        snprintf(path, INDEX_PATH_MAX, "%s" PATH_SEP JOURNAL_SNAPSHOT "%s", j->dir, suffix);
+    return (len < 0 || len >= INDEX_PATH_MAX) ? -1 : 0;
+}
+
+/**
+ * Codifica um registro
+ *
+ * @param out Buffer com JOURNAL_RECORD_MAX bytes
+ * @return Tamanho do registro (cabeçalho incluído)
+ */
+static inline size_t journal_encode(const journal_record_t *r, uint8_t *out) {
+    uint8_t *p = out + JOURNAL_HEADER_SIZE;
+    size_t name_len = strlen(r->name), from_len = strlen(r->from);
+
+    *p++ = r->type;
+    put_u64(p, r->id);
+    p += 8;
+    put_u16(p, (uint16_t)name_len);
+    memcpy(p + 2, r->name, name_len);
+    p += 2 + name_len;
+    put_u16(p, (uint16_t)from_len);
+    memcpy(p + 2, r->from, from_len);
+    p += 2 + from_len;
+    if (r->type == JOURNAL_DONE) {
+        *p++ = r->present;
+        *p++ = r->meta.source;
+        put_u64(p, r->meta.size);
+        put_u64(p + 8, (uint64_t)r->meta.mtime);
+        put_u64(p + 16, r->meta.inode);
+        p[24] = r->meta.digest_len;
+        memcpy(p + 25, r->meta.digest, r->meta.digest_len);
+        p += 25 + r->meta.digest_len;
+    }
+
+    uint32_t body = (uint32_t)(p - out - JOURNAL_HEADER_SIZE);
+    put_u32(out, body);
+    put_u32(out + 4, crc32c(0, out + JOURNAL_HEADER_SIZE, body));
+    return JOURNAL_HEADER_SIZE + body;
+}
+
+/**
+ * Lê um nome (u16 + bytes) de um registro
+ *
+ * @return Bytes consumidos, ou 0 se o nome não cabe no registro
+ */
+static inline size_t journal_decode_name(const uint8_t *p, size_t avail, char *out) {
+    if (avail < 2) return 0;
+    size_t len = get_u16(p);
+    if (len > PROTO_MAX_NAME || len > avail - 2) return 0;
+    memcpy(out, p + 2, len);
+    out[len] = '\0';
+    return 2 + len;
+}
+
+/**
+ * Decodifica o registro no início de um buffer
+ *
+ * @param avail Bytes disponíveis a partir de p
+ * @return Tamanho do registro, ou 0 se está cortado ou corrompido
+ */
+static inline size_t journal_decode(const uint8_t *p, size_t avail, journal_record_t *r) {
+    if (avail < JOURNAL_HEADER_SIZE) return 0;
+    size_t body = get_u32(p);
+    if (body < 13 || body > JOURNAL_BODY_MAX || body > avail - JOURNAL_HEADER_SIZE) return 0;
+    const uint8_t *b = p + JOURNAL_HEADER_SIZE;
+    if (crc32c(0, b, body) != get_u32(p + 4)) return 0;
+
+    memset(&r->meta, 0, sizeof(r->meta));
+    r->present = 0;
+    r->type = b[0];
+    r->id = get_u64(b + 1);
+    size_t pos = 9, used;
+    if ((used = journal_decode_name(b + pos, body - pos, r->name)) == 0) return 0;
+    pos += used;
+    if ((used = journal_decode_name(b + pos, body - pos, r->from)) == 0) return 0;
+    pos += used;
+    if (r->type == JOURNAL_DONE) {
+        if (body - pos < 27) return 0;
+        r->present = b[pos];
+        r->meta.source = b[pos + 1];
+        r->meta.size = get_u64(b + pos + 2);
+        r->meta.mtime = (int64_t)get_u64(b + pos + 10);
+        r->meta.inode = get_u64(b + pos + 18);
+        r->meta.digest_len = b[pos + 26];
+        if (r->meta.digest_len > LIST_HASH_MAX || body - pos - 27 < r->meta.digest_len) return 0;
+        memcpy(r->meta.digest, b + pos + 27, r->meta.digest_len);
+    } else if (r->type != JOURNAL_UPLOAD && r->type != JOURNAL_DELETE && r->type != JOURNAL_MANIFEST) {
+        return 0;
+    }
+    return JOURNAL_HEADER_SIZE + body;
+}
+
+/**
+ * Aplica à tabela do índice os metadados de um DONE
+ *
+ * Por que foi feito:
+ * - Os registros trazem o estado final do nome, e não a mudança; aplicá-los
+ *   de novo (um diário relido depois de outra queda) dá o mesmo resultado
+ */
+static inline void journal_apply(storage_index_t *idx, const journal_record_t *r) {
+    index_table_t *t = &idx->table;
+
+    if (!r->present || r->meta.source >= idx->source_count) {
+        index_table_remove(t, r->name);
+        return;
+    }
+    if (index_table_put(t, r->name, r->meta.source, r->meta.size, r->meta.mtime, r->meta.inode) != 0) return;
+    size_t slot = index_table_find(t, r->name, index_name_hash(r->name));
+    index_entry_t *e = &t->entries[t->slots[slot].entry - 1];
+    memcpy(e->digest, r->meta.digest, r->meta.digest_len);
+    e->digest_len = r->meta.digest_len;
+}
+
+/*--------------------------------------------------------------
+ * CONFIRMAÇÃO EM GRUPO
+ *------------------------------------------------------------*/
+
+/**
+ * Acrescenta bytes aos registros ainda não gravados (com o lock)
+ *
+ * @return 0 em caso de sucesso, -1 se faltou memória
+ */
+static inline int journal_buffer_add(journal_t *j, const uint8_t *data, size_t len) {
+    if (j->len + len > j->cap) {
+        size_t cap = j->cap ? j->cap : 64 * 1024;
+        while (cap < j->len + len) cap *= 2;
+        uint8_t *grown = (uint8_t *)realloc(j->buf, cap);
+        if (grown == NULL) return -1;
+        j->buf = grown;
+        j->cap = cap;
+    }
+    memcpy(j->buf + j->len, data, len);
+    j->len += len;
+    j->appended += len;
+    j->records++;
+    return 0;
+}
+
+/**
+ * Espera até os registros acumulados até mark estarem no disco (com o lock)
+ *
+ * @param mark Valor de appended a cobrir
+ * @return 0 em caso de sucesso, -1 se o diário não pode mais ser gravado
+ *
+ * Por que foi feito:
+ * - Enquanto uma thread grava e sincroniza um lote, as outras continuam
+ *   acumulando no outro buffer; a próxima a passar leva tudo de uma vez
+ */
+static inline int journal_sync_to(journal_t *j, uint64_t mark) {
+    while (j->durable < mark && !j->failed) {
+        if (j->flushing) {
+            cond_wait(&j->flushed, &j->lock);
+            continue;
+        }
+        uint8_t *batch = j->buf;
+        size_t len = j->len, cap = j->cap;
+        uint64_t upto = j->appended, offset = j->file_size;
+        int fd = j->fd;
+        j->buf = j->spare;
+        j->cap = j->spare_cap;
+        j->len = 0;
+        j->file_size += len;
+        j->flushing = 1;
+        mutex_unlock(&j->lock);
+
+        io_vec_t iov;
+        iov.iov_base = batch;
+        iov.iov_len = len;
+        int failed = (len > 0 && file_pwritev(fd, &iov, 1, offset) != 0) || file_sync(fd) != 0;
+
+        mutex_lock(&j->lock);
+        j->spare = batch;
+        j->spare_cap = cap;
+        j->flushing = 0;
+        j->syncs++;
+        if (failed) j->failed = 1;
+        else j->durable = upto;
+        cond_broadcast(&j->flushed);
+    }
+    return j->failed ? -1 : 0;
+}
+
+/**
+ * Registra a intenção de uma operação (sem esperar o disco)
+ *
+ * @param type JOURNAL_UPLOAD, JOURNAL_MANIFEST ou JOURNAL_DELETE
+ * @param from Temporário do upload, relativo ao armazenamento (ou "")
+ * @return Id da operação, ou 0 se o diário não pode ser gravado
+ *
+ * Por que foi feito:
+ * - Um lote de arquivos registra todas as intenções e espera uma vez só
+ *   com journal_commit()
+ */
+static inline uint64_t journal_begin(journal_t *j, int type, const char *name, const char *from) {
+    journal_record_t r;
+    uint8_t *bytes = (uint8_t *)malloc(JOURNAL_RECORD_MAX);
+    uint64_t id = 0;
+
+    if (bytes == NULL || strlen(name) > PROTO_MAX_NAME || strlen(from) > PROTO_MAX_NAME) {
+        free(bytes);
+        return 0;
+    }
+    memset(&r, 0, sizeof(r));
+    r.type = (uint8_t)type;
+    strcpy(r.name, name);
+    strcpy(r.from, from);
+
+    mutex_lock(&j->lock);
+    if (j->active_count == j->active_cap) {
+        size_t cap = j->active_cap ? j->active_cap * 2 : 64;
+        journal_active_t *grown = (journal_active_t *)realloc(j->active, cap * sizeof(journal_active_t));
+        if (grown != NULL) {
+            j->active = grown;
+            j->active_cap = cap;
+        }
+    }
+    if (!j->failed && j->active_count < j->active_cap) {
+        r.id = j->next_id;
+        size_t len = journal_encode(&r, bytes);
+        if (journal_buffer_add(j, bytes, len) == 0) {
+            id = j->next_id++;
+            journal_active_t *a = &j->active[j->active_count++];
+            a->id = id;
+            a->len = len;
+            a->bytes = bytes;
+        }
+    }
+    mutex_unlock(&j->lock);
+    if (id == 0) free(bytes);
+    return id;
+}
+
+/**
+ * Espera as intenções registradas até aqui chegarem ao disco
+ *
+ * @return 0 em caso de sucesso, -1 se o diário não pode ser gravado
+ */
+static inline int journal_commit(journal_t *j) {
+    mutex_lock(&j->lock);
+    int result = journal_sync_to(j, j->appended);
+    mutex_unlock(&j->lock);
+    return result;
+}
+
+/**
+ * Registra o fim de uma operação com o estado do nome no índice
+ *
+ * @param id Id devolvido por journal_begin(), ou 0 para registrar só os
+ *           metadados (ex.: data aplicada a um arquivo já guardado)
+ *
+ * Por que foi feito:
+ * - Chamada depois de atualizar o índice; o registro fica no buffer até a
+ *   próxima confirmação ou até a thread do diário gravá-lo
+ */
+static inline void journal_end(journal_t *j, uint64_t id, const char *name) {
+    journal_record_t r;
+    uint8_t bytes[JOURNAL_RECORD_MAX];
+
+    if (strlen(name) > PROTO_MAX_NAME) return;
+    memset(&r, 0, sizeof(r));
+    r.type = JOURNAL_DONE;
+    r.id = id;
+    strcpy(r.name, name);
+    r.present = index_lookup(j->idx, name, &r.meta) == 0;
+    size_t len = journal_encode(&r, bytes);
+
+    mutex_lock(&j->lock);
+    for (size_t i = 0; id != 0 && i < j->active_count; i++) {
+        if (j->active[i].id != id) continue;
+        free(j->active[i].bytes);
+        j->active[i] = j->active[--j->active_count];
+        break;
+    }
+    if (!j->failed) journal_buffer_add(j, bytes, len);
+    if (!j->checkpointing && j->file_size + j->len > JOURNAL_CHECKPOINT_BYTES) {
+        j->checkpointing = 1;
+        cond_signal(&j->wake);
+    }
+    mutex_unlock(&j->lock);
+}
+
+/**
+ * Registra que uma operação registrada com journal_begin() não aconteceu
+ *
+ * Por que foi feito:
+ * - Um lote que falhou no meio desiste dos arquivos que ainda não
+ *   trocaram de nome; o DONE sem nome não muda a tabela na recuperação
+ */
+static inline void journal_cancel(journal_t *j, uint64_t id) {
+    journal_end(j, id, "");
+}
+
+/*--------------------------------------------------------------
+ * PONTO DE CONTROLE
+ *------------------------------------------------------------*/
+
+/**
+ * Grava um arquivo inteiro com troca atômica de nome
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+static inline int journal_write_file(const journal_t *j, const char *path, const uint8_t *data, size_t len) {
+    char temp[INDEX_PATH_MAX];
+    io_vec_t iov;
+
+    if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp)) return -1;
+    int fd = file_open_write(temp, 1);
+    if (fd < 0) return -1;
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    int failed = file_pwritev(fd, &iov, 1, 0) != 0 || file_sync(fd) != 0;
+    file_close(fd);
+    if (failed || file_replace(temp, path) != 0) {
+        remove(temp);
+        return -1;
+    }
+    return dir_sync(j->dir);
+}
+
+/**
+ * Grava o índice inteiro como ponto de controle de uma geração
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - As entradas são copiadas para um buffer com o lock do índice e
+ *   gravadas sem ele; consultas só esperam a cópia, não o disco
+ */
+static inline int journal_snapshot_save(journal_t *j, uint32_t generation) {
+    storage_index_t *idx = j->idx;
+    char path[INDEX_PATH_MAX];
+
+    if (journal_path(j, path, 0, "") != 0) return -1;
+    mutex_lock(&idx->lock);
+    const index_table_t *t = &idx->table;
+    size_t size = 20 + 4 + t->count * 27 + t->name_bytes;   // name_bytes conta o '\0' de cada nome
+    for (size_t i = 0; i < t->count; i++) size += t->entries[i].digest_len;
+    uint8_t *data = (uint8_t *)malloc(size);
+    uint8_t *p = data;
+    if (data != NULL) {
+        memcpy(p, JOURNAL_SNAPSHOT_MAGIC, 8);
+        put_u32(p + 8, generation);
+        put_u64(p + 12, t->count);
+        p += 20;
+        for (size_t i = 0; i < t->count; i++) {
+            const index_entry_t *e = &t->entries[i];
+            size_t name_len = strlen(e->name);
+            p[0] = e->source;
+            p[1] = e->digest_len;
+            put_u16(p + 2, (uint16_t)name_len);
+            put_u64(p + 4, e->size);
+            put_u64(p + 12, (uint64_t)e->mtime);
+            put_u64(p + 20, e->inode);
+            memcpy(p + 28, e->digest, e->digest_len);
+            memcpy(p + 28 + e->digest_len, e->name, name_len);
+            p += 28 + e->digest_len + name_len;
+        }
+    }
+    mutex_unlock(&idx->lock);
+    if (data == NULL) return -1;
+
+    size = (size_t)(p - data) + 4;
+    put_u32(p, crc32c(0, data, (size_t)(p - data)));
+    int result = journal_write_file(j, path, data, size);
+    free(data);
+    return result;
+}
+
+/**
+ * Lê o ponto de controle para a tabela do índice (antes de index_start)
+ *
+ * @param generation Recebe a geração do primeiro diário a reaplicar
+ * @return Arquivos lidos, ou -1 se não há ponto de controle válido
+ */
+static inline long journal_snapshot_load(journal_t *j, uint32_t *generation) {
+    storage_index_t *idx = j->idx;
+    char path[INDEX_PATH_MAX];
+    char name[PROTO_MAX_NAME + 1];
+
+    int64_t size = journal_path(j, path, 0, "") == 0 ? file_size(path) : -1;
+    if (size < 24) return -1;
+    uint8_t *data = (uint8_t *)malloc((size_t)size);
+    int fd = data != NULL ? file_open_read(path) : -1;
+    int ok = fd >= 0 && file_pread(fd, data, (size_t)size, 0) == size &&
+             memcmp(data, JOURNAL_SNAPSHOT_MAGIC, 8) == 0 &&
+             crc32c(0, data, (size_t)size - 4) == get_u32(data + size - 4);
+    if (fd >= 0) file_close(fd);
+    if (!ok || index_table_init(&idx->table) != 0) {
+        free(data);
+        return -1;
+    }
+
+    *generation = get_u32(data + 8);
+    uint64_t count = get_u64(data + 12);
+    const uint8_t *p = data + 20, *end = data + size - 4;
+    uint64_t i;
+    for (i = 0; i < count && end - p >= 28; i++) {
+        size_t digest_len = p[1], name_len = get_u16(p + 2);
+        if (digest_len > LIST_HASH_MAX || name_len > PROTO_MAX_NAME || (size_t)(end - p) < 28 + digest_len + name_len) break;
+        memcpy(name, p + 28 + digest_len, name_len);
+        name[name_len] = '\0';
+        size_t before = idx->table.count;
+        if (p[0] < idx->source_count &&
+            index_table_put(&idx->table, name, p[0], get_u64(p + 4), (int64_t)get_u64(p + 12), get_u64(p + 20)) == 0 &&
+            idx->table.count > before) {
+            index_entry_t *e = &idx->table.entries[idx->table.count - 1];
+            memcpy(e->digest, p + 28, digest_len);
+            e->digest_len = (uint8_t)digest_len;
+        }
+        p += 28 + digest_len + name_len;
+    }
+    free(data);
+    if (i != count) {
+        index_table_free(&idx->table);
+        return -1;
+    }
+    return (long)idx->table.count;
+}
+
+/**
+ * Troca para o diário da geração seguinte e grava o ponto de controle
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - As intenções em andamento são copiadas para o diário novo antes do
+ *   ponto de controle: uma operação que termina depois dele continua
+ *   descrita no diário que a recuperação vai ler
+ * - O índice é gravado depois da troca, então tudo o que terminou no
+ *   diário antigo já está nele; os diários antigos só são apagados depois
+ *   que o ponto de controle está no disco
+ */
+static inline int journal_checkpoint(journal_t *j) {
+    char path[INDEX_PATH_MAX];
+
+    mutex_lock(&j->lock);
+    if (journal_sync_to(j, j->appended) != 0) {
+        mutex_unlock(&j->lock);
+        return -1;
+    }
+    while (j->flushing) cond_wait(&j->flushed, &j->lock);
+    j->flushing = 1;
+    uint32_t generation = j->generation + 1;
+    size_t copied = 0;
+    uint8_t *active = NULL;
+    for (size_t i = 0; i < j->active_count; i++) copied += j->active[i].len;
+    if (copied > 0 && (active = (uint8_t *)malloc(copied)) != NULL) {
+        copied = 0;
+        for (size_t i = 0; i < j->active_count; i++) {
+            memcpy(active + copied, j->active[i].bytes, j->active[i].len);
+            copied += j->active[i].len;
+        }
+    }
+    mutex_unlock(&j->lock);
+
+    int fd = (copied == 0 || active != NULL) && journal_path(j, path, generation, "") == 0 ? file_open_write(path, 1) : -1;
+    int failed = fd < 0;
+    if (!failed && copied > 0) {
+        io_vec_t iov;
+        iov.iov_base = active;
+        iov.iov_len = copied;
+        failed = file_pwritev(fd, &iov, 1, 0) != 0;
+    }
+    if (!failed) failed = file_sync(fd) != 0 || dir_sync(j->dir) != 0;
+    free(active);
+
+    mutex_lock(&j->lock);
+    int old = j->fd;
+    if (!failed) {
+        j->fd = fd;
+        j->generation = generation;
+        j->file_size = copied;
+    }
+    j->flushing = 0;
+    cond_broadcast(&j->flushed);
+    mutex_unlock(&j->lock);
+    if (failed) {
+        if (fd >= 0) {
+            file_close(fd);
+            remove(path);
+        }
+        return -1;
+    }
+    file_close(old);
+
+    if (journal_snapshot_save(j, generation) != 0) return -1;
+    for (uint32_t g = j->first; g < generation; g++) {
+        if (journal_path(j, path, g, "") == 0) remove(path);
+    }
+    mutex_lock(&j->lock);
+    j->first = generation;
+    j->checkpoints++;
+    mutex_unlock(&j->lock);
+    return 0;
+}
+
+/**
+ * Thread do diário: grava os DONEs acumulados e faz os pontos de controle
+ */
+static inline void *journal_main(void *arg) {
+    journal_t *j = (journal_t *)arg;
+
+    mutex_lock(&j->lock);
+    for (;;) {
+        if (!j->checkpointing) cond_wait_ms(&j->wake, &j->lock, JOURNAL_FLUSH_MS);
+        if (j->checkpointing) {
+            mutex_unlock(&j->lock);
+            if (journal_checkpoint(j) != 0) printf("Erro ao gravar o ponto de controle do índice.\n");
+            mutex_lock(&j->lock);
+            j->checkpointing = 0;
+        } else if (j->len > 0) {
+            journal_sync_to(j, j->appended);
+        }
+    }
+    mutex_unlock(&j->lock);
+    return NULL;
+}
+
+/*--------------------------------------------------------------
+ * RECUPERAÇÃO
+ *------------------------------------------------------------*/
+
+/**
+ * Reaplica um diário
+ *
+ * @param apply 1 para aplicar os DONEs à tabela (ponto de controle lido)
+ * @return 0 se o diário existe, -1 se não existe
+ */
+static inline int journal_replay(journal_t *j, uint32_t generation, int apply, journal_recovery_t *rec) {
+    char path[INDEX_PATH_MAX];
+    journal_record_t r;
+
+    int64_t size = journal_path(j, path, generation, "") == 0 ? file_size(path) : -1;
+    if (size < 0) return -1;
+    uint8_t *data = (uint8_t *)malloc(size > 0 ? (size_t)size : 1);
+    int fd = data != NULL ? file_open_read(path) : -1;
+    if (fd < 0 || (size > 0 && file_pread(fd, data, (size_t)size, 0) != size)) size = 0;
+    if (fd >= 0) file_close(fd);
+
+    // Um registro cortado (queda durante a gravação) encerra o diário
+    size_t used;
+    for (size_t pos = 0; data != NULL && (used = journal_decode(data + pos, (size_t)size - pos, &r)) > 0; pos += used) {
+        rec->records++;
+        if (r.id >= j->next_id) j->next_id = r.id + 1;
+        size_t i = 0;
+        while (i < j->pending_count && j->pending[i].id != r.id) i++;
+        if (r.type != JOURNAL_DONE) {
+            if (i == j->pending_count) {
+                journal_record_t *grown = (journal_record_t *)realloc(j->pending, (i + 1) * sizeof(journal_record_t));
+                if (grown == NULL) continue;
+                j->pending = grown;
+                j->pending_count++;
+            }
+            j->pending[i] = r;
+            continue;
+        }
+        if (r.id != 0 && i < j->pending_count) j->pending[i] = j->pending[--j->pending_count];
+        if (apply && r.name[0] != '\0') journal_apply(j->idx, &r);
+    }
+    free(data);
+    rec->journals++;
+    return 0;
+}
+
+/**
+ * Lê o ponto de controle, reaplica os diários e resolve as operações
+ * interrompidas (antes de index_start)
+ *
+ * @param dir Diretório de armazenamento
+ * @param idx Índice com as origens já registradas
+ * @param recover Desfaz ou termina uma operação sem DONE, no disco
+ *
+ * Por que foi feito:
+ * - Com ponto de controle, a tabela do índice fica pronta aqui e
+ *   index_start() não lê o diretório antes de aceitar conexões; sem ele
+ *   (primeira partida ou arquivo danificado) o índice é montado lendo o
+ *   diretório e o ponto de controle é gravado logo em seguida
+ */
+static inline void journal_open(journal_t *j, const char *dir, storage_index_t *idx,
+                                void (*recover)(const journal_record_t *r), journal_recovery_t *rec) {
+    uint64_t started = monotonic_ns();
+    uint32_t generation = 1;
+
+    memset(j, 0, sizeof(*j));
+    memset(rec, 0, sizeof(*rec));
+    mutex_init(&j->lock);
+    cond_init(&j->flushed);
+    cond_init(&j->wake);
+    snprintf(j->dir, sizeof(j->dir), "%s", dir);
+    j->idx = idx;
+    j->fd = -1;
+    j->next_id = 1;
+
+    long files = journal_snapshot_load(j, &generation);
+    rec->snapshot = files >= 0;
+    rec->files = files >= 0 ? (size_t)files : 0;
+    idx->preloaded = rec->snapshot;
+    if (generation == 0) generation = 1;
+    j->first = generation;
+    while (journal_replay(j, generation, rec->snapshot, rec) == 0) generation++;
+    j->generation = generation - 1;
+
+    for (size_t i = 0; i < j->pending_count; i++) {
+        recover(&j->pending[i]);
+        if (idx->preloaded) index_update(idx, j->pending[i].name);
+    }
+    rec->resolved = j->pending_count;
+    rec->ms = (double)(monotonic_ns() - started) / 1e6;
+}
+
+/**
+ * Abre o diário da próxima geração e inicia a thread (depois de index_start)
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - Cada operação resolvida na recuperação ganha o seu DONE: sem ele, uma
+ *   exclusão interrompida seria refeita numa próxima recuperação por cima
+ *   de um arquivo enviado depois com o mesmo nome
+ * - Sem ponto de controle lido, o índice recém-montado é gravado já
+ */
+static inline int journal_start(journal_t *j) {
+    char path[INDEX_PATH_MAX];
+    thread_t thread;
+
+    j->generation++;
+    if (journal_path(j, path, j->generation, "") != 0 || (j->fd = file_open_write(path, 1)) < 0) return -1;
+    for (size_t i = 0; i < j->pending_count; i++) journal_end(j, j->pending[i].id, j->pending[i].name);
+    free(j->pending);
+    j->pending = NULL;
+    j->pending_count = 0;
+    if (journal_commit(j) != 0 || dir_sync(j->dir) != 0) return -1;
+    if (!j->idx->preloaded) j->checkpointing = 1;
+    return thread_create(&thread, journal_main, j);
+}
+
+/**
+ * Lê os contadores do diário (métricas)
+ */
+static inline void journal_stats(journal_t *j, uint64_t *records, uint64_t *syncs, uint64_t *checkpoints) {
+    mutex_lock(&j->lock);
+    *records = j->records;
+    *syncs = j->syncs;
+    *checkpoints = j->checkpoints;
+    mutex_unlock(&j->lock);
+}
+
+#endif /* BIGFS_JOURNAL_H */
@@ -0,0 +1,899 @@
+/*******************************************************************************
+ * GERADOR DE CARGA DO SISTEMA DE TRANSFERÊNCIA DE ARQUIVOS
+ *
+ * Descrição: Abre várias conexões com o servidor e executa, sem interação,
+ *            uma mistura configurável de LIST/UPLOAD/DOWNLOAD/DELETE,
+ *            medindo vazão, latência (p50/p99/p999) e erros por operação.
+ *
+ * Funcionalidades:
+ * - N conexões simultâneas, uma thread por conexão
+ * - Mistura de operações e distribuição de tamanhos de arquivo por pesos
+ * - Execução reprodutível: a sequência de operações e tamanhos de cada
+ *   conexão sai de um gerador pseudoaleatório com a semente informada
+ * - Servidor opcional no próprio processo (o mesmo server.c, em loopback),
+ *   com as opções do servidor repassadas depois de "--"
+ * - Resultado em tabela e, opcionalmente, uma linha JSON por execução
+ *   acrescentada a um arquivo, para comparar execuções ao longo do tempo
+ *
+ * Compilação: gcc -O2 loadgen.c -o loadgen -pthread
+ *             (com zstd: -DBIGFS_WITH_ZSTD ... -lzstd)
+ ******************************************************************************/
+
+/*--------------------------------------------------------------
+ * INCLUSÕES DE BIBLIOTECAS
+ *------------------------------------------------------------*/
+#define BIGFS_SERVER_NO_MAIN
+#include "server.c"     // Servidor embutido (-S), protocolo, resumos e histogramas
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define LOAD_ADDRESS "127.0.0.1"        // Endereço padrão do servidor
+#define LOAD_CONNECTIONS 8              // Conexões simultâneas padrão
+#define LOAD_MAX_CONNECTIONS 1024       // Limite de conexões do gerador
+#define LOAD_SECONDS 10                 // Duração padrão da medição
+#define LOAD_PRELOAD 4                  // Arquivos enviados por conexão antes da medição
+#define LOAD_MIX "list=5,upload=30,download=55,delete=10" // Mistura padrão
+#define LOAD_SIZES "4K=40,64K=30,1M=20,16M=10"             // Distribuição padrão
+#define LOAD_MAX_SIZES 16               // Faixas da distribuição de tamanhos
+#define LOAD_STORAGE "loadgen_storage"  // Armazenamento padrão do servidor embutido
+#define LOAD_PREFIX "loadgen-"          // Prefixo dos arquivos criados pelo gerador
+#define LOAD_NAME_SIZE 64               // Tamanho dos nomes gerados
+#define LOAD_RECONNECTS 3               // Tentativas de reconexão após uma queda
+#define LOAD_RETRY_MS 500               // Espera entre tentativas de reconexão
+#define LOAD_SERVER_ARGS 64             // Opções repassadas ao servidor embutido
+
+/**
+ * Operações da mistura (também as posições dos histogramas de latência)
+ */
+typedef enum {
+    LOAD_LIST,
+    LOAD_UPLOAD,
+    LOAD_DOWNLOAD,
+    LOAD_DELETE,
+    LOAD_OPS
+} load_op_t;
+
+static const char *load_op_names[LOAD_OPS] = { "list", "upload", "download", "delete" };
+
+#define LOAD_ERRORS 0                   // Contador de erros: LOAD_ERRORS + operação
+#define LOAD_BYTES LOAD_OPS             // Bytes de arquivo: LOAD_BYTES + operação
+
+/*--------------------------------------------------------------
+ * CONFIGURAÇÃO E ESTADO DO GERADOR
+ *------------------------------------------------------------*/
+
+/**
+ * Parâmetros ajustáveis pela linha de comando
+ */
+typedef struct {
+    char address[64];           // IP do servidor
+    int port;                   // Porta do servidor
+    int connections;            // Conexões simultâneas
+    int seconds;                // Duração da medição (sem efeito com operations)
+    long operations;            // Total de operações (0: mede por tempo)
+    int preload;                // Arquivos enviados por conexão antes de medir
+    uint64_t seed;              // Semente dos sorteios
+    const char *mix;            // Mistura ("list=5,upload=30,...")
+    const char *sizes;          // Distribuição de tamanhos ("4K=40,1M=60")
+    const char *storage;        // Armazenamento do servidor embutido
+    int embedded;               // Roda o servidor no próprio processo
+    const char *server_log;     // Log do servidor embutido (NULL: descarta)
+    const char *json;           // Arquivo JSON Lines ("-": saída padrão)
+    const char *label;          // Rótulo da execução no JSON
+    int weights[LOAD_OPS];      // Pesos da mistura
+    uint64_t size_values[LOAD_MAX_SIZES];   // Tamanhos da distribuição
+    int size_weights[LOAD_MAX_SIZES];       // Peso de cada tamanho
+    int size_count;
+    char *server_args[LOAD_SERVER_ARGS];    // Opções extras do servidor embutido
+    int server_argc;
+} load_config_t;
+
+static load_config_t load = { LOAD_ADDRESS, PORT, LOAD_CONNECTIONS, LOAD_SECONDS, 0, LOAD_PRELOAD, 1,
+                              LOAD_MIX, LOAD_SIZES, LOAD_STORAGE, 0, NULL, NULL, NULL,
+                              { 0 }, { 0 }, { 0 }, 0, { NULL }, 0 };
+
+/**
+ * Conteúdo dos uploads
+ *
+ * Por que foi feito:
+ * - Todos os uploads repetem o mesmo bloco de bytes pseudoaleatórios (não
+ *   comprimíveis); o resumo de cada tamanho é calculado uma vez no início
+ *   e a medição não inclui o custo de gerar nem de resumir os dados
+ */
+static uint8_t *load_data;                          // FRAME_DATA_CHUNK bytes
+static uint8_t load_digests[LOAD_MAX_SIZES][CHECKSUM_SIZE];
+
+/**
+ * Largada das conexões
+ *
+ * Por que foi feito:
+ * - Conexão e arquivos iniciais ficam fora da medição; todas as conexões
+ *   começam juntas quando a última está pronta
+ */
+static struct {
+    mutex_t lock;
+    cond_t changed;
+    int ready;                  // Conexões prontas para começar
+    int started;                // Medição em andamento
+    uint64_t start_ns;          // Início da medição
+    uint64_t deadline_ns;       // Fim da medição por tempo
+} load_gate;
+
+/**
+ * Estado de uma conexão do gerador
+ */
+typedef struct {
+    int index;                  // Posição da conexão (entra nos nomes e na semente)
+    SOCKET sock;
+    uint64_t rng;               // Estado do gerador pseudoaleatório
+    uint32_t request_id;        // Último id de pedido desta conexão
+    long quota;                 // Operações desta conexão (-1: por tempo)
+    char (*files)[LOAD_NAME_SIZE];  // Arquivos que esta conexão enviou
+    int *file_sizes;            // Faixa de tamanho de cada arquivo
+    int file_count, file_cap;
+    unsigned next_name;         // Número do próximo arquivo enviado
+    uint8_t *buffer;            // Respostas, páginas de LIST e dados baixados
+    metrics_shard_t *stats;     // Erros, bytes e latências (só desta thread)
+    uint64_t finished_ns;       // Fim da última operação medida
+    int lost;                   // Conexão perdida sem conseguir reconectar
+} load_worker_t;
+
+/*--------------------------------------------------------------
+ * DECLARAÇÕES DE FUNÇÕES
+ *------------------------------------------------------------*/
+
+/**
+ * Exibe as opções do gerador
+ */
+void load_usage(const char *program) {
+    printf("Uso: %s [opções] [-- opções do servidor embutido]\n", program);
+    printf("  -a <endereço>  IP do servidor (padrão %s)\n", LOAD_ADDRESS);
+    printf("  -p <porta>     Porta do servidor (padrão %d)\n", PORT);
+    printf("  -c <conexões>  Conexões simultâneas (padrão %d)\n", LOAD_CONNECTIONS);
+    printf("  -t <segundos>  Duração da medição (padrão %d)\n", LOAD_SECONDS);
+    printf("  -n <operações> Total de operações em vez de duração\n");
+    printf("  -m <mistura>   Pesos das operações (padrão %s)\n", LOAD_MIX);
+    printf("  -s <tamanhos>  Pesos dos tamanhos de arquivo (padrão %s)\n", LOAD_SIZES);
+    printf("  -f <arquivos>  Arquivos enviados por conexão antes de medir (padrão %d)\n", LOAD_PRELOAD);
+    printf("  -k <semente>   Semente dos sorteios (padrão 1)\n");
+    printf("  -S             Roda o servidor no próprio processo, em loopback\n");
+    printf("  -d <diretório> Armazenamento do servidor embutido (padrão %s)\n", LOAD_STORAGE);
+    printf("  -L <arquivo>   Log do servidor embutido (padrão: descartado)\n");
+    printf("  -j <arquivo>   Acrescenta o resultado como uma linha JSON (\"-\": saída padrão)\n");
+    printf("  -r <rótulo>    Rótulo da execução no JSON\n");
+}
+
+/**
+ * Converte "<número>[K|M|G]" em bytes
+ *
+ * @return 0 em caso de sucesso, -1 se o valor é inválido
+ */
+int load_parse_bytes(const char *text, uint64_t *bytes) {
+    char *end;
+    double value = strtod(text, &end);
+
+    if (end == text || value < 0) return -1;
+    if (*end == 'K' || *end == 'k') value *= 1024.0, end++;
+    else if (*end == 'M' || *end == 'm') value *= 1024.0 * 1024.0, end++;
+    else if (*end == 'G' || *end == 'g') value *= 1024.0 * 1024.0 * 1024.0, end++;
+    if (*end != '\0') return -1;
+    *bytes = (uint64_t)value;
+    return 0;
+}
+
+/**
+ * Lê uma lista "chave=peso,chave=peso"
+ *
+ * @param parse Converte cada chave em uma posição (ou -1 se inválida)
+ * @param max Número de posições
+ * @return Número de pares lidos, ou -1 se a lista é inválida
+ */
+int load_parse_weights(const char *text, int *weights, int max,
+                       int (*parse)(const char *key, int count)) {
+    char copy[512];
+    int count = 0, total = 0;
+
+    if (strlen(text) >= sizeof(copy)) return -1;
+    snprintf(copy, sizeof(copy), "%s", text);
+    for (char *item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        char *eq = strchr(item, '=');
+        if (eq == NULL) return -1;
+        *eq = '\0';
+        int pos = parse(item, count);
+        int weight = atoi(eq + 1);
+        if (pos < 0 || pos >= max || weight < 0) return -1;
+        weights[pos] = weight;
+        total += weight;
+        count++;
+    }
+    return count > 0 && total > 0 ? count : -1;
+}
+
+/**
+ * Posição de uma operação da mistura pelo nome
+ */
+int load_parse_op(const char *key, int count) {
+    (void)count;
+    for (int op = 0; op < LOAD_OPS; op++) {
+        if (strcmp(key, load_op_names[op]) == 0) return op;
+    }
+    return -1;
+}
+
+/**
+ * Posição de um tamanho da distribuição (na ordem em que aparece)
+ */
+int load_parse_size(const char *key, int count) {
+    if (count >= LOAD_MAX_SIZES || load_parse_bytes(key, &load.size_values[count]) != 0) return -1;
+    return count;
+}
+
+/**
+ * Lê as opções da linha de comando
+ *
+ * @return 0 se as opções são válidas, -1 caso contrário
+ *
+ * Por que foi feito:
+ * - Tudo o que muda o resultado (mistura, tamanhos, semente, conexões)
+ *   vem da linha de comando, para que a mesma execução possa ser repetida
+ */
+int load_parse_arguments(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(argv[i], "--") == 0) {
+            // O restante vai para o servidor embutido
+            for (i++; i < argc && load.server_argc < LOAD_SERVER_ARGS; i++) {
+                load.server_args[load.server_argc++] = argv[i];
+            }
+            if (i < argc) return -1;
+            break;
+        }
+        if (strcmp(argv[i], "-S") == 0) {
+            load.embedded = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-h") == 0) return -1;
+        if (value == NULL) return -1;
+
+        if (strcmp(argv[i], "-a") == 0) snprintf(load.address, sizeof(load.address), "%s", value);
+        else if (strcmp(argv[i], "-p") == 0) load.port = atoi(value);
+        else if (strcmp(argv[i], "-c") == 0) load.connections = atoi(value);
+        else if (strcmp(argv[i], "-t") == 0) load.seconds = atoi(value);
+        else if (strcmp(argv[i], "-n") == 0) load.operations = atol(value);
+        else if (strcmp(argv[i], "-m") == 0) load.mix = value;
+        else if (strcmp(argv[i], "-s") == 0) load.sizes = value;
+        else if (strcmp(argv[i], "-f") == 0) load.preload = atoi(value);
+        else if (strcmp(argv[i], "-k") == 0) load.seed = strtoull(value, NULL, 10);
+        else if (strcmp(argv[i], "-d") == 0) load.storage = value;
+        else if (strcmp(argv[i], "-L") == 0) load.server_log = value;
+        else if (strcmp(argv[i], "-j") == 0) load.json = value;
+        else if (strcmp(argv[i], "-r") == 0) load.label = value;
+        else return -1;
+        i++;
+    }
+
+    if (load_parse_weights(load.mix, load.weights, LOAD_OPS, load_parse_op) < 0) return -1;
+    load.size_count = load_parse_weights(load.sizes, load.size_weights, LOAD_MAX_SIZES, load_parse_size);
+    if (load.size_count < 0) return -1;
+    if (load.port <= 0 || load.port > 65535 || load.connections <= 0 ||
+        load.connections > LOAD_MAX_CONNECTIONS || load.seconds <= 0 ||
+        load.operations < 0 || load.preload < 0) return -1;
+    return 0;
+}
+
+/*--------------------------------------------------------------
+ * SORTEIOS REPRODUTÍVEIS
+ *------------------------------------------------------------*/
+
+/**
+ * Próximo número do gerador pseudoaleatório (xorshift64*)
+ */
+uint64_t load_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+/**
+ * Estado inicial do gerador de uma conexão (splitmix64 da semente)
+ *
+ * Por que foi feito:
+ * - Sementes vizinhas (a mesma semente com índices 0, 1, 2...) precisam
+ *   gerar sequências sem relação entre si
+ */
+uint64_t load_seed(uint64_t seed, int index) {
+    uint64_t z = seed + (uint64_t)(index + 1) * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+/**
+ * Sorteia uma posição de acordo com os pesos
+ */
+int load_pick(uint64_t *state, const int *weights, int count) {
+    int total = 0;
+    for (int i = 0; i < count; i++) total += weights[i];
+
+    int r = (int)(load_random(state) % (uint64_t)total);
+    for (int i = 0; i < count; i++) {
+        if (r < weights[i]) return i;
+        r -= weights[i];
+    }
+    return count - 1;
+}
+
+/**
+ * Prepara o conteúdo dos uploads e o resumo de cada tamanho
+ *
+ * @return 0 em caso de sucesso, -1 se faltou memória
+ */
+int load_prepare_data() {
+    uint64_t state = load_seed(load.seed, -1);
+
+    load_data = (uint8_t *)malloc(FRAME_DATA_CHUNK);
+    if (load_data == NULL) return -1;
+    for (size_t i = 0; i < FRAME_DATA_CHUNK; i += 8) put_u64(load_data + i, load_random(&state));
+
+    for (int k = 0; k < load.size_count; k++) {
+        checksum_t sum;
+        checksum_init(&sum);
+        for (uint64_t done = 0; done < load.size_values[k]; ) {
+            uint64_t left = load.size_values[k] - done;
+            size_t len = left < FRAME_DATA_CHUNK ? (size_t)left : FRAME_DATA_CHUNK;
+            checksum_update(&sum, load_data, len);
+            done += len;
+        }
+        checksum_final(&sum, load_digests[k]);
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------
+ * OPERAÇÕES NO SERVIDOR
+ *------------------------------------------------------------*/
+
+/**
+ * Abre uma conexão com o servidor
+ *
+ * @return Socket conectado, ou INVALID_SOCKET em caso de erro
+ */
+SOCKET load_connect() {
+    struct sockaddr_in addr;
+    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (s == INVALID_SOCKET) return INVALID_SOCKET;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(load.address);
+    addr.sin_port = htons((uint16_t)load.port);
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    net_set_nodelay(s);
+    return s;
+}
+
+/**
+ * Aguarda a resposta OK/ERROR de um pedido
+ *
+ * @return 1 para OK, 0 para ERROR, -1 se a conexão falhou
+ */
+int load_reply(load_worker_t *w, uint32_t id) {
+    frame_header_t h;
+
+    if (proto_recv_frame(w->sock, &h, (char *)w->buffer, FRAME_MAX_CONTROL + 1) != 0 || h.request_id != id) {
+        return -1;
+    }
+    return h.opcode == OP_OK ? 1 : h.opcode == OP_ERROR ? 0 : -1;
+}
+
+/**
+ * Lista todos os arquivos do servidor, página por página
+ *
+ * @param bytes Recebe o número de entradas listadas
+ * @return 1 em caso de sucesso, -1 se a conexão falhou
+ */
+int load_list(load_worker_t *w, uint64_t *bytes) {
+    frame_header_t h;
+    uint8_t request[6 + PROTO_MAX_NAME];
+    char cursor[PROTO_MAX_NAME] = "";
+    list_entry_t entry;
+
+    *bytes = 0;
+    do {
+        uint32_t id = ++w->request_id;
+        size_t cursor_len = strlen(cursor);
+
+        // Pedido LIST: tamanho da página, prefixo vazio e cursor
+        put_u32(request, LIST_PAGE_DEFAULT);
+        put_u16(request + 4, 0);
+        memcpy(request + 6, cursor, cursor_len);
+        if (proto_send_frame(w->sock, OP_LIST, 0, id, request, 6 + cursor_len) != 0) return -1;
+
+        do {
+            if (proto_recv_header(w->sock, &h) != 0 || h.opcode != OP_DATA || h.request_id != id ||
+                h.length > FRAME_MAX_CONTROL || net_recv_all(w->sock, w->buffer, (size_t)h.length) != 0) {
+                return -1;
+            }
+            size_t pos = 0, used;
+            while (pos < h.length && (used = list_entry_decode(w->buffer + pos, (size_t)h.length - pos, &entry)) > 0) {
+                memcpy(cursor, entry.name, strlen(entry.name) + 1);
+                pos += used;
+                (*bytes)++;
+            }
+        } while (!(h.flags & FLAG_END));
+    } while (h.flags & FLAG_MORE);
+    return 1;
+}
+
+/**
+ * Envia um arquivo com um dos tamanhos da distribuição
+ *
+ * @param size_class Posição do tamanho na distribuição
+ * @return 1 para OK, 0 se o servidor recusou, -1 se a conexão falhou
+ */
+int load_upload(load_worker_t *w, const char *name, int size_class) {
+    uint8_t request[8 + PROTO_MAX_NAME];
+    size_t name_len = strlen(name);
+    uint64_t size = load.size_values[size_class];
+    uint64_t sent = 0;
+    uint32_t id = ++w->request_id;
+
+    // Pedido UPLOAD, quadros DATA com o conteúdo e o resumo pré-calculado
+    put_u64(request, size);
+    memcpy(request + 8, name, name_len);
+    if (proto_send_frame(w->sock, OP_UPLOAD, 0, id, request, 8 + name_len) != 0) return -1;
+    do {
+        size_t len = size - sent < FRAME_DATA_CHUNK ? (size_t)(size - sent) : FRAME_DATA_CHUNK;
+        if (proto_send_frame(w->sock, OP_DATA, 0, id, load_data, len) != 0) return -1;
+        sent += len;
+    } while (sent < size);
+    if (proto_send_frame(w->sock, OP_DATA, FLAG_END | FLAG_DIGEST, id,
+                         load_digests[size_class], CHECKSUM_SIZE) != 0) return -1;
+    return load_reply(w, id);
+}
+
+/**
+ * Baixa um arquivo, descartando os bytes
+ *
+ * @param expected Tamanho com que o arquivo foi enviado
+ * @param bytes Recebe os bytes recebidos
+ * @return 1 se chegou inteiro, 0 se o servidor recusou ou o tamanho não
+ *         confere, -1 se a conexão falhou
+ */
+int load_download(load_worker_t *w, const char *name, uint64_t expected, uint64_t *bytes) {
+    frame_header_t h;
+    uint32_t id = ++w->request_id;
+
+    *bytes = 0;
+    if (proto_send_frame(w->sock, OP_DOWNLOAD, 0, id, name, strlen(name)) != 0) return -1;
+    int result = load_reply(w, id);
+    if (result <= 0) return result;
+
+    // Quadros DATA crus (nenhum codec foi negociado) até o marcado com FLAG_END
+    do {
+        if (proto_recv_header(w->sock, &h) != 0 || h.opcode != OP_DATA || h.request_id != id) return -1;
+        for (uint64_t left = h.length; left > 0; ) {
+            size_t len = left < FRAME_DATA_CHUNK ? (size_t)left : FRAME_DATA_CHUNK;
+            if (net_recv_all(w->sock, w->buffer, len) != 0) return -1;
+            left -= len;
+            *bytes += len;
+        }
+    } while (!(h.flags & FLAG_END));
+    return *bytes == expected ? 1 : 0;
+}
+
+/**
+ * Exclui um arquivo do servidor
+ *
+ * @return 1 para OK, 0 se o servidor recusou, -1 se a conexão falhou
+ */
+int load_delete(load_worker_t *w, const char *name) {
+    uint32_t id = ++w->request_id;
+    if (proto_send_frame(w->sock, OP_DELETE, 0, id, name, strlen(name)) != 0) return -1;
+    return load_reply(w, id);
+}
+
+/**
+ * Envia um arquivo novo e o guarda na lista da conexão
+ *
+ * @param bytes Recebe o tamanho do arquivo
+ * @return Como load_upload()
+ */
+int load_add_file(load_worker_t *w, uint64_t *bytes) {
+    char name[LOAD_NAME_SIZE];
+    int size_class = load_pick(&w->rng, load.size_weights, load.size_count);
+
+    if (w->file_count == w->file_cap) {
+        int cap = w->file_cap ? w->file_cap * 2 : 64;
+        char (*files)[LOAD_NAME_SIZE] = realloc(w->files, (size_t)cap * sizeof(*files));
+        int *sizes = files != NULL ? (int *)realloc(w->file_sizes, (size_t)cap * sizeof(int)) : NULL;
+        if (files != NULL) w->files = files;
+        if (sizes == NULL) return 0;
+        w->file_sizes = sizes;
+        w->file_cap = cap;
+    }
+
+    snprintf(name, sizeof(name), LOAD_PREFIX "%llu-%d-%u", (unsigned long long)load.seed, w->index, w->next_name++);
+    *bytes = load.size_values[size_class];
+    int result = load_upload(w, name, size_class);
+    if (result == 1) {
+        memcpy(w->files[w->file_count], name, sizeof(name));
+        w->file_sizes[w->file_count++] = size_class;
+    }
+    return result;
+}
+
+/**
+ * Executa uma operação da mistura
+ *
+ * @param bytes Recebe os bytes de arquivo transferidos (entradas no LIST)
+ * @return 1 em caso de sucesso, 0 se o servidor recusou, -1 se a conexão
+ *         falhou
+ */
+int load_run(load_worker_t *w, load_op_t op, uint64_t *bytes) {
+    if (op == LOAD_LIST) return load_list(w, bytes);
+    if (op == LOAD_UPLOAD) return load_add_file(w, bytes);
+
+    int pick = (int)(load_random(&w->rng) % (uint64_t)w->file_count);
+    if (op == LOAD_DOWNLOAD) {
+        return load_download(w, w->files[pick], load.size_values[w->file_sizes[pick]], bytes);
+    }
+
+    *bytes = 0;
+    int result = load_delete(w, w->files[pick]);
+    if (result == 1) {
+        // Troca com o último para remover da lista sem deslocar
+        w->file_count--;
+        memcpy(w->files[pick], w->files[w->file_count], LOAD_NAME_SIZE);
+        w->file_sizes[pick] = w->file_sizes[w->file_count];
+    }
+    return result;
+}
+
+/**
+ * Substitui uma conexão perdida
+ *
+ * @return 0 se reconectou, -1 se todas as tentativas falharam
+ */
+int load_reconnect(load_worker_t *w) {
+    closesocket(w->sock);
+    for (int attempt = 0; attempt < LOAD_RECONNECTS; attempt++) {
+        if ((w->sock = load_connect()) != INVALID_SOCKET) return 0;
+        sleep_ms(LOAD_RETRY_MS);
+    }
+    return -1;
+}
+
+/**
+ * Indica se a conexão já fez a sua parte da medição
+ */
+int load_finished(load_worker_t *w, long done) {
+    if (w->quota >= 0) return done >= w->quota;
+    return monotonic_ns() >= load_gate.deadline_ns;
+}
+
+/**
+ * Thread de uma conexão do gerador
+ *
+ * Por que foi feito:
+ * - Cada conexão faz uma operação por vez, como o cliente; a latência é
+ *   o tempo do pedido até o fim da resposta, registrado só nos
+ *   histogramas desta thread (somados no fim, sem disputa durante a medição)
+ * - Download ou exclusão sem arquivo disponível vira upload, para que
+ *   a sequência não dependa do que outras conexões fizeram
+ */
+void *load_worker_main(void *arg) {
+    load_worker_t *w = (load_worker_t *)arg;
+    uint64_t bytes;
+    long done = 0;
+
+    // Conexão e arquivos iniciais, fora da medição
+    w->sock = load_connect();
+    w->lost = w->sock == INVALID_SOCKET;
+    for (int i = 0; i < load.preload && !w->lost; i++) {
+        if (load_add_file(w, &bytes) < 0) w->lost = 1;
+    }
+
+    mutex_lock(&load_gate.lock);
+    load_gate.ready++;
+    cond_broadcast(&load_gate.changed);
+    while (!load_gate.started) cond_wait(&load_gate.changed, &load_gate.lock);
+    mutex_unlock(&load_gate.lock);
+
+    while (!w->lost && !load_finished(w, done)) {
+        load_op_t op = (load_op_t)load_pick(&w->rng, load.weights, LOAD_OPS);
+        if ((op == LOAD_DOWNLOAD || op == LOAD_DELETE) && w->file_count == 0) op = LOAD_UPLOAD;
+
+        uint64_t start = monotonic_ns();
+        int result = load_run(w, op, &bytes);
+        uint64_t elapsed_us = (monotonic_ns() - start) / 1000;
+        done++;
+
+        if (result == 1) {
+            w->stats->hist[op][hist_index(elapsed_us)]++;
+            w->stats->hist_sum[op] += elapsed_us;
+            w->stats->counters[LOAD_BYTES + op] += bytes;
+        } else {
+            w->stats->counters[LOAD_ERRORS + op]++;
+        }
+        if (result < 0 && load_reconnect(w) != 0) w->lost = 1;
+    }
+    w->finished_ns = monotonic_ns();
+
+    // Remove o que sobrou, para não acumular arquivos entre execuções
+    for (int i = 0; i < w->file_count && !w->lost; i++) {
+        if (load_delete(w, w->files[i]) < 0) w->lost = 1;
+    }
+    if (w->sock != INVALID_SOCKET) {
+        proto_send_frame(w->sock, OP_BYE, 0, ++w->request_id, NULL, 0);
+        closesocket(w->sock);
+    }
+    return NULL;
+}
+
+/*--------------------------------------------------------------
+ * SERVIDOR EMBUTIDO
+ *------------------------------------------------------------*/
+
+/**
+ * Thread que distribui os eventos do servidor embutido
+ */
+void *load_server_main(void *arg) {
+    server_loop(*(SOCKET *)arg);
+    return NULL;
+}
+
+/**
+ * Inicia o servidor no próprio processo, na porta e no diretório do gerador
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - O servidor embutido é o mesmo código do executável do servidor (as
+ *   mesmas opções valem depois de "--"); sem rede entre máquinas nem
+ *   outro processo, dá para medir e comparar execuções localmente
+ */
+int load_start_server() {
+    static SOCKET server_socket;
+    char port[16];
+    char *args[LOAD_SERVER_ARGS + 5];
+    int count = 0;
+    thread_t thread;
+
+    snprintf(port, sizeof(port), "%d", load.port);
+    args[count++] = "server";
+    args[count++] = "-p";
+    args[count++] = port;
+    args[count++] = "-d";
+    args[count++] = (char *)load.storage;
+    for (int i = 0; i < load.server_argc; i++) args[count++] = load.server_args[i];
+    args[count] = NULL;
+
+    server_socket = server_start(count, args);
+    if (server_socket == INVALID_SOCKET) return -1;
+    return thread_create(&thread, load_server_main, &server_socket);
+}
+
+/*--------------------------------------------------------------
+ * RELATÓRIO
+ *------------------------------------------------------------*/
+
+/**
+ * Escreve um texto como string JSON
+ */
+void load_json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        if (*p == '"' || *p == '\\') fprintf(out, "\\%c", *p);
+        else if (*p < 0x20) fprintf(out, "\\u%04x", *p);
+        else fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+/**
+ * Escreve o resultado de uma operação (ou do total) como objeto JSON
+ */
+void load_json_op(FILE *out, const metrics_shard_t *total, int op, double seconds) {
+    uint64_t count = metrics_count(total, op);
+    uint64_t errors = total->counters[LOAD_ERRORS + op];
+    double bytes = op == LOAD_LIST ? 0.0 : (double)total->counters[LOAD_BYTES + op];
+
+    fprintf(out, "{\"ops\":%llu,\"errors\":%llu,\"ops_per_s\":%.3f,\"mb_per_s\":%.3f,"
+            "\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f}",
+            (unsigned long long)count, (unsigned long long)errors, (double)count / seconds,
+            bytes / seconds / (1024.0 * 1024.0),
+            count > 0 ? (double)total->hist_sum[op] / (double)count / 1000.0 : 0.0,
+            (double)metrics_quantile(total, op, 0.50) / 1000.0,
+            (double)metrics_quantile(total, op, 0.99) / 1000.0,
+            (double)metrics_quantile(total, op, 0.999) / 1000.0);
+}
+
+/**
+ * Acrescenta o resultado da execução como uma linha JSON
+ *
+ * @return 0 em caso de sucesso, -1 se o arquivo não pôde ser aberto
+ *
+ * Por que foi feito:
+ * - Uma linha por execução, com todos os parâmetros que a reproduzem, num
+ *   arquivo que só cresce: execuções de versões diferentes do servidor
+ *   podem ser comparadas por scripts
+ */
+int load_write_json(FILE *report, const metrics_shard_t *total, double seconds) {
+    FILE *out = strcmp(load.json, "-") == 0 ? report : fopen(load.json, "a");
+    char server[96];
+
+    if (out == NULL) return -1;
+    if (load.embedded) snprintf(server, sizeof(server), "embutido");
+    else snprintf(server, sizeof(server), "%s:%d", load.address, load.port);
+
+    fprintf(out, "{\"label\":");
+    load_json_string(out, load.label != NULL ? load.label : "");
+    fprintf(out, ",\"time\":%lld,\"server\":", (long long)time(NULL));
+    load_json_string(out, server);
+    fprintf(out, ",\"connections\":%d,\"seconds\":%.3f,\"operations\":%ld,\"preload\":%d,\"seed\":%llu,\"mix\":",
+            load.connections, seconds, load.operations, load.preload, (unsigned long long)load.seed);
+    load_json_string(out, load.mix);
+    fprintf(out, ",\"sizes\":");
+    load_json_string(out, load.sizes);
+    fprintf(out, ",\"server_args\":");
+    char args[1024] = "";
+    for (int i = 0; i < load.server_argc; i++) {
+        size_t used = strlen(args);
+        snprintf(args + used, sizeof(args) - used, "%s%s", i > 0 ? " " : "", load.server_args[i]);
+    }
+    load_json_string(out, args);
+    for (int op = 0; op < LOAD_OPS; op++) {
+        fprintf(out, ",\"%s\":", load_op_names[op]);
+        load_json_op(out, total, op, seconds);
+    }
+    fprintf(out, "}\n");
+    if (out != report) fclose(out);
+    return 0;
+}
+
+/**
+ * Exibe a tabela de resultados
+ */
+void load_print_table(FILE *out, const metrics_shard_t *total, double seconds) {
+    uint64_t all_ops = 0, all_errors = 0;
+    double all_bytes = 0.0;
+
+    fprintf(out, "\n%d conexões, %.2f s, mistura %s, tamanhos %s, semente %llu\n", load.connections,
+            seconds, load.mix, load.sizes, (unsigned long long)load.seed);
+    fprintf(out, "%-10s %10s %8s %10s %10s %10s %10s %10s\n",
+            "operação", "ops", "erros", "ops/s", "MB/s", "p50 ms", "p99 ms", "p999 ms");
+    for (int op = 0; op < LOAD_OPS; op++) {
+        uint64_t count = metrics_count(total, op);
+        uint64_t errors = total->counters[LOAD_ERRORS + op];
+        double bytes = op == LOAD_LIST ? 0.0 : (double)total->counters[LOAD_BYTES + op];
+
+        if (count == 0 && errors == 0) continue;
+        fprintf(out, "%-10s %10llu %8llu %10.1f %10.1f %10.3f %10.3f %10.3f\n", load_op_names[op],
+                (unsigned long long)count, (unsigned long long)errors, (double)count / seconds,
+                bytes / seconds / (1024.0 * 1024.0), (double)metrics_quantile(total, op, 0.50) / 1000.0,
+                (double)metrics_quantile(total, op, 0.99) / 1000.0,
+                (double)metrics_quantile(total, op, 0.999) / 1000.0);
+        all_ops += count;
+        all_errors += errors;
+        all_bytes += bytes;
+    }
+    fprintf(out, "%-10s %10llu %8llu %10.1f %10.1f\n", "total", (unsigned long long)all_ops,
+            (unsigned long long)all_errors, (double)all_ops / seconds, all_bytes / seconds / (1024.0 * 1024.0));
+}
+
+/*******************************************************************************
+ * FUNÇÃO PRINCIPAL
+ ******************************************************************************/
+int main(int argc, char *argv[]) {
+    FILE *report = stdout;      // Saída do relatório (a original, com o servidor embutido)
+
+    set_console_encoding();
+    setlocale(LC_NUMERIC, "C");  // Ponto decimal no JSON e na tabela, em qualquer idioma
+
+    if (load_parse_arguments(argc, argv) != 0) {
+        load_usage(argv[0]);
+        return 1;
+    }
+    if (load_prepare_data() != 0) {
+        printf("Memória insuficiente.\n");
+        return 1;
+    }
+
+    if (load.embedded) {
+        // O log do servidor (uma linha por pedido) sai da saída padrão
+        if ((report = stdout_divert(load.server_log)) == NULL) {
+            printf("Não foi possível desviar o log do servidor.\n");
+            return 1;
+        }
+        snprintf(load.address, sizeof(load.address), "127.0.0.1");
+        if (load_start_server() != 0) {
+            fprintf(report, "Não foi possível iniciar o servidor embutido na porta %d.\n", load.port);
+            return 1;
+        }
+    } else {
+        bufpool_init(0);
+        if (net_init() != 0) {
+            printf("Falha ao inicializar a rede. Código de erro: %d\n", net_error());
+            return 1;
+        }
+    }
+
+    load_worker_t *workers = (load_worker_t *)calloc((size_t)load.connections, sizeof(load_worker_t));
+    thread_t *threads = (thread_t *)calloc((size_t)load.connections, sizeof(thread_t));
+    metrics_shard_t *total = (metrics_shard_t *)calloc(1, sizeof(metrics_shard_t));
+    if (workers == NULL || threads == NULL || total == NULL) {
+        fprintf(report, "Memória insuficiente.\n");
+        return 1;
+    }
+
+    /*--------------------------------------------------------------
+     * CONEXÕES: PREPARAÇÃO E LARGADA JUNTAS
+     *------------------------------------------------------------*/
+    mutex_init(&load_gate.lock);
+    cond_init(&load_gate.changed);
+    fprintf(report, "Preparando %d conexões com %s:%d...\n", load.connections, load.address, load.port);
+    fflush(report);
+    for (int i = 0; i < load.connections; i++) {
+        load_worker_t *w = &workers[i];
+        w->index = i;
+        w->rng = load_seed(load.seed, i);
+        w->quota = load.operations > 0 ? load.operations / load.connections + (i < load.operations % load.connections) : -1;
+        w->buffer = (uint8_t *)malloc(FRAME_DATA_CHUNK);
+        w->stats = (metrics_shard_t *)calloc(1, sizeof(metrics_shard_t));
+        if (w->buffer == NULL || w->stats == NULL || thread_create(&threads[i], load_worker_main, w) != 0) {
+            fprintf(report, "Erro ao criar a conexão %d.\n", i);
+            return 1;
+        }
+    }
+
+    mutex_lock(&load_gate.lock);
+    while (load_gate.ready < load.connections) cond_wait(&load_gate.changed, &load_gate.lock);
+    load_gate.start_ns = monotonic_ns();
+    load_gate.deadline_ns = load_gate.start_ns + (uint64_t)load.seconds * 1000000000ull;
+    load_gate.started = 1;
+    cond_broadcast(&load_gate.changed);
+    mutex_unlock(&load_gate.lock);
+    if (load.operations > 0) fprintf(report, "Medindo %ld operações...\n", load.operations);
+    else fprintf(report, "Medindo por %d s...\n", load.seconds);
+    fflush(report);
+
+    /*--------------------------------------------------------------
+     * SOMA DOS RESULTADOS DAS CONEXÕES
+     *------------------------------------------------------------*/
+    uint64_t end_ns = load_gate.start_ns;
+    int lost = 0;
+    for (int i = 0; i < load.connections; i++) {
+        thread_join(threads[i]);
+        const metrics_shard_t *m = workers[i].stats;
+        for (int c = 0; c < 2 * LOAD_OPS; c++) total->counters[c] += m->counters[c];
+        for (int op = 0; op < LOAD_OPS; op++) {
+            for (int b = 0; b < HIST_BUCKETS; b++) total->hist[op][b] += m->hist[op][b];
+            total->hist_sum[op] += m->hist_sum[op];
+        }
+        if (workers[i].finished_ns > end_ns) end_ns = workers[i].finished_ns;
+        lost += workers[i].lost;
+    }
+    double seconds = (double)(end_ns - load_gate.start_ns) / 1e9;
+    if (seconds <= 0.0) seconds = 1e-9;
+
+    load_print_table(report, total, seconds);
+    if (lost > 0) fprintf(report, "%d conexão(ões) perdida(s) sem conseguir reconectar.\n", lost);
+    if (load.json != NULL && load_write_json(report, total, seconds) != 0) {
+        fprintf(report, "Não foi possível gravar o resultado em %s.\n", load.json);
+    }
+    fflush(report);
+
+    uint64_t errors = 0;
+    for (int op = 0; op < LOAD_OPS; op++) errors += total->counters[LOAD_ERRORS + op];
+    return lost > 0 || errors > 0 ? 2 : 0;
+}
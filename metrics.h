@@ -0,0 +1,420 @@
+/*******************************************************************************
+ * MÉTRICAS
+ *
+ * Descrição: Contadores e histogramas de latência registrados pelas threads
+ *            do servidor sem trava nem instrução atômica, somados apenas
+ *            quando alguém lê (endpoint HTTP ou relatório periódico).
+ *
+ * Organização:
+ * - Cada thread escreve na sua própria área (shard), alocada no primeiro
+ *   registro; somar 1 a um contador é um incremento comum em memória que
+ *   só aquela thread toca
+ * - Histogramas no estilo HDR: 16 faixas lineares por potência de 2, o que
+ *   mantém o erro relativo abaixo de 6,25% de 1 a 2^32 (em microssegundos,
+ *   de 1 µs a mais de uma hora) com 464 posições por histograma
+ * - A leitura soma todas as áreas; valores de 64 bits alinhados são lidos
+ *   inteiros nas plataformas suportadas, então o pior caso é um número
+ *   que ainda não inclui o último evento
+ * - Os nomes e rótulos ficam com quem registra (tabelas de metric_def_t);
+ *   este módulo só conhece posições numéricas
+ *
+ * Exposição:
+ * - metrics_render_*() monta o formato de texto do Prometheus
+ * - metrics_http_start() atende "GET /metrics" em 127.0.0.1, em uma thread
+ *   própria que nunca toca nas threads de atendimento
+ ******************************************************************************/
+#ifndef BIGFS_METRICS_H
+#define BIGFS_METRICS_H
+
+#include <stdarg.h>
+#include "platform.h"
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define METRICS_COUNTERS 48                 // Contadores por área
+#define METRICS_HISTOGRAMS 24               // Histogramas por área
+#define METRICS_MAX_SHARDS 256              // Threads com área própria
+#define HIST_SUB_BITS 4                     // 16 faixas por potência de 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 32                    // Maior valor: 2^32 - 1
+#define HIST_BUCKETS (HIST_SUB + (HIST_MAX_BITS - HIST_SUB_BITS) * HIST_SUB)
+#define METRICS_HTTP_REQUEST 2048           // Bytes lidos do pedido HTTP
+
+/*--------------------------------------------------------------
+ * ESTRUTURAS
+ *------------------------------------------------------------*/
+
+/**
+ * Contadores e histogramas de uma thread (ou a soma de todas)
+ */
+typedef struct {
+    uint64_t counters[METRICS_COUNTERS];
+    uint64_t hist[METRICS_HISTOGRAMS][HIST_BUCKETS];
+    uint64_t hist_sum[METRICS_HISTOGRAMS];  // Soma dos valores (para a média)
+} metrics_shard_t;
+
+/**
+ * Nome e rótulos de uma posição, para a exposição
+ *
+ * Posições seguidas com o mesmo nome formam uma família (um HELP/TYPE só)
+ */
+typedef struct {
+    const char *name;           // Ex.: "bigfs_errors_total"
+    const char *labels;         // Ex.: "type=\"not_found\"" (NULL: sem rótulos)
+    const char *help;
+    double scale;               // Divisor do valor exposto (ex.: 1e9 para ns -> s)
+} metric_def_t;
+
+/**
+ * Texto montado para a exposição
+ */
+typedef struct {
+    char *buf;
+    size_t len, cap;
+} metrics_text_t;
+
+/**
+ * Registro das áreas de todas as threads
+ */
+static struct {
+    mutex_t lock;
+    metrics_shard_t *shards[METRICS_MAX_SHARDS];
+    int count;
+    metrics_shard_t overflow;   // Compartilhada além de METRICS_MAX_SHARDS threads
+} metrics;
+
+static THREAD_LOCAL metrics_shard_t *metrics_local;
+
+/*--------------------------------------------------------------
+ * REGISTRO
+ *------------------------------------------------------------*/
+
+/**
+ * Prepara o registro (antes de criar as threads)
+ */
+static inline void metrics_init(void) {
+    mutex_init(&metrics.lock);
+    metrics.count = 0;
+}
+
+/**
+ * Cria a área da thread atual
+ *
+ * Por que foi feito:
+ * - Fica fora do caminho rápido: roda uma vez por thread
+ */
+static inline metrics_shard_t *metrics_attach(void) {
+    metrics_shard_t *m = (metrics_shard_t *)calloc(1, sizeof(metrics_shard_t));
+
+    mutex_lock(&metrics.lock);
+    if (m != NULL && metrics.count < METRICS_MAX_SHARDS) {
+        metrics.shards[metrics.count++] = m;
+    } else {
+        // Threads demais (ou sem memória): dividem uma área; contagens podem se perder
+        free(m);
+        m = &metrics.overflow;
+    }
+    mutex_unlock(&metrics.lock);
+    metrics_local = m;
+    return m;
+}
+
+static inline metrics_shard_t *metrics_shard(void) {
+    metrics_shard_t *m = metrics_local;
+    return m != NULL ? m : metrics_attach();
+}
+
+/**
+ * Soma v a um contador
+ */
+static inline void metrics_add(int id, uint64_t v) {
+    metrics_shard()->counters[id] += v;
+}
+
+/**
+ * Posição de um valor no histograma
+ */
+static inline int hist_index(uint64_t v) {
+    if (v < HIST_SUB) return (int)v;
+    if (v >> HIST_MAX_BITS) v = ((uint64_t)1 << HIST_MAX_BITS) - 1;
+#ifdef _MSC_VER
+    unsigned long msb;
+    _BitScanReverse64(&msb, v);
+#else
+    int msb = 63 - __builtin_clzll(v);
+#endif
+    int shift = (int)msb - HIST_SUB_BITS;
+    return HIST_SUB + shift * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+/**
+ * Maior valor que cai em uma posição do histograma
+ */
+static inline uint64_t hist_upper(int index) {
+    if (index < HIST_SUB) return (uint64_t)index;
+    int shift = (index - HIST_SUB) / HIST_SUB;
+    uint64_t low = (uint64_t)(HIST_SUB + (index - HIST_SUB) % HIST_SUB) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+/**
+ * Registra um valor em um histograma
+ */
+static inline void metrics_record(int id, uint64_t v) {
+    metrics_shard_t *m = metrics_shard();
+    m->hist[id][hist_index(v)]++;
+    m->hist_sum[id] += v;
+}
+
+/*--------------------------------------------------------------
+ * LEITURA
+ *------------------------------------------------------------*/
+
+/**
+ * Soma as áreas de todas as threads
+ */
+static inline void metrics_snapshot(metrics_shard_t *out) {
+    memset(out, 0, sizeof(*out));
+    mutex_lock(&metrics.lock);
+    for (int s = 0; s <= metrics.count; s++) {
+        const metrics_shard_t *m = s < metrics.count ? metrics.shards[s] : &metrics.overflow;
+        for (int i = 0; i < METRICS_COUNTERS; i++) out->counters[i] += m->counters[i];
+        for (int h = 0; h < METRICS_HISTOGRAMS; h++) {
+            for (int b = 0; b < HIST_BUCKETS; b++) out->hist[h][b] += m->hist[h][b];
+            out->hist_sum[h] += m->hist_sum[h];
+        }
+    }
+    mutex_unlock(&metrics.lock);
+}
+
+/**
+ * Quantidade de valores registrados em um histograma
+ */
+static inline uint64_t metrics_count(const metrics_shard_t *snap, int id) {
+    uint64_t total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) total += snap->hist[id][b];
+    return total;
+}
+
+/**
+ * Quantil de um histograma (ex.: 0.99)
+ *
+ * @return Limite superior da faixa que contém o quantil, 0 se vazio
+ */
+static inline uint64_t metrics_quantile(const metrics_shard_t *snap, int id, double q) {
+    uint64_t total = metrics_count(snap, id);
+    uint64_t seen = 0;
+
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(q * (double)total + 0.5);
+    if (rank < 1) rank = 1;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += snap->hist[id][b];
+        if (seen >= rank) return hist_upper(b);
+    }
+    return hist_upper(HIST_BUCKETS - 1);
+}
+
+/*--------------------------------------------------------------
+ * FORMATO DE TEXTO DO PROMETHEUS
+ *------------------------------------------------------------*/
+
+/**
+ * Acrescenta texto formatado
+ */
+static inline void metrics_printf(metrics_text_t *t, const char *fmt, ...) {
+    va_list args;
+
+    while (1) {
+        size_t room = t->cap - t->len;
+        va_start(args, fmt);
+        int n = t->buf != NULL ? vsnprintf(t->buf + t->len, room, fmt, args) : -1;
+        va_end(args);
+        if (n >= 0 && (size_t)n < room) {
+            t->len += (size_t)n;
+            return;
+        }
+        size_t cap = t->cap ? t->cap * 2 : 16384;
+        if (n >= 0 && cap < t->len + (size_t)n + 1) cap = t->len + (size_t)n + 1;
+        char *grown = (char *)realloc(t->buf, cap);
+        if (grown == NULL) return;  // Sem memória: a linha fica de fora
+        t->buf = grown;
+        t->cap = cap;
+    }
+}
+
+/**
+ * Cabeçalho de uma família, escrito só na primeira posição com o nome
+ */
+static inline void metrics_family(metrics_text_t *t, const metric_def_t *defs, int i, const char *type) {
+    if (i > 0 && strcmp(defs[i - 1].name, defs[i].name) == 0) return;
+    metrics_printf(t, "# HELP %s %s\n# TYPE %s %s\n", defs[i].name, defs[i].help, defs[i].name, type);
+}
+
+/**
+ * Escreve uma posição (contador ou medida instantânea)
+ */
+static inline void metrics_value(metrics_text_t *t, const metric_def_t *def, double value) {
+    if (def->labels != NULL) metrics_printf(t, "%s{%s} %.15g\n", def->name, def->labels, value / def->scale);
+    else metrics_printf(t, "%s %.15g\n", def->name, value / def->scale);
+}
+
+/**
+ * Escreve uma tabela de contadores
+ */
+static inline void metrics_render_counters(metrics_text_t *t, const metric_def_t *defs, int count,
+                                           const metrics_shard_t *snap) {
+    for (int i = 0; i < count; i++) {
+        metrics_family(t, defs, i, "counter");
+        metrics_value(t, &defs[i], (double)snap->counters[i]);
+    }
+}
+
+/**
+ * Escreve valores lidos por quem chama (de estruturas fora das áreas)
+ *
+ * @param type "gauge" ou "counter"
+ */
+static inline void metrics_render_values(metrics_text_t *t, const metric_def_t *defs, int count,
+                                         const double *values, const char *type) {
+    for (int i = 0; i < count; i++) {
+        metrics_family(t, defs, i, type);
+        metrics_value(t, &defs[i], values[i]);
+    }
+}
+
+/**
+ * Escreve uma tabela de histogramas (posições vazias ficam de fora)
+ *
+ * Por que foi feito:
+ * - As 464 faixas internas são agrupadas em limites 1-2-5 ("le"), o que
+ *   basta para histogram_quantile() sem milhares de séries por histograma
+ * - Os quantis exatos das faixas internas (p50, p99, p99.9) saem como uma
+ *   família à parte, "<nome>_quantile"
+ */
+static inline void metrics_render_histograms(metrics_text_t *t, const metric_def_t *defs, int count,
+                                             const metrics_shard_t *snap) {
+    static const double qs[] = { 0.5, 0.99, 0.999 };
+    const char *last = NULL;
+
+    for (int i = 0; i < count; i++) {
+        uint64_t total = metrics_count(snap, i);
+        if (total == 0 || defs[i].name == NULL) continue;
+        if (last == NULL || strcmp(last, defs[i].name) != 0) {
+            metrics_printf(t, "# HELP %s %s\n# TYPE %s histogram\n", defs[i].name, defs[i].help, defs[i].name);
+        }
+        last = defs[i].name;
+
+        const char *sep = defs[i].labels != NULL ? "," : "";
+        const char *labels = defs[i].labels != NULL ? defs[i].labels : "";
+        uint64_t seen = 0;
+        int b = 0;
+        for (uint64_t le = 1; le < ((uint64_t)1 << HIST_MAX_BITS); le *= 10) {
+            static const int steps[] = { 1, 2, 5 };
+            for (int k = 0; k < 3; k++) {
+                uint64_t bound = le * (uint64_t)steps[k];
+                while (b < HIST_BUCKETS && hist_upper(b) <= bound) seen += snap->hist[i][b++];
+                metrics_printf(t, "%s_bucket{%s%sle=\"%.15g\"} %llu\n", defs[i].name, labels, sep,
+                               (double)bound / defs[i].scale, (unsigned long long)seen);
+            }
+        }
+        metrics_printf(t, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", defs[i].name, labels, sep, (unsigned long long)total);
+        metrics_printf(t, "%s_sum{%s} %.15g\n", defs[i].name, labels, (double)snap->hist_sum[i] / defs[i].scale);
+        metrics_printf(t, "%s_count{%s} %llu\n", defs[i].name, labels, (unsigned long long)total);
+    }
+
+    last = NULL;
+    for (int i = 0; i < count; i++) {
+        if (metrics_count(snap, i) == 0 || defs[i].name == NULL) continue;
+        if (last == NULL || strcmp(last, defs[i].name) != 0) {
+            metrics_printf(t, "# HELP %s_quantile %s (quantis)\n# TYPE %s_quantile gauge\n",
+                           defs[i].name, defs[i].help, defs[i].name);
+        }
+        last = defs[i].name;
+        for (int k = 0; k < 3; k++) {
+            metrics_printf(t, "%s_quantile{%s%squantile=\"%g\"} %.15g\n", defs[i].name,
+                           defs[i].labels != NULL ? defs[i].labels : "", defs[i].labels != NULL ? "," : "",
+                           qs[k], (double)metrics_quantile(snap, i, qs[k]) / defs[i].scale);
+        }
+    }
+}
+
+/*--------------------------------------------------------------
+ * ENDPOINT HTTP
+ *------------------------------------------------------------*/
+
+/**
+ * Parâmetros da thread do endpoint
+ */
+typedef struct {
+    SOCKET sock;
+    void (*render)(metrics_text_t *t);
+} metrics_http_t;
+
+/**
+ * Laço do endpoint HTTP: uma conexão por vez, resposta e fechamento
+ *
+ * Por que foi feito:
+ * - Um coletor consulta a cada poucos segundos; atender em série, com
+ *   sockets bloqueantes, mantém o endpoint simples e fora do motor de eventos
+ */
+static inline void *metrics_http_main(void *arg) {
+    metrics_http_t *http = (metrics_http_t *)arg;
+    char request[METRICS_HTTP_REQUEST];
+
+    while (1) {
+        SOCKET client = accept(http->sock, NULL, NULL);
+        if (client == INVALID_SOCKET) continue;
+
+        // Só a primeira linha interessa: "GET /metrics HTTP/1.x"
+        int got = recv(client, request, sizeof(request) - 1, 0);
+        request[got > 0 ? got : 0] = '\0';
+        if (strncmp(request, "GET /metrics", 12) == 0 && (request[12] == ' ' || request[12] == '?')) {
+            metrics_text_t body = { NULL, 0, 0 };
+            char header[160];
+            http->render(&body);
+            int n = snprintf(header, sizeof(header),
+                             "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.len);
+            if (net_send_all(client, header, (size_t)n) == 0 && body.len > 0) net_send_all(client, body.buf, body.len);
+            free(body.buf);
+        } else {
+            static const char missing[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            net_send_all(client, missing, sizeof(missing) - 1);
+        }
+        closesocket(client);
+    }
+    return NULL;
+}
+
+/**
+ * Abre o endpoint de métricas em 127.0.0.1
+ *
+ * @param render Monta o texto de cada consulta
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+static inline int metrics_http_start(int port, void (*render)(metrics_text_t *t)) {
+    static metrics_http_t http;
+    struct sockaddr_in addr;
+    thread_t thread;
+
+    http.render = render;
+    http.sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (http.sock == INVALID_SOCKET) return -1;
+    net_set_reuseaddr(http.sock);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  // Só coletores na própria máquina
+    addr.sin_port = htons((unsigned short)port);
+    if (bind(http.sock, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(http.sock, 16) == SOCKET_ERROR ||
+        thread_create(&thread, metrics_http_main, &http) != 0) {
+        closesocket(http.sock);
+        return -1;
+    }
+    return 0;
+}
+
+#endif // BIGFS_METRICS_H
@@ -0,0 +1,1211 @@
+/*******************************************************************************
+ * CAMADA DE PORTABILIDADE PARA O SISTEMA DE TRANSFERÊNCIA DE ARQUIVOS
+ *
+ * Descrição: Isola as diferenças entre Winsock/Win32 e POSIX (Linux) para que
+ *            cliente e servidor compilem nas duas plataformas sem #ifdefs
+ *            espalhados pelo código.
+ *
+ * Funcionalidades:
+ * - Sockets (inicialização, modo não bloqueante, envio/recebimento completo)
+ * - Multiplexação de eventos (epoll no Linux, poll/WSAPoll nas demais)
+ * - Threads, mutex e variáveis de condição
+ * - Operações atômicas simples, memória alinhada e utilidades de sistema de
+ *   arquivos (escrita vetorizada, reserva de espaço, troca atômica)
+ *
+ * Todas as funções são "static inline" para que cada programa continue sendo
+ * compilado a partir de um único arquivo .c (ex.: gcc server.c -o server).
+ ******************************************************************************/
+#ifndef BIGFS_PLATFORM_H
+#define BIGFS_PLATFORM_H
+
+/*--------------------------------------------------------------
+ * INCLUSÕES DE BIBLIOTECAS
+ *------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <winsock2.h>   // Para sockets no Windows
+#include <ws2tcpip.h>   // Para socklen_t e WSAPoll
+#include <windows.h>    // Para threads e funções específicas do Windows
+#include <direct.h>     // Para manipulação de diretórios
+#include <io.h>         // Para _access, _open e _read
+#include <fcntl.h>      // Para _O_RDONLY e _O_BINARY
+#include <sys/stat.h>   // Para _stati64
+#include <sys/utime.h>  // Para _utime64
+#include <malloc.h>     // Para _aligned_malloc
+
+// Linkar com a biblioteca de sockets do Windows
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <utime.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#endif
+#endif
+
+/*--------------------------------------------------------------
+ * TIPOS E CONSTANTES EQUIVALENTES AO WINSOCK
+ *------------------------------------------------------------*/
+#ifdef _WIN32
+#define PATH_SEP "\\"
+
+/**
+ * Trecho de memória para escrita vetorizada (mesmos campos de struct iovec)
+ */
+typedef struct {
+    void *iov_base;
+    size_t iov_len;
+} io_vec_t;
+#else
+typedef struct iovec io_vec_t;
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#define SD_SEND SHUT_WR
+#define SD_BOTH SHUT_RDWR
+#define PATH_SEP "/"
+#ifndef MAX_PATH
+#define MAX_PATH 4096
+#endif
+#endif
+
+/*--------------------------------------------------------------
+ * SOCKETS
+ *------------------------------------------------------------*/
+
+/**
+ * Inicializa a pilha de rede da plataforma
+ *
+ * @return 0 em caso de sucesso, código de erro caso contrário
+ *
+ * Por que foi feito:
+ * - No Windows é obrigatório chamar WSAStartup antes de usar sockets
+ * - No POSIX ignoramos SIGPIPE para que um cliente desconectado não
+ *   derrube o processo durante um send()
+ */
+static inline int net_init(void) {
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        return WSAGetLastError();
+    }
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    return 0;
+}
+
+/**
+ * Libera os recursos da pilha de rede
+ */
+static inline void net_cleanup(void) {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+/**
+ * Retorna o último erro de socket da thread atual
+ */
+static inline int net_error(void) {
+#ifdef _WIN32
+    return WSAGetLastError();
+#else
+    return errno;
+#endif
+}
+
+/**
+ * Indica se o erro informado significa "tente novamente mais tarde"
+ *
+ * Por que foi feito:
+ * - Sockets não bloqueantes retornam códigos diferentes em cada plataforma
+ */
+static inline int net_would_block(int err) {
+#ifdef _WIN32
+    return err == WSAEWOULDBLOCK;
+#else
+    return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
+#endif
+}
+
+/**
+ * Coloca o socket em modo não bloqueante
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+static inline int net_set_nonblocking(SOCKET s) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(s, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(s, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+/**
+ * Habilita SO_REUSEADDR no socket de escuta
+ *
+ * Por que foi feito:
+ * - Permite reiniciar o servidor sem esperar o TIME_WAIT da porta
+ */
+static inline void net_set_reuseaddr(SOCKET s) {
+    int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+}
+
+/**
+ * Desliga o algoritmo de Nagle em um socket
+ *
+ * Por que foi feito:
+ * - Um upload pequeno termina com o quadro do resumo logo depois do
+ *   último quadro DATA; com Nagle, o resumo espera o ACK do servidor, que
+ *   o atrasa (ACK atrasado) e cada pedido levava uns 40 ms a mais
+ */
+static inline void net_set_nodelay(SOCKET s) {
+    int on = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+}
+
+/**
+ * Envia todo o buffer em um socket bloqueante
+ *
+ * @return 0 se todos os bytes foram enviados, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - send() pode enviar menos bytes que o solicitado; o laço garante
+ *   que nenhum dado seja perdido silenciosamente
+ */
+static inline int net_send_all(SOCKET s, const void *data, size_t len) {
+    const char *p = (const char *)data;
+    while (len > 0) {
+        int chunk = len > 0x40000000 ? 0x40000000 : (int)len;
+        int sent = send(s, p, chunk, 0);
+        if (sent == SOCKET_ERROR) {
+#ifndef _WIN32
+            if (errno == EINTR) continue;
+#endif
+            return -1;
+        }
+        p += sent;
+        len -= (size_t)sent;
+    }
+    return 0;
+}
+
+/**
+ * Recebe exatamente len bytes de um socket bloqueante
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro ou desconexão
+ */
+static inline int net_recv_all(SOCKET s, void *data, size_t len) {
+    char *p = (char *)data;
+    while (len > 0) {
+        int chunk = len > 0x40000000 ? 0x40000000 : (int)len;
+        int got = recv(s, p, chunk, 0);
+        if (got == 0) return -1;
+        if (got == SOCKET_ERROR) {
+#ifndef _WIN32
+            if (errno == EINTR) continue;
+#endif
+            return -1;
+        }
+        p += got;
+        len -= (size_t)got;
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------
+ * THREADS, MUTEX E VARIÁVEIS DE CONDIÇÃO
+ *------------------------------------------------------------*/
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)     // Variável com uma cópia por thread
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+
+typedef struct {
+    void *(*fn)(void *);
+    void *arg;
+} thread_start_t;
+
+static DWORD WINAPI thread_trampoline(LPVOID param) {
+    thread_start_t start = *(thread_start_t *)param;
+    free(param);
+    start.fn(start.arg);
+    return 0;
+}
+
+static inline int thread_create(thread_t *t, void *(*fn)(void *), void *arg) {
+    thread_start_t *start = (thread_start_t *)malloc(sizeof(thread_start_t));
+    if (start == NULL) return -1;
+    start->fn = fn;
+    start->arg = arg;
+    *t = CreateThread(NULL, 0, thread_trampoline, start, 0, NULL);
+    if (*t == NULL) {
+        free(start);
+        return -1;
+    }
+    return 0;
+}
+
+static inline void thread_join(thread_t t) {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+static inline void mutex_init(mutex_t *m) { InitializeCriticalSection(m); }
+static inline void mutex_destroy(mutex_t *m) { DeleteCriticalSection(m); }
+static inline void mutex_lock(mutex_t *m) { EnterCriticalSection(m); }
+static inline void mutex_unlock(mutex_t *m) { LeaveCriticalSection(m); }
+
+static inline void cond_init(cond_t *c) { InitializeConditionVariable(c); }
+static inline void cond_destroy(cond_t *c) { (void)c; }
+static inline void cond_wait(cond_t *c, mutex_t *m) { SleepConditionVariableCS(c, m, INFINITE); }
+static inline void cond_wait_ms(cond_t *c, mutex_t *m, int ms) { SleepConditionVariableCS(c, m, (DWORD)ms); }
+static inline void cond_signal(cond_t *c) { WakeConditionVariable(c); }
+static inline void cond_broadcast(cond_t *c) { WakeAllConditionVariable(c); }
+
+static inline int cpu_count(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+#else
+#define THREAD_LOCAL __thread               // Variável com uma cópia por thread
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+
+static inline int thread_create(thread_t *t, void *(*fn)(void *), void *arg) {
+    return pthread_create(t, NULL, fn, arg) == 0 ? 0 : -1;
+}
+
+static inline void thread_join(thread_t t) { pthread_join(t, NULL); }
+
+static inline void mutex_init(mutex_t *m) { pthread_mutex_init(m, NULL); }
+static inline void mutex_destroy(mutex_t *m) { pthread_mutex_destroy(m); }
+static inline void mutex_lock(mutex_t *m) { pthread_mutex_lock(m); }
+static inline void mutex_unlock(mutex_t *m) { pthread_mutex_unlock(m); }
+
+static inline void cond_init(cond_t *c) { pthread_cond_init(c, NULL); }
+static inline void cond_destroy(cond_t *c) { pthread_cond_destroy(c); }
+static inline void cond_wait(cond_t *c, mutex_t *m) { pthread_cond_wait(c, m); }
+
+static inline void cond_wait_ms(cond_t *c, mutex_t *m, int ms) {
+    // A variável de condição padrão mede o prazo no relógio de parede
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(c, m, &ts);
+}
+static inline void cond_signal(cond_t *c) { pthread_cond_signal(c); }
+static inline void cond_broadcast(cond_t *c) { pthread_cond_broadcast(c); }
+
+static inline int cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+#endif
+
+/*--------------------------------------------------------------
+ * OPERAÇÕES ATÔMICAS
+ *------------------------------------------------------------*/
+
+/**
+ * Soma v ao contador e retorna o valor anterior
+ *
+ * Por que foi feito:
+ * - Contadores globais (conexões ativas, estatísticas) são atualizados
+ *   por várias threads sem precisar de mutex
+ */
+static inline long atomic_add_long(volatile long *p, long v) {
+#ifdef _MSC_VER
+    return InterlockedExchangeAdd(p, v);
+#else
+    return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/**
+ * Eleva o contador a v se v for maior (marcas de pico)
+ */
+static inline void atomic_max_long(volatile long *p, long v) {
+    long seen = atomic_add_long(p, 0);
+    while (seen < v) {
+#ifdef _MSC_VER
+        long previous = InterlockedCompareExchange(p, v, seen);
+        if (previous == seen) break;
+        seen = previous;
+#else
+        if (__atomic_compare_exchange_n(p, &seen, v, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) break;
+#endif
+    }
+}
+
+/*--------------------------------------------------------------
+ * MEMÓRIA
+ *------------------------------------------------------------*/
+
+/**
+ * Aloca um bloco alinhado (ex.: ao tamanho de página)
+ *
+ * @return Ponteiro alinhado, ou NULL em caso de erro; liberar com
+ *         mem_aligned_free()
+ *
+ * Por que foi feito:
+ * - Buffers de E/S alinhados à página são copiados pelo kernel sem
+ *   ajustes e atendem os requisitos de O_DIRECT
+ */
+static inline void *mem_aligned_alloc(size_t size, size_t alignment) {
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void *p = NULL;
+    return posix_memalign(&p, alignment, size) == 0 ? p : NULL;
+#endif
+}
+
+/**
+ * Libera um bloco obtido com mem_aligned_alloc()
+ */
+static inline void mem_aligned_free(void *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+/*--------------------------------------------------------------
+ * SISTEMA DE ARQUIVOS
+ *------------------------------------------------------------*/
+
+/**
+ * Cria um diretório (permissões padrão no POSIX)
+ */
+static inline int make_dir(const char *path) {
+#ifdef _WIN32
+    return _mkdir(path);
+#else
+    return mkdir(path, 0755);
+#endif
+}
+
+/**
+ * Remove um diretório vazio
+ *
+ * @return 0 em caso de sucesso, -1 se não existe ou não está vazio
+ */
+static inline int remove_dir(const char *path) {
+#ifdef _WIN32
+    return _rmdir(path);
+#else
+    return rmdir(path);
+#endif
+}
+
+/**
+ * Cria os diretórios que faltam até o último separador de um caminho
+ *
+ * @return 0 em caso de sucesso, -1 se algum diretório não pôde ser criado
+ *
+ * Por que foi feito:
+ * - Árvores enviadas recriam subdiretórios sob demanda, na hora de gravar
+ *   cada arquivo; separadores '/' e '\\' valem nas duas plataformas
+ */
+static inline int make_parent_dirs(const char *path) {
+    char dir[MAX_PATH];
+    size_t len = strlen(path);
+
+    if (len >= sizeof(dir)) return -1;
+    memcpy(dir, path, len + 1);
+    for (size_t i = 1; i < len; i++) {
+        if (dir[i] != '/' && dir[i] != '\\') continue;
+        if (dir[i - 1] == ':') continue;  // Raiz da unidade ("C:") no Windows
+        dir[i] = '\0';
+        struct stat st;
+        if (stat(dir, &st) != 0 && make_dir(dir) != 0 && stat(dir, &st) != 0) return -1;
+        dir[i] = path[i];
+    }
+    return 0;
+}
+
+/**
+ * Verifica se um caminho é um diretório
+ */
+static inline int path_is_dir(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return 0;
+#ifdef _WIN32
+    return (st.st_mode & _S_IFDIR) != 0;
+#else
+    return S_ISDIR(st.st_mode);
+#endif
+}
+
+/**
+ * Verifica se um caminho existe no sistema de arquivos
+ */
+static inline int path_exists(const char *path) {
+#ifdef _WIN32
+    return _access(path, 0) == 0;
+#else
+    return access(path, F_OK) == 0;
+#endif
+}
+
+/**
+ * Retorna o tamanho de um arquivo em bytes (64 bits)
+ *
+ * @return Tamanho do arquivo, ou -1 se não existir
+ *
+ * Por que foi feito:
+ * - ftell() retorna long, que tem 32 bits no Windows e não representa
+ *   arquivos maiores que 2 GB
+ */
+static inline int64_t file_size(const char *path) {
+#ifdef _WIN32
+    struct _stati64 st;
+    if (_stati64(path, &st) != 0) return -1;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+#endif
+    return (int64_t)st.st_size;
+}
+
+/**
+ * Abre um arquivo para leitura binária por descritor
+ *
+ * @return Descritor do arquivo, ou -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - sendfile() e mmap() trabalham com descritores, não com FILE*
+ */
+static inline int file_open_read(const char *path) {
+#ifdef _WIN32
+    return _open(path, _O_RDONLY | _O_BINARY);
+#else
+    return open(path, O_RDONLY | O_CLOEXEC);
+#endif
+}
+
+/**
+ * Lê até len bytes a partir de uma posição do arquivo
+ *
+ * @return Bytes lidos, 0 no fim do arquivo, -1 em caso de erro
+ */
+static inline int64_t file_pread(int fd, void *buf, size_t len, uint64_t offset) {
+#ifdef _WIN32
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0) return -1;
+    return _read(fd, buf, (unsigned int)(len > 0x40000000 ? 0x40000000 : len));
+#else
+    ssize_t n;
+    do {
+        n = pread(fd, buf, len, (off_t)offset);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && errno == ESPIPE) n = read(fd, buf, len);  // Pipes não têm posição
+    return n;
+#endif
+}
+
+/**
+ * Fecha um descritor de arquivo
+ */
+static inline void file_close(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+/**
+ * Descritor de um arquivo aberto com fopen() ou tmpfile()
+ *
+ * Por que foi feito:
+ * - Conteúdos gerados em arquivo temporário são enviados pela biblioteca
+ *   de pedidos, que lê por descritor (depois de fflush())
+ */
+static inline int file_stream_fd(FILE *f) {
+#ifdef _WIN32
+    return _fileno(f);
+#else
+    return fileno(f);
+#endif
+}
+
+/**
+ * Abre (criando se preciso) um arquivo para escrita binária por descritor
+ *
+ * @param truncate 1 para descartar o conteúdo existente, 0 para preservá-lo
+ * @return Descritor do arquivo, ou -1 em caso de erro
+ */
+static inline int file_open_write(const char *path, int truncate) {
+#ifdef _WIN32
+    return _open(path, _O_WRONLY | _O_CREAT | _O_BINARY | (truncate ? _O_TRUNC : 0), _S_IREAD | _S_IWRITE);
+#else
+    return open(path, O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+#endif
+}
+
+/**
+ * Ajusta o tamanho de um arquivo aberto para escrita
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+static inline int file_truncate(int fd, uint64_t size) {
+#ifdef _WIN32
+    return _chsize_s(fd, (__int64)size) == 0 ? 0 : -1;
+#else
+    return ftruncate(fd, (off_t)size);
+#endif
+}
+
+/**
+ * Retorna a data da última modificação de um arquivo
+ *
+ * @return Segundos desde 1970 (UTC), ou -1 se o arquivo não existir
+ */
+static inline int64_t file_mtime(const char *path) {
+#ifdef _WIN32
+    struct _stati64 st;
+    if (_stati64(path, &st) != 0) return -1;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+#endif
+    return (int64_t)st.st_mtime;
+}
+
+/**
+ * Reserva espaço em disco para o tamanho final do arquivo
+ *
+ * O tamanho visível do arquivo não muda (FALLOC_FL_KEEP_SIZE): ele continua
+ * crescendo com as escritas e indica quantos bytes já foram gravados.
+ *
+ * @return 0 em caso de sucesso ou se a plataforma não suporta reserva,
+ *         -1 se não há espaço suficiente
+ *
+ * Por que foi feito:
+ * - Com o tamanho conhecido de antemão, o sistema de arquivos aloca
+ *   extensões contíguas de uma vez em vez de crescer o arquivo a cada
+ *   escrita, e a falta de espaço aparece antes de receber qualquer byte
+ * - fallocate() é chamado diretamente porque posix_fallocate() da glibc
+ *   emula a reserva escrevendo zeros quando o sistema de arquivos não a
+ *   suporta, o que dobraria a escrita em disco
+ */
+static inline int file_preallocate(int fd, uint64_t size) {
+#ifdef __linux__
+    if (size == 0) return 0;
+    if (syscall(SYS_fallocate, fd, FALLOC_FL_KEEP_SIZE, (off_t)0, (off_t)size) == 0) return 0;
+    return errno == ENOSPC ? -1 : 0;
+#else
+    (void)fd;
+    (void)size;
+    return 0;
+#endif
+}
+
+/**
+ * Grava vários trechos de memória em sequência a partir de uma posição
+ *
+ * @return 0 se todos os bytes foram gravados, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - Buffers que não são contíguos na memória vão para o disco em uma
+ *   única chamada pwritev(), sem copiá-los para um buffer intermediário
+ */
+static inline int file_pwritev(int fd, io_vec_t *iov, int count, uint64_t offset) {
+#ifdef _WIN32
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0) return -1;
+    for (int i = 0; i < count; i++) {
+        const char *p = (const char *)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            int n = _write(fd, p, (unsigned int)(left > 0x40000000 ? 0x40000000 : left));
+            if (n <= 0) return -1;
+            p += n;
+            left -= (size_t)n;
+        }
+    }
+    return 0;
+#else
+    while (count > 0) {
+        ssize_t n = pwritev(fd, iov, count, (off_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        offset += (uint64_t)n;
+        // Escrita parcial: avança pelos trechos já gravados
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+#endif
+}
+
+/**
+ * Garante que os dados gravados chegaram ao disco
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+static inline int file_sync(int fd) {
+#ifdef _WIN32
+    return _commit(fd);
+#elif defined(__linux__)
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+/**
+ * Renomeia um arquivo substituindo o destino atomicamente
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - Quem abre o destino vê a versão antiga ou a nova completa, nunca um
+ *   arquivo pela metade; no Windows rename() falha se o destino existe
+ */
+static inline int file_replace(const char *from, const char *to) {
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(from, to);
+#endif
+}
+
+/**
+ * Garante que as entradas de um diretório (nomes criados, trocados ou
+ * removidos) chegaram ao disco
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - No POSIX o fsync() de um arquivo não cobre o nome dele no diretório;
+ *   no Windows o NTFS já grava os nomes no seu próprio diário
+ */
+static inline int dir_sync(const char *path) {
+#ifdef _WIN32
+    (void)path;
+    return 0;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    int result = fsync(fd);
+    close(fd);
+    return result == 0 ? 0 : -1;
+#endif
+}
+
+/**
+ * Consulta tamanho, data de modificação e inode de um arquivo regular
+ *
+ * @param inode Recebe o número do inode (0 no Windows); pode ser NULL
+ * @return 0 em caso de sucesso, -1 se não existe ou não é arquivo regular
+ *
+ * Por que foi feito:
+ * - O índice do armazenamento precisa de todos esses dados de cada
+ *   arquivo; uma única chamada stat() em vez de file_size() e file_mtime()
+ */
+static inline int file_stat(const char *path, uint64_t *size, int64_t *mtime, uint64_t *inode) {
+#ifdef _WIN32
+    struct _stati64 st;
+    if (_stati64(path, &st) != 0 || (st.st_mode & _S_IFREG) == 0) return -1;
+    if (inode != NULL) *inode = 0;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    if (inode != NULL) *inode = (uint64_t)st.st_ino;
+#endif
+    *size = (uint64_t)st.st_size;
+    *mtime = (int64_t)st.st_mtime;
+    return 0;
+}
+
+/**
+ * Lê as permissões de um arquivo ou diretório
+ *
+ * @param mode Recebe os bits de permissão no formato POSIX (ex.: 0644)
+ * @return 0 em caso de sucesso, -1 se o caminho não existe
+ *
+ * Por que foi feito:
+ * - Árvores de código têm scripts executáveis; no Windows só existe o
+ *   atributo de somente leitura, traduzido para 0444 ou 0644
+ */
+static inline int file_get_mode(const char *path, uint32_t *mode) {
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+#ifdef _WIN32
+    *mode = (st.st_mode & _S_IWRITE) ? 0644 : 0444;
+    if (st.st_mode & _S_IFDIR) *mode |= 0111;
+#else
+    *mode = (uint32_t)st.st_mode & 07777;
+#endif
+    return 0;
+}
+
+/**
+ * Aplica permissões e data de modificação a um arquivo ou diretório
+ *
+ * @param mode Bits de permissão no formato POSIX
+ * @param mtime Segundos desde 1970 (também usado como último acesso)
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+static inline int file_set_meta(const char *path, uint32_t mode, int64_t mtime) {
+#ifdef _WIN32
+    struct __utimbuf64 times;
+    times.actime = times.modtime = (__time64_t)mtime;
+    if (_utime64(path, &times) != 0) return -1;
+    return _chmod(path, (mode & 0200) ? (_S_IREAD | _S_IWRITE) : _S_IREAD);
+#else
+    struct utimbuf times;
+    times.actime = times.modtime = (time_t)mtime;
+    if (utime(path, &times) != 0) return -1;
+    return chmod(path, (mode_t)(mode & 07777));
+#endif
+}
+
+/**
+ * Grava no disco tudo o que está pendente no sistema de arquivos de fd
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - Milhares de arquivos pequenos gravados juntos pagam um único syncfs()
+ *   no Linux em vez de um fsync() cada; nas demais plataformas só o
+ *   próprio fd é gravado, e FILESYSTEM_SYNC diz ao chamador para
+ *   sincronizar cada arquivo
+ */
+#ifdef __linux__
+#define FILESYSTEM_SYNC 1
+#else
+#define FILESYSTEM_SYNC 0
+#endif
+static inline int filesystem_sync(int fd) {
+#ifdef __linux__
+    return syscall(SYS_syncfs, fd) == 0 ? 0 : -1;
+#else
+    return file_sync(fd);
+#endif
+}
+
+/**
+ * Indica se o descritor aponta para um arquivo regular
+ *
+ * Por que foi feito:
+ * - Caminhos de cópia zero só valem para arquivos regulares; pipes e
+ *   dispositivos seguem pelo caminho com buffer
+ */
+static inline int file_is_regular(int fd) {
+#ifdef _WIN32
+    struct _stati64 st;
+    if (_fstati64(fd, &st) != 0) return 0;
+    return (st.st_mode & _S_IFREG) != 0;
+#else
+    struct stat st;
+    if (fstat(fd, &st) != 0) return 0;
+    return S_ISREG(st.st_mode);
+#endif
+}
+
+/**
+ * Obtém o tamanho de um arquivo aberto
+ *
+ * @return Tamanho em bytes, ou -1 em caso de erro
+ */
+static inline int64_t file_size_fd(int fd) {
+#ifdef _WIN32
+    struct _stati64 st;
+    if (_fstati64(fd, &st) != 0) return -1;
+#else
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+#endif
+    return (int64_t)st.st_size;
+}
+
+/**
+ * Obtém o diretório de trabalho atual
+ */
+static inline void current_dir(char *path, size_t size) {
+#ifdef _WIN32
+    GetCurrentDirectory((DWORD)size, path);
+#else
+    if (getcwd(path, size) == NULL) snprintf(path, size, ".");
+#endif
+}
+
+/**
+ * Desvia a saída padrão para um arquivo
+ *
+ * @param path Destino do que for escrito em stdout (NULL: descarta)
+ * @return Fluxo ligado à saída padrão original, ou NULL em caso de erro
+ *
+ * Por que foi feito:
+ * - O gerador de carga roda o servidor no mesmo processo; o log do
+ *   servidor (uma linha por pedido) vai para outro lugar e o relatório
+ *   continua na saída original
+ */
+static inline FILE *stdout_divert(const char *path) {
+#ifdef _WIN32
+    int fd = _dup(_fileno(stdout));
+    FILE *original = fd >= 0 ? _fdopen(fd, "w") : NULL;
+    if (path == NULL) path = "NUL";
+#else
+    int fd = dup(fileno(stdout));
+    FILE *original = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (path == NULL) path = "/dev/null";
+#endif
+    fflush(stdout);
+    if (original == NULL || freopen(path, "w", stdout) == NULL) return NULL;
+    return original;
+}
+
+/**
+ * Relógio monotônico em nanossegundos
+ *
+ * Por que foi feito:
+ * - Medições de duração não podem ser afetadas por ajustes no relógio
+ *   do sistema
+ */
+static inline uint64_t monotonic_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+ * Tempo de CPU consumido pela thread atual, em nanossegundos
+ */
+static inline uint64_t thread_cpu_ns(void) {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user);
+    uint64_t k = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    uint64_t u = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    return (k + u) * 100;  // FILETIME conta intervalos de 100 ns
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+ * Suspende a thread atual por alguns milissegundos
+ */
+static inline void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+}
+
+/**
+ * Iterador de diretório portátil
+ *
+ * Por que foi feito:
+ * - FindFirstFile/FindNextFile só existem no Windows; opendir/readdir
+ *   é o equivalente POSIX. Entradas "." e ".." são sempre ignoradas.
+ */
+typedef struct {
+#ifdef _WIN32
+    HANDLE handle;
+    WIN32_FIND_DATA data;
+    int first;
+#else
+    DIR *dir;
+#endif
+} dir_iter_t;
+
+static inline int dir_open(dir_iter_t *it, const char *path) {
+#ifdef _WIN32
+    char searchPath[MAX_PATH];
+    snprintf(searchPath, sizeof(searchPath), "%s\\*", path);
+    it->handle = FindFirstFile(searchPath, &it->data);
+    it->first = 1;
+    return it->handle == INVALID_HANDLE_VALUE ? -1 : 0;
+#else
+    it->dir = opendir(path);
+    return it->dir == NULL ? -1 : 0;
+#endif
+}
+
+static inline const char *dir_next(dir_iter_t *it) {
+    for (;;) {
+        const char *name;
+#ifdef _WIN32
+        if (!it->first && FindNextFile(it->handle, &it->data) == 0) return NULL;
+        it->first = 0;
+        name = it->data.cFileName;
+#else
+        struct dirent *entry = readdir(it->dir);
+        if (entry == NULL) return NULL;
+        name = entry->d_name;
+#endif
+        if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) return name;
+    }
+}
+
+static inline void dir_close(dir_iter_t *it) {
+#ifdef _WIN32
+    FindClose(it->handle);
+#else
+    closedir(it->dir);
+#endif
+}
+
+/*--------------------------------------------------------------
+ * MULTIPLEXAÇÃO DE EVENTOS (POLLER)
+ *------------------------------------------------------------*/
+#define POLLER_IN  1            // Socket pronto para leitura
+#define POLLER_OUT 2            // Socket pronto para escrita
+
+typedef struct {
+    void *ptr;                  // Ponteiro associado ao socket no registro
+    int events;                 // Combinação de POLLER_IN/POLLER_OUT
+} poller_event_t;
+
+/*
+ * Todos os registros são "one-shot": após entregar um evento o socket fica
+ * desarmado até que poller_rearm() seja chamado. Isso garante que apenas uma
+ * thread trabalhadora processe uma sessão por vez.
+ */
+#ifdef __linux__
+typedef struct {
+    int epfd;
+} poller_t;
+
+static inline int poller_init(poller_t *p) {
+    p->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return p->epfd < 0 ? -1 : 0;
+}
+
+static inline uint32_t poller_mask(int events) {
+    uint32_t mask = EPOLLONESHOT | EPOLLRDHUP;
+    if (events & POLLER_IN) mask |= EPOLLIN;
+    if (events & POLLER_OUT) mask |= EPOLLOUT;
+    return mask;
+}
+
+static inline int poller_add(poller_t *p, SOCKET s, void *ptr, int events) {
+    struct epoll_event ev;
+    ev.events = poller_mask(events);
+    ev.data.ptr = ptr;
+    return epoll_ctl(p->epfd, EPOLL_CTL_ADD, s, &ev);
+}
+
+static inline int poller_rearm(poller_t *p, SOCKET s, void *ptr, int events) {
+    struct epoll_event ev;
+    ev.events = poller_mask(events);
+    ev.data.ptr = ptr;
+    return epoll_ctl(p->epfd, EPOLL_CTL_MOD, s, &ev);
+}
+
+static inline int poller_del(poller_t *p, SOCKET s) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    return epoll_ctl(p->epfd, EPOLL_CTL_DEL, s, &ev);
+}
+
+static inline int poller_wait(poller_t *p, poller_event_t *out, int max, int timeout_ms) {
+    struct epoll_event evs[64];
+    if (max > 64) max = 64;
+    int n = epoll_wait(p->epfd, evs, max, timeout_ms);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+    for (int i = 0; i < n; i++) {
+        out[i].ptr = evs[i].data.ptr;
+        out[i].events = 0;
+        // Erros e desconexões são entregues como leitura: recv() os reporta
+        if (evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) out[i].events |= POLLER_IN;
+        if (evs[i].events & EPOLLOUT) out[i].events |= POLLER_OUT;
+    }
+    return n;
+}
+
+static inline void poller_close(poller_t *p) {
+    close(p->epfd);
+}
+#else
+/*
+ * Implementação portátil com poll()/WSAPoll(). O conjunto de sockets armados
+ * é reconstruído a cada espera; como não há mecanismo de despertar, a espera
+ * é limitada a um intervalo curto para que rearmes sejam notados rapidamente.
+ */
+#define POLLER_FALLBACK_TICK_MS 20
+
+typedef struct {
+    SOCKET sock;
+    void *ptr;
+    int events;
+    int armed;
+} poller_entry_t;
+
+typedef struct {
+    mutex_t lock;
+    poller_entry_t *entries;
+    int count, capacity;
+} poller_t;
+
+static inline int poller_init(poller_t *p) {
+    mutex_init(&p->lock);
+    p->entries = NULL;
+    p->count = p->capacity = 0;
+    return 0;
+}
+
+static inline int poller_find(poller_t *p, SOCKET s) {
+    for (int i = 0; i < p->count; i++) {
+        if (p->entries[i].sock == s) return i;
+    }
+    return -1;
+}
+
+static inline int poller_add(poller_t *p, SOCKET s, void *ptr, int events) {
+    mutex_lock(&p->lock);
+    if (p->count == p->capacity) {
+        int cap = p->capacity ? p->capacity * 2 : 64;
+        poller_entry_t *grown = (poller_entry_t *)realloc(p->entries, cap * sizeof(poller_entry_t));
+        if (grown == NULL) {
+            mutex_unlock(&p->lock);
+            return -1;
+        }
+        p->entries = grown;
+        p->capacity = cap;
+    }
+    poller_entry_t *e = &p->entries[p->count++];
+    e->sock = s;
+    e->ptr = ptr;
+    e->events = events;
+    e->armed = 1;
+    mutex_unlock(&p->lock);
+    return 0;
+}
+
+static inline int poller_rearm(poller_t *p, SOCKET s, void *ptr, int events) {
+    mutex_lock(&p->lock);
+    int i = poller_find(p, s);
+    if (i >= 0) {
+        p->entries[i].ptr = ptr;
+        p->entries[i].events = events;
+        p->entries[i].armed = 1;
+    }
+    mutex_unlock(&p->lock);
+    return i >= 0 ? 0 : -1;
+}
+
+static inline int poller_del(poller_t *p, SOCKET s) {
+    mutex_lock(&p->lock);
+    int i = poller_find(p, s);
+    if (i >= 0) p->entries[i] = p->entries[--p->count];
+    mutex_unlock(&p->lock);
+    return i >= 0 ? 0 : -1;
+}
+
+static inline int poller_wait(poller_t *p, poller_event_t *out, int max, int timeout_ms) {
+#ifdef _WIN32
+    typedef WSAPOLLFD pollfd_t;
+#define poller_sys_poll WSAPoll
+#else
+    typedef struct pollfd pollfd_t;
+#define poller_sys_poll poll
+#endif
+    pollfd_t *fds;
+    void **ptrs;
+    int n = 0, ready = 0;
+
+    mutex_lock(&p->lock);
+    fds = (pollfd_t *)malloc((p->count + 1) * sizeof(pollfd_t));
+    ptrs = (void **)malloc((p->count + 1) * sizeof(void *));
+    for (int i = 0; fds && ptrs && i < p->count; i++) {
+        if (!p->entries[i].armed) continue;
+        fds[n].fd = p->entries[i].sock;
+        fds[n].events = (short)(((p->entries[i].events & POLLER_IN) ? POLLIN : 0) |
+                                ((p->entries[i].events & POLLER_OUT) ? POLLOUT : 0));
+        fds[n].revents = 0;
+        ptrs[n++] = p->entries[i].ptr;
+    }
+    mutex_unlock(&p->lock);
+
+    if (timeout_ms < 0 || timeout_ms > POLLER_FALLBACK_TICK_MS) timeout_ms = POLLER_FALLBACK_TICK_MS;
+    if (fds && ptrs && n > 0 && poller_sys_poll(fds, n, timeout_ms) > 0) {
+        mutex_lock(&p->lock);
+        for (int i = 0; i < n && ready < max; i++) {
+            if (fds[i].revents == 0) continue;
+            int idx = poller_find(p, fds[i].fd);
+            if (idx < 0 || !p->entries[idx].armed) continue;
+            p->entries[idx].armed = 0;  // Semântica one-shot
+            out[ready].ptr = ptrs[i];
+            out[ready].events = 0;
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) out[ready].events |= POLLER_IN;
+            if (fds[i].revents & POLLOUT) out[ready].events |= POLLER_OUT;
+            ready++;
+        }
+        mutex_unlock(&p->lock);
+    } else if (n == 0) {
+#ifdef _WIN32
+        Sleep(timeout_ms);
+#else
+        usleep(timeout_ms * 1000);
+#endif
+    }
+    free(fds);
+    free(ptrs);
+    return ready;
+#undef poller_sys_poll
+}
+
+static inline void poller_close(poller_t *p) {
+    free(p->entries);
+    mutex_destroy(&p->lock);
+}
+#endif
+
+#endif /* BIGFS_PLATFORM_H */
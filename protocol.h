@@ -0,0 +1,508 @@
+/*******************************************************************************
+ * PROTOCOLO BINÁRIO DO SISTEMA DE TRANSFERÊNCIA DE ARQUIVOS
+ *
+ * Descrição: Define o formato dos quadros (frames) trocados entre cliente e
+ *            servidor. Cada quadro tem um cabeçalho fixo de 16 bytes seguido
+ *            de um payload de tamanho declarado, o que permite manter a
+ *            conexão aberta entre transferências e enviar comandos em
+ *            sequência sem esperar cada resposta (pipelining).
+ *
+ * Formato do cabeçalho (inteiros em big-endian / ordem de rede):
+ *
+ *   0       1       2               4                               8
+ *   +-------+-------+---------------+-------------------------------+
+ *   |versão |opcode |    flags      |          request id           |
+ *   +-------+-------+---------------+-------------------------------+
+ *   |                  tamanho do payload (64 bits)                 |
+ *   +---------------------------------------------------------------+
+ *
+ * Fluxo das operações (mesmo request id em todos os quadros de uma operação):
+ * - LIST:     C->S LIST(página)       S->C DATA... (último com FLAG_END)
+ * - UPLOAD:   C->S UPLOAD(tamanho,nome) + DATA... (FLAG_END)   S->C OK|ERROR
+ * - DOWNLOAD: C->S DOWNLOAD(nome)     S->C OK(tamanho) + DATA... (FLAG_END)
+ *                                       ou ERROR
+ * - DELETE:   C->S DELETE(nome)       S->C OK|ERROR
+ * - STAT:     C->S STAT(nome)         S->C OK(entrada, como na listagem)
+ *                                       ou ERROR
+ * - BYE:      C->S BYE                (servidor encerra a conexão)
+ *
+ * Listagem paginada:
+ * - Payload do LIST (opcional): u32 entradas por página (0 = padrão) +
+ *   u16 tamanho do prefixo + prefixo + cursor (resto do payload)
+ * - Entradas em ordem de nome, só as que começam com o prefixo e vêm
+ *   depois do cursor; o cursor da página seguinte é o nome da última
+ *   entrada recebida
+ * - Cada quadro DATA leva entradas inteiras: u64 tamanho + u64 data de
+ *   modificação (segundos desde 1970) + u8 tamanho do hash + hash (vazio
+ *   se o servidor não o conhece) + u16 tamanho do nome + nome
+ * - O último quadro leva FLAG_MORE se ainda há entradas após a página
+ *
+ * Transferências retomáveis e parciais:
+ * - DOWNLOAD com FLAG_RANGE: payload u64 posição + u64 tamanho (0 = até o
+ *   fim) + nome; a resposta é OK(u64 bytes a seguir, u64 tamanho do arquivo)
+ * - UPLOAD com FLAG_RESUME: payload u64 tamanho + u64 id do upload + u64
+ *   posição + nome; o id é escolhido pelo cliente e identifica o upload
+ *   entre conexões, e os quadros DATA continuam a partir da posição
+ * - UPLOAD_STATUS: C->S UPLOAD_STATUS(u64 id do upload)
+ *                  S->C OK(u64 bytes já gravados, u64 tamanho, nome) | ERROR
+ *
+ * Transferências paralelas (várias conexões, blocos de tamanho fixo):
+ * - UPLOAD com FLAG_CHUNK: payload u64 tamanho + u64 id do upload + u64
+ *   posição + u64 tamanho do bloco + nome; cada conexão envia blocos
+ *   diferentes do mesmo upload e recebe OK quando o bloco está no disco
+ * - UPLOAD_COMMIT: C->S UPLOAD_COMMIT(u64 id) depois de todos os blocos;
+ *                  S->C OK quando o arquivo recebeu o nome final | ERROR
+ * - Downloads paralelos usam DOWNLOAD com FLAG_RANGE, um intervalo por bloco
+ *
+ * Armazenamento por conteúdo (servidor iniciado com -s dedup):
+ * - CHUNK_QUERY:  C->S CHUNK_QUERY(u32 quantidade + SHA-256 de cada bloco)
+ *                 S->C OK(mapa de bits, 1 = bloco ausente no servidor)
+ * - CHUNK_PUT:    C->S CHUNK_PUT(SHA-256 + u64 tamanho) + DATA... (FLAG_END)
+ *                 S->C OK depois de conferir o hash | ERROR
+ * - MANIFEST_PUT: C->S MANIFEST_PUT(u64 tamanho + u32 blocos + nome) +
+ *                 DATA... com blocos x (SHA-256 + u32 tamanho)
+ *                 S->C OK quando o arquivo recebeu o nome | ERROR (NOT_FOUND
+ *                 se algum bloco ainda não está no servidor)
+ * - Servidores sem armazenamento por conteúdo respondem ERROR(UNSUPPORTED)
+ *
+ * Atualização por diferenças (formato das assinaturas e instruções em delta.h):
+ * - SIGNATURES: C->S SIGNATURES(u32 tamanho dos blocos, 0 = servidor escolhe + nome)
+ *               S->C OK(u64 tamanho + u64 data + u32 bloco + u32 blocos) +
+ *                    DATA... com as assinaturas (FLAG_END) | ERROR
+ * - DELTA:      C->S DELTA(u64 tamanho das instruções + u64 tamanho novo +
+ *                    SHA-256 novo + u32 bloco + u64 tamanho e u64 data da
+ *                    cópia assinada + nome) + DATA... com as instruções
+ *               S->C OK | ERROR (RANGE se a cópia mudou desde as assinaturas)
+ *
+ * Compressão dos quadros DATA (codecs em compress.h):
+ * - CODECS:   C->S CODECS(u8 mapa de codecs do cliente)
+ *             S->C OK(u8 mapa dos codecs que os dois lados suportam)
+ * - DATA com FLAG_COMPRESSED: payload u32 tamanho original + bytes
+ *   comprimidos com o codec indicado por FLAG_CODEC nas flags do quadro;
+ *   cada quadro é independente e nunca passa de FRAME_DATA_CHUNK bytes
+ * - DOWNLOAD com FLAG_CODEC(c) pede quadros comprimidos com c; o servidor
+ *   pode ignorar o pedido (conteúdo já comprimido) e cada quadro diz se
+ *   foi comprimido
+ * - Uploads podem comprimir qualquer quadro DATA com um codec negociado
+ *
+ * Árvores de diretórios (nomes com '/' recriam subdiretórios no servidor):
+ * - TREE_PUT: C->S TREE_PUT(u64 tamanho do lote + u32 entradas) + DATA...
+ *             com as entradas, cada TREE_FILE seguida dos seus bytes
+ *             S->C OK quando todos os arquivos do lote têm o nome final | ERROR
+ * - TREE_GET: C->S TREE_GET(u32 nomes + (u16 tamanho + nome) de cada um)
+ *             S->C OK(u64 tamanho do lote + resumo do lote) + DATA... com
+ *                  uma entrada por nome (FLAG_END) | ERROR
+ * - Entrada: u8 tipo + u32 permissões + u64 data + u64 tamanho + u16
+ *   tamanho do nome + nome; TREE_DIR cria um diretório, TREE_ATTR aplica
+ *   permissões e data a um arquivo existente (no TREE_GET: arquivo grande
+ *   demais para o lote, baixado à parte) e TREE_MISSING marca um nome
+ *   que não existe; só TREE_FILE é seguida de bytes, o tamanho das
+ *   demais é informativo
+ * - TREE_GET aceita FLAG_CODEC como o DOWNLOAD
+ *
+ * Integridade (CRC32C e XXH64, em digest.h):
+ * - Pedidos com quadros DATA do cliente (UPLOAD, CHUNK_PUT, DELTA) podem
+ *   terminar com um quadro DATA com FLAG_END | FLAG_DIGEST cujo payload é
+ *   o resumo (u32 CRC32C + u64 XXH64) dos bytes originais enviados neste
+ *   pedido; se não confere, o servidor descarta os dados e responde
+ *   ERROR(CHECKSUM)
+ * - Resumo do arquivo inteiro (u32 CRC32C, seguido do u64 XXH64 quando o
+ *   servidor o conhece): anexado ao OK do DOWNLOAD e no campo de hash das
+ *   entradas de LIST e STAT, quando o servidor o tem guardado
+ ******************************************************************************/
+#ifndef BIGFS_PROTOCOL_H
+#define BIGFS_PROTOCOL_H
+
+#include "platform.h"
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define PROTO_VERSION 1                 // Versão do formato de quadro
+#define FRAME_HEADER_SIZE 16            // Tamanho fixo do cabeçalho
+#define FRAME_MAX_CONTROL (64 * 1024)   // Payload máximo de quadros que não são DATA
+#define FRAME_DATA_CHUNK (256 * 1024)   // Payload de cada quadro DATA enviado
+#define PROTO_MAX_NAME 1024             // Tamanho máximo de um nome de arquivo
+#define LIST_PAGE_DEFAULT 1000          // Entradas por página de LIST (padrão)
+#define LIST_PAGE_MAX 10000             // Máximo de entradas por página
+#define LIST_HASH_MAX 32                // Tamanho máximo do hash de uma entrada
+#define LIST_ENTRY_MAX (19 + LIST_HASH_MAX + PROTO_MAX_NAME) // Entrada codificada
+#define TREE_ENTRY_HEADER 23            // Entrada de lote sem o nome
+#define TREE_MAX_ENTRIES 4096           // Entradas de um pedido TREE_PUT ou TREE_GET
+#define TREE_MAX_BYTES (16 * 1024 * 1024) // Dados de arquivos em um lote
+#define TREE_FILE_MAX (1024 * 1024)     // Maior arquivo levado dentro de um lote
+
+/**
+ * Códigos de operação
+ */
+enum {
+    OP_LIST     = 0x01,     // Listar arquivos
+    OP_UPLOAD   = 0x02,     // Enviar arquivo (payload: u64 tamanho + nome)
+    OP_DOWNLOAD = 0x03,     // Baixar arquivo (payload: nome)
+    OP_DELETE   = 0x04,     // Excluir arquivo (payload: nome)
+    OP_BYE      = 0x05,     // Encerrar a conexão
+    OP_UPLOAD_STATUS = 0x06, // Progresso de um upload retomável (payload: u64 id)
+    OP_UPLOAD_COMMIT = 0x07, // Conclui um upload enviado em blocos (payload: u64 id)
+    OP_STAT     = 0x08,     // Metadados de um arquivo (payload: nome)
+    OP_CHUNK_QUERY = 0x09,  // Quais blocos faltam no servidor (payload: hashes)
+    OP_CHUNK_PUT = 0x0A,    // Enviar um bloco (payload: hash + u64 tamanho)
+    OP_MANIFEST_PUT = 0x0B, // Dar nome a uma lista de blocos (payload: tamanho + blocos + nome)
+    OP_SIGNATURES = 0x0C,   // Assinaturas dos blocos de um arquivo (payload: bloco + nome)
+    OP_DELTA    = 0x0D,     // Atualizar um arquivo por diferenças (payload: ver acima)
+    OP_CODECS   = 0x0E,     // Negociar codecs de compressão (payload: u8 mapa)
+    OP_TREE_PUT = 0x0F,     // Enviar um lote de arquivos pequenos (payload: tamanho + entradas)
+    OP_DATA     = 0x10,     // Bloco de dados de uma transferência
+    OP_TREE_GET = 0x11,     // Baixar um lote de arquivos pequenos (payload: nomes)
+    OP_OK       = 0x20,     // Resposta de sucesso
+    OP_ERROR    = 0x21      // Resposta de erro (payload: u16 código + mensagem)
+};
+
+/**
+ * Flags do cabeçalho
+ */
+#define FLAG_END 0x0001     // Último quadro de uma sequência DATA
+#define FLAG_RANGE 0x0002   // DOWNLOAD de um intervalo do arquivo
+#define FLAG_RESUME 0x0004  // UPLOAD retomável identificado por id
+#define FLAG_CHUNK 0x0008   // UPLOAD de um bloco de um upload paralelo
+#define FLAG_MORE 0x0010    // LIST: há mais entradas depois desta página
+#define FLAG_COMPRESSED 0x0020 // DATA: payload comprimido (u32 tamanho original + bytes)
+#define FLAG_DIGEST 0x0040  // DATA: payload é o resumo dos dados enviados no pedido
+#define FLAG_CODEC(c) ((uint16_t)(((c) & 0x0f) << 8)) // Codec nos bits 8-11 das flags
+#define FLAG_CODEC_OF(f) (((f) >> 8) & 0x0f)
+
+/**
+ * Códigos de erro transportados em OP_ERROR
+ */
+enum {
+    ERR_NOT_FOUND   = 1,    // Arquivo inexistente
+    ERR_IO          = 2,    // Falha de leitura/escrita no servidor
+    ERR_BAD_REQUEST = 3,    // Quadro ou parâmetro inválido
+    ERR_BUSY        = 4,    // Servidor sem capacidade para a sessão
+    ERR_UNSUPPORTED = 5,    // Operação desconhecida
+    ERR_RANGE       = 6,    // Posição além do fim do arquivo ou do upload
+    ERR_CHECKSUM    = 7     // Resumo dos dados recebidos não confere com o enviado
+};
+
+/**
+ * Cabeçalho decodificado de um quadro
+ */
+typedef struct {
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint32_t request_id;
+    uint64_t length;
+} frame_header_t;
+
+/*--------------------------------------------------------------
+ * CODIFICAÇÃO BIG-ENDIAN
+ *------------------------------------------------------------*/
+static inline void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static inline void put_u32(uint8_t *p, uint32_t v) {
+    put_u16(p, (uint16_t)(v >> 16));
+    put_u16(p + 2, (uint16_t)v);
+}
+
+static inline void put_u64(uint8_t *p, uint64_t v) {
+    put_u32(p, (uint32_t)(v >> 32));
+    put_u32(p + 4, (uint32_t)v);
+}
+
+static inline uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t get_u32(const uint8_t *p) {
+    return ((uint32_t)get_u16(p) << 16) | get_u16(p + 2);
+}
+
+static inline uint64_t get_u64(const uint8_t *p) {
+    return ((uint64_t)get_u32(p) << 32) | get_u32(p + 4);
+}
+
+/*--------------------------------------------------------------
+ * CABEÇALHO DE QUADRO
+ *------------------------------------------------------------*/
+
+/**
+ * Serializa um cabeçalho de quadro
+ *
+ * @param out Buffer com FRAME_HEADER_SIZE bytes
+ */
+static inline void frame_encode(uint8_t *out, uint8_t opcode, uint16_t flags,
+                                uint32_t request_id, uint64_t length) {
+    out[0] = PROTO_VERSION;
+    out[1] = opcode;
+    put_u16(out + 2, flags);
+    put_u32(out + 4, request_id);
+    put_u64(out + 8, length);
+}
+
+/**
+ * Decodifica e valida um cabeçalho de quadro
+ *
+ * @return 0 se o cabeçalho é válido, -1 caso contrário
+ *
+ * Por que foi feito:
+ * - Um quadro de controle com payload gigante ou de versão desconhecida
+ *   indica cliente incompatível ou fluxo corrompido; a conexão deve ser
+ *   encerrada antes de alocar memória para ele
+ */
+static inline int frame_decode(const uint8_t *in, frame_header_t *h) {
+    h->version = in[0];
+    h->opcode = in[1];
+    h->flags = get_u16(in + 2);
+    h->request_id = get_u32(in + 4);
+    h->length = get_u64(in + 8);
+
+    if (h->version != PROTO_VERSION) return -1;
+    if (h->opcode != OP_DATA && h->length > FRAME_MAX_CONTROL) return -1;
+    return 0;
+}
+
+/**
+ * Retorna o nome legível de um código de operação (para logs)
+ */
+static inline const char *opcode_name(uint8_t opcode) {
+    switch (opcode) {
+        case OP_LIST: return "LIST";
+        case OP_UPLOAD: return "UPLOAD";
+        case OP_DOWNLOAD: return "DOWNLOAD";
+        case OP_DELETE: return "DELETE";
+        case OP_BYE: return "BYE";
+        case OP_UPLOAD_STATUS: return "UPLOAD_STATUS";
+        case OP_UPLOAD_COMMIT: return "UPLOAD_COMMIT";
+        case OP_STAT: return "STAT";
+        case OP_CHUNK_QUERY: return "CHUNK_QUERY";
+        case OP_CHUNK_PUT: return "CHUNK_PUT";
+        case OP_MANIFEST_PUT: return "MANIFEST_PUT";
+        case OP_SIGNATURES: return "SIGNATURES";
+        case OP_DELTA: return "DELTA";
+        case OP_CODECS: return "CODECS";
+        case OP_TREE_PUT: return "TREE_PUT";
+        case OP_TREE_GET: return "TREE_GET";
+        case OP_DATA: return "DATA";
+        case OP_OK: return "OK";
+        case OP_ERROR: return "ERROR";
+        default: return "?";
+    }
+}
+
+/**
+ * Valida um nome de arquivo recebido pela rede
+ *
+ * @return 1 se o nome é aceitável, 0 caso contrário
+ *
+ * Por que foi feito:
+ * - Nomes com '/' descrevem arquivos em subdiretórios (árvores enviadas
+ *   com TREE_PUT); cada parte entre barras precisa ser um nome comum
+ * - Impede que um cliente escape do diretório de armazenamento com
+ *   caminhos absolutos, '\\' ou partes "." e ".."
+ */
+static inline int proto_valid_name(const char *name, size_t len) {
+    if (len == 0 || len >= PROTO_MAX_NAME) return 0;
+    if (memchr(name, '\\', len) || memchr(name, '\0', len)) return 0;
+
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && name[i] != '/') continue;
+        size_t part = i - start;
+        if (part == 0) return 0;  // Barra no início, no fim ou repetida
+        if (name[start] == '.' && (part == 1 || (part == 2 && name[start + 1] == '.'))) return 0;
+        start = i + 1;
+    }
+    return 1;
+}
+
+/*--------------------------------------------------------------
+ * ENTRADAS DE LISTAGEM
+ *------------------------------------------------------------*/
+
+/**
+ * Entrada de uma página de LIST
+ */
+typedef struct {
+    uint64_t size;                  // Tamanho em bytes
+    int64_t mtime;                  // Última modificação (segundos desde 1970)
+    uint8_t hash_len;               // 0 se o hash do conteúdo não é conhecido
+    uint8_t hash[LIST_HASH_MAX];
+    char name[PROTO_MAX_NAME];
+} list_entry_t;
+
+/**
+ * Serializa uma entrada de listagem
+ *
+ * @param out Buffer com pelo menos LIST_ENTRY_MAX bytes
+ * @return Tamanho da entrada codificada
+ */
+static inline size_t list_entry_encode(uint8_t *out, const list_entry_t *e) {
+    size_t name_len = strlen(e->name);
+    size_t pos = 0;
+
+    put_u64(out, e->size);
+    put_u64(out + 8, (uint64_t)e->mtime);
+    out[16] = e->hash_len;
+    pos = 17;
+    memcpy(out + pos, e->hash, e->hash_len);
+    pos += e->hash_len;
+    put_u16(out + pos, (uint16_t)name_len);
+    memcpy(out + pos + 2, e->name, name_len);
+    return pos + 2 + name_len;
+}
+
+/**
+ * Decodifica a próxima entrada de um quadro DATA de LIST
+ *
+ * @return Bytes consumidos, ou 0 se a entrada está truncada ou é inválida
+ */
+static inline size_t list_entry_decode(const uint8_t *in, size_t len, list_entry_t *e) {
+    if (len < 19) return 0;
+    e->size = get_u64(in);
+    e->mtime = (int64_t)get_u64(in + 8);
+    e->hash_len = in[16];
+    if (e->hash_len > LIST_HASH_MAX || len < 19 + (size_t)e->hash_len) return 0;
+    memcpy(e->hash, in + 17, e->hash_len);
+
+    size_t pos = 17 + e->hash_len;
+    size_t name_len = get_u16(in + pos);
+    if (name_len >= PROTO_MAX_NAME || len < pos + 2 + name_len) return 0;
+    memcpy(e->name, in + pos + 2, name_len);
+    e->name[name_len] = '\0';
+    return pos + 2 + name_len;
+}
+
+/*--------------------------------------------------------------
+ * ENTRADAS DE LOTES DE ÁRVORES
+ *------------------------------------------------------------*/
+
+/**
+ * Tipos de entrada de um lote
+ */
+enum {
+    TREE_FILE    = 0,       // Arquivo; os bytes seguem a entrada
+    TREE_DIR     = 1,       // Diretório (criado se não existe)
+    TREE_ATTR    = 2,       // Só permissões e data de um arquivo enviado à parte
+    TREE_MISSING = 3        // Nome pedido no TREE_GET que não existe
+};
+
+/**
+ * Entrada de um lote de TREE_PUT ou TREE_GET
+ */
+typedef struct {
+    uint8_t type;                   // TREE_*
+    uint32_t mode;                  // Permissões no formato POSIX (ex.: 0644)
+    int64_t mtime;                  // Última modificação (segundos desde 1970)
+    uint64_t size;                  // Bytes que seguem uma entrada TREE_FILE
+    char name[PROTO_MAX_NAME];
+} tree_entry_t;
+
+/**
+ * Serializa uma entrada de lote
+ *
+ * @param out Buffer com pelo menos TREE_ENTRY_HEADER + PROTO_MAX_NAME bytes
+ * @return Tamanho da entrada codificada
+ */
+static inline size_t tree_entry_encode(uint8_t *out, const tree_entry_t *e) {
+    size_t name_len = strlen(e->name);
+
+    out[0] = e->type;
+    put_u32(out + 1, e->mode);
+    put_u64(out + 5, (uint64_t)e->mtime);
+    put_u64(out + 13, e->size);
+    put_u16(out + 21, (uint16_t)name_len);
+    memcpy(out + TREE_ENTRY_HEADER, e->name, name_len);
+    return TREE_ENTRY_HEADER + name_len;
+}
+
+/**
+ * Decodifica a próxima entrada de um lote
+ *
+ * @return Bytes consumidos, ou 0 se a entrada está truncada ou o nome é inválido
+ */
+static inline size_t tree_entry_decode(const uint8_t *in, size_t len, tree_entry_t *e) {
+    if (len < TREE_ENTRY_HEADER) return 0;
+    size_t name_len = get_u16(in + 21);
+    if (len < TREE_ENTRY_HEADER + name_len || !proto_valid_name((const char *)in + TREE_ENTRY_HEADER, name_len)) {
+        return 0;
+    }
+    e->type = in[0];
+    e->mode = get_u32(in + 1);
+    e->mtime = (int64_t)get_u64(in + 5);
+    e->size = get_u64(in + 13);
+    memcpy(e->name, in + TREE_ENTRY_HEADER, name_len);
+    e->name[name_len] = '\0';
+    return TREE_ENTRY_HEADER + name_len;
+}
+
+/*--------------------------------------------------------------
+ * ENVIO E RECEBIMENTO EM SOCKETS BLOQUEANTES (CLIENTE)
+ *------------------------------------------------------------*/
+
+/**
+ * Envia um quadro completo (cabeçalho + payload)
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - Payloads pequenos seguem no mesmo send() do cabeçalho, evitando um
+ *   segmento TCP extra por comando
+ */
+static inline int proto_send_frame(SOCKET s, uint8_t opcode, uint16_t flags, uint32_t request_id,
+                                   const void *payload, size_t length) {
+    uint8_t small[FRAME_HEADER_SIZE + 512];
+
+    if (length <= sizeof(small) - FRAME_HEADER_SIZE) {
+        frame_encode(small, opcode, flags, request_id, length);
+        if (length > 0) memcpy(small + FRAME_HEADER_SIZE, payload, length);
+        return net_send_all(s, small, FRAME_HEADER_SIZE + length);
+    }
+
+    frame_encode(small, opcode, flags, request_id, length);
+    if (net_send_all(s, small, FRAME_HEADER_SIZE) != 0) return -1;
+    return net_send_all(s, payload, length);
+}
+
+/**
+ * Recebe e valida o cabeçalho do próximo quadro
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro ou desconexão
+ */
+static inline int proto_recv_header(SOCKET s, frame_header_t *h) {
+    uint8_t raw[FRAME_HEADER_SIZE];
+    if (net_recv_all(s, raw, sizeof(raw)) != 0) return -1;
+    return frame_decode(raw, h);
+}
+
+/**
+ * Recebe um quadro de controle inteiro
+ *
+ * @param buf Buffer para o payload (recebe terminação '\0' extra)
+ * @param cap Capacidade do buffer
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+static inline int proto_recv_frame(SOCKET s, frame_header_t *h, char *buf, size_t cap) {
+    if (proto_recv_header(s, h) != 0) return -1;
+    if (h->length >= cap) return -1;
+    if (net_recv_all(s, buf, (size_t)h->length) != 0) return -1;
+    buf[h->length] = '\0';
+    return 0;
+}
+
+/**
+ * Monta o payload de uma resposta OP_ERROR
+ *
+ * @return Tamanho do payload gerado
+ */
+static inline size_t proto_error_payload(uint8_t *out, size_t cap, uint16_t code, const char *message) {
+    size_t len = strlen(message);
+    if (len > cap - 2) len = cap - 2;
+    put_u16(out, code);
+    memcpy(out + 2, message, len);
+    return len + 2;
+}
+
+#endif /* BIGFS_PROTOCOL_H */
@@ -0,0 +1,453 @@
+/*******************************************************************************
+ * LIMITES DE BANDA
+ *
+ * Descrição: Baldes de fichas (token buckets) que limitam os bytes de
+ *            arquivos enviados e recebidos por conexão, por endereço IP e
+ *            no servidor inteiro, e o temporizador que devolve as sessões
+ *            paradas pelo limite quando a banda volta a estar disponível.
+ *
+ * Componentes:
+ * - rate_limits_t:   taxas configuradas (KB/s) por escopo e sentido; podem
+ *                    ser trocadas com o servidor rodando
+ * - rate_bucket_t:   balde de um escopo e sentido; enche na taxa configurada
+ *                    e guarda no máximo RATE_BURST_MS de banda
+ * - rate_ip_table_t: baldes compartilhados pelas conexões de um mesmo IP
+ * - pacer_t:         thread que acorda cada sessão no instante em que o
+ *                    limite que a parou volta a liberar bytes
+ *
+ * Uma transferência consulta a cadeia de baldes (conexão, IP, global) antes
+ * de cada envio ou recebimento e só prossegue se todos têm fichas; os bytes
+ * transferidos são descontados de todos. Um quadro inteiro pode deixar o
+ * balde negativo (dívida), e a dívida é paga esperando, então a taxa média
+ * respeita o limite mesmo com quadros maiores que a rajada.
+ *
+ * Arquivo de limites (uma regra por linha, "#" inicia um comentário):
+ *
+ *   <escopo> <sentido> <bytes por segundo>
+ *
+ *   escopo:  conexao, ip ou global
+ *   sentido: download (servidor -> cliente) ou upload (cliente -> servidor)
+ *   valor:   número com sufixo opcional K, M ou G (potências de 1024);
+ *            0 remove o limite
+ ******************************************************************************/
+#ifndef BIGFS_RATELIMIT_H
+#define BIGFS_RATELIMIT_H
+
+#include "platform.h"
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define RATE_SCOPES 3                       // Conexão, IP e global
+#define RATE_BURST_MS 100                   // Banda acumulada no máximo por um balde parado
+#define RATE_MIN_BURST (256L * 1024)        // Rajada mínima (um quadro DATA)
+#define RATE_MIN_GRANT (16L * 1024)         // Menor liberação: evita envios de poucos bytes
+#define RATE_IP_SLOTS 256                   // Listas da tabela de endereços
+#define RATE_UNLIMITED INT64_MAX
+
+/**
+ * Escopos de um limite
+ */
+typedef enum {
+    RATE_CONNECTION,
+    RATE_IP,
+    RATE_GLOBAL
+} rate_scope_t;
+
+/**
+ * Sentidos de uma transferência, do ponto de vista do cliente
+ */
+typedef enum {
+    RATE_DOWN,                  // Servidor envia (download)
+    RATE_UP                     // Servidor recebe (upload)
+} rate_dir_t;
+
+/*--------------------------------------------------------------
+ * ESTRUTURAS
+ *------------------------------------------------------------*/
+
+/**
+ * Taxas configuradas
+ *
+ * Por que foi feito:
+ * - Os baldes leem a taxa a cada consulta, então trocar um valor aqui vale
+ *   para todas as conexões já abertas, sem reiniciar o servidor
+ * - KB/s cabe em um long (leitura atômica) mesmo onde long tem 32 bits
+ */
+typedef struct {
+    volatile long kbps[RATE_SCOPES][2];     // [escopo][sentido]; 0: sem limite
+} rate_limits_t;
+
+/**
+ * Balde de fichas de um escopo e sentido
+ */
+typedef struct {
+    mutex_t lock;
+    const volatile long *kbps;  // Taxa configurada (aponta para rate_limits_t)
+    double tokens;              // Bytes disponíveis; negativo: dívida a pagar
+    uint64_t last_ns;           // Último reabastecimento
+} rate_bucket_t;
+
+/**
+ * Baldes das conexões de um endereço IP
+ */
+typedef struct rate_ip {
+    uint32_t addr;              // Endereço IPv4 (ordem da rede)
+    int refs;                   // Conexões abertas deste endereço
+    rate_bucket_t bucket[2];    // [sentido]
+    struct rate_ip *next;
+} rate_ip_t;
+
+/**
+ * Tabela de endereços com conexões abertas
+ */
+typedef struct {
+    mutex_t lock;
+    rate_ip_t *slots[RATE_IP_SLOTS];
+} rate_ip_table_t;
+
+/**
+ * Sessão esperando a banda voltar
+ */
+typedef struct {
+    uint64_t due;               // Instante (monotonic_ns) em que pode continuar
+    void *owner;
+} pacer_entry_t;
+
+/**
+ * Temporizador das sessões paradas pelo limite
+ */
+typedef struct {
+    mutex_t lock;
+    cond_t changed;
+    pacer_entry_t *heap;        // Heap mínimo por prazo
+    int count, cap;
+    void (*wake)(void *owner);  // Devolve o dono à fila de trabalho
+} pacer_t;
+
+/*--------------------------------------------------------------
+ * TAXAS CONFIGURADAS
+ *------------------------------------------------------------*/
+
+/**
+ * Converte "<número>[K|M|G]" (bytes por segundo) em KB/s
+ *
+ * @return 0 em caso de sucesso, -1 se o valor é inválido
+ */
+static inline int rate_parse_value(const char *text, long *kbps) {
+    char *end;
+    double value = strtod(text, &end);
+
+    if (end == text || value < 0) return -1;
+    if (*end == 'K' || *end == 'k') value *= 1024.0, end++;
+    else if (*end == 'M' || *end == 'm') value *= 1024.0 * 1024.0, end++;
+    else if (*end == 'G' || *end == 'g') value *= 1024.0 * 1024.0 * 1024.0, end++;
+    if (*end != '\0' || value / 1024.0 > 2147483647.0) return -1;
+
+    *kbps = (long)(value / 1024.0);
+    if (*kbps == 0 && value > 0) *kbps = 1;   // Menor limite representável
+    return 0;
+}
+
+/**
+ * Lê um arquivo de limites
+ *
+ * @param out Recebe as taxas; escopos ausentes do arquivo ficam sem limite
+ * @return 0 em caso de sucesso, -1 se o arquivo não pôde ser aberto, ou o
+ *         número da primeira linha inválida
+ *
+ * Por que foi feito:
+ * - O arquivo inteiro é validado antes de qualquer taxa mudar; uma edição
+ *   com erro mantém os limites anteriores
+ */
+static inline int rate_limits_load(const char *path, long out[RATE_SCOPES][2]) {
+    static const char *scopes[RATE_SCOPES] = { "conexao", "ip", "global" };
+    char line[256];
+    int number = 0;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) return -1;
+    memset(out, 0, sizeof(long) * RATE_SCOPES * 2);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char scope[32], dir[32], value[64], extra[2];
+        char *comment = strchr(line, '#');
+        number++;
+
+        if (comment != NULL) *comment = '\0';
+        int fields = sscanf(line, "%31s %31s %63s %1s", scope, dir, value, extra);
+        if (fields <= 0) continue;  // Linha vazia ou só comentário
+
+        int sc = -1, d = -1;
+        long kbps;
+        for (int i = 0; i < RATE_SCOPES; i++) {
+            if (strcmp(scope, scopes[i]) == 0) sc = i;
+        }
+        if (strcmp(dir, "download") == 0) d = RATE_DOWN;
+        else if (strcmp(dir, "upload") == 0) d = RATE_UP;
+        if (fields != 3 || sc < 0 || d < 0 || rate_parse_value(value, &kbps) != 0) {
+            fclose(f);
+            return number;
+        }
+        out[sc][d] = kbps;
+    }
+    fclose(f);
+    return 0;
+}
+
+/**
+ * Aplica novas taxas
+ *
+ * @return 1 se alguma taxa mudou, 0 caso contrário
+ */
+static inline int rate_limits_apply(rate_limits_t *limits, long kbps[RATE_SCOPES][2]) {
+    int changed = 0;
+
+    for (int sc = 0; sc < RATE_SCOPES; sc++) {
+        for (int d = 0; d < 2; d++) {
+            if (limits->kbps[sc][d] != kbps[sc][d]) changed = 1;
+            limits->kbps[sc][d] = kbps[sc][d];
+        }
+    }
+    return changed;
+}
+
+/*--------------------------------------------------------------
+ * BALDES DE FICHAS
+ *------------------------------------------------------------*/
+
+/**
+ * Prepara um balde cheio ligado a uma taxa configurada
+ */
+static inline void rate_bucket_init(rate_bucket_t *b, const volatile long *kbps) {
+    mutex_init(&b->lock);
+    b->kbps = kbps;
+    b->tokens = (double)RATE_MIN_BURST;
+    b->last_ns = monotonic_ns();
+}
+
+static inline void rate_bucket_destroy(rate_bucket_t *b) {
+    mutex_destroy(&b->lock);
+}
+
+/**
+ * Acrescenta as fichas acumuladas desde o último reabastecimento
+ *
+ * @return Taxa atual em bytes por segundo (chamado com o lock)
+ */
+static inline double rate_bucket_refill_locked(rate_bucket_t *b, uint64_t now, long kbps) {
+    double rate = (double)kbps * 1024.0;
+    double burst = rate * RATE_BURST_MS / 1000.0;
+
+    if (burst < (double)RATE_MIN_BURST) burst = (double)RATE_MIN_BURST;
+    if (now > b->last_ns) b->tokens += rate * (double)(now - b->last_ns) / 1e9;
+    if (b->tokens > burst) b->tokens = burst;
+    b->last_ns = now;
+    return rate;
+}
+
+/**
+ * Quanto o balde libera agora
+ *
+ * @param wait_ns Recebe o tempo até liberar quando o retorno é 0
+ * @return Bytes liberados (RATE_UNLIMITED sem limite), 0 se é preciso esperar
+ */
+static inline int64_t rate_bucket_allow(rate_bucket_t *b, uint64_t now, uint64_t *wait_ns) {
+    long kbps = *b->kbps;
+    int64_t allow = 0;
+
+    if (kbps == 0) return RATE_UNLIMITED;
+
+    mutex_lock(&b->lock);
+    double rate = rate_bucket_refill_locked(b, now, kbps);
+    double grant = rate / 10.0 < (double)RATE_MIN_GRANT ? rate / 10.0 : (double)RATE_MIN_GRANT;
+    if (b->tokens >= grant) allow = (int64_t)b->tokens;
+    else *wait_ns = (uint64_t)((grant - b->tokens) / rate * 1e9) + 1;
+    mutex_unlock(&b->lock);
+    return allow;
+}
+
+/**
+ * Desconta bytes transferidos (pode deixar o balde em dívida)
+ */
+static inline void rate_bucket_charge(rate_bucket_t *b, int64_t bytes) {
+    if (*b->kbps == 0) return;
+    mutex_lock(&b->lock);
+    b->tokens -= (double)bytes;
+    mutex_unlock(&b->lock);
+}
+
+/**
+ * Consulta uma cadeia de baldes (conexão, IP, global)
+ *
+ * @param wait_ns Recebe a maior espera entre os baldes sem fichas
+ * @return Menor liberação entre os baldes, 0 se algum exige espera
+ */
+static inline int64_t rate_allow(rate_bucket_t **chain, int count, uint64_t now, uint64_t *wait_ns) {
+    int64_t allow = RATE_UNLIMITED;
+
+    *wait_ns = 0;
+    for (int i = 0; i < count; i++) {
+        uint64_t wait = 0;
+        int64_t a = rate_bucket_allow(chain[i], now, &wait);
+        if (a < allow) allow = a;
+        if (wait > *wait_ns) *wait_ns = wait;
+    }
+    return allow;
+}
+
+/**
+ * Desconta bytes transferidos de todos os baldes da cadeia
+ */
+static inline void rate_charge(rate_bucket_t **chain, int count, int64_t bytes) {
+    for (int i = 0; i < count; i++) rate_bucket_charge(chain[i], bytes);
+}
+
+/*--------------------------------------------------------------
+ * BALDES POR ENDEREÇO IP
+ *------------------------------------------------------------*/
+
+static inline void rate_ip_init(rate_ip_table_t *t) {
+    mutex_init(&t->lock);
+    memset(t->slots, 0, sizeof(t->slots));
+}
+
+/**
+ * Obtém (ou cria) os baldes de um endereço para uma nova conexão
+ *
+ * @return Baldes do endereço, NULL se faltou memória
+ */
+static inline rate_ip_t *rate_ip_acquire(rate_ip_table_t *t, rate_limits_t *limits, uint32_t addr) {
+    rate_ip_t **slot = &t->slots[(addr ^ (addr >> 8) ^ (addr >> 16) ^ (addr >> 24)) % RATE_IP_SLOTS];
+    rate_ip_t *ip;
+
+    mutex_lock(&t->lock);
+    for (ip = *slot; ip != NULL && ip->addr != addr; ip = ip->next) {}
+    if (ip == NULL && (ip = (rate_ip_t *)calloc(1, sizeof(rate_ip_t))) != NULL) {
+        ip->addr = addr;
+        rate_bucket_init(&ip->bucket[RATE_DOWN], &limits->kbps[RATE_IP][RATE_DOWN]);
+        rate_bucket_init(&ip->bucket[RATE_UP], &limits->kbps[RATE_IP][RATE_UP]);
+        ip->next = *slot;
+        *slot = ip;
+    }
+    if (ip != NULL) ip->refs++;
+    mutex_unlock(&t->lock);
+    return ip;
+}
+
+/**
+ * Devolve os baldes de um endereço; a última conexão os libera
+ */
+static inline void rate_ip_release(rate_ip_table_t *t, rate_ip_t *ip) {
+    uint32_t addr = ip->addr;
+    rate_ip_t **slot = &t->slots[(addr ^ (addr >> 8) ^ (addr >> 16) ^ (addr >> 24)) % RATE_IP_SLOTS];
+
+    mutex_lock(&t->lock);
+    if (--ip->refs > 0) {
+        mutex_unlock(&t->lock);
+        return;
+    }
+    while (*slot != ip) slot = &(*slot)->next;
+    *slot = ip->next;
+    mutex_unlock(&t->lock);
+
+    rate_bucket_destroy(&ip->bucket[RATE_DOWN]);
+    rate_bucket_destroy(&ip->bucket[RATE_UP]);
+    free(ip);
+}
+
+/*--------------------------------------------------------------
+ * TEMPORIZADOR DAS SESSÕES PARADAS
+ *------------------------------------------------------------*/
+
+/**
+ * Laço da thread do temporizador
+ *
+ * Por que foi feito:
+ * - Uma sessão parada pelo limite não tem evento de rede que a acorde;
+ *   a thread dorme até o prazo mais próximo e devolve a sessão à fila
+ */
+static inline void *pacer_main(void *arg) {
+    pacer_t *p = (pacer_t *)arg;
+
+    mutex_lock(&p->lock);
+    while (1) {
+        if (p->count == 0) {
+            cond_wait(&p->changed, &p->lock);
+            continue;
+        }
+        uint64_t now = monotonic_ns();
+        if (p->heap[0].due > now) {
+            uint64_t ms = (p->heap[0].due - now + 999999) / 1000000;
+            cond_wait_ms(&p->changed, &p->lock, (int)(ms > 1000 ? 1000 : ms));
+            continue;
+        }
+
+        // Retira o topo do heap
+        void *owner = p->heap[0].owner;
+        pacer_entry_t last = p->heap[--p->count];
+        int i = 0;
+        while (1) {
+            int child = 2 * i + 1;
+            if (child >= p->count) break;
+            if (child + 1 < p->count && p->heap[child + 1].due < p->heap[child].due) child++;
+            if (last.due <= p->heap[child].due) break;
+            p->heap[i] = p->heap[child];
+            i = child;
+        }
+        if (p->count > 0) p->heap[i] = last;
+
+        mutex_unlock(&p->lock);
+        p->wake(owner);
+        mutex_lock(&p->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Inicia a thread do temporizador
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+static inline int pacer_start(pacer_t *p, void (*wake)(void *owner)) {
+    mutex_init(&p->lock);
+    cond_init(&p->changed);
+    p->heap = NULL;
+    p->count = p->cap = 0;
+    p->wake = wake;
+
+    thread_t thread;
+    return thread_create(&thread, pacer_main, p);
+}
+
+/**
+ * Agenda o retorno de uma sessão parada pelo limite
+ *
+ * @param due Instante (monotonic_ns) em que a sessão pode continuar
+ */
+static inline void pacer_park(pacer_t *p, void *owner, uint64_t due) {
+    mutex_lock(&p->lock);
+    if (p->count == p->cap) {
+        int cap = p->cap ? p->cap * 2 : 64;
+        pacer_entry_t *grown = (pacer_entry_t *)realloc(p->heap, (size_t)cap * sizeof(pacer_entry_t));
+        if (grown == NULL) {
+            // Sem memória para esperar: a sessão tenta de novo na hora
+            mutex_unlock(&p->lock);
+            p->wake(owner);
+            return;
+        }
+        p->heap = grown;
+        p->cap = cap;
+    }
+
+    int i = p->count++;
+    while (i > 0 && p->heap[(i - 1) / 2].due > due) {
+        p->heap[i] = p->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    p->heap[i].due = due;
+    p->heap[i].owner = owner;
+    if (i == 0) cond_signal(&p->changed);   // Novo prazo mais próximo
+    mutex_unlock(&p->lock);
+}
+
+#endif // BIGFS_RATELIMIT_H
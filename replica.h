@@ -0,0 +1,991 @@
+/*******************************************************************************
+ * REPLICAÇÃO DOS ARQUIVOS GRAVADOS (QUORUM DE ESCRITA E RECUPERAÇÃO)
+ *
+ * Descrição: Leva a outros servidores (réplicas) cada arquivo que o
+ *            servidor grava ou exclui, e decide quando uma escrita tem
+ *            cópias suficientes para ser confirmada ao cliente.
+ *
+ * Organização:
+ * - As réplicas são servidores comuns; o servidor principal fala com elas
+ *   pela biblioteca de pedidos assíncronos (clientlib.h), com conexões
+ *   persistentes e vários pedidos em andamento em cada uma
+ * - replica_write_t acompanha uma escrita: os pedidos partem para todas
+ *   as réplicas ao mesmo tempo e a escrita é decidida assim que o quorum
+ *   (contando a cópia local) confirmou, ou quando não há mais como
+ *   atingi-lo; quem espera é acordado como pelo estágio de disco
+ * - Os pedidos de um mesmo nome a uma réplica saem um de cada vez, na
+ *   ordem em que foram feitos (replica_op_t); cada um leva o estado local
+ *   do nome no momento em que parte: o arquivo, aberto ali, ou a exclusão
+ * - Um upload grande segue para as réplicas enquanto chega
+ *   (replica_stream_t), por conexões só para isso; a gravação local só
+ *   encerra o envio, e o pedido do nome espera a confirmação final. Num
+ *   upload em blocos cada bloco segue assim, e o pedido do nome pede à
+ *   réplica a conclusão depois que os blocos dela terminaram
+ * - Uma réplica que falhou fica marcada como atrasada; uma thread compara
+ *   a listagem dela (tamanho e resumo de cada arquivo) com os arquivos
+ *   locais e envia só o que falta ou difere, excluindo o que sobrou
+ *
+ * Por que foi feito:
+ * - Com uma cópia só, a perda de um disco perde os arquivos; esperar a
+ *   confirmação de todas as réplicas deixaria cada upload tão lento
+ *   quanto a réplica mais lenta, e parada enquanto uma estiver fora
+ ******************************************************************************/
+#ifndef BIGFS_REPLICA_H
+#define BIGFS_REPLICA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "protocol.h"
+#include "clientlib.h"
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define REPLICA_MAX 8                   // Réplicas de um servidor
+#define REPLICA_CONNECTIONS 2           // Conexões com cada réplica
+#define REPLICA_WINDOW 32               // Pedidos sem resposta por conexão
+#define REPLICA_CATCHUP_MS 10000        // Intervalo entre tentativas de recuperação
+#define REPLICA_CATCHUP_PARALLEL 64     // Arquivos em andamento numa recuperação
+#define REPLICA_LANES 256               // Grupos de nomes na fila de pedidos
+#define REPLICA_STREAMS 4               // Conexões de envio contínuo com cada réplica
+#define REPLICA_STREAM_MIN (1024 * 1024) // Uploads a partir deste tamanho seguem enquanto chegam
+#define REPLICA_STREAM_LIMIT (16 * 1024 * 1024) // Bytes à espera de uma réplica antes de abandonar o envio
+
+/**
+ * Arquivo de uma listagem (local ou de uma réplica)
+ */
+typedef struct {
+    char *name;
+    uint64_t size;
+    int64_t mtime;
+    uint8_t digest_len;         // 0 se o resumo não é conhecido
+    uint8_t digest[LIST_HASH_MAX];
+} replica_file_t;
+
+struct replica_write;
+struct replica_op;
+struct replica_stream;
+struct replica_upload;
+
+/**
+ * Posição de uma réplica em uma escrita (contexto das funções de retorno)
+ */
+typedef struct {
+    struct replica_write *write;
+    int node;
+} replica_slot_t;
+
+/**
+ * Réplicas do servidor
+ */
+typedef struct {
+    int count;
+    int quorum;                 // Cópias confirmadas (com a local) antes do OK
+    char names[REPLICA_MAX][RING_NAME_SIZE];
+    bfs_client_t *nodes[REPLICA_MAX];
+    bfs_client_t *streams[REPLICA_MAX]; // Envios contínuos (um por conexão)
+    mutex_t lock;
+    cond_t changed;             // Alguma réplica ficou atrasada
+    int behind[REPLICA_MAX];    // Precisa de recuperação
+    struct replica_op *lanes[REPLICA_LANES]; // Pedidos por grupo de nomes, em ordem
+    struct replica_upload *uploads; // Uploads em blocos com blocos seguindo
+    int stopping;
+    thread_t thread;
+
+    // Arquivos locais, fornecidos pelo servidor
+    size_t (*local)(replica_file_t **files); // Listagem em ordem de nome
+    int (*present)(const char *name);         // O arquivo existe agora
+    int (*path)(char *out, const char *name); // Caminho local (0 em caso de sucesso)
+} replica_set_t;
+
+/**
+ * Pedido de um nome a uma réplica
+ */
+typedef struct replica_op {
+    struct replica_op *next;    // Próximo pedido do mesmo grupo de nomes
+    replica_set_t *set;
+    int node;
+    int lane;
+    int removal;                // O nome foi excluído no servidor
+    int removing;               // Partiu como exclusão
+    struct replica_stream *stream; // Envio contínuo a encerrar (NULL: nenhum)
+    uint64_t upload_id;         // Upload em blocos a concluir na réplica (0: nenhum)
+    struct replica_op *parked;  // Próximo pedido esperando os blocos do mesmo upload
+    bfs_done_fn done;
+    void *ctx;
+    char *name;
+} replica_op_t;
+
+/**
+ * Envio contínuo de um upload a uma réplica
+ */
+typedef struct replica_stream {
+    mutex_t lock;
+    replica_set_t *set;
+    int node;
+    uint64_t upload_id;         // Bloco de um upload em blocos (0: arquivo inteiro)
+    bfs_stream_t *stream;
+    int finished;               // A resposta da réplica chegou
+    int ok;
+    replica_op_t *op;           // Pedido do nome esperando a resposta
+    int refs;                   // Dono (escrita ou pedido do nome) + pedido do envio
+} replica_stream_t;
+
+/**
+ * Blocos de um upload seguindo para uma réplica
+ */
+typedef struct replica_upload {
+    struct replica_upload *next;
+    uint64_t id;
+    int node;
+    int pending;                // Blocos sem resposta
+    replica_op_t *parked;       // Pedidos do nome esperando os blocos
+} replica_upload_t;
+
+/**
+ * Uma escrita sendo levada às réplicas
+ */
+typedef struct replica_write {
+    replica_set_t *set;
+    mutex_t lock;
+    int starting;               // Ainda recebendo pedidos: nada é decidido
+    int lost;                   // Réplicas que falharam em algum pedido
+    int decided;                // 1 quorum atingido, -1 inatingível, 0 aguardando
+    int waiting;                // O dono parou esperando a decisão
+    int refs;                   // Pedidos em andamento + o dono
+    int left[REPLICA_MAX];      // Pedidos sem resposta de cada réplica
+    int failed[REPLICA_MAX];
+    replica_slot_t slots[REPLICA_MAX];
+    replica_stream_t *streams[REPLICA_MAX]; // Envios do upload ainda sem pedido do nome
+    void (*wake)(void *owner);
+    void *owner;
+} replica_write_t;
+
+/**
+ * Listagem e pedidos de uma recuperação
+ */
+typedef struct {
+    mutex_t lock;
+    cond_t cond;
+    replica_file_t *files;      // Arquivos da réplica
+    size_t count, cap;
+    int pending;                // Pedidos sem resposta
+    int failed;
+    int oom;
+} replica_scan_t;
+
+/**
+ * Consulta do resumo de um arquivo da réplica
+ */
+typedef struct {
+    replica_scan_t *scan;
+    replica_file_t *file;
+} replica_probe_t;
+
+/*--------------------------------------------------------------
+ * PEDIDOS EM ORDEM POR NOME
+ *------------------------------------------------------------*/
+
+/**
+ * Marca uma réplica como atrasada e avisa a thread de recuperação
+ */
+static inline void replica_mark_behind(replica_set_t *set, int node) {
+    mutex_lock(&set->lock);
+    if (!set->behind[node]) {
+        set->behind[node] = 1;
+        cond_signal(&set->changed);
+    }
+    mutex_unlock(&set->lock);
+}
+
+static inline void replica_op_done(void *ctx, const bfs_result_t *r);
+static inline void replica_op_issue(replica_op_t *op);
+
+/**
+ * Procura os blocos de um upload seguindo para uma réplica
+ *
+ * Deve ser chamada com o lock do conjunto adquirido.
+ */
+static inline replica_upload_t **replica_upload_find(replica_set_t *set, uint64_t id, int node) {
+    replica_upload_t **p = &set->uploads;
+    while (*p != NULL && ((*p)->id != id || (*p)->node != node)) p = &(*p)->next;
+    return p;
+}
+
+/**
+ * Conta um bloco que terminou de seguir; com o último, os pedidos que
+ * esperavam partem
+ */
+static inline void replica_upload_end(replica_set_t *set, uint64_t id, int node) {
+    replica_op_t *parked = NULL;
+
+    mutex_lock(&set->lock);
+    replica_upload_t **p = replica_upload_find(set, id, node), *u = *p;
+    if (u != NULL && --u->pending == 0) {
+        *p = u->next;
+        parked = u->parked;
+        free(u);
+    }
+    mutex_unlock(&set->lock);
+    while (parked != NULL) {
+        replica_op_t *next = parked->parked;
+        replica_op_issue(parked);
+        parked = next;
+    }
+}
+
+/**
+ * Recebe a conclusão de um upload em blocos pedida à réplica
+ *
+ * Por que foi feito:
+ * - Se faltou algum bloco na réplica (um envio abandonado, ou blocos que
+ *   chegaram ao servidor antes de uma parada), o arquivo segue inteiro
+ */
+static inline void replica_commit_done(void *ctx, const bfs_result_t *r) {
+    replica_op_t *op = (replica_op_t *)ctx;
+
+    op->upload_id = 0;
+    if (r->status == BFS_OK) replica_op_done(op, r);
+    else replica_op_issue(op);
+}
+
+/**
+ * Libera uma referência de um envio contínuo
+ */
+static inline void replica_stream_unref(replica_stream_t *hold) {
+    mutex_lock(&hold->lock);
+    int last = --hold->refs == 0;
+    mutex_unlock(&hold->lock);
+    if (!last) return;
+    bfs_stream_release(hold->stream);
+    mutex_destroy(&hold->lock);
+    free(hold);
+}
+
+/**
+ * Recebe a resposta de um envio contínuo (thread da conexão)
+ *
+ * Por que foi feito:
+ * - Se o pedido do nome já está esperando, ele é concluído aqui; se o
+ *   envio falhou, o pedido segue como um envio comum do arquivo local
+ */
+static inline void replica_stream_done(void *ctx, const bfs_result_t *r) {
+    replica_stream_t *hold = (replica_stream_t *)ctx;
+
+    mutex_lock(&hold->lock);
+    hold->finished = 1;
+    hold->ok = r->status == BFS_OK;
+    replica_op_t *op = hold->op;
+    hold->op = NULL;
+    mutex_unlock(&hold->lock);
+    if (op != NULL) {
+        op->stream = NULL;
+        replica_stream_unref(hold);
+        if (r->status == BFS_OK) replica_op_done(op, r);
+        else replica_op_issue(op);
+    }
+    if (hold->upload_id != 0) replica_upload_end(hold->set, hold->upload_id, hold->node);
+    replica_stream_unref(hold);
+}
+
+/**
+ * Envia um pedido: o arquivo local como está agora, ou a exclusão
+ *
+ * Por que foi feito:
+ * - Cada pedido parte depois de o anterior do mesmo nome ser respondido e
+ *   lê o estado local só então; o último pedido de um nome sempre leva o
+ *   estado mais novo, mesmo que sessões diferentes tenham gravado e
+ *   excluído o nome em ordem diferente da dos pedidos
+ * - O arquivo vai aberto para a biblioteca: as novas tentativas reenviam
+ *   a mesma versão
+ */
+static inline void replica_op_issue(replica_op_t *op) {
+    replica_set_t *set = op->set;
+    bfs_client_t *c = set->nodes[op->node];
+    char path[MAX_PATH];
+    replica_stream_t *hold = op->stream;
+
+    if (hold != NULL) {
+        // Upload que já seguiu enquanto chegava: só falta encerrar o envio
+        mutex_lock(&hold->lock);
+        int finished = hold->finished, ok = hold->ok;
+        if (!finished) {
+            hold->op = op;
+            bfs_stream_close(hold->stream, BFS_STREAM_END);
+        }
+        mutex_unlock(&hold->lock);
+        if (!finished) return;
+        op->stream = NULL;
+        replica_stream_unref(hold);
+        if (ok) {
+            bfs_result_t r;
+            memset(&r, 0, sizeof(r));
+            r.status = BFS_OK;
+            replica_op_done(op, &r);
+            return;
+        }
+    }
+
+    if (op->upload_id != 0) {
+        // Upload em blocos: a conclusão espera os blocos que ainda seguem
+        mutex_lock(&set->lock);
+        replica_upload_t *u = *replica_upload_find(set, op->upload_id, op->node);
+        if (u != NULL) {
+            op->parked = u->parked;
+            u->parked = op;
+        }
+        mutex_unlock(&set->lock);
+        if (u == NULL) bfs_commit_upload(c, op->upload_id, replica_commit_done, op);
+        return;
+    }
+
+    int fd = set->path(path, op->name) == 0 ? file_open_read(path) : -1;
+
+    if (fd >= 0) {
+        bfs_put_fd(c, fd, op->name, replica_op_done, op);
+    } else if (!set->present(op->name)) {
+        op->removing = 1;
+        bfs_delete(c, op->name, replica_op_done, op);
+    } else {
+        bfs_result_t r;
+        memset(&r, 0, sizeof(r));
+        r.status = BFS_REFUSED;
+        snprintf(r.message, sizeof(r.message), "Erro ao ler o arquivo.");
+        replica_op_done(op, &r);
+    }
+}
+
+/**
+ * Grupo de nomes de um pedido
+ */
+static inline int replica_lane(int node, const char *name) {
+    uint32_t hash = 2166136261u ^ (uint32_t)node;
+    for (const char *p = name; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+    return (int)(hash % REPLICA_LANES);
+}
+
+/**
+ * Indica se dois pedidos são do mesmo nome na mesma réplica
+ */
+static inline int replica_op_same(const replica_op_t *a, const replica_op_t *b) {
+    return a->node == b->node && strcmp(a->name, b->name) == 0;
+}
+
+/**
+ * Conclui um pedido e envia o próximo do mesmo nome (thread da conexão)
+ *
+ * Por que foi feito:
+ * - Excluir o que a réplica já não tem deixa a réplica como devia ficar,
+ *   mas, se a exclusão foi feita no servidor, a réplica não tinha um
+ *   arquivo que devia ter: ela é marcada como atrasada
+ */
+static inline void replica_op_done(void *ctx, const bfs_result_t *r) {
+    replica_op_t *op = (replica_op_t *)ctx, **p, *next;
+    replica_set_t *set = op->set;
+    bfs_result_t result = *r;
+
+    if (op->removing && r->status == BFS_REFUSED && r->code == ERR_NOT_FOUND) {
+        if (op->removal) replica_mark_behind(set, op->node);
+        result.status = BFS_OK;
+    }
+    if (op->done != NULL) op->done(op->ctx, &result);
+
+    mutex_lock(&set->lock);
+    for (p = &set->lanes[op->lane]; *p != op; p = &(*p)->next) {}
+    *p = op->next;
+    for (next = op->next; next != NULL && !replica_op_same(next, op); next = next->next) {}
+    mutex_unlock(&set->lock);
+    free(op);
+    if (next != NULL) replica_op_issue(next);
+}
+
+/**
+ * Pede que a réplica fique com o estado local de um nome
+ *
+ * @param removal 1 se o nome foi excluído no servidor
+ * @param stream Envio contínuo do arquivo a encerrar (NULL: nenhum); a
+ *               referência passa para o pedido, e o envio é abandonado se
+ *               o nome tem pedidos na frente
+ * @param upload_id Upload em blocos a concluir na réplica (0: nenhum)
+ * @param done Chamada com a resposta (pode ser antes do retorno)
+ *
+ * Por que foi feito:
+ * - Uma réplica tem várias conexões e a biblioteca devolve à fila os
+ *   pedidos de uma conexão perdida; só com um pedido por nome em
+ *   andamento a réplica aplica as escritas de um nome na ordem certa
+ */
+static inline void replica_submit(replica_set_t *set, int node, const char *name, int removal,
+                                  replica_stream_t *stream, uint64_t upload_id, bfs_done_fn done, void *ctx) {
+    size_t len = strlen(name) + 1;
+    replica_op_t *op = (replica_op_t *)malloc(sizeof(replica_op_t) + len), **p;
+    int busy = 0;
+
+    if (op == NULL) {
+        bfs_result_t r;
+        memset(&r, 0, sizeof(r));
+        r.status = BFS_REFUSED;
+        snprintf(r.message, sizeof(r.message), "Memória insuficiente.");
+        if (stream != NULL) {
+            bfs_stream_close(stream->stream, BFS_STREAM_CANCEL);
+            replica_stream_unref(stream);
+        }
+        if (done != NULL) done(ctx, &r);
+        return;
+    }
+    memset(op, 0, sizeof(*op));
+    op->name = (char *)(op + 1);
+    memcpy(op->name, name, len);
+    op->set = set;
+    op->node = node;
+    op->lane = replica_lane(node, name);
+    op->removal = removal;
+    op->stream = stream;
+    op->upload_id = upload_id;
+    op->done = done;
+    op->ctx = ctx;
+
+    mutex_lock(&set->lock);
+    for (p = &set->lanes[op->lane]; *p != NULL; p = &(*p)->next) busy |= replica_op_same(*p, op);
+    if (busy) op->stream = NULL;
+    *p = op;
+    mutex_unlock(&set->lock);
+    if (busy && stream != NULL) {
+        // Esperando a vez do nome, o envio prenderia uma conexão de envio
+        // contínuo que outro pedido da fila pode precisar; o arquivo segue
+        // inteiro quando chegar a vez
+        bfs_stream_close(stream->stream, BFS_STREAM_CANCEL);
+        replica_stream_unref(stream);
+    }
+    if (!busy) replica_op_issue(op);
+}
+
+/*--------------------------------------------------------------
+ * ESCRITAS
+ *------------------------------------------------------------*/
+
+/**
+ * Indica se uma consulta da recuperação terminou bem
+ *
+ * Por que foi feito:
+ * - Um arquivo que sumiu da réplica entre a listagem e a consulta não é
+ *   falha: o envio seguinte o leva de novo
+ */
+static inline int replica_ok(const bfs_result_t *r) {
+    return r->status == BFS_OK || (r->status == BFS_REFUSED && r->code == ERR_NOT_FOUND);
+}
+
+/**
+ * Decide a escrita se o quorum foi atingido ou ficou inatingível
+ *
+ * Deve ser chamada com o lock da escrita adquirido.
+ *
+ * @return 1 se o dono deve ser acordado
+ */
+static inline int replica_write_decide(replica_write_t *w) {
+    int needed = w->set->quorum - 1, confirmed = 0;
+
+    if (w->starting || w->decided != 0) return 0;
+    for (int i = 0; i < w->set->count; i++) confirmed += w->left[i] == 0 && !w->failed[i];
+    if (confirmed >= needed) w->decided = 1;
+    else if (w->set->count - w->lost < needed) w->decided = -1;
+    if (w->decided == 0 || !w->waiting) return 0;
+    w->waiting = 0;
+    return w->wake != NULL;
+}
+
+/**
+ * Libera uma referência da escrita (chamada com o lock adquirido)
+ */
+static inline void replica_write_unref(replica_write_t *w) {
+    int last = --w->refs == 0;
+    mutex_unlock(&w->lock);
+    if (last) {
+        mutex_destroy(&w->lock);
+        free(w);
+    }
+}
+
+/**
+ * Recebe a resposta de uma réplica (thread da conexão)
+ */
+static inline void replica_write_done(void *ctx, const bfs_result_t *r) {
+    replica_slot_t *slot = (replica_slot_t *)ctx;
+    replica_write_t *w = slot->write;
+    int node = slot->node;
+
+    if (r->status != BFS_OK) replica_mark_behind(w->set, node);
+    mutex_lock(&w->lock);
+    if (r->status != BFS_OK && !w->failed[node]) {
+        w->failed[node] = 1;
+        w->lost++;
+    }
+    w->left[node]--;
+    int wake = replica_write_decide(w);
+    void (*fn)(void *) = w->wake;
+    void *owner = w->owner;
+    replica_write_unref(w);
+    if (wake) fn(owner);
+}
+
+/**
+ * Cria o acompanhamento de uma escrita
+ *
+ * @param wake Chamada (na thread da conexão) quando a escrita é decidida
+ *             depois que o dono parou em replica_write_park()
+ * @return Escrita, ou NULL se faltou memória
+ */
+static inline replica_write_t *replica_write_new(replica_set_t *set, void (*wake)(void *), void *owner) {
+    replica_write_t *w = (replica_write_t *)calloc(1, sizeof(replica_write_t));
+    if (w == NULL) return NULL;
+    mutex_init(&w->lock);
+    w->set = set;
+    w->starting = 1;
+    w->refs = 1;
+    w->wake = wake;
+    w->owner = owner;
+    for (int i = 0; i < set->count; i++) {
+        w->slots[i].write = w;
+        w->slots[i].node = i;
+    }
+    return w;
+}
+
+/**
+ * Leva um arquivo local (deleted = 0) ou a exclusão dele às réplicas
+ *
+ * @param upload_id Upload em blocos cujos blocos já seguiram para as
+ *                  réplicas (0: nenhum)
+ */
+static inline void replica_write_submit(replica_write_t *w, const char *name, int deleted, uint64_t upload_id) {
+    replica_set_t *set = w->set;
+
+    mutex_lock(&w->lock);
+    for (int i = 0; i < set->count; i++) w->left[i]++;
+    w->refs += set->count;
+    mutex_unlock(&w->lock);
+    for (int i = 0; i < set->count; i++) {
+        replica_stream_t *hold = w->streams[i];
+        w->streams[i] = NULL;
+        if (hold != NULL && deleted) {
+            bfs_stream_close(hold->stream, BFS_STREAM_CANCEL);
+            replica_stream_unref(hold);
+            hold = NULL;
+        }
+        replica_submit(set, i, name, deleted, hold, deleted ? 0 : upload_id, replica_write_done, &w->slots[i]);
+    }
+}
+
+/**
+ * Leva um arquivo local (deleted = 0) ou a exclusão dele às réplicas
+ */
+static inline void replica_write_add(replica_write_t *w, const char *name, int deleted) {
+    replica_write_submit(w, name, deleted, 0);
+}
+
+/**
+ * Leva às réplicas um arquivo recebido em blocos
+ *
+ * Por que foi feito:
+ * - Os blocos seguiram enquanto chegavam; a réplica só precisa concluir
+ *   o upload dela, na vez do nome
+ */
+static inline void replica_write_commit(replica_write_t *w, const char *name, uint64_t upload_id) {
+    replica_write_submit(w, name, 0, upload_id);
+}
+
+/**
+ * Começa a levar às réplicas um upload que ainda está chegando
+ *
+ * @param size Tamanho declarado do arquivo
+ * @param upload_id Id do upload em blocos (0: o upload é o arquivo inteiro)
+ * @param offset Posição do bloco (só com upload_id)
+ * @param length Tamanho do bloco (só com upload_id)
+ *
+ * Por que foi feito:
+ * - Enviar o arquivo só depois de gravado soma o tempo da réplica ao do
+ *   upload; seguindo enquanto chega, a confirmação espera só o fim
+ * - Sem memória para algum envio, aquela réplica recebe o arquivo pelo
+ *   caminho comum depois da gravação
+ */
+static inline void replica_write_stream(replica_write_t *w, const char *name, uint64_t size, uint64_t upload_id,
+                                        uint64_t offset, uint64_t length) {
+    replica_set_t *set = w->set;
+
+    for (int i = 0; i < set->count; i++) {
+        replica_stream_t *hold = (replica_stream_t *)calloc(1, sizeof(replica_stream_t));
+        bfs_stream_t *st = hold != NULL ? bfs_stream_new(REPLICA_STREAM_LIMIT) : NULL;
+        if (st == NULL) {
+            free(hold);
+            continue;
+        }
+        mutex_init(&hold->lock);
+        hold->set = set;
+        hold->node = i;
+        hold->upload_id = upload_id;
+        hold->stream = st;
+        hold->refs = 2;
+        w->streams[i] = hold;
+        if (upload_id != 0) {
+            // A conclusão do upload na réplica espera a resposta deste bloco
+            mutex_lock(&set->lock);
+            replica_upload_t **p = replica_upload_find(set, upload_id, i);
+            if (*p == NULL && (*p = (replica_upload_t *)calloc(1, sizeof(replica_upload_t))) != NULL) {
+                (*p)->id = upload_id;
+                (*p)->node = i;
+            }
+            if (*p != NULL) (*p)->pending++;
+            else hold->upload_id = 0;
+            mutex_unlock(&set->lock);
+        }
+        bfs_put_stream(set->streams[i], st, size, upload_id, offset, length, name, replica_stream_done, hold);
+    }
+}
+
+/**
+ * Encerra os envios de um bloco gravado: a réplica guarda o bloco
+ */
+static inline void replica_write_end(replica_write_t *w) {
+    for (int i = 0; i < w->set->count; i++) {
+        if (w->streams[i] == NULL) continue;
+        bfs_stream_close(w->streams[i]->stream, BFS_STREAM_END);
+        replica_stream_unref(w->streams[i]);
+        w->streams[i] = NULL;
+    }
+}
+
+/**
+ * Leva às réplicas bytes recebidos do upload, na ordem do arquivo
+ */
+static inline void replica_write_data(replica_write_t *w, const uint8_t *data, size_t len) {
+    for (int i = 0; i < w->set->count; i++) {
+        if (w->streams[i] != NULL) bfs_stream_write(w->streams[i]->stream, data, len);
+    }
+}
+
+/**
+ * Encerra o envio de pedidos: a partir daqui a escrita pode ser decidida
+ */
+static inline void replica_write_start(replica_write_t *w) {
+    mutex_lock(&w->lock);
+    w->starting = 0;
+    replica_write_decide(w);
+    mutex_unlock(&w->lock);
+}
+
+/**
+ * Registra que o dono vai esperar a decisão
+ *
+ * @return 1 se o dono será acordado pela função wake, 0 se a escrita já
+ *         foi decidida
+ */
+static inline int replica_write_park(replica_write_t *w) {
+    mutex_lock(&w->lock);
+    int parked = w->decided == 0;
+    if (parked) w->waiting = 1;
+    mutex_unlock(&w->lock);
+    return parked;
+}
+
+/**
+ * Decisão da escrita: 1 quorum atingido, -1 inatingível, 0 aguardando
+ */
+static inline int replica_write_result(replica_write_t *w) {
+    mutex_lock(&w->lock);
+    int decided = w->decided;
+    mutex_unlock(&w->lock);
+    return decided;
+}
+
+/**
+ * Libera a escrita do lado do dono; os pedidos em andamento continuam
+ */
+static inline void replica_write_release(replica_write_t *w) {
+    if (w == NULL) return;
+    // Upload que não foi gravado: as réplicas descartam o que receberam
+    for (int i = 0; i < w->set->count; i++) {
+        if (w->streams[i] == NULL) continue;
+        bfs_stream_close(w->streams[i]->stream, BFS_STREAM_CANCEL);
+        replica_stream_unref(w->streams[i]);
+        w->streams[i] = NULL;
+    }
+    mutex_lock(&w->lock);
+    w->starting = 0;
+    w->wake = NULL;
+    w->waiting = 0;
+    replica_write_unref(w);
+}
+
+/*--------------------------------------------------------------
+ * RECUPERAÇÃO DE RÉPLICAS ATRASADAS
+ *------------------------------------------------------------*/
+
+/**
+ * Compara arquivos pelo nome, para qsort() e bsearch()
+ */
+static inline int replica_file_compare(const void *a, const void *b) {
+    return strcmp(((const replica_file_t *)a)->name, ((const replica_file_t *)b)->name);
+}
+
+/**
+ * Libera uma listagem
+ */
+static inline void replica_files_free(replica_file_t *files, size_t count) {
+    for (size_t i = 0; files != NULL && i < count; i++) free(files[i].name);
+    free(files);
+}
+
+/**
+ * Guarda uma entrada da listagem da réplica (thread da conexão)
+ */
+static inline void replica_scan_entry(void *ctx, const list_entry_t *e) {
+    replica_scan_t *scan = (replica_scan_t *)ctx;
+
+    if (scan->count == scan->cap) {
+        size_t cap = scan->cap ? scan->cap * 2 : 1024;
+        replica_file_t *files = (replica_file_t *)realloc(scan->files, cap * sizeof(replica_file_t));
+        if (files == NULL) {
+            scan->oom = 1;
+            return;
+        }
+        scan->files = files;
+        scan->cap = cap;
+    }
+    replica_file_t *f = &scan->files[scan->count];
+    size_t len = strlen(e->name) + 1;
+    if ((f->name = (char *)malloc(len)) == NULL) {
+        scan->oom = 1;
+        return;
+    }
+    memcpy(f->name, e->name, len);
+    f->size = e->size;
+    f->mtime = e->mtime;
+    f->digest_len = e->hash_len;
+    memcpy(f->digest, e->hash, e->hash_len);
+    scan->count++;
+}
+
+/**
+ * Conclui um pedido da recuperação (thread da conexão)
+ */
+static inline void replica_scan_done(void *ctx, const bfs_result_t *r) {
+    replica_scan_t *scan = (replica_scan_t *)ctx;
+
+    mutex_lock(&scan->lock);
+    if (!replica_ok(r)) scan->failed++;
+    scan->pending--;
+    cond_signal(&scan->cond);
+    mutex_unlock(&scan->lock);
+}
+
+/**
+ * Guarda o resumo informado pelo STAT da réplica (thread da conexão)
+ */
+static inline void replica_probe_done(void *ctx, const bfs_result_t *r) {
+    replica_probe_t *probe = (replica_probe_t *)ctx;
+
+    if (r->status == BFS_OK && r->entry != NULL) {
+        probe->file->digest_len = r->entry->hash_len;
+        memcpy(probe->file->digest, r->entry->hash, r->entry->hash_len);
+    }
+    replica_scan_done(probe->scan, r);
+}
+
+/**
+ * Espera até restarem no máximo limit pedidos sem resposta
+ */
+static inline void replica_scan_wait(replica_scan_t *scan, int limit) {
+    mutex_lock(&scan->lock);
+    while (scan->pending > limit) cond_wait(&scan->cond, &scan->lock);
+    mutex_unlock(&scan->lock);
+}
+
+/**
+ * Conta um pedido da recuperação, respeitando REPLICA_CATCHUP_PARALLEL
+ */
+static inline void replica_scan_begin(replica_scan_t *scan) {
+    replica_scan_wait(scan, REPLICA_CATCHUP_PARALLEL - 1);
+    mutex_lock(&scan->lock);
+    scan->pending++;
+    mutex_unlock(&scan->lock);
+}
+
+/**
+ * Indica se a cópia da réplica difere da local
+ *
+ * Por que foi feito:
+ * - O CRC32C existe em todo resumo guardado (uploads paralelos guardam só
+ *   ele); sem resumo de um dos lados, vale a data: a cópia da réplica
+ *   recebe a data do envio, então uma data local mais nova indica mudança
+ */
+static inline int replica_differs(const replica_file_t *local, const replica_file_t *remote) {
+    if (local->size != remote->size) return 1;
+    if (local->digest_len >= CHECKSUM_CRC_SIZE && remote->digest_len >= CHECKSUM_CRC_SIZE) {
+        return memcmp(local->digest, remote->digest, CHECKSUM_CRC_SIZE) != 0;
+    }
+    return local->mtime > remote->mtime;
+}
+
+/**
+ * Põe uma réplica em dia com os arquivos locais
+ *
+ * @return 0 em caso de sucesso, -1 se algo falhou (a réplica continua atrasada)
+ *
+ * Por que foi feito:
+ * - Depois de uma parada, a réplica recebe só os arquivos que faltam ou
+ *   cujo resumo difere; os iguais não trafegam
+ * - Arquivos que a réplica tem e o servidor não (excluídos durante a
+ *   parada) são excluídos dela, conferindo antes se o arquivo não acabou
+ *   de ser gravado
+ * - A listagem da réplica nem sempre traz o resumo (ele é lido na primeira
+ *   consulta depois que ela reinicia); para os arquivos do mesmo tamanho o
+ *   resumo é pedido por STAT, vários de uma vez
+ */
+static inline int replica_catchup(replica_set_t *set, int node) {
+    bfs_client_t *c = set->nodes[node];
+    replica_scan_t scan;
+    replica_file_t *local = NULL;
+    replica_probe_t *probes = NULL;
+    size_t local_count = set->local(&local);
+    size_t sent = 0, removed = 0;
+
+    memset(&scan, 0, sizeof(scan));
+    mutex_init(&scan.lock);
+    cond_init(&scan.cond);
+    scan.pending = 1;
+    bfs_list(c, "", replica_scan_entry, replica_scan_done, &scan);
+    replica_scan_wait(&scan, 0);
+    if (scan.failed == 0 && !scan.oom) {
+        qsort(scan.files, scan.count, sizeof(replica_file_t), replica_file_compare);
+        probes = (replica_probe_t *)calloc(local_count + 1, sizeof(replica_probe_t));
+    }
+
+    // Resumos que a listagem não trouxe
+    for (size_t i = 0; probes != NULL && i < local_count; i++) {
+        replica_file_t *remote = (replica_file_t *)bsearch(&local[i], scan.files, scan.count,
+                                                           sizeof(replica_file_t), replica_file_compare);
+        if (remote == NULL || remote->digest_len > 0 || local[i].digest_len == 0 || remote->size != local[i].size) continue;
+        probes[i].scan = &scan;
+        probes[i].file = remote;
+        replica_scan_begin(&scan);
+        bfs_stat(c, remote->name, replica_probe_done, &probes[i]);
+    }
+    replica_scan_wait(&scan, 0);
+
+    // Arquivos que faltam ou diferem (o pedido leva o estado local de quando parte)
+    for (size_t i = 0; probes != NULL && i < local_count; i++) {
+        replica_file_t *remote = (replica_file_t *)bsearch(&local[i], scan.files, scan.count,
+                                                           sizeof(replica_file_t), replica_file_compare);
+        if (remote != NULL && !replica_differs(&local[i], remote)) continue;
+        replica_scan_begin(&scan);
+        replica_submit(set, node, local[i].name, 0, NULL, 0, replica_scan_done, &scan);
+        sent++;
+    }
+
+    // Arquivos que sobraram na réplica
+    for (size_t i = 0; probes != NULL && i < scan.count; i++) {
+        if (bsearch(&scan.files[i], local, local_count, sizeof(replica_file_t), replica_file_compare) != NULL ||
+            set->present(scan.files[i].name)) continue;
+        replica_scan_begin(&scan);
+        replica_submit(set, node, scan.files[i].name, 0, NULL, 0, replica_scan_done, &scan);
+        removed++;
+    }
+    replica_scan_wait(&scan, 0);
+
+    int failed = probes == NULL || scan.failed > 0;
+    if (probes != NULL) {
+        printf("Réplica %s: %zu arquivo(s) enviado(s), %zu excluído(s), %d falha(s)\n", set->names[node], sent,
+               removed, scan.failed);
+    } else {
+        printf("Réplica %s inacessível; nova tentativa em %d s.\n", set->names[node], REPLICA_CATCHUP_MS / 1000);
+    }
+    free(probes);
+    replica_files_free(scan.files, scan.count);
+    replica_files_free(local, local_count);
+    mutex_destroy(&scan.lock);
+    cond_destroy(&scan.cond);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Laço da thread de recuperação
+ *
+ * Por que foi feito:
+ * - Na partida todas as réplicas são conferidas (podem ter perdido
+ *   escritas enquanto o servidor estava fora); depois, só as que falharam
+ *   em alguma escrita, de novo a cada REPLICA_CATCHUP_MS enquanto falharem
+ */
+static inline void *replica_main(void *arg) {
+    replica_set_t *set = (replica_set_t *)arg;
+
+    mutex_lock(&set->lock);
+    while (!set->stopping) {
+        for (int i = 0; i < set->count && !set->stopping; i++) {
+            if (!set->behind[i]) continue;
+            set->behind[i] = 0;
+            mutex_unlock(&set->lock);
+            int failed = replica_catchup(set, i) != 0;
+            mutex_lock(&set->lock);
+            if (failed) set->behind[i] = 1;
+        }
+        cond_wait_ms(&set->changed, &set->lock, REPLICA_CATCHUP_MS);
+    }
+    mutex_unlock(&set->lock);
+    return NULL;
+}
+
+/*--------------------------------------------------------------
+ * CONJUNTO DE RÉPLICAS
+ *------------------------------------------------------------*/
+
+/**
+ * Lê a lista de réplicas e o quorum
+ *
+ * @param list Réplicas no formato "ip:porta,ip:porta,..."
+ * @param quorum Cópias confirmadas antes do OK, contando a local (0:
+ *               maioria das cópias)
+ * @return 0 se a lista e o quorum são válidos, -1 caso contrário
+ */
+static inline int replica_parse(replica_set_t *set, const char *list, int quorum) {
+    char address[RING_NAME_SIZE];
+
+    memset(set, 0, sizeof(*set));
+    while (*list != '\0') {
+        size_t len = strcspn(list, ",");
+        if (set->count == REPLICA_MAX || len == 0 || len >= RING_NAME_SIZE) return -1;
+        snprintf(set->names[set->count], RING_NAME_SIZE, "%.*s", (int)len, list);
+        if (bfs_node_split(set->names[set->count], address) < 0) return -1;
+        set->count++;
+        list += len;
+        if (*list == ',') list++;
+    }
+    set->quorum = quorum > 0 ? quorum : (set->count + 1) / 2 + 1;
+    return set->count > 0 && set->quorum <= set->count + 1 ? 0 : -1;
+}
+
+/**
+ * Abre as conexões com as réplicas e inicia a thread de recuperação
+ *
+ * @return 0 em caso de sucesso, -1 se faltou memória ou a thread não iniciou
+ */
+static inline int replica_start(replica_set_t *set, size_t (*local)(replica_file_t **),
+                                int (*present)(const char *), int (*path)(char *, const char *)) {
+    char address[RING_NAME_SIZE];
+
+    set->local = local;
+    set->present = present;
+    set->path = path;
+    for (int i = 0; i < set->count; i++) {
+        int port = bfs_node_split(set->names[i], address);
+        set->nodes[i] = bfs_open(address, port, REPLICA_CONNECTIONS, REPLICA_WINDOW, -1);
+        set->streams[i] = bfs_open(address, port, REPLICA_STREAMS, 1, -1);
+        if (set->nodes[i] == NULL || set->streams[i] == NULL) return -1;
+        set->behind[i] = 1;
+    }
+    mutex_init(&set->lock);
+    cond_init(&set->changed);
+    return thread_create(&set->thread, replica_main, set);
+}
+
+#endif /* BIGFS_REPLICA_H */
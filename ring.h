@@ -0,0 +1,139 @@
+/*******************************************************************************
+ * ANEL DE HASH CONSISTENTE (DIVISÃO DOS NOMES ENTRE SERVIDORES)
+ *
+ * Descrição: Decide qual servidor de um cluster guarda cada nome de
+ *            arquivo. Cada servidor (nó) ocupa vários pontos de um anel de
+ *            64 bits; o dono de um nome é o primeiro ponto depois do hash
+ *            do nome, dando a volta no fim do anel.
+ *
+ * Organização:
+ * - Um nó é identificado pelo seu endereço ("ip:porta"); os pontos dele
+ *   são o XXH64 de "ip:porta#n", para n de 0 a RING_VNODES - 1
+ * - Os pontos ficam num vetor ordenado; achar o dono é uma busca binária
+ * - Com muitos pontos por nó, cada um recebe uma parte parecida dos nomes
+ *
+ * Por que hash consistente:
+ * - Ao acrescentar um nó só mudam de dono os nomes que caem nos trechos
+ *   do anel que os pontos novos tomaram, todos eles indo para o nó novo;
+ *   com "hash % nós" quase todos os nomes mudariam de servidor
+ ******************************************************************************/
+#ifndef BIGFS_RING_H
+#define BIGFS_RING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "digest.h"
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define RING_MAX_NODES 64               // Nós de um cluster
+#define RING_VNODES 128                 // Pontos de cada nó no anel
+#define RING_NAME_SIZE 64               // Identificação de um nó ("ip:porta")
+
+/**
+ * Ponto do anel
+ */
+typedef struct {
+    uint64_t hash;
+    int node;                   // Posição do nó em names
+} ring_point_t;
+
+/**
+ * Anel com os pontos de todos os nós
+ */
+typedef struct {
+    char names[RING_MAX_NODES][RING_NAME_SIZE];
+    int count;                  // Nós
+    ring_point_t *points;       // count * RING_VNODES, em ordem de hash
+} ring_t;
+
+/*--------------------------------------------------------------
+ * ANEL
+ *------------------------------------------------------------*/
+
+/**
+ * Hash de um nome no anel (XXH64)
+ */
+static inline uint64_t ring_hash(const void *data, size_t len) {
+    xxh64_t x;
+    xxh64_init(&x);
+    xxh64_update(&x, data, len);
+    return xxh64_final(&x);
+}
+
+/**
+ * Compara pontos para qsort() (empate: menor nó primeiro)
+ */
+static inline int ring_point_compare(const void *a, const void *b) {
+    const ring_point_t *x = (const ring_point_t *)a, *y = (const ring_point_t *)b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->node - y->node;
+}
+
+/**
+ * Monta o anel de uma lista de nós
+ *
+ * @param names Identificação de cada nó ("ip:porta")
+ * @return 0 em caso de sucesso, -1 se a lista é inválida ou faltou memória
+ *
+ * Por que foi feito:
+ * - Os pontos dependem só dos nomes dos nós, não da ordem da lista: todo
+ *   cliente configurado com os mesmos nós chega ao mesmo dono
+ */
+static inline int ring_init(ring_t *r, const char *const *names, int count) {
+    memset(r, 0, sizeof(*r));
+    if (count <= 0 || count > RING_MAX_NODES) return -1;
+    r->points = (ring_point_t *)malloc((size_t)count * RING_VNODES * sizeof(ring_point_t));
+    if (r->points == NULL) return -1;
+
+    for (int i = 0; i < count; i++) {
+        size_t len = strlen(names[i]);
+        if (len == 0 || len >= RING_NAME_SIZE) {
+            free(r->points);
+            r->points = NULL;
+            return -1;
+        }
+        memcpy(r->names[i], names[i], len + 1);
+        for (int v = 0; v < RING_VNODES; v++) {
+            char key[RING_NAME_SIZE + 16];
+            int key_len = snprintf(key, sizeof(key), "%s#%d", names[i], v);
+            r->points[i * RING_VNODES + v].hash = ring_hash(key, (size_t)key_len);
+            r->points[i * RING_VNODES + v].node = i;
+        }
+    }
+    r->count = count;
+    qsort(r->points, (size_t)count * RING_VNODES, sizeof(ring_point_t), ring_point_compare);
+    return 0;
+}
+
+/**
+ * Libera os pontos do anel
+ */
+static inline void ring_free(ring_t *r) {
+    free(r->points);
+    r->points = NULL;
+    r->count = 0;
+}
+
+/**
+ * Nó dono de um nome de arquivo
+ *
+ * @return Posição do nó na lista passada a ring_init()
+ */
+static inline int ring_owner(const ring_t *r, const char *name) {
+    uint64_t h = ring_hash(name, strlen(name));
+    size_t low = 0, high = (size_t)r->count * RING_VNODES;
+
+    // Primeiro ponto com hash >= h; depois do último, volta ao início
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (r->points[mid].hash < h) low = mid + 1;
+        else high = mid;
+    }
+    if (low == (size_t)r->count * RING_VNODES) low = 0;
+    return r->points[low].node;
+}
+
+#endif
@@ -0,0 +1,1127 @@
+/*******************************************************************************
+ * SEGMENTOS DE OBJETOS PEQUENOS (ARMAZENAMENTO EM LOG)
+ *
+ * Descrição: Guarda uploads pequenos como registros acrescentados ao fim de
+ *            arquivos grandes (segmentos), em vez de um arquivo por upload.
+ *            Uma tabela em memória diz em que segmento e posição está cada
+ *            objeto; a leitura é um pread() no segmento.
+ *
+ * Registros (cabeçalho de SEGMENT_HEADER_SIZE bytes, nome e conteúdo):
+ * - Parte fixa, gravada ao reservar o espaço: CRC32C, tamanho do conteúdo
+ *   e do nome; nunca é regravada, então a leitura do segmento sempre acha
+ *   o registro seguinte, mesmo depois de um upload interrompido
+ * - Conclusão, gravada no fim do upload: tipo (objeto ou exclusão),
+ *   sequência, data, segmento de origem da exclusão e resumo do conteúdo
+ *   (CRC32C + XXH64), com CRC32C próprio; sem conclusão válida o registro
+ *   é espaço morto
+ * - Vale o registro de maior sequência de cada nome; uma exclusão esconde
+ *   as versões anteriores do nome em qualquer segmento
+ *
+ * Confirmação em grupo:
+ * - O conteúdo chega pelo anel de escrita da sessão, sem sincronização;
+ *   a conclusão espera um fdatasync() dos segmentos alterados, e as
+ *   conclusões que chegam juntas dividem a mesma sincronização
+ *
+ * Compactação:
+ * - Um segmento fechado com metade ou mais de bytes mortos (objetos
+ *   substituídos ou excluídos, uploads interrompidos) tem os registros
+ *   vivos copiados para o segmento ativo e é apagado
+ * - Uma exclusão só é descartada quando já não existe segmento que possa
+ *   guardar uma versão anterior do nome
+ *
+ * Partida:
+ * - Os segmentos são lidos em ordem e a tabela é montada a partir dos
+ *   registros; o conteúdo de cada objeto é conferido pelo CRC32C
+ * - O último segmento volta a ser o ativo, sem o trecho cortado por uma
+ *   queda (registro nunca confirmado ao cliente)
+ ******************************************************************************/
+#ifndef BIGFS_SEGSTORE_H
+#define BIGFS_SEGSTORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "protocol.h"
+#include "digest.h"
+#include "index.h"
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define SEGMENT_DIR ".bigfs-segments"   // Segmentos: "<dir>/seg-<número>"
+#define SEGMENT_MAX_BYTES (64 * 1024 * 1024) // Segmento ativo que passa disso é fechado
+#define SEGMENT_OBJECT_MAX (64 * 1024)  // Maior upload guardado em segmento (padrão)
+#define SEGMENT_OBJECT_LIMIT (1024 * 1024) // Maior valor aceito para o limite acima
+#define SEGMENT_HEADER_SIZE 52          // Parte fixa (12 bytes) e conclusão (40 bytes)
+#define SEGMENT_COMMIT_OFFSET 12        // Início da conclusão no cabeçalho
+#define SEGMENT_COMMIT_SIZE (SEGMENT_HEADER_SIZE - SEGMENT_COMMIT_OFFSET)
+#define SEGMENT_READ_SIZE (2 * (SEGMENT_HEADER_SIZE + PROTO_MAX_NAME + SEGMENT_OBJECT_LIMIT))
+#define SEGMENT_DEAD_PERCENT 50         // Bytes mortos que tornam um segmento candidato
+#define SEGMENT_COMPACT_MS 5000         // Intervalo da thread de compactação
+
+/**
+ * Tipos de registro (0: sem conclusão)
+ */
+enum {
+    SEGMENT_OBJECT = 1,
+    SEGMENT_DELETE = 2
+};
+
+/**
+ * Objeto guardado
+ */
+typedef struct {
+    char *name;
+    uint32_t hash;                      // Hash do nome (usado ao crescer a tabela)
+    uint32_t segment;                   // Número do segmento
+    uint64_t offset;                    // Início do registro no segmento
+    uint32_t size;                      // Tamanho do conteúdo
+    uint16_t name_len;
+    uint8_t deleted;                    // Exclusão (só durante a partida)
+    uint64_t seq;
+    int64_t mtime;
+    uint8_t digest[CHECKSUM_SIZE];
+} segment_object_t;
+
+/**
+ * Arquivo de segmento
+ */
+typedef struct {
+    uint32_t id;
+    int fd;                             // Aberto para gravação
+    uint64_t size;                      // Fim do último registro
+    uint64_t live;                      // Bytes de registros ainda válidos
+    int pending;                        // Registros reservados ainda sem conclusão
+    int sealed;                         // Não recebe registros novos
+    int dirty;                          // Gravado depois da última sincronização
+} segment_t;
+
+/**
+ * Espaço reservado para um upload
+ */
+typedef struct {
+    uint32_t segment;
+    int fd;                             // Descritor do segmento (continua sendo do armazenamento)
+    uint64_t offset;                    // Início do registro
+    uint64_t data;                      // Posição do primeiro byte do conteúdo
+    uint32_t size;
+} segment_slot_t;
+
+/**
+ * Armazenamento em segmentos
+ */
+typedef struct {
+    mutex_t lock;                       // Protege todos os campos abaixo
+    cond_t synced;                      // Fim de uma sincronização (confirmação em grupo)
+    char dir[INDEX_PATH_MAX];
+
+    segment_t *segments;                // Em ordem de número; o último é o ativo se !sealed
+    size_t count, cap;
+    uint32_t next_id;
+    uint64_t seq;                       // Última sequência atribuída
+
+    index_slot_t *slots;                // Tabela hash dos objetos (como em index.h)
+    size_t slot_mask;
+    segment_object_t *objects;
+    size_t object_count, object_cap;
+
+    uint64_t written, durable;          // Gravações feitas e já sincronizadas
+    int syncing;                        // Uma thread está sincronizando
+    int failed;                         // Erro de gravação: novos registros são recusados
+
+    uint64_t syncs, compactions, reclaimed;
+} segment_store_t;
+
+/**
+ * Resultado da leitura dos segmentos na partida
+ */
+typedef struct {
+    uint32_t segments;
+    size_t objects;
+    uint64_t records;                   // Registros lidos
+    uint64_t damaged;                   // Objetos descartados por conteúdo que não confere
+    double ms;
+} segment_recovery_t;
+
+/**
+ * Ocupação dos segmentos (métricas)
+ */
+typedef struct {
+    size_t objects;
+    uint32_t segments;
+    uint64_t live, dead;                // Bytes de registros válidos e mortos
+    uint64_t syncs, compactions, reclaimed;
+} segment_stats_t;
+
+/*--------------------------------------------------------------
+ * REGISTROS
+ *------------------------------------------------------------*/
+
+/**
+ * Registro lido de um segmento
+ */
+typedef struct {
+    uint64_t offset;                    // Início do registro no segmento
+    uint64_t length;                    // Cabeçalho, nome e conteúdo
+    const uint8_t *bytes;               // Registro inteiro (no buffer da leitura)
+    uint8_t type;                       // 0 se não há conclusão válida
+    uint64_t seq;
+    int64_t mtime;
+    uint32_t origin;                    // Exclusão: segmento ativo quando ela foi feita
+    const uint8_t *digest;
+    int intact;                         // Objeto: o conteúdo confere com o CRC32C
+    uint32_t size;
+    uint16_t name_len;
+    char name[PROTO_MAX_NAME];
+} segment_record_t;
+
+/**
+ * Leitura sequencial de um segmento
+ */
+typedef struct {
+    int fd;
+    uint8_t *buf;                       // SEGMENT_READ_SIZE bytes
+    uint64_t start;                     // Posição de buf[0] no segmento
+    size_t len;                         // Bytes lidos em buf
+    uint64_t pos;                       // Próximo registro
+    uint64_t end;                       // Limite da leitura
+} segment_scan_t;
+
+/**
+ * Monta o caminho de um segmento
+ *
+ * @return 0 em caso de sucesso, -1 se o caminho não cabe
+ */
+static inline int segstore_path(const segment_store_t *st, char *path, uint32_t id) {
+    return snprintf(path, INDEX_PATH_MAX, "%s" PATH_SEP "seg-%u", st->dir, id) < INDEX_PATH_MAX ? 0 : -1;
+}
+
+/**
+ * Tamanho de um registro no segmento
+ */
+static inline uint64_t segment_record_size(uint16_t name_len, uint32_t size) {
+    return SEGMENT_HEADER_SIZE + (uint64_t)name_len + size;
+}
+
+/**
+ * Monta o cabeçalho (conclusão zerada) seguido do nome
+ *
+ * @param out Buffer com SEGMENT_HEADER_SIZE + PROTO_MAX_NAME bytes
+ * @return Bytes montados
+ */
+static inline size_t segment_encode_head(uint8_t *out, const char *name, uint32_t size) {
+    uint16_t name_len = (uint16_t)strlen(name);
+
+    memset(out, 0, SEGMENT_HEADER_SIZE);
+    put_u32(out + 4, size);
+    put_u16(out + 8, name_len);
+    memcpy(out + SEGMENT_HEADER_SIZE, name, name_len);
+    put_u32(out, crc32c(crc32c(0, out + 4, 8), name, name_len));
+    return SEGMENT_HEADER_SIZE + name_len;
+}
+
+/**
+ * Monta a conclusão de um registro
+ *
+ * @param out Buffer com SEGMENT_COMMIT_SIZE bytes
+ * @param digest Resumo do conteúdo (NULL para exclusões)
+ */
+static inline void segment_encode_commit(uint8_t *out, uint8_t type, uint64_t seq, int64_t mtime,
+                                         uint32_t origin, const uint8_t *digest) {
+    memset(out, 0, SEGMENT_COMMIT_SIZE);
+    out[4] = type;
+    put_u64(out + 8, seq);
+    put_u64(out + 16, (uint64_t)mtime);
+    put_u32(out + 24, origin);
+    if (digest != NULL) memcpy(out + 28, digest, CHECKSUM_SIZE);
+    put_u32(out, crc32c(0, out + 4, SEGMENT_COMMIT_SIZE - 4));
+}
+
+/**
+ * Garante que buf tem os bytes [pos, pos + need) do segmento
+ *
+ * @return 1 se os bytes estão em buf, 0 se o segmento termina antes
+ */
+static inline int segment_scan_fill(segment_scan_t *sc, uint64_t need) {
+    if (sc->pos + need > sc->end) return 0;
+    if (sc->pos >= sc->start && sc->pos + need <= sc->start + sc->len) return 1;
+
+    sc->start = sc->pos;
+    sc->len = 0;
+    while (sc->len < SEGMENT_READ_SIZE && sc->start + sc->len < sc->end) {
+        int64_t got = file_pread(sc->fd, sc->buf + sc->len, SEGMENT_READ_SIZE - sc->len, sc->start + sc->len);
+        if (got <= 0) break;
+        sc->len += (size_t)got;
+    }
+    return sc->pos + need <= sc->start + sc->len;
+}
+
+/**
+ * Lê o próximo registro
+ *
+ * @return 1 se leu um registro, 0 no fim do segmento ou num cabeçalho
+ *         inválido (trecho cortado por uma queda)
+ */
+static inline int segment_scan_next(segment_scan_t *sc, segment_record_t *r) {
+    if (!segment_scan_fill(sc, SEGMENT_HEADER_SIZE)) return 0;
+    const uint8_t *p = sc->buf + (sc->pos - sc->start);
+
+    r->size = get_u32(p + 4);
+    r->name_len = get_u16(p + 8);
+    if (r->name_len == 0 || r->name_len >= PROTO_MAX_NAME || r->size > SEGMENT_OBJECT_LIMIT) return 0;
+    r->length = segment_record_size(r->name_len, r->size);
+    if (!segment_scan_fill(sc, r->length)) return 0;
+    p = sc->buf + (sc->pos - sc->start);
+    if (crc32c(crc32c(0, p + 4, 8), p + SEGMENT_HEADER_SIZE, r->name_len) != get_u32(p)) return 0;
+
+    r->offset = sc->pos;
+    r->bytes = p;
+    memcpy(r->name, p + SEGMENT_HEADER_SIZE, r->name_len);
+    r->name[r->name_len] = '\0';
+
+    const uint8_t *c = p + SEGMENT_COMMIT_OFFSET;
+    r->type = c[4];
+    if (crc32c(0, c + 4, SEGMENT_COMMIT_SIZE - 4) != get_u32(c) ||
+        (r->type != SEGMENT_OBJECT && r->type != SEGMENT_DELETE)) {
+        r->type = 0;
+    }
+    r->seq = get_u64(c + 8);
+    r->mtime = (int64_t)get_u64(c + 16);
+    r->origin = get_u32(c + 24);
+    r->digest = c + 28;
+    r->intact = r->type == SEGMENT_OBJECT &&
+                crc32c(0, p + SEGMENT_HEADER_SIZE + r->name_len, r->size) == checksum_crc(r->digest);
+    sc->pos += r->length;
+    return 1;
+}
+
+/*--------------------------------------------------------------
+ * TABELA DE OBJETOS
+ *------------------------------------------------------------*/
+
+/**
+ * Procura um objeto (com o lock)
+ *
+ * @return Objeto, ou NULL se o nome não está na tabela
+ */
+static inline segment_object_t *segstore_object(segment_store_t *st, const char *name) {
+    uint32_t hash = index_name_hash(name);
+
+    for (size_t i = hash & st->slot_mask; st->slots[i].entry != 0; i = (i + 1) & st->slot_mask) {
+        segment_object_t *obj = &st->objects[st->slots[i].entry - 1];
+        if (st->slots[i].hash == hash && strcmp(obj->name, name) == 0) return obj;
+    }
+    return NULL;
+}
+
+/**
+ * Acrescenta um objeto vazio à tabela (com o lock; o nome não está nela)
+ *
+ * @return Objeto, ou NULL se faltou memória
+ */
+static inline segment_object_t *segstore_insert(segment_store_t *st, const char *name) {
+    // Mantém a ocupação abaixo de 70% para sondagens curtas
+    if ((st->object_count + 1) * 10 > (st->slot_mask + 1) * 7) {
+        size_t slots = (st->slot_mask + 1) * 2;
+        index_slot_t *grown = (index_slot_t *)calloc(slots, sizeof(index_slot_t));
+        if (grown == NULL) return NULL;
+        for (size_t e = 0; e < st->object_count; e++) {
+            size_t i = st->objects[e].hash & (slots - 1);
+            while (grown[i].entry != 0) i = (i + 1) & (slots - 1);
+            grown[i].hash = st->objects[e].hash;
+            grown[i].entry = (uint32_t)(e + 1);
+        }
+        free(st->slots);
+        st->slots = grown;
+        st->slot_mask = slots - 1;
+    }
+    if (st->object_count == st->object_cap) {
+        size_t cap = st->object_cap ? st->object_cap * 2 : 256;
+        segment_object_t *grown = (segment_object_t *)realloc(st->objects, cap * sizeof(segment_object_t));
+        if (grown == NULL) return NULL;
+        st->objects = grown;
+        st->object_cap = cap;
+    }
+
+    segment_object_t *obj = &st->objects[st->object_count];
+    memset(obj, 0, sizeof(*obj));
+    if ((obj->name = strdup(name)) == NULL) return NULL;
+    obj->hash = index_name_hash(name);
+
+    size_t slot = obj->hash & st->slot_mask;
+    while (st->slots[slot].entry != 0) slot = (slot + 1) & st->slot_mask;
+    st->slots[slot].hash = obj->hash;
+    st->slots[slot].entry = (uint32_t)(++st->object_count);
+    return obj;
+}
+
+/**
+ * Remove um objeto da tabela (com o lock)
+ *
+ * Por que foi feito:
+ * - Mesma remoção de index_table_remove(): a última entrada ocupa a
+ *   posição liberada e os slots seguintes são puxados para trás
+ */
+static inline void segstore_remove(segment_store_t *st, const char *name) {
+    uint32_t hash = index_name_hash(name);
+    size_t i = hash & st->slot_mask;
+
+    while (st->slots[i].entry != 0 &&
+           (st->slots[i].hash != hash || strcmp(st->objects[st->slots[i].entry - 1].name, name) != 0)) {
+        i = (i + 1) & st->slot_mask;
+    }
+    if (st->slots[i].entry == 0) return;
+
+    size_t e = st->slots[i].entry - 1;
+    st->slots[i].entry = 0;
+    for (size_t j = (i + 1) & st->slot_mask; st->slots[j].entry != 0; j = (j + 1) & st->slot_mask) {
+        size_t home = st->slots[j].hash & st->slot_mask;
+        if (((j - home) & st->slot_mask) >= ((j - i) & st->slot_mask)) {
+            st->slots[i] = st->slots[j];
+            st->slots[j].entry = 0;
+            i = j;
+        }
+    }
+
+    free(st->objects[e].name);
+    size_t last = st->object_count - 1;
+    if (e != last) {
+        st->objects[e] = st->objects[last];
+        size_t k = st->objects[e].hash & st->slot_mask;
+        while (st->slots[k].entry != last + 1) k = (k + 1) & st->slot_mask;
+        st->slots[k].entry = (uint32_t)(e + 1);
+    }
+    st->object_count--;
+}
+
+/*--------------------------------------------------------------
+ * SEGMENTOS
+ *------------------------------------------------------------*/
+
+/**
+ * Procura um segmento pelo número (com o lock)
+ *
+ * @return Segmento, ou NULL se ele não existe mais; o ponteiro vale até o
+ *         próximo segmento criado ou removido
+ */
+static inline segment_t *segstore_segment(segment_store_t *st, uint32_t id) {
+    size_t low = 0, high = st->count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (st->segments[mid].id < id) low = mid + 1;
+        else high = mid;
+    }
+    return low < st->count && st->segments[low].id == id ? &st->segments[low] : NULL;
+}
+
+/**
+ * Acrescenta um segmento ao fim da lista (com o lock)
+ *
+ * @return Segmento, ou NULL se faltou memória
+ */
+static inline segment_t *segstore_append(segment_store_t *st, uint32_t id, int fd) {
+    if (st->count == st->cap) {
+        size_t cap = st->cap ? st->cap * 2 : 16;
+        segment_t *grown = (segment_t *)realloc(st->segments, cap * sizeof(segment_t));
+        if (grown == NULL) return NULL;
+        st->segments = grown;
+        st->cap = cap;
+    }
+    segment_t *seg = &st->segments[st->count++];
+    memset(seg, 0, sizeof(*seg));
+    seg->id = id;
+    seg->fd = fd;
+    if (id >= st->next_id) st->next_id = id + 1;
+    return seg;
+}
+
+/**
+ * Desconta os bytes de um registro que deixou de valer (com o lock)
+ */
+static inline void segstore_dead(segment_store_t *st, const segment_object_t *obj) {
+    segment_t *seg = segstore_segment(st, obj->segment);
+    if (seg != NULL) seg->live -= segment_record_size(obj->name_len, obj->size);
+}
+
+/**
+ * Segmento que recebe o próximo registro (com o lock)
+ *
+ * @param need Tamanho do registro
+ * @return Segmento ativo, ou NULL se um segmento novo não pôde ser criado
+ *
+ * Por que foi feito:
+ * - O segmento ativo que passaria de SEGMENT_MAX_BYTES é fechado e passa a
+ *   ser candidato à compactação; o nome do segmento novo é sincronizado
+ *   no diretório antes de receber registros
+ */
+static inline segment_t *segstore_active(segment_store_t *st, uint64_t need) {
+    char path[INDEX_PATH_MAX];
+    segment_t *seg = st->count > 0 && !st->segments[st->count - 1].sealed ? &st->segments[st->count - 1] : NULL;
+
+    if (seg != NULL && seg->size > 0 && seg->size + need > SEGMENT_MAX_BYTES) {
+        seg->sealed = 1;
+        seg = NULL;
+    }
+    if (seg != NULL) return seg;
+
+    int fd = segstore_path(st, path, st->next_id) == 0 ? file_open_write(path, 1) : -1;
+    if (fd < 0) return NULL;
+    if (dir_sync(st->dir) != 0 || (seg = segstore_append(st, st->next_id, fd)) == NULL) {
+        file_close(fd);
+        remove(path);
+        return NULL;
+    }
+    return seg;
+}
+
+/**
+ * Espera até as gravações feitas até mark estarem no disco (com o lock)
+ *
+ * @param mark Valor de written a cobrir
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - Mesmo esquema do diário (journal_sync_to): enquanto uma thread
+ *   sincroniza, as outras acumulam gravações; a próxima a passar cobre
+ *   todas com um fdatasync() por segmento alterado
+ */
+static inline int segstore_sync_to(segment_store_t *st, uint64_t mark) {
+    while (st->durable < mark && !st->failed) {
+        if (st->syncing) {
+            cond_wait(&st->synced, &st->lock);
+            continue;
+        }
+        int *fds = (int *)malloc((st->count > 0 ? st->count : 1) * sizeof(int));
+        if (fds == NULL) return -1;
+        size_t n = 0;
+        for (size_t i = 0; i < st->count; i++) {
+            if (!st->segments[i].dirty) continue;
+            st->segments[i].dirty = 0;
+            fds[n++] = st->segments[i].fd;
+        }
+        uint64_t upto = st->written;
+        st->syncing = 1;
+        mutex_unlock(&st->lock);
+
+        // Nenhum segmento é removido (nem tem o descritor fechado) durante a sincronização
+        int failed = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (file_sync(fds[i]) != 0) failed = 1;
+        }
+        free(fds);
+
+        mutex_lock(&st->lock);
+        st->syncing = 0;
+        st->syncs++;
+        if (failed) st->failed = 1;
+        else st->durable = upto;
+        cond_broadcast(&st->synced);
+    }
+    return st->failed ? -1 : 0;
+}
+
+/*--------------------------------------------------------------
+ * GRAVAÇÃO
+ *------------------------------------------------------------*/
+
+/**
+ * Reserva o espaço de um upload no segmento ativo
+ *
+ * @param size Tamanho declarado do conteúdo
+ * @param slot Recebe o segmento e as posições do registro
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - Uploads simultâneos recebem trechos distintos do mesmo segmento e
+ *   gravam em paralelo; o cabeçalho sai já na reserva, então um upload
+ *   interrompido deixa só um registro sem conclusão
+ */
+static inline int segstore_reserve(segment_store_t *st, const char *name, uint64_t size, segment_slot_t *slot) {
+    uint8_t head[SEGMENT_HEADER_SIZE + PROTO_MAX_NAME];
+    size_t name_len = strlen(name);
+    io_vec_t iov;
+
+    if (name_len == 0 || name_len >= PROTO_MAX_NAME || size > SEGMENT_OBJECT_LIMIT) return -1;
+    iov.iov_base = head;
+    iov.iov_len = segment_encode_head(head, name, (uint32_t)size);
+
+    mutex_lock(&st->lock);
+    segment_t *seg = st->failed ? NULL : segstore_active(st, segment_record_size((uint16_t)name_len, (uint32_t)size));
+    if (seg != NULL && file_pwritev(seg->fd, &iov, 1, seg->size) != 0) seg = NULL;
+    if (seg != NULL) {
+        slot->segment = seg->id;
+        slot->fd = seg->fd;
+        slot->offset = seg->size;
+        slot->data = seg->size + SEGMENT_HEADER_SIZE + name_len;
+        slot->size = (uint32_t)size;
+        seg->size += segment_record_size((uint16_t)name_len, (uint32_t)size);
+        seg->pending++;
+    }
+    mutex_unlock(&st->lock);
+    return seg != NULL ? 0 : -1;
+}
+
+/**
+ * Conclui um upload já gravado no espaço reservado
+ *
+ * @param mtime Data de modificação do objeto
+ * @param digest Resumo do conteúdo (CHECKSUM_SIZE bytes)
+ * @return 0 se o objeto está no disco e na tabela, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - A sequência é atribuída aqui, não na reserva: entre dois uploads do
+ *   mesmo nome vale o último a terminar, como na troca de nome dos
+ *   arquivos comuns
+ */
+static inline int segstore_commit(segment_store_t *st, const segment_slot_t *slot, const char *name,
+                                  int64_t mtime, const uint8_t *digest) {
+    uint8_t commit[SEGMENT_COMMIT_SIZE];
+    io_vec_t iov;
+
+    mutex_lock(&st->lock);
+    uint64_t seq = ++st->seq;
+    segment_t *seg = segstore_segment(st, slot->segment);
+    segment_encode_commit(commit, SEGMENT_OBJECT, seq, mtime, 0, digest);
+    iov.iov_base = commit;
+    iov.iov_len = sizeof(commit);
+    int failed = st->failed || seg == NULL || file_pwritev(seg->fd, &iov, 1, slot->offset + SEGMENT_COMMIT_OFFSET) != 0;
+    if (!failed) {
+        seg->dirty = 1;
+        failed = segstore_sync_to(st, ++st->written) != 0;
+    }
+
+    if ((seg = segstore_segment(st, slot->segment)) != NULL) seg->pending--;
+    segment_object_t *obj = failed ? NULL : segstore_object(st, name);
+    if (!failed && (obj == NULL || obj->seq < seq)) {
+        // Outro upload do nome terminado durante a sincronização pode ser mais novo
+        if (obj != NULL) segstore_dead(st, obj);
+        else obj = segstore_insert(st, name);
+        if (obj == NULL) {
+            failed = 1;
+        } else {
+            obj->segment = slot->segment;
+            obj->offset = slot->offset;
+            obj->size = slot->size;
+            obj->name_len = (uint16_t)strlen(name);
+            obj->seq = seq;
+            obj->mtime = mtime;
+            memcpy(obj->digest, digest, CHECKSUM_SIZE);
+            if (seg != NULL) seg->live += segment_record_size(obj->name_len, obj->size);
+        }
+    }
+    mutex_unlock(&st->lock);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Abandona o espaço reservado de um upload interrompido
+ */
+static inline void segstore_cancel(segment_store_t *st, const segment_slot_t *slot) {
+    mutex_lock(&st->lock);
+    segment_t *seg = segstore_segment(st, slot->segment);
+    if (seg != NULL) seg->pending--;
+    mutex_unlock(&st->lock);
+}
+
+/**
+ * Exclui um objeto
+ *
+ * @return 1 se o objeto foi excluído, 0 se ele não existe, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - O registro de exclusão vai para o segmento ativo e é sincronizado
+ *   antes da resposta; sem ele, a versão anterior voltaria na partida
+ */
+static inline int segstore_delete(segment_store_t *st, const char *name) {
+    uint8_t record[SEGMENT_HEADER_SIZE + PROTO_MAX_NAME];
+    size_t name_len = strlen(name);
+    io_vec_t iov;
+
+    if (name_len == 0 || name_len >= PROTO_MAX_NAME) return 0;
+    iov.iov_base = record;
+    iov.iov_len = segment_encode_head(record, name, 0);
+
+    mutex_lock(&st->lock);
+    if (segstore_object(st, name) == NULL) {
+        mutex_unlock(&st->lock);
+        return 0;
+    }
+    uint64_t seq = ++st->seq;
+    segment_t *seg = st->failed ? NULL : segstore_active(st, iov.iov_len);
+    if (seg != NULL) {
+        segment_encode_commit(record + SEGMENT_COMMIT_OFFSET, SEGMENT_DELETE, seq, 0, seg->id, NULL);
+        if (file_pwritev(seg->fd, &iov, 1, seg->size) != 0) seg = NULL;
+    }
+    int failed = seg == NULL;
+    uint32_t id = failed ? 0 : seg->id;
+    if (!failed) {
+        seg->size += iov.iov_len;
+        seg->live += iov.iov_len;
+        seg->dirty = 1;
+        seg->pending++;     // Não é compactado antes de a exclusão chegar ao disco
+        failed = segstore_sync_to(st, ++st->written) != 0;
+        if ((seg = segstore_segment(st, id)) != NULL) seg->pending--;
+    }
+
+    segment_object_t *obj = failed ? NULL : segstore_object(st, name);
+    if (obj != NULL && obj->seq < seq) {
+        segstore_dead(st, obj);
+        segstore_remove(st, name);
+    }
+    mutex_unlock(&st->lock);
+    return failed ? -1 : 1;
+}
+
+/*--------------------------------------------------------------
+ * LEITURA
+ *------------------------------------------------------------*/
+
+/**
+ * Consulta um objeto
+ *
+ * @param out Recebe uma cópia do objeto (sem o nome); pode ser NULL
+ * @return 0 se o objeto existe, -1 caso contrário
+ */
+static inline int segstore_lookup(segment_store_t *st, const char *name, segment_object_t *out) {
+    mutex_lock(&st->lock);
+    segment_object_t *obj = segstore_object(st, name);
+    if (obj != NULL && out != NULL) {
+        *out = *obj;
+        out->name = NULL;
+    }
+    mutex_unlock(&st->lock);
+    return obj != NULL ? 0 : -1;
+}
+
+/**
+ * Abre para leitura o segmento de um objeto
+ *
+ * @param out Recebe uma cópia do objeto (sem o nome)
+ * @return Descritor do segmento, ou -1 se o objeto não existe
+ *
+ * Por que foi feito:
+ * - A consulta e a abertura acontecem sob o mesmo lock que a compactação
+ *   usa para mudar o objeto de segmento; o descritor aberto continua
+ *   lendo o conteúdo mesmo se o segmento for apagado em seguida
+ */
+static inline int segstore_open_object(segment_store_t *st, const char *name, segment_object_t *out) {
+    char path[INDEX_PATH_MAX];
+    int fd = -1;
+
+    mutex_lock(&st->lock);
+    segment_object_t *obj = segstore_object(st, name);
+    if (obj != NULL && segstore_path(st, path, obj->segment) == 0 && (fd = file_open_read(path)) >= 0) {
+        *out = *obj;
+        out->name = NULL;
+    }
+    mutex_unlock(&st->lock);
+    return fd;
+}
+
+/**
+ * Posição do conteúdo de um objeto no segmento
+ */
+static inline uint64_t segment_object_data(const segment_object_t *obj) {
+    return obj->offset + SEGMENT_HEADER_SIZE + obj->name_len;
+}
+
+/**
+ * Metadados de um objeto para o índice (index_add_store)
+ *
+ * @return 0 se o objeto existe, -1 caso contrário
+ *
+ * Por que foi feito:
+ * - A sequência faz o papel do inode: muda a cada nova versão do nome, e
+ *   o cache de leitura e os resumos conferem a versão por ela
+ */
+static inline int segstore_index_lookup(void *ctx, const char *name, uint64_t *size, int64_t *mtime, uint64_t *inode) {
+    segment_object_t obj;
+
+    if (segstore_lookup((segment_store_t *)ctx, name, &obj) != 0) return -1;
+    *size = obj.size;
+    *mtime = obj.mtime;
+    *inode = obj.seq;
+    return 0;
+}
+
+/**
+ * Percorre todos os objetos para o índice (index_add_store)
+ */
+static inline void segstore_index_each(void *ctx, index_visit_fn visit, void *arg) {
+    segment_store_t *st = (segment_store_t *)ctx;
+
+    mutex_lock(&st->lock);
+    for (size_t i = 0; i < st->object_count; i++) {
+        const segment_object_t *obj = &st->objects[i];
+        visit(arg, obj->name, obj->size, obj->mtime, obj->seq);
+    }
+    mutex_unlock(&st->lock);
+}
+
+/*--------------------------------------------------------------
+ * COMPACTAÇÃO
+ *------------------------------------------------------------*/
+
+/**
+ * Registro copiado para outro segmento
+ */
+typedef struct {
+    char *name;                         // NULL para exclusões
+    uint64_t from;                      // Posição no segmento compactado
+    uint32_t segment;                   // Destino
+    uint64_t offset;
+    uint64_t length;
+} segment_move_t;
+
+/**
+ * Indica se uma exclusão ainda esconde alguma versão anterior (com o lock)
+ *
+ * @param victim Segmento em compactação (não conta)
+ *
+ * Por que foi feito:
+ * - As versões anteriores do nome estão em segmentos que já existiam
+ *   quando a exclusão foi feita (número até o de origem); sem nenhum
+ *   deles, ou com uma versão mais nova do nome, a exclusão pode sumir
+ */
+static inline int segstore_tombstone_needed(segment_store_t *st, uint32_t victim, const segment_record_t *r) {
+    const segment_object_t *obj = segstore_object(st, r->name);
+
+    if (obj != NULL && obj->seq > r->seq) return 0;
+    for (size_t i = 0; i < st->count && st->segments[i].id <= r->origin; i++) {
+        if (st->segments[i].id != victim) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Copia os registros vivos de um segmento para o ativo e apaga o segmento
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro (o segmento fica)
+ *
+ * Por que foi feito:
+ * - Os registros são copiados byte a byte, com a mesma sequência; um
+ *   objeto substituído ou excluído durante a cópia não é redirecionado, e
+ *   a cópia vira espaço morto no destino
+ * - Os destinos só passam a valer depois de sincronizados; até lá as
+ *   leituras continuam no segmento antigo
+ */
+static inline int segstore_compact(segment_store_t *st, uint32_t victim) {
+    char path[INDEX_PATH_MAX];
+    segment_scan_t sc;
+    segment_record_t r;
+    segment_move_t *moves = NULL;
+    size_t move_count = 0, move_cap = 0;
+    int failed = 0;
+
+    memset(&sc, 0, sizeof(sc));
+    mutex_lock(&st->lock);
+    segment_t *seg = segstore_segment(st, victim);
+    sc.end = seg != NULL ? seg->size : 0;
+    mutex_unlock(&st->lock);
+
+    if (segstore_path(st, path, victim) != 0 || (sc.fd = file_open_read(path)) < 0) return -1;
+    if ((sc.buf = (uint8_t *)malloc(SEGMENT_READ_SIZE)) == NULL) {
+        file_close(sc.fd);
+        return -1;
+    }
+
+    while (!failed && segment_scan_next(&sc, &r)) {
+        if (r.type == 0) continue;
+        mutex_lock(&st->lock);
+        const segment_object_t *obj = r.type == SEGMENT_OBJECT ? segstore_object(st, r.name) : NULL;
+        int keep = r.type == SEGMENT_OBJECT ? obj != NULL && obj->segment == victim && obj->offset == r.offset :
+                   segstore_tombstone_needed(st, victim, &r);
+        if (keep && move_count == move_cap) {
+            size_t cap = move_cap ? move_cap * 2 : 256;
+            segment_move_t *grown = (segment_move_t *)realloc(moves, cap * sizeof(segment_move_t));
+            if (grown != NULL) {
+                moves = grown;
+                move_cap = cap;
+            }
+        }
+        segment_t *dest = keep && move_count < move_cap && !st->failed ? segstore_active(st, r.length) : NULL;
+        if (keep && dest == NULL) failed = 1;
+        if (dest != NULL) {
+            io_vec_t iov;
+            iov.iov_base = (void *)r.bytes;
+            iov.iov_len = (size_t)r.length;
+            segment_move_t *m = &moves[move_count];
+            m->name = r.type == SEGMENT_OBJECT ? strdup(r.name) : NULL;
+            if ((r.type == SEGMENT_OBJECT && m->name == NULL) || file_pwritev(dest->fd, &iov, 1, dest->size) != 0) {
+                free(m->name);
+                failed = 1;
+            } else {
+                m->from = r.offset;
+                m->segment = dest->id;
+                m->offset = dest->size;
+                m->length = r.length;
+                dest->size += r.length;
+                dest->dirty = 1;
+                dest->pending++;    // Destino não é compactado antes de a cópia valer
+                st->written++;
+                move_count++;
+            }
+        }
+        mutex_unlock(&st->lock);
+    }
+    free(sc.buf);
+    file_close(sc.fd);
+
+    mutex_lock(&st->lock);
+    if (!failed && segstore_sync_to(st, st->written) != 0) failed = 1;
+    for (size_t i = 0; i < move_count; i++) {
+        segment_move_t *m = &moves[i];
+        segment_t *dest = segstore_segment(st, m->segment);
+        if (dest != NULL) dest->pending--;
+        if (failed || dest == NULL) {
+            free(m->name);
+            continue;
+        }
+        if (m->name == NULL) {
+            dest->live += m->length;
+            continue;
+        }
+        segment_object_t *obj = segstore_object(st, m->name);
+        if (obj != NULL && obj->segment == victim && obj->offset == m->from) {
+            obj->segment = m->segment;
+            obj->offset = m->offset;
+            dest->live += m->length;
+        }
+        free(m->name);
+    }
+    free(moves);
+
+    if (!failed) {
+        // Leitores já abriram o segmento pelo caminho; a sincronização em
+        // andamento pode estar usando o descritor
+        while (st->syncing) cond_wait(&st->synced, &st->lock);
+        if ((seg = segstore_segment(st, victim)) != NULL) {
+            file_close(seg->fd);
+            st->reclaimed += seg->size;
+            st->compactions++;
+            size_t at = (size_t)(seg - st->segments);
+            memmove(seg, seg + 1, (st->count - at - 1) * sizeof(segment_t));
+            st->count--;
+        }
+    }
+    mutex_unlock(&st->lock);
+
+    if (failed) return -1;
+    remove(path);
+    dir_sync(st->dir);
+    return 0;
+}
+
+/**
+ * Escolhe o segmento fechado com mais bytes mortos (com o lock)
+ *
+ * @return 1 se há um segmento a compactar (em victim), 0 caso contrário
+ */
+static inline int segstore_pick(segment_store_t *st, uint32_t *victim) {
+    uint64_t best = 0;
+    int found = 0;
+
+    for (size_t i = 0; i < st->count; i++) {
+        const segment_t *seg = &st->segments[i];
+        uint64_t dead = seg->size - seg->live;
+        if (!seg->sealed || seg->pending > 0 || dead * 100 < seg->size * SEGMENT_DEAD_PERCENT) continue;
+        if (!found || dead > best) {
+            best = dead;
+            *victim = seg->id;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+/**
+ * Thread de compactação
+ */
+static inline void *segstore_main(void *arg) {
+    segment_store_t *st = (segment_store_t *)arg;
+    uint32_t victim;
+
+    for (;;) {
+        sleep_ms(SEGMENT_COMPACT_MS);
+        for (;;) {
+            mutex_lock(&st->lock);
+            int found = segstore_pick(st, &victim);
+            mutex_unlock(&st->lock);
+            if (!found) break;
+            if (segstore_compact(st, victim) != 0) {
+                printf("Erro ao compactar o segmento %u.\n", victim);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*--------------------------------------------------------------
+ * PARTIDA
+ *------------------------------------------------------------*/
+
+/**
+ * Compara números de segmento para qsort()
+ */
+static inline int segstore_id_compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Lê os registros de um segmento para a tabela
+ *
+ * @param buf Buffer de leitura com SEGMENT_READ_SIZE bytes
+ */
+static inline void segstore_replay(segment_store_t *st, uint32_t id, uint8_t *buf, segment_recovery_t *rec) {
+    char path[INDEX_PATH_MAX];
+    segment_scan_t sc;
+    segment_record_t r;
+
+    memset(&sc, 0, sizeof(sc));
+    sc.buf = buf;
+    sc.end = UINT64_MAX;
+    if (segstore_path(st, path, id) != 0 || (sc.fd = file_open_read(path)) < 0) return;
+
+    while (segment_scan_next(&sc, &r)) {
+        rec->records++;
+        if (r.type == 0) continue;
+        if (r.seq > st->seq) st->seq = r.seq;
+        if (r.type == SEGMENT_OBJECT && !r.intact) {
+            rec->damaged++;
+            continue;
+        }
+        segment_t *seg = segstore_segment(st, id);
+        if (r.type == SEGMENT_DELETE) seg->live += r.length;
+
+        // Vale o registro de maior sequência de cada nome
+        segment_object_t *obj = segstore_object(st, r.name);
+        if (obj != NULL && obj->seq >= r.seq) continue;
+        if (obj != NULL && !obj->deleted) segstore_dead(st, obj);
+        if (obj == NULL && (obj = segstore_insert(st, r.name)) == NULL) continue;
+        obj->segment = id;
+        obj->offset = r.offset;
+        obj->size = r.size;
+        obj->name_len = r.name_len;
+        obj->deleted = r.type == SEGMENT_DELETE;
+        obj->seq = r.seq;
+        obj->mtime = r.mtime;
+        memcpy(obj->digest, r.digest, CHECKSUM_SIZE);
+        if (!obj->deleted) seg->live += r.length;
+    }
+    file_close(sc.fd);
+    segstore_segment(st, id)->size = sc.pos;
+}
+
+/**
+ * Lê os segmentos e monta a tabela (antes da recuperação do diário)
+ *
+ * @param storage Diretório de armazenamento
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - A recuperação do diário pode excluir objetos, e o índice consulta a
+ *   tabela ao reler os nomes das operações interrompidas
+ */
+static inline int segstore_open(segment_store_t *st, const char *storage, segment_recovery_t *rec) {
+    uint64_t started = monotonic_ns();
+    uint32_t *ids = NULL;
+    size_t id_count = 0, id_cap = 0;
+    dir_iter_t it;
+    const char *entry;
+
+    memset(st, 0, sizeof(*st));
+    memset(rec, 0, sizeof(*rec));
+    mutex_init(&st->lock);
+    cond_init(&st->synced);
+    st->next_id = 1;
+    int len = snprintf(st->dir, sizeof(st->dir), "%s" PATH_SEP SEGMENT_DIR, storage);
+    if (len < 0 || len >= (int)sizeof(st->dir)) return -1;
+    if (!path_is_dir(st->dir) && make_dir(st->dir) != 0) return -1;
+    if ((st->slots = (index_slot_t *)calloc(INDEX_INITIAL_SLOTS, sizeof(index_slot_t))) == NULL) return -1;
+    st->slot_mask = INDEX_INITIAL_SLOTS - 1;
+
+    // Números dos segmentos existentes, em ordem
+    if (dir_open(&it, st->dir) != 0) return -1;
+    while ((entry = dir_next(&it)) != NULL) {
+        char *end;
+        if (strncmp(entry, "seg-", 4) != 0 || entry[4] < '0' || entry[4] > '9') continue;
+        unsigned long id = strtoul(entry + 4, &end, 10);
+        if (*end != '\0' || id == 0 || id > UINT32_MAX) continue;
+        if (id_count == id_cap) {
+            size_t cap = id_cap ? id_cap * 2 : 64;
+            uint32_t *grown = (uint32_t *)realloc(ids, cap * sizeof(uint32_t));
+            if (grown == NULL) break;
+            ids = grown;
+            id_cap = cap;
+        }
+        ids[id_count++] = (uint32_t)id;
+    }
+    dir_close(&it);
+    qsort(ids, id_count, sizeof(uint32_t), segstore_id_compare);
+
+    uint8_t *buf = (uint8_t *)malloc(SEGMENT_READ_SIZE);
+    int failed = buf == NULL;
+    for (size_t i = 0; i < id_count && !failed; i++) {
+        char path[INDEX_PATH_MAX];
+        int fd = segstore_path(st, path, ids[i]) == 0 ? file_open_write(path, 0) : -1;
+        segment_t *seg = fd >= 0 ? segstore_append(st, ids[i], fd) : NULL;
+        if (seg == NULL) {
+            if (fd >= 0) file_close(fd);
+            failed = 1;
+            break;
+        }
+        seg->sealed = 1;
+        segstore_replay(st, ids[i], buf, rec);
+    }
+    free(buf);
+    free(ids);
+    if (failed) return -1;
+
+    // Exclusões só serviam para ordenar as versões durante a leitura
+    for (size_t i = st->object_count; i-- > 0;) {
+        if (st->objects[i].deleted) segstore_remove(st, st->objects[i].name);
+    }
+
+    // O último segmento volta a receber registros, sem o trecho cortado
+    segment_t *last = st->count > 0 ? &st->segments[st->count - 1] : NULL;
+    if (last != NULL && last->size < SEGMENT_MAX_BYTES && file_truncate(last->fd, last->size) == 0) last->sealed = 0;
+
+    rec->segments = (uint32_t)st->count;
+    rec->objects = st->object_count;
+    rec->ms = (double)(monotonic_ns() - started) / 1e6;
+    return 0;
+}
+
+/**
+ * Inicia a thread de compactação
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+static inline int segstore_start(segment_store_t *st) {
+    thread_t thread;
+    return thread_create(&thread, segstore_main, st);
+}
+
+/**
+ * Lê a ocupação dos segmentos (métricas)
+ */
+static inline void segstore_stats(segment_store_t *st, segment_stats_t *out) {
+    mutex_lock(&st->lock);
+    memset(out, 0, sizeof(*out));
+    out->objects = st->object_count;
+    out->segments = (uint32_t)st->count;
+    for (size_t i = 0; i < st->count; i++) {
+        out->live += st->segments[i].live;
+        out->dead += st->segments[i].size - st->segments[i].live;
+    }
+    out->syncs = st->syncs;
+    out->compactions = st->compactions;
+    out->reclaimed = st->reclaimed;
+    mutex_unlock(&st->lock);
+}
+
+#endif /* BIGFS_SEGSTORE_H */
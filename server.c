@@ -1,19 +1,50 @@
 /*******************************************************************************
  * SERVIDOR PARA SISTEMA DE TRANSFERÊNCIA DE ARQUIVOS
- * 
+ *
  * Descrição: Implementa o servidor para transferência de arquivos via sockets TCP/IP
  *            que gerencia operações de arquivos remotos.
- * 
+ *
  * Funcionalidades:
- * - Aceita conexões de múltiplos clientes
- * - Gerencia upload/download de arquivos
- * - Lista arquivos disponíveis
+ * - Aceita conexões de múltiplos clientes simultaneamente (motor orientado a
+ *   eventos com epoll no Linux e um conjunto fixo de threads trabalhadoras)
+ * - Gerencia upload/download de arquivos com protocolo binário enquadrado
+ * - Acesso ao disco em threads separadas da rede: gravação de uploads,
+ *   leitura antecipada de downloads e conclusão (troca atômica do nome),
+ *   com orçamento de memória que segura uploads rápidos para um disco lento
+ * - Downloads de intervalos e uploads retomáveis entre conexões
+ * - Uploads em blocos paralelos (várias conexões) com escrita posicional
+ * - Armazenamento opcional por conteúdo: blocos deduplicados por SHA-256 e
+ *   arquivos descritos por manifestos
+ * - Atualização por diferenças (estilo rsync) de arquivos já armazenados
+ * - Árvores de diretórios: subdiretórios no armazenamento, arquivos pequenos
+ *   enviados em lotes com um único syncfs() por lote, permissões e datas
+ *   preservadas
+ * - Compressão LZ4/zstd dos quadros DATA, dispensada para conteúdo já comprimido
+ * - Cache de leitura em memória (2Q) com os arquivos pequenos e os trechos
+ *   quentes dos grandes, descartado a cada upload, exclusão ou mudança externa
+ * - Integridade de ponta a ponta: CRC32C e XXH64 calculados enquanto os
+ *   bytes chegam, conferidos a cada pedido e guardados por arquivo
+ * - Buffers de transferência de um pool com limite global e por sessão
+ * - Limites de banda por conexão, por IP e globais, trocados sem reiniciar,
+ *   e revezamento justo (deficit round-robin) entre as transferências
+ * - Métricas por thread sem trava (contadores e histogramas de latência),
+ *   expostas em um endpoint HTTP local e em um relatório periódico
+ * - Replicação opcional para outros servidores: a escrita é confirmada
+ *   quando um quorum de cópias a gravou, e réplicas que ficaram para trás
+ *   recebem só os arquivos que faltam ou diferem
+ * - Diário de operações (write-ahead) com confirmação em grupo: uploads e
+ *   exclusões interrompidos por uma queda são terminados na partida, e o
+ *   índice volta de um ponto de controle sem ler o diretório
+ * - Armazenamento opcional em segmentos: uploads pequenos acrescentados a
+ *   poucos arquivos grandes, com confirmação em grupo e compactação do
+ *   espaço liberado por exclusões
+ * - Lista arquivos disponíveis a partir de um índice em memória
  * - Remove arquivos do servidor
  * - Suporte a caracteres acentuados e Unicode
- * 
+ *
  * Autor: [Seu Nome]
  * Data: [Data]
- * Versão: 1.0
+ * Versão: 2.0
  ******************************************************************************/
 
 /*--------------------------------------------------------------
@@ -22,331 +53,4671 @@
 #include <stdio.h>      // Para funções de entrada/saída padrão
 #include <stdlib.h>     // Para alocação de memória e outras utilidades
 #include <string.h>     // Para manipulação de strings
-#include <winsock2.h>   // Para sockets no Windows
-#include <windows.h>    // Para funções específicas do Windows
-#include <direct.h>     // Para manipulação de diretórios
 #include <locale.h>     // Para configuração de localização (acentos)
+#include <time.h>       // Para a idade de uploads abandonados
+#include "platform.h"   // Sockets, threads e poller portáveis (Winsock/POSIX)
+#include "protocol.h"   // Formato binário dos quadros
+#include "transfer.h"   // Envio de arquivos com sendfile/mmap
+#include "bufpool.h"    // Buffers alinhados das transferências
+#include "diskio.h"     // E/S de arquivos em threads de disco
+#include "index.h"      // Metadados dos arquivos em memória
+#include "chunkstore.h" // Blocos deduplicados e manifestos
+#include "delta.h"      // Assinaturas e reconstrução por diferenças
+#include "compress.h"   // Compressão dos quadros DATA
+#include "ratelimit.h"  // Limites de banda e temporizador das sessões
+#include "metrics.h"    // Contadores, histogramas e endpoint de métricas
+#include "cache.h"      // Cache de leitura dos arquivos mais pedidos
+#include "replica.h"    // Réplicas, quorum de escrita e recuperação
+#include "journal.h"    // Diário de operações e ponto de controle do índice
+#include "segstore.h"   // Objetos pequenos em segmentos (armazenamento em log)
 
-// Linkar com a biblioteca de sockets do Windows
-#pragma comment(lib, "ws2_32.lib")
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define PORT 8888               // Porta padrão para conexão
+#define BUFFER_SIZE 1024        // Tamanho do buffer para transferência
+#ifdef _WIN32
+#define SERVER_STORAGE "C:\\Users\\ld388\\Desktop\\SD\\server_storage" // Diretório de armazenamento
+#else
+#define SERVER_STORAGE "server_storage" // Diretório de armazenamento
+#endif
+#define LISTEN_BACKLOG 128      // Tamanho padrão da fila de conexões pendentes
+#define MAX_CONNECTIONS 1024    // Número máximo padrão de sessões simultâneas
+#define MAX_EVENTS 64           // Eventos tratados por iteração do poller
+#define SESSION_IO_BUDGET 64    // Operações de E/S por sessão antes de ceder a vez
+#define SESSION_INPUT_SIZE (FRAME_HEADER_SIZE + FRAME_MAX_CONTROL) // Buffer de entrada por sessão
+#define SESSION_OUTPUT_HIGH (64 * 1024) // Resposta acumulada que pausa novos pedidos
+#define DRR_QUANTUM (512 * 1024)        // Bytes de arquivo por vez de cada sessão (deficit round-robin)
+#define LIMITS_CHECK_NS 1000000000ull   // Intervalo entre verificações do arquivo de limites
+#define DISK_THREADS 2          // Threads padrão do estágio de escrita em disco
+#define BUFFER_MEMORY_MB 1024   // Memória padrão dos buffers de transferência (todas as sessões)
+#define SESSION_BUFFER_LIMIT (16L * 1024 * 1024) // Buffers de transferência de uma sessão
+#define CACHE_MEMORY_MB 128     // Memória padrão do cache de leitura (0: desligado)
+#define STORAGE_INTERNAL ".bigfs-"      // Prefixo dos itens internos do armazenamento
+#define PARTS_DIR ".bigfs-parts"        // Uploads em andamento (nomes temporários)
+#define PARTS_MAX_AGE (7 * 24 * 3600)   // Idade máxima de um upload retomável abandonado (s)
+#define SUMS_DIR ".bigfs-sums"          // Resumos de integridade dos arquivos guardados
+#define SUMS_MAGIC "BIGFSCK1"
+#define SUMS_HEADER_SIZE 33             // Magic + tamanho + data + inode + tamanho do resumo
+#define CHUNK_RECORD_SIZE 20            // Posição, fim e CRC32C de um bloco concluído
+#define LIST_BATCH_SIZE (64 * 1024)     // Tamanho de cada quadro DATA da listagem
+#define SOURCE_MANIFEST 1               // Origem do índice com os manifestos
+
+/*--------------------------------------------------------------
+ * CONFIGURAÇÃO E ESTADO DO SERVIDOR
+ *------------------------------------------------------------*/
+
+/**
+ * Parâmetros do servidor ajustáveis pela linha de comando
+ */
+typedef struct {
+    int port;                   // Porta de escuta
+    int backlog;                // Fila de conexões pendentes do listen()
+    int max_connections;        // Limite de sessões simultâneas
+    int workers;                // Threads trabalhadoras (padrão: núcleos da CPU)
+    int disk_threads;           // Threads que leem e gravam arquivos em disco
+    int disk_budget_mb;         // Memória de uploads aguardando o disco (MB)
+    int buffer_mb;              // Memória total dos buffers de transferência (MB)
+    char storage[MAX_PATH];     // Diretório de armazenamento
+    send_mode_t send_mode;      // Caminho de envio dos downloads
+    int dedup;                  // Aceita blocos e manifestos (armazenamento por conteúdo)
+    char limits[MAX_PATH];      // Arquivo de limites de banda ("" sem limites)
+    int metrics_port;           // Endpoint HTTP de métricas em 127.0.0.1 (0: desligado)
+    int report_seconds;         // Intervalo do relatório de métricas (0: desligado)
+    int cache_mb;               // Memória do cache de leitura (MB, 0: desligado)
+    const char *replicas;       // Réplicas ("ip:porta,..."; NULL: nenhuma)
+    int quorum;                 // Cópias confirmadas antes do OK (0: maioria)
+    int pack;                   // Uploads pequenos vão para segmentos (-s pack)
+    int pack_kb;                // Maior upload guardado em segmento (KB)
+} server_config_t;
+
+static server_config_t config = { PORT, LISTEN_BACKLOG, MAX_CONNECTIONS, 0, DISK_THREADS,
+                                  (int)(DISK_BUDGET_DEFAULT >> 20), BUFFER_MEMORY_MB,
+                                  SERVER_STORAGE, SEND_MODE_SENDFILE, 0, "", 0, 0, CACHE_MEMORY_MB, NULL, 0,
+                                  0, SEGMENT_OBJECT_MAX / 1024 };
+
+/**
+ * Estados de uma sessão
+ */
+typedef enum {
+    SESSION_ACTIVE,             // Processando quadros do cliente
+    SESSION_CLOSING             // Encerrar assim que a resposta for enviada
+} session_state_t;
+
+/**
+ * O que está sendo recebido nos quadros DATA de um upload
+ */
+typedef enum {
+    UPLOAD_FILE,                // Arquivo (inteiro, retomável ou bloco paralelo)
+    UPLOAD_CHUNK,               // Bloco do armazenamento por conteúdo
+    UPLOAD_MANIFEST,            // Lista de blocos de um arquivo
+    UPLOAD_DELTA,               // Instruções para reconstruir um arquivo existente
+    UPLOAD_TREE                 // Lote de arquivos pequenos (TREE_PUT)
+} upload_kind_t;
+
+/**
+ * Papel do cache de leitura em um download
+ */
+typedef enum {
+    TX_CACHE_OFF,               // Sem cache (sendfile, manifesto, lote de TREE_GET)
+    TX_CACHE_HIT,               // Trecho inteiro em blocos fixados: nenhum arquivo aberto
+    TX_CACHE_FILL               // Leituras do disco guardadas no cache
+} tx_cache_t;
+
+/**
+ * Estado de uma conexão de cliente
+ *
+ * Por que foi feito:
+ * - Com várias conexões atendidas pelas mesmas threads, todo o estado que
+ *   antes vivia na pilha de main() (comando, arquivo aberto, progresso)
+ *   precisa ficar associado à própria conexão
+ * - Quadros podem chegar fragmentados ou vários no mesmo recv(); o buffer
+ *   de entrada guarda o que ainda não formou um quadro completo
+ */
+typedef struct session {
+    SOCKET sock;                // Socket conectado ao cliente
+    char peer[64];              // Endereço do cliente ("ip:porta")
+    session_state_t state;      // Estado da sessão
+    int input_blocked;          // Há quadros no buffer esperando a resposta esvaziar
+    int disk_wait;              // Parou esperando o estágio de disco
+    buf_account_t mem;          // Buffers de transferência em uso pela sessão
+    struct session *next;       // Encadeamento na fila de trabalho
+
+    // Revezamento e limites de banda
+    long deficit;               // Bytes de arquivo que ainda cabem nesta vez (DRR)
+    int yielded;                // Cedeu a vez com trabalho pendente
+    uint64_t throttle_until;    // Parada pelo limite de banda até este instante (0: não)
+    rate_bucket_t rate_conn[2]; // Baldes da própria conexão [sentido]
+    rate_ip_t *rate_ip;         // Baldes compartilhados com o mesmo endereço
+    rate_bucket_t *rate_chain[2][RATE_SCOPES]; // Baldes consultados em cada sentido
+
+    // Métricas
+    int req_op;                 // Histograma do pedido em andamento
+    uint64_t req_start;         // Chegada do pedido em andamento (0: nenhum)
+    uint64_t queued_ns;         // Entrada na fila de trabalho
+    uint64_t parked_ns;         // Início da espera pelo disco (0: não está esperando)
+
+    // Bytes recebidos ainda não processados
+    uint8_t *in;
+    size_t in_len;
+
+    // Quadro DATA sendo recebido
+    int rx_active;
+    uint64_t rx_left;
+    uint16_t rx_flags;
+    uint8_t *rx_packed;         // Payload de um quadro comprimido (alocado no primeiro uso)
+    size_t rx_packed_len;
+    uint8_t *rx_plain;          // Quadro descomprimido ainda não entregue ao disco
+    size_t rx_plain_len, rx_plain_pos;
+
+    // Resposta pendente de envio
+    char *out;
+    size_t out_len, out_sent, out_cap;
+
+    // Upload em andamento
+    int uploading;              // Há um upload aberto (mesmo que descartando dados)
+    int upload_fd;              // Arquivo temporário; -1 quando os dados são descartados
+    int upload_refused;         // O erro do upload já foi respondido
+    int upload_committing;      // Fim recebido, esperando as escritas terminarem
+    int upload_resumable;       // Upload identificado por id (sobrevive à conexão)
+    int upload_chunked;         // Bloco de um upload paralelo (várias conexões)
+    int upload_packed;          // Objeto pequeno gravado num segmento (-s pack)
+    segment_slot_t upload_slot; // Espaço reservado no segmento
+    upload_kind_t upload_kind;
+    uint8_t upload_hash[SHA256_SIZE]; // Hash declarado de um bloco
+    sha256_t upload_digest;     // Hash calculado enquanto o bloco chega
+    checksum_t upload_sum;      // CRC32C e XXH64 dos bytes recebidos neste pedido
+    int upload_corrupt;         // O resumo enviado pelo cliente não conferiu
+    uint32_t delta_block;       // Blocos das assinaturas usadas pelo cliente
+    uint64_t delta_base_size;   // Cópia sobre a qual as diferenças foram calculadas
+    int64_t delta_base_mtime;
+    uint32_t tree_entries;      // Entradas do lote de TREE_PUT
+    uint64_t upload_id;
+    file_writer_t writer;       // Anel de buffers e escrita em disco
+    disk_call_t commit;         // Conclusão do upload (troca de nome, resumos) no disco
+    int upload_storing;         // Conclusão entregue às threads de disco
+    uint32_t upload_request;
+    uint64_t upload_size;       // Tamanho declarado do arquivo
+    uint64_t upload_start;      // Posição do primeiro byte deste pedido
+    uint64_t upload_end;        // Posição após o último byte deste pedido
+    uint64_t upload_total;      // Próxima posição a receber
+    char upload_name[MAX_PATH];
+    char upload_temp[MAX_PATH];
+
+    // Download em andamento
+    int downloading;
+    file_sender_t tx;           // Origem dos bytes (sendfile, mmap ou buffer)
+    file_reader_t reader;       // Leitura antecipada dos envios que passam pela memória
+    int tx_buffered;            // Quadros montados na memória (comprimidos ou modo buffer)
+    uint32_t tx_request;
+    uint64_t tx_remaining;      // Bytes do arquivo ainda não enquadrados
+    uint64_t tx_frame_left;     // Bytes restantes do quadro DATA atual
+    int tx_final;               // O último quadro DATA já foi enquadrado
+    manifest_t tx_manifest;     // Blocos do arquivo (refs == NULL para arquivos comuns)
+    uint32_t tx_chunk;          // Próximo bloco a abrir
+    uint64_t tx_chunk_left;     // Bytes restantes do bloco aberto
+    int tx_codec;               // Compressão dos quadros (CODEC_NONE: envio direto do arquivo)
+    uint8_t *tx_plain;          // Amostra do arquivo para decidir a compressão
+    uint8_t *tx_packed;         // Quadro comprimido
+    char tx_name[MAX_PATH];
+    tx_cache_t tx_cache;
+    cache_version_t tx_version; // Versão do arquivo lida antes de abri-lo
+    cache_block_t **tx_blocks;  // Blocos fixados (TX_CACHE_HIT)
+    long tx_block_count;
+    uint32_t tx_block_first;    // Bloco que contém a posição inicial
+
+    // Lote de TREE_GET montado pelo estágio de disco
+    int tree_packing;           // Montagem entregue às threads de disco
+    uint32_t tree_request;
+    int tree_codec;             // Compressão pedida (FLAG_CODEC)
+    char *tree_names;           // Nomes pedidos (u16 tamanho + nome cada)
+    uint32_t tree_count;
+    uint64_t tree_size;         // Tamanho do lote montado
+    uint8_t tree_digest[CHECKSUM_SIZE];
+    char tree_temp[MAX_PATH];
+
+    // DELETE ou UPLOAD_COMMIT entregue ao estágio de disco
+    int store_op;               // Opcode do pedido (0: nenhum)
+    uint32_t store_request;
+    uint64_t store_id;          // Id do upload em blocos
+    uint64_t store_size;        // Tamanho declarado do upload em blocos
+    char store_name[MAX_PATH];
+
+    // Escrita levada às réplicas
+    replica_write_t *replica_write; // Criada no primeiro arquivo gravado ou excluído
+    int replicating;            // Resposta esperando o quorum
+    uint32_t replica_request;
+    char replica_message[64];   // Resposta de sucesso
+} session_t;
+
+/**
+ * Fila de sessões prontas para processamento
+ */
+typedef struct {
+    mutex_t lock;
+    cond_t ready;
+    session_t *head, *tail;
+    long length;                // Sessões na fila
+} work_queue_t;
+
+static poller_t poller;                 // Multiplexador de eventos
+static work_queue_t work_queue;         // Sessões com eventos pendentes
+static disk_pool_t disk_pool;           // Threads do estágio de E/S em disco
+static volatile long upload_sequence;   // Gera nomes temporários únicos
+static storage_index_t storage_index;   // Metadados dos arquivos armazenados
+static journal_t journal;               // Intenções e conclusões das operações no armazenamento
+static segment_store_t segments;        // Objetos pequenos (config.pack)
+static chunk_gc_t chunk_gc;             // Coleta dos blocos sem uso (config.dedup)
+static int source_packed = -1;          // Origem do índice com os objetos em segmentos
+static rate_limits_t rate_limits;       // Taxas em vigor (arquivo de limites)
+static rate_bucket_t rate_global[2];    // Baldes do servidor inteiro [sentido]
+static rate_ip_table_t rate_ips;        // Baldes por endereço IP
+static pacer_t pacer;                   // Acorda as sessões paradas pelo limite
+static read_cache_t read_cache;         // Arquivos pequenos e trechos quentes (config.cache_mb > 0)
+static replica_set_t replica_set;       // Réplicas (count == 0: nenhuma)
+
+/**
+ * Contadores do servidor (posições nas áreas de métricas)
+ */
+typedef enum {
+    M_NET_IN, M_NET_OUT,                    // Bytes lidos e escritos nos sockets
+    M_FILE_UP, M_FILE_DOWN,                 // Bytes de arquivos recebidos e enviados
+    M_ACCEPTED, M_REJECTED,                 // Conexões aceitas e recusadas pelo limite
+    M_WORKER_NS,                            // Tempo das threads trabalhadoras atendendo sessões
+    M_PAUSE_DISK, M_PAUSE_BANDWIDTH, M_PAUSE_QUANTUM, // Sessões paradas e o motivo
+    M_ERR_REPLY,                            // Respostas de erro: M_ERR_REPLY + código - 1
+    M_ERR_NETWORK = M_ERR_REPLY + ERR_CHECKSUM, // Falhas de envio ou recebimento
+    M_ERR_PROTOCOL,                         // Quadros inválidos do cliente
+    M_ERR_DISK,                             // Falhas de leitura durante downloads
+    M_COUNTERS
+} server_counter_t;
+
+static const metric_def_t counter_defs[M_COUNTERS] = {
+    { "bigfs_network_bytes_total", "direction=\"in\"", "Bytes lidos e escritos nos sockets dos clientes", 1 },
+    { "bigfs_network_bytes_total", "direction=\"out\"", "", 1 },
+    { "bigfs_file_bytes_total", "direction=\"upload\"", "Bytes de arquivos recebidos e enviados", 1 },
+    { "bigfs_file_bytes_total", "direction=\"download\"", "", 1 },
+    { "bigfs_connections_total", "result=\"accepted\"", "Conexões aceitas e recusadas", 1 },
+    { "bigfs_connections_total", "result=\"rejected\"", "", 1 },
+    { "bigfs_worker_busy_seconds_total", NULL, "Tempo das threads trabalhadoras atendendo sessões", 1e9 },
+    { "bigfs_session_pauses_total", "reason=\"disk\"", "Sessões paradas por disco, banda ou fim da vez", 1 },
+    { "bigfs_session_pauses_total", "reason=\"bandwidth\"", "", 1 },
+    { "bigfs_session_pauses_total", "reason=\"quantum\"", "", 1 },
+    { "bigfs_errors_total", "type=\"not_found\"", "Erros por tipo", 1 },
+    { "bigfs_errors_total", "type=\"io\"", "", 1 },
+    { "bigfs_errors_total", "type=\"bad_request\"", "", 1 },
+    { "bigfs_errors_total", "type=\"busy\"", "", 1 },
+    { "bigfs_errors_total", "type=\"unsupported\"", "", 1 },
+    { "bigfs_errors_total", "type=\"range\"", "", 1 },
+    { "bigfs_errors_total", "type=\"checksum\"", "", 1 },
+    { "bigfs_errors_total", "type=\"network\"", "", 1 },
+    { "bigfs_errors_total", "type=\"protocol\"", "", 1 },
+    { "bigfs_errors_total", "type=\"disk\"", "", 1 },
+};
+
+/**
+ * Histogramas do servidor: um por operação (posição = opcode) e as esperas
+ */
+#define H_REQUEST_OTHER 0                   // Operação desconhecida
+#define H_QUEUE_WAIT 18                     // Fila de trabalho até uma thread pegar a sessão (ns)
+#define H_DISK_WAIT 19                      // Sessão parada esperando o disco (µs)
+#define H_COUNT 20
+
+#define REQUEST_DEF(op) { "bigfs_request_duration_seconds", "op=\"" op "\"", "Duração dos pedidos por operação", 1e6 }
+static const metric_def_t histogram_defs[H_COUNT] = {
+    REQUEST_DEF("OTHER"), REQUEST_DEF("LIST"), REQUEST_DEF("UPLOAD"), REQUEST_DEF("DOWNLOAD"),
+    REQUEST_DEF("DELETE"), REQUEST_DEF("BYE"), REQUEST_DEF("UPLOAD_STATUS"), REQUEST_DEF("UPLOAD_COMMIT"),
+    REQUEST_DEF("STAT"), REQUEST_DEF("CHUNK_QUERY"), REQUEST_DEF("CHUNK_PUT"), REQUEST_DEF("MANIFEST_PUT"),
+    REQUEST_DEF("SIGNATURES"), REQUEST_DEF("DELTA"), REQUEST_DEF("CODECS"), REQUEST_DEF("TREE_PUT"),
+    { NULL, NULL, NULL, 1 }, REQUEST_DEF("TREE_GET"),
+    { "bigfs_queue_wait_seconds", NULL, "Espera na fila de trabalho", 1e9 },
+    { "bigfs_disk_wait_seconds", NULL, "Sessões paradas esperando o disco", 1e6 },
+};
+
+/**
+ * Uploads retomáveis em andamento em alguma sessão
+ *
+ * Por que foi feito:
+ * - Um cliente que reconecta antes de o servidor perceber a queda da
+ *   conexão antiga não pode gravar no mesmo arquivo que a sessão antiga
+ */
+static struct {
+    mutex_t lock;
+    uint64_t *ids;
+    int count, cap;
+} resumable;
+static volatile long active_sessions;   // Sessões abertas no momento
+static char listener_tag;               // Identifica o socket de escuta no poller
+
+/*--------------------------------------------------------------
+ * DECLARAÇÕES DE FUNÇÕES
+ *------------------------------------------------------------*/
+
+/**
+ * Configura a codificação do console para suportar UTF-8 e acentos
+ *
+ * Por que foi feito:
+ * - Garantir que caracteres acentuados sejam exibidos corretamente
+ * - Configurar o locale para português do Brasil
+ */
+void set_console_encoding() {
+#ifdef _WIN32
+    system("chcp 65001 > nul");     // Muda a página de código para UTF-8
+    SetConsoleOutputCP(CP_UTF8);    // Configura saída do console para UTF-8
+    SetConsoleCP(CP_UTF8);          // Configura entrada do console para UTF-8
+    setlocale(LC_ALL, "Portuguese_Brazil.1252"); // Configura localização
+#else
+    setlocale(LC_ALL, "");          // Terminais POSIX já usam UTF-8
+#endif
+}
+
+/**
+ * Cria o diretório de armazenamento do servidor se não existir
+ *
+ * Por que foi feito:
+ * - Garantir que o local para armazenar arquivos exista
+ * - Evitar erros ao tentar salvar arquivos recebidos
+ */
+void create_storage_directory() {
+    if (!path_exists(config.storage)) {
+        make_dir(config.storage); // Cria o diretório se não existir
+        printf("Diretório de armazenamento criado: %s\n", config.storage);
+    }
+}
+
+/**
+ * Monta o caminho completo de um arquivo no diretório de armazenamento
+ *
+ * @param filepath Buffer de saída com MAX_PATH bytes
+ * @param filename Nome do arquivo
+ * @return 0 em caso de sucesso, -1 se o caminho não couber no buffer
+ */
+int storage_path(char *filepath, const char *filename) {
+    int len = snprintf(filepath, MAX_PATH, "%s" PATH_SEP "%s", config.storage, filename);
+    return (len < 0 || len >= MAX_PATH) ? -1 : 0;
+}
+
+/**
+ * Caminho de um arquivo do armazenamento relativo ao diretório (o inverso
+ * de storage_path)
+ */
+const char *storage_relative(const char *filepath) {
+    size_t len = strlen(config.storage);
+    return strncmp(filepath, config.storage, len) == 0 && filepath[len] != '\0' ? filepath + len + 1 : filepath;
+}
+
+/**
+ * Dá o nome final a um arquivo, criando os subdiretórios que faltam
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - Nomes com '/' (árvores enviadas pelo cliente) vão para subdiretórios
+ *   que podem ainda não existir no armazenamento, nos resumos ou nos
+ *   manifestos; os diretórios só são criados se a troca de nome falhar
+ */
+int storage_rename(const char *from, const char *to) {
+    if (file_replace(from, to) == 0) return 0;
+    if (make_parent_dirs(to) != 0) return -1;
+    return file_replace(from, to);
+}
+
+/**
+ * Garante que o nome de um arquivo do armazenamento chegou ao disco
+ *
+ * @param path Caminho do arquivo (dentro do armazenamento)
+ * @param parents 1 para sincronizar também os diretórios acima dele, até o
+ *                armazenamento (subdiretórios criados na troca de nome)
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+int storage_sync_name(const char *path, int parents) {
+    char dir[MAX_PATH];
+    size_t root = strlen(config.storage);
+    size_t len = strlen(path);
+
+    if (len >= sizeof(dir)) return -1;
+    memcpy(dir, path, len + 1);
+    while (len > root) {
+        while (len > root && dir[len - 1] != '/' && dir[len - 1] != '\\') len--;
+        if (len <= root) break;
+        dir[--len] = '\0';
+        if (dir_sync(dir) != 0) return -1;
+        if (!parents) return 0;
+    }
+    return 0;
+}
+
+/**
+ * Dá o nome final a um upload e espera a troca chegar ao disco
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - O temporário já foi sincronizado, mas a troca de nome fica só no
+ *   diretório; sem sincronizá-lo, uma queda de energia depois do OK pode
+ *   devolver o nome antigo (ou nenhum) a um upload confirmado
+ */
+int storage_publish(const char *from, const char *to) {
+    int created = file_replace(from, to) != 0;
+    if (created && (make_parent_dirs(to) != 0 || file_replace(from, to) != 0)) return -1;
+    return storage_sync_name(to, created);
+}
+
+/**
+ * Remove os subdiretórios que ficaram vazios depois de uma exclusão
+ *
+ * @param root Diretório onde o nome é resolvido (armazenamento, resumos ou manifestos)
+ */
+void storage_prune_dirs(const char *root, const char *filename) {
+    char dirpath[MAX_PATH];
+
+    for (size_t len = strlen(filename); len > 0; len--) {
+        if (filename[len - 1] != '/') continue;
+        int n = snprintf(dirpath, MAX_PATH, "%s" PATH_SEP "%.*s", root, (int)(len - 1), filename);
+        // O primeiro diretório que não está vazio encerra a subida
+        if (n < 0 || n >= MAX_PATH || remove_dir(dirpath) != 0) return;
+    }
+}
+
+/**
+ * Monta o caminho do manifesto de um arquivo do armazenamento por conteúdo
+ *
+ * @return 0 em caso de sucesso, -1 se o caminho não couber no buffer
+ */
+int manifest_path(char *filepath, const char *filename) {
+    int len = snprintf(filepath, MAX_PATH, "%s" PATH_SEP MANIFESTS_DIR PATH_SEP "%s", config.storage, filename);
+    return (len < 0 || len >= MAX_PATH) ? -1 : 0;
+}
+
+/**
+ * Remove o manifesto de um arquivo que acabou de ser gravado por inteiro
+ *
+ * Por que foi feito:
+ * - Um nome aponta para um arquivo comum ou para um manifesto, nunca os
+ *   dois; sem isso a versão antiga voltaria a aparecer após uma exclusão
+ */
+void storage_drop_manifest(const char *filename) {
+    char filepath[MAX_PATH];
+    if (config.dedup && manifest_path(filepath, filename) == 0 && remove(filepath) == 0) chunk_gc_request(&chunk_gc);
+}
+
+/**
+ * Exclui o objeto em segmento de um arquivo que acabou de ser gravado por
+ * inteiro como arquivo comum
+ *
+ * Por que foi feito:
+ * - Como nos manifestos: um arquivo grande demais para o segmento
+ *   substitui a versão pequena que estava lá
+ */
+void storage_drop_packed(const char *filename) {
+    if (config.pack) segstore_delete(&segments, filename);
+}
+
+/**
+ * Monta o caminho de um arquivo no diretório dos uploads em andamento
+ *
+ * @return 0 em caso de sucesso, -1 se o caminho não couber no buffer
+ */
+int parts_path(char *filepath, const char *filename) {
+    int len = snprintf(filepath, MAX_PATH, "%s" PATH_SEP PARTS_DIR PATH_SEP "%s", config.storage, filename);
+    return (len < 0 || len >= MAX_PATH) ? -1 : 0;
+}
+
+/**
+ * Monta o caminho do arquivo parcial ou da descrição de um upload retomável
+ *
+ * @param extension "part" para os dados, "meta" para tamanho e nome
+ */
+int resumable_path(char *filepath, uint64_t upload_id, const char *extension) {
+    char name[64];
+    snprintf(name, sizeof(name), "up-%016llx.%s", (unsigned long long)upload_id, extension);
+    return parts_path(filepath, name);
+}
+
+/**
+ * Monta o caminho do resumo de integridade de um arquivo
+ *
+ * @return 0 em caso de sucesso, -1 se o caminho não couber no buffer
+ */
+int sums_path(char *filepath, const char *filename) {
+    int len = snprintf(filepath, MAX_PATH, "%s" PATH_SEP SUMS_DIR PATH_SEP "%s", config.storage, filename);
+    return (len < 0 || len >= MAX_PATH) ? -1 : 0;
+}
+
+/**
+ * Remove o resumo de integridade de um arquivo
+ */
+void storage_drop_sums(const char *filename) {
+    char filepath[MAX_PATH];
+    if (sums_path(filepath, filename) == 0) remove(filepath);
+}
+
+/**
+ * Exclui um arquivo do armazenamento, com o resumo e os subdiretórios que
+ * ficaram vazios
+ *
+ * @return 1 se o nome existia (arquivo, manifesto ou objeto), 0 caso contrário
+ *
+ * Por que foi feito:
+ * - Usada pelo pedido DELETE e pela recuperação do diário, que termina
+ *   uma exclusão interrompida antes de o índice existir
+ */
+int storage_delete(const char *filename) {
+    char filepath[MAX_PATH];
+    int removed = storage_path(filepath, filename) == 0 && remove(filepath) == 0;
+    // Os blocos do manifesto ficam para a coleta: podem pertencer a outros arquivos
+    if (config.dedup && manifest_path(filepath, filename) == 0 && remove(filepath) == 0) {
+        removed = 1;
+        chunk_gc_request(&chunk_gc);
+    }
+    if (config.pack && segstore_delete(&segments, filename) > 0) removed = 1;
+    if (!removed) return 0;
+    storage_drop_sums(filename);
+    if (strchr(filename, '/') != NULL) {
+        // Arquivo de uma árvore: leva junto os subdiretórios que esvaziaram
+        char root[MAX_PATH];
+        storage_prune_dirs(config.storage, filename);
+        if (storage_path(root, SUMS_DIR) == 0) storage_prune_dirs(root, filename);
+        if (config.dedup && storage_path(root, MANIFESTS_DIR) == 0) storage_prune_dirs(root, filename);
+    }
+    return 1;
+}
+
+/**
+ * Guarda o resumo do arquivo inteiro, calculado durante a transferência
+ *
+ * @param digest CRC32C (u32), seguido do XXH64 (u64) quando conhecido
+ * @param len CHECKSUM_CRC_SIZE ou CHECKSUM_SIZE
+ *
+ * Por que foi feito:
+ * - Downloads e consultas usam o resumo guardado, sem reler o arquivo
+ * - O resumo registra tamanho, data e inode do arquivo; se o arquivo for
+ *   alterado por fora do servidor, o resumo antigo deixa de valer
+ */
+void sums_store(const char *filename, const uint8_t *digest, size_t len) {
+    char filepath[MAX_PATH];
+    char sumpath[MAX_PATH];
+    char temp[MAX_PATH];
+    char name[64];
+    uint8_t record[SUMS_HEADER_SIZE + CHECKSUM_SIZE];
+    uint64_t size, inode;
+    int64_t mtime;
+
+    if (storage_path(filepath, filename) != 0 || sums_path(sumpath, filename) != 0 ||
+        file_stat(filepath, &size, &mtime, &inode) != 0) return;
+    memcpy(record, SUMS_MAGIC, 8);
+    put_u64(record + 8, size);
+    put_u64(record + 16, (uint64_t)mtime);
+    put_u64(record + 24, inode);
+    record[32] = (uint8_t)len;
+    memcpy(record + SUMS_HEADER_SIZE, digest, len);
+
+    // Grava em um temporário e troca o nome: leitores veem o resumo inteiro
+    snprintf(name, sizeof(name), "tmp-%ld.sum", atomic_add_long(&upload_sequence, 1));
+    FILE *file = parts_path(temp, name) == 0 ? fopen(temp, "wb") : NULL;
+    if (file == NULL) return;
+    int failed = fwrite(record, 1, SUMS_HEADER_SIZE + len, file) != SUMS_HEADER_SIZE + len;
+    if (fclose(file) != 0) failed = 1;
+    if (failed || storage_rename(temp, sumpath) != 0) {
+        remove(temp);
+        return;
+    }
+    index_set_digest(&storage_index, filename, size, mtime, digest, len);
+}
+
+/**
+ * Lê o resumo guardado de um arquivo
+ *
+ * @param e Entrada do índice do arquivo (tamanho, data e inode atuais)
+ * @param digest Recebe até CHECKSUM_SIZE bytes
+ * @return Tamanho do resumo, ou 0 se não há resumo válido
+ */
+size_t sums_load(const char *filename, const index_entry_t *e, uint8_t *digest) {
+    char filepath[MAX_PATH];
+    uint8_t record[SUMS_HEADER_SIZE + CHECKSUM_SIZE];
+    int64_t got = -1;
+
+    int fd = sums_path(filepath, filename) == 0 ? file_open_read(filepath) : -1;
+    if (fd >= 0) {
+        got = file_pread(fd, record, sizeof(record), 0);
+        file_close(fd);
+    }
+    if (got < SUMS_HEADER_SIZE || memcmp(record, SUMS_MAGIC, 8) != 0 ||
+        get_u64(record + 8) != e->size || (int64_t)get_u64(record + 16) != e->mtime ||
+        get_u64(record + 24) != e->inode) return 0;
+    size_t len = record[32];
+    if ((len != CHECKSUM_CRC_SIZE && len != CHECKSUM_SIZE) || (int64_t)(SUMS_HEADER_SIZE + len) != got) return 0;
+    memcpy(digest, record + SUMS_HEADER_SIZE, len);
+    return len;
+}
+
+/**
+ * Completa uma entrada do índice com o resumo guardado em disco
+ *
+ * Por que foi feito:
+ * - O índice é montado na partida só com o que o stat() informa; o
+ *   resumo é lido na primeira consulta ao arquivo e fica no índice
+ */
+void sums_attach(const char *filename, index_entry_t *e) {
+    segment_object_t obj;
+
+    if (e->digest_len != 0) return;
+    if (e->source == source_packed) {
+        // O resumo está no registro do objeto; a sequência faz o papel do inode
+        if (segstore_lookup(&segments, filename, &obj) != 0 || obj.seq != e->inode) return;
+        memcpy(e->digest, obj.digest, CHECKSUM_SIZE);
+        e->digest_len = CHECKSUM_SIZE;
+    } else if (e->source != SOURCE_MANIFEST) {
+        e->digest_len = (uint8_t)sums_load(filename, e, e->digest);
+    }
+    if (e->digest_len > 0) index_set_digest(&storage_index, filename, e->size, e->mtime, e->digest, e->digest_len);
+}
+
+/**
+ * Calcula o CRC32C do início de um arquivo
+ *
+ * @param length Bytes a ler a partir do início
+ * @return 0 em caso de sucesso, -1 em caso de erro de leitura
+ */
+int file_crc_prefix(const char *path, uint64_t length, uint32_t *crc) {
+    uint8_t *buf = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, NULL);
+    int fd = buf != NULL ? file_open_read(path) : -1;
+    uint64_t done = 0;
+
+    *crc = 0;
+    while (fd >= 0 && done < length) {
+        size_t want = length - done < FRAME_DATA_CHUNK ? (size_t)(length - done) : FRAME_DATA_CHUNK;
+        if (file_pread(fd, buf, want, done) != (int64_t)want) break;
+        *crc = crc32c(*crc, buf, want);
+        done += want;
+    }
+    if (fd >= 0) file_close(fd);
+    bufpool_free(buf, FRAME_DATA_CHUNK, NULL);
+    return done == length ? 0 : -1;
+}
+
+/**
+ * Registra no diário uma operação e espera o registro chegar ao disco
+ *
+ * @param type JOURNAL_UPLOAD ou JOURNAL_MANIFEST (temp recebe o nome
+ *             filename) ou JOURNAL_DELETE
+ * @param temp Caminho do temporário (NULL na exclusão)
+ * @return Id da operação para journal_end(), ou 0 se o diário falhou
+ *
+ * Por que foi feito:
+ * - A intenção vai ao disco antes da troca de nome ou da exclusão; as
+ *   sessões que registram ao mesmo tempo dividem o mesmo fdatasync()
+ */
+uint64_t storage_journal(int type, const char *filename, const char *temp) {
+    // O temporário fica relativo ao armazenamento, como os nomes
+    uint64_t id = journal_begin(&journal, type, filename, temp != NULL ? storage_relative(temp) : "");
+    if (id != 0 && journal_commit(&journal) != 0) {
+        journal_cancel(&journal, id);
+        id = 0;
+    }
+    return id;
+}
+
+void resumable_remove_meta(uint64_t upload_id);
+
+/**
+ * Resolve uma operação que o diário registrou e não viu terminar
+ *
+ * Por que foi feito:
+ * - Upload com o temporário ainda presente: a troca de nome não chegou ao
+ *   disco, mas o cliente pode ter recebido a confirmação; o temporário já
+ *   estava completo e sincronizado antes da intenção, então a troca é
+ *   terminada
+ * - Exclusão: o cliente pode ter recebido a confirmação antes da queda;
+ *   a exclusão é terminada
+ */
+void journal_recover(const journal_record_t *r) {
+    char temp[MAX_PATH];
+    char filepath[MAX_PATH];
+    unsigned long long upload_id;
+
+    if (r->type == JOURNAL_DELETE) {
+        storage_delete(r->name);
+        printf("Diário: exclusão de %s concluída.\n", r->name);
+        return;
+    }
+    if (storage_path(temp, r->from) != 0 || !path_exists(temp)) return;
+    int manifest = r->type == JOURNAL_MANIFEST;
+    if ((manifest ? manifest_path(filepath, r->name) : storage_path(filepath, r->name)) != 0 ||
+        storage_publish(temp, filepath) != 0) {
+        printf("Diário: erro ao concluir o upload interrompido de %s.\n", r->name);
+        return;
+    }
+    // A versão anterior, de outro tipo, e o resumo dela deixam de valer
+    if (manifest && storage_path(filepath, r->name) == 0) remove(filepath);
+    if (!manifest) {
+        storage_drop_manifest(r->name);
+        storage_drop_packed(r->name);
+    }
+    storage_drop_sums(r->name);
+    const char *base = r->from + strlen(r->from);
+    while (base > r->from && base[-1] != '/' && base[-1] != '\\') base--;
+    if (sscanf(base, "up-%16llx.part", &upload_id) == 1) resumable_remove_meta((uint64_t)upload_id);
+    printf("Diário: upload interrompido de %s concluído.\n", r->name);
+}
+
+/**
+ * Prepara o diretório dos uploads em andamento
+ *
+ * Por que foi feito:
+ * - Uploads são gravados com nomes temporários fora da listagem e só
+ *   ganham o nome final quando completos
+ * - Sobras de uploads anônimos interrompidos por uma queda do servidor são
+ *   removidas na inicialização; uploads retomáveis são mantidos para o
+ *   cliente continuar, exceto os abandonados há mais de PARTS_MAX_AGE
+ */
+void prepare_parts_directory() {
+    char parts[MAX_PATH];
+    char filepath[MAX_PATH];
+    dir_iter_t it;
+    const char *name;
+    int64_t now = (int64_t)time(NULL);
+
+    if (storage_path(parts, PARTS_DIR) != 0) return;
+    if (!path_exists(parts)) make_dir(parts);
+
+    if (dir_open(&it, parts) == 0) {
+        while ((name = dir_next(&it)) != NULL) {
+            if (parts_path(filepath, name) != 0) continue;
+            if (strncmp(name, "up-", 3) == 0 && now - file_mtime(filepath) < PARTS_MAX_AGE) continue;
+            remove(filepath);
+        }
+        dir_close(&it);
+    }
+}
+
+/**
+ * Reserva um id de upload retomável para a sessão atual
+ *
+ * @return 1 se o id estava livre, 0 se outra sessão o está usando
+ */
+int resumable_claim(uint64_t upload_id) {
+    int claimed = 1;
+
+    mutex_lock(&resumable.lock);
+    for (int i = 0; i < resumable.count; i++) {
+        if (resumable.ids[i] == upload_id) claimed = 0;
+    }
+    if (claimed && resumable.count == resumable.cap) {
+        int cap = resumable.cap ? resumable.cap * 2 : 16;
+        uint64_t *grown = (uint64_t *)realloc(resumable.ids, (size_t)cap * sizeof(uint64_t));
+        if (grown == NULL) claimed = 0;
+        else {
+            resumable.ids = grown;
+            resumable.cap = cap;
+        }
+    }
+    if (claimed) resumable.ids[resumable.count++] = upload_id;
+    mutex_unlock(&resumable.lock);
+    return claimed;
+}
+
+/**
+ * Libera um id reservado com resumable_claim()
+ */
+void resumable_release(uint64_t upload_id) {
+    mutex_lock(&resumable.lock);
+    for (int i = 0; i < resumable.count; i++) {
+        if (resumable.ids[i] == upload_id) {
+            resumable.ids[i] = resumable.ids[--resumable.count];
+            break;
+        }
+    }
+    mutex_unlock(&resumable.lock);
+}
+
+/**
+ * Grava a descrição (tamanho declarado e nome) de um upload retomável
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+int resumable_write_meta(uint64_t upload_id, uint64_t size, const char *filename) {
+    char filepath[MAX_PATH];
+    FILE *meta;
+
+    if (resumable_path(filepath, upload_id, "meta") != 0 || (meta = fopen(filepath, "wb")) == NULL) return -1;
+    int failed = fprintf(meta, "%llu\n%s", (unsigned long long)size, filename) < 0;
+    if (fclose(meta) != 0) failed = 1;
+    return failed ? -1 : 0;
+}
+
+/**
+ * Registra um bloco gravado de um upload paralelo
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - Em uploads paralelos os blocos chegam fora de ordem e o tamanho do
+ *   arquivo parcial não indica o progresso; a lista de blocos concluídos
+ *   ("up-<id>.done") diz o que já pode ser pulado numa retomada
+ */
+int resumable_record_chunk(uint64_t upload_id, uint64_t start, uint64_t end, uint32_t crc) {
+    char filepath[MAX_PATH];
+    uint8_t record[CHUNK_RECORD_SIZE];
+    FILE *done;
+
+    put_u64(record, start);
+    put_u64(record + 8, end);
+    put_u32(record + 16, crc);
+    if (resumable_path(filepath, upload_id, "done") != 0) return -1;
+
+    mutex_lock(&resumable.lock);
+    done = fopen(filepath, "ab");
+    int failed = done == NULL || fwrite(record, 1, sizeof(record), done) != sizeof(record);
+    if (done != NULL && fclose(done) != 0) failed = 1;
+    mutex_unlock(&resumable.lock);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Compara dois registros de bloco pela posição inicial (para qsort)
+ */
+int compare_chunks(const void *a, const void *b) {
+    uint64_t x = ((const uint64_t *)a)[0], y = ((const uint64_t *)b)[0];
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/**
+ * Calcula até onde os blocos concluídos cobrem o arquivo sem lacunas
+ *
+ * @param prefix Recebe o tamanho do trecho inicial completo
+ * @param crc Recebe o CRC32C do trecho inicial, combinado a partir dos
+ *            CRCs dos blocos (pode ser NULL)
+ * @return 0 em caso de sucesso, 1 se o trecho foi calculado mas os blocos
+ *         se sobrepõem (CRC desconhecido), -1 se o upload não foi feito
+ *         em blocos
+ */
+int resumable_chunks_prefix(uint64_t upload_id, uint64_t *prefix, uint32_t *crc) {
+    char filepath[MAX_PATH];
+    uint8_t record[CHUNK_RECORD_SIZE];
+    uint64_t *ranges = NULL;
+    size_t count = 0, cap = 0;
+    FILE *done;
+
+    if (resumable_path(filepath, upload_id, "done") != 0) return -1;
+    mutex_lock(&resumable.lock);
+    done = fopen(filepath, "rb");
+    while (done != NULL && fread(record, 1, sizeof(record), done) == sizeof(record)) {
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            uint64_t *grown = (uint64_t *)realloc(ranges, cap * 3 * sizeof(uint64_t));
+            if (grown == NULL) break;
+            ranges = grown;
+        }
+        ranges[count * 3] = get_u64(record);
+        ranges[count * 3 + 1] = get_u64(record + 8);
+        ranges[count * 3 + 2] = get_u32(record + 16);
+        count++;
+    }
+    if (done != NULL) fclose(done);
+    mutex_unlock(&resumable.lock);
+    if (done == NULL) return -1;
+
+    // Ordena por posição e avança enquanto os blocos forem contíguos; um
+    // bloco repetido (reenviado depois de uma queda) é o mesmo trecho
+    qsort(ranges, count, 3 * sizeof(uint64_t), compare_chunks);
+    int overlap = 0;
+    uint32_t sum = 0;
+    *prefix = 0;
+    for (size_t i = 0; i < count && ranges[i * 3] <= *prefix; i++) {
+        uint64_t start = ranges[i * 3], end = ranges[i * 3 + 1];
+        if (end <= *prefix) {
+            continue;
+        } else if (start == *prefix) {
+            sum = crc32c_combine(sum, (uint32_t)ranges[i * 3 + 2], end - start);
+        } else {
+            overlap = 1;
+        }
+        *prefix = end;
+    }
+    free(ranges);
+    if (crc != NULL) *crc = sum;
+    return overlap ? 1 : 0;
+}
+
+/**
+ * Remove a descrição e a lista de blocos de um upload retomável
+ */
+void resumable_remove_meta(uint64_t upload_id) {
+    char filepath[MAX_PATH];
+    if (resumable_path(filepath, upload_id, "meta") == 0) remove(filepath);
+    if (resumable_path(filepath, upload_id, "done") == 0) remove(filepath);
+}
+
+/**
+ * Lê a descrição de um upload retomável
+ *
+ * @param filename Buffer com MAX_PATH bytes para o nome do arquivo
+ * @return 0 em caso de sucesso, -1 se o upload não existe
+ */
+int resumable_read_meta(uint64_t upload_id, uint64_t *size, char *filename) {
+    char filepath[MAX_PATH];
+    unsigned long long declared;
+    FILE *meta;
+
+    if (resumable_path(filepath, upload_id, "meta") != 0 || (meta = fopen(filepath, "rb")) == NULL) return -1;
+    int ok = fscanf(meta, "%llu\n", &declared) == 1 && fgets(filename, MAX_PATH, meta) != NULL;
+    fclose(meta);
+    if (!ok) return -1;
+    *size = (uint64_t)declared;
+    return 0;
+}
+
+/**
+ * Indica se um nome pertence aos itens internos do armazenamento
+ */
+int storage_is_internal(const char *name) {
+    return strncmp(name, STORAGE_INTERNAL, strlen(STORAGE_INTERNAL)) == 0;
+}
+
+/**
+ * Descarta do cache de leitura um arquivo que o índice viu mudar
+ *
+ * Por que foi feito:
+ * - Uploads, exclusões, trocas de nome e alterações feitas por fora
+ *   passam todas pelo índice; chamada a cada nome atualizado ou removido
+ */
+void cache_changed(void *ctx, const char *name) {
+    cache_invalidate((read_cache_t *)ctx, name);
+}
+
+/**
+ * Exibe as opções de linha de comando do servidor
+ */
+void print_usage(const char *program) {
+    printf("Uso: %s [opções]\n", program);
+    printf("  -p <porta>     Porta de escuta (padrão %d)\n", PORT);
+    printf("  -b <backlog>   Fila de conexões pendentes (padrão %d)\n", LISTEN_BACKLOG);
+    printf("  -c <conexões>  Máximo de sessões simultâneas (padrão %d)\n", MAX_CONNECTIONS);
+    printf("  -w <threads>   Threads trabalhadoras (padrão: núcleos da CPU)\n");
+    printf("  -i <threads>   Threads de E/S em disco (padrão %d)\n", DISK_THREADS);
+    printf("  -q <MB>        Memória de uploads aguardando o disco (padrão %ld)\n", DISK_BUDGET_DEFAULT >> 20);
+    printf("  -m <MB>        Memória total dos buffers de transferência (padrão %d)\n", BUFFER_MEMORY_MB);
+    printf("  -d <diretório> Diretório de armazenamento (padrão %s)\n", SERVER_STORAGE);
+    printf("  -z <modo>      Envio de downloads: sendfile, mmap ou buffer (padrão %s)\n",
+           send_mode_name(send_mode_default()));
+    printf("  -s <modo>      Armazenamento: flat, dedup (blocos por conteúdo) ou pack (pequenos em segmentos;\n"
+           "                 padrão flat)\n");
+    printf("  -P <KB>        Maior upload guardado em segmento com -s pack (padrão %d)\n", SEGMENT_OBJECT_MAX / 1024);
+    printf("  -l <arquivo>   Limites de banda por conexão, IP e globais (relido quando muda)\n");
+    printf("  -e <porta>     Endpoint HTTP de métricas em 127.0.0.1 (GET /metrics)\n");
+    printf("  -r <segundos>  Relatório periódico de métricas no console\n");
+    printf("  -k <MB>        Cache de leitura dos downloads (padrão %d, 0 desliga)\n", CACHE_MEMORY_MB);
+    printf("  -R <réplicas>  Replica as escritas em ip:porta,... (até %d)\n", REPLICA_MAX);
+    printf("  -Q <cópias>    Cópias gravadas (com a local) antes de confirmar (padrão: maioria)\n");
+}
+
+/**
+ * Lê as opções da linha de comando para a configuração global
+ *
+ * @return 0 se as opções são válidas, -1 caso contrário
+ *
+ * Por que foi feito:
+ * - Backlog, limite de conexões e tamanho do pool precisam ser ajustados
+ *   à máquina sem recompilar o servidor
+ */
+int parse_arguments(int argc, char *argv[]) {
+    config.send_mode = send_mode_default();
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(argv[i], "-h") == 0) return -1;
+        if (value == NULL) return -1;
+
+        if (strcmp(argv[i], "-p") == 0) config.port = atoi(value);
+        else if (strcmp(argv[i], "-b") == 0) config.backlog = atoi(value);
+        else if (strcmp(argv[i], "-c") == 0) config.max_connections = atoi(value);
+        else if (strcmp(argv[i], "-w") == 0) config.workers = atoi(value);
+        else if (strcmp(argv[i], "-i") == 0) config.disk_threads = atoi(value);
+        else if (strcmp(argv[i], "-q") == 0) config.disk_budget_mb = atoi(value);
+        else if (strcmp(argv[i], "-m") == 0) config.buffer_mb = atoi(value);
+        else if (strcmp(argv[i], "-d") == 0) snprintf(config.storage, sizeof(config.storage), "%s", value);
+        else if (strcmp(argv[i], "-l") == 0) snprintf(config.limits, sizeof(config.limits), "%s", value);
+        else if (strcmp(argv[i], "-e") == 0) config.metrics_port = atoi(value);
+        else if (strcmp(argv[i], "-r") == 0) config.report_seconds = atoi(value);
+        else if (strcmp(argv[i], "-k") == 0) config.cache_mb = atoi(value);
+        else if (strcmp(argv[i], "-R") == 0) config.replicas = value;
+        else if (strcmp(argv[i], "-Q") == 0) config.quorum = atoi(value);
+        else if (strcmp(argv[i], "-P") == 0) config.pack_kb = atoi(value);
+        else if (strcmp(argv[i], "-z") == 0) {
+            if (send_mode_parse(value, &config.send_mode) != 0) return -1;
+        }
+        else if (strcmp(argv[i], "-s") == 0) {
+            config.dedup = strcmp(value, "dedup") == 0;
+            config.pack = strcmp(value, "pack") == 0;
+            if (!config.dedup && !config.pack && strcmp(value, "flat") != 0) return -1;
+        }
+        else return -1;
+        i++;
+    }
+
+    if (config.workers <= 0) config.workers = cpu_count();
+    if (config.port <= 0 || config.backlog <= 0 || config.max_connections <= 0 ||
+        config.disk_threads <= 0 || config.disk_budget_mb <= 0 ||
+        config.buffer_mb <= 0 || config.metrics_port < 0 || config.report_seconds < 0 || config.cache_mb < 0 ||
+        config.quorum < 0 || config.pack_kb <= 0 || config.pack_kb > SEGMENT_OBJECT_LIMIT / 1024) return -1;
+    // Réplicas recebem arquivos inteiros: manifestos, blocos e segmentos ficam de fora
+    if (config.replicas != NULL && (config.dedup || config.pack || replica_parse(&replica_set, config.replicas, config.quorum) != 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Exibe os limites de banda em vigor
+ */
+void limits_report() {
+    static const char *scopes[RATE_SCOPES] = { "conexão", "IP", "global" };
+
+    printf("Limites de banda (KB/s, 0 = sem limite):");
+    for (int sc = 0; sc < RATE_SCOPES; sc++) {
+        printf(" %s %ld/%ld%s", scopes[sc], rate_limits.kbps[sc][RATE_DOWN], rate_limits.kbps[sc][RATE_UP],
+               sc + 1 < RATE_SCOPES ? "," : "");
+    }
+    printf(" (download/upload)\n");
+}
+
+/**
+ * Relê o arquivo de limites de banda quando ele muda
+ *
+ * @return 0 em caso de sucesso, -1 se o arquivo está ausente ou inválido
+ *
+ * Por que foi feito:
+ * - Os limites mudam com o servidor rodando: basta editar o arquivo, e as
+ *   novas taxas valem também para as conexões já abertas
+ * - Tamanho, data e inode identificam uma nova versão, inclusive as
+ *   gravadas por troca de nome; uma versão inválida mantém os limites
+ *   anteriores e só é lida de novo quando mudar outra vez
+ */
+int limits_reload() {
+    static uint64_t loaded_size, loaded_inode;
+    static int64_t loaded_mtime;
+    static int loaded;
+    uint64_t size = 0, inode = 0;
+    int64_t mtime = -1;
+    long kbps[RATE_SCOPES][2];
+
+    if (config.limits[0] == '\0') return 0;
+    file_stat(config.limits, &size, &mtime, &inode);
+    if (loaded && mtime == loaded_mtime && size == loaded_size && inode == loaded_inode) return 0;
+    loaded_size = size;
+    loaded_mtime = mtime;
+    loaded_inode = inode;
+
+    int result = rate_limits_load(config.limits, kbps);
+    if (result < 0) {
+        printf("Arquivo de limites não encontrado: %s\n", config.limits);
+        return -1;
+    }
+    if (result > 0) {
+        printf("Linha %d inválida em %s; limites mantidos.\n", result, config.limits);
+        return -1;
+    }
+    if (rate_limits_apply(&rate_limits, kbps) || !loaded) limits_report();
+    loaded = 1;
+    return 0;
+}
+
+/*--------------------------------------------------------------
+ * MÉTRICAS
+ *------------------------------------------------------------*/
+
+/**
+ * Monta o texto de uma consulta ao endpoint de métricas
+ *
+ * Por que foi feito:
+ * - Contadores e histogramas vêm das áreas das threads; filas, memória e
+ *   conexões são lidos na hora das estruturas que já os mantêm
+ */
+void metrics_render(metrics_text_t *t) {
+    static const metric_def_t gauge_defs[] = {
+        { "bigfs_sessions", NULL, "Sessões abertas", 1 },
+        { "bigfs_work_queue_sessions", NULL, "Sessões esperando uma thread trabalhadora", 1 },
+        { "bigfs_bandwidth_wait_sessions", NULL, "Sessões paradas pelo limite de banda", 1 },
+        { "bigfs_disk_queue_jobs", NULL, "Tarefas na fila de disco", 1 },
+        { "bigfs_disk_queue_peak_jobs", NULL, "Maior fila de disco já vista", 1 },
+        { "bigfs_disk_pending_bytes", NULL, "Bytes em buffers cheios esperando escrita", 1 },
+        { "bigfs_buffer_bytes", "state=\"in_use\"", "Memória do pool de buffers", 1 },
+        { "bigfs_buffer_bytes", "state=\"held\"", "", 1 },
+        { "bigfs_buffer_bytes", "state=\"high_water\"", "", 1 },
+        { "bigfs_cache_bytes", NULL, "Bytes guardados no cache de leitura", 1 },
+        { "bigfs_cache_blocks", "state=\"data\"", "Blocos do cache de leitura (fantasmas: só a chave)", 1 },
+        { "bigfs_cache_blocks", "state=\"ghost\"", "", 1 },
+        { "bigfs_segment_objects", NULL, "Arquivos pequenos guardados em segmentos", 1 },
+        { "bigfs_segment_bytes", "state=\"live\"", "Bytes dos segmentos (mortos: sobrescritos ou excluídos)", 1 },
+        { "bigfs_segment_bytes", "state=\"dead\"", "", 1 },
+    };
+    static const metric_def_t disk_defs[] = {
+        { "bigfs_disk_busy_seconds_total", NULL, "Tempo das threads de disco executando tarefas", 1e9 },
+        { "bigfs_disk_jobs_total", NULL, "Tarefas de disco executadas", 1 },
+        { "bigfs_disk_throttled_total", NULL, "Uploads segurados pelo orçamento de disco", 1 },
+        { "bigfs_buffer_allocations_total", "source=\"pool\"", "Pedidos ao pool de buffers", 1 },
+        { "bigfs_buffer_allocations_total", "source=\"system\"", "", 1 },
+        { "bigfs_buffer_allocations_total", "source=\"refused\"", "", 1 },
+        { "bigfs_cache_requests_total", "result=\"hit\"", "Blocos pedidos ao cache de leitura", 1 },
+        { "bigfs_cache_requests_total", "result=\"miss\"", "", 1 },
+        { "bigfs_cache_inserts_total", NULL, "Blocos guardados no cache de leitura", 1 },
+        { "bigfs_cache_evictions_total", NULL, "Blocos tirados do cache para abrir espaço", 1 },
+        { "bigfs_cache_invalidations_total", NULL, "Arquivos descartados do cache por mudança", 1 },
+        { "bigfs_journal_records_total", NULL, "Registros gravados no diário de operações", 1 },
+        { "bigfs_journal_syncs_total", NULL, "Sincronizações do diário (cada uma confirma um grupo)", 1 },
+        { "bigfs_journal_checkpoints_total", NULL, "Pontos de controle do índice gravados", 1 },
+        { "bigfs_segment_syncs_total", NULL, "Sincronizações dos segmentos (cada uma confirma um grupo)", 1 },
+        { "bigfs_segment_compactions_total", NULL, "Segmentos compactados", 1 },
+        { "bigfs_segment_reclaimed_bytes_total", NULL, "Bytes devolvidos ao disco pela compactação", 1 },
+        { "bigfs_chunk_gc_runs_total", NULL, "Coletas de blocos sem uso", 1 },
+        { "bigfs_chunk_gc_removed_total", NULL, "Blocos sem uso removidos", 1 },
+        { "bigfs_chunk_gc_reclaimed_bytes_total", NULL, "Bytes devolvidos ao disco pela coleta de blocos", 1 },
+    };
+    metrics_shard_t *snap = (metrics_shard_t *)malloc(sizeof(metrics_shard_t));
+    bufpool_stats_t mem;
+    cache_stats_t cache;
+    segment_stats_t seg;
+    uint64_t records, syncs, checkpoints;
+    uint64_t gc_runs = 0, gc_removed = 0, gc_reclaimed = 0;
+
+    if (snap == NULL) return;
+    metrics_snapshot(snap);
+    journal_stats(&journal, &records, &syncs, &checkpoints);
+    bufpool_stats(&mem);
+    memset(&cache, 0, sizeof(cache));
+    if (config.cache_mb > 0) cache_stats(&read_cache, &cache);
+    memset(&seg, 0, sizeof(seg));
+    if (config.pack) segstore_stats(&segments, &seg);
+    if (config.dedup) chunk_gc_stats(&chunk_gc, &gc_runs, &gc_removed, &gc_reclaimed);
+    mutex_lock(&disk_pool.lock);
+    double depth = (double)disk_pool.depth, peak = (double)disk_pool.peak;
+    double busy = (double)disk_pool.busy_ns, jobs = (double)disk_pool.completed;
+    mutex_unlock(&disk_pool.lock);
+
+    double gauges[] = { (double)active_sessions, (double)work_queue.length, (double)pacer.count,
+                        depth, peak, (double)disk_pool.pending,
+                        (double)mem.in_use, (double)mem.held, (double)mem.high_water,
+                        (double)cache.bytes, (double)cache.blocks, (double)cache.ghosts,
+                        (double)seg.objects, (double)seg.live, (double)seg.dead };
+    double disk[] = { busy, jobs, (double)disk_pool.throttled,
+                      (double)(mem.allocations - mem.system_allocations), (double)mem.system_allocations,
+                      (double)mem.failures, (double)cache.hits, (double)cache.misses, (double)cache.inserts,
+                      (double)cache.evictions, (double)cache.invalidations,
+                      (double)records, (double)syncs, (double)checkpoints,
+                      (double)seg.syncs, (double)seg.compactions, (double)seg.reclaimed,
+                      (double)gc_runs, (double)gc_removed, (double)gc_reclaimed };
+
+    metrics_render_counters(t, counter_defs, M_COUNTERS, snap);
+    metrics_render_values(t, disk_defs, (int)(sizeof(disk) / sizeof(disk[0])), disk, "counter");
+    metrics_render_values(t, gauge_defs, (int)(sizeof(gauges) / sizeof(gauges[0])), gauges, "gauge");
+    metrics_render_histograms(t, histogram_defs, H_COUNT, snap);
+    free(snap);
+}
+
+/**
+ * Exibe no console o resumo das métricas desde o último relatório
+ *
+ * Por que foi feito:
+ * - Sem um coletor, a vazão, as latências e o tempo ocupado de rede e
+ *   disco ainda aparecem a cada poucos segundos no próprio log
+ */
+void metrics_report(double seconds) {
+    static metrics_shard_t *last;
+    static uint64_t last_disk_ns;
+    static cache_stats_t last_cache;
+    metrics_shard_t *snap = (metrics_shard_t *)malloc(sizeof(metrics_shard_t));
+    const double mb = 1024.0 * 1024.0;
+
+    if (snap == NULL) return;
+    if (last == NULL && (last = (metrics_shard_t *)calloc(1, sizeof(metrics_shard_t))) == NULL) {
+        free(snap);
+        return;
+    }
+    metrics_snapshot(snap);
+    mutex_lock(&disk_pool.lock);
+    uint64_t disk_ns = disk_pool.busy_ns;
+    long depth = disk_pool.depth;
+    mutex_unlock(&disk_pool.lock);
+
+    // Diferença desde o último relatório, no próprio snap
+    uint64_t errors = 0;
+    for (int i = 0; i < M_COUNTERS; i++) {
+        snap->counters[i] -= last->counters[i];
+        last->counters[i] += snap->counters[i];
+        if (i >= M_ERR_REPLY) errors += snap->counters[i];
+    }
+    for (int h = 0; h < H_COUNT; h++) {
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            snap->hist[h][b] -= last->hist[h][b];
+            last->hist[h][b] += snap->hist[h][b];
+        }
+    }
+
+    printf("[métricas %.0f s] %ld sessões | rede %.1f MB/s entrada, %.1f MB/s saída | arquivos %.1f MB/s upload, "
+           "%.1f MB/s download\n", seconds, active_sessions,
+           snap->counters[M_NET_IN] / mb / seconds, snap->counters[M_NET_OUT] / mb / seconds,
+           snap->counters[M_FILE_UP] / mb / seconds, snap->counters[M_FILE_DOWN] / mb / seconds);
+    for (int h = 0; h < H_QUEUE_WAIT; h++) {
+        uint64_t count = metrics_count(snap, h);
+        if (count == 0) continue;
+        printf("  %-13s %6llu pedidos  p50 %.3f ms  p99 %.3f ms  p99.9 %.3f ms\n",
+               h == H_REQUEST_OTHER ? "OTHER" : opcode_name((uint8_t)h), (unsigned long long)count,
+               metrics_quantile(snap, h, 0.5) / 1e3, metrics_quantile(snap, h, 0.99) / 1e3,
+               metrics_quantile(snap, h, 0.999) / 1e3);
+    }
+    printf("  ocupado: trabalhadoras %.0f%%, disco %.0f%% (fila %ld) | fila de trabalho p99 %.1f µs | "
+           "pausas: disco %llu, banda %llu, vez %llu | erros %llu\n",
+           snap->counters[M_WORKER_NS] / 1e7 / seconds / config.workers,
+           (double)(disk_ns - last_disk_ns) / 1e7 / seconds / config.disk_threads, depth,
+           metrics_quantile(snap, H_QUEUE_WAIT, 0.99) / 1e3,
+           (unsigned long long)snap->counters[M_PAUSE_DISK], (unsigned long long)snap->counters[M_PAUSE_BANDWIDTH],
+           (unsigned long long)snap->counters[M_PAUSE_QUANTUM], (unsigned long long)errors);
+    if (config.cache_mb > 0) {
+        cache_stats_t cache;
+        cache_stats(&read_cache, &cache);
+        uint64_t hits = cache.hits - last_cache.hits, misses = cache.misses - last_cache.misses;
+        printf("  cache: %.1f/%.0f MB, %ld blocos | acertos %llu, falhas %llu (%.0f%%) | saídas %llu, "
+               "invalidações %llu\n", cache.bytes / mb, cache.budget / mb, cache.blocks,
+               (unsigned long long)hits, (unsigned long long)misses,
+               hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0,
+               (unsigned long long)(cache.evictions - last_cache.evictions),
+               (unsigned long long)(cache.invalidations - last_cache.invalidations));
+        last_cache = cache;
+    }
+    last_disk_ns = disk_ns;
+    free(snap);
+}
+
+/*--------------------------------------------------------------
+ * FILA DE TRABALHO
+ *------------------------------------------------------------*/
+
+/**
+ * Entrega uma sessão com eventos pendentes às threads trabalhadoras
+ */
+void queue_push(session_t *s) {
+    s->queued_ns = monotonic_ns();
+    mutex_lock(&work_queue.lock);
+    s->next = NULL;
+    if (work_queue.tail) work_queue.tail->next = s;
+    else work_queue.head = s;
+    work_queue.tail = s;
+    work_queue.length++;
+    cond_signal(&work_queue.ready);
+    mutex_unlock(&work_queue.lock);
+}
+
+/**
+ * Retira a próxima sessão da fila, bloqueando enquanto estiver vazia
+ */
+session_t *queue_pop() {
+    mutex_lock(&work_queue.lock);
+    while (work_queue.head == NULL) {
+        cond_wait(&work_queue.ready, &work_queue.lock);
+    }
+    session_t *s = work_queue.head;
+    work_queue.head = s->next;
+    if (work_queue.head == NULL) work_queue.tail = NULL;
+    work_queue.length--;
+    mutex_unlock(&work_queue.lock);
+    metrics_record(H_QUEUE_WAIT, monotonic_ns() - s->queued_ns);
+    return s;
+}
+
+/*--------------------------------------------------------------
+ * SESSÕES
+ *------------------------------------------------------------*/
+
+/**
+ * Devolve à fila uma sessão que esperava o estágio de disco
+ *
+ * Por que foi feito:
+ * - Chamado pela thread de disco; a sessão volta a ser processada por uma
+ *   thread trabalhadora como se tivesse recebido um evento do poller
+ */
+void session_wake(void *owner) {
+    queue_push((session_t *)owner);
+}
+
+/**
+ * Registra a espera pela operação de disco que parou a sessão
+ *
+ * @return 1 se a sessão será acordada por session_wake(), 0 se a
+ *         operação já terminou e a sessão deve voltar para a fila
+ */
+int session_park(session_t *s) {
+    if (s->replicating) return replica_write_park(s->replica_write);
+    if (s->downloading && s->tx_buffered) return reader_park(&s->reader);
+    return disk_call_park(&s->commit) || writer_park(&s->writer);
+}
+
+/**
+ * Cria o estado de uma nova conexão
+ */
+int download_fill(void *owner, uint8_t *buf, size_t len);
+
+session_t *session_create(SOCKET sock, struct sockaddr_in *addr) {
+    session_t *s = (session_t *)calloc(1, sizeof(session_t));
+    if (s == NULL) return NULL;
+    s->in = (uint8_t *)malloc(SESSION_INPUT_SIZE);
+    if (s->in == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->rate_ip = rate_ip_acquire(&rate_ips, &rate_limits, addr->sin_addr.s_addr);
+    if (s->rate_ip == NULL) {
+        free(s->in);
+        free(s);
+        return NULL;
+    }
+    for (int d = RATE_DOWN; d <= RATE_UP; d++) {
+        rate_bucket_init(&s->rate_conn[d], &rate_limits.kbps[RATE_CONNECTION][d]);
+        s->rate_chain[d][RATE_CONNECTION] = &s->rate_conn[d];
+        s->rate_chain[d][RATE_IP] = &s->rate_ip->bucket[d];
+        s->rate_chain[d][RATE_GLOBAL] = &rate_global[d];
+    }
+    s->sock = sock;
+    s->state = SESSION_ACTIVE;
+    s->upload_fd = -1;
+    s->mem.limit = SESSION_BUFFER_LIMIT;
+    writer_init(&s->writer, &disk_pool, &s->mem, session_wake, s);
+    disk_call_init(&s->commit, &disk_pool, session_wake, s);
+    reader_init(&s->reader, &disk_pool, &s->mem, download_fill, session_wake, s);
+    snprintf(s->peer, sizeof(s->peer), "%s:%d", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+    return s;
+}
+
+/**
+ * Encerra a conexão e libera todos os recursos da sessão
+ */
+void upload_discard(session_t *s, int keep);
+void upload_release(session_t *s);
+void download_cache_release(session_t *s);
+void replicate_release(session_t *s);
+
+void session_close(session_t *s) {
+    poller_del(&poller, s->sock);
+    closesocket(s->sock);
+    disk_call_wait(&s->commit);
+    reader_abort(&s->reader);
+    if (s->upload_fd >= 0) {
+        // Upload interrompido: o arquivo temporário nunca chega à listagem;
+        // o de um upload retomável fica para o cliente continuar
+        upload_discard(s, s->upload_resumable);
+        printf("Upload interrompido: %s\n", s->upload_name);
+    }
+    upload_release(s);
+    replicate_release(s);
+    writer_destroy(&s->writer);
+    disk_call_destroy(&s->commit);
+    reader_destroy(&s->reader);
+    if (s->downloading) sender_close(&s->tx);
+    download_cache_release(s);
+    manifest_free(&s->tx_manifest);
+    if (s->tree_packing) remove(s->tree_temp);
+    free(s->tree_names);
+    bufpool_free(s->rx_packed, FRAME_DATA_CHUNK, &s->mem);
+    bufpool_free(s->rx_plain, FRAME_DATA_CHUNK, &s->mem);
+    bufpool_free(s->tx_plain, FRAME_DATA_CHUNK, &s->mem);
+    bufpool_free(s->tx_packed, FRAME_DATA_CHUNK, &s->mem);
+    rate_bucket_destroy(&s->rate_conn[RATE_DOWN]);
+    rate_bucket_destroy(&s->rate_conn[RATE_UP]);
+    rate_ip_release(&rate_ips, s->rate_ip);
+    free(s->out);
+    free(s->in);
+    printf("Cliente desconectado: %s\n", s->peer);
+    free(s);
+    atomic_add_long(&active_sessions, -1);
+}
+
+/**
+ * Acrescenta bytes à resposta pendente da sessão
+ *
+ * Por que foi feito:
+ * - Com sockets não bloqueantes o send() pode aceitar apenas parte da
+ *   resposta; o restante fica guardado até o socket aceitar mais dados
+ */
+int session_queue(session_t *s, const void *data, size_t len) {
+    if (s->out_len + len > s->out_cap) {
+        size_t cap = s->out_cap ? s->out_cap : BUFFER_SIZE;
+        while (cap < s->out_len + len) cap *= 2;
+        char *grown = (char *)realloc(s->out, cap);
+        if (grown == NULL) return -1;
+        s->out = grown;
+        s->out_cap = cap;
+    }
+    memcpy(s->out + s->out_len, data, len);
+    s->out_len += len;
+    return 0;
+}
+
+/**
+ * Enfileira um quadro completo (cabeçalho + payload) na resposta
+ */
+int session_send_frame(session_t *s, uint8_t opcode, uint16_t flags, uint32_t request_id,
+                       const void *payload, size_t len) {
+    uint8_t header[FRAME_HEADER_SIZE];
+    frame_encode(header, opcode, flags, request_id, len);
+    if (session_queue(s, header, sizeof(header)) != 0) return -1;
+    return len > 0 ? session_queue(s, payload, len) : 0;
+}
+
+/**
+ * Responde com sucesso e uma mensagem de texto
+ */
+int session_reply(session_t *s, uint32_t request_id, const char *message) {
+    return session_send_frame(s, OP_OK, 0, request_id, message, strlen(message));
+}
+
+/**
+ * Responde com um código de erro e uma mensagem de texto
+ */
+int session_error(session_t *s, uint32_t request_id, uint16_t code, const char *message) {
+    uint8_t payload[PROTO_MAX_NAME];
+    if (code >= ERR_NOT_FOUND && code <= ERR_CHECKSUM) metrics_add(M_ERR_REPLY + code - 1, 1);
+    size_t len = proto_error_payload(payload, sizeof(payload), code, message);
+    return session_send_frame(s, OP_ERROR, 0, request_id, payload, len);
+}
+
+/**
+ * Indica se a sessão ainda tem dados a enviar
+ */
+int session_has_output(session_t *s) {
+    return s->out_sent < s->out_len || s->downloading;
+}
+
+/**
+ * Indica se novos pedidos devem esperar a resposta atual ser enviada
+ *
+ * Por que foi feito:
+ * - Pedidos enfileirados (pipelining) são respondidos em ordem; um download
+ *   ativo ou uma resposta grande acumulada segura o processamento dos
+ *   próximos quadros em vez de crescer o buffer sem limite
+ */
+int session_output_blocked(session_t *s) {
+    return s->downloading || s->out_len - s->out_sent >= SESSION_OUTPUT_HIGH;
+}
+
+/**
+ * Quantos bytes de arquivo a sessão pode transferir agora
+ *
+ * @param dir RATE_DOWN (envio) ou RATE_UP (recebimento)
+ * @return Bytes liberados; 0 se a sessão deve parar (cota da vez esgotada:
+ *         yielded; limite de banda: throttle_until)
+ *
+ * Por que foi feito:
+ * - Deficit round-robin: cada vez na fila rende até DRR_QUANTUM bytes, e
+ *   uma transferência longa volta para o fim da fila em vez de segurar a
+ *   thread; um LIST ou DELETE espera no máximo uma cota de cada sessão
+ * - Os limites valem só para os bytes dos arquivos; respostas de controle
+ *   nunca esperam pela banda
+ */
+int64_t session_allowance(session_t *s, int dir) {
+    uint64_t wait = 0;
+
+    if (s->deficit <= 0) {
+        s->yielded = 1;
+        return 0;
+    }
+    uint64_t now = monotonic_ns();
+    int64_t allow = rate_allow(s->rate_chain[dir], RATE_SCOPES, now, &wait);
+    if (allow == 0) {
+        s->throttle_until = now + wait;
+        return 0;
+    }
+    return allow < s->deficit ? allow : s->deficit;
+}
+
+/**
+ * Desconta bytes transferidos da cota da vez e dos limites de banda
+ */
+void session_account(session_t *s, int dir, int64_t bytes) {
+    s->deficit -= (long)bytes;
+    rate_charge(s->rate_chain[dir], RATE_SCOPES, bytes);
+}
+
+/**
+ * Registra a duração do pedido em andamento, se ele já terminou
+ *
+ * Por que foi feito:
+ * - Um pedido termina quando a resposta final está na fila de envio: para
+ *   LIST logo após handle_request(); para uploads e DELETE depois da
+ *   conclusão no disco; para downloads quando o último quadro saiu
+ */
+void session_request_done(session_t *s) {
+    if (s->req_start == 0 || s->uploading || s->downloading || s->upload_committing || s->tree_packing ||
+        s->store_op != 0 || s->replicating) return;
+    metrics_record(s->req_op, (monotonic_ns() - s->req_start) / 1000);
+    s->req_start = 0;
+}
+
+/*--------------------------------------------------------------
+ * REPLICAÇÃO
+ *------------------------------------------------------------*/
+
+/**
+ * Lista os arquivos locais para a recuperação de uma réplica
+ *
+ * @param out Recebe os arquivos, em ordem de nome
+ * @return Quantidade de arquivos
+ *
+ * Por que foi feito:
+ * - Os nomes são copiados com o índice bloqueado; os resumos que o
+ *   índice ainda não tem são lidos do disco depois, sem o lock
+ */
+size_t replica_local_files(replica_file_t **out) {
+    index_table_t *t = &storage_index.table;
+    size_t count = 0;
+
+    mutex_lock(&storage_index.lock);
+    replica_file_t *files = (replica_file_t *)malloc((t->count + 1) * sizeof(replica_file_t));
+    for (size_t i = 0; files != NULL && i < t->count; i++) {
+        const index_entry_t *e = &t->entries[i];
+        size_t len = strlen(e->name) + 1;
+        replica_file_t *f = &files[count];
+        if (e->source == SOURCE_MANIFEST || (f->name = (char *)malloc(len)) == NULL) continue;
+        memcpy(f->name, e->name, len);
+        f->size = e->size;
+        f->mtime = e->mtime;
+        f->digest_len = e->digest_len;
+        memcpy(f->digest, e->digest, e->digest_len);
+        count++;
+    }
+    mutex_unlock(&storage_index.lock);
+
+    for (size_t i = 0; i < count; i++) {
+        index_entry_t found;
+        if (files[i].digest_len != 0 || index_lookup(&storage_index, files[i].name, &found) != 0) continue;
+        sums_attach(files[i].name, &found);
+        files[i].digest_len = found.digest_len;
+        memcpy(files[i].digest, found.digest, found.digest_len);
+    }
+    if (files != NULL) qsort(files, count, sizeof(replica_file_t), replica_file_compare);
+    *out = files;
+    return count;
+}
+
+/**
+ * Indica se um arquivo existe agora no armazenamento
+ */
+int replica_local_present(const char *name) {
+    index_entry_t found;
+    return index_lookup(&storage_index, name, &found) == 0;
+}
+
+/**
+ * Leva um arquivo gravado (deleted = 0) ou excluído às réplicas
+ *
+ * Por que foi feito:
+ * - A escrita da sessão é criada no primeiro arquivo; um lote de TREE_PUT
+ *   leva todos os arquivos na mesma escrita e o quorum vale para o lote
+ * - Sem memória para acompanhar a escrita, as réplicas ficam atrasadas e
+ *   a recuperação leva o arquivo depois
+ */
+void replicate_name(session_t *s, const char *name, int deleted) {
+    if (replica_set.count == 0) return;
+    if (s->replica_write == NULL) s->replica_write = replica_write_new(&replica_set, session_wake, s);
+    if (s->replica_write != NULL) {
+        replica_write_add(s->replica_write, name, deleted);
+        return;
+    }
+    for (int i = 0; i < replica_set.count; i++) replica_mark_behind(&replica_set, i);
+}
+
+/**
+ * Leva às réplicas um arquivo recebido em blocos
+ */
+void replicate_commit(session_t *s, const char *name, uint64_t upload_id) {
+    if (replica_set.count == 0) return;
+    if (s->replica_write == NULL) s->replica_write = replica_write_new(&replica_set, session_wake, s);
+    if (s->replica_write != NULL) {
+        replica_write_commit(s->replica_write, name, upload_id);
+        return;
+    }
+    for (int i = 0; i < replica_set.count; i++) replica_mark_behind(&replica_set, i);
+}
+
+/**
+ * Começa a levar às réplicas o upload que está chegando
+ *
+ * Por que foi feito:
+ * - Um bloco de upload paralelo segue como bloco do mesmo upload na
+ *   réplica; um upload comum só segue se começa do primeiro byte (um retomável
+ *   interrompido é abandonado na réplica e segue inteiro depois)
+ * - Arquivos pequenos chegam antes que a diferença apareça e seguem
+ *   depois da gravação
+ */
+void replicate_stream(session_t *s) {
+    if (replica_set.count == 0 || s->upload_refused || s->upload_kind != UPLOAD_FILE ||
+        s->upload_end - s->upload_start < REPLICA_STREAM_MIN || (!s->upload_chunked && s->upload_start != 0)) return;
+    if (s->replica_write == NULL) s->replica_write = replica_write_new(&replica_set, session_wake, s);
+    if (s->replica_write == NULL) return;
+    if (s->upload_chunked) {
+        replica_write_stream(s->replica_write, s->upload_name, s->upload_size, s->upload_id, s->upload_start,
+                             s->upload_end - s->upload_start);
+    } else {
+        replica_write_stream(s->replica_write, s->upload_name, s->upload_size, 0, 0, 0);
+    }
+}
+
+/**
+ * Responde com sucesso depois que as réplicas atingirem o quorum
+ *
+ * Por que foi feito:
+ * - A sessão para como se esperasse o disco e é acordada pela thread da
+ *   conexão com a réplica que completou o quorum; sem réplicas, a
+ *   resposta sai na hora
+ */
+void replicate_reply(session_t *s, uint32_t request_id, const char *message) {
+    if (s->replica_write == NULL) {
+        session_reply(s, request_id, message);
+        return;
+    }
+    s->replicating = 1;
+    s->replica_request = request_id;
+    snprintf(s->replica_message, sizeof(s->replica_message), "%s", message);
+    replica_write_start(s->replica_write);
+}
+
+/**
+ * Solta a escrita da sessão; os pedidos às réplicas seguem sem ela
+ */
+void replicate_release(session_t *s) {
+    replica_write_release(s->replica_write);
+    s->replica_write = NULL;
+}
+
+/**
+ * Envia a resposta guardada por replicate_reply() quando o quorum é decidido
+ *
+ * @return 1 se o pedido foi respondido, 0 se ainda espera as réplicas
+ */
+int replicate_finish(session_t *s) {
+    int decided = replica_write_result(s->replica_write);
+    if (decided == 0) return 0;
+
+    replicate_release(s);
+    s->replicating = 0;
+    if (decided > 0) session_reply(s, s->replica_request, s->replica_message);
+    else session_error(s, s->replica_request, ERR_IO, "Cópias insuficientes: quorum de réplicas não atingido.");
+    return 1;
+}
+
+/**
+ * Abre um bloco de um arquivo do armazenamento por conteúdo para envio
+ *
+ * @param index Bloco no manifesto
+ * @param within Primeiro byte do bloco a enviar
+ * @return 0 em caso de sucesso, -1 se o bloco não pôde ser aberto
+ */
+int download_open_chunk(session_t *s, uint32_t index, uint64_t within) {
+    char filepath[MAX_PATH];
+    const chunk_ref_t *ref = &s->tx_manifest.refs[index];
+    int fd;
+
+    if (chunk_path(filepath, MAX_PATH, config.storage, ref->hash) != 0 ||
+        (fd = file_open_read(filepath)) < 0) return -1;
+    sender_open(&s->tx, fd, config.send_mode, within);
+    s->tx_chunk = index + 1;
+    s->tx_chunk_left = ref->length - within;
+    return 0;
+}
+
+/**
+ * Localiza os próximos bytes de um download servido pelo cache
+ *
+ * @param data Recebe o início dos bytes na posição atual do download
+ * @return Bytes disponíveis no bloco até o seu fim
+ *
+ * Por que foi feito:
+ * - Os blocos ficam fixados até o fim do envio, então os quadros saem
+ *   direto da memória do cache, sem cópia nem lock
+ */
+size_t download_hit_data(session_t *s, const uint8_t **data) {
+    cache_block_t *b = s->tx_blocks[s->tx.offset / CACHE_BLOCK - s->tx_block_first];
+    size_t within = (size_t)(s->tx.offset % CACHE_BLOCK);
+
+    *data = b->data + within;
+    return b->len - within;
+}
+
+/**
+ * Libera os blocos fixados de um download (concluído ou interrompido)
+ */
+void download_cache_release(session_t *s) {
+    if (s->tx_blocks != NULL) {
+        cache_unpin(&read_cache, s->tx_blocks, s->tx_block_count);
+        free(s->tx_blocks);
+        s->tx_blocks = NULL;
+        s->tx_block_count = 0;
+    }
+    s->tx_cache = TX_CACHE_OFF;
+}
+
+/**
+ * Lê os próximos bytes do download (arquivo comum ou blocos do manifesto)
+ *
+ * @return 0 em caso de sucesso, -1 se o arquivo encolheu ou um bloco sumiu
+ */
+int download_read(session_t *s, uint8_t *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        size_t want = len - done;
+        if (s->tx_manifest.refs != NULL) {
+            if (s->tx_chunk_left == 0) {
+                sender_close(&s->tx);
+                if (s->tx_chunk >= s->tx_manifest.count || download_open_chunk(s, s->tx_chunk, 0) != 0) return -1;
+            }
+            if (want > s->tx_chunk_left) want = (size_t)s->tx_chunk_left;
+        }
+        int64_t got = file_pread(s->tx.fd, buf + done, want, s->tx.base + s->tx.offset);
+        if (got <= 0) return -1;
+        s->tx.offset += (uint64_t)got;
+        done += (size_t)got;
+        if (s->tx_manifest.refs != NULL) s->tx_chunk_left -= (uint64_t)got;
+    }
+    return 0;
+}
+
+/**
+ * Lê o próximo bloco de um download para a leitura antecipada
+ *
+ * Por que foi feito:
+ * - Executada pela thread de disco; enquanto a leitura está em andamento
+ *   a thread trabalhadora não toca no file_sender nem no manifesto
+ * - Em TX_CACHE_FILL os blocos lidos ficam no cache para os próximos
+ *   pedidos do mesmo arquivo
+ */
+int download_fill(void *owner, uint8_t *buf, size_t len) {
+    session_t *s = (session_t *)owner;
+    uint64_t offset = s->tx.offset;
+    uint32_t index = (uint32_t)(offset / CACHE_BLOCK);
+
+    if (s->tx_cache != TX_CACHE_FILL) return download_read(s, buf, len);
+
+    // Bloco guardado por outro envio depois do início deste: dispensa o disco
+    if (cache_copy(&read_cache, s->tx_name, &s->tx_version, index, buf, len) == 0) {
+        s->tx.offset += len;
+        return 0;
+    }
+    if (download_read(s, buf, len) != 0) return -1;
+    // Os buffers começam alinhados aos blocos; só blocos inteiros (ou o final do arquivo) entram
+    if (len == CACHE_BLOCK || offset + len == s->tx_version.size) {
+        cache_insert(&read_cache, s->tx_name, &s->tx_version, index, buf, len);
+    }
+    return 0;
+}
+
+/**
+ * Enfileira o próximo quadro DATA de um download que passa pela memória
+ *
+ * @return 1 se o quadro foi enfileirado, 0 se a leitura do disco ainda
+ *         não chegou, -1 em caso de erro
+ *
+ * Por que foi feito:
+ * - Quadros comprimidos precisam passar pela memória, então saem pela
+ *   resposta pendente em vez do sendfile; blocos que não diminuem vão
+ *   crus, sem a flag
+ * - Os bytes chegam já lidos pelas threads de disco, um quadro por
+ *   buffer; a thread trabalhadora só comprime e envia
+ * - Um download servido pelo cache nunca espera: os blocos já estão na
+ *   memória
+ */
+int download_pack(session_t *s) {
+    const uint8_t *data = NULL;
+    size_t len = 0;
+
+    if (s->tx_remaining > 0 && s->tx_cache == TX_CACHE_HIT) {
+        // Um quadro por bloco do cache (o primeiro pode começar no meio)
+        len = download_hit_data(s, &data);
+        if (len > s->tx_remaining) len = (size_t)s->tx_remaining;
+        s->tx.offset += len;
+    } else if (s->tx_remaining > 0) {
+        int ready = reader_next(&s->reader, &data, &len);
+        if (ready <= 0) return ready;
+    }
+    s->tx_remaining -= len;
+    s->tx_final = (s->tx_remaining == 0);
+    metrics_add(M_FILE_DOWN, len);
+
+    uint16_t flags = s->tx_final ? FLAG_END : 0;
+    size_t packed = 0;
+    if (s->tx_codec != CODEC_NONE && len > 4) packed = codec_compress(s->tx_codec, data, len, s->tx_packed + 4, len - 4);
+    int result;
+    if (packed == 0) {
+        result = session_send_frame(s, OP_DATA, flags, s->tx_request, data, len);
+    } else {
+        put_u32(s->tx_packed, (uint32_t)len);
+        result = session_send_frame(s, OP_DATA, flags | FLAG_COMPRESSED | FLAG_CODEC(s->tx_codec), s->tx_request,
+                                    s->tx_packed, packed + 4);
+    }
+    if (len > 0 && s->tx_cache != TX_CACHE_HIT) reader_consume(&s->reader);
+    return result == 0 ? 1 : -1;
+}
+
+/**
+ * Envia a resposta pendente e o download em andamento
+ *
+ * @return 0 se a sessão continua ativa, -1 se a conexão falhou
+ *
+ * Por que foi feito:
+ * - Envia até o socket recusar mais dados (ou o orçamento acabar) e devolve
+ *   a thread para atender outras sessões em vez de bloquear no send()
+ * - O arquivo é enquadrado em blocos DATA de tamanho conhecido, então o
+ *   cliente sabe exatamente onde o arquivo termina
+ * - O conteúdo dos quadros sai pelo file_sender (sendfile/mmap), sem passar
+ *   por buffers do servidor, exceto quando o cliente pediu compressão ou o
+ *   modo é buffer; nesses casos as threads de disco leem à frente e a
+ *   sessão para (disk_wait) se a leitura ainda não chegou
+ * - Os bytes do arquivo passam por session_allowance(): a sessão cede a
+ *   vez ao fim da cota e para quando um limite de banda se esgota
+ */
+int session_flush(session_t *s) {
+    int budget = SESSION_IO_BUDGET;
+
+    while (budget-- > 0) {
+        if (s->out_sent < s->out_len) {
+            // Só o cabeçalho de um quadro cujo conteúdo ainda sai pelo
+            // file_sender espera o próximo segmento; o resto (respostas,
+            // quadros montados na memória, o fim do download) sai na hora
+            int flags = s->downloading && !s->tx_buffered && s->tx_frame_left > 0 ? MSG_MORE : 0;
+            int sent = send(s->sock, s->out + s->out_sent, (int)(s->out_len - s->out_sent), flags);
+            if (sent == SOCKET_ERROR) {
+                if (net_would_block(net_error())) return 0;
+                printf("Erro ao enviar para %s.\n", s->peer);
+                metrics_add(M_ERR_NETWORK, 1);
+                return -1;
+            }
+            s->out_sent += sent;
+            metrics_add(M_NET_OUT, (uint64_t)sent);
+            continue;
+        }
+        s->out_len = s->out_sent = 0;
+
+        if (!s->downloading) return 0;
+
+        if (s->tx_frame_left == 0) {
+            if (s->tx_final) {
+                // Último quadro enviado: download concluído
+                reader_abort(&s->reader);
+                sender_close(&s->tx);
+                manifest_free(&s->tx_manifest);
+                s->downloading = 0;
+                session_request_done(s);
+                printf("Arquivo enviado: %s (%s)\n", s->tx_name,
+                       s->tx_codec != CODEC_NONE ? codec_name(s->tx_codec) :
+                       s->tx_cache == TX_CACHE_HIT ? "cache" : send_mode_name(s->tx.mode));
+                download_cache_release(s);
+                continue;
+            }
+            if (s->tx_buffered) {
+                // Quadro inteiro (comprimido ou não) de uma vez na resposta pendente
+                if (session_allowance(s, RATE_DOWN) == 0) return 0;
+                int packed = download_pack(s);
+                if (packed < 0) {
+                    printf("Erro ao ler arquivo %s para %s.\n", s->tx_name, s->peer);
+                    metrics_add(M_ERR_DISK, 1);
+                    return -1;
+                }
+                if (packed == 0) {
+                    s->disk_wait = 1;
+                    return 0;
+                }
+                session_account(s, RATE_DOWN, (int64_t)s->out_len);
+                continue;
+            }
+            // Abre o próximo quadro DATA
+            uint64_t frame = s->tx_remaining < FRAME_DATA_CHUNK ? s->tx_remaining : FRAME_DATA_CHUNK;
+            s->tx_remaining -= frame;
+            s->tx_frame_left = frame;
+            s->tx_final = (s->tx_remaining == 0);
+            uint8_t header[FRAME_HEADER_SIZE];
+            frame_encode(header, OP_DATA, s->tx_final ? FLAG_END : 0, s->tx_request, frame);
+            session_queue(s, header, sizeof(header));
+            continue;
+        }
+
+        uint64_t want = s->tx_frame_left;
+        if (s->tx_manifest.refs != NULL) {
+            // Arquivo descrito por manifesto: um quadro pode atravessar blocos
+            if (s->tx_chunk_left == 0) {
+                sender_close(&s->tx);
+                if (s->tx_chunk >= s->tx_manifest.count || download_open_chunk(s, s->tx_chunk, 0) != 0) {
+                    printf("Bloco ausente ao enviar %s para %s.\n", s->tx_name, s->peer);
+                    metrics_add(M_ERR_DISK, 1);
+                    return -1;
+                }
+            }
+            if (want > s->tx_chunk_left) want = s->tx_chunk_left;
+        }
+        int64_t allow = session_allowance(s, RATE_DOWN);
+        if (allow == 0) return 0;
+        if (want > (uint64_t)allow) want = (uint64_t)allow;
+
+        int64_t sent = sender_send(&s->tx, s->sock, want);
+        if (sent == 0) return 0;
+        if (sent < 0) {
+            // Falha de rede ou arquivo encolheu durante o envio: o quadro não tem como ser completado
+            printf("Erro ao enviar arquivo %s para %s.\n", s->tx_name, s->peer);
+            metrics_add(M_ERR_NETWORK, 1);
+            return -1;
+        }
+        metrics_add(M_NET_OUT, (uint64_t)sent);
+        metrics_add(M_FILE_DOWN, (uint64_t)sent);
+        s->tx_frame_left -= (uint64_t)sent;
+        if (s->tx_manifest.refs != NULL) s->tx_chunk_left -= (uint64_t)sent;
+        session_account(s, RATE_DOWN, sent);
+    }
+    return 0;
+}
+
+/**
+ * Copia e valida o nome de arquivo contido em um payload
+ *
+ * @return 0 se o nome é válido, -1 caso contrário
+ */
+int extract_name(const char *payload, size_t len, char *name) {
+    if (!proto_valid_name(payload, len)) return -1;
+    memcpy(name, payload, len);
+    name[len] = '\0';
+    return storage_is_internal(name) ? -1 : 0;
+}
+
+/**
+ * Seleciona as entradas de uma página de listagem
+ *
+ * Deve ser chamada com o lock do índice adquirido; as entradas
+ * selecionadas só valem enquanto ele estiver adquirido.
+ *
+ * @param out Recebe até page entradas, em ordem crescente de nome
+ * @param more Recebe 1 se outras entradas ficaram de fora da página
+ * @return Quantidade de entradas selecionadas, ou (size_t)-1 se faltou
+ *         memória para ordenar o índice
+ *
+ * Por que foi feito:
+ * - A tabela hash não tem ordem; ordenar por nome e continuar a partir do
+ *   último nome entregue faz o cursor continuar válido mesmo com arquivos
+ *   criados e removidos entre as páginas
+ * - A ordem por nome do índice é mantida a cada alteração; a página começa
+ *   por busca binária no cursor (ou no prefixo) e percorre só as entradas
+ *   entregues, sem varrer o índice inteiro com o lock adquirido
+ */
+size_t list_select(const char *prefix, const char *cursor, index_entry_t **out, size_t page, int *more) {
+    index_table_t *t = &storage_index.table;
+    size_t count = 0;
+    size_t prefix_len = strlen(prefix);
+
+    *more = 0;
+    if (index_table_order(t) != 0) return (size_t)-1;
+
+    // Primeiro nome depois do cursor que ainda pode ter o prefixo
+    size_t i = index_order_seek(t, prefix, 0);
+    if (cursor[0] != '\0') {
+        size_t after = index_order_seek(t, cursor, 1);
+        if (after > i) i = after;
+    }
+
+    for (; i < t->count; i++) {
+        index_entry_t *e = &t->entries[t->order[i]];
+        if (strncmp(e->name, prefix, prefix_len) != 0) break;
+        if (count == page) {
+            *more = 1;
+            break;
+        }
+        out[count++] = e;
+    }
+    return count;
+}
+
+/**
+ * Converte uma entrada do índice para o formato da listagem
+ */
+void list_entry_from_index(list_entry_t *out, const index_entry_t *e, const char *name) {
+    out->size = e->size;
+    out->mtime = e->mtime;
+    out->hash_len = e->digest_len;
+    memcpy(out->hash, e->digest, e->digest_len);
+    snprintf(out->name, sizeof(out->name), "%s", name);
+}
+
+/**
+ * Lista arquivos disponíveis no servidor e envia ao cliente
+ *
+ * @param s Sessão do cliente
+ * @param request_id Identificador do pedido
+ * @param payload Tamanho da página, prefixo e cursor (vazio = padrões)
+ *
+ * Por que foi feito:
+ * - Diretórios com centenas de milhares de arquivos: cada pedido devolve
+ *   uma página, montada a partir do índice em memória, sem ler o disco
+ * - Tamanho e data acompanham cada nome, sem um pedido extra por arquivo
+ */
+void list_files(session_t *s, uint32_t request_id, const char *payload, uint64_t len) {
+    char prefix[PROTO_MAX_NAME] = "";
+    char cursor[PROTO_MAX_NAME] = "";
+    size_t page = LIST_PAGE_DEFAULT;
+    int more;
+
+    if (len > 0) {
+        size_t prefix_len = len >= 6 ? get_u16((const uint8_t *)payload + 4) : 0;
+        size_t cursor_len = len >= 6 + prefix_len ? (size_t)len - 6 - prefix_len : 0;
+        if (len < 6 + prefix_len || prefix_len >= PROTO_MAX_NAME || cursor_len >= PROTO_MAX_NAME) {
+            session_error(s, request_id, ERR_BAD_REQUEST, "Pedido de listagem inválido.");
+            return;
+        }
+        uint32_t requested = get_u32((const uint8_t *)payload);
+        if (requested > 0) page = requested < LIST_PAGE_MAX ? requested : LIST_PAGE_MAX;
+        memcpy(prefix, payload + 6, prefix_len);
+        prefix[prefix_len] = '\0';
+        memcpy(cursor, payload + 6 + prefix_len, cursor_len);
+        cursor[cursor_len] = '\0';
+    }
+
+    index_entry_t **entries = (index_entry_t **)malloc(page * sizeof(index_entry_t *));
+    uint8_t *batch = (uint8_t *)bufpool_alloc(LIST_BATCH_SIZE, &s->mem);
+    if (entries == NULL || batch == NULL) {
+        free(entries);
+        bufpool_free(batch, LIST_BATCH_SIZE, &s->mem);
+        session_error(s, request_id, ERR_IO, "Memória insuficiente.");
+        return;
+    }
+
+    // Seleciona e codifica a página com o índice bloqueado
+    mutex_lock(&storage_index.lock);
+    size_t count = list_select(prefix, cursor, entries, page, &more);
+    if (count == (size_t)-1) {
+        mutex_unlock(&storage_index.lock);
+        bufpool_free(batch, LIST_BATCH_SIZE, &s->mem);
+        free(entries);
+        session_error(s, request_id, ERR_IO, "Memória insuficiente.");
+        return;
+    }
+    size_t used = 0;
+    list_entry_t entry;
+    for (size_t i = 0; i < count; i++) {
+        list_entry_from_index(&entry, entries[i], entries[i]->name);
+        if (used + LIST_ENTRY_MAX > LIST_BATCH_SIZE) {
+            session_send_frame(s, OP_DATA, 0, request_id, batch, used);
+            used = 0;
+        }
+        used += list_entry_encode(batch + used, &entry);
+    }
+    mutex_unlock(&storage_index.lock);
+
+    session_send_frame(s, OP_DATA, FLAG_END | (more ? FLAG_MORE : 0), request_id, batch, used);
+    bufpool_free(batch, LIST_BATCH_SIZE, &s->mem);
+    free(entries);
+}
+
+/**
+ * Responde com os metadados de um arquivo
+ *
+ * @param filename Nome do arquivo consultado
+ *
+ * Por que foi feito:
+ * - Consultas de existência e tamanho (ex.: antes de um download
+ *   paralelo) são respondidas pelo índice, sem abrir o arquivo
+ */
+void stat_file(session_t *s, uint32_t request_id, const char *filename) {
+    index_entry_t found;
+    list_entry_t entry;
+    uint8_t payload[LIST_ENTRY_MAX];
+
+    if (index_lookup(&storage_index, filename, &found) != 0) {
+        session_error(s, request_id, ERR_NOT_FOUND, "Arquivo não encontrado.");
+        return;
+    }
+    sums_attach(filename, &found);
+    list_entry_from_index(&entry, &found, filename);
+    session_send_frame(s, OP_OK, 0, request_id, payload, list_entry_encode(payload, &entry));
+}
+
+/**
+ * Abre o arquivo parcial de um upload retomável
+ *
+ * @param offset Posição a partir da qual o cliente vai enviar
+ * @return 0 em caso de sucesso, -1 se o pedido foi recusado (já respondido)
+ *
+ * Por que foi feito:
+ * - O cliente pode continuar de qualquer posição até os bytes que o
+ *   servidor já gravou; o que estiver além dela é descartado
+ * - O tamanho e o nome registrados na criação impedem que um id seja
+ *   reaproveitado para outro arquivo por engano
+ */
+int upload_open_resumable(session_t *s, uint64_t offset) {
+    uint64_t declared;
+    char filename[MAX_PATH];
+
+    if (!resumable_claim(s->upload_id)) {
+        session_error(s, s->upload_request, ERR_BUSY, "Upload em andamento em outra conexão.");
+        return -1;
+    }
+    s->upload_resumable = 1;
+
+    if (resumable_path(s->upload_temp, s->upload_id, "part") != 0) {
+        session_error(s, s->upload_request, ERR_IO, "Erro ao criar arquivo.");
+        return -1;
+    }
+
+    if (offset == 0) {
+        if (resumable_write_meta(s->upload_id, s->upload_size, s->upload_name) != 0 ||
+            (s->upload_fd = file_open_write(s->upload_temp, 1)) < 0) {
+            session_error(s, s->upload_request, ERR_IO, "Erro ao criar arquivo.");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (resumable_read_meta(s->upload_id, &declared, filename) != 0) {
+        session_error(s, s->upload_request, ERR_NOT_FOUND, "Upload não encontrado.");
+        return -1;
+    }
+    if (declared != s->upload_size || strcmp(filename, s->upload_name) != 0) {
+        session_error(s, s->upload_request, ERR_BAD_REQUEST, "Upload não corresponde ao arquivo.");
+        return -1;
+    }
+    int64_t held = file_size(s->upload_temp);
+    if (held < 0 || offset > (uint64_t)held || offset > s->upload_size) {
+        session_error(s, s->upload_request, ERR_RANGE, "Posição além dos bytes recebidos.");
+        return -1;
+    }
+    if ((s->upload_fd = file_open_write(s->upload_temp, 0)) < 0 || file_truncate(s->upload_fd, offset) != 0) {
+        session_error(s, s->upload_request, ERR_IO, "Erro ao abrir arquivo.");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Abre o arquivo parcial para receber um bloco de um upload paralelo
+ *
+ * @param offset Posição do bloco no arquivo
+ * @param length Tamanho do bloco
+ * @return 0 em caso de sucesso, -1 se o pedido foi recusado (já respondido)
+ *
+ * Por que foi feito:
+ * - Cada conexão grava seu bloco por escrita posicional no mesmo arquivo
+ *   parcial, então os blocos não precisam chegar em ordem
+ * - A primeira conexão a chegar registra tamanho e nome; as demais só
+ *   conferem, sob o mesmo lock, que falam do mesmo arquivo
+ */
+int upload_open_chunk(session_t *s, uint64_t offset, uint64_t length) {
+    uint64_t declared;
+    char filename[MAX_PATH];
+    int mismatch = 0, failed = 0;
+
+    if (length == 0 || offset > s->upload_size || length > s->upload_size - offset) {
+        session_error(s, s->upload_request, ERR_RANGE, "Bloco fora do arquivo.");
+        return -1;
+    }
+    s->upload_chunked = 1;
+    s->upload_start = offset;
+    s->upload_end = offset + length;
+
+    if (resumable_path(s->upload_temp, s->upload_id, "part") != 0) {
+        session_error(s, s->upload_request, ERR_IO, "Erro ao criar arquivo.");
+        return -1;
+    }
+
+    mutex_lock(&resumable.lock);
+    if (resumable_read_meta(s->upload_id, &declared, filename) == 0) {
+        mismatch = declared != s->upload_size || strcmp(filename, s->upload_name) != 0;
+    } else {
+        failed = resumable_write_meta(s->upload_id, s->upload_size, s->upload_name) != 0;
+    }
+    mutex_unlock(&resumable.lock);
+
+    if (mismatch) {
+        session_error(s, s->upload_request, ERR_BAD_REQUEST, "Upload não corresponde ao arquivo.");
+        return -1;
+    }
+    if (failed || (s->upload_fd = file_open_write(s->upload_temp, 0)) < 0) {
+        session_error(s, s->upload_request, ERR_IO, "Erro ao criar arquivo.");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Cria o arquivo temporário de um upload anônimo
+ *
+ * @return 0 em caso de sucesso, -1 se o pedido foi recusado (já respondido)
+ */
+int upload_open_temp(session_t *s) {
+    // Arquivo temporário com nome único, fora da listagem
+    char name[64];
+    snprintf(name, sizeof(name), "tmp-%ld.part", atomic_add_long(&upload_sequence, 1));
+    if (parts_path(s->upload_temp, name) != 0 || (s->upload_fd = file_open_write(s->upload_temp, 1)) < 0) {
+        session_error(s, s->upload_request, ERR_IO, "Erro ao criar arquivo.");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reserva o espaço de um upload pequeno no segmento ativo (-s pack)
+ *
+ * @return 0 em caso de sucesso, -1 se o pedido foi recusado (já respondido)
+ *
+ * Por que foi feito:
+ * - Muitos arquivos pequenos viram registros seguidos em poucos arquivos
+ *   grandes: nada de criar, renomear e sincronizar um arquivo (e um
+ *   inode) por upload
+ */
+int upload_open_segment(session_t *s) {
+    if (segstore_reserve(&segments, s->upload_name, s->upload_size, &s->upload_slot) != 0) {
+        session_error(s, s->upload_request, ERR_IO, "Erro ao gravar no servidor.");
+        return -1;
+    }
+    s->upload_fd = s->upload_slot.fd;
+    s->upload_packed = 1;
+    s->upload_temp[0] = '\0';
+    return 0;
+}
+
+/**
+ * Reserva o espaço e prepara o estágio de disco para os quadros DATA
+ *
+ * @param offset Posição do primeiro byte a receber
+ * @param reserve Tamanho final do arquivo (espaço reservado de antemão)
+ */
+void upload_begin(session_t *s, uint64_t offset, uint64_t reserve) {
+    if (!s->upload_packed && file_preallocate(s->upload_fd, reserve) != 0) {
+        upload_discard(s, s->upload_resumable || s->upload_chunked);
+        upload_release(s);
+        session_error(s, s->upload_request, ERR_IO, "Espaço insuficiente no servidor.");
+        return;
+    }
+    if (writer_open(&s->writer, s->upload_fd, s->upload_packed ? s->upload_slot.data + offset : offset) != 0) {
+        // Limite de memória: o cliente tenta de novo mais tarde
+        upload_discard(s, s->upload_resumable || s->upload_chunked);
+        upload_release(s);
+        session_error(s, s->upload_request, ERR_BUSY, "Memória insuficiente no servidor.");
+        return;
+    }
+    // O segmento é sincronizado na conclusão, junto com os uploads vizinhos
+    if (s->upload_packed) writer_defer_sync(&s->writer);
+    s->upload_start = s->upload_total = offset;
+    s->upload_refused = 0;
+    s->upload_corrupt = 0;
+    checksum_init(&s->upload_sum);
+}
+
+/**
+ * Inicia o recebimento de um arquivo enviado pelo cliente
+ *
+ * @param s Sessão do cliente
+ * @param h Cabeçalho do pedido UPLOAD
+ * @param payload Tamanho declarado (u64) seguido do nome do arquivo; com
+ *                FLAG_RESUME, também o id do upload e a posição inicial, e
+ *                com FLAG_CHUNK, também o tamanho do bloco
+ *
+ * Por que foi feito:
+ * - Permitir upload de arquivos para o servidor
+ * - Os bytes chegam nos quadros DATA seguintes (upload_chunk) e são
+ *   gravados em um arquivo temporário; o nome final só aparece na
+ *   listagem quando o upload termina completo (upload_commit)
+ * - O tamanho declarado reserva o espaço em disco de uma vez e permite
+ *   recusar o upload antes de receber os dados se não houver espaço
+ * - Uploads retomáveis continuam de onde a conexão anterior parou em vez
+ *   de reenviar o arquivo desde o primeiro byte
+ * - Com -s pack, arquivos pequenos vão para um segmento; um retomável que
+ *   começa do zero também, e se for interrompido recomeça do início
+ */
+void upload_file(session_t *s, frame_header_t *h, const char *payload) {
+    size_t fixed = (h->flags & FLAG_CHUNK) ? 32 : (h->flags & FLAG_RESUME) ? 24 : 8;
+    uint64_t offset = 0;
+
+    s->uploading = 1;
+    s->upload_fd = -1;
+    s->upload_refused = 1;
+    s->upload_resumable = 0;
+    s->upload_chunked = 0;
+    s->upload_packed = 0;
+    s->upload_kind = UPLOAD_FILE;
+    s->upload_request = h->request_id;
+
+    if (h->length < fixed || extract_name(payload + fixed, h->length - fixed, s->upload_name) != 0) {
+        session_error(s, h->request_id, ERR_BAD_REQUEST, "Nome de arquivo inválido.");
+        return;
+    }
+    s->upload_size = get_u64((const uint8_t *)payload);
+    s->upload_start = 0;
+    s->upload_end = s->upload_size;
+    int packable = config.pack && s->upload_size <= (uint64_t)config.pack_kb * 1024 &&
+                   (!(h->flags & FLAG_RESUME) || get_u64((const uint8_t *)payload + 16) == 0);
+
+    if (h->flags & FLAG_CHUNK) {
+        s->upload_id = get_u64((const uint8_t *)payload + 8);
+        offset = get_u64((const uint8_t *)payload + 16);
+        if (upload_open_chunk(s, offset, get_u64((const uint8_t *)payload + 24)) != 0) {
+            if (s->upload_fd >= 0) file_close(s->upload_fd);
+            s->upload_fd = -1;
+            s->upload_chunked = 0;
+            return;
+        }
+    } else if (packable) {
+        if (upload_open_segment(s) != 0) return;
+    } else if (h->flags & FLAG_RESUME) {
+        s->upload_id = get_u64((const uint8_t *)payload + 8);
+        offset = get_u64((const uint8_t *)payload + 16);
+        if (upload_open_resumable(s, offset) != 0) {
+            if (s->upload_fd >= 0) file_close(s->upload_fd);
+            s->upload_fd = -1;
+            upload_release(s);
+            return;
+        }
+    } else if (upload_open_temp(s) != 0) {
+        return;
+    }
+
+    upload_begin(s, offset, s->upload_size);
+    replicate_stream(s);
+}
+
+/**
+ * Inicia o recebimento de um bloco do armazenamento por conteúdo
+ *
+ * @param payload SHA-256 do bloco seguido do tamanho (u64)
+ *
+ * Por que foi feito:
+ * - O bloco passa pelo mesmo caminho dos uploads (buffers alinhados e
+ *   threads de disco); o hash é calculado enquanto os bytes chegam e
+ *   conferido antes de o bloco ganhar seu nome
+ */
+void chunk_put(session_t *s, frame_header_t *h, const char *payload) {
+    char hex[SHA256_SIZE * 2 + 1];
+
+    s->uploading = 1;
+    s->upload_fd = -1;
+    s->upload_refused = 1;
+    s->upload_resumable = 0;
+    s->upload_chunked = 0;
+    s->upload_kind = UPLOAD_CHUNK;
+    s->upload_request = h->request_id;
+
+    if (!config.dedup) {
+        session_error(s, h->request_id, ERR_UNSUPPORTED, "Armazenamento por conteúdo desativado.");
+        return;
+    }
+    if (h->length != SHA256_SIZE + 8) {
+        session_error(s, h->request_id, ERR_BAD_REQUEST, "Pedido inválido.");
+        return;
+    }
+    memcpy(s->upload_hash, payload, SHA256_SIZE);
+    s->upload_size = get_u64((const uint8_t *)payload + SHA256_SIZE);
+    if (s->upload_size == 0 || s->upload_size > CDC_MAX_SIZE) {
+        session_error(s, h->request_id, ERR_BAD_REQUEST, "Tamanho de bloco inválido.");
+        return;
+    }
+    digest_hex(s->upload_hash, SHA256_SIZE, hex);
+    snprintf(s->upload_name, sizeof(s->upload_name), "bloco %.16s", hex);
+    sha256_init(&s->upload_digest);
+
+    s->upload_start = 0;
+    s->upload_end = s->upload_size;
+    if (upload_open_temp(s) != 0) return;
+    upload_begin(s, 0, s->upload_size);
+}
+
+/**
+ * Inicia o recebimento do manifesto de um arquivo
+ *
+ * @param payload Tamanho do arquivo (u64) + quantidade de blocos (u32) + nome
+ *
+ * Por que foi feito:
+ * - O cabeçalho do manifesto é gravado pelo servidor a partir do pedido;
+ *   os quadros DATA trazem só a lista de blocos, gravada logo depois
+ */
+void manifest_put(session_t *s, frame_header_t *h, const char *payload) {
+    uint8_t header[MANIFEST_HEADER_SIZE];
+
+    s->uploading = 1;
+    s->upload_fd = -1;
+    s->upload_refused = 1;
+    s->upload_resumable = 0;
+    s->upload_chunked = 0;
+    s->upload_kind = UPLOAD_MANIFEST;
+    s->upload_request = h->request_id;
+
+    if (!config.dedup) {
+        session_error(s, h->request_id, ERR_UNSUPPORTED, "Armazenamento por conteúdo desativado.");
+        return;
+    }
+    if (h->length < 12 || extract_name(payload + 12, h->length - 12, s->upload_name) != 0) {
+        session_error(s, h->request_id, ERR_BAD_REQUEST, "Nome de arquivo inválido.");
+        return;
+    }
+    s->upload_size = get_u64((const uint8_t *)payload);
+    uint32_t count = get_u32((const uint8_t *)payload + 8);
+    // Cada bloco tem ao menos um byte
+    if (count > s->upload_size) {
+        session_error(s, h->request_id, ERR_BAD_REQUEST, "Manifesto inválido.");
+        return;
+    }
+
+    s->upload_start = MANIFEST_HEADER_SIZE;
+    s->upload_end = MANIFEST_HEADER_SIZE + (uint64_t)count * MANIFEST_REF_SIZE;
+    if (upload_open_temp(s) != 0) return;
+
+    io_vec_t iov;
+    manifest_encode_header(header, s->upload_size, count);
+    iov.iov_base = header;
+    iov.iov_len = sizeof(header);
+    if (file_pwritev(s->upload_fd, &iov, 1, 0) != 0) {
+        upload_discard(s, 0);
+        session_error(s, h->request_id, ERR_IO, "Erro ao criar arquivo.");
+        return;
+    }
+    upload_begin(s, MANIFEST_HEADER_SIZE, s->upload_end);
+}
+
+/**
+ * Inicia o recebimento das diferenças de um arquivo existente
+ *
+ * @param payload u64 tamanho das instruções + u64 tamanho do arquivo novo +
+ *                SHA-256 do arquivo novo + u32 tamanho dos blocos + u64
+ *                tamanho e u64 data da cópia usada nas assinaturas + nome
+ *
+ * Por que foi feito:
+ * - As instruções são gravadas como um upload comum e aplicadas só
+ *   quando chegam inteiras (upload_commit), sem segurar a rede no disco
+ */
+void delta_put(session_t *s, frame_header_t *h, const char *payload) {
+    const uint8_t *p = (const uint8_t *)payload;
+
+    s->uploading = 1;
+    s->upload_fd = -1;
+    s->upload_refused = 1;
+    s->upload_resumable = 0;
+    s->upload_chunked = 0;
+    s->upload_kind = UPLOAD_DELTA;
+    s->upload_request = h->request_id;
+
+    if (h->length < 68 || extract_name(payload + 68, h->length - 68, s->upload_name) != 0) {
+        session_error(s, h->request_id, ERR_BAD_REQUEST, "Nome de arquivo inválido.");
+        return;
+    }
+    s->upload_start = 0;
+    s->upload_end = get_u64(p);
+    s->upload_size = get_u64(p + 8);
+    memcpy(s->upload_hash, p + 16, SHA256_SIZE);
+    s->delta_block = get_u32(p + 48);
+    s->delta_base_size = get_u64(p + 52);
+    s->delta_base_mtime = (int64_t)get_u64(p + 60);
+    if (s->delta_block == 0 || s->delta_block > DELTA_BLOCK_MAX) {
+        session_error(s, h->request_id, ERR_BAD_REQUEST, "Tamanho de bloco inválido.");
+        return;
+    }
+    if (upload_open_temp(s) != 0) return;
+    upload_begin(s, 0, s->upload_end);
+}
+
+/**
+ * Inicia o recebimento de um lote de arquivos pequenos
+ *
+ * @param payload u64 tamanho do lote + u32 entradas
+ *
+ * Por que foi feito:
+ * - O lote passa pelo mesmo caminho dos uploads (compressão, resumo,
+ *   buffers e threads de disco) e é desmontado só quando chega inteiro
+ *   (tree_store), sem uma ida e volta nem um arquivo aberto por vez na
+ *   rede para cada arquivo
+ */
+void tree_put(session_t *s, frame_header_t *h, const char *payload) {
+    s->uploading = 1;
+    s->upload_fd = -1;
+    s->upload_refused = 1;
+    s->upload_resumable = 0;
+    s->upload_chunked = 0;
+    s->upload_kind = UPLOAD_TREE;
+    s->upload_request = h->request_id;
+
+    if (h->length != 12) {
+        session_error(s, h->request_id, ERR_BAD_REQUEST, "Pedido inválido.");
+        return;
+    }
+    s->upload_start = 0;
+    s->upload_end = s->upload_size = get_u64((const uint8_t *)payload);
+    s->tree_entries = get_u32((const uint8_t *)payload + 8);
+    if (s->tree_entries == 0 || s->tree_entries > TREE_MAX_ENTRIES ||
+        s->upload_end > TREE_MAX_BYTES + (uint64_t)s->tree_entries * (TREE_ENTRY_HEADER + PROTO_MAX_NAME)) {
+        session_error(s, h->request_id, ERR_BAD_REQUEST, "Lote inválido.");
+        return;
+    }
+    snprintf(s->upload_name, sizeof(s->upload_name), "lote de %u entradas", s->tree_entries);
+    if (upload_open_temp(s) != 0) return;
+    upload_begin(s, 0, s->upload_end);
+}
+
+/**
+ * Abandona o upload em andamento
+ *
+ * @param keep 1 para manter o arquivo parcial (upload retomável
+ *             interrompido), 0 para removê-lo; o arquivo de um upload
+ *             paralelo é sempre mantido, pois outros blocos estão nele
+ */
+void upload_discard(session_t *s, int keep) {
+    if (s->upload_fd < 0) return;
+    writer_abort(&s->writer);       // Espera a escrita em andamento terminar
+    if (s->upload_packed) {
+        // O descritor é do segmento; o registro sem conclusão vira espaço morto
+        segstore_cancel(&segments, &s->upload_slot);
+        s->upload_packed = 0;
+    } else {
+        file_close(s->upload_fd);
+    }
+    if (!keep && !s->upload_chunked && s->upload_temp[0] != '\0') {
+        remove(s->upload_temp);
+        if (s->upload_resumable) resumable_remove_meta(s->upload_id);
+    }
+    writer_reset(&s->writer);
+    s->upload_fd = -1;
+}
+
+/**
+ * Devolve o id do upload retomável da sessão, se houver
+ */
+void upload_release(session_t *s) {
+    if (!s->upload_resumable) return;
+    resumable_release(s->upload_id);
+    s->upload_resumable = 0;
+}
+
+/**
+ * Informa quantos bytes de um upload retomável o servidor já tem
+ *
+ * @param payload Id do upload (u64)
+ *
+ * Por que foi feito:
+ * - Depois de uma queda, o cliente pergunta de onde continuar em vez de
+ *   reenviar o arquivo inteiro
+ */
+void upload_status(session_t *s, uint32_t request_id, const char *payload, uint64_t len) {
+    char filepath[MAX_PATH];
+    char filename[MAX_PATH];
+    uint8_t reply[16 + MAX_PATH];
+    uint64_t declared;
+
+    if (len != 8) {
+        session_error(s, request_id, ERR_BAD_REQUEST, "Pedido inválido.");
+        return;
+    }
+    uint64_t upload_id = get_u64((const uint8_t *)payload);
+    if (resumable_read_meta(upload_id, &declared, filename) != 0 ||
+        resumable_path(filepath, upload_id, "part") != 0) {
+        session_error(s, request_id, ERR_NOT_FOUND, "Upload não encontrado.");
+        return;
+    }
+
+    // Uploads em blocos informam o trecho inicial sem lacunas
+    uint64_t prefix;
+    int64_t held = resumable_chunks_prefix(upload_id, &prefix, NULL) >= 0 ? (int64_t)prefix : file_size(filepath);
+    size_t name_len = strlen(filename);
+    put_u64(reply, held > 0 ? (uint64_t)held : 0);
+    put_u64(reply + 8, declared);
+    memcpy(reply + 16, filename, name_len);
+    session_send_frame(s, OP_OK, 0, request_id, reply, 16 + name_len);
+}
+
+/**
+ * Entrega ao estágio de disco um bloco recebido durante o upload
+ *
+ * @return Bytes consumidos; menos que len quando todos os buffers de
+ *         escrita estão ocupados e a leitura deve esperar o disco
+ */
+size_t upload_chunk(session_t *s, const uint8_t *data, size_t len) {
+    if (s->upload_fd < 0) return len; // Upload recusado: descarta os dados
+
+    if (s->upload_total + len > s->upload_end) {
+        // Mais dados que o declarado: o upload não pode ser aceito
+        upload_discard(s, 0);
+        return len;
+    }
+    size_t used = writer_write(&s->writer, data, len);
+    if (s->replica_write != NULL) replica_write_data(s->replica_write, data, used);
+    if (s->upload_kind == UPLOAD_CHUNK) sha256_update(&s->upload_digest, data, used);
+    checksum_update(&s->upload_sum, data, used);
+    s->upload_total += used;
+    metrics_add(M_FILE_UP, used);
+    return used;
+}
+
+/**
+ * Acumula o payload de um quadro DATA comprimido
+ *
+ * @return Bytes consumidos
+ *
+ * Por que foi feito:
+ * - O codec precisa do quadro inteiro; quando o último byte chega, os
+ *   dados descomprimidos seguem para upload_chunk() como os de um quadro
+ *   comum (inclusive o SHA-256 de blocos, calculado sobre os bytes
+ *   originais)
+ */
+size_t upload_packed_input(session_t *s, const uint8_t *data, size_t len) {
+    if (s->rx_packed == NULL) s->rx_packed = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, &s->mem);
+    if (s->rx_packed != NULL) memcpy(s->rx_packed + s->rx_packed_len, data, len);
+    s->rx_packed_len += len;
+    return len;
+}
+
+/**
+ * Descomprime o quadro DATA acumulado
+ *
+ * @return 0 em caso de sucesso, -1 se o quadro é inválido
+ */
+int upload_unpack(session_t *s) {
+    size_t len = s->rx_packed_len;
+
+    s->rx_packed_len = 0;
+    s->rx_plain_len = s->rx_plain_pos = 0;
+    if (s->upload_fd < 0) return 0;   // Upload recusado: nem descomprime
+    if (s->rx_plain == NULL) s->rx_plain = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, &s->mem);
+    if (s->rx_packed == NULL || s->rx_plain == NULL) return -1;
+
+    uint32_t raw = get_u32(s->rx_packed);
+    if (raw == 0 || raw > FRAME_DATA_CHUNK ||
+        codec_decompress(FLAG_CODEC_OF(s->rx_flags), s->rx_packed + 4, len - 4, s->rx_plain, raw) != 0) return -1;
+    s->rx_plain_len = raw;
+    return 0;
+}
+
+/**
+ * Recebe do socket direto para o buffer de escrita do upload
+ *
+ * @param limit Máximo de bytes a receber (cota da vez e limite de banda)
+ * @return Bytes recebidos, 0 se a conexão foi encerrada, -1 em erro ou se
+ *         não há dados agora, -2 se o caminho direto não se aplica
+ *
+ * Por que foi feito:
+ * - No meio de um quadro DATA, com o buffer de entrada vazio, os bytes
+ *   podem ir do socket para o buffer alinhado que será gravado em disco,
+ *   sem a cópia intermediária pelo buffer de entrada da sessão
+ */
+int upload_receive_direct(session_t *s, int64_t limit) {
+    if (!s->rx_active || s->in_len > 0 || s->upload_fd < 0 || (s->rx_flags & FLAG_COMPRESSED)) return -2;
+
+    size_t room;
+    char *dst = writer_reserve(&s->writer, &room);
+    uint64_t want = s->rx_left;
+    if (s->upload_end - s->upload_total < want) want = s->upload_end - s->upload_total;
+    if (dst == NULL || want == 0) return -2;
+    if (want < room) room = (size_t)want;
+    if ((uint64_t)limit < room) room = (size_t)limit;
+
+    int received = recv(s->sock, dst, (int)(room > 0x40000000 ? 0x40000000 : room), 0);
+    if (received > 0) {
+        if (s->replica_write != NULL) replica_write_data(s->replica_write, (const uint8_t *)dst, (size_t)received);
+        if (s->upload_kind == UPLOAD_CHUNK) sha256_update(&s->upload_digest, dst, (size_t)received);
+        checksum_update(&s->upload_sum, dst, (size_t)received);
+        writer_commit(&s->writer, (size_t)received);
+        s->upload_total += (uint64_t)received;
+        metrics_add(M_FILE_UP, (uint64_t)received);
+        s->rx_left -= (uint64_t)received;
+    }
+    return received == SOCKET_ERROR ? -1 : received;
+}
+
+/**
+ * Confere o resumo enviado pelo cliente no fim do pedido
+ *
+ * @param digest CHECKSUM_SIZE bytes (CRC32C + XXH64)
+ *
+ * Por que foi feito:
+ * - O resumo é calculado enquanto os bytes passam para o estágio de
+ *   disco, então a conferência não relê o arquivo
+ * - O CRC do TCP não pega todos os erros (memória, placas de rede,
+ *   middleboxes); um upload corrompido nunca recebe o nome final
+ */
+void upload_verify(session_t *s, const uint8_t *digest) {
+    uint8_t computed[CHECKSUM_SIZE];
+
+    if (s->upload_fd < 0) return;
+    checksum_final(&s->upload_sum, computed);
+    if (memcmp(computed, digest, CHECKSUM_SIZE) != 0) s->upload_corrupt = 1;
+}
+
+/**
+ * Encerra o recebimento ao chegar o quadro DATA marcado com FLAG_END
+ *
+ * Por que foi feito:
+ * - O fim do arquivo agora é explícito no protocolo, então a conexão
+ *   continua disponível para os próximos comandos
+ * - A resposta só sai em upload_commit(), depois que o estágio de disco
+ *   gravou e sincronizou todos os buffers
+ */
+void upload_finish(session_t *s) {
+    if (s->upload_refused) {
+        s->uploading = 0;  // Erro já foi respondido
+        return;
+    }
+    if (s->upload_corrupt) {
+        // Nada do que chegou neste pedido é aproveitado
+        upload_discard(s, 0);
+        upload_release(s);
+        replicate_release(s);
+        s->uploading = 0;
+        session_error(s, s->upload_request, ERR_CHECKSUM, "Dados corrompidos na transferência.");
+        printf("Resumo não confere: %s (%s)\n", s->upload_name, s->peer);
+        return;
+    }
+    if (s->upload_fd >= 0 && s->upload_total != s->upload_end) upload_discard(s, 0);
+    if (s->upload_fd >= 0) writer_finish(&s->writer);
+    s->upload_committing = 1;
+}
+
+/**
+ * Guarda um bloco recebido no armazenamento por conteúdo
+ *
+ * @return 0 em caso de sucesso, ou o código de erro a responder
+ *
+ * Por que foi feito:
+ * - Um bloco com hash diferente do declarado nunca recebe o nome de outro
+ *   conteúdo
+ * - Dois clientes podem enviar o mesmo bloco ao mesmo tempo; como o
+ *   conteúdo é idêntico, qualquer uma das trocas de nome serve
+ */
+int chunk_store(session_t *s) {
+    char filepath[MAX_PATH];
+    uint8_t digest[SHA256_SIZE];
+
+    sha256_final(&s->upload_digest, digest);
+    if (memcmp(digest, s->upload_hash, SHA256_SIZE) != 0) return ERR_BAD_REQUEST;
+    if (chunk_path(filepath, MAX_PATH, config.storage, digest) != 0 ||
+        file_replace(s->upload_temp, filepath) != 0) return ERR_IO;
+    return 0;
+}
+
+/**
+ * Dá nome a um manifesto recebido
+ *
+ * @return 0 em caso de sucesso, ou o código de erro a responder
+ *
+ * Por que foi feito:
+ * - Um arquivo só aparece na listagem quando todos os seus blocos estão
+ *   no servidor, então um download nunca encontra um bloco faltando
+ * - Os blocos conferidos ficam protegidos da coleta em andamento, e a
+ *   versão substituída deixa os seus para a próxima
+ */
+int manifest_store(session_t *s) {
+    char filepath[MAX_PATH];
+    manifest_t m;
+    int error = 0;
+
+    if (manifest_load(s->upload_temp, &m) != 0) return ERR_BAD_REQUEST;
+    for (uint32_t i = 0; i < m.count && error == 0; i++) {
+        if (!chunk_claim(&chunk_gc, m.refs[i].hash, m.refs[i].length)) error = ERR_NOT_FOUND;
+    }
+    manifest_free(&m);
+    if (error != 0) return error;
+
+    uint64_t op = storage_journal(JOURNAL_MANIFEST, s->upload_name, s->upload_temp);
+    if (op == 0) return ERR_IO;
+    if (manifest_path(filepath, s->upload_name) != 0) {
+        journal_cancel(&journal, op);
+        return ERR_IO;
+    }
+    int replaced = path_exists(filepath);
+    if (storage_publish(s->upload_temp, filepath) != 0) {
+        journal_cancel(&journal, op);
+        return ERR_IO;
+    }
+    if (replaced) chunk_gc_request(&chunk_gc);
+    // A versão anterior, se era um arquivo comum, deixa de valer
+    if (storage_path(filepath, s->upload_name) == 0) remove(filepath);
+    storage_drop_sums(s->upload_name);
+    index_update(&storage_index, s->upload_name);
+    journal_end(&journal, op, s->upload_name);
+    return 0;
+}
+
+/**
+ * Reconstrói um arquivo a partir da cópia atual e das diferenças recebidas
+ *
+ * @return 0 em caso de sucesso, ou o código de erro a responder
+ *
+ * Por que foi feito:
+ * - A versão nova é montada em um arquivo temporário e troca de nome
+ *   atomicamente; quem baixa o arquivo durante a atualização recebe a
+ *   versão antiga inteira
+ * - Se a cópia mudou desde as assinaturas, as referências a blocos não
+ *   valem mais: o cliente recebe ERR_RANGE e recalcula as diferenças
+ */
+int delta_store(session_t *s) {
+    char filepath[MAX_PATH];
+    char rebuilt[MAX_PATH];
+    char name[64];
+    uint8_t digest[SHA256_SIZE];
+    uint8_t sum_digest[CHECKSUM_SIZE];
+    checksum_t sum;
+    uint64_t base_size;
+    int64_t base_mtime;
+    int base_fd = -1, ops_fd = -1, out_fd = -1;
+    int error = 0;
+
+    snprintf(name, sizeof(name), "tmp-%ld.part", atomic_add_long(&upload_sequence, 1));
+    if (storage_path(filepath, s->upload_name) != 0 || parts_path(rebuilt, name) != 0) {
+        error = ERR_IO;
+    } else if (file_stat(filepath, &base_size, &base_mtime, NULL) != 0 ||
+               base_size != s->delta_base_size || base_mtime != s->delta_base_mtime) {
+        error = ERR_RANGE;
+    } else if ((base_fd = file_open_read(filepath)) < 0 || (ops_fd = file_open_read(s->upload_temp)) < 0 ||
+               (out_fd = file_open_write(rebuilt, 1)) < 0 || file_preallocate(out_fd, s->upload_size) != 0) {
+        error = ERR_IO;
+    } else if (delta_apply(base_fd, base_size, s->delta_block, ops_fd, s->upload_end,
+                           out_fd, s->upload_size, digest, &sum) != 0 ||
+               memcmp(digest, s->upload_hash, SHA256_SIZE) != 0) {
+        error = ERR_BAD_REQUEST;
+    } else if (file_sync(out_fd) != 0) {
+        error = ERR_IO;
+    }
+    if (base_fd >= 0) file_close(base_fd);
+    if (ops_fd >= 0) file_close(ops_fd);
+    if (out_fd >= 0) file_close(out_fd);
+    remove(s->upload_temp);
+
+    uint64_t op = error == 0 ? storage_journal(JOURNAL_UPLOAD, s->upload_name, rebuilt) : 0;
+    if (error == 0 && (op == 0 || storage_publish(rebuilt, filepath) != 0)) error = ERR_IO;
+    if (error != 0) {
+        if (op != 0) journal_cancel(&journal, op);
+        remove(rebuilt);
+        return error;
+    }
+    index_update(&storage_index, s->upload_name);
+    checksum_final(&sum, sum_digest);
+    sums_store(s->upload_name, sum_digest, CHECKSUM_SIZE);
+    journal_end(&journal, op, s->upload_name);
+    return 0;
+}
+
+/**
+ * Lê a próxima entrada de um lote gravado em disco
+ *
+ * @param pos Posição da entrada; avança para a seguinte (depois dos bytes
+ *            de uma entrada TREE_FILE)
+ * @param end Tamanho do lote
+ * @return 0 em caso de sucesso, -1 se a entrada é inválida ou está truncada
+ */
+int tree_read_entry(int fd, uint64_t *pos, uint64_t end, tree_entry_t *e) {
+    uint8_t head[TREE_ENTRY_HEADER + PROTO_MAX_NAME];
+    size_t want = end - *pos < sizeof(head) ? (size_t)(end - *pos) : sizeof(head);
+    int64_t got = want > 0 ? file_pread(fd, head, want, *pos) : 0;
+    size_t used = got > 0 ? tree_entry_decode(head, (size_t)got, e) : 0;
+
+    if (used == 0 || e->type > TREE_ATTR || storage_is_internal(e->name)) return -1;
+    if (e->type != TREE_FILE) e->size = 0;
+    if (e->size > end - *pos - used) return -1;
+    *pos += used + e->size;
+    return 0;
+}
+
+/**
+ * Copia os bytes de um arquivo do lote para um arquivo temporário
+ *
+ * @param offset Posição dos bytes no lote
+ * @param digest Recebe o resumo (CRC32C + XXH64) dos bytes copiados
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+int tree_extract(int fd, uint64_t offset, const tree_entry_t *e, const char *temp, uint8_t *buf, uint8_t *digest) {
+    checksum_t sum;
+    int out = file_open_write(temp, 1);
+    int failed = out < 0;
+
+    checksum_init(&sum);
+    for (uint64_t done = 0; !failed && done < e->size;) {
+        size_t want = e->size - done < FRAME_DATA_CHUNK ? (size_t)(e->size - done) : FRAME_DATA_CHUNK;
+        io_vec_t iov;
+        iov.iov_base = buf;
+        iov.iov_len = want;
+        failed = file_pread(fd, buf, want, offset + done) != (int64_t)want || file_pwritev(out, &iov, 1, done) != 0;
+        checksum_update(&sum, buf, want);
+        done += want;
+    }
+    // Sem syncfs(), cada arquivo vai ao disco antes da troca de nome
+    if (!failed && !FILESYSTEM_SYNC && file_sync(out) != 0) failed = 1;
+    if (out >= 0) file_close(out);
+    if (failed) return -1;
+
+    // Permissões e data acompanham o arquivo na troca de nome
+    file_set_meta(temp, (e->mode & 0777) | 0400, e->mtime);
+    checksum_final(&sum, digest);
+    return 0;
+}
+
+/**
+ * Aplica permissões e data de uma entrada TREE_DIR ou TREE_ATTR
+ *
+ * Por que foi feito:
+ * - Alterar a data invalida o resumo guardado (que registra a data do
+ *   arquivo); o conteúdo não mudou, então o resumo é gravado de novo
+ * - Arquivos descritos por manifesto só guardam a data
+ */
+void tree_apply_meta(const tree_entry_t *e) {
+    char filepath[MAX_PATH];
+    index_entry_t found;
+    uint8_t digest[CHECKSUM_SIZE];
+
+    if (storage_path(filepath, e->name) != 0) return;
+    if (e->type == TREE_DIR) {
+        file_set_meta(filepath, (e->mode & 0777) | 0700, e->mtime);
+        return;
+    }
+    // Objetos em segmentos guardam a data do upload
+    if (index_lookup(&storage_index, e->name, &found) != 0 || found.source == source_packed) return;
+    if (found.source == SOURCE_MANIFEST) {
+        // A data do arquivo é a do manifesto; os blocos são compartilhados
+        if (manifest_path(filepath, e->name) == 0 && file_set_meta(filepath, 0644, e->mtime) == 0) {
+            index_update(&storage_index, e->name);
+            journal_end(&journal, 0, e->name);
+        }
+        return;
+    }
+    size_t len = sums_load(e->name, &found, digest);
+    if (file_set_meta(filepath, (e->mode & 0777) | 0400, e->mtime) != 0) return;
+    index_update(&storage_index, e->name);
+    if (len > 0) sums_store(e->name, digest, len);
+    journal_end(&journal, 0, e->name);
+}
+
+/**
+ * Grava os arquivos de um lote recebido por TREE_PUT
+ *
+ * @return 0 em caso de sucesso, ou o código de erro a responder
+ *
+ * Por que foi feito:
+ * - Cada arquivo vai para um temporário e só troca de nome depois que
+ *   todos estão no disco, como nos uploads avulsos; no Linux um único
+ *   syncfs() cobre o lote inteiro em vez de um fsync() por arquivo
+ * - Diretórios e arquivos enviados à parte (TREE_ATTR) recebem permissões
+ *   e data por último, pois criar arquivos altera a data do diretório
+ * - Com erro no meio, os temporários que não trocaram de nome são
+ *   removidos; os que trocaram estão completos e o cliente reenvia o lote
+ * - As intenções de todos os arquivos vão ao diário com uma única espera
+ * - Cada diretório que recebeu nomes é sincronizado uma vez antes dos
+ *   DONEs, sem um fsync() de diretório por arquivo
+ */
+int tree_store(session_t *s) {
+    char temp[MAX_PATH];
+    char filepath[MAX_PATH];
+    char name[64];
+    tree_entry_t e;
+    long *temps = (long *)calloc(s->tree_entries, sizeof(long));   // Temporário de cada TREE_FILE (0: nenhum)
+    uint64_t *ops = (uint64_t *)calloc(s->tree_entries, sizeof(uint64_t)); // Operação no diário (0: nenhuma)
+    uint8_t *digests = (uint8_t *)malloc((size_t)s->tree_entries * CHECKSUM_SIZE);
+    uint8_t *buf = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, NULL);
+    int fd = file_open_read(s->upload_temp);
+    int error = (temps == NULL || ops == NULL || digests == NULL || buf == NULL || fd < 0) ? ERR_IO : 0;
+    uint64_t pos = 0;
+
+    // Conteúdo de cada arquivo em um temporário
+    for (uint32_t i = 0; i < s->tree_entries && error == 0; i++) {
+        if (tree_read_entry(fd, &pos, s->upload_end, &e) != 0) {
+            error = ERR_BAD_REQUEST;
+            break;
+        }
+        if (e.type != TREE_FILE) continue;
+        temps[i] = atomic_add_long(&upload_sequence, 1);
+        snprintf(name, sizeof(name), "tmp-%ld.part", temps[i]);
+        if (parts_path(temp, name) != 0 ||
+            tree_extract(fd, pos - e.size, &e, temp, buf, digests + (size_t)i * CHECKSUM_SIZE) != 0 ||
+            (ops[i] = journal_begin(&journal, JOURNAL_UPLOAD, e.name, storage_relative(temp))) == 0) {
+            error = ERR_IO;
+        }
+    }
+    if (error == 0 && pos != s->upload_end) error = ERR_BAD_REQUEST;
+    if (error == 0 && FILESYSTEM_SYNC && filesystem_sync(fd) != 0) error = ERR_IO;
+    if (error == 0 && journal_commit(&journal) != 0) error = ERR_IO;
+
+    // Nomes finais e diretórios
+    pos = 0;
+    for (uint32_t i = 0; i < s->tree_entries && error == 0; i++) {
+        tree_read_entry(fd, &pos, s->upload_end, &e);
+        if (e.type == TREE_ATTR || storage_path(filepath, e.name) != 0) continue;
+        if (e.type == TREE_DIR) {
+            if (!path_is_dir(filepath) && (make_parent_dirs(filepath) != 0 || make_dir(filepath) != 0)) error = ERR_IO;
+            continue;
+        }
+        snprintf(name, sizeof(name), "tmp-%ld.part", temps[i]);
+        if (parts_path(temp, name) != 0 || storage_rename(temp, filepath) != 0) {
+            error = ERR_IO;
+            break;
+        }
+        temps[i] = 0;
+        storage_drop_manifest(e.name);
+        storage_drop_packed(e.name);
+        index_update(&storage_index, e.name);
+        sums_store(e.name, digests + (size_t)i * CHECKSUM_SIZE, CHECKSUM_SIZE);
+    }
+
+    // Os nomes novos vão ao disco antes dos DONEs e do OK: um fsync() por
+    // diretório, pois entradas vizinhas costumam dividir o mesmo
+    size_t synced = SIZE_MAX;
+    char last[PROTO_MAX_NAME + 1];
+    pos = 0;
+    for (uint32_t i = 0; i < s->tree_entries && error == 0; i++) {
+        tree_read_entry(fd, &pos, s->upload_end, &e);
+        if (e.type == TREE_ATTR || storage_path(filepath, e.name) != 0) continue;
+        const char *slash = strrchr(e.name, '/');
+        size_t dir_len = slash != NULL ? (size_t)(slash - e.name) : 0;
+        if (dir_len == synced && memcmp(e.name, last, dir_len) == 0) continue;
+        if (storage_sync_name(filepath, 1) != 0) error = ERR_IO;
+        memcpy(last, e.name, dir_len);
+        synced = dir_len;
+    }
+    pos = 0;
+    for (uint32_t i = 0; temps != NULL && ops != NULL && fd >= 0 && i < s->tree_entries; i++) {
+        if (tree_read_entry(fd, &pos, s->upload_end, &e) != 0) break;
+        if (ops[i] == 0 || temps[i] != 0) continue;
+        journal_end(&journal, ops[i], e.name);
+        ops[i] = 0;
+        if (error == 0) replicate_name(s, e.name, 0);
+    }
+
+    // Permissões e datas dos diretórios e dos arquivos enviados à parte
+    pos = 0;
+    for (uint32_t i = 0; i < s->tree_entries && error == 0; i++) {
+        tree_read_entry(fd, &pos, s->upload_end, &e);
+        if (e.type != TREE_FILE) tree_apply_meta(&e);
+    }
+
+    for (uint32_t i = 0; temps != NULL && i < s->tree_entries; i++) {
+        snprintf(name, sizeof(name), "tmp-%ld.part", temps[i]);
+        if (temps[i] != 0 && parts_path(temp, name) == 0) remove(temp);
+        if (ops != NULL && ops[i] != 0) journal_cancel(&journal, ops[i]);
+    }
+    if (fd >= 0) file_close(fd);
+    remove(s->upload_temp);
+    bufpool_free(buf, FRAME_DATA_CHUNK, NULL);
+    free(digests);
+    free(ops);
+    free(temps);
+    return error;
+}
+
+/**
+ * Guarda o resumo de um arquivo recebido por upload sequencial
+ *
+ * Por que foi feito:
+ * - Um upload desde o primeiro byte já tem CRC32C e XXH64 do arquivo
+ *   inteiro; um upload retomado só tem o resumo do trecho final, e o CRC
+ *   do trecho gravado antes da queda é lido do disco e combinado (o XXH64
+ *   não pode ser combinado e fica de fora)
+ */
+void upload_store_sums(session_t *s) {
+    char filepath[MAX_PATH];
+    uint8_t digest[CHECKSUM_SIZE];
+    uint32_t crc;
+
+    if (s->upload_start == 0) {
+        checksum_final(&s->upload_sum, digest);
+        sums_store(s->upload_name, digest, CHECKSUM_SIZE);
+        return;
+    }
+    if (storage_path(filepath, s->upload_name) != 0 || file_crc_prefix(filepath, s->upload_start, &crc) != 0) {
+        storage_drop_sums(s->upload_name);
+        return;
+    }
+    put_u32(digest, crc32c_combine(crc, s->upload_sum.crc, s->upload_end - s->upload_start));
+    sums_store(s->upload_name, digest, CHECKSUM_CRC_SIZE);
+}
+
+/**
+ * Conclui um upload gravado num segmento (-s pack)
+ *
+ * @return 0 em caso de sucesso, ou o código de erro a responder
+ *
+ * Por que foi feito:
+ * - Dispensa o diário de operações: o registro do segmento é a intenção e
+ *   o resultado ao mesmo tempo, e só vale depois de sincronizado; o DONE
+ *   avulso leva o nome ao próximo ponto de controle do índice
+ * - Um arquivo comum com o mesmo nome, enviado antes, deixa de valer
+ */
+int upload_store_packed(session_t *s) {
+    uint8_t digest[CHECKSUM_SIZE];
+    char filepath[MAX_PATH];
+    int64_t mtime = (int64_t)time(NULL);
+
+    s->upload_packed = 0;
+    checksum_final(&s->upload_sum, digest);
+    if (segstore_commit(&segments, &s->upload_slot, s->upload_name, mtime, digest) != 0) return ERR_IO;
+    if (storage_path(filepath, s->upload_name) == 0 && remove(filepath) == 0) {
+        storage_drop_sums(s->upload_name);
+        if (strchr(s->upload_name, '/') != NULL) {
+            storage_prune_dirs(config.storage, s->upload_name);
+            if (storage_path(filepath, SUMS_DIR) == 0) storage_prune_dirs(filepath, s->upload_name);
+        }
+    }
+    index_update(&storage_index, s->upload_name);
+    index_set_digest(&storage_index, s->upload_name, s->upload_size, mtime, digest, CHECKSUM_SIZE);
+    journal_end(&journal, 0, s->upload_name);
+    return 0;
+}
+
+/**
+ * Dá o destino final aos dados de um upload já gravados e sincronizados
+ *
+ * @param arg Sessão do upload
+ * @return 0 em caso de sucesso, ou o código de erro a responder
+ *
+ * Por que foi feito:
+ * - Executada pela thread de disco (disk_call_t): trocas de nome, resumos,
+ *   a conferência de manifestos e a reconstrução por diferenças leem e
+ *   gravam no disco e não podem parar a thread trabalhadora
+ */
+int upload_store(void *arg) {
+    session_t *s = (session_t *)arg;
+    char filepath[MAX_PATH];
+    int error = 0;
+
+    if (s->upload_chunked) {
+        // Bloco de upload paralelo: o nome final vem com UPLOAD_COMMIT
+        return resumable_record_chunk(s->upload_id, s->upload_start, s->upload_end, s->upload_sum.crc) != 0 ? ERR_IO : 0;
+    }
+    if (s->upload_kind != UPLOAD_FILE) {
+        error = s->upload_kind == UPLOAD_CHUNK ? chunk_store(s) :
+                s->upload_kind == UPLOAD_MANIFEST ? manifest_store(s) :
+                s->upload_kind == UPLOAD_TREE ? tree_store(s) : delta_store(s);
+        if (error != 0) remove(s->upload_temp);
+        return error;
+    }
+    if (s->upload_packed) return upload_store_packed(s);
+    uint64_t op = storage_journal(JOURNAL_UPLOAD, s->upload_name, s->upload_temp);
+    if (op == 0 || storage_path(filepath, s->upload_name) != 0 || storage_publish(s->upload_temp, filepath) != 0) {
+        error = ERR_IO;
+        remove(s->upload_temp);
+    } else {
+        storage_drop_manifest(s->upload_name);
+        storage_drop_packed(s->upload_name);
+        index_update(&storage_index, s->upload_name);
+        upload_store_sums(s);
+    }
+    if (op != 0) journal_end(&journal, op, s->upload_name);
+    if (s->upload_resumable) resumable_remove_meta(s->upload_id);
+    return error;
+}
+
+/**
+ * Conclui o upload quando o estágio de disco termina
+ *
+ * @return 1 se o upload foi concluído, 0 se ainda há operação de disco
+ *         pendente (escrita ou upload_store())
+ *
+ * Por que foi feito:
+ * - O arquivo completo troca de nome atomicamente: a listagem nunca
+ *   mostra um arquivo truncado, nem depois de uma queda do servidor
+ */
+int upload_commit(session_t *s) {
+    int error = ERR_IO;
+
+    if (s->upload_storing) {
+        if (!disk_call_done(&s->commit, &error)) return 0;
+        s->upload_storing = 0;
+    } else if (s->upload_fd >= 0) {
+        int result = writer_done(&s->writer);
+        if (result == 0) return 0;
+        if (!s->upload_packed) file_close(s->upload_fd);
+        writer_reset(&s->writer);
+        s->upload_fd = -1;
+        if (result > 0) {
+            s->upload_storing = 1;
+            disk_call_submit(&s->commit, upload_store, s);
+            return 0;
+        }
+        // Escrita falhou: nada do que chegou é aproveitado
+        if (s->upload_packed) {
+            segstore_cancel(&segments, &s->upload_slot);
+            s->upload_packed = 0;
+        } else if (!s->upload_chunked) {
+            remove(s->upload_temp);
+        }
+        if (!s->upload_chunked && s->upload_kind == UPLOAD_FILE && s->upload_resumable) {
+            resumable_remove_meta(s->upload_id);
+        }
+    }
+    upload_release(s);
+    s->uploading = 0;
+    s->upload_committing = 0;
+
+    if (s->upload_chunked) {
+        // O bloco segue gravado para as réplicas; o upload é concluído nelas com o arquivo
+        if (error == 0 && s->replica_write != NULL) replica_write_end(s->replica_write);
+        replicate_release(s);
+        if (error != 0) session_error(s, s->upload_request, ERR_IO, "Bloco incompleto.");
+        else session_reply(s, s->upload_request, "Bloco recebido.");
+        return 1;
+    }
+
+    if (s->upload_kind != UPLOAD_FILE) {
+        // Um lote pode ter gravado parte dos arquivos antes do erro: as
+        // réplicas recebem essa parte sem que a resposta espere por elas
+        if (error != 0) replicate_release(s);
+        if (error == 0 && s->upload_kind == UPLOAD_DELTA) replicate_name(s, s->upload_name, 0);
+        if (error == ERR_NOT_FOUND) session_error(s, s->upload_request, error, "Blocos ausentes no servidor.");
+        else if (error == ERR_BAD_REQUEST) {
+            session_error(s, s->upload_request, error, s->upload_kind == UPLOAD_TREE ? "Lote inválido." : "Conteúdo não confere.");
+        }
+        else if (error == ERR_RANGE) session_error(s, s->upload_request, error, "Arquivo mudou no servidor.");
+        else if (error != 0) session_error(s, s->upload_request, error, "Falha ao gravar.");
+        else if (s->upload_kind == UPLOAD_DELTA) replicate_reply(s, s->upload_request, "Arquivo atualizado com sucesso.");
+        else if (s->upload_kind == UPLOAD_TREE) replicate_reply(s, s->upload_request, "Lote gravado com sucesso.");
+        else session_reply(s, s->upload_request, s->upload_kind == UPLOAD_CHUNK ? "Bloco guardado." : "Upload concluído com sucesso.");
+        if (error == 0 && s->upload_kind == UPLOAD_MANIFEST) {
+            printf("Manifesto recebido: %s (%llu bytes)\n", s->upload_name, (unsigned long long)s->upload_size);
+        }
+        if (error == 0 && s->upload_kind == UPLOAD_TREE) {
+            printf("Lote recebido de %s: %u entradas (%llu bytes)\n", s->peer, s->tree_entries,
+                   (unsigned long long)s->upload_end);
+        }
+        if (error == 0 && s->upload_kind == UPLOAD_DELTA) {
+            printf("Arquivo atualizado por diferenças: %s (%llu bytes, %llu recebidos)\n", s->upload_name,
+                   (unsigned long long)s->upload_size, (unsigned long long)s->upload_end);
+        }
+        return 1;
+    }
+
+    if (error != 0) {
+        replicate_release(s);
+        session_error(s, s->upload_request, ERR_IO, "Upload incompleto.");
+        printf("Upload incompleto: %s\n", s->upload_name);
+        return 1;
+    }
+
+    // Envia confirmação para o cliente (depois do quorum, com réplicas)
+    replicate_name(s, s->upload_name, 0);
+    replicate_reply(s, s->upload_request, "Upload concluído com sucesso.");
+    printf("Arquivo recebido: %s (%llu bytes)\n", s->upload_name, (unsigned long long)s->upload_total);
+    return 1;
+}
+
+/**
+ * Confere os blocos de um upload paralelo e dá o nome final ao arquivo
+ *
+ * @param arg Sessão do pedido UPLOAD_COMMIT
+ * @return 0 em caso de sucesso, ou o código de erro a responder
+ *
+ * Por que foi feito:
+ * - Executada pela thread de disco (disk_call_t): a leitura da descrição
+ *   e dos blocos, o diário e a troca de nome sincronizam o disco e não
+ *   podem parar a thread trabalhadora
+ */
+int upload_finalize_store(void *arg) {
+    session_t *s = (session_t *)arg;
+    char part[MAX_PATH];
+    char filepath[MAX_PATH];
+    uint64_t prefix;
+    uint32_t crc;
+    uint8_t digest[CHECKSUM_CRC_SIZE];
+
+    if (resumable_read_meta(s->store_id, &s->store_size, s->store_name) != 0 ||
+        resumable_path(part, s->store_id, "part") != 0) return ERR_NOT_FOUND;
+    int combined = resumable_chunks_prefix(s->store_id, &prefix, &crc);
+    if (combined < 0 || prefix < s->store_size) return ERR_RANGE;
+    uint64_t op = storage_journal(JOURNAL_UPLOAD, s->store_name, part);
+    if (op == 0 || storage_path(filepath, s->store_name) != 0 || storage_publish(part, filepath) != 0) {
+        if (op != 0) journal_cancel(&journal, op);
+        return ERR_IO;
+    }
+    resumable_remove_meta(s->store_id);
+    storage_drop_manifest(s->store_name);
+    storage_drop_packed(s->store_name);
+    index_update(&storage_index, s->store_name);
+    // CRC do arquivo inteiro, combinado a partir dos CRCs dos blocos
+    if (combined == 0) {
+        put_u32(digest, crc);
+        sums_store(s->store_name, digest, sizeof(digest));
+    } else {
+        storage_drop_sums(s->store_name);
+    }
+    journal_end(&journal, op, s->store_name);
+    return 0;
+}
+
+/**
+ * Dá o nome final a um upload enviado em blocos
+ *
+ * @param payload Id do upload (u64)
+ *
+ * Por que foi feito:
+ * - Com várias conexões, nenhuma delas sabe sozinha que o arquivo está
+ *   completo; o cliente pede a conclusão depois de receber o OK de todos
+ *   os blocos, e o servidor confere que os blocos cobrem o arquivo inteiro
+ * - A conferência e a troca de nome rodam no estágio de disco; a resposta
+ *   sai em store_finish()
+ */
+void upload_finalize(session_t *s, uint32_t request_id, const char *payload, uint64_t len) {
+    if (len != 8) {
+        session_error(s, request_id, ERR_BAD_REQUEST, "Pedido inválido.");
+        return;
+    }
+    s->store_id = get_u64((const uint8_t *)payload);
+    s->store_request = request_id;
+    s->store_op = OP_UPLOAD_COMMIT;
+    disk_call_submit(&s->commit, upload_finalize_store, s);
+}
+
+/**
+ * Informa quais blocos ainda faltam no servidor
+ *
+ * @param payload Quantidade (u32) seguida do SHA-256 de cada bloco
+ *
+ * Por que foi feito:
+ * - O cliente envia só os blocos que o servidor não tem; um arquivo que
+ *   difere pouco de outro já armazenado custa poucos blocos na rede
+ */
+void chunk_query(session_t *s, uint32_t request_id, const char *payload, uint64_t len) {
+    uint8_t missing[(CHUNK_QUERY_MAX + 7) / 8];
+
+    if (!config.dedup) {
+        session_error(s, request_id, ERR_UNSUPPORTED, "Armazenamento por conteúdo desativado.");
+        return;
+    }
+    uint32_t count = len >= 4 ? get_u32((const uint8_t *)payload) : 0;
+    if (len < 4 || count > CHUNK_QUERY_MAX || len != 4 + (uint64_t)count * SHA256_SIZE) {
+        session_error(s, request_id, ERR_BAD_REQUEST, "Pedido inválido.");
+        return;
+    }
+
+    memset(missing, 0, sizeof(missing));
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *hash = (const uint8_t *)payload + 4 + (size_t)i * SHA256_SIZE;
+        if (!chunk_claim(&chunk_gc, hash, 0)) missing[i / 8] |= (uint8_t)(1 << (i % 8));
+    }
+    session_send_frame(s, OP_OK, 0, request_id, missing, (count + 7) / 8);
+}
+
+/**
+ * Envia as assinaturas dos blocos de um arquivo armazenado
+ *
+ * @param payload Tamanho dos blocos (u32, 0 = escolhido pelo servidor) + nome
+ *
+ * Por que foi feito:
+ * - Com as assinaturas o cliente descobre, sem baixar nada do arquivo,
+ *   quais trechos da versão nova o servidor já tem
+ * - A resposta OK leva tamanho e data da cópia assinada; o pedido DELTA
+ *   devolve os dois para o servidor conferir que a cópia não mudou
+ */
+void delta_signatures(session_t *s, uint32_t request_id, const char *payload, uint64_t len) {
+    char filename[PROTO_MAX_NAME];
+    char filepath[MAX_PATH];
+    uint8_t reply[24];
+    index_entry_t found;
+    delta_signature_t sig;
+    uint64_t size;
+    int64_t mtime;
+    int fd;
+
+    if (len < 4 || extract_name(payload + 4, len - 4, filename) != 0) {
+        session_error(s, request_id, ERR_BAD_REQUEST, "Nome de arquivo inválido.");
+        return;
+    }
+    uint32_t block = get_u32((const uint8_t *)payload);
+    if (index_lookup(&storage_index, filename, &found) != 0) {
+        session_error(s, request_id, ERR_NOT_FOUND, "Arquivo não encontrado.");
+        return;
+    }
+    if (found.source == source_packed) {
+        // Objetos em segmentos são pequenos: o cliente reenvia o arquivo inteiro
+        session_error(s, request_id, ERR_UNSUPPORTED, "Arquivo guardado em segmento.");
+        return;
+    }
+    if (found.source == SOURCE_MANIFEST) {
+        // Arquivos por conteúdo já são atualizados só com os blocos novos
+        session_error(s, request_id, ERR_UNSUPPORTED, "Arquivo guardado por conteúdo.");
+        return;
+    }
+    if (storage_path(filepath, filename) != 0 || file_stat(filepath, &size, &mtime, NULL) != 0 ||
+        (fd = file_open_read(filepath)) < 0) {
+        session_error(s, request_id, ERR_NOT_FOUND, "Arquivo não encontrado.");
+        return;
+    }
+    if (block == 0) block = delta_block_size(size);
+    if (block > DELTA_BLOCK_MAX || delta_sign_file(fd, size, block, &sig) != 0) {
+        file_close(fd);
+        session_error(s, request_id, ERR_IO, "Erro ao ler o arquivo.");
+        return;
+    }
+    file_close(fd);
+
+    put_u64(reply, size);
+    put_u64(reply + 8, (uint64_t)mtime);
+    put_u32(reply + 16, block);
+    put_u32(reply + 20, sig.count);
+    session_send_frame(s, OP_OK, 0, request_id, reply, sizeof(reply));
+
+    // Assinaturas em quadros DATA; o último leva FLAG_END
+    uint8_t *batch = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, &s->mem);
+    size_t per_frame = FRAME_DATA_CHUNK / DELTA_SIG_SIZE;
+    uint32_t next = 0;
+    do {
+        size_t count = batch == NULL ? 0 : sig.count - next < per_frame ? sig.count - next : per_frame;
+        for (size_t i = 0; i < count; i++) delta_sig_encode(batch + i * DELTA_SIG_SIZE, &sig.sigs[next + i]);
+        next += (uint32_t)count;
+        if (batch == NULL) next = sig.count;  // Sem memória: o cliente recebe menos assinaturas e desiste
+        session_send_frame(s, OP_DATA, next == sig.count ? FLAG_END : 0, request_id, batch, count * DELTA_SIG_SIZE);
+    } while (next < sig.count);
+    bufpool_free(batch, FRAME_DATA_CHUNK, &s->mem);
+    delta_signature_free(&sig);
+}
+
+/**
+ * Aloca os buffers de compressão da sessão
+ *
+ * @return 0 em caso de sucesso, -1 sem memória (ou acima do limite da sessão)
+ */
+int session_codec_buffers(session_t *s) {
+    if (s->tx_plain == NULL) s->tx_plain = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, &s->mem);
+    if (s->tx_packed == NULL) s->tx_packed = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, &s->mem);
+    return (s->tx_plain == NULL || s->tx_packed == NULL) ? -1 : 0;
+}
+
+/**
+ * Decide se o download será comprimido
+ *
+ * @param requested Codec pedido pelo cliente
+ * @param length Bytes a enviar a partir da posição atual do download
+ * @return Codec a usar (CODEC_NONE mantém o envio direto do arquivo)
+ *
+ * Por que foi feito:
+ * - Conteúdo já comprimido (imagens, vídeos, PDFs, arquivos zip) não
+ *   diminui; uma amostra do início decide antes de gastar CPU no arquivo
+ *   inteiro e perder o sendfile
+ */
+int download_codec(session_t *s, int requested, uint64_t length) {
+    if (requested == CODEC_NONE || !(codec_supported_mask() & (1 << requested)) || length == 0 ||
+        session_codec_buffers(s) != 0) return CODEC_NONE;
+
+    size_t want = length < COMPRESS_SAMPLE ? (size_t)length : COMPRESS_SAMPLE;
+    const uint8_t *sample = s->tx_plain;
+    int64_t got;
+    if (s->tx_cache == TX_CACHE_HIT) {
+        size_t avail = download_hit_data(s, &sample);
+        got = (int64_t)(avail < want ? avail : want);
+    } else {
+        got = file_pread(s->tx.fd, s->tx_plain, want, s->tx.base + s->tx.offset);
+    }
+    if (got <= 0 || compress_looks_compressed(sample, (size_t)got, s->tx_packed)) return CODEC_NONE;
+    return requested;
+}
+
+/**
+ * Informa os codecs de compressão que cliente e servidor têm em comum
+ *
+ * @param payload Mapa de codecs do cliente (u8, bit 1 << codec)
+ */
+void codecs_negotiate(session_t *s, uint32_t request_id, const char *payload, uint64_t len) {
+    uint8_t common;
+
+    if (len != 1) {
+        session_error(s, request_id, ERR_BAD_REQUEST, "Pedido inválido.");
+        return;
+    }
+    common = (uint8_t)payload[0] & codec_supported_mask();
+    session_send_frame(s, OP_OK, 0, request_id, &common, 1);
+}
+
+/**
+ * Responde a um pedido de download e começa a enviar os quadros DATA
+ *
+ * @param name Nome mostrado no log ao fim do envio
+ * @param length Bytes a enviar a partir da posição atual de s->tx
+ * @param reply Payload do OK (tamanho e resumo)
+ */
+void download_begin(session_t *s, uint32_t request_id, const char *name, uint64_t length, int codec,
+                    const uint8_t *reply, size_t reply_len) {
+    s->downloading = 1;
+    s->tx_codec = download_codec(s, codec, length);
+    s->tx_buffered = s->tx_codec != CODEC_NONE || s->tx.mode == SEND_MODE_BUFFERED || s->tx_cache != TX_CACHE_OFF;
+    session_send_frame(s, OP_OK, FLAG_CODEC(s->tx_codec), request_id, reply, reply_len);
+
+    snprintf(s->tx_name, sizeof(s->tx_name), "%s", name);
+    s->tx_request = request_id;
+    s->tx_remaining = length;
+    s->tx_frame_left = 0;
+    s->tx_final = 0;
+    if (s->tx_buffered && s->tx_cache != TX_CACHE_HIT && reader_open(&s->reader, length, FRAME_DATA_CHUNK) != 0) {
+        printf("Sem memória para a leitura antecipada de %s.\n", s->tx_name);
+        s->tx_buffered = 0;
+        s->tx_codec = CODEC_NONE;
+        s->tx_cache = TX_CACHE_OFF;
+    }
+}
+
+/**
+ * Decide como o cache de leitura participa de um download
+ *
+ * @param version Versão do arquivo lida antes de abri-lo
+ * @param length Bytes a enviar (maior que 0)
+ * @return TX_CACHE_HIT com os blocos fixados em s->tx_blocks, TX_CACHE_FILL
+ *         se as leituras devem ser guardadas, TX_CACHE_OFF caso contrário
+ *
+ * Por que foi feito:
+ * - Arquivos pequenos entram no cache já no primeiro pedido; trechos de
+ *   arquivos grandes só no segundo (os fantasmas deixados por cache_note()
+ *   marcam o primeiro), então uma cópia avulsa de um arquivo enorme
+ *   continua no sendfile sem passar pela memória
+ * - A versão é lida antes de abrir o arquivo: se ele for trocado entre as
+ *   duas operações, os blocos lidos ficam com a versão antiga e são
+ *   descartados no próximo pedido, em vez de o contrário
+ */
+tx_cache_t download_cache_mode(session_t *s, const char *name, const cache_version_t *version,
+                        uint64_t offset, uint64_t length) {
+    uint32_t first = (uint32_t)(offset / CACHE_BLOCK);
+    uint32_t last = (uint32_t)((offset + length - 1) / CACHE_BLOCK);
+    long count = (long)(last - first) + 1;
+    int known = 0;
+
+    // Trecho maior que o cache inteiro não teria como ficar nele
+    if (config.cache_mb == 0 || length > read_cache.budget) return TX_CACHE_OFF;
+    s->tx_version = *version;
+    s->tx_block_first = first;
+    if ((s->tx_blocks = (cache_block_t **)malloc((size_t)count * sizeof(cache_block_t *))) == NULL) return TX_CACHE_OFF;
+    if (cache_pin_range(&read_cache, name, version, first, last, s->tx_blocks, &known) == 0) {
+        s->tx_block_count = count;
+        return TX_CACHE_HIT;
+    }
+    free(s->tx_blocks);
+    s->tx_blocks = NULL;
+    if (offset % CACHE_BLOCK == 0 && (version->size <= CACHE_SMALL_FILE || known)) return TX_CACHE_FILL;
+    cache_note(&read_cache, name, version, first, last);
+    return TX_CACHE_OFF;
+}
+
+/**
+ * Inicia o envio de um arquivo solicitado pelo cliente
+ *
+ * @param s Sessão do cliente
+ * @param request_id Identificador do pedido
+ * @param filename Nome do arquivo a ser enviado
+ * @param offset Primeiro byte a enviar
+ * @param length Bytes a enviar (0 = até o fim do arquivo)
+ * @param ranged 1 se o pedido veio com FLAG_RANGE
+ * @param codec Compressão pedida para os quadros DATA (FLAG_CODEC)
+ *
+ * Por que foi feito:
+ * - Permitir download de arquivos do servidor
+ * - A resposta OK leva o tamanho do arquivo; os quadros DATA seguintes são
+ *   produzidos por session_flush() no modo de envio configurado
+ * - Pedidos de intervalo permitem retomar um download interrompido ou
+ *   ler só uma parte de um arquivo grande
+ * - Arquivos descritos por manifesto são enviados bloco a bloco; o cliente
+ *   recebe os mesmos quadros que receberia de um arquivo comum
+ * - Um trecho inteiro no cache de leitura é enviado sem abrir o arquivo
+ * - Um objeto em segmento é enviado do trecho dele no segmento, pelo
+ *   mesmo caminho (sendfile, mmap ou pread) dos arquivos comuns
+ */
+void download_file(session_t *s, uint32_t request_id, char *filename,
+                   uint64_t offset, uint64_t length, int ranged, int codec) {
+    char filepath[MAX_PATH];
+    uint8_t size_payload[16 + CHECKSUM_SIZE];
+    index_entry_t found;
+    cache_version_t version;
+    segment_object_t obj;
+    uint64_t base = 0;
+    int64_t size;
+    int fd = -1;
+
+    // Arquivos fora do índice são recusados sem tocar no disco; os demais
+    // são abertos e medidos de novo (o índice pode estar atrasado)
+    if (index_lookup(&storage_index, filename, &found) != 0) {
+        session_error(s, request_id, ERR_NOT_FOUND, "Arquivo não encontrado.");
+        return;
+    }
+    if (found.source == source_packed) {
+        // Aberto junto com a consulta: continua legível se a compactação apagar o segmento
+        if ((fd = segstore_open_object(&segments, filename, &obj)) < 0) {
+            session_error(s, request_id, ERR_NOT_FOUND, "Arquivo não encontrado.");
+            return;
+        }
+        version.size = obj.size;
+        version.mtime = obj.mtime;
+        version.inode = obj.seq;
+        size = (int64_t)obj.size;
+        base = segment_object_data(&obj);
+    } else if (found.source == SOURCE_MANIFEST) {
+        if (manifest_path(filepath, filename) != 0 || manifest_load(filepath, &s->tx_manifest) != 0) {
+            session_error(s, request_id, ERR_NOT_FOUND, "Arquivo não encontrado.");
+            return;
+        }
+        size = (int64_t)s->tx_manifest.size;
+    } else if (storage_path(filepath, filename) != 0 ||
+               file_stat(filepath, &version.size, &version.mtime, &version.inode) != 0) {
+        session_error(s, request_id, ERR_NOT_FOUND, "Arquivo não encontrado.");
+        return;
+    } else {
+        size = (int64_t)version.size;
+    }
+    if (offset > (uint64_t)size) {
+        if (fd >= 0) file_close(fd);
+        manifest_free(&s->tx_manifest);
+        session_error(s, request_id, ERR_RANGE, "Posição além do fim do arquivo.");
+        return;
+    }
+    if (length == 0 || length > (uint64_t)size - offset) length = (uint64_t)size - offset;
+
+    if (s->tx_manifest.refs == NULL) {
+        s->tx_cache = length > 0 ? download_cache_mode(s, filename, &version, offset, length) : TX_CACHE_OFF;
+        if (s->tx_cache == TX_CACHE_HIT && fd >= 0) {
+            file_close(fd);
+            fd = -1;
+        } else if (s->tx_cache != TX_CACHE_HIT && fd < 0 && (fd = file_open_read(filepath)) < 0) {
+            download_cache_release(s);
+            session_error(s, request_id, ERR_NOT_FOUND, "Arquivo não encontrado.");
+            return;
+        }
+    }
+    if (s->tx_manifest.refs == NULL || length == 0) {
+        // Leituras guardadas no cache passam pela memória de qualquer forma
+        sender_open(&s->tx, fd, s->tx_cache == TX_CACHE_FILL ? SEND_MODE_BUFFERED : config.send_mode, offset);
+        s->tx.base = base;
+        s->tx_chunk_left = 0;
+    } else {
+        // Começa no bloco que contém a posição pedida
+        uint32_t first = manifest_find(&s->tx_manifest, offset);
+        if (download_open_chunk(s, first, offset - s->tx_manifest.refs[first].offset) != 0) {
+            manifest_free(&s->tx_manifest);
+            session_error(s, request_id, ERR_IO, "Bloco ausente no servidor.");
+            return;
+        }
+    }
+
+    // Resumo do arquivo inteiro, se guardado, para o cliente conferir
+    size_t reply_len = ranged ? 16 : 8;
+    sums_attach(filename, &found);
+    put_u64(size_payload, length);
+    put_u64(size_payload + 8, (uint64_t)size);
+    if (found.digest_len > 0 && found.size == (uint64_t)size) {
+        memcpy(size_payload + reply_len, found.digest, found.digest_len);
+        reply_len += found.digest_len;
+    }
+    download_begin(s, request_id, filename, length, codec, size_payload, reply_len);
+}
+
+/**
+ * Escreve uma entrada no lote de TREE_GET
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro de escrita
+ */
+int tree_pack_write(FILE *out, checksum_t *sum, const uint8_t *data, size_t len) {
+    checksum_update(sum, data, len);
+    return fwrite(data, 1, len, out) == len ? 0 : -1;
+}
+
+/**
+ * Monta em um arquivo temporário o lote pedido por TREE_GET
+ *
+ * @return 0 em caso de sucesso, ERR_IO em caso de erro
+ *
+ * Por que foi feito:
+ * - Roda nas threads de disco: abrir e ler centenas de arquivos pequenos
+ *   não segura a thread de rede; o lote pronto segue pelo envio comum
+ *   (sendfile ou compressão) como um único arquivo
+ * - Arquivos descritos por manifesto ou grandes demais vão só com os
+ *   atributos (TREE_ATTR) e o cliente os baixa à parte
+ * - Objetos em segmentos são lidos do trecho deles no segmento
+ */
+int tree_pack(void *arg) {
+    session_t *s = (session_t *)arg;
+    uint8_t head[TREE_ENTRY_HEADER + PROTO_MAX_NAME];
+    char filepath[MAX_PATH];
+    uint8_t *buf = (uint8_t *)bufpool_alloc(FRAME_DATA_CHUNK, NULL);
+    FILE *out = fopen(s->tree_temp, "wb");
+    const char *p = s->tree_names;
+    uint64_t data_bytes = 0;
+    checksum_t sum;
+    int failed = buf == NULL || out == NULL;
+
+    checksum_init(&sum);
+    s->tree_size = 0;
+    for (uint32_t i = 0; i < s->tree_count && !failed; i++) {
+        tree_entry_t e;
+        index_entry_t found;
+        size_t name_len = get_u16((const uint8_t *)p);
+        segment_object_t obj;
+        uint64_t base = 0;
+        int fd = -1;
+
+        memset(&e, 0, sizeof(e));
+        memcpy(e.name, p + 2, name_len);
+        e.name[name_len] = '\0';
+        p += 2 + name_len;
+
+        e.type = TREE_MISSING;
+        if (index_lookup(&storage_index, e.name, &found) == 0) {
+            e.type = TREE_ATTR;
+            e.size = found.size;
+            e.mtime = found.mtime;
+            e.mode = 0644;
+            if (found.source == source_packed) {
+                if ((fd = segstore_open_object(&segments, e.name, &obj)) < 0) {
+                    e.type = TREE_MISSING;
+                } else if (obj.size <= TREE_FILE_MAX && data_bytes + obj.size <= TREE_MAX_BYTES) {
+                    e.type = TREE_FILE;
+                    e.size = obj.size;
+                    e.mtime = obj.mtime;
+                    base = segment_object_data(&obj);
+                } else {
+                    file_close(fd);
+                    fd = -1;
+                }
+            } else if (found.source != SOURCE_MANIFEST && storage_path(filepath, e.name) == 0) {
+                file_get_mode(filepath, &e.mode);
+                if (file_stat(filepath, &e.size, &e.mtime, NULL) != 0) e.type = TREE_MISSING;
+                else if (e.size <= TREE_FILE_MAX && data_bytes + e.size <= TREE_MAX_BYTES &&
+                         (fd = file_open_read(filepath)) >= 0) e.type = TREE_FILE;
+            }
+        }
+
+        failed = tree_pack_write(out, &sum, head, tree_entry_encode(head, &e)) != 0;
+        for (uint64_t done = 0; fd >= 0 && !failed && done < e.size;) {
+            size_t want = e.size - done < FRAME_DATA_CHUNK ? (size_t)(e.size - done) : FRAME_DATA_CHUNK;
+            // O arquivo encolheu desde o stat(): o lote ficaria desalinhado
+            failed = file_pread(fd, buf, want, base + done) != (int64_t)want ||
+                     tree_pack_write(out, &sum, buf, want) != 0;
+            done += want;
+        }
+        if (fd >= 0) {
+            data_bytes += e.size;
+            file_close(fd);
+        }
+    }
+    if (out != NULL && (fflush(out) != 0 || ferror(out))) failed = 1;
+    if (out != NULL) {
+        s->tree_size = (uint64_t)ftell(out);
+        fclose(out);
+    }
+    checksum_final(&sum, s->tree_digest);
+    bufpool_free(buf, FRAME_DATA_CHUNK, NULL);
+    return failed ? ERR_IO : 0;
+}
+
+/**
+ * Recebe um pedido TREE_GET e entrega a montagem do lote ao disco
+ *
+ * @param payload u32 nomes + (u16 tamanho + nome) de cada um
+ */
+void tree_get(session_t *s, frame_header_t *h, const char *payload) {
+    char name[64];
+    char filename[PROTO_MAX_NAME];
+    const uint8_t *p = (const uint8_t *)payload;
+    uint64_t left = h->length;
+    uint32_t count;
+
+    if (left < 4 || (count = get_u32(p)) == 0 || count > TREE_MAX_ENTRIES) {
+        session_error(s, h->request_id, ERR_BAD_REQUEST, "Pedido inválido.");
+        return;
+    }
+    p += 4;
+    left -= 4;
+    for (uint32_t i = 0; i < count; i++) {
+        size_t len = left >= 2 ? get_u16(p) : 0;
+        if (left < 2 + (uint64_t)len || extract_name((const char *)p + 2, len, filename) != 0) {
+            session_error(s, h->request_id, ERR_BAD_REQUEST, "Nome de arquivo inválido.");
+            return;
+        }
+        p += 2 + len;
+        left -= 2 + len;
+    }
+
+    snprintf(name, sizeof(name), "tmp-%ld.batch", atomic_add_long(&upload_sequence, 1));
+    free(s->tree_names);
+    s->tree_names = (char *)malloc((size_t)h->length - 4);
+    if (s->tree_names == NULL || parts_path(s->tree_temp, name) != 0) {
+        session_error(s, h->request_id, ERR_IO, "Sem memória no servidor.");
+        return;
+    }
+    memcpy(s->tree_names, payload + 4, (size_t)h->length - 4);
+    s->tree_count = count;
+    s->tree_request = h->request_id;
+    s->tree_codec = FLAG_CODEC_OF(h->flags);
+    s->tree_packing = 1;
+    disk_call_submit(&s->commit, tree_pack, s);
+}
 
-/*--------------------------------------------------------------
- * DEFINIÇÕES DE CONSTANTES
- *------------------------------------------------------------*/
-#define PORT 8888               // Porta padrão para conexão
-#define BUFFER_SIZE 1024        // Tamanho do buffer para transferência
-#define SERVER_STORAGE "C:\\Users\\ld388\\Desktop\\SD\\server_storage" // Diretório de armazenamento
-#define MAX_CONNECTIONS 3       // Número máximo de conexões simultâneas
+/**
+ * Começa o envio do lote de TREE_GET depois que o disco o montou
+ *
+ * @return 1 se o pedido foi respondido, 0 se o lote ainda está sendo montado
+ *
+ * Por que foi feito:
+ * - O arquivo temporário é removido logo depois de aberto; o descritor
+ *   continua válido até o fim do envio e nada fica para trás se a conexão
+ *   cair (onde a remoção falha, a limpeza da inicialização cuida dele)
+ */
+int tree_send(session_t *s) {
+    uint8_t reply[8 + CHECKSUM_SIZE];
+    char label[64];
+    int error = ERR_IO;
+    int fd = -1;
 
-/*--------------------------------------------------------------
- * DECLARAÇÕES DE FUNÇÕES
- *------------------------------------------------------------*/
+    if (!disk_call_done(&s->commit, &error)) return 0;
+    s->tree_packing = 0;
+    if (error == 0) fd = file_open_read(s->tree_temp);
+    remove(s->tree_temp);
+    free(s->tree_names);
+    s->tree_names = NULL;
+    if (fd < 0) {
+        session_error(s, s->tree_request, ERR_IO, "Falha ao montar o lote.");
+        return 1;
+    }
+
+    sender_open(&s->tx, fd, config.send_mode, 0);
+    s->tx_chunk_left = 0;
+    put_u64(reply, s->tree_size);
+    memcpy(reply + 8, s->tree_digest, CHECKSUM_SIZE);
+    snprintf(label, sizeof(label), "lote de %u entradas", s->tree_count);
+    download_begin(s, s->tree_request, label, s->tree_size, s->tree_codec, reply, sizeof(reply));
+    return 1;
+}
 
 /**
- * Configura a codificação do console para suportar UTF-8 e acentos
- * 
+ * Registra a exclusão no diário e exclui o arquivo
+ *
+ * @param arg Sessão do pedido DELETE
+ * @return 0 se o arquivo foi excluído, ERR_NOT_FOUND se o nome não existia
+ *         mais, ERR_IO se o diário falhou
+ *
  * Por que foi feito:
- * - Garantir que caracteres acentuados sejam exibidos corretamente
- * - Configurar o locale para português do Brasil
+ * - Executada pela thread de disco (disk_call_t): o diário sincroniza o
+ *   disco, e no modo pack a exclusão do objeto grava o segmento
  */
-void set_console_encoding() {
-    system("chcp 65001 > nul");     // Muda a página de código para UTF-8
-    SetConsoleOutputCP(CP_UTF8);    // Configura saída do console para UTF-8
-    SetConsoleCP(CP_UTF8);          // Configura entrada do console para UTF-8
-    setlocale(LC_ALL, "Portuguese_Brazil.1252"); // Configura localização
+int delete_store(void *arg) {
+    session_t *s = (session_t *)arg;
+
+    uint64_t op = storage_journal(JOURNAL_DELETE, s->store_name, NULL);
+    if (op == 0) return ERR_IO;
+    int removed = storage_delete(s->store_name);
+    if (removed) index_update(&storage_index, s->store_name);
+    journal_end(&journal, op, s->store_name);
+    return removed ? 0 : ERR_NOT_FOUND;
 }
 
 /**
- * Cria o diretório de armazenamento do servidor se não existir
- * 
+ * Remove um arquivo do servidor
+ *
+ * @param s Sessão do cliente
+ * @param request_id Identificador do pedido
+ * @param filename Nome do arquivo a ser removido
+ *
  * Por que foi feito:
- * - Garantir que o local para armazenar arquivos exista
- * - Evitar erros ao tentar salvar arquivos recebidos
+ * - Permitir exclusão remota de arquivos
+ * - Um nome que não está no índice é recusado antes do diário, sem
+ *   custar uma sincronização do disco; os demais seguem para o estágio
+ *   de disco e a resposta sai em store_finish()
  */
-void create_storage_directory() {
-    if (_access(SERVER_STORAGE, 0) == -1) {
-        _mkdir(SERVER_STORAGE); // Cria o diretório se não existir
-        printf("Diretório de armazenamento criado: %s\n", SERVER_STORAGE);
+void delete_file(session_t *s, uint32_t request_id, char *filename) {
+    if (index_lookup(&storage_index, filename, NULL) != 0) {
+        session_error(s, request_id, ERR_NOT_FOUND, "Erro ao excluir arquivo.");
+        printf("Falha ao excluir: %s\n", filename);
+        return;
     }
+    snprintf(s->store_name, sizeof(s->store_name), "%s", filename);
+    s->store_request = request_id;
+    s->store_op = OP_DELETE;
+    disk_call_submit(&s->commit, delete_store, s);
 }
 
 /**
- * Lista arquivos disponíveis no servidor e envia ao cliente
- * 
- * @param client_socket Socket conectado ao cliente
- * 
- * Por que foi feito:
- * - Permitir que clientes vejam quais arquivos estão disponíveis
- * - Interface consistente com o cliente
- */
-void list_files(SOCKET client_socket) {
-    WIN32_FIND_DATA findFileData;  // Estrutura para dados do arquivo
-    HANDLE hFind;                  // Handle para busca
-    char file_list[BUFFER_SIZE] = {0}; // Buffer para lista de arquivos
-    char searchPath[MAX_PATH];     // Caminho para busca
-    
-    // Prepara o caminho de busca (todos os arquivos)
-    sprintf(searchPath, "%s\\*", SERVER_STORAGE);
-    
-    // Inicia a busca
-    hFind = FindFirstFile(searchPath, &findFileData);
-    
-    if (hFind == INVALID_HANDLE_VALUE) {
-        send(client_socket, "Nenhum arquivo encontrado.", 25, 0);
-        return;
-    }
-    
-    // Constrói a lista de arquivos, ignorando "." e ".."
-    do {
-        if (strcmp(findFileData.cFileName, ".") != 0 && 
-            strcmp(findFileData.cFileName, "..") != 0) {
-            strcat(file_list, findFileData.cFileName);
-            strcat(file_list, "\n"); // Separa por linhas
+ * Responde o DELETE ou UPLOAD_COMMIT quando o estágio de disco termina
+ *
+ * @return 1 se o pedido foi respondido, 0 se o disco ainda não terminou
+ *
+ * Por que foi feito:
+ * - As réplicas recebem a alteração só depois que ela está no disco local,
+ *   como nos uploads avulsos
+ */
+int store_finish(session_t *s) {
+    int error = ERR_IO;
+
+    if (!disk_call_done(&s->commit, &error)) return 0;
+    int op = s->store_op;
+    s->store_op = 0;
+
+    if (op == OP_DELETE) {
+        if (error == 0) {
+            replicate_name(s, s->store_name, 1);
+            replicate_reply(s, s->store_request, "Arquivo excluído com sucesso.");
+            printf("Arquivo excluído: %s\n", s->store_name);
+        } else if (error == ERR_NOT_FOUND) {
+            session_error(s, s->store_request, ERR_NOT_FOUND, "Erro ao excluir arquivo.");
+            printf("Falha ao excluir: %s\n", s->store_name);
+        } else {
+            session_error(s, s->store_request, ERR_IO, "Erro ao excluir arquivo.");
+            printf("Falha ao registrar a exclusão no diário: %s\n", s->store_name);
         }
-    } while (FindNextFile(hFind, &findFileData) != 0);
-    
-    FindClose(hFind); // Libera o handle de busca
-    
-    // Envia a lista para o cliente
-    send(client_socket, file_list, strlen(file_list), 0);
+        return 1;
+    }
+
+    if (error == ERR_NOT_FOUND) session_error(s, s->store_request, error, "Upload não encontrado.");
+    else if (error == ERR_RANGE) session_error(s, s->store_request, error, "Upload incompleto: faltam blocos.");
+    else if (error != 0) session_error(s, s->store_request, error, "Erro ao concluir upload.");
+    else {
+        replicate_commit(s, s->store_name, s->store_id);
+        replicate_reply(s, s->store_request, "Upload concluído com sucesso.");
+        printf("Arquivo recebido em blocos: %s (%llu bytes)\n", s->store_name, (unsigned long long)s->store_size);
+    }
+    return 1;
 }
 
 /**
- * Recebe um arquivo enviado pelo cliente e armazena no servidor
- * 
- * @param client_socket Socket conectado ao cliente
- * @param filename Nome do arquivo a ser recebido
- * 
- * Por que foi feito:
- * - Permitir upload de arquivos para o servidor
- * - Armazenar dados recebidos de forma confiável
+ * Executa um pedido (quadro de controle completo)
+ *
+ * @param s Sessão do cliente
+ * @param h Cabeçalho do quadro
+ * @param payload Payload do quadro (h->length bytes)
  */
-void upload_file(SOCKET client_socket, char *filename) {
-    char filepath[MAX_PATH];
-    // Constrói o caminho completo do arquivo
-    sprintf(filepath, "%s\\%s", SERVER_STORAGE, filename);
-    
-    // Abre o arquivo para escrita binária
-    FILE *file = fopen(filepath, "wb");
-    if (file == NULL) {
-        send(client_socket, "Erro ao criar arquivo.", 22, 0);
-        return;
-    }
-    
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-    long total_received = 0;
-    
-    // Recebe dados em chunks até a conexão ser fechada
-    while ((bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0)) > 0) {
-        fwrite(buffer, 1, bytes_received, file);
-        total_received += bytes_received;
-    }
-    
-    fclose(file);
-    // Envia confirmação para o cliente
-    send(client_socket, "Upload concluído com sucesso.", 29, 0);
-    printf("Arquivo recebido: %s (%ld bytes)\n", filename, total_received);
-}
-
-/**
- * Envia um arquivo solicitado para o cliente
- * 
- * @param client_socket Socket conectado ao cliente
- * @param filename Nome do arquivo a ser enviado
- * 
+void handle_request(session_t *s, frame_header_t *h, const char *payload) {
+    char filename[PROTO_MAX_NAME];
+
+    printf("Comando recebido de %s: %s (pedido %u)\n", s->peer, opcode_name(h->opcode), h->request_id);
+    s->req_op = h->opcode <= OP_TREE_GET && h->opcode != OP_DATA ? h->opcode : H_REQUEST_OTHER;
+    s->req_start = monotonic_ns();
+
+    switch (h->opcode) {
+        case OP_LIST:
+            // Lista arquivos disponíveis
+            list_files(s, h->request_id, payload, h->length);
+            break;
+
+        case OP_UPLOAD:
+            // Recebe upload de arquivo (dados chegam nos quadros DATA)
+            if (s->uploading) {
+                session_error(s, h->request_id, ERR_BAD_REQUEST, "Já existe um upload em andamento.");
+            } else {
+                upload_file(s, h, payload);
+            }
+            break;
+
+        case OP_DOWNLOAD: {
+            // Envia arquivo solicitado (inteiro ou um intervalo)
+            size_t fixed = (h->flags & FLAG_RANGE) ? 16 : 0;
+            if (h->length < fixed || extract_name(payload + fixed, h->length - fixed, filename) != 0) {
+                session_error(s, h->request_id, ERR_BAD_REQUEST, "Nome de arquivo inválido.");
+            } else if (fixed) {
+                download_file(s, h->request_id, filename, get_u64((const uint8_t *)payload),
+                              get_u64((const uint8_t *)payload + 8), 1, FLAG_CODEC_OF(h->flags));
+            } else {
+                download_file(s, h->request_id, filename, 0, 0, 0, FLAG_CODEC_OF(h->flags));
+            }
+            break;
+        }
+
+        case OP_DELETE:
+            if (extract_name(payload, h->length, filename) != 0) {
+                session_error(s, h->request_id, ERR_BAD_REQUEST, "Nome de arquivo inválido.");
+            } else {
+                // Remove arquivo
+                delete_file(s, h->request_id, filename);
+            }
+            break;
+
+        case OP_STAT:
+            if (extract_name(payload, h->length, filename) != 0) {
+                session_error(s, h->request_id, ERR_BAD_REQUEST, "Nome de arquivo inválido.");
+            } else {
+                // Metadados a partir do índice
+                stat_file(s, h->request_id, filename);
+            }
+            break;
+
+        case OP_UPLOAD_STATUS:
+            // Progresso de um upload retomável
+            upload_status(s, h->request_id, payload, h->length);
+            break;
+
+        case OP_UPLOAD_COMMIT:
+            // Conclusão de um upload paralelo
+            upload_finalize(s, h->request_id, payload, h->length);
+            break;
+
+        case OP_CHUNK_QUERY:
+            // Blocos que faltam no armazenamento por conteúdo
+            chunk_query(s, h->request_id, payload, h->length);
+            break;
+
+        case OP_SIGNATURES:
+            // Assinaturas para atualização por diferenças
+            delta_signatures(s, h->request_id, payload, h->length);
+            break;
+
+        case OP_DELTA:
+            // Diferenças de um arquivo (dados chegam nos quadros DATA)
+            if (s->uploading) {
+                session_error(s, h->request_id, ERR_BAD_REQUEST, "Já existe um upload em andamento.");
+            } else {
+                delta_put(s, h, payload);
+            }
+            break;
+
+        case OP_CHUNK_PUT:
+        case OP_MANIFEST_PUT:
+            // Bloco ou manifesto (dados chegam nos quadros DATA)
+            if (s->uploading) {
+                session_error(s, h->request_id, ERR_BAD_REQUEST, "Já existe um upload em andamento.");
+            } else if (h->opcode == OP_CHUNK_PUT) {
+                chunk_put(s, h, payload);
+            } else {
+                manifest_put(s, h, payload);
+            }
+            break;
+
+        case OP_TREE_PUT:
+            // Lote de arquivos pequenos (dados chegam nos quadros DATA)
+            if (s->uploading) {
+                session_error(s, h->request_id, ERR_BAD_REQUEST, "Já existe um upload em andamento.");
+            } else {
+                tree_put(s, h, payload);
+            }
+            break;
+
+        case OP_TREE_GET:
+            // Lote de arquivos pequenos montado pelo estágio de disco
+            tree_get(s, h, payload);
+            break;
+
+        case OP_CODECS:
+            // Codecs de compressão em comum
+            codecs_negotiate(s, h->request_id, payload, h->length);
+            break;
+
+        case OP_BYE:
+            // Encerra conexão com este cliente
+            printf("Cliente solicitou desconexão: %s\n", s->peer);
+            s->state = SESSION_CLOSING;
+            break;
+
+        default:
+            // Comando não reconhecido
+            session_error(s, h->request_id, ERR_UNSUPPORTED, "Comando inválido.");
+    }
+}
+
+/**
+ * Processa os quadros completos presentes no buffer de entrada
+ *
+ * @return 1 se parou porque a resposta precisa esvaziar, 2 se parou
+ *         esperando o estágio de disco, 0 se precisa de mais bytes do
+ *         cliente, -1 se o fluxo é inválido
+ *
  * Por que foi feito:
- * - Permitir download de arquivos do servidor
- * - Transferência eficiente em chunks
+ * - Um recv() pode trazer meio quadro ou vários quadros; os limites vêm
+ *   sempre do cabeçalho e nunca do tamanho de cada leitura
+ * - Payloads DATA são gravados à medida que chegam, sem precisar caber
+ *   inteiros na memória; com os buffers de escrita cheios a sessão para
+ *   de consumir a entrada até o disco alcançar a rede
  */
-void download_file(SOCKET client_socket, char *filename) {
-    char filepath[MAX_PATH];
-    // Constrói o caminho completo do arquivo
-    sprintf(filepath, "%s\\%s", SERVER_STORAGE, filename);
-    
-    // Abre o arquivo para leitura binária
-    FILE *file = fopen(filepath, "rb");
-    if (file == NULL) {
-        send(client_socket, "Arquivo não encontrado.", 23, 0);
-        return;
-    }
-    
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    
-    // Lê e envia o arquivo em chunks
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        if (send(client_socket, buffer, bytes_read, 0) == SOCKET_ERROR) {
-            printf("Erro ao enviar arquivo.\n");
+int session_process_input(session_t *s) {
+    size_t pos = 0;
+    int status = 0;
+
+    while (1) {
+        session_request_done(s);
+        if (s->upload_committing) {
+            // Respostas saem em ordem: o próximo pedido espera o upload
+            if (!upload_commit(s)) {
+                status = 2;
+                break;
+            }
+            continue;
+        }
+        if (s->tree_packing) {
+            // O lote de TREE_GET responde antes do próximo pedido
+            if (!tree_send(s)) {
+                status = 2;
+                break;
+            }
+            continue;
+        }
+        if (s->store_op != 0) {
+            // DELETE e UPLOAD_COMMIT respondem depois do disco
+            if (!store_finish(s)) {
+                status = 2;
+                break;
+            }
+            continue;
+        }
+        if (s->replicating) {
+            // A resposta de uma escrita espera o quorum das réplicas
+            if (!replicate_finish(s)) {
+                status = 2;
+                break;
+            }
+            continue;
+        }
+
+        if (s->rx_plain_pos < s->rx_plain_len) {
+            // Quadro descomprimido esperando espaço no estágio de disco
+            s->rx_plain_pos += upload_chunk(s, s->rx_plain + s->rx_plain_pos, s->rx_plain_len - s->rx_plain_pos);
+            if (s->rx_plain_pos < s->rx_plain_len) {
+                status = 2;
+                break;
+            }
+            s->rx_plain_len = s->rx_plain_pos = 0;
+            if (s->rx_flags & FLAG_END) upload_finish(s);
+            continue;
+        }
+
+        if (s->rx_active) {
+            // Dentro do payload de um quadro DATA
+            size_t avail = s->in_len - pos;
+            size_t n = avail < s->rx_left ? avail : (size_t)s->rx_left;
+            if (s->rx_flags & FLAG_COMPRESSED) {
+                pos += upload_packed_input(s, s->in + pos, n);
+                s->rx_left -= n;
+                if (s->rx_left > 0) break;
+                s->rx_active = 0;
+                if (upload_unpack(s) != 0) {
+                    printf("Quadro comprimido inválido de %s.\n", s->peer);
+                    return -1;
+                }
+                if (s->rx_plain_len == 0 && (s->rx_flags & FLAG_END)) upload_finish(s);
+                continue;
+            }
+            size_t used = upload_chunk(s, s->in + pos, n);
+            pos += used;
+            s->rx_left -= used;
+            if (used < n) {
+                status = 2;
+                break;
+            }
+            if (s->rx_left > 0) break;
+            s->rx_active = 0;
+            if (s->rx_flags & FLAG_END) upload_finish(s);
+            continue;
+        }
+
+        if (s->state == SESSION_CLOSING || session_output_blocked(s)) {
+            status = 1;
             break;
         }
+        if (s->in_len - pos < FRAME_HEADER_SIZE) break;
+
+        frame_header_t h;
+        if (frame_decode(s->in + pos, &h) != 0) {
+            printf("Quadro inválido recebido de %s.\n", s->peer);
+            return -1;
+        }
+
+        if (h.opcode == OP_DATA) {
+            // Dados só são aceitos para o upload aberto nesta sessão
+            if (!s->uploading || h.request_id != s->upload_request) {
+                printf("Quadro DATA inesperado de %s.\n", s->peer);
+                return -1;
+            }
+            if (h.flags & FLAG_DIGEST) {
+                // Resumo do pedido: encerra o upload depois da conferência
+                if (h.length != CHECKSUM_SIZE || !(h.flags & FLAG_END)) {
+                    printf("Quadro de resumo inválido de %s.\n", s->peer);
+                    return -1;
+                }
+                if (s->in_len - pos < FRAME_HEADER_SIZE + CHECKSUM_SIZE) break;
+                upload_verify(s, s->in + pos + FRAME_HEADER_SIZE);
+                pos += FRAME_HEADER_SIZE + CHECKSUM_SIZE;
+                upload_finish(s);
+                continue;
+            }
+            if ((h.flags & FLAG_COMPRESSED) &&
+                (h.length <= 4 || h.length > FRAME_DATA_CHUNK ||
+                 !(codec_supported_mask() & (1 << FLAG_CODEC_OF(h.flags))) || FLAG_CODEC_OF(h.flags) == CODEC_NONE)) {
+                printf("Quadro comprimido inválido de %s.\n", s->peer);
+                return -1;
+            }
+            pos += FRAME_HEADER_SIZE;
+            s->rx_active = 1;
+            s->rx_left = h.length;
+            s->rx_flags = h.flags;
+            continue;
+        }
+
+        // Quadro de controle: espera o payload chegar inteiro
+        if (s->in_len - pos < FRAME_HEADER_SIZE + h.length) break;
+        handle_request(s, &h, (const char *)s->in + pos + FRAME_HEADER_SIZE);
+        pos += FRAME_HEADER_SIZE + (size_t)h.length;
     }
-    
-    fclose(file);
-    printf("Arquivo enviado: %s\n", filename);
+
+    // Preserva apenas os bytes ainda não consumidos
+    memmove(s->in, s->in + pos, s->in_len - pos);
+    s->in_len -= pos;
+    return status;
 }
 
 /**
- * Remove um arquivo do servidor
- * 
- * @param client_socket Socket conectado ao cliente
- * @param filename Nome do arquivo a ser removido
- * 
+ * Consome os dados disponíveis no socket da sessão
+ *
+ * @return 0 se a sessão continua ativa, -1 se deve ser encerrada
+ *
  * Por que foi feito:
- * - Permitir exclusão remota de arquivos
- * - Feedback sobre sucesso/falha da operação
+ * - Lê apenas o que já chegou (socket não bloqueante) e para assim que a
+ *   resposta acumulada precisar ser enviada, preservando a ordem das respostas
+ * - Durante um upload a leitura respeita a cota da vez e os limites de
+ *   banda; parar de ler segura o cliente pelo controle de fluxo do TCP
  */
-void delete_file(SOCKET client_socket, char *filename) {
-    char filepath[MAX_PATH];
-    // Constrói o caminho completo do arquivo
-    sprintf(filepath, "%s\\%s", SERVER_STORAGE, filename);
-    
-    // Tenta deletar o arquivo e envia resposta apropriada
-    if (DeleteFile(filepath)) {
-        send(client_socket, "Arquivo excluído com sucesso.", 28, 0);
-        printf("Arquivo excluído: %s\n", filename);
-    } else {
-        send(client_socket, "Erro ao excluir arquivo.", 23, 0);
-        printf("Falha ao excluir: %s\n", filename);
+int session_on_readable(session_t *s) {
+    int budget = SESSION_IO_BUDGET;
+
+    while (budget-- > 0) {
+        int status = session_process_input(s);
+        if (status < 0) {
+            metrics_add(M_ERR_PROTOCOL, 1);
+            return -1;
+        }
+        s->input_blocked = (status == 1);
+        s->disk_wait = (status == 2);
+        if (s->input_blocked || s->disk_wait || s->in_len == SESSION_INPUT_SIZE) return 0;
+
+        int64_t allow = RATE_UNLIMITED;
+        if (s->uploading && (allow = session_allowance(s, RATE_UP)) == 0) return 0;
+
+        int direct = upload_receive_direct(s, allow);
+        int bytes_received = direct;
+        if (direct == -2) {
+            size_t room = SESSION_INPUT_SIZE - s->in_len;
+            if ((uint64_t)allow < room) room = (size_t)allow;
+            bytes_received = recv(s->sock, (char *)s->in + s->in_len, (int)room, 0);
+        }
+
+        // Verifica se cliente desconectou
+        if (bytes_received == 0) return -1;
+        if (bytes_received == SOCKET_ERROR) {
+            if (net_would_block(net_error())) return 0;
+            metrics_add(M_ERR_NETWORK, 1);
+            return -1;
+        }
+        metrics_add(M_NET_IN, (uint64_t)bytes_received);
+        if (s->uploading) session_account(s, RATE_UP, bytes_received);
+        if (direct == -2) s->in_len += bytes_received;
     }
+    return 0;
 }
 
-/*******************************************************************************
- * FUNÇÃO PRINCIPAL
- ******************************************************************************/
-int main() {
-    // Configura o console para suportar acentos e caracteres especiais
-    set_console_encoding();
-    
-    // Variáveis para controle do servidor
-    WSADATA wsa;                    // Estrutura para inicialização do Winsock
-    SOCKET server_socket,          // Socket principal do servidor
-           client_socket;          // Socket para comunicação com cliente
-    struct sockaddr_in server,     // Estrutura com dados do servidor
-                      client;      // Estrutura com dados do cliente
-    int client_size;               // Tamanho da estrutura do cliente
-    char buffer[BUFFER_SIZE];      // Buffer para comunicação
-    
+/**
+ * Processa os eventos entregues pelo poller para uma sessão
+ *
+ * @return 0 se a sessão deve continuar, -1 se deve ser encerrada
+ */
+int session_process(session_t *s) {
+    // Nova vez na fila: a cota cresce um quantum, sem acumular vezes ociosas
+    s->deficit = s->deficit + DRR_QUANTUM > DRR_QUANTUM ? DRR_QUANTUM : s->deficit + DRR_QUANTUM;
+    s->yielded = 0;
+    s->throttle_until = 0;
+    if (s->parked_ns != 0) {
+        metrics_record(H_DISK_WAIT, (monotonic_ns() - s->parked_ns) / 1000);
+        s->parked_ns = 0;
+    }
+
+    if (session_on_readable(s) < 0) return -1;
+    if (session_flush(s) < 0) return -1;
+    if (s->state == SESSION_CLOSING && !session_has_output(s)) return -1;
+    return 0;
+}
+
+/**
+ * Laço das threads trabalhadoras
+ *
+ * Por que foi feito:
+ * - Um número fixo de threads atende todas as sessões; cada sessão é
+ *   processada por uma única thread por vez (registro one-shot no poller)
+ */
+void *worker_main(void *arg) {
+    (void)arg;
+    while (1) {
+        session_t *s = queue_pop();
+        uint64_t start = monotonic_ns();
+        int result = session_process(s);
+        uint64_t now = monotonic_ns();
+
+        metrics_add(M_WORKER_NS, now - start);
+        if (result < 0) {
+            session_close(s);
+            continue;
+        }
+
+        // Sessão parada pelo disco: a thread de disco devolve a sessão à fila
+        if (s->disk_wait) {
+            s->disk_wait = 0;
+            s->parked_ns = now;
+            metrics_add(M_PAUSE_DISK, 1);
+            if (!session_park(s)) queue_push(s);
+            continue;
+        }
+
+        // Limite de banda esgotado: o temporizador devolve a sessão à fila
+        if (s->throttle_until != 0) {
+            metrics_add(M_PAUSE_BANDWIDTH, 1);
+            pacer_park(&pacer, s, s->throttle_until);
+            continue;
+        }
+
+        // Cota da vez esgotada com trabalho pendente: volta para o fim da fila
+        if (s->yielded) {
+            metrics_add(M_PAUSE_QUANTUM, 1);
+            queue_push(s);
+            continue;
+        }
+
+        // Resposta esvaziou com pedidos ainda no buffer: volta para a fila
+        if (s->input_blocked && !session_has_output(s)) {
+            queue_push(s);
+            continue;
+        }
+
+        // Enquanto houver resposta pendente, espera apenas por escrita
+        int interest = session_has_output(s) ? POLLER_OUT : POLLER_IN;
+        if (poller_rearm(&poller, s->sock, s, interest) != 0) {
+            session_close(s);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Aceita todas as conexões pendentes no socket de escuta
+ *
+ * Por que foi feito:
+ * - O socket de escuta é não bloqueante; aceitar em laço esvazia a fila
+ *   do backlog de uma só vez em rajadas de conexões
+ * - Conexões acima do limite configurado são recusadas explicitamente
+ */
+void accept_connections(SOCKET server_socket) {
+    while (1) {
+        struct sockaddr_in client;     // Estrutura com dados do cliente
+        socklen_t client_size = sizeof(client);
+        SOCKET client_socket = accept(server_socket, (struct sockaddr *)&client, &client_size);
+
+        if (client_socket == INVALID_SOCKET) {
+            int err = net_error();
+            if (!net_would_block(err)) {
+                printf("Erro ao aceitar conexão. Código de erro: %d\n", err);
+            }
+            return;
+        }
+
+        if (active_sessions >= config.max_connections) {
+            send(client_socket, "Servidor ocupado.", 17, 0);
+            closesocket(client_socket);
+            metrics_add(M_REJECTED, 1);
+            printf("Conexão recusada (limite de %d sessões atingido).\n", config.max_connections);
+            continue;
+        }
+
+        // A sessão junta as próprias respostas em s->out; com Nagle, o quadro
+        // que a leitura à frente entrega depois da resposta OK esperaria o
+        // ACK atrasado do cliente
+        net_set_nodelay(client_socket);
+        session_t *s = NULL;
+        if (net_set_nonblocking(client_socket) != 0 || (s = session_create(client_socket, &client)) == NULL) {
+            closesocket(client_socket);
+            continue;
+        }
+
+        atomic_add_long(&active_sessions, 1);
+        metrics_add(M_ACCEPTED, 1);
+        printf("\nConexão aceita de %s\n", s->peer);
+
+        if (poller_add(&poller, client_socket, s, POLLER_IN) != 0) {
+            session_close(s);
+        }
+    }
+}
+
+/*--------------------------------------------------------------
+ * INICIALIZAÇÃO E LAÇO DO SERVIDOR
+ *------------------------------------------------------------*/
+
+/**
+ * Lê as opções, abre o socket de escuta e inicia todas as threads
+ *
+ * @return Socket de escuta, ou INVALID_SOCKET em caso de erro
+ *
+ * Por que foi feito:
+ * - Separado de main() para que o gerador de carga (loadgen.c) rode o
+ *   mesmo servidor dentro do próprio processo, com as mesmas opções
+ */
+SOCKET server_start(int argc, char *argv[]) {
+    SOCKET server_socket;          // Socket principal do servidor
+    struct sockaddr_in server;     // Estrutura com dados do servidor
+    char sums[MAX_PATH];           // Diretório dos resumos de integridade
+    journal_recovery_t recovery;   // O que a partida reaplicou do diário
+    segment_recovery_t packed;     // O que a partida leu dos segmentos
+
+    if (parse_arguments(argc, argv) != 0) {
+        print_usage(argv[0]);
+        return INVALID_SOCKET;
+    }
+    bufpool_init((long)config.buffer_mb << 20);
+    metrics_init();
+    if (limits_reload() != 0) return INVALID_SOCKET;
+
     /*--------------------------------------------------------------
-     * INICIALIZAÇÃO DO WINSOCK
+     * INICIALIZAÇÃO DA REDE
      *------------------------------------------------------------*/
-    printf("Inicializando Winsock...\n");
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-        printf("Falha. Código de erro: %d\n", WSAGetLastError());
-        return 1;
+    printf("Inicializando rede...\n");
+    if (net_init() != 0) {
+        printf("Falha. Código de erro: %d\n", net_error());
+        return INVALID_SOCKET;
     }
     printf("Inicializado.\n");
-    
+
     /*--------------------------------------------------------------
      * CRIAÇÃO DO SOCKET DO SERVIDOR
      *------------------------------------------------------------*/
     if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET) {
-        printf("Não foi possível criar o socket: %d\n", WSAGetLastError());
-        return 1;
+        printf("Não foi possível criar o socket: %d\n", net_error());
+        return INVALID_SOCKET;
     }
+    net_set_reuseaddr(server_socket);
     printf("Socket criado.\n");
-    
+
     /*--------------------------------------------------------------
      * CONFIGURAÇÃO DO ENDEREÇO DO SERVIDOR
      *------------------------------------------------------------*/
+    memset(&server, 0, sizeof(server));
     server.sin_family = AF_INET;           // Família IPv4
     server.sin_addr.s_addr = INADDR_ANY;   // Aceita conexões de qualquer IP
-    server.sin_port = htons(PORT);         // Porta configurada
-    
+    server.sin_port = htons(config.port);  // Porta configurada
+
     /*--------------------------------------------------------------
      * VINCULAÇÃO DO SOCKET AO ENDEREÇO
      *------------------------------------------------------------*/
     if (bind(server_socket, (struct sockaddr *)&server, sizeof(server)) == SOCKET_ERROR) {
-        printf("Erro ao vincular. Código de erro: %d\n", WSAGetLastError());
-        return 1;
+        printf("Erro ao vincular. Código de erro: %d\n", net_error());
+        return INVALID_SOCKET;
     }
     printf("Vinculação concluída.\n");
-    
+
     /*--------------------------------------------------------------
      * COLOCA O SERVIDOR EM MODO DE ESCUTA
      *------------------------------------------------------------*/
-    listen(server_socket, MAX_CONNECTIONS);
-    printf("Aguardando conexões na porta %d...\n", PORT);
-    
+    listen(server_socket, config.backlog);
+    net_set_nonblocking(server_socket);
+    printf("Aguardando conexões na porta %d (backlog %d, até %d sessões)...\n",
+           config.port, config.backlog, config.max_connections);
+
     /*--------------------------------------------------------------
      * CRIA O DIRETÓRIO DE ARMAZENAMENTO
      *------------------------------------------------------------*/
     create_storage_directory();
-    
+    if (storage_path(sums, SUMS_DIR) == 0 && !path_exists(sums)) make_dir(sums);
+    index_init(&storage_index, STORAGE_INTERNAL);
+    if (config.cache_mb > 0) {
+        if (cache_init(&read_cache, (uint64_t)config.cache_mb << 20) != 0) {
+            printf("Sem memória para o cache de leitura.\n");
+            return INVALID_SOCKET;
+        }
+        index_on_change(&storage_index, cache_changed, &read_cache);
+    }
+    index_add_source(&storage_index, config.storage, NULL);
+    if (config.dedup) {
+        char manifests[MAX_PATH];
+        chunk_store_prepare(config.storage);
+        if (storage_path(manifests, MANIFESTS_DIR) != 0) {
+            printf("Diretório de armazenamento com caminho longo demais.\n");
+            return INVALID_SOCKET;
+        }
+        index_add_source(&storage_index, manifests, manifest_read_size);
+    }
+    if (config.pack) {
+        if (segstore_open(&segments, config.storage, &packed) != 0) {
+            printf("Erro ao abrir os segmentos de arquivos pequenos.\n");
+            return INVALID_SOCKET;
+        }
+        source_packed = index_add_store(&storage_index, segstore_index_lookup, segstore_index_each, &segments);
+    }
+    // O diário resolve os uploads interrompidos antes da limpeza dos temporários
+    journal_open(&journal, config.storage, &storage_index, journal_recover, &recovery);
+    prepare_parts_directory();
+    if (index_start(&storage_index) != 0) {
+        printf("Erro ao indexar o diretório de armazenamento.\n");
+        return INVALID_SOCKET;
+    }
+    if (journal_start(&journal) != 0) {
+        printf("Erro ao abrir o diário de operações.\n");
+        return INVALID_SOCKET;
+    }
+    if (recovery.snapshot) {
+        printf("Índice lido do ponto de controle: %zu arquivos, %llu registro(s) de %u diário(s) reaplicados, "
+               "%zu operação(ões) interrompida(s) resolvida(s) em %.1f ms.\n", recovery.files,
+               (unsigned long long)recovery.records, recovery.journals, recovery.resolved, recovery.ms);
+    } else if (recovery.resolved > 0) {
+        printf("Diário sem ponto de controle: %zu operação(ões) interrompida(s) resolvida(s).\n", recovery.resolved);
+    }
+    if (config.pack) {
+        if (segstore_start(&segments) != 0) {
+            printf("Erro ao iniciar a compactação dos segmentos.\n");
+            return INVALID_SOCKET;
+        }
+        printf("Segmentos: %zu objeto(s) em %zu segmento(s), %llu registro(s) lidos, %llu descartado(s) em %.1f ms.\n",
+               packed.objects, (size_t)packed.segments, (unsigned long long)packed.records,
+               (unsigned long long)packed.damaged, packed.ms);
+    }
+    if (config.dedup && chunk_gc_start(&chunk_gc, config.storage) != 0) {
+        printf("Erro ao iniciar a coleta de blocos.\n");
+        return INVALID_SOCKET;
+    }
+    index_report(&storage_index);
+    if (replica_set.count > 0) {
+        if (replica_start(&replica_set, replica_local_files, replica_local_present, storage_path) != 0) {
+            printf("Erro ao iniciar a replicação.\n");
+            return INVALID_SOCKET;
+        }
+        printf("Replicando para %d servidor(es); confirmação com %d de %d cópias.\n", replica_set.count,
+               replica_set.quorum, replica_set.count + 1);
+    }
+
     /*--------------------------------------------------------------
-     * LOOP PRINCIPAL - ACEITA CONEXÕES DE CLIENTES
+     * INICIA O MOTOR DE EVENTOS E AS THREADS TRABALHADORAS
      *------------------------------------------------------------*/
-    client_size = sizeof(struct sockaddr_in);
-    
-    while ((client_socket = accept(server_socket, (struct sockaddr *)&client, &client_size)) != INVALID_SOCKET) {
-        printf("\nConexão aceita de %s:%d\n", inet_ntoa(client.sin_addr), ntohs(client.sin_port));
-        
-        /*--------------------------------------------------------------
-         * LOOP DE COMUNICAÇÃO COM O CLIENTE
-         *------------------------------------------------------------*/
-        while (1) {
-            // Recebe comando do cliente
-            int bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-            
-            // Verifica se cliente desconectou
-            if (bytes_received <= 0) {
-                printf("Cliente desconectado.\n");
-                break;
-            }
-            
-            buffer[bytes_received] = '\0'; // Garante terminação da string
-            printf("Comando recebido: %s\n", buffer);
-            
-            /*--------------------------------------------------------------
-             * PROCESSAMENTO DE COMANDOS
-             *------------------------------------------------------------*/
-            if (strncmp(buffer, "LIST", 4) == 0) {
-                // Lista arquivos disponíveis
-                list_files(client_socket);
-            } 
-            else if (strncmp(buffer, "UPLOAD ", 7) == 0) {
-                // Recebe upload de arquivo (remove "UPLOAD " do buffer)
-                char *filename = buffer + 7;
-                upload_file(client_socket, filename);
-            } 
-            else if (strncmp(buffer, "DOWNLOAD ", 9) == 0) {
-                // Envia arquivo solicitado (remove "DOWNLOAD " do buffer)
-                char *filename = buffer + 9;
-                download_file(client_socket, filename);
-            } 
-            else if (strncmp(buffer, "DELETE ", 7) == 0) {
-                // Remove arquivo (remove "DELETE " do buffer)
-                char *filename = buffer + 7;
-                delete_file(client_socket, filename);
-            } 
-            else if (strncmp(buffer, "EXIT", 4) == 0) {
-                // Encerra conexão com este cliente
-                printf("Cliente solicitou desconexão.\n");
-                break;
-            } 
-            else {
-                // Comando não reconhecido
-                send(client_socket, "Comando inválido.", 17, 0);
-            }
+    mutex_init(&work_queue.lock);
+    mutex_init(&resumable.lock);
+    cond_init(&work_queue.ready);
+    if (poller_init(&poller) != 0 ||
+        poller_add(&poller, server_socket, &listener_tag, POLLER_IN) != 0) {
+        printf("Erro ao iniciar o poller. Código de erro: %d\n", net_error());
+        return INVALID_SOCKET;
+    }
+
+    if (disk_pool_start(&disk_pool, config.disk_threads, (long)config.disk_budget_mb << 20) != 0) {
+        printf("Erro ao criar threads de disco.\n");
+        return INVALID_SOCKET;
+    }
+
+    rate_ip_init(&rate_ips);
+    rate_bucket_init(&rate_global[RATE_DOWN], &rate_limits.kbps[RATE_GLOBAL][RATE_DOWN]);
+    rate_bucket_init(&rate_global[RATE_UP], &rate_limits.kbps[RATE_GLOBAL][RATE_UP]);
+    if (pacer_start(&pacer, session_wake) != 0) {
+        printf("Erro ao criar a thread do temporizador.\n");
+        return INVALID_SOCKET;
+    }
+    if (config.metrics_port > 0) {
+        if (metrics_http_start(config.metrics_port, metrics_render) != 0) {
+            printf("Não foi possível abrir o endpoint de métricas na porta %d.\n", config.metrics_port);
+            return INVALID_SOCKET;
         }
-        
-        /*--------------------------------------------------------------
-         * FINALIZAÇÃO DA CONEXÃO COM O CLIENTE
-         *------------------------------------------------------------*/
-        closesocket(client_socket);
+        printf("Métricas em http://127.0.0.1:%d/metrics\n", config.metrics_port);
     }
-    
+
+    for (int i = 0; i < config.workers; i++) {
+        thread_t worker;
+        if (thread_create(&worker, worker_main, NULL) != 0) {
+            printf("Erro ao criar thread trabalhadora.\n");
+            return INVALID_SOCKET;
+        }
+    }
+    printf("%d threads trabalhadoras e %d de disco iniciadas (downloads via %s, %d MB aguardando o disco, "
+           "%d MB de buffers, %d MB de cache).\n", config.workers, config.disk_threads,
+           send_mode_name(config.send_mode), config.disk_budget_mb, config.buffer_mb, config.cache_mb);
+    return server_socket;
+}
+
+/**
+ * Distribui os eventos de rede às threads trabalhadoras até um erro no poller
+ *
+ * @param server_socket Socket de escuta devolvido por server_start()
+ */
+void server_loop(SOCKET server_socket) {
+    poller_event_t events[MAX_EVENTS]; // Eventos retornados pelo poller
+    uint64_t limits_checked = 0;   // Última verificação do arquivo de limites
+    uint64_t reported = 0;         // Último relatório de métricas
+
     /*--------------------------------------------------------------
-     * TRATAMENTO DE ERROS DE ACEITAÇÃO
+     * LOOP PRINCIPAL - DISTRIBUI EVENTOS DE REDE
      *------------------------------------------------------------*/
-    if (client_socket == INVALID_SOCKET) {
-        printf("Erro ao aceitar conexão. Código de erro: %d\n", WSAGetLastError());
+    while (1) {
+        int count = poller_wait(&poller, events, MAX_EVENTS, 1000);
+        if (count < 0) {
+            printf("Erro no poller. Código de erro: %d\n", net_error());
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].ptr == &listener_tag) {
+                // Novas conexões: aceita e volta a escutar
+                accept_connections(server_socket);
+                poller_rearm(&poller, server_socket, &listener_tag, POLLER_IN);
+            } else {
+                // Atividade em uma sessão: entrega a uma thread trabalhadora
+                queue_push((session_t *)events[i].ptr);
+            }
+        }
+
+        // Arquivo de limites alterado: as novas taxas valem para as conexões abertas
+        uint64_t now = monotonic_ns();
+        if (now - limits_checked >= LIMITS_CHECK_NS) {
+            limits_checked = now;
+            limits_reload();
+        }
+
+        // Relatório periódico das métricas no console
+        if (config.report_seconds > 0) {
+            if (reported == 0) reported = now;
+            if (now - reported >= (uint64_t)config.report_seconds * 1000000000ull) {
+                metrics_report((double)(now - reported) / 1e9);
+                reported = now;
+            }
+        }
     }
-    
+
     /*--------------------------------------------------------------
      * FINALIZAÇÃO DO SERVIDOR
      *------------------------------------------------------------*/
+    poller_close(&poller);
     closesocket(server_socket);
-    WSACleanup();
+    net_cleanup();
+}
+
+#ifndef BIGFS_SERVER_NO_MAIN
+/*******************************************************************************
+ * FUNÇÃO PRINCIPAL
+ ******************************************************************************/
+int main(int argc, char *argv[]) {
+    // Configura o console para suportar acentos e caracteres especiais
+    set_console_encoding();
+
+    SOCKET server_socket = server_start(argc, argv);
+    if (server_socket == INVALID_SOCKET) return 1;
+    server_loop(server_socket);
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,247 @@
+/*******************************************************************************
+ * ENVIO DE ARQUIVOS PARA SOCKETS (CÓPIA ZERO)
+ *
+ * Descrição: Envia trechos de um arquivo para um socket escolhendo o caminho
+ *            mais barato disponível na plataforma.
+ *
+ * Modos de envio:
+ * - SENDFILE: sendfile() do Linux; os bytes vão do page cache direto para o
+ *             socket, sem passar pelo espaço do usuário
+ * - MMAP:     o arquivo é mapeado em janelas e enviado com send() a partir do
+ *             mapeamento (uma cópia a menos que read()+send())
+ * - BUFFERED: pread() para um buffer seguido de send(); usado para arquivos
+ *             que não são regulares (pipes, dispositivos) e plataformas sem
+ *             os mecanismos acima
+ *
+ * Se o modo preferido falhar com um erro de "não suportado", o envio cai para
+ * o próximo modo automaticamente, sem perder a posição no arquivo.
+ *
+ * O conteúdo enviado pode começar no meio do arquivo (base): um objeto
+ * guardado dentro de um segmento é enviado como se fosse um arquivo próprio.
+ ******************************************************************************/
+#ifndef BIGFS_TRANSFER_H
+#define BIGFS_TRANSFER_H
+
+#include "platform.h"
+#include "bufpool.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+/*--------------------------------------------------------------
+ * DEFINIÇÕES DE CONSTANTES
+ *------------------------------------------------------------*/
+#define SENDER_BUFFER_SIZE (64 * 1024)          // Buffer do modo BUFFERED
+#define SENDER_MMAP_WINDOW (64 * 1024 * 1024)   // Janela de mapeamento do modo MMAP
+
+#ifndef MSG_MORE
+#define MSG_MORE 0              // Dica de "mais dados a seguir" (só no Linux)
+#endif
+
+/**
+ * Modos de envio em ordem de preferência
+ */
+typedef enum {
+    SEND_MODE_SENDFILE = 0,
+    SEND_MODE_MMAP = 1,
+    SEND_MODE_BUFFERED = 2
+} send_mode_t;
+
+/**
+ * Estado do envio de um arquivo
+ */
+typedef struct {
+    int fd;                     // Arquivo de origem
+    send_mode_t mode;           // Modo em uso
+    uint64_t offset;            // Próximo byte do arquivo a enviar
+    uint64_t base;              // Posição do byte 0 do conteúdo no arquivo
+
+    // Modo MMAP: janela mapeada atual (posições do arquivo)
+    char *map;
+    uint64_t map_start;
+    size_t map_len;
+
+    // Modo BUFFERED: bytes lidos e ainda não enviados (posições do arquivo)
+    char *buffer;
+    uint64_t buffer_start;
+    size_t buffer_len;
+} file_sender_t;
+
+/**
+ * Nome legível de um modo de envio
+ */
+static inline const char *send_mode_name(send_mode_t mode) {
+    switch (mode) {
+        case SEND_MODE_SENDFILE: return "sendfile";
+        case SEND_MODE_MMAP: return "mmap";
+        default: return "buffer";
+    }
+}
+
+/**
+ * Converte o nome de um modo (linha de comando) no valor correspondente
+ *
+ * @return 0 em caso de sucesso, -1 se o nome é desconhecido
+ */
+static inline int send_mode_parse(const char *name, send_mode_t *mode) {
+    if (strcmp(name, "sendfile") == 0) *mode = SEND_MODE_SENDFILE;
+    else if (strcmp(name, "mmap") == 0) *mode = SEND_MODE_MMAP;
+    else if (strcmp(name, "buffer") == 0) *mode = SEND_MODE_BUFFERED;
+    else return -1;
+    return 0;
+}
+
+/**
+ * Modo mais eficiente disponível nesta plataforma
+ */
+static inline send_mode_t send_mode_default(void) {
+#if defined(__linux__)
+    return SEND_MODE_SENDFILE;
+#elif !defined(_WIN32)
+    return SEND_MODE_MMAP;
+#else
+    return SEND_MODE_BUFFERED;
+#endif
+}
+
+/**
+ * Prepara o envio de um arquivo já aberto
+ *
+ * @param fd Descritor aberto para leitura (passa a pertencer ao sender)
+ * @param preferred Modo desejado
+ * @param offset Posição inicial no arquivo
+ *
+ * Por que foi feito:
+ * - Arquivos que não são regulares e plataformas sem sendfile/mmap são
+ *   rebaixados para o modo com buffer já na abertura
+ */
+static inline void sender_open(file_sender_t *fs, int fd, send_mode_t preferred, uint64_t offset) {
+    memset(fs, 0, sizeof(*fs));
+    fs->fd = fd;
+    fs->offset = offset;
+    fs->mode = preferred;
+
+#if !defined(__linux__)
+    if (fs->mode == SEND_MODE_SENDFILE) fs->mode = SEND_MODE_MMAP;
+#endif
+#if defined(_WIN32)
+    fs->mode = SEND_MODE_BUFFERED;
+#endif
+    if (!file_is_regular(fd)) fs->mode = SEND_MODE_BUFFERED;
+}
+
+/**
+ * Libera os recursos do envio e fecha o arquivo
+ */
+static inline void sender_close(file_sender_t *fs) {
+#ifndef _WIN32
+    if (fs->map) munmap(fs->map, fs->map_len);
+#endif
+    bufpool_free(fs->buffer, SENDER_BUFFER_SIZE, NULL);
+    if (fs->fd >= 0) file_close(fs->fd);
+    fs->map = NULL;
+    fs->buffer = NULL;
+    fs->fd = -1;
+}
+
+/**
+ * Envia a partir de um buffer em memória
+ *
+ * @return Bytes enviados, 0 se o socket não aceita dados agora, -1 em erro
+ */
+static inline int64_t sender_send_memory(SOCKET s, const char *data, size_t len) {
+    int sent = send(s, data, (int)(len > 0x40000000 ? 0x40000000 : len), 0);
+    if (sent == SOCKET_ERROR) return net_would_block(net_error()) ? 0 : -1;
+    return sent;
+}
+
+/**
+ * Envia até len bytes do arquivo a partir da posição atual
+ *
+ * @param fs Estado do envio
+ * @param s Socket de destino (bloqueante ou não)
+ * @param len Máximo de bytes a enviar nesta chamada
+ * @return Bytes enviados, 0 se o socket não aceita dados agora, -1 em erro
+ *         (inclusive se o arquivo terminar antes do esperado)
+ */
+static inline int64_t sender_send(file_sender_t *fs, SOCKET s, uint64_t len) {
+    uint64_t at = fs->base + fs->offset;
+
+    if (len == 0) return 0;
+
+#ifdef __linux__
+    if (fs->mode == SEND_MODE_SENDFILE) {
+        off_t off = (off_t)at;
+        size_t want = len > 0x7ffff000 ? 0x7ffff000 : (size_t)len;
+        ssize_t sent = sendfile(s, fs->fd, &off, want);
+        if (sent > 0) {
+            fs->offset = (uint64_t)off - fs->base;
+            return sent;
+        }
+        if (sent == 0) return -1;  // Arquivo menor que o anunciado
+        if (errno == EAGAIN || errno == EINTR) return 0;
+        if (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+        fs->mode = SEND_MODE_MMAP;  // Sistema de arquivos sem suporte: próximo modo
+    }
+#endif
+
+#ifndef _WIN32
+    if (fs->mode == SEND_MODE_MMAP) {
+        // Remapeia quando a posição atual sai da janela mapeada
+        if (fs->map == NULL || at < fs->map_start || at >= fs->map_start + fs->map_len) {
+            long page = sysconf(_SC_PAGESIZE);
+            uint64_t start = at - (at % (uint64_t)page);
+            struct stat st;
+
+            if (fs->map) munmap(fs->map, fs->map_len);
+            fs->map = NULL;
+            if (fstat(fs->fd, &st) != 0) return -1;
+            if ((uint64_t)st.st_size <= at) return -1;
+
+            uint64_t avail = (uint64_t)st.st_size - start;
+            fs->map_len = (size_t)(avail < SENDER_MMAP_WINDOW ? avail : SENDER_MMAP_WINDOW);
+            fs->map_start = start;
+            void *map = mmap(NULL, fs->map_len, PROT_READ, MAP_SHARED, fs->fd, (off_t)start);
+            if (map == MAP_FAILED) {
+                fs->mode = SEND_MODE_BUFFERED;
+            } else {
+                fs->map = (char *)map;
+#ifdef MADV_SEQUENTIAL
+                madvise(fs->map, fs->map_len, MADV_SEQUENTIAL);
+#endif
+            }
+        }
+        if (fs->map != NULL) {
+            size_t in_window = (size_t)(fs->map_start + fs->map_len - at);
+            size_t want = len < in_window ? (size_t)len : in_window;
+            int64_t sent = sender_send_memory(s, fs->map + (at - fs->map_start), want);
+            if (sent > 0) fs->offset += (uint64_t)sent;
+            return sent;
+        }
+    }
+#endif
+
+    // Modo BUFFERED: lê um bloco quando o anterior foi todo enviado
+    if (fs->buffer == NULL) {
+        fs->buffer = (char *)bufpool_alloc(SENDER_BUFFER_SIZE, NULL);
+        if (fs->buffer == NULL) return -1;
+    }
+    if (at < fs->buffer_start || at >= fs->buffer_start + fs->buffer_len) {
+        size_t want = len < SENDER_BUFFER_SIZE ? (size_t)len : SENDER_BUFFER_SIZE;
+        int64_t got = file_pread(fs->fd, fs->buffer, want, at);
+        if (got <= 0) return -1;
+        fs->buffer_start = at;
+        fs->buffer_len = (size_t)got;
+    }
+    size_t in_buffer = (size_t)(fs->buffer_start + fs->buffer_len - at);
+    size_t want = len < in_buffer ? (size_t)len : in_buffer;
+    int64_t sent = sender_send_memory(s, fs->buffer + (at - fs->buffer_start), want);
+    if (sent > 0) fs->offset += (uint64_t)sent;
+    return sent;
+}
+
+#endif /* BIGFS_TRANSFER_H */